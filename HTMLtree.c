@@ -868,6 +868,9 @@ htmlNodeDumpInternal(xmlOutputBuffer *buf, xmlNode *cur,
             int isMeta = 0;
             int addMeta = 0;
 
+            if (XML_LAZY_DOC(cur->doc))
+                xmlLazyMaterialize(cur, XML_LAZY_ATTRS | XML_LAZY_CONTENT);
+
             /*
              * Some users like lxml are known to pass nodes with a corrupted
              * tree structure. Fall back to a recursive call to handle this
@@ -29,6 +29,7 @@
 #include "private/error.h"
 #include "private/parser.h"
 #include "private/tree.h"
+#include "private/valid.h"
 
 #ifndef SIZE_MAX
   #define SIZE_MAX ((size_t) -1)
@@ -260,9 +261,56 @@ xmlSAX2InternalSubset(void *ctx, const xmlChar *name,
         xmlSAX2ErrMemory(ctxt);
 }
 
+/*
+ * Check whether an external subset can be shared with other documents.
+ * Declarations in the internal subset take precedence over those in
+ * the external subset and custom handlers must see all declarations.
+ * The cache is only keyed by identifiers, so DTDs loaded by a resource
+ * loader, entity resolver or local catalog of a single context aren't
+ * shared.
+ */
+static int
+xmlSAX2CanShareDtd(xmlParserCtxtPtr ctxt) {
+    xmlDtdPtr intSubset = ctxt->myDoc->intSubset;
+    xmlSAXHandlerPtr sax = ctxt->sax;
+
+    if (((ctxt->options & XML_PARSE_DTD_CACHE) == 0) ||
+        (ctxt->options & XML_PARSE_OLDSAX) ||
+        (ctxt->myDoc->extSubset != NULL) ||
+        (ctxt->resourceLoader != NULL) ||
+        (sax->resolveEntity != xmlSAX2ResolveEntity))
+        return(0);
+#ifdef LIBXML_CATALOG_ENABLED
+    if (ctxt->catalogs != NULL)
+        return(0);
+#endif
+
+    if ((intSubset != NULL) &&
+        ((intSubset->entities != NULL) ||
+         (intSubset->pentities != NULL) ||
+         (intSubset->elements != NULL) ||
+         (intSubset->attributes != NULL) ||
+         (intSubset->notations != NULL)))
+        return(0);
+
+    return((sax->getEntity == xmlSAX2GetEntity) &&
+           (sax->getParameterEntity == xmlSAX2GetParameterEntity) &&
+           (sax->entityDecl == xmlSAX2EntityDecl) &&
+           (sax->notationDecl == xmlSAX2NotationDecl) &&
+           (sax->attributeDecl == xmlSAX2AttributeDecl) &&
+           (sax->elementDecl == xmlSAX2ElementDecl) &&
+           (sax->unparsedEntityDecl == xmlSAX2UnparsedEntityDecl));
+}
+
 /**
  * Callback on external subset declaration.
  *
+ * With XML_PARSE_DTD_CACHE, the external subset is looked up in a
+ * process-wide cache keyed by the public identifier and the resolved
+ * system identifier. Documents sharing a cached DTD must not modify
+ * it. The cache is bypassed if the context has a resource loader, a
+ * custom resolveEntity handler or local catalogs.
+ *
  * @param ctx  the user data (XML parser context)
  * @param name  the root element name
  * @param publicId  public identifier of the DTD (optional)
@@ -287,14 +335,48 @@ xmlSAX2ExternalSubset(void *ctx, const xmlChar *name,
 	xmlParserInputPtr *oldinputTab;
 	xmlParserInputPtr input = NULL;
 	xmlChar *oldencoding;
+        xmlChar *URI = NULL;
         unsigned long consumed;
         size_t buffered;
+        unsigned short nbErrors = 0, nbWarnings = 0;
+        int cacheOptions = 0;
 #ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
         int inputMax = 1;
 #else
         int inputMax = 5;
 #endif
 
+        if (xmlSAX2CanShareDtd(ctxt)) {
+            const xmlChar *base = NULL;
+            xmlDtdPtr dtd;
+
+            if (ctxt->input != NULL)
+                base = BAD_CAST ctxt->input->filename;
+            if (base == NULL)
+                base = BAD_CAST ctxt->directory;
+            if (xmlBuildURISafe(systemId, base, &URI) < 0) {
+                xmlSAX2ErrMemory(ctxt);
+                return;
+            }
+
+            cacheOptions = ctxt->options;
+            if (ctxt->validate)
+                cacheOptions |= XML_PARSE_DTDVALID;
+            if (ctxt->replaceEntities)
+                cacheOptions |= XML_PARSE_NOENT;
+
+            dtd = xmlDtdCacheLookup(publicId, URI, cacheOptions);
+            if (dtd != NULL) {
+                ctxt->myDoc->extSubset = dtd;
+                xmlCtxtAddDtdDefaults(ctxt, dtd);
+                xmlFree(URI);
+                return;
+            }
+
+            nbErrors = ctxt->nbErrors;
+            nbWarnings = ctxt->nbWarnings;
+        }
+
 	/*
 	 * Ask the Entity resolver to load the damn thing
 	 */
@@ -302,12 +384,14 @@ xmlSAX2ExternalSubset(void *ctx, const xmlChar *name,
 	    input = ctxt->sax->resolveEntity(ctxt->userData, publicId,
 	                                     systemId);
 	if (input == NULL) {
+            xmlFree(URI);
 	    return;
 	}
 
 	if (xmlNewDtd(ctxt->myDoc, name, publicId, systemId) == NULL) {
             xmlSAX2ErrMemory(ctxt);
             xmlFreeInputStream(input);
+            xmlFree(URI);
             return;
         }
 
@@ -363,7 +447,19 @@ xmlSAX2ExternalSubset(void *ctx, const xmlChar *name,
         else
             ctxt->sizeentities += consumed;
 
+        /*
+         * Only share DTDs which were parsed without any problems.
+         */
+        if ((URI != NULL) &&
+            (ctxt->nbErrors == nbErrors) &&
+            (ctxt->nbWarnings == nbWarnings) &&
+            (ctxt->wellFormed) &&
+            (!ctxt->disableSAX))
+            xmlDtdCacheAdd(ctxt->myDoc->extSubset, publicId, URI,
+                           cacheOptions);
+
 error:
+        xmlFree(URI);
 	xmlFreeInputStream(input);
         xmlFree(ctxt->inputTab);
 
@@ -824,6 +920,20 @@ xmlSAX2StartDocument(void *ctx)
 	    doc->dict = ctxt->dict;
 	    xmlDictReference(doc->dict);
 	}
+        /*
+         * The reader frees nodes while parsing, so it can't use
+         * an arena. Lazy trees store deferred content in the arena
+         * and need a dictionary for names.
+         */
+        if (((ctxt->options & XML_PARSE_ARENA) || (ctxt->lazyTree)) &&
+            (ctxt->parseMode != XML_PARSE_READER)) {
+            if (xmlDocCreateArena(doc) < 0) {
+                xmlSAX2ErrMemory(ctxt);
+                return;
+            }
+            if ((ctxt->lazyTree) && (ctxt->dictNames))
+                doc->properties |= XML_DOC_LAZY;
+        }
     }
     if ((ctxt->myDoc != NULL) && (ctxt->myDoc->URL == NULL) &&
 	(ctxt->input != NULL) && (ctxt->input->filename != NULL)) {
@@ -1791,6 +1901,8 @@ xmlSAX2TextNode(xmlParserCtxtPtr ctxt, xmlDocPtr doc, const xmlChar *str,
 	ret = ctxt->freeElems;
 	ctxt->freeElems = ret->next;
 	ctxt->freeElemsNr--;
+    } else if ((doc != NULL) && (doc->arena != NULL)) {
+        ret = xmlDocArenaAlloc(doc, sizeof(xmlNode));
     } else {
 	ret = (xmlNodePtr) xmlMalloc(sizeof(xmlNode));
     }
@@ -1818,7 +1930,8 @@ xmlSAX2TextNode(xmlParserCtxtPtr ctxt, xmlDocPtr doc, const xmlChar *str,
 	    intern = xmlDictLookup(ctxt->dict, str, len);
             if (intern == NULL) {
                 xmlSAX2ErrMemory(ctxt);
-                xmlFree(ret);
+                if (!xmlDocArenaOwns(doc, ret))
+                    xmlFree(ret);
                 return(NULL);
             }
 	} else if (IS_BLANK_CH(*str) && (len < 60) && (cur == '<') &&
@@ -1831,7 +1944,8 @@ xmlSAX2TextNode(xmlParserCtxtPtr ctxt, xmlDocPtr doc, const xmlChar *str,
 	    intern = xmlDictLookup(ctxt->dict, str, len);
             if (intern == NULL) {
                 xmlSAX2ErrMemory(ctxt);
-                xmlFree(ret);
+                if (!xmlDocArenaOwns(doc, ret))
+                    xmlFree(ret);
                 return(NULL);
             }
 	}
@@ -1842,10 +1956,14 @@ skip:
 
     ret->name = xmlStringText;
     if (intern == NULL) {
-	ret->content = xmlStrndup(str, len);
+        if ((doc != NULL) && (doc->arena != NULL))
+            ret->content = xmlDocArenaStrndup(doc, str, len);
+        else
+            ret->content = xmlStrndup(str, len);
 	if (ret->content == NULL) {
 	    xmlSAX2ErrMemory(ctxt);
-	    xmlFree(ret);
+            if (!xmlDocArenaOwns(doc, ret))
+                xmlFree(ret);
 	    return(NULL);
 	}
     } else
@@ -1931,6 +2049,13 @@ xmlSAX2AttributeNs(xmlParserCtxtPtr ctxt,
         ret = ctxt->freeAttrs;
 	ctxt->freeAttrs = ret->next;
 	ctxt->freeAttrsNr--;
+    } else if ((ctxt->node->doc != NULL) &&
+               (ctxt->node->doc->arena != NULL)) {
+        ret = xmlDocArenaAlloc(ctxt->node->doc, sizeof(*ret));
+        if (ret == NULL) {
+            xmlSAX2ErrMemory(ctxt);
+            return(NULL);
+        }
     } else {
         ret = xmlMalloc(sizeof(*ret));
         if (ret == NULL) {
@@ -2126,6 +2251,178 @@ xmlSAX2AttributeNs(xmlParserCtxtPtr ctxt,
     return(ret);
 }
 
+/*
+ * Check whether the attributes and content of a new element can be
+ * deferred. This requires a document without DTD, so there are no
+ * entities, default attributes or IDs except xml:id.
+ */
+static int
+xmlSAX2CanDefer(xmlParserCtxtPtr ctxt) {
+    xmlDocPtr doc = ctxt->myDoc;
+
+    return((ctxt->lazyTree) &&
+           (XML_LAZY_DOC(doc)) &&
+           (doc->intSubset == NULL) &&
+           (doc->extSubset == NULL) &&
+           (!ctxt->validate) &&
+           (ctxt->keepBlanks) &&
+           (ctxt->input->entity == NULL));
+}
+
+/*
+ * Returns the record of the current node if its content is deferred.
+ */
+static xmlLazyElem *
+xmlSAX2LazyParent(xmlParserCtxtPtr ctxt) {
+    xmlNodePtr parent = ctxt->node;
+    xmlLazyElem *lazy;
+
+    if ((parent == NULL) || (ctxt->inSubset != 0))
+        return(NULL);
+
+    lazy = xmlLazyLookup(parent);
+    if ((lazy == NULL) || ((lazy->flags & XML_LAZY_CONTENT) == 0))
+        return(NULL);
+
+    return(lazy);
+}
+
+/*
+ * Record the attributes of an element instead of creating the
+ * attribute nodes. Returns 1 if the attributes were deferred, 0 if
+ * they must be created and -1 if a memory allocation failed.
+ */
+static int
+xmlSAX2DeferAttributes(xmlParserCtxtPtr ctxt, xmlLazyElem *lazy,
+                       int nb_attributes, const xmlChar **attributes) {
+    xmlDocPtr doc = ctxt->myDoc;
+    int i, j;
+
+    for (j = 0, i = 0; i < nb_attributes; i++, j += 5) {
+        /* Undefined prefix */
+        if ((attributes[j+1] != NULL) && (attributes[j+2] == NULL))
+            return(0);
+        /* xml:id must be registered */
+        if ((attributes[j+1] == ctxt->str_xml) &&
+            (xmlStrEqual(attributes[j], BAD_CAST "id")))
+            return(0);
+    }
+
+    lazy->attrs = xmlDocArenaAlloc(doc, nb_attributes * sizeof(xmlLazyAttr));
+    if (lazy->attrs == NULL)
+        return(-1);
+
+    for (j = 0, i = 0; i < nb_attributes; i++, j += 5) {
+        xmlLazyAttr *attr = &lazy->attrs[i];
+        const xmlChar *prefix = attributes[j+1];
+        const xmlChar *value = attributes[j+3];
+        const xmlChar *valueend = attributes[j+4];
+
+        attr->name = attributes[j];
+        attr->ns = NULL;
+        if (prefix != NULL) {
+            attr->ns = xmlParserNsLookupSax(ctxt, prefix);
+            if ((attr->ns == NULL) && (prefix == ctxt->str_xml)) {
+                if (xmlSearchNsSafe(ctxt->node, prefix, &attr->ns) < 0)
+                    return(-1);
+            }
+        }
+
+        /* See xmlSAX2AttributeNs */
+        attr->len = valueend - value;
+        attr->parse = ((ctxt->replaceEntities == 0) && (*valueend == 0));
+        attr->value = xmlDocArenaStrndup(doc, value, attr->len);
+        if (attr->value == NULL)
+            return(-1);
+    }
+
+    lazy->nbAttrs = nb_attributes;
+    lazy->flags |= XML_LAZY_ATTRS;
+
+    return(1);
+}
+
+/*
+ * Append a deferred child node.
+ */
+static xmlLazyItem *
+xmlSAX2LazyItem(xmlParserCtxtPtr ctxt, xmlLazyElem *lazy,
+                xmlElementType type, const xmlChar *content, int len) {
+    xmlDocPtr doc = ctxt->node->doc;
+    xmlLazyItem *item;
+
+    item = xmlDocArenaAlloc(doc, sizeof(*item));
+    if (item == NULL)
+        return(NULL);
+    memset(item, 0, sizeof(*item));
+    item->type = type;
+    item->position = lazy->nbElems;
+    item->line = ctxt->input->line;
+
+    if (content != NULL) {
+        item->content = xmlDocArenaStrndup(doc, content, len);
+        if (item->content == NULL)
+            return(NULL);
+        item->len = len;
+        item->size = len + 1;
+    }
+
+    if (lazy->last == NULL)
+        lazy->first = item;
+    else
+        lazy->last->next = item;
+    lazy->last = item;
+
+    return(item);
+}
+
+/*
+ * Defer text or a CDATA section. Text is merged like in xmlSAX2Text.
+ */
+static void
+xmlSAX2LazyText(xmlParserCtxtPtr ctxt, xmlLazyElem *lazy,
+                const xmlChar *ch, int len, xmlElementType type) {
+    xmlLazyItem *item = lazy->last;
+    int maxSize = (ctxt->options & XML_PARSE_HUGE) ?
+                  XML_MAX_HUGE_LENGTH :
+                  XML_MAX_TEXT_LENGTH;
+
+    if ((type != XML_TEXT_NODE) ||
+        (item == NULL) ||
+        (item->type != XML_TEXT_NODE) ||
+        (item->position != lazy->nbElems)) {
+        if (xmlSAX2LazyItem(ctxt, lazy, type, ch, len) == NULL)
+            xmlSAX2ErrMemory(ctxt);
+        return;
+    }
+
+    if ((len > maxSize) || (item->len > maxSize - len)) {
+        xmlFatalErr(ctxt, XML_ERR_RESOURCE_LIMIT,
+                    "Text node too long, try XML_PARSE_HUGE");
+        return;
+    }
+
+    if (item->len + len >= item->size) {
+        xmlChar *content;
+        int size = item->len + len;
+
+        size = size > INT_MAX / 2 ? INT_MAX : size * 2;
+        content = xmlDocArenaAlloc(ctxt->node->doc, size);
+        if (content == NULL) {
+            xmlSAX2ErrMemory(ctxt);
+            return;
+        }
+        memcpy(content, item->content, item->len);
+        item->content = content;
+        item->size = size;
+    }
+
+    memcpy(&item->content[item->len], ch, len);
+    item->len += len;
+    item->content[item->len] = 0;
+    item->line = ctxt->input->line;
+}
+
 /**
  * SAX2 callback when an element start has been detected by the parser.
  * It provides the namespace information for the element, as well as
@@ -2156,6 +2453,7 @@ xmlSAX2StartElementNs(void *ctx,
     xmlParserCtxtPtr ctxt = (xmlParserCtxtPtr) ctx;
     xmlNodePtr ret;
     xmlNsPtr last = NULL, ns;
+    xmlLazyElem *lazy = NULL, *parentLazy;
     const xmlChar *uri, *pref;
     xmlChar *lname = NULL;
     int i, j;
@@ -2204,10 +2502,21 @@ xmlSAX2StartElementNs(void *ctx,
     /*
      * allocate the node
      */
-    if (ctxt->freeElems != NULL) {
-        ret = ctxt->freeElems;
-	ctxt->freeElems = ret->next;
-	ctxt->freeElemsNr--;
+    if ((ctxt->freeElems != NULL) ||
+        ((ctxt->myDoc != NULL) && (ctxt->myDoc->arena != NULL))) {
+        if (ctxt->freeElems != NULL) {
+            ret = ctxt->freeElems;
+            ctxt->freeElems = ret->next;
+            ctxt->freeElemsNr--;
+        } else {
+            ret = xmlDocArenaAlloc(ctxt->myDoc, sizeof(xmlNode));
+            if (ret == NULL) {
+                xmlSAX2ErrMemory(ctxt);
+                if (lname != NULL)
+                    xmlFree(lname);
+                return;
+            }
+        }
 	memset(ret, 0, sizeof(xmlNode));
         ret->doc = ctxt->myDoc;
 	ret->type = XML_ELEMENT_NODE;
@@ -2221,7 +2530,8 @@ xmlSAX2StartElementNs(void *ctx,
 	        ret->name = lname;
 	    if (ret->name == NULL) {
 	        xmlSAX2ErrMemory(ctxt);
-                xmlFree(ret);
+                if (!xmlDocArenaOwns(ctxt->myDoc, ret))
+                    xmlFree(ret);
 		return;
 	    }
 	}
@@ -2274,9 +2584,18 @@ xmlSAX2StartElementNs(void *ctx,
     }
     ctxt->nodemem = -1;
 
+    if (xmlSAX2CanDefer(ctxt)) {
+        lazy = xmlLazyCreate(ret);
+        if (lazy == NULL)
+            xmlSAX2ErrMemory(ctxt);
+    }
+
     /*
      * Link the child element
      */
+    parentLazy = xmlSAX2LazyParent(ctxt);
+    if (parentLazy != NULL)
+        parentLazy->nbElems += 1;
     xmlSAX2AppendChild(ctxt, ret);
 
     /*
@@ -2326,6 +2645,16 @@ xmlSAX2StartElementNs(void *ctx,
 	}
     }
 
+    if ((lazy != NULL) && (nb_attributes > 0)) {
+        int res = xmlSAX2DeferAttributes(ctxt, lazy, nb_attributes,
+                                         attributes);
+
+        if (res < 0)
+            xmlSAX2ErrMemory(ctxt);
+        if (res != 0)
+            nb_attributes = 0;
+    }
+
     /*
      * process all the other attributes
      */
@@ -2450,6 +2779,25 @@ xmlSAX2Reference(void *ctx, const xmlChar *name)
     xmlNodePtr ret;
 
     if (ctx == NULL) return;
+
+    /*
+     * Entity references aren't deferred. Materialize the content
+     * of the parent and continue with merging text like xmlSAX2Text.
+     */
+    if (xmlSAX2LazyParent(ctxt) != NULL) {
+        xmlNodePtr last;
+
+        if (xmlLazyMaterialize(ctxt->node, XML_LAZY_CONTENT) < 0) {
+            xmlSAX2ErrMemory(ctxt);
+            return;
+        }
+        last = ctxt->node->last;
+        if ((last != NULL) && (last->type == XML_TEXT_NODE)) {
+            ctxt->nodelen = xmlStrlen(last->content);
+            ctxt->nodemem = ctxt->nodelen + 1;
+        }
+    }
+
     ret = xmlNewReference(ctxt->myDoc, name);
     if (ret == NULL) {
         xmlSAX2ErrMemory(ctxt);
@@ -2473,6 +2821,7 @@ xmlSAX2Text(xmlParserCtxtPtr ctxt, const xmlChar *ch, int len,
 {
     xmlNodePtr lastChild;
     xmlNodePtr parent;
+    xmlLazyElem *lazy;
 
     if (ctxt == NULL)
         return;
@@ -2480,6 +2829,13 @@ xmlSAX2Text(xmlParserCtxtPtr ctxt, const xmlChar *ch, int len,
     parent = ctxt->node;
     if (parent == NULL)
         return;
+
+    lazy = xmlSAX2LazyParent(ctxt);
+    if (lazy != NULL) {
+        xmlSAX2LazyText(ctxt, lazy, ch, len, type);
+        return;
+    }
+
     lastChild = parent->last;
 
     /*
@@ -2547,12 +2903,13 @@ xmlSAX2Text(xmlParserCtxtPtr ctxt, const xmlChar *ch, int len,
                 capacity = newSize > INT_MAX / 2 ? INT_MAX : newSize * 2;
 
             /*
-             * If the content was stored in properties or in
-             * the dictionary, don't realloc.
+             * If the content was stored in properties, in the
+             * dictionary or in the document arena, don't realloc.
              */
             if ((content == (xmlChar *) &lastChild->properties) ||
                 ((ctxt->nodemem == oldSize + 1) &&
-                 (xmlDictOwns(ctxt->dict, content)))) {
+                 (xmlDictOwns(ctxt->dict, content))) ||
+                (xmlDocArenaOwns(lastChild->doc, content))) {
                 xmlChar *newContent;
 
                 newContent = xmlMalloc(capacity);
@@ -2633,9 +2990,23 @@ xmlSAX2ProcessingInstruction(void *ctx, const xmlChar *target,
 {
     xmlParserCtxtPtr ctxt = (xmlParserCtxtPtr) ctx;
     xmlNodePtr ret;
+    xmlLazyElem *lazy;
 
     if (ctx == NULL) return;
 
+    lazy = xmlSAX2LazyParent(ctxt);
+    if (lazy != NULL) {
+        xmlLazyItem *item;
+
+        item = xmlSAX2LazyItem(ctxt, lazy, XML_PI_NODE, data,
+                               data ? xmlStrlen(data) : 0);
+        if (item != NULL)
+            item->name = xmlDictLookup(ctxt->dict, target, -1);
+        if ((item == NULL) || (item->name == NULL))
+            xmlSAX2ErrMemory(ctxt);
+        return;
+    }
+
     ret = xmlNewDocPI(ctxt->myDoc, target, data);
     if (ret == NULL) {
         xmlSAX2ErrMemory(ctxt);
@@ -2656,9 +3027,18 @@ xmlSAX2Comment(void *ctx, const xmlChar *value)
 {
     xmlParserCtxtPtr ctxt = (xmlParserCtxtPtr) ctx;
     xmlNodePtr ret;
+    xmlLazyElem *lazy;
 
     if (ctx == NULL) return;
 
+    lazy = xmlSAX2LazyParent(ctxt);
+    if (lazy != NULL) {
+        if (xmlSAX2LazyItem(ctxt, lazy, XML_COMMENT_NODE, value,
+                            xmlStrlen(value)) == NULL)
+            xmlSAX2ErrMemory(ctxt);
+        return;
+    }
+
     ret = xmlNewDocComment(ctxt->myDoc, value);
     if (ret == NULL) {
         xmlSAX2ErrMemory(ctxt);
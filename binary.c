@@ -0,0 +1,1082 @@
+/*
+ * binary.c: binary snapshots of documents
+ *
+ * A snapshot stores the nodes of a document as fixed-size records
+ * together with a table of names and a blob of null-terminated
+ * strings. Loading a snapshot doesn't involve tokenizing, unescaping
+ * or transcoding, so it's mostly a sequential scan over the records.
+ *
+ * See Copyright for the status of this software.
+ */
+
+#define IN_LIBXML
+#include "libxml.h"
+
+#include <limits.h>
+#include <string.h>
+
+#include <libxml/tree.h>
+#include <libxml/xmlmemory.h>
+#include <libxml/parser.h>
+#include <libxml/parserInternals.h>
+#include <libxml/dict.h>
+#include <libxml/hash.h>
+#include <libxml/xmlIO.h>
+#include <libxml/xmlsave.h>
+
+#include "private/buf.h"
+#include "private/io.h"
+#include "private/memory.h"
+#include "private/tree.h"
+
+/*
+ * Snapshot layout, all integers are 32-bit in native byte order:
+ *
+ * - header, see XML_BIN_HDR_*
+ * - names: three text offsets per entry for the local name, the
+ *   prefix and the namespace URI. For namespace declarations, the
+ *   local name is the prefix.
+ * - node types, one byte per node, padded to a multiple of four
+ * - node names, an index into the names table
+ * - node parents, the index of the parent node which must be smaller
+ *   than the index of the node
+ * - node data, a text offset with the content of text, CDATA,
+ *   comment and PI nodes and the value of attributes
+ * - node line numbers, the attribute type of attributes
+ * - text blob
+ *
+ * Node 0 is the document node. The other nodes are stored in document
+ * order, the namespace declarations and attributes of an element
+ * immediately follow the element. Missing strings are stored as
+ * XML_BIN_NONE.
+ */
+
+#define XML_BIN_MAGIC       0x424c4d58 /* "XMLB" on little-endian */
+#define XML_BIN_VERSION     1
+#define XML_BIN_BYTE_ORDER  0x01020304
+#define XML_BIN_NONE        0xFFFFFFFFu
+
+#define XML_BIN_HDR_MAGIC       0
+#define XML_BIN_HDR_VERSION     1
+#define XML_BIN_HDR_BYTE_ORDER  2
+#define XML_BIN_HDR_NB_NODES    3
+#define XML_BIN_HDR_NB_NAMES    4
+#define XML_BIN_HDR_TEXT_SIZE   5
+#define XML_BIN_HDR_XML_VERSION 6
+#define XML_BIN_HDR_ENCODING    7
+#define XML_BIN_HDR_URL         8
+#define XML_BIN_HDR_STANDALONE  9
+#define XML_BIN_HDR_SIZE        10
+
+#define XML_BIN_PAD(n) (((n) + 3) & ~(size_t) 3)
+
+#ifdef LIBXML_OUTPUT_ENABLED
+
+/************************************************************************
+ *									*
+ *			Writing snapshots				*
+ *									*
+ ************************************************************************/
+
+/* maximum nesting of entity references */
+#define XML_BIN_MAX_ENT_DEPTH 40
+
+typedef struct {
+    unsigned nbNodes;
+    unsigned maxNodes;
+    unsigned char *types;
+    unsigned *names;
+    unsigned *parents;
+    unsigned *data;
+    unsigned *lines;
+
+    /* three text offsets per entry */
+    unsigned *nameTab;
+    unsigned nbNames;
+    unsigned maxNames;
+    xmlHashTable *nameHash;
+
+    xmlChar *text;
+    size_t textSize;
+    size_t textMax;
+} xmlBinaryWriter;
+
+static void
+xmlBinaryWriterCleanup(xmlBinaryWriter *writer) {
+    xmlFree(writer->types);
+    xmlFree(writer->names);
+    xmlFree(writer->parents);
+    xmlFree(writer->data);
+    xmlFree(writer->lines);
+    xmlFree(writer->nameTab);
+    xmlFree(writer->text);
+    if (writer->nameHash != NULL)
+        xmlHashFree(writer->nameHash, NULL);
+}
+
+/*
+ * Append a null-terminated copy of a string to the text blob.
+ */
+static unsigned
+xmlBinaryAddText(xmlBinaryWriter *writer, const xmlChar *str) {
+    size_t len, needed;
+    unsigned ret;
+
+    if (str == NULL)
+        return(XML_BIN_NONE);
+
+    len = strlen((const char *) str);
+    if (len >= XML_BIN_NONE - writer->textSize)
+        return(XML_BIN_NONE);
+    needed = writer->textSize + len + 1;
+
+    if (needed > writer->textMax) {
+        size_t newSize = writer->textMax + writer->textMax / 2;
+        xmlChar *tmp;
+
+        if (newSize < needed)
+            newSize = needed;
+        if (newSize < 4096)
+            newSize = 4096;
+        tmp = xmlRealloc(writer->text, newSize);
+        if (tmp == NULL)
+            return(XML_BIN_NONE);
+        writer->text = tmp;
+        writer->textMax = newSize;
+    }
+
+    ret = writer->textSize;
+    memcpy(writer->text + ret, str, len + 1);
+    writer->textSize = needed;
+
+    return(ret);
+}
+
+/*
+ * Intern a name triple. Returns the index or XML_BIN_NONE in case of
+ * error.
+ */
+static unsigned
+xmlBinaryAddName(xmlBinaryWriter *writer, const xmlChar *name,
+                 const xmlChar *prefix, const xmlChar *href) {
+    const xmlChar *key;
+    unsigned *entry;
+    unsigned idx;
+
+    /* The default namespace declaration has no name. */
+    key = (name != NULL) ? name : BAD_CAST "";
+
+    idx = XML_PTR_TO_INT(xmlHashLookup3(writer->nameHash, key, prefix,
+                                        href));
+    if (idx != 0)
+        return(idx - 1);
+
+    if (writer->nbNames >= writer->maxNames) {
+        unsigned *tmp;
+        int newSize;
+
+        newSize = xmlGrowCapacity(writer->maxNames, 3 * sizeof(tmp[0]),
+                                  16, XML_MAX_ITEMS);
+        if (newSize < 0)
+            return(XML_BIN_NONE);
+        tmp = xmlRealloc(writer->nameTab, newSize * 3 * sizeof(tmp[0]));
+        if (tmp == NULL)
+            return(XML_BIN_NONE);
+        writer->nameTab = tmp;
+        writer->maxNames = newSize;
+    }
+
+    idx = writer->nbNames;
+    entry = &writer->nameTab[idx * 3];
+    entry[0] = xmlBinaryAddText(writer, name);
+    entry[1] = xmlBinaryAddText(writer, prefix);
+    entry[2] = xmlBinaryAddText(writer, href);
+    if (((name != NULL) && (entry[0] == XML_BIN_NONE)) ||
+        ((prefix != NULL) && (entry[1] == XML_BIN_NONE)) ||
+        ((href != NULL) && (entry[2] == XML_BIN_NONE)))
+        return(XML_BIN_NONE);
+
+    if (xmlHashAdd3(writer->nameHash, key, prefix, href,
+                    XML_INT_TO_PTR(idx + 1)) <= 0)
+        return(XML_BIN_NONE);
+    writer->nbNames += 1;
+
+    return(idx);
+}
+
+/*
+ * Append a node record. Returns the index or XML_BIN_NONE in case of
+ * error.
+ */
+static unsigned
+xmlBinaryAddNode(xmlBinaryWriter *writer, xmlElementType type,
+                 unsigned name, unsigned parent, const xmlChar *data,
+                 unsigned line) {
+    unsigned node;
+
+    if (writer->nbNodes >= writer->maxNodes) {
+        void *tmp;
+        int newSize;
+
+        newSize = xmlGrowCapacity(writer->maxNodes, sizeof(unsigned),
+                                  256, XML_MAX_ITEMS);
+        if (newSize < 0)
+            return(XML_BIN_NONE);
+
+        tmp = xmlRealloc(writer->types, newSize);
+        if (tmp == NULL)
+            return(XML_BIN_NONE);
+        writer->types = tmp;
+        tmp = xmlRealloc(writer->names, newSize * sizeof(unsigned));
+        if (tmp == NULL)
+            return(XML_BIN_NONE);
+        writer->names = tmp;
+        tmp = xmlRealloc(writer->parents, newSize * sizeof(unsigned));
+        if (tmp == NULL)
+            return(XML_BIN_NONE);
+        writer->parents = tmp;
+        tmp = xmlRealloc(writer->data, newSize * sizeof(unsigned));
+        if (tmp == NULL)
+            return(XML_BIN_NONE);
+        writer->data = tmp;
+        tmp = xmlRealloc(writer->lines, newSize * sizeof(unsigned));
+        if (tmp == NULL)
+            return(XML_BIN_NONE);
+        writer->lines = tmp;
+
+        writer->maxNodes = newSize;
+    }
+
+    node = writer->nbNodes;
+    writer->types[node] = type;
+    writer->names[node] = name;
+    writer->parents[node] = parent;
+    writer->data[node] = xmlBinaryAddText(writer, data);
+    writer->lines[node] = line;
+    if ((data != NULL) && (writer->data[node] == XML_BIN_NONE))
+        return(XML_BIN_NONE);
+    writer->nbNodes += 1;
+
+    return(node);
+}
+
+/*
+ * Append a text node record. If the previous record is a text node
+ * with the same parent, it's the preceding sibling and the text is
+ * appended to it instead, merging the text around expanded entity
+ * references like XML_PARSE_NOENT does.
+ */
+static int
+xmlBinaryAddTextNode(xmlBinaryWriter *writer, unsigned parent,
+                     const xmlChar *content, unsigned line) {
+    unsigned prev = writer->nbNodes - 1;
+
+    if ((writer->nbNodes > 0) &&
+        (writer->types[prev] == XML_TEXT_NODE) &&
+        (writer->parents[prev] == parent)) {
+        /* Nothing was added to the text blob after the previous text */
+        writer->textSize -= 1;
+        if (xmlBinaryAddText(writer, content) == XML_BIN_NONE)
+            return(-1);
+        return(0);
+    }
+
+    if (xmlBinaryAddNode(writer, XML_TEXT_NODE, 0, parent, content,
+                         line) == XML_BIN_NONE)
+        return(-1);
+    return(0);
+}
+
+/*
+ * Add the namespace declarations and attributes of an element.
+ */
+static int
+xmlBinaryAddAttrs(xmlBinaryWriter *writer, xmlNodePtr elem, unsigned idx) {
+    xmlNsPtr ns;
+    xmlAttrPtr attr;
+    unsigned name;
+
+    for (ns = elem->nsDef; ns != NULL; ns = ns->next) {
+        name = xmlBinaryAddName(writer, ns->prefix, NULL, ns->href);
+        if ((name == XML_BIN_NONE) ||
+            (xmlBinaryAddNode(writer, XML_NAMESPACE_DECL, name, idx, NULL,
+                              0) == XML_BIN_NONE))
+            return(-1);
+    }
+
+    for (attr = elem->properties; attr != NULL; attr = attr->next) {
+        xmlChar *value = NULL;
+        const xmlChar *content;
+        unsigned node;
+
+        if (attr->ns != NULL)
+            name = xmlBinaryAddName(writer, attr->name, attr->ns->prefix,
+                                    attr->ns->href);
+        else
+            name = xmlBinaryAddName(writer, attr->name, NULL, NULL);
+        if (name == XML_BIN_NONE)
+            return(-1);
+
+        /* Avoid a copy for the common case of a single text node. */
+        if ((attr->children != NULL) &&
+            (attr->children->type == XML_TEXT_NODE) &&
+            (attr->children->next == NULL)) {
+            content = attr->children->content;
+        } else {
+            value = xmlNodeGetContent((xmlNodePtr) attr);
+            if (value == NULL)
+                return(-1);
+            content = value;
+        }
+        if (content == NULL)
+            content = BAD_CAST "";
+
+        /* Keep IDs declared in the DTD */
+        node = xmlBinaryAddNode(writer, XML_ATTRIBUTE_NODE, name, idx,
+                                content, attr->atype);
+        xmlFree(value);
+        if (node == XML_BIN_NONE)
+            return(-1);
+    }
+
+    return(0);
+}
+
+/*
+ * Add a list of sibling nodes and their descendants. The content
+ * of entity references is added in place of the reference.
+ */
+static int
+xmlBinaryAddList(xmlBinaryWriter *writer, xmlNodePtr list, xmlNodePtr top,
+                 unsigned parent, int depth) {
+    xmlNodePtr cur = list;
+    unsigned name, idx;
+
+    while (cur != NULL) {
+        xmlNodePtr descend = NULL;
+        const xmlChar *content = cur->content;
+
+        switch (cur->type) {
+            case XML_ELEMENT_NODE:
+                if (cur->ns != NULL)
+                    name = xmlBinaryAddName(writer, cur->name,
+                                            cur->ns->prefix, cur->ns->href);
+                else
+                    name = xmlBinaryAddName(writer, cur->name, NULL, NULL);
+                if (name == XML_BIN_NONE)
+                    return(-1);
+                idx = xmlBinaryAddNode(writer, XML_ELEMENT_NODE, name,
+                                       parent, NULL, cur->line);
+                if ((idx == XML_BIN_NONE) ||
+                    (xmlBinaryAddAttrs(writer, cur, idx) < 0))
+                    return(-1);
+                if (cur->children != NULL) {
+                    descend = cur->children;
+                    parent = idx;
+                }
+                break;
+
+            case XML_TEXT_NODE:
+                if (content == NULL)
+                    content = BAD_CAST "";
+                if (xmlBinaryAddTextNode(writer, parent, content,
+                                         cur->line) < 0)
+                    return(-1);
+                break;
+
+            case XML_CDATA_SECTION_NODE:
+            case XML_COMMENT_NODE:
+                if (content == NULL)
+                    content = BAD_CAST "";
+                if (xmlBinaryAddNode(writer, cur->type, 0, parent, content,
+                                     cur->line) == XML_BIN_NONE)
+                    return(-1);
+                break;
+
+            case XML_PI_NODE:
+                name = xmlBinaryAddName(writer, cur->name, NULL, NULL);
+                if ((name == XML_BIN_NONE) ||
+                    (xmlBinaryAddNode(writer, XML_PI_NODE, name, parent,
+                                      content, cur->line) == XML_BIN_NONE))
+                    return(-1);
+                break;
+
+            case XML_ENTITY_REF_NODE: {
+                xmlEntityPtr ent = (xmlEntityPtr) cur->children;
+
+                if ((ent == NULL) || (ent->type != XML_ENTITY_DECL))
+                    break;
+                if (depth >= XML_BIN_MAX_ENT_DEPTH)
+                    return(-1);
+                if ((ent->children != NULL) &&
+                    (xmlBinaryAddList(writer, ent->children,
+                                      (xmlNodePtr) ent, parent,
+                                      depth + 1) < 0))
+                    return(-1);
+                break;
+            }
+
+            default:
+                /* DTDs, XInclude markers */
+                break;
+        }
+
+        if (descend != NULL) {
+            cur = descend;
+            continue;
+        }
+
+        while ((cur->next == NULL) && (cur->parent != top)) {
+            cur = cur->parent;
+            parent = writer->parents[parent];
+        }
+        cur = cur->next;
+    }
+
+    return(0);
+}
+
+static int
+xmlBinaryWrite(xmlOutputBufferPtr buf, const void *data, size_t size) {
+    const char *ptr = data;
+
+    while (size > 0) {
+        int chunk = size > INT_MAX / 2 ? INT_MAX / 2 : size;
+
+        if (xmlOutputBufferWrite(buf, chunk, ptr) < 0)
+            return(-1);
+        ptr += chunk;
+        size -= chunk;
+    }
+
+    return(0);
+}
+
+/**
+ * Write a binary snapshot of a document which can be loaded with
+ * #xmlReadBinary or #xmlReadBinaryFile without parsing.
+ *
+ * The snapshot contains the element, text, CDATA, comment and PI
+ * nodes of the document as well as attributes, namespace
+ * declarations and line numbers. The content of entity references
+ * is stored in place of the reference and merged with adjacent text,
+ * like when parsing with XML_PARSE_NOENT. Document type declarations
+ * and XInclude markers are not stored. Lazy documents are
+ * materialized.
+ *
+ * Snapshots use the byte order of the machine they're written on
+ * and can only be read on machines with the same byte order.
+ *
+ * The output buffer must not use an encoder.
+ *
+ * @since 2.16.0
+ *
+ * @param buf  an output buffer
+ * @param doc  an XML document
+ * @returns 0 on success, -1 in case of error.
+ */
+int
+xmlSaveBinary(xmlOutputBuffer *buf, xmlDoc *doc) {
+    xmlBinaryWriter writer;
+    unsigned header[XML_BIN_HDR_SIZE];
+    unsigned char pad[4] = { 0, 0, 0, 0 };
+    int ret = -1;
+
+    if ((buf == NULL) || (buf->encoder != NULL) || (buf->error) ||
+        (doc == NULL) || (doc->type != XML_DOCUMENT_NODE))
+        return(-1);
+
+    if (xmlNodeMaterialize((xmlNodePtr) doc) < 0)
+        return(-1);
+
+    memset(&writer, 0, sizeof(writer));
+    writer.nameHash = xmlHashCreate(0);
+    if (writer.nameHash == NULL)
+        goto done;
+
+    /* Text offset 0 is the empty string */
+    if (xmlBinaryAddText(&writer, BAD_CAST "") != 0)
+        goto done;
+    if ((xmlBinaryAddName(&writer, NULL, NULL, NULL) != 0) ||
+        (xmlBinaryAddNode(&writer, XML_DOCUMENT_NODE, 0, 0, NULL,
+                          0) != 0))
+        goto done;
+
+    if (xmlBinaryAddList(&writer, doc->children, (xmlNodePtr) doc, 0,
+                         0) < 0)
+        goto done;
+
+    header[XML_BIN_HDR_MAGIC] = XML_BIN_MAGIC;
+    header[XML_BIN_HDR_VERSION] = XML_BIN_VERSION;
+    header[XML_BIN_HDR_BYTE_ORDER] = XML_BIN_BYTE_ORDER;
+    header[XML_BIN_HDR_NB_NODES] = writer.nbNodes;
+    header[XML_BIN_HDR_NB_NAMES] = writer.nbNames;
+    header[XML_BIN_HDR_XML_VERSION] = xmlBinaryAddText(&writer,
+                                                       doc->version);
+    header[XML_BIN_HDR_ENCODING] = xmlBinaryAddText(&writer, doc->encoding);
+    header[XML_BIN_HDR_URL] = xmlBinaryAddText(&writer, doc->URL);
+    header[XML_BIN_HDR_STANDALONE] = doc->standalone;
+    if (((doc->version != NULL) &&
+         (header[XML_BIN_HDR_XML_VERSION] == XML_BIN_NONE)) ||
+        ((doc->encoding != NULL) &&
+         (header[XML_BIN_HDR_ENCODING] == XML_BIN_NONE)) ||
+        ((doc->URL != NULL) &&
+         (header[XML_BIN_HDR_URL] == XML_BIN_NONE)))
+        goto done;
+    header[XML_BIN_HDR_TEXT_SIZE] = writer.textSize;
+
+    if ((xmlBinaryWrite(buf, header, sizeof(header)) < 0) ||
+        (xmlBinaryWrite(buf, writer.nameTab,
+                        (size_t) writer.nbNames * 3 * sizeof(unsigned)) < 0) ||
+        (xmlBinaryWrite(buf, writer.types, writer.nbNodes) < 0) ||
+        (xmlBinaryWrite(buf, pad,
+                        XML_BIN_PAD(writer.nbNodes) - writer.nbNodes) < 0) ||
+        (xmlBinaryWrite(buf, writer.names,
+                        (size_t) writer.nbNodes * sizeof(unsigned)) < 0) ||
+        (xmlBinaryWrite(buf, writer.parents,
+                        (size_t) writer.nbNodes * sizeof(unsigned)) < 0) ||
+        (xmlBinaryWrite(buf, writer.data,
+                        (size_t) writer.nbNodes * sizeof(unsigned)) < 0) ||
+        (xmlBinaryWrite(buf, writer.lines,
+                        (size_t) writer.nbNodes * sizeof(unsigned)) < 0) ||
+        (xmlBinaryWrite(buf, writer.text, writer.textSize) < 0))
+        goto done;
+
+    ret = 0;
+
+done:
+    xmlBinaryWriterCleanup(&writer);
+    return(ret);
+}
+
+#endif /* LIBXML_OUTPUT_ENABLED */
+
+/************************************************************************
+ *									*
+ *			Reading snapshots				*
+ *									*
+ ************************************************************************/
+
+typedef struct {
+    const xmlChar *name;
+    const xmlChar *prefix;
+    const xmlChar *href;
+} xmlBinaryName;
+
+typedef struct {
+    unsigned nbNodes;
+    unsigned nbNames;
+    unsigned textSize;
+    const unsigned char *nameTab;
+    const unsigned char *types;
+    const unsigned char *names;
+    const unsigned char *parents;
+    const unsigned char *data;
+    const unsigned char *lines;
+    const xmlChar *text;
+} xmlBinaryReader;
+
+/*
+ * The buffer isn't necessarily aligned.
+ */
+static unsigned
+xmlBinaryGet(const unsigned char *array, unsigned i) {
+    unsigned ret;
+
+    memcpy(&ret, array + (size_t) i * sizeof(unsigned), sizeof(ret));
+    return(ret);
+}
+
+static const xmlChar *
+xmlBinaryString(const xmlBinaryReader *reader, unsigned offset) {
+    if (offset == XML_BIN_NONE)
+        return(NULL);
+    return(reader->text + offset);
+}
+
+/*
+ * Check the header and the structure of the records, so the
+ * document can be built without further checks.
+ */
+static int
+xmlBinaryCheck(xmlBinaryReader *reader, const unsigned char *buffer,
+               size_t size, unsigned *header) {
+    unsigned i, nbNodes, nbNames, textSize;
+    size_t offset;
+
+    if (size < sizeof(unsigned) * XML_BIN_HDR_SIZE)
+        return(-1);
+    memcpy(header, buffer, sizeof(unsigned) * XML_BIN_HDR_SIZE);
+    if ((header[XML_BIN_HDR_MAGIC] != XML_BIN_MAGIC) ||
+        (header[XML_BIN_HDR_VERSION] != XML_BIN_VERSION) ||
+        (header[XML_BIN_HDR_BYTE_ORDER] != XML_BIN_BYTE_ORDER))
+        return(-1);
+
+    nbNodes = header[XML_BIN_HDR_NB_NODES];
+    nbNames = header[XML_BIN_HDR_NB_NAMES];
+    textSize = header[XML_BIN_HDR_TEXT_SIZE];
+    if ((nbNodes < 1) || (nbNodes > XML_MAX_ITEMS) ||
+        (nbNames < 1) || (nbNames > XML_MAX_ITEMS) ||
+        (textSize < 1) || (textSize == XML_BIN_NONE))
+        return(-1);
+
+    /* Can't overflow with at most XML_MAX_ITEMS entries */
+    offset = sizeof(unsigned) * XML_BIN_HDR_SIZE +
+             (size_t) nbNames * 3 * sizeof(unsigned) +
+             XML_BIN_PAD(nbNodes) +
+             (size_t) nbNodes * 4 * sizeof(unsigned);
+    if ((offset > size) || (size - offset != textSize))
+        return(-1);
+
+    offset = sizeof(unsigned) * XML_BIN_HDR_SIZE;
+    reader->nameTab = buffer + offset;
+    offset += (size_t) nbNames * 3 * sizeof(unsigned);
+    reader->types = buffer + offset;
+    offset += XML_BIN_PAD(nbNodes);
+    reader->names = buffer + offset;
+    offset += (size_t) nbNodes * sizeof(unsigned);
+    reader->parents = buffer + offset;
+    offset += (size_t) nbNodes * sizeof(unsigned);
+    reader->data = buffer + offset;
+    offset += (size_t) nbNodes * sizeof(unsigned);
+    reader->lines = buffer + offset;
+    offset += (size_t) nbNodes * sizeof(unsigned);
+    reader->text = buffer + offset;
+    if (reader->text[textSize - 1] != 0)
+        return(-1);
+
+    reader->nbNodes = nbNodes;
+    reader->nbNames = nbNames;
+    reader->textSize = textSize;
+
+    for (i = XML_BIN_HDR_XML_VERSION; i <= XML_BIN_HDR_URL; i++) {
+        if ((header[i] != XML_BIN_NONE) && (header[i] >= textSize))
+            return(-1);
+    }
+    for (i = 0; i < nbNames * 3; i++) {
+        unsigned str = xmlBinaryGet(reader->nameTab, i);
+
+        if ((str != XML_BIN_NONE) && (str >= textSize))
+            return(-1);
+    }
+
+    if (reader->types[0] != XML_DOCUMENT_NODE)
+        return(-1);
+
+    for (i = 1; i < nbNodes; i++) {
+        unsigned parent = xmlBinaryGet(reader->parents, i);
+        unsigned name = xmlBinaryGet(reader->names, i);
+        unsigned data = xmlBinaryGet(reader->data, i);
+        unsigned nameStr, hrefStr;
+        int type = reader->types[i];
+        int parentType, prevType;
+
+        if ((parent >= i) || (name >= nbNames) ||
+            ((data != XML_BIN_NONE) && (data >= textSize)))
+            return(-1);
+        parentType = reader->types[parent];
+        prevType = reader->types[i - 1];
+        nameStr = xmlBinaryGet(reader->nameTab, name * 3);
+        hrefStr = xmlBinaryGet(reader->nameTab, name * 3 + 2);
+
+        switch (type) {
+            case XML_ELEMENT_NODE:
+            case XML_COMMENT_NODE:
+                if ((parentType != XML_ELEMENT_NODE) &&
+                    (parentType != XML_DOCUMENT_NODE))
+                    return(-1);
+                break;
+            case XML_PI_NODE:
+                if (((parentType != XML_ELEMENT_NODE) &&
+                     (parentType != XML_DOCUMENT_NODE)) ||
+                    (nameStr == XML_BIN_NONE))
+                    return(-1);
+                break;
+            case XML_TEXT_NODE:
+            case XML_CDATA_SECTION_NODE:
+                if (parentType != XML_ELEMENT_NODE)
+                    return(-1);
+                break;
+            case XML_NAMESPACE_DECL:
+                /* Namespace declarations come first */
+                if ((parentType != XML_ELEMENT_NODE) ||
+                    ((i - 1 != parent) &&
+                     ((prevType != XML_NAMESPACE_DECL) ||
+                      (xmlBinaryGet(reader->parents, i - 1) != parent))) ||
+                    (hrefStr == XML_BIN_NONE))
+                    return(-1);
+                break;
+            case XML_ATTRIBUTE_NODE:
+                if ((parentType != XML_ELEMENT_NODE) ||
+                    ((i - 1 != parent) &&
+                     (((prevType != XML_NAMESPACE_DECL) &&
+                       (prevType != XML_ATTRIBUTE_NODE)) ||
+                      (xmlBinaryGet(reader->parents, i - 1) != parent))) ||
+                    (nameStr == XML_BIN_NONE) || (data == XML_BIN_NONE))
+                    return(-1);
+                break;
+            default:
+                return(-1);
+        }
+
+        if ((type == XML_ELEMENT_NODE) && (nameStr == XML_BIN_NONE))
+            return(-1);
+        if (((type == XML_TEXT_NODE) || (type == XML_CDATA_SECTION_NODE) ||
+             (type == XML_COMMENT_NODE)) &&
+            (data == XML_BIN_NONE))
+            return(-1);
+    }
+
+    return(0);
+}
+
+static xmlNodePtr
+xmlBinaryNewNode(xmlDocPtr doc, xmlElementType type, const xmlChar *name,
+                 const xmlChar *content, unsigned line) {
+    xmlNodePtr cur;
+
+    if (doc->arena != NULL)
+        cur = xmlDocArenaAlloc(doc, sizeof(xmlNode));
+    else
+        cur = xmlMalloc(sizeof(xmlNode));
+    if (cur == NULL)
+        return(NULL);
+    memset(cur, 0, sizeof(xmlNode));
+    cur->type = type;
+    cur->doc = doc;
+    cur->name = name;
+    cur->line = line > 65535 ? 65535 : line;
+
+    if (content != NULL) {
+        int len = strlen((const char *) content);
+
+        if (doc->arena != NULL)
+            cur->content = xmlDocArenaStrndup(doc, content, len);
+        else
+            cur->content = xmlStrndup(content, len);
+        if (cur->content == NULL) {
+            if (doc->arena == NULL)
+                xmlFree(cur);
+            return(NULL);
+        }
+    }
+
+    if ((xmlRegisterCallbacks) && (xmlRegisterNodeDefaultValue))
+	xmlRegisterNodeDefaultValue(cur);
+    return(cur);
+}
+
+/*
+ * Find or create the namespace of an element or attribute.
+ */
+static int
+xmlBinaryGetNs(xmlNodePtr elem, const xmlBinaryName *entry, xmlNsPtr *out) {
+    xmlNsPtr ns;
+
+    *out = NULL;
+    if (entry->href == NULL)
+        return(0);
+
+    if (xmlSearchNsSafe(elem, entry->prefix, &ns) < 0)
+        return(-1);
+    if ((ns == NULL) || (!xmlStrEqual(ns->href, entry->href))) {
+        ns = xmlNewNs(elem, entry->href, entry->prefix);
+        if (ns == NULL)
+            return(-1);
+    }
+
+    *out = ns;
+    return(0);
+}
+
+/*
+ * Append an attribute to an element. `atype` is XML_ATTRIBUTE_ID for
+ * attributes which were IDs in the original document.
+ */
+static int
+xmlBinaryNewAttr(xmlNodePtr elem, const xmlBinaryName *entry,
+                 const xmlChar *value, unsigned atype, xmlAttrPtr *last) {
+    xmlDocPtr doc = elem->doc;
+    xmlAttrPtr attr;
+    xmlNodePtr text;
+    xmlNsPtr ns;
+
+    if (xmlBinaryGetNs(elem, entry, &ns) < 0)
+        return(-1);
+
+    if (doc->arena != NULL)
+        attr = xmlDocArenaAlloc(doc, sizeof(xmlAttr));
+    else
+        attr = xmlMalloc(sizeof(xmlAttr));
+    if (attr == NULL)
+        return(-1);
+    memset(attr, 0, sizeof(xmlAttr));
+    attr->type = XML_ATTRIBUTE_NODE;
+    attr->name = entry->name;
+    attr->ns = ns;
+    attr->parent = elem;
+    attr->doc = doc;
+
+    if ((xmlRegisterCallbacks) && (xmlRegisterNodeDefaultValue))
+        xmlRegisterNodeDefaultValue((xmlNodePtr) attr);
+
+    if (*last == NULL) {
+        elem->properties = attr;
+    } else {
+        (*last)->next = attr;
+        attr->prev = *last;
+    }
+    *last = attr;
+
+    text = xmlBinaryNewNode(doc, XML_TEXT_NODE, xmlStringText, value, 0);
+    if (text == NULL)
+        return(-1);
+    text->parent = (xmlNodePtr) attr;
+    attr->children = text;
+    attr->last = text;
+
+    if ((atype == XML_ATTRIBUTE_ID) || (xmlIsID(doc, elem, attr) == 1)) {
+        if (xmlAddIDSafe(attr, value) < 0)
+            return(-1);
+    }
+
+    return(0);
+}
+
+static xmlDocPtr
+xmlBinaryBuild(const xmlBinaryReader *reader, const unsigned *header,
+               int options) {
+    xmlDocPtr doc;
+    xmlDictPtr dict;
+    xmlBinaryName *nameTab = NULL;
+    xmlNodePtr *nodes = NULL;
+    xmlNodePtr pending = NULL;
+    const xmlBinaryName *pendingName = NULL;
+    xmlAttrPtr lastAttr = NULL;
+    unsigned i;
+
+    doc = xmlNewDoc(xmlBinaryString(reader, header[XML_BIN_HDR_XML_VERSION]));
+    if (doc == NULL)
+        return(NULL);
+    doc->standalone = (int) header[XML_BIN_HDR_STANDALONE];
+    doc->parseFlags = options;
+
+    if (header[XML_BIN_HDR_ENCODING] != XML_BIN_NONE) {
+        doc->encoding = xmlStrdup(xmlBinaryString(reader,
+                                  header[XML_BIN_HDR_ENCODING]));
+        if (doc->encoding == NULL)
+            goto error;
+    }
+    if (header[XML_BIN_HDR_URL] != XML_BIN_NONE) {
+        doc->URL = xmlStrdup(xmlBinaryString(reader,
+                             header[XML_BIN_HDR_URL]));
+        if (doc->URL == NULL)
+            goto error;
+    }
+
+    dict = xmlDictCreate();
+    if (dict == NULL)
+        goto error;
+    doc->dict = dict;
+
+    if ((options & XML_PARSE_ARENA) && (xmlDocCreateArena(doc) < 0))
+        goto error;
+
+    /* Intern every name once */
+    nameTab = xmlMalloc(reader->nbNames * sizeof(nameTab[0]));
+    if (nameTab == NULL)
+        goto error;
+    for (i = 0; i < reader->nbNames; i++) {
+        const xmlChar *name, *prefix;
+
+        name = xmlBinaryString(reader, xmlBinaryGet(reader->nameTab, i * 3));
+        prefix = xmlBinaryString(reader,
+                                 xmlBinaryGet(reader->nameTab, i * 3 + 1));
+        nameTab[i].href = xmlBinaryString(reader,
+                                  xmlBinaryGet(reader->nameTab, i * 3 + 2));
+        if (name != NULL) {
+            name = xmlDictLookup(dict, name, -1);
+            if (name == NULL)
+                goto error;
+        }
+        if (prefix != NULL) {
+            prefix = xmlDictLookup(dict, prefix, -1);
+            if (prefix == NULL)
+                goto error;
+        }
+        nameTab[i].name = name;
+        nameTab[i].prefix = prefix;
+    }
+
+    nodes = xmlMalloc(reader->nbNodes * sizeof(nodes[0]));
+    if (nodes == NULL)
+        goto error;
+    nodes[0] = (xmlNodePtr) doc;
+
+    /*
+     * Every node is linked into the tree right away, so the document
+     * can simply be freed in case of error.
+     */
+    for (i = 1; i < reader->nbNodes; i++) {
+        const xmlBinaryName *entry;
+        xmlNodePtr parent, cur;
+        const xmlChar *content;
+        unsigned data;
+        int type = reader->types[i];
+
+        parent = nodes[xmlBinaryGet(reader->parents, i)];
+        entry = &nameTab[xmlBinaryGet(reader->names, i)];
+        data = xmlBinaryGet(reader->data, i);
+        content = xmlBinaryString(reader, data);
+        nodes[i] = NULL;
+
+        /*
+         * Resolve the namespace of the last element after its
+         * namespace declarations were added.
+         */
+        if ((pending != NULL) && (type != XML_NAMESPACE_DECL)) {
+            if (xmlBinaryGetNs(pending, pendingName, &pending->ns) < 0)
+                goto error;
+            pending = NULL;
+        }
+
+        switch (type) {
+            case XML_NAMESPACE_DECL:
+                if (xmlNewNs(parent, entry->href, entry->name) == NULL)
+                    goto error;
+                continue;
+
+            case XML_ATTRIBUTE_NODE:
+                if (xmlBinaryNewAttr(parent, entry, content,
+                                     xmlBinaryGet(reader->lines, i),
+                                     &lastAttr) < 0)
+                    goto error;
+                continue;
+
+            case XML_TEXT_NODE:
+                cur = xmlBinaryNewNode(doc, XML_TEXT_NODE, xmlStringText,
+                                       content,
+                                       xmlBinaryGet(reader->lines, i));
+                break;
+            case XML_CDATA_SECTION_NODE:
+                cur = xmlBinaryNewNode(doc, XML_CDATA_SECTION_NODE, NULL,
+                                       content,
+                                       xmlBinaryGet(reader->lines, i));
+                break;
+            case XML_COMMENT_NODE:
+                cur = xmlBinaryNewNode(doc, XML_COMMENT_NODE,
+                                       xmlStringComment, content,
+                                       xmlBinaryGet(reader->lines, i));
+                break;
+            case XML_PI_NODE:
+                cur = xmlBinaryNewNode(doc, XML_PI_NODE, entry->name,
+                                       content,
+                                       xmlBinaryGet(reader->lines, i));
+                break;
+            default:
+                cur = xmlBinaryNewNode(doc, XML_ELEMENT_NODE, entry->name,
+                                       NULL,
+                                       xmlBinaryGet(reader->lines, i));
+                pending = cur;
+                pendingName = entry;
+                lastAttr = NULL;
+                break;
+        }
+        if (cur == NULL)
+            goto error;
+
+        cur->parent = parent;
+        if (parent->last == NULL) {
+            parent->children = cur;
+        } else {
+            parent->last->next = cur;
+            cur->prev = parent->last;
+        }
+        parent->last = cur;
+        nodes[i] = cur;
+    }
+
+    if ((pending != NULL) &&
+        (xmlBinaryGetNs(pending, pendingName, &pending->ns) < 0))
+        goto error;
+
+    xmlFree(nodes);
+    xmlFree(nameTab);
+    return(doc);
+
+error:
+    xmlFree(nodes);
+    xmlFree(nameTab);
+    xmlFreeDoc(doc);
+    return(NULL);
+}
+
+/**
+ * Load a document from a binary snapshot written with
+ * #xmlSaveBinary. The buffer isn't referenced after the function
+ * returns, so it can be a temporary memory mapping of a file.
+ *
+ * The structure of the snapshot is checked but the content isn't
+ * parsed, so names and text aren't checked for well-formedness.
+ * Snapshots should only be read from trusted sources.
+ *
+ * XML_PARSE_ARENA is the only supported parser option.
+ *
+ * @since 2.16.0
+ *
+ * @param buffer  the snapshot
+ * @param size  size of the snapshot in bytes
+ * @param options  a combination of xmlParserOption
+ * @returns the document or NULL if the snapshot is invalid or a
+ * memory allocation failed.
+ */
+xmlDoc *
+xmlReadBinary(const char *buffer, size_t size, int options) {
+    xmlBinaryReader reader;
+    unsigned header[XML_BIN_HDR_SIZE];
+
+    if (buffer == NULL)
+        return(NULL);
+
+    xmlInitParser();
+
+    if (xmlBinaryCheck(&reader, (const unsigned char *) buffer, size,
+                       header) < 0)
+        return(NULL);
+
+    return(xmlBinaryBuild(&reader, header, options));
+}
+
+/**
+ * Load a document from a binary snapshot file written with
+ * #xmlSaveBinary. Large files are memory-mapped if possible.
+ *
+ * See #xmlReadBinary for details.
+ *
+ * @since 2.16.0
+ *
+ * @param filename  a file or URL
+ * @param options  a combination of xmlParserOption
+ * @returns the document or NULL in case of error.
+ */
+xmlDoc *
+xmlReadBinaryFile(const char *filename, int options) {
+    xmlParserInputBufferPtr buf;
+    xmlDocPtr doc = NULL;
+    int res;
+
+    if (xmlParserInputBufferCreateUrl(filename, XML_CHAR_ENCODING_NONE, 0,
+                                      &buf) != XML_ERR_OK)
+        return(NULL);
+
+    do {
+        res = xmlParserInputBufferGrow(buf, 64 * 1024);
+    } while (res > 0);
+
+    if (res == 0)
+        doc = xmlReadBinary((const char *) xmlBufContent(buf->buffer),
+                            xmlBufUse(buf->buffer), options);
+
+    xmlFreeParserInputBuffer(buf);
+    return(doc);
+}
@@ -19,6 +19,10 @@
 #include <libxml/tree.h>
 #include <libxml/parser.h>
 #include <libxml/uri.h>
+#include <libxml/hash.h>
+#ifdef LIBXML_READER_ENABLED
+#include <libxml/xmlreader.h>
+#endif
 #include <libxml/xmlerror.h>
 #include <libxml/xpathInternals.h>
 #include <libxml/c14n.h>
@@ -46,8 +50,26 @@ typedef struct _xmlC14NVisibleNsStack {
     int nsMax;              /* size of the array as allocated */
     xmlNsPtr	*nsTab;	    /* array of ns in no particular order */
     xmlNodePtr	*nodeTab;   /* array of nodes in no particular order */
+    int		*prevTab;   /* previous entry with the same prefix or -1 */
+    xmlHashTablePtr prefixes; /* prefix -> index + 1 of the topmost entry */
 } xmlC14NVisibleNsStack, *xmlC14NVisibleNsStackPtr;
 
+/*
+ * Hash set of the nodes in an XPath node set. Namespace nodes are
+ * copies keyed on their parent element and prefix, see xpath.c.
+ */
+typedef struct {
+    const void *key;        /* the node or the parent of a namespace node */
+    const xmlChar *prefix;  /* prefix of a namespace node */
+    int isNs;
+} xmlC14NNodeSetEntry;
+
+typedef struct {
+    xmlC14NNodeSetEntry *table;
+    size_t mask;
+    int shift;
+} xmlC14NNodeSetIndex, *xmlC14NNodeSetIndexPtr;
+
 typedef struct _xmlC14NCtx {
     /* input parameters */
     xmlDocPtr doc;
@@ -67,6 +89,9 @@ typedef struct _xmlC14NCtx {
     /* exclusive canonicalization */
     xmlChar **inclusive_ns_prefixes;
 
+    /* index of the node set if the input is an XPath node set */
+    xmlC14NNodeSetIndexPtr nodes_index;
+
     /* error number */
     int error;
 } xmlC14NCtx, *xmlC14NCtxPtr;
@@ -90,6 +115,9 @@ static int			xmlExcC14NVisibleNsStackFind	(xmlC14NVisibleNsStackPtr cur,
 static int			xmlC14NIsNodeInNodeset		(void *user_data,
 								 xmlNodePtr node,
 								 xmlNodePtr parent);
+static int			xmlC14NIsNodeInIndex		(void *user_data,
+								 xmlNodePtr node,
+								 xmlNodePtr parent);
 
 
 
@@ -268,6 +296,145 @@ xmlC14NIsNodeInNodeset(void *user_data, xmlNodePtr node, xmlNodePtr parent) {
     return(1);
 }
 
+/*
+ * Fibonacci hashing of a node address, mixed with the prefix of
+ * namespace nodes.
+ */
+static size_t
+xmlC14NNodeSetHash(xmlC14NNodeSetIndexPtr index, const void *key,
+                   const xmlChar *prefix) {
+    uint64_t h = (uint64_t) XML_PTR_TO_INT(key);
+
+    if (prefix != NULL) {
+        while (*prefix != 0)
+            h = h * 31 + *prefix++;
+    }
+
+    return((size_t) ((h * 0x9E3779B97F4A7C15ull) >> index->shift));
+}
+
+static void
+xmlC14NNodeSetIndexFree(xmlC14NNodeSetIndexPtr index) {
+    if (index == NULL)
+        return;
+    xmlFree(index->table);
+    xmlFree(index);
+}
+
+/**
+ * Build a hash set of the nodes in a node set.
+ *
+ * @param nodes  the node set
+ * @returns the index or NULL if a memory allocation failed.
+ */
+static xmlC14NNodeSetIndexPtr
+xmlC14NNodeSetIndexCreate(xmlNodeSetPtr nodes) {
+    xmlC14NNodeSetIndexPtr index;
+    size_t size = 16;
+    int shift = 60;
+    int i;
+
+    index = xmlMalloc(sizeof(*index));
+    if (index == NULL)
+        return(NULL);
+
+    /* Keep the load factor at or below 50% */
+    while (size < (size_t) nodes->nodeNr * 2) {
+        size *= 2;
+        shift--;
+    }
+    index->table = xmlMalloc(size * sizeof(index->table[0]));
+    if (index->table == NULL) {
+        xmlFree(index);
+        return(NULL);
+    }
+    memset(index->table, 0, size * sizeof(index->table[0]));
+    index->mask = size - 1;
+    index->shift = shift;
+
+    for (i = 0; i < nodes->nodeNr; i++) {
+        xmlNodePtr node = nodes->nodeTab[i];
+        xmlC14NNodeSetEntry *entry;
+        const xmlChar *prefix = NULL;
+        const void *key = node;
+        int isNs = 0;
+        size_t h;
+
+        if (node == NULL)
+            continue;
+        if (node->type == XML_NAMESPACE_DECL) {
+            xmlNsPtr ns = (xmlNsPtr) node;
+
+            /* Namespace nodes without parent never match a copy */
+            if (ns->next == NULL)
+                continue;
+            key = ns->next;
+            prefix = ns->prefix;
+            isNs = 1;
+        }
+
+        h = xmlC14NNodeSetHash(index, key, prefix);
+        while (1) {
+            entry = &index->table[h];
+            if (entry->key == NULL) {
+                entry->key = key;
+                entry->prefix = prefix;
+                entry->isNs = isNs;
+                break;
+            }
+            if ((entry->key == key) && (entry->isNs == isNs) &&
+                ((!isNs) || (xmlStrEqual(entry->prefix, prefix))))
+                break;
+            h = (h + 1) & index->mask;
+        }
+    }
+
+    return(index);
+}
+
+/**
+ * Replacement for xmlC14NIsNodeInNodeset using a hash set.
+ *
+ * @param user_data  the node set index
+ * @param node  the node
+ * @param parent  the parent node
+ * @returns 1 if the node is in the node set, 0 otherwise.
+ */
+static int
+xmlC14NIsNodeInIndex(void *user_data, xmlNodePtr node, xmlNodePtr parent) {
+    xmlC14NNodeSetIndexPtr index = (xmlC14NNodeSetIndexPtr) user_data;
+    const xmlChar *prefix = NULL;
+    const void *key = node;
+    int isNs = 0;
+    size_t h;
+
+    if (node == NULL)
+        return(1);
+
+    if (node->type == XML_NAMESPACE_DECL) {
+        /* this is a libxml hack! check xpath.c for details */
+        if ((parent != NULL) && (parent->type == XML_ATTRIBUTE_NODE))
+            parent = parent->parent;
+        if (parent == NULL)
+            return(0);
+        key = parent;
+        prefix = ((xmlNsPtr) node)->prefix;
+        isNs = 1;
+    }
+
+    h = xmlC14NNodeSetHash(index, key, prefix);
+    while (index->table[h].key != NULL) {
+        xmlC14NNodeSetEntry *entry = &index->table[h];
+
+        if ((entry->key == key) && (entry->isNs == isNs) &&
+            ((!isNs) || (xmlStrEqual(entry->prefix, prefix))))
+            return(1);
+        h = (h + 1) & index->mask;
+    }
+
+    return(0);
+}
+
 static xmlC14NVisibleNsStackPtr
 xmlC14NVisibleNsStackCreate(void) {
     xmlC14NVisibleNsStackPtr ret;
@@ -293,13 +460,40 @@ xmlC14NVisibleNsStackDestroy(xmlC14NVisibleNsStackPtr cur) {
 	memset(cur->nodeTab, 0, cur->nsMax * sizeof(xmlNodePtr));
 	xmlFree(cur->nodeTab);
     }
+    xmlFree(cur->prevTab);
+    xmlHashFree(cur->prefixes, NULL);
     memset(cur, 0, sizeof(xmlC14NVisibleNsStack));
     xmlFree(cur);
 
 }
 
+/*
+ * Key of a namespace in the prefix table of the visible stack.
+ * A missing prefix is the same as an empty one, see xmlC14NStrEqual.
+ */
+#define xmlC14NNsPrefixKey( ns ) \
+    ((((ns) == NULL) || ((ns)->prefix == NULL)) ? BAD_CAST "" : (ns)->prefix)
+
+/**
+ * Find the topmost entry of the visible stack with the prefix of a
+ * namespace.
+ *
+ * @param cur  the visible stack
+ * @param ns  the namespace
+ * @returns the index of the entry or -1 if there's none
+ */
+static int
+xmlC14NVisibleNsStackTop(xmlC14NVisibleNsStackPtr cur, xmlNsPtr ns) {
+    if (cur->prefixes == NULL)
+        return(-1);
+    return((int) XML_PTR_TO_INT(xmlHashLookup(cur->prefixes,
+                                              xmlC14NNsPrefixKey(ns))) - 1);
+}
+
 static int
 xmlC14NVisibleNsStackAdd(xmlC14NVisibleNsStackPtr cur, xmlNsPtr ns, xmlNodePtr node) {
+    const xmlChar *key;
+
     if((cur == NULL) ||
        ((cur->nsTab == NULL) && (cur->nodeTab != NULL)) ||
        ((cur->nsTab != NULL) && (cur->nodeTab == NULL)))
@@ -308,10 +502,12 @@ xmlC14NVisibleNsStackAdd(xmlC14NVisibleNsStackPtr cur, xmlNsPtr ns, xmlNodePtr n
     if (cur->nsMax <= cur->nsCurEnd) {
 	xmlNsPtr *tmp1;
         xmlNodePtr *tmp2;
+        int *tmp3;
 	int newSize;
 
         newSize = xmlGrowCapacity(cur->nsMax,
-                                  sizeof(tmp1[0]) + sizeof(tmp2[0]),
+                                  sizeof(tmp1[0]) + sizeof(tmp2[0]) +
+                                  sizeof(tmp3[0]),
                                   XML_NAMESPACES_DEFAULT, XML_MAX_ITEMS);
 
 	tmp1 = xmlRealloc(cur->nsTab, newSize * sizeof(tmp1[0]));
@@ -324,8 +520,24 @@ xmlC14NVisibleNsStackAdd(xmlC14NVisibleNsStackPtr cur, xmlNsPtr ns, xmlNodePtr n
 	    return (-1);
 	cur->nodeTab = tmp2;
 
+	tmp3 = xmlRealloc(cur->prevTab, newSize * sizeof(tmp3[0]));
+	if (tmp3 == NULL)
+	    return (-1);
+	cur->prevTab = tmp3;
+
 	cur->nsMax = newSize;
     }
+    if (cur->prefixes == NULL) {
+        cur->prefixes = xmlHashCreate(0);
+        if (cur->prefixes == NULL)
+            return (-1);
+    }
+
+    key = xmlC14NNsPrefixKey(ns);
+    cur->prevTab[cur->nsCurEnd] = xmlC14NVisibleNsStackTop(cur, ns);
+    if (xmlHashUpdateEntry(cur->prefixes, key,
+                           XML_INT_TO_PTR(cur->nsCurEnd + 1), NULL) < 0)
+        return (-1);
     cur->nsTab[cur->nsCurEnd] = ns;
     cur->nodeTab[cur->nsCurEnd] = node;
 
@@ -352,6 +564,17 @@ xmlC14NVisibleNsStackRestore(xmlC14NVisibleNsStackPtr cur, xmlC14NVisibleNsStack
         xmlC14NErrParam(NULL);
 	return;
     }
+    /* Pop the entries added since the save from the prefix table */
+    while (cur->nsCurEnd > state->nsCurEnd) {
+        int i = --cur->nsCurEnd;
+        const xmlChar *key = xmlC14NNsPrefixKey(cur->nsTab[i]);
+
+        if (cur->prevTab[i] >= 0)
+            xmlHashUpdateEntry(cur->prefixes, key,
+                               XML_INT_TO_PTR(cur->prevTab[i] + 1), NULL);
+        else
+            xmlHashRemoveEntry(cur->prefixes, key, NULL);
+    }
     cur->nsCurEnd = state->nsCurEnd;
     cur->nsPrevStart = state->nsPrevStart;
     cur->nsPrevEnd = state->nsPrevEnd;
@@ -406,15 +629,12 @@ xmlC14NVisibleNsStackFind(xmlC14NVisibleNsStackPtr cur, xmlNsPtr ns)
     href = ((ns == NULL) || (ns->href == NULL)) ? BAD_CAST "" : ns->href;
     has_empty_ns = (xmlC14NStrEqual(prefix, NULL) && xmlC14NStrEqual(href, NULL));
 
-    if (cur->nsTab != NULL) {
-	int start = (has_empty_ns) ? 0 : cur->nsPrevStart;
-        for (i = cur->nsCurEnd - 1; i >= start; --i) {
-            xmlNsPtr ns1 = cur->nsTab[i];
+    /* Only the topmost entry with the same prefix matters */
+    i = xmlC14NVisibleNsStackTop(cur, ns);
+    if (i >= ((has_empty_ns) ? 0 : cur->nsPrevStart)) {
+        xmlNsPtr ns1 = cur->nsTab[i];
 
-	    if(xmlC14NStrEqual(prefix, (ns1 != NULL) ? ns1->prefix : NULL)) {
-		return(xmlC14NStrEqual(href, (ns1 != NULL) ? ns1->href : NULL));
-	    }
-        }
+        return(xmlC14NStrEqual(href, (ns1 != NULL) ? ns1->href : NULL));
     }
     return(has_empty_ns);
 }
@@ -439,18 +659,14 @@ xmlExcC14NVisibleNsStackFind(xmlC14NVisibleNsStackPtr cur, xmlNsPtr ns, xmlC14NC
     href = ((ns == NULL) || (ns->href == NULL)) ? BAD_CAST "" : ns->href;
     has_empty_ns = (xmlC14NStrEqual(prefix, NULL) && xmlC14NStrEqual(href, NULL));
 
-    if (cur->nsTab != NULL) {
-	int start = 0;
-        for (i = cur->nsCurEnd - 1; i >= start; --i) {
-            xmlNsPtr ns1 = cur->nsTab[i];
+    i = xmlC14NVisibleNsStackTop(cur, ns);
+    if (i >= 0) {
+        xmlNsPtr ns1 = cur->nsTab[i];
 
-	    if(xmlC14NStrEqual(prefix, (ns1 != NULL) ? ns1->prefix : NULL)) {
-		if(xmlC14NStrEqual(href, (ns1 != NULL) ? ns1->href : NULL)) {
-		    return(xmlC14NIsVisible(ctx, ns1, cur->nodeTab[i]));
-		} else {
-		    return(0);
-		}
-	    }
+        if(xmlC14NStrEqual(href, (ns1 != NULL) ? ns1->href : NULL)) {
+            return(xmlC14NIsVisible(ctx, ns1, cur->nodeTab[i]));
+        } else {
+            return(0);
         }
     }
     return(has_empty_ns);
@@ -1373,36 +1589,21 @@ xmlC14NCheckForRelativeNamespaces(xmlC14NCtxPtr ctx, xmlNodePtr cur)
 }
 
 /**
- * Canonical XML v 1.0 (http://www.w3.org/TR/xml-c14n)
- *
- * Element Nodes
- * If the element is not in the node-set, then the result is obtained
- * by processing the namespace axis, then the attribute axis, then
- * processing the child nodes of the element that are in the node-set
- * (in document order). If the element is in the node-set, then the result
- * is an open angle bracket (<), the element QName, the result of
- * processing the namespace axis, the result of processing the attribute
- * axis, a close angle bracket (>), the result of processing the child
- * nodes of the element that are in the node-set (in document order), an
- * open angle bracket, a forward slash (/), the element QName, and a close
- * angle bracket.
+ * Outputs the start tag of an element, see xmlC14NProcessElementNode.
  *
  * @param ctx  		the pointer to C14N context object
- * @param cur  		the node to process
+ * @param cur  		the element node
  * @param visible  		this node is visible
+ * @param parent_is_doc  	set to the saved parent_is_doc flag
  * @returns non-negative value on success or negative value on fail
  */
 static int
-xmlC14NProcessElementNode(xmlC14NCtxPtr ctx, xmlNodePtr cur, int visible)
+xmlC14NStartElement(xmlC14NCtxPtr ctx, xmlNodePtr cur, int visible,
+                    int *parent_is_doc)
 {
     int ret;
-    xmlC14NVisibleNsStack state;
-    int parent_is_doc = 0;
 
-    if ((ctx == NULL) || (cur == NULL) || (cur->type != XML_ELEMENT_NODE)) {
-        xmlC14NErrParam(ctx);
-        return (-1);
-    }
+    *parent_is_doc = 0;
 
     /*
      * Check relative relative namespaces:
@@ -1412,16 +1613,10 @@ xmlC14NProcessElementNode(xmlC14NCtxPtr ctx, xmlNodePtr cur, int visible)
     if (xmlC14NCheckForRelativeNamespaces(ctx, cur) < 0)
         return (-1);
 
-    /*
-     * Save ns_rendered stack position
-     */
-    memset(&state, 0, sizeof(state));
-    xmlC14NVisibleNsStackSave(ctx->ns_rendered, &state);
-
     if (visible) {
         if (ctx->parent_is_doc) {
 	    /* save this flag into the stack */
-	    parent_is_doc = ctx->parent_is_doc;
+	    *parent_is_doc = ctx->parent_is_doc;
 	    ctx->parent_is_doc = 0;
             ctx->pos = XMLC14N_INSIDE_DOCUMENT_ELEMENT;
         }
@@ -1454,11 +1649,22 @@ xmlC14NProcessElementNode(xmlC14NCtxPtr ctx, xmlNodePtr cur, int visible)
     if (visible) {
         xmlOutputBufferWriteString(ctx->buf, ">");
     }
-    if (cur->children != NULL) {
-        ret = xmlC14NProcessNodeList(ctx, cur->children);
-        if (ret < 0)
-            return (-1);
-    }
+
+    return (0);
+}
+
+/**
+ * Outputs the end tag of an element, see xmlC14NProcessElementNode.
+ *
+ * @param ctx  		the pointer to C14N context object
+ * @param cur  		the element node
+ * @param visible  		this node is visible
+ * @param parent_is_doc  	the flag saved by xmlC14NStartElement
+ */
+static void
+xmlC14NEndElement(xmlC14NCtxPtr ctx, xmlNodePtr cur, int visible,
+                  int parent_is_doc)
+{
     if (visible) {
         xmlOutputBufferWriteString(ctx->buf, "</");
         if ((cur->ns != NULL) && (xmlStrlen(cur->ns->prefix) > 0)) {
@@ -1474,6 +1680,55 @@ xmlC14NProcessElementNode(xmlC14NCtxPtr ctx, xmlNodePtr cur, int visible)
 	    ctx->pos = XMLC14N_AFTER_DOCUMENT_ELEMENT;
         }
     }
+}
+
+/**
+ * Canonical XML v 1.0 (http://www.w3.org/TR/xml-c14n)
+ *
+ * Element Nodes
+ * If the element is not in the node-set, then the result is obtained
+ * by processing the namespace axis, then the attribute axis, then
+ * processing the child nodes of the element that are in the node-set
+ * (in document order). If the element is in the node-set, then the result
+ * is an open angle bracket (<), the element QName, the result of
+ * processing the namespace axis, the result of processing the attribute
+ * axis, a close angle bracket (>), the result of processing the child
+ * nodes of the element that are in the node-set (in document order), an
+ * open angle bracket, a forward slash (/), the element QName, and a close
+ * angle bracket.
+ *
+ * @param ctx  		the pointer to C14N context object
+ * @param cur  		the node to process
+ * @param visible  		this node is visible
+ * @returns non-negative value on success or negative value on fail
+ */
+static int
+xmlC14NProcessElementNode(xmlC14NCtxPtr ctx, xmlNodePtr cur, int visible)
+{
+    int ret;
+    xmlC14NVisibleNsStack state;
+    int parent_is_doc;
+
+    if ((ctx == NULL) || (cur == NULL) || (cur->type != XML_ELEMENT_NODE)) {
+        xmlC14NErrParam(ctx);
+        return (-1);
+    }
+
+    /*
+     * Save ns_rendered stack position
+     */
+    memset(&state, 0, sizeof(state));
+    xmlC14NVisibleNsStackSave(ctx->ns_rendered, &state);
+
+    ret = xmlC14NStartElement(ctx, cur, visible, &parent_is_doc);
+    if (ret < 0)
+        return (-1);
+    if (cur->children != NULL) {
+        ret = xmlC14NProcessNodeList(ctx, cur->children);
+        if (ret < 0)
+            return (-1);
+    }
+    xmlC14NEndElement(ctx, cur, visible, parent_is_doc);
 
     /*
      * Restore ns_rendered stack position
@@ -1709,6 +1964,7 @@ xmlC14NFreeCtx(xmlC14NCtxPtr ctx)
     if (ctx->ns_rendered != NULL) {
         xmlC14NVisibleNsStackDestroy(ctx->ns_rendered);
     }
+    xmlC14NNodeSetIndexFree(ctx->nodes_index);
     xmlFree(ctx);
 }
 
@@ -1781,6 +2037,22 @@ xmlC14NNewCtx(xmlDocPtr doc,
         return (NULL);
     }
 
+    /*
+     * Membership tests against a node set are done for every node of
+     * the document, so hash the node set once.
+     */
+    if ((is_visible_callback == xmlC14NIsNodeInNodeset) &&
+        (user_data != NULL)) {
+        ctx->nodes_index = xmlC14NNodeSetIndexCreate((xmlNodeSetPtr) user_data);
+        if (ctx->nodes_index == NULL) {
+            xmlC14NErrMemory(ctx);
+            xmlC14NFreeCtx(ctx);
+            return (NULL);
+        }
+        ctx->is_visible_callback = xmlC14NIsNodeInIndex;
+        ctx->user_data = ctx->nodes_index;
+    }
+
     /*
      * Set "mode" flag and remember list of inclusive prefixes
      * for exclusive c14n
@@ -1859,6 +2131,12 @@ xmlC14NExecute(xmlDoc *doc, xmlC14NIsVisibleCallback is_visible_callback,
         return (-1);
     }
 
+    if (xmlNodeMaterialize((xmlNodePtr) doc) < 0) {
+        xmlC14NErrMemory(ctx);
+        xmlC14NFreeCtx(ctx);
+        return (-1);
+    }
+
 
 
     /*
@@ -2057,6 +2335,146 @@ xmlC14NDocSave(xmlDoc *doc, xmlNodeSet *nodes,
     return (ret);
 }
 
+#ifdef LIBXML_READER_ENABLED
+/*
+ * State of an open element while canonicalizing from a reader
+ */
+typedef struct {
+    xmlC14NVisibleNsStack state;
+    int parent_is_doc;
+} xmlC14NOpenElement;
+
+/**
+ * Canonicalizes the document parsed by a reader and writes the result
+ * to the provided buffer. Unlike #xmlC14NDocSaveTo, this doesn't build
+ * the whole tree: the reader frees the nodes already processed, so
+ * memory use only depends on the depth of the document. The whole
+ * document is canonicalized, node sets aren't supported.
+ *
+ * The reader should be created with XML_PARSE_DTDATTR and
+ * XML_PARSE_NOENT. It must be positioned before the first node and
+ * is left at the end of the document.
+ *
+ * @param reader  		the reader, positioned at the start of the document
+ * @param mode  		the c14n mode (see `xmlC14NMode`)
+ * @param inclusive_ns_prefixes  the list of inclusive namespace prefixes
+ *			ended with a NULL or NULL if there is no
+ *			inclusive namespaces (only for exclusive
+ *			canonicalization, ignored otherwise)
+ * @param with_comments  	include comments in the result (!=0) or not (==0)
+ * @param buf  		the output buffer to store canonical XML; this
+ *			buffer MUST have encoder==NULL because C14N requires
+ *			UTF-8 output
+ * @returns non-negative value on success or a negative value on fail
+ * @since 2.16.0
+ */
+int
+xmlC14NReaderSaveTo(xmlTextReader *reader, int mode,
+                    xmlChar **inclusive_ns_prefixes, int with_comments,
+                    xmlOutputBuffer *buf) {
+    xmlC14NCtxPtr ctx = NULL;
+    xmlC14NOpenElement *elems = NULL;
+    int nbElems = 0, maxElems = 0;
+    int ret;
+
+    if ((reader == NULL) || (buf == NULL)) {
+        xmlC14NErrParam(NULL);
+        return (-1);
+    }
+    switch(mode) {
+    case XML_C14N_1_0:
+    case XML_C14N_EXCLUSIVE_1_0:
+    case XML_C14N_1_1:
+         break;
+    default:
+        xmlC14NErrParam(NULL);
+        return (-1);
+    }
+
+    while ((ret = xmlTextReaderRead(reader)) == 1) {
+        xmlNodePtr cur = xmlTextReaderCurrentNode(reader);
+        xmlC14NOpenElement *elem;
+
+        if (cur == NULL)
+            continue;
+        if (ctx == NULL) {
+            ctx = xmlC14NNewCtx(cur->doc, NULL, NULL, (xmlC14NMode) mode,
+                                inclusive_ns_prefixes, with_comments, buf);
+            if (ctx == NULL) {
+                xmlC14NErr(NULL, NULL, XML_C14N_CREATE_CTXT,
+                    "xmlC14NReaderSaveTo: unable to create C14N context\n");
+                ret = -1;
+                break;
+            }
+        }
+
+        switch (xmlTextReaderNodeType(reader)) {
+            case XML_READER_TYPE_ELEMENT:
+                if (nbElems >= maxElems) {
+                    xmlC14NOpenElement *tmp;
+                    int newSize;
+
+                    newSize = xmlGrowCapacity(maxElems, sizeof(tmp[0]),
+                                              16, XML_MAX_ITEMS);
+                    if (newSize < 0) {
+                        xmlC14NErrMemory(ctx);
+                        ret = -1;
+                        break;
+                    }
+                    tmp = xmlRealloc(elems, newSize * sizeof(tmp[0]));
+                    if (tmp == NULL) {
+                        xmlC14NErrMemory(ctx);
+                        ret = -1;
+                        break;
+                    }
+                    elems = tmp;
+                    maxElems = newSize;
+                }
+                elem = &elems[nbElems++];
+
+                memset(elem, 0, sizeof(*elem));
+                xmlC14NVisibleNsStackSave(ctx->ns_rendered, &elem->state);
+                ret = xmlC14NStartElement(ctx, cur, 1, &elem->parent_is_doc);
+                if (ret < 0)
+                    break;
+                if (!xmlTextReaderIsEmptyElement(reader))
+                    break;
+                /* Fall through */
+            case XML_READER_TYPE_END_ELEMENT:
+                if (nbElems <= 0) {
+                    xmlC14NErrParam(ctx);
+                    ret = -1;
+                    break;
+                }
+                elem = &elems[--nbElems];
+                xmlC14NEndElement(ctx, cur, 1, elem->parent_is_doc);
+                xmlC14NVisibleNsStackRestore(ctx->ns_rendered, &elem->state);
+                break;
+            case XML_READER_TYPE_DOCUMENT_TYPE:
+                break;
+            default:
+                /* Text, comments, PIs and unsupported nodes */
+                ret = xmlC14NProcessNode(ctx, cur);
+                break;
+        }
+        if (ret < 0)
+            break;
+        ret = 0;
+    }
+
+    if (ret == 0) {
+        ret = xmlOutputBufferFlush(buf);
+        if (ret < 0)
+            xmlC14NErr(ctx, NULL, buf->error, "flushing output buffer");
+    }
+
+    xmlFree(elems);
+    if (ctx != NULL)
+        xmlC14NFreeCtx(ctx);
+    return ((ret < 0) ? -1 : ret);
+}
+#endif /* LIBXML_READER_ENABLED */
+
 /**
  * Converts a string to a canonical (normalized) format. The code is stolen
  * from xmlEscapeText. Added normalization of `\x09`, `\x0a`,
@@ -74,6 +74,7 @@ symbolMap2 = {
     'xmlOutputBufferCreateFilenameDefault': '',
 
     'xmlXPathDebugDumpCompExpr': 'DEBUG',
+    'xmlXPathDebugDumpCompExprPlan': 'DEBUG',
     'xmlXPathDebugDumpObject': 'DEBUG',
     'xmlSchemaDump': 'DEBUG',
     'xmlRelaxNGDump': 'DEBUG',
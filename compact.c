@@ -0,0 +1,1311 @@
+/*
+ * compact.c: read-only compact documents
+ *
+ * Compact documents store nodes as a structure of arrays with 32-bit
+ * links and dictionary-interned names instead of xmlNode structs.
+ * They're built directly from SAX events and can't be modified.
+ *
+ * See Copyright for the status of this software.
+ */
+
+#define IN_LIBXML
+#include "libxml.h"
+
+#include <limits.h>
+#include <string.h>
+
+#include <libxml/tree.h>
+#include <libxml/xmlmemory.h>
+#include <libxml/parser.h>
+#include <libxml/parserInternals.h>
+#include <libxml/SAX2.h>
+#include <libxml/dict.h>
+#include <libxml/hash.h>
+
+#include "private/compact.h"
+#include "private/error.h"
+#include "private/memory.h"
+#include "private/parser.h"
+#include "private/tree.h"
+
+#define XML_COMPACT_MIN_NODES   64
+#define XML_COMPACT_MIN_TEXT    4096
+
+typedef struct {
+    xmlCompactDoc *doc;
+    /* current element or document node */
+    unsigned parent;
+    /* last child of parent, 0 if there's none yet */
+    unsigned last;
+} xmlCompactBuilder;
+
+/************************************************************************
+ *									*
+ *			Allocation					*
+ *									*
+ ************************************************************************/
+
+static int
+xmlCompactGrowNodes(xmlCompactDoc *doc) {
+    void *tmp;
+    int newSize;
+
+    newSize = xmlGrowCapacity(doc->maxNodes, sizeof(unsigned),
+                              XML_COMPACT_MIN_NODES, XML_MAX_ITEMS);
+    if (newSize < 0)
+        return(-1);
+
+    /*
+     * If one of the allocations fails, the arrays that were already
+     * reallocated are simply larger than needed.
+     */
+    tmp = xmlRealloc(doc->types, newSize);
+    if (tmp == NULL)
+        return(-1);
+    doc->types = tmp;
+    tmp = xmlRealloc(doc->names, newSize * sizeof(unsigned));
+    if (tmp == NULL)
+        return(-1);
+    doc->names = tmp;
+    tmp = xmlRealloc(doc->parents, newSize * sizeof(unsigned));
+    if (tmp == NULL)
+        return(-1);
+    doc->parents = tmp;
+    tmp = xmlRealloc(doc->children, newSize * sizeof(unsigned));
+    if (tmp == NULL)
+        return(-1);
+    doc->children = tmp;
+    tmp = xmlRealloc(doc->nexts, newSize * sizeof(unsigned));
+    if (tmp == NULL)
+        return(-1);
+    doc->nexts = tmp;
+    tmp = xmlRealloc(doc->data, newSize * sizeof(unsigned));
+    if (tmp == NULL)
+        return(-1);
+    doc->data = tmp;
+
+    doc->maxNodes = newSize;
+    return(0);
+}
+
+static xmlCompactDoc *
+xmlCompactNewDoc(xmlDict *dict) {
+    xmlCompactDoc *doc;
+
+    doc = xmlMalloc(sizeof(*doc));
+    if (doc == NULL)
+        return(NULL);
+    memset(doc, 0, sizeof(*doc));
+    doc->standalone = -1;
+
+    doc->dict = dict;
+    xmlDictReference(dict);
+
+    /* offset 0 is the empty string */
+    doc->text = xmlMalloc(XML_COMPACT_MIN_TEXT);
+    if (doc->text == NULL)
+        goto error;
+    doc->text[0] = 0;
+    doc->textSize = 1;
+    doc->textMax = XML_COMPACT_MIN_TEXT;
+
+    /* name 0 is used for nodes without name */
+    doc->nameTab = xmlMalloc(16 * sizeof(doc->nameTab[0]));
+    if (doc->nameTab == NULL)
+        goto error;
+    memset(&doc->nameTab[0], 0, sizeof(doc->nameTab[0]));
+    doc->nbNames = 1;
+    doc->maxNames = 16;
+
+    doc->nameHash = xmlHashCreateDict(0, dict);
+    if (doc->nameHash == NULL)
+        goto error;
+
+    if (xmlCompactGrowNodes(doc) < 0)
+        goto error;
+
+    /* Index 0 is unused, so 0 can mean "no node". */
+    memset(doc->types, 0, XML_COMPACT_DOC_NODE + 1);
+    memset(doc->names, 0, (XML_COMPACT_DOC_NODE + 1) * sizeof(unsigned));
+    memset(doc->parents, 0, (XML_COMPACT_DOC_NODE + 1) * sizeof(unsigned));
+    memset(doc->children, 0, (XML_COMPACT_DOC_NODE + 1) * sizeof(unsigned));
+    memset(doc->nexts, 0, (XML_COMPACT_DOC_NODE + 1) * sizeof(unsigned));
+    memset(doc->data, 0, (XML_COMPACT_DOC_NODE + 1) * sizeof(unsigned));
+    doc->types[XML_COMPACT_DOC_NODE] = XML_DOCUMENT_NODE;
+    doc->nbNodes = XML_COMPACT_DOC_NODE + 1;
+
+    return(doc);
+
+error:
+    xmlFreeCompactDoc(doc);
+    return(NULL);
+}
+
+/**
+ * Free a compact document.
+ *
+ * @since 2.16.0
+ *
+ * @param doc  a compact document
+ */
+void
+xmlFreeCompactDoc(xmlCompactDoc *doc) {
+    if (doc == NULL)
+        return;
+
+    xmlFree(doc->types);
+    xmlFree(doc->names);
+    xmlFree(doc->parents);
+    xmlFree(doc->children);
+    xmlFree(doc->nexts);
+    xmlFree(doc->data);
+    xmlFree(doc->nameTab);
+    xmlFree(doc->text);
+    if (doc->nameHash != NULL)
+        xmlHashFree(doc->nameHash, NULL);
+    xmlFree(doc->URL);
+    xmlFree(doc->version);
+    xmlFree(doc->encoding);
+    xmlDictFree(doc->dict);
+    xmlFree(doc);
+}
+
+/*
+ * Release unused memory after parsing.
+ */
+static void
+xmlCompactShrink(xmlCompactDoc *doc) {
+    unsigned n = doc->nbNodes;
+    void *tmp;
+
+    if (doc->nameHash != NULL) {
+        xmlHashFree(doc->nameHash, NULL);
+        doc->nameHash = NULL;
+    }
+
+    /* Failure to shrink is harmless. */
+    if (n < doc->maxNodes) {
+        tmp = xmlRealloc(doc->types, n);
+        if (tmp != NULL)
+            doc->types = tmp;
+        tmp = xmlRealloc(doc->names, n * sizeof(unsigned));
+        if (tmp != NULL)
+            doc->names = tmp;
+        tmp = xmlRealloc(doc->parents, n * sizeof(unsigned));
+        if (tmp != NULL)
+            doc->parents = tmp;
+        tmp = xmlRealloc(doc->children, n * sizeof(unsigned));
+        if (tmp != NULL)
+            doc->children = tmp;
+        tmp = xmlRealloc(doc->nexts, n * sizeof(unsigned));
+        if (tmp != NULL)
+            doc->nexts = tmp;
+        tmp = xmlRealloc(doc->data, n * sizeof(unsigned));
+        if (tmp != NULL)
+            doc->data = tmp;
+        doc->maxNodes = n;
+    }
+
+    if (doc->nbNames < doc->maxNames) {
+        tmp = xmlRealloc(doc->nameTab, doc->nbNames * sizeof(doc->nameTab[0]));
+        if (tmp != NULL) {
+            doc->nameTab = tmp;
+            doc->maxNames = doc->nbNames;
+        }
+    }
+
+    if (doc->textSize < doc->textMax) {
+        tmp = xmlRealloc(doc->text, doc->textSize);
+        if (tmp != NULL) {
+            doc->text = tmp;
+            doc->textMax = doc->textSize;
+        }
+    }
+}
+
+/************************************************************************
+ *									*
+ *			Builder						*
+ *									*
+ ************************************************************************/
+
+/*
+ * Make room for `extra` more bytes in the text blob.
+ */
+static int
+xmlCompactGrowText(xmlParserCtxtPtr ctxt, xmlCompactDoc *doc, size_t extra) {
+    size_t needed, newSize;
+    xmlChar *tmp;
+
+    if (extra > UINT_MAX - doc->textSize) {
+        xmlFatalErr(ctxt, XML_ERR_RESOURCE_LIMIT,
+                    "Compact document text too large");
+        return(-1);
+    }
+    needed = doc->textSize + extra;
+    if (needed <= doc->textMax)
+        return(0);
+
+    newSize = (size_t) doc->textMax + doc->textMax / 2;
+    if (newSize < needed)
+        newSize = needed;
+    if (newSize > UINT_MAX)
+        newSize = UINT_MAX;
+
+    tmp = xmlRealloc(doc->text, newSize);
+    if (tmp == NULL) {
+        xmlCtxtErrMemory(ctxt);
+        return(-1);
+    }
+    doc->text = tmp;
+    doc->textMax = newSize;
+
+    return(0);
+}
+
+/*
+ * Append a null-terminated copy of a string to the text blob.
+ */
+static int
+xmlCompactAddText(xmlParserCtxtPtr ctxt, xmlCompactDoc *doc,
+                  const xmlChar *str, size_t len, unsigned *out) {
+    if (xmlCompactGrowText(ctxt, doc, len + 1) < 0)
+        return(-1);
+
+    *out = doc->textSize;
+    memcpy(doc->text + doc->textSize, str, len);
+    doc->textSize += len;
+    doc->text[doc->textSize++] = 0;
+
+    return(0);
+}
+
+/*
+ * Intern a name triple. For namespace declarations, `name` is the
+ * prefix and `href` the namespace URI.
+ */
+static unsigned
+xmlCompactAddName(xmlParserCtxtPtr ctxt, xmlCompactDoc *doc,
+                  const xmlChar *name, const xmlChar *prefix,
+                  const xmlChar *href) {
+    xmlCompactName *entry;
+    const xmlChar *key;
+    unsigned idx;
+    int res;
+
+    /* The default namespace declaration has no name. */
+    key = (name != NULL) ? name : BAD_CAST "";
+
+    idx = XML_PTR_TO_INT(xmlHashLookup3(doc->nameHash, key, prefix, href));
+    if (idx != 0)
+        return(idx);
+
+    if (doc->nbNames >= doc->maxNames) {
+        xmlCompactName *tmp;
+        int newSize;
+
+        newSize = xmlGrowCapacity(doc->maxNames, sizeof(tmp[0]),
+                                  16, XML_MAX_ITEMS);
+        if (newSize < 0) {
+            xmlFatalErr(ctxt, XML_ERR_RESOURCE_LIMIT,
+                        "Too many names in compact document");
+            return(0);
+        }
+        tmp = xmlRealloc(doc->nameTab, newSize * sizeof(tmp[0]));
+        if (tmp == NULL) {
+            xmlCtxtErrMemory(ctxt);
+            return(0);
+        }
+        doc->nameTab = tmp;
+        doc->maxNames = newSize;
+    }
+
+    idx = doc->nbNames;
+    res = xmlHashAdd3(doc->nameHash, key, prefix, href, XML_INT_TO_PTR(idx));
+    if (res <= 0) {
+        xmlCtxtErrMemory(ctxt);
+        return(0);
+    }
+
+    entry = &doc->nameTab[idx];
+    entry->name = name;
+    entry->prefix = prefix;
+    entry->href = href;
+    doc->nbNames += 1;
+
+    return(idx);
+}
+
+/*
+ * Append a node without linking it to its siblings.
+ */
+static unsigned
+xmlCompactNewNode(xmlParserCtxtPtr ctxt, xmlCompactDoc *doc,
+                  xmlElementType type, unsigned name, unsigned parent,
+                  unsigned data) {
+    unsigned node;
+
+    if (doc->nbNodes >= doc->maxNodes) {
+        if (doc->maxNodes >= XML_MAX_ITEMS) {
+            xmlFatalErr(ctxt, XML_ERR_RESOURCE_LIMIT,
+                        "Too many nodes in compact document");
+            return(0);
+        }
+        if (xmlCompactGrowNodes(doc) < 0) {
+            xmlCtxtErrMemory(ctxt);
+            return(0);
+        }
+    }
+
+    node = doc->nbNodes++;
+    doc->types[node] = type;
+    doc->names[node] = name;
+    doc->parents[node] = parent;
+    doc->children[node] = 0;
+    doc->nexts[node] = 0;
+    doc->data[node] = data;
+
+    return(node);
+}
+
+/*
+ * Append a child to the current parent.
+ */
+static unsigned
+xmlCompactAddChild(xmlParserCtxtPtr ctxt, xmlCompactBuilder *builder,
+                   xmlElementType type, unsigned name, unsigned data) {
+    xmlCompactDoc *doc = builder->doc;
+    unsigned node;
+
+    node = xmlCompactNewNode(ctxt, doc, type, name, builder->parent, data);
+    if (node == 0)
+        return(0);
+
+    if (builder->last == 0)
+        doc->children[builder->parent] = node;
+    else
+        doc->nexts[builder->last] = node;
+    builder->last = node;
+
+    return(node);
+}
+
+static void
+xmlCompactStartElementNs(void *ctx, const xmlChar *localname,
+                         const xmlChar *prefix, const xmlChar *URI,
+                         int nb_namespaces, const xmlChar **namespaces,
+                         int nb_attributes,
+                         int nb_defaulted ATTRIBUTE_UNUSED,
+                         const xmlChar **attributes) {
+    xmlParserCtxtPtr ctxt = ctx;
+    xmlCompactBuilder *builder = ctxt->compactBuilder;
+    xmlCompactDoc *doc = builder->doc;
+    unsigned elem, name, node, offset, prev = 0;
+    int i;
+
+    name = xmlCompactAddName(ctxt, doc, localname, prefix, URI);
+    if (name == 0)
+        return;
+    elem = xmlCompactAddChild(ctxt, builder, XML_ELEMENT_NODE, name, 0);
+    if (elem == 0)
+        return;
+
+    for (i = 0; i < nb_namespaces; i++) {
+        const xmlChar *nsPrefix = namespaces[2 * i];
+        const xmlChar *nsURI = namespaces[2 * i + 1];
+
+        name = xmlCompactAddName(ctxt, doc, nsPrefix, NULL, nsURI);
+        if (name == 0)
+            return;
+        node = xmlCompactNewNode(ctxt, doc, XML_NAMESPACE_DECL, name,
+                                 elem, 0);
+        if (node == 0)
+            return;
+        if (prev == 0)
+            doc->data[elem] = node;
+        else
+            doc->nexts[prev] = node;
+        prev = node;
+    }
+
+    for (i = 0; i < nb_attributes * 5; i += 5) {
+        const xmlChar *value = attributes[i + 3];
+        const xmlChar *valueEnd = attributes[i + 4];
+        xmlChar *dup = NULL;
+        int res;
+
+        name = xmlCompactAddName(ctxt, doc, attributes[i],
+                                 attributes[i + 1], attributes[i + 2]);
+        if (name == 0)
+            return;
+
+        /*
+         * Without entity substitution, values containing references
+         * are null-terminated and still contain the references.
+         */
+        if ((ctxt->replaceEntities == 0) && (*valueEnd == 0) &&
+            (memchr(value, '&', valueEnd - value) != NULL)) {
+            dup = xmlExpandEntitiesInAttValue(ctxt, value, /* normalize */ 0);
+            if (dup == NULL) {
+                xmlCtxtErrMemory(ctxt);
+                return;
+            }
+            value = dup;
+            valueEnd = dup + strlen((char *) dup);
+        }
+        res = xmlCompactAddText(ctxt, doc, value, valueEnd - value, &offset);
+        xmlFree(dup);
+        if (res < 0)
+            return;
+
+        node = xmlCompactNewNode(ctxt, doc, XML_ATTRIBUTE_NODE, name,
+                                 elem, offset);
+        if (node == 0)
+            return;
+        if (prev == 0)
+            doc->data[elem] = node;
+        else
+            doc->nexts[prev] = node;
+        prev = node;
+    }
+
+    builder->parent = elem;
+    builder->last = 0;
+}
+
+static void
+xmlCompactEndElementNs(void *ctx,
+                       const xmlChar *localname ATTRIBUTE_UNUSED,
+                       const xmlChar *prefix ATTRIBUTE_UNUSED,
+                       const xmlChar *URI ATTRIBUTE_UNUSED) {
+    xmlParserCtxtPtr ctxt = ctx;
+    xmlCompactBuilder *builder = ctxt->compactBuilder;
+
+    if (builder->parent == XML_COMPACT_DOC_NODE)
+        return;
+
+    builder->last = builder->parent;
+    builder->parent = builder->doc->parents[builder->parent];
+}
+
+static void
+xmlCompactText(xmlParserCtxtPtr ctxt, const xmlChar *ch, int len,
+               xmlElementType type) {
+    xmlCompactBuilder *builder = ctxt->compactBuilder;
+    xmlCompactDoc *doc = builder->doc;
+    unsigned last = builder->last;
+    unsigned offset;
+
+    if (len < 0)
+        return;
+
+    /*
+     * Text is appended in document order, so if the last child is a
+     * text node and was also the last node added, its content is at
+     * the end of the blob and can be extended in place.
+     */
+    if ((type == XML_TEXT_NODE) &&
+        (last != 0) &&
+        (last == doc->nbNodes - 1) &&
+        (doc->types[last] == XML_TEXT_NODE)) {
+        if (xmlCompactGrowText(ctxt, doc, len) < 0)
+            return;
+        memcpy(doc->text + doc->textSize - 1, ch, len);
+        doc->textSize += len;
+        doc->text[doc->textSize - 1] = 0;
+        return;
+    }
+
+    if (xmlCompactAddText(ctxt, doc, ch, len, &offset) < 0)
+        return;
+    xmlCompactAddChild(ctxt, builder, type, 0, offset);
+}
+
+static void
+xmlCompactCharacters(void *ctx, const xmlChar *ch, int len) {
+    xmlCompactText(ctx, ch, len, XML_TEXT_NODE);
+}
+
+static void
+xmlCompactCDataBlock(void *ctx, const xmlChar *value, int len) {
+    xmlCompactText(ctx, value, len, XML_CDATA_SECTION_NODE);
+}
+
+static void
+xmlCompactComment(void *ctx, const xmlChar *value) {
+    xmlParserCtxtPtr ctxt = ctx;
+    xmlCompactBuilder *builder = ctxt->compactBuilder;
+    unsigned offset;
+
+    if (xmlCompactAddText(ctxt, builder->doc, value, strlen((char *) value),
+                          &offset) < 0)
+        return;
+    xmlCompactAddChild(ctxt, builder, XML_COMMENT_NODE, 0, offset);
+}
+
+static void
+xmlCompactProcessingInstruction(void *ctx, const xmlChar *target,
+                                const xmlChar *data) {
+    xmlParserCtxtPtr ctxt = ctx;
+    xmlCompactBuilder *builder = ctxt->compactBuilder;
+    unsigned name, offset = 0;
+
+    name = xmlCompactAddName(ctxt, builder->doc, target, NULL, NULL);
+    if (name == 0)
+        return;
+
+    /* Offset 0 means no data, so even empty data is stored. */
+    if ((data != NULL) &&
+        (xmlCompactAddText(ctxt, builder->doc, data, strlen((char *) data),
+                           &offset) < 0))
+        return;
+    xmlCompactAddChild(ctxt, builder, XML_PI_NODE, name, offset);
+}
+
+/**
+ * Parse an XML document into a read-only compact document. Takes
+ * ownership of the input object.
+ *
+ * Compact documents store nodes as arrays of small records with
+ * 32-bit links and names interned in the parser dictionary, using a
+ * fraction of the memory of a regular tree. They can be queried
+ * with the xmlCompactNode accessors, with streamable XPath
+ * expressions using #xmlPatternSelectCompact and serialized with
+ * #xmlSaveCompactDoc. For other processing, parts of the document
+ * can be copied to a regular tree with #xmlCompactNodeCopy.
+ *
+ * The element content handlers of the SAX handler are replaced
+ * while parsing. The DTD is processed like with a regular tree but
+ * not kept. Entity references are always substituted and DTD
+ * validation isn't supported.
+ *
+ * @since 2.16.0
+ *
+ * @param ctxt  an XML parser context
+ * @param input  parser input
+ * @returns the compact document or NULL in case of error
+ */
+xmlCompactDoc *
+xmlCtxtParseCompact(xmlParserCtxt *ctxt, xmlParserInput *input) {
+    xmlCompactBuilder builder;
+    xmlSAXHandler oldSax;
+    xmlSAXHandlerPtr sax;
+    xmlCompactDoc *ret = NULL;
+    xmlDocPtr myDoc;
+    int oldOptions, oldValidate;
+
+    if ((ctxt == NULL) || (input == NULL) || (ctxt->sax == NULL) ||
+        (ctxt->html)) {
+        xmlFatalErr(ctxt, XML_ERR_ARGUMENT, NULL);
+        xmlFreeInputStream(input);
+        return(NULL);
+    }
+
+    /* assert(ctxt->inputNr == 0); */
+    while (ctxt->inputNr > 0)
+        xmlFreeInputStream(xmlCtxtPopInput(ctxt));
+
+    if (xmlCtxtPushInput(ctxt, input) < 0) {
+        xmlFreeInputStream(input);
+        return(NULL);
+    }
+
+    builder.doc = xmlCompactNewDoc(ctxt->dict);
+    if (builder.doc == NULL) {
+        xmlCtxtErrMemory(ctxt);
+        goto done;
+    }
+    builder.parent = XML_COMPACT_DOC_NODE;
+    builder.last = 0;
+
+    /*
+     * Keep the default handlers for the document and the DTD, but
+     * build the content with our own.
+     */
+    sax = ctxt->sax;
+    memcpy(&oldSax, sax, sizeof(oldSax));
+    sax->initialized = XML_SAX2_MAGIC;
+    sax->startElementNs = xmlCompactStartElementNs;
+    sax->endElementNs = xmlCompactEndElementNs;
+    sax->startElement = NULL;
+    sax->endElement = NULL;
+    sax->characters = xmlCompactCharacters;
+    sax->ignorableWhitespace = ctxt->keepBlanks ?
+                               xmlCompactCharacters :
+                               xmlSAX2IgnorableWhitespace;
+    sax->cdataBlock = xmlCompactCDataBlock;
+    sax->comment = xmlCompactComment;
+    sax->processingInstruction = xmlCompactProcessingInstruction;
+    /* Without a reference handler, entity content is reported again. */
+    sax->reference = NULL;
+
+    oldOptions = ctxt->options;
+    oldValidate = ctxt->validate;
+    ctxt->options &= ~XML_PARSE_SAX1;
+    ctxt->validate = 0;
+    ctxt->compactBuilder = &builder;
+
+    xmlParseDocument(ctxt);
+
+    ctxt->compactBuilder = NULL;
+    ctxt->options = oldOptions;
+    ctxt->validate = oldValidate;
+    memcpy(sax, &oldSax, sizeof(oldSax));
+
+    myDoc = xmlCtxtGetDocument(ctxt);
+    if (myDoc == NULL)
+        goto done;
+
+    ret = builder.doc;
+    builder.doc = NULL;
+
+    ret->standalone = myDoc->standalone;
+    ret->version = (xmlChar *) myDoc->version;
+    myDoc->version = NULL;
+    ret->encoding = (xmlChar *) myDoc->encoding;
+    myDoc->encoding = NULL;
+    ret->URL = (xmlChar *) myDoc->URL;
+    myDoc->URL = NULL;
+    xmlFreeDoc(myDoc);
+
+    xmlCompactShrink(ret);
+
+done:
+    xmlFreeCompactDoc(builder.doc);
+
+    /* assert(ctxt->inputNr == 1); */
+    while (ctxt->inputNr > 0)
+        xmlFreeInputStream(xmlCtxtPopInput(ctxt));
+
+    return(ret);
+}
+
+/**
+ * Parse an XML file from the filesystem or a global, user-defined
+ * resource loader into a compact document.
+ *
+ * See #xmlCtxtParseCompact for details.
+ *
+ * @since 2.16.0
+ *
+ * @param ctxt  an XML parser context
+ * @param filename  a file or URL
+ * @param encoding  the document encoding (optional)
+ * @param options  a combination of xmlParserOption
+ * @returns the compact document or NULL in case of error
+ */
+xmlCompactDoc *
+xmlCtxtReadCompactFile(xmlParserCtxt *ctxt, const char *filename,
+                       const char *encoding, int options) {
+    xmlParserInputPtr input;
+
+    if (ctxt == NULL)
+        return(NULL);
+
+    xmlCtxtReset(ctxt);
+    xmlCtxtUseOptions(ctxt, options);
+
+    input = xmlCtxtNewInputFromUrl(ctxt, filename, NULL, encoding, 0);
+    if (input == NULL)
+        return(NULL);
+
+    return(xmlCtxtParseCompact(ctxt, input));
+}
+
+/**
+ * Parse an XML in-memory document into a compact document. The
+ * input buffer must not contain a terminating null byte.
+ *
+ * See #xmlCtxtParseCompact for details.
+ *
+ * @since 2.16.0
+ *
+ * @param ctxt  an XML parser context
+ * @param buffer  a pointer to a char array
+ * @param size  the size of the array
+ * @param URL  base URL (optional)
+ * @param encoding  the document encoding (optional)
+ * @param options  a combination of xmlParserOption
+ * @returns the compact document or NULL in case of error
+ */
+xmlCompactDoc *
+xmlCtxtReadCompactMemory(xmlParserCtxt *ctxt, const char *buffer, int size,
+                         const char *URL, const char *encoding,
+                         int options) {
+    xmlParserInputPtr input;
+
+    if ((ctxt == NULL) || (size < 0))
+        return(NULL);
+
+    xmlCtxtReset(ctxt);
+    xmlCtxtUseOptions(ctxt, options);
+
+    input = xmlCtxtNewInputFromMemory(ctxt, URL, buffer, size, encoding,
+                                      XML_INPUT_BUF_STATIC);
+    if (input == NULL)
+        return(NULL);
+
+    return(xmlCtxtParseCompact(ctxt, input));
+}
+
+/************************************************************************
+ *									*
+ *			Accessors					*
+ *									*
+ ************************************************************************/
+
+#define XML_COMPACT_VALID(doc, node) \
+    (((doc) != NULL) && ((node) != 0) && ((node) < (doc)->nbNodes))
+
+/**
+ * @since 2.16.0
+ *
+ * @param doc  a compact document
+ * @returns the dictionary holding the names of the document.
+ */
+xmlDict *
+xmlCompactDocGetDict(const xmlCompactDoc *doc) {
+    if (doc == NULL)
+        return(NULL);
+    return(doc->dict);
+}
+
+/**
+ * @since 2.16.0
+ *
+ * @param doc  a compact document
+ * @returns the root element or 0 if the document has none.
+ */
+unsigned
+xmlCompactDocGetRootElement(const xmlCompactDoc *doc) {
+    unsigned cur;
+
+    if (doc == NULL)
+        return(0);
+
+    for (cur = doc->children[XML_COMPACT_DOC_NODE]; cur != 0;
+         cur = doc->nexts[cur]) {
+        if (doc->types[cur] == XML_ELEMENT_NODE)
+            return(cur);
+    }
+
+    return(0);
+}
+
+/**
+ * Return the number of bytes allocated for a compact document,
+ * excluding the shared dictionary.
+ *
+ * @since 2.16.0
+ *
+ * @param doc  a compact document
+ * @returns the memory size in bytes.
+ */
+size_t
+xmlCompactDocGetMemory(const xmlCompactDoc *doc) {
+    size_t ret;
+
+    if (doc == NULL)
+        return(0);
+
+    ret = sizeof(*doc);
+    ret += (size_t) doc->maxNodes * (1 + 5 * sizeof(unsigned));
+    ret += (size_t) doc->maxNames * sizeof(doc->nameTab[0]);
+    ret += doc->textMax;
+
+    return(ret);
+}
+
+/**
+ * Return the type of a node. The document node, the first child of
+ * which can be obtained with #xmlCompactNodeGetFirstChild, is node
+ * number 1.
+ *
+ * Attributes and namespace declarations have types
+ * XML_ATTRIBUTE_NODE and XML_NAMESPACE_DECL.
+ *
+ * @since 2.16.0
+ *
+ * @param doc  a compact document
+ * @param node  a node
+ * @returns the xmlElementType of the node or -1 if the node is invalid.
+ */
+int
+xmlCompactNodeGetType(const xmlCompactDoc *doc, unsigned node) {
+    if (!XML_COMPACT_VALID(doc, node))
+        return(-1);
+    return(doc->types[node]);
+}
+
+/**
+ * @since 2.16.0
+ *
+ * @param doc  a compact document
+ * @param node  a node
+ * @returns the local name of an element or attribute, the target of
+ * a processing instruction, the prefix of a namespace declaration or
+ * NULL.
+ */
+const xmlChar *
+xmlCompactNodeGetName(const xmlCompactDoc *doc, unsigned node) {
+    if (!XML_COMPACT_VALID(doc, node))
+        return(NULL);
+    return(doc->nameTab[doc->names[node]].name);
+}
+
+/**
+ * @since 2.16.0
+ *
+ * @param doc  a compact document
+ * @param node  a node
+ * @returns the namespace prefix of an element or attribute or NULL.
+ */
+const xmlChar *
+xmlCompactNodeGetPrefix(const xmlCompactDoc *doc, unsigned node) {
+    if (!XML_COMPACT_VALID(doc, node))
+        return(NULL);
+    return(doc->nameTab[doc->names[node]].prefix);
+}
+
+/**
+ * @since 2.16.0
+ *
+ * @param doc  a compact document
+ * @param node  a node
+ * @returns the namespace URI of an element, attribute or namespace
+ * declaration or NULL.
+ */
+const xmlChar *
+xmlCompactNodeGetNsURI(const xmlCompactDoc *doc, unsigned node) {
+    if (!XML_COMPACT_VALID(doc, node))
+        return(NULL);
+    return(doc->nameTab[doc->names[node]].href);
+}
+
+/**
+ * @since 2.16.0
+ *
+ * @param doc  a compact document
+ * @param node  a node
+ * @returns the parent of a node or the element of an attribute or
+ * namespace declaration. Returns 0 for the document node.
+ */
+unsigned
+xmlCompactNodeGetParent(const xmlCompactDoc *doc, unsigned node) {
+    if (!XML_COMPACT_VALID(doc, node))
+        return(0);
+    return(doc->parents[node]);
+}
+
+/**
+ * @since 2.16.0
+ *
+ * @param doc  a compact document
+ * @param node  a node
+ * @returns the first child of an element or the document node or 0.
+ */
+unsigned
+xmlCompactNodeGetFirstChild(const xmlCompactDoc *doc, unsigned node) {
+    if (!XML_COMPACT_VALID(doc, node))
+        return(0);
+    return(doc->children[node]);
+}
+
+/**
+ * @since 2.16.0
+ *
+ * @param doc  a compact document
+ * @param node  a node
+ * @returns the next sibling of a node or the next attribute or
+ * namespace declaration of an element or 0.
+ */
+unsigned
+xmlCompactNodeGetNext(const xmlCompactDoc *doc, unsigned node) {
+    if (!XML_COMPACT_VALID(doc, node))
+        return(0);
+    return(doc->nexts[node]);
+}
+
+/**
+ * Return the first attribute or namespace declaration of an element.
+ * Namespace declarations come first. Use #xmlCompactNodeGetNext to
+ * iterate.
+ *
+ * @since 2.16.0
+ *
+ * @param doc  a compact document
+ * @param node  an element
+ * @returns the first attribute or namespace declaration or 0.
+ */
+unsigned
+xmlCompactNodeGetAttributes(const xmlCompactDoc *doc, unsigned node) {
+    if ((!XML_COMPACT_VALID(doc, node)) ||
+        (doc->types[node] != XML_ELEMENT_NODE))
+        return(0);
+    return(doc->data[node]);
+}
+
+/**
+ * Return the value of attributes, text, CDATA sections, comments,
+ * processing instructions or namespace declarations.
+ *
+ * @since 2.16.0
+ *
+ * @param doc  a compact document
+ * @param node  a node
+ * @returns the value or NULL if the node has no value.
+ */
+const xmlChar *
+xmlCompactNodeGetValue(const xmlCompactDoc *doc, unsigned node) {
+    if (!XML_COMPACT_VALID(doc, node))
+        return(NULL);
+
+    switch (doc->types[node]) {
+        case XML_ATTRIBUTE_NODE:
+        case XML_TEXT_NODE:
+        case XML_CDATA_SECTION_NODE:
+        case XML_COMMENT_NODE:
+            return(doc->text + doc->data[node]);
+        case XML_PI_NODE:
+            if (doc->data[node] == 0)
+                return(NULL);
+            return(doc->text + doc->data[node]);
+        case XML_NAMESPACE_DECL:
+            return(doc->nameTab[doc->names[node]].href);
+        default:
+            return(NULL);
+    }
+}
+
+/*
+ * Return the index after the last descendant of a node.
+ */
+static unsigned
+xmlCompactSubtreeEnd(const xmlCompactDoc *doc, unsigned node) {
+    while (node != 0) {
+        if (doc->nexts[node] != 0)
+            return(doc->nexts[node]);
+        node = doc->parents[node];
+    }
+
+    return(doc->nbNodes);
+}
+
+/**
+ * Return the string value of a node. For elements and the document
+ * node, this is the concatenated content of all text and CDATA
+ * descendants, see #xmlNodeGetContent.
+ *
+ * @since 2.16.0
+ *
+ * @param doc  a compact document
+ * @param node  a node
+ * @returns a newly allocated string or NULL if the node is invalid
+ * or a memory allocation failed.
+ */
+xmlChar *
+xmlCompactNodeGetContent(const xmlCompactDoc *doc, unsigned node) {
+    const xmlChar *value;
+    xmlChar *ret;
+    unsigned cur, end;
+    size_t len = 0;
+
+    if (!XML_COMPACT_VALID(doc, node))
+        return(NULL);
+
+    if ((doc->types[node] != XML_ELEMENT_NODE) &&
+        (doc->types[node] != XML_DOCUMENT_NODE)) {
+        value = xmlCompactNodeGetValue(doc, node);
+        return(xmlStrdup(value ? value : BAD_CAST ""));
+    }
+
+    /*
+     * Descendants are stored contiguously after the node and its
+     * attributes.
+     */
+    if (doc->types[node] == XML_ELEMENT_NODE)
+        end = xmlCompactSubtreeEnd(doc, node);
+    else
+        end = doc->nbNodes;
+
+    for (cur = node + 1; cur < end; cur++) {
+        if ((doc->types[cur] == XML_TEXT_NODE) ||
+            (doc->types[cur] == XML_CDATA_SECTION_NODE))
+            len += strlen((char *) doc->text + doc->data[cur]);
+    }
+
+    ret = xmlMalloc(len + 1);
+    if (ret == NULL)
+        return(NULL);
+
+    len = 0;
+    for (cur = node + 1; cur < end; cur++) {
+        if ((doc->types[cur] == XML_TEXT_NODE) ||
+            (doc->types[cur] == XML_CDATA_SECTION_NODE)) {
+            size_t l;
+
+            value = doc->text + doc->data[cur];
+            l = strlen((char *) value);
+            memcpy(ret + len, value, l);
+            len += l;
+        }
+    }
+    ret[len] = 0;
+
+    return(ret);
+}
+
+/**
+ * Look up the value of an attribute, see #xmlGetNsProp.
+ *
+ * @since 2.16.0
+ *
+ * @param doc  a compact document
+ * @param node  an element
+ * @param name  the local name of the attribute
+ * @param nsURI  the namespace URI of the attribute or NULL for no
+ * namespace
+ * @returns the attribute value or NULL if the attribute wasn't found.
+ */
+const xmlChar *
+xmlCompactNodeGetProp(const xmlCompactDoc *doc, unsigned node,
+                      const xmlChar *name, const xmlChar *nsURI) {
+    unsigned cur;
+
+    if (name == NULL)
+        return(NULL);
+
+    for (cur = xmlCompactNodeGetAttributes(doc, node); cur != 0;
+         cur = doc->nexts[cur]) {
+        const xmlCompactName *entry = &doc->nameTab[doc->names[cur]];
+
+        if ((doc->types[cur] == XML_ATTRIBUTE_NODE) &&
+            (xmlStrEqual(entry->name, name)) &&
+            (xmlStrEqual(entry->href, nsURI)))
+            return(doc->text + doc->data[cur]);
+    }
+
+    return(NULL);
+}
+
+/************************************************************************
+ *									*
+ *			Conversion to trees				*
+ *									*
+ ************************************************************************/
+
+/*
+ * Find or create a namespace for a copied node. Declarations outside
+ * of the copied subtree are added to its root.
+ */
+static int
+xmlCompactCopyNs(xmlNodePtr root, xmlNodePtr elem, const xmlChar *prefix,
+                 const xmlChar *href, xmlNsPtr *out) {
+    xmlNsPtr ns;
+
+    *out = NULL;
+    if (href == NULL)
+        return(0);
+
+    if (xmlSearchNsSafe(elem, prefix, &ns) < 0)
+        return(-1);
+    if ((ns == NULL) || (!xmlStrEqual(ns->href, href))) {
+        ns = xmlNewNs(root, href, prefix);
+        if (ns == NULL)
+            ns = xmlNewNs(elem, href, prefix);
+        if (ns == NULL)
+            return(-1);
+    }
+
+    *out = ns;
+    return(0);
+}
+
+static xmlNodePtr
+xmlCompactCopyOne(const xmlCompactDoc *cdoc, unsigned node, xmlDocPtr doc,
+                  xmlNodePtr root, xmlNodePtr parent) {
+    const xmlCompactName *entry = &cdoc->nameTab[cdoc->names[node]];
+    const xmlChar *value = cdoc->text + cdoc->data[node];
+    xmlNodePtr copy = NULL;
+    xmlNsPtr ns;
+    unsigned attr;
+
+    switch (cdoc->types[node]) {
+        case XML_ELEMENT_NODE:
+            copy = xmlNewDocNode(doc, NULL, entry->name, NULL);
+            break;
+        case XML_TEXT_NODE:
+            copy = xmlNewDocText(doc, value);
+            break;
+        case XML_CDATA_SECTION_NODE:
+            copy = xmlNewCDataBlock(doc, value, strlen((char *) value));
+            break;
+        case XML_COMMENT_NODE:
+            copy = xmlNewDocComment(doc, value);
+            break;
+        case XML_PI_NODE:
+            copy = xmlNewDocPI(doc, entry->name,
+                               cdoc->data[node] ? value : NULL);
+            break;
+        default:
+            return(NULL);
+    }
+    if (copy == NULL)
+        return(NULL);
+
+    if (parent != NULL) {
+        xmlNodePtr tmp;
+
+        /* Text may be merged */
+        tmp = xmlAddChild(parent, copy);
+        if (tmp == NULL) {
+            xmlFreeNode(copy);
+            return(NULL);
+        }
+        copy = tmp;
+    }
+    if (cdoc->types[node] != XML_ELEMENT_NODE)
+        return(copy);
+
+    if (root == NULL)
+        root = copy;
+
+    attr = cdoc->data[node];
+    while ((attr != 0) && (cdoc->types[attr] == XML_NAMESPACE_DECL)) {
+        const xmlCompactName *nsEntry = &cdoc->nameTab[cdoc->names[attr]];
+
+        if (xmlNewNs(copy, nsEntry->href, nsEntry->name) == NULL)
+            goto error;
+        attr = cdoc->nexts[attr];
+    }
+
+    if (xmlCompactCopyNs(root, copy, entry->prefix, entry->href, &ns) < 0)
+        goto error;
+    copy->ns = ns;
+
+    for (; attr != 0; attr = cdoc->nexts[attr]) {
+        const xmlCompactName *attrEntry = &cdoc->nameTab[cdoc->names[attr]];
+
+        if (xmlCompactCopyNs(root, copy, attrEntry->prefix, attrEntry->href,
+                             &ns) < 0)
+            goto error;
+        if (xmlNewNsProp(copy, ns, attrEntry->name,
+                         cdoc->text + cdoc->data[attr]) == NULL)
+            goto error;
+    }
+
+    return(copy);
+
+error:
+    if (parent != NULL)
+        xmlUnlinkNode(copy);
+    xmlFreeNode(copy);
+    return(NULL);
+}
+
+/**
+ * Copy a node of a compact document and its descendants to a
+ * regular tree, for example to process it with the XPath engine.
+ * Namespaces declared outside of the subtree are redeclared on the
+ * copy.
+ *
+ * @since 2.16.0
+ *
+ * @param cdoc  a compact document
+ * @param node  an element, text, CDATA, comment or PI node
+ * @param doc  the document of the copy (optional)
+ * @returns the unlinked copy or NULL in case of error.
+ */
+xmlNode *
+xmlCompactNodeCopy(const xmlCompactDoc *cdoc, unsigned node, xmlDoc *doc) {
+    xmlNodePtr ret, parent, copy;
+    unsigned cur;
+
+    if (!XML_COMPACT_VALID(cdoc, node))
+        return(NULL);
+
+    ret = xmlCompactCopyOne(cdoc, node, doc, NULL, NULL);
+    if (ret == NULL)
+        return(NULL);
+
+    /* copy is the copy of cur */
+    copy = ret;
+    cur = node;
+    while (1) {
+        if ((cdoc->types[cur] == XML_ELEMENT_NODE) &&
+            (cdoc->children[cur] != 0)) {
+            parent = copy;
+            cur = cdoc->children[cur];
+        } else {
+            while ((cur != node) && (cdoc->nexts[cur] == 0)) {
+                cur = cdoc->parents[cur];
+                copy = copy->parent;
+            }
+            if (cur == node)
+                break;
+            parent = copy->parent;
+            cur = cdoc->nexts[cur];
+        }
+
+        copy = xmlCompactCopyOne(cdoc, cur, doc, ret, parent);
+        if (copy == NULL) {
+            xmlFreeNode(ret);
+            return(NULL);
+        }
+    }
+
+    return(ret);
+}
+
+/**
+ * Copy a compact document to a regular document. The copy shares
+ * the dictionary of the compact document.
+ *
+ * @since 2.16.0
+ *
+ * @param cdoc  a compact document
+ * @returns the new document or NULL in case of error.
+ */
+xmlDoc *
+xmlCompactDocCopy(const xmlCompactDoc *cdoc) {
+    xmlDocPtr doc;
+    xmlNodePtr copy;
+    unsigned cur;
+
+    if (cdoc == NULL)
+        return(NULL);
+
+    doc = xmlNewDoc(cdoc->version);
+    if (doc == NULL)
+        return(NULL);
+    doc->standalone = cdoc->standalone;
+    doc->dict = cdoc->dict;
+    xmlDictReference(doc->dict);
+    if (cdoc->encoding != NULL) {
+        doc->encoding = xmlStrdup(cdoc->encoding);
+        if (doc->encoding == NULL)
+            goto error;
+    }
+    if (cdoc->URL != NULL) {
+        doc->URL = xmlStrdup(cdoc->URL);
+        if (doc->URL == NULL)
+            goto error;
+    }
+
+    for (cur = cdoc->children[XML_COMPACT_DOC_NODE]; cur != 0;
+         cur = cdoc->nexts[cur]) {
+        copy = xmlCompactNodeCopy(cdoc, cur, doc);
+        if (copy == NULL)
+            goto error;
+        if (xmlAddChild((xmlNodePtr) doc, copy) == NULL) {
+            xmlFreeNode(copy);
+            goto error;
+        }
+    }
+
+    return(doc);
+
+error:
+    xmlFreeDoc(doc);
+    return(NULL);
+}
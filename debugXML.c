@@ -24,6 +24,7 @@
 #include <libxml/xmlerror.h>
 
 #include "private/error.h"
+#include "private/tree.h"
 
 #define DUMP_TEXT_TYPE 1
 
@@ -842,6 +843,9 @@ xmlCtxtDumpOneNode(xmlDebugCtxtPtr ctxt, xmlNodePtr node)
 
     switch (node->type) {
         case XML_ELEMENT_NODE:
+            if (xmlLazyMaterialize(node, XML_LAZY_ATTRS |
+                                         XML_LAZY_CONTENT) < 0)
+                xmlDebugErr(ctxt, XML_ERR_NO_MEMORY, "out of memory\n");
             if (!ctxt->check) {
                 xmlCtxtDumpSpaces(ctxt);
                 fprintf(ctxt->output, "ELEMENT ");
@@ -27,6 +27,7 @@
 #include "private/dict.h"
 #include "private/error.h"
 #include "private/globals.h"
+#include "private/memory.h"
 #include "private/threads.h"
 
 #include <libxml/parser.h>
@@ -66,12 +67,19 @@ struct _xmlDict {
     size_t size;
     unsigned int nbElems;
     xmlDictStringsPtr strings;
+    /* full string pools moved from other dictionaries, sorted by address */
+    xmlDictStringsPtr *merged;
+    int nbMerged;
+    int maxMerged;
+    size_t mergedSize;
 
     struct _xmlDict *subdict;
     /* used for randomization */
     unsigned seed;
     /* used to impose a limit on size */
     size_t limit;
+    /* read-only, safe for concurrent lookups */
+    int frozen;
 };
 
 /*
@@ -131,7 +139,7 @@ xmlDictAddString(xmlDictPtr dict, const xmlChar *name, unsigned int namelen) {
     xmlDictStringsPtr pool;
     const xmlChar *ret;
     size_t size = 0; /* + sizeof(_xmlDictStrings) == 1024 */
-    size_t limit = 0;
+    size_t limit = dict->mergedSize;
 
     pool = dict->strings;
     while (pool != NULL) {
@@ -200,7 +208,7 @@ xmlDictAddQString(xmlDictPtr dict, const xmlChar *prefix, unsigned int plen,
     xmlDictStringsPtr pool;
     const xmlChar *ret;
     size_t size = 0; /* + sizeof(_xmlDictStrings) == 1024 */
-    size_t limit = 0;
+    size_t limit = dict->mergedSize;
 
     pool = dict->strings;
     while (pool != NULL) {
@@ -265,7 +273,12 @@ xmlDictCreate(void) {
     dict->nbElems = 0;
     dict->table = NULL;
     dict->strings = NULL;
+    dict->merged = NULL;
+    dict->nbMerged = 0;
+    dict->maxMerged = 0;
+    dict->mergedSize = 0;
     dict->subdict = NULL;
+    dict->frozen = 0;
     dict->seed = xmlRandom();
 #ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
     dict->seed = 0;
@@ -294,6 +307,43 @@ xmlDictCreateSub(xmlDict *sub) {
     return(dict);
 }
 
+/**
+ * Make a dictionary read-only. Lookups of strings which aren't
+ * already in the dictionary fail and return NULL afterwards.
+ *
+ * Since a frozen dictionary is never modified, it can be shared
+ * between threads without locking. The typical use is to fill a
+ * dictionary with the names of known vocabularies, freeze it and
+ * create a sub-dictionary with xmlDictCreateSub() for each parser.
+ * New strings are then added to the sub-dictionaries, and names
+ * found in the frozen dictionary have the same address in all
+ * documents.
+ *
+ * Freezing must happen before the dictionary is shared. It can't
+ * be undone.
+ *
+ * @since 2.16.0
+ *
+ * @param dict  the dictionary
+ * @returns 0 on success or -1 if `dict` is NULL.
+ */
+int
+xmlDictFreeze(xmlDict *dict) {
+    if (dict == NULL)
+        return(-1);
+    dict->frozen = 1;
+    return(0);
+}
+
+/**
+ * @param dict  the dictionary
+ * @returns 1 if the dictionary is frozen, 0 otherwise.
+ */
+int
+xmlDictIsFrozen(const xmlDict *dict) {
+    return((dict != NULL) && (dict->frozen));
+}
+
 /**
  * Increment the reference counter of a dictionary
  *
@@ -318,6 +368,7 @@ xmlDictReference(xmlDict *dict) {
 void
 xmlDictFree(xmlDict *dict) {
     xmlDictStringsPtr pool, nextp;
+    int i;
 
     if (dict == NULL)
 	return;
@@ -345,6 +396,9 @@ xmlDictFree(xmlDict *dict) {
 	xmlFree(pool);
 	pool = nextp;
     }
+    for (i = 0; i < dict->nbMerged; i++)
+        xmlFree(dict->merged[i]);
+    xmlFree(dict->merged);
     xmlFree(dict);
 }
 
@@ -368,6 +422,21 @@ xmlDictOwns(xmlDict *dict, const xmlChar *str) {
 	    return(1);
 	pool = pool->next;
     }
+    if (dict->nbMerged > 0) {
+        int lo = 0, hi = dict->nbMerged;
+
+        /* Find the last merged pool starting at or before str */
+        while (lo < hi) {
+            int mid = lo + (hi - lo) / 2;
+
+            if (&dict->merged[mid]->array[0] <= str)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if ((lo > 0) && (str <= dict->merged[lo-1]->free))
+            return(1);
+    }
     if (dict->subdict)
         return(xmlDictOwns(dict->subdict, str));
     return(0);
@@ -427,7 +496,7 @@ xmlDictGetUsage(xmlDict *dict) {
         limit += pool->size;
 	pool = pool->next;
     }
-    return(limit);
+    return(limit + dict->mergedSize);
 }
 
 /*****************************************************************
@@ -652,6 +721,99 @@ done:
     return(0);
 }
 
+/**
+ * Insert a new entry at the location returned by xmlDictFindEntry.
+ *
+ * @param dict  dict
+ * @param entry  location of the new entry
+ * @param hashValue  hash value of the string
+ * @param name  string owned by the dictionary
+ */
+static void
+xmlDictInsertEntry(xmlDictPtr dict, xmlDictEntry *entry, unsigned hashValue,
+                   const xmlChar *name) {
+    /*
+     * Shift the remainder of the probe sequence to the right
+     */
+    if (entry->hashValue != 0) {
+        const xmlDictEntry *end = &dict->table[dict->size];
+        const xmlDictEntry *cur = entry;
+
+        do {
+            cur++;
+            if (cur >= end)
+                cur = dict->table;
+        } while (cur->hashValue != 0);
+
+        if (cur < entry) {
+            /*
+             * If we traversed the end of the buffer, handle the part
+             * at the start of the buffer.
+             */
+            memmove(&dict->table[1], dict->table,
+                    (char *) cur - (char *) dict->table);
+            cur = end - 1;
+            dict->table[0] = *cur;
+        }
+
+        memmove(&entry[1], entry, (char *) cur - (char *) entry);
+    }
+
+    /*
+     * Populate entry
+     */
+    entry->hashValue = hashValue;
+    entry->name = name;
+
+    dict->nbElems++;
+}
+
+/**
+ * Search the parent dictionary and its ancestors. The hash value is
+ * only recomputed if the seeds differ.
+ *
+ * @param dict  dict
+ * @param prefix  optional QName prefix
+ * @param name  string
+ * @param klen  length of the key
+ * @param hashValue  hash value of the key with the seed of `dict`
+ * @param pfound  set to 1 if the entry was found
+ * @returns the entry or NULL
+ */
+static xmlDictEntry *
+xmlDictFindSubEntry(const xmlDict *dict, const xmlChar *prefix,
+                    const xmlChar *name, int klen, unsigned hashValue,
+                    int *pfound) {
+    const xmlDict *sub;
+    unsigned seed = dict->seed;
+
+    *pfound = 0;
+
+    for (sub = dict->subdict; sub != NULL; sub = sub->subdict) {
+        xmlDictEntry *entry;
+
+        if (sub->size == 0)
+            continue;
+
+        if (sub->seed != seed) {
+            size_t len, plen;
+
+            seed = sub->seed;
+            if (prefix == NULL)
+                hashValue = xmlDictHashName(seed, name, klen, &len);
+            else
+                hashValue = xmlDictHashQName(seed, prefix, name,
+                                             &plen, &len);
+        }
+
+        entry = xmlDictFindEntry(sub, prefix, name, klen, hashValue, pfound);
+        if (*pfound)
+            return(entry);
+    }
+
+    return(NULL);
+}
+
 /**
  * Internal lookup and update function.
  *
@@ -691,6 +853,20 @@ xmlDictLookupInternal(xmlDict *dict, const xmlChar *prefix,
     if ((dict->limit > 0) && (klen >= dict->limit))
         return(NULL);
 
+    /*
+     * A frozen parent never gains strings, so it can be searched
+     * first. Names from a pre-populated vocabulary are then found
+     * with a single probe.
+     */
+    if ((dict->subdict != NULL) && (dict->subdict->frozen)) {
+        xmlDictEntry *subEntry;
+
+        subEntry = xmlDictFindSubEntry(dict, prefix, name, klen, hashValue,
+                                       &found);
+        if (found)
+            return(subEntry);
+    }
+
     /*
      * Check for an existing entry
      */
@@ -710,23 +886,16 @@ xmlDictLookupInternal(xmlDict *dict, const xmlChar *prefix,
         }
     }
 
-    if ((dict->subdict != NULL) && (dict->subdict->size > 0)) {
+    if ((dict->subdict != NULL) && (!dict->subdict->frozen)) {
         xmlDictEntry *subEntry;
-        unsigned subHashValue;
-
-        if (prefix == NULL)
-            subHashValue = xmlDictHashName(dict->subdict->seed, name, len,
-                                           &len);
-        else
-            subHashValue = xmlDictHashQName(dict->subdict->seed, prefix, name,
-                                            &plen, &len);
-        subEntry = xmlDictFindEntry(dict->subdict, prefix, name, klen,
-                                    subHashValue, &found);
+
+        subEntry = xmlDictFindSubEntry(dict, prefix, name, klen, hashValue,
+                                       &found);
         if (found)
             return(subEntry);
     }
 
-    if (!update)
+    if ((!update) || (dict->frozen))
         return(NULL);
 
     /*
@@ -763,42 +932,153 @@ xmlDictLookupInternal(xmlDict *dict, const xmlChar *prefix,
     if (ret == NULL)
         return(NULL);
 
-    /*
-     * Shift the remainder of the probe sequence to the right
-     */
-    if (entry->hashValue != 0) {
-        const xmlDictEntry *end = &dict->table[dict->size];
-        const xmlDictEntry *cur = entry;
+    xmlDictInsertEntry(dict, entry, hashValue, ret);
 
-        do {
-            cur++;
-            if (cur >= end)
-                cur = dict->table;
-        } while (cur->hashValue != 0);
+    return(entry);
+}
 
-        if (cur < entry) {
-            /*
-             * If we traversed the end of the buffer, handle the part
-             * at the start of the buffer.
-             */
-            memmove(&dict->table[1], dict->table,
-                    (char *) cur - (char *) dict->table);
-            cur = end - 1;
-            dict->table[0] = *cur;
-        }
+/**
+ * Add a string pool to the sorted array of merged pools.
+ *
+ * @param dict  the dictionary
+ * @param pool  the pool
+ * @returns 0 on success or -1 if a memory allocation failed.
+ */
+static int
+xmlDictAddMergedPool(xmlDictPtr dict, xmlDictStringsPtr pool) {
+    int i;
+
+    if (dict->nbMerged >= dict->maxMerged) {
+        xmlDictStringsPtr *tmp;
+        int newSize;
+
+        newSize = xmlGrowCapacity(dict->maxMerged, sizeof(tmp[0]),
+                                  16, XML_MAX_ITEMS);
+        if (newSize < 0)
+            return(-1);
+        tmp = xmlRealloc(dict->merged, newSize * sizeof(tmp[0]));
+        if (tmp == NULL)
+            return(-1);
+        dict->merged = tmp;
+        dict->maxMerged = newSize;
+    }
 
-        memmove(&entry[1], entry, (char *) cur - (char *) entry);
+    i = dict->nbMerged;
+    while ((i > 0) && (dict->merged[i-1] > pool)) {
+        dict->merged[i] = dict->merged[i-1];
+        i--;
     }
+    dict->merged[i] = pool;
+    dict->nbMerged++;
+    dict->mergedSize += pool->size;
 
-    /*
-     * Populate entry
-     */
-    entry->hashValue = hashValue;
-    entry->name = ret;
+    return(0);
+}
 
-    dict->nbElems++;
+/**
+ * Move the strings of `other` to `dict`. The strings keep their
+ * addresses and stay valid as long as `dict` is alive. If a string
+ * was already in `dict`, lookups keep returning the old copy and
+ * the function returns 1. Callers must then look up strings of
+ * `other` in `dict` again to get addresses which compare equal.
+ * Creating `other` with xmlDictCreateSub() from `dict` avoids this
+ * for strings which were in `dict` before.
+ *
+ * The string pools of `other` are kept in a sorted array, so
+ * merging many dictionaries doesn't slow down xmlDictOwns or adding
+ * strings.
+ *
+ * `other` is left empty and should be freed. This also happens if
+ * growing the hash table fails, so the strings are always owned by
+ * `dict`, but some of them can't be found with lookups then.
+ *
+ * @param dict  the destination dictionary
+ * @param other  the dictionary to empty
+ * @returns 0 on success, 1 if some strings were duplicates or -1 if
+ * a memory allocation failed.
+ */
+int
+xmlDictMerge(xmlDict *dict, xmlDict *other) {
+    xmlDictStringsPtr *last;
+    size_t i;
+    int j;
+    int ret = 0;
+    int dup = 0;
 
-    return(entry);
+    if ((dict == NULL) || (other == NULL) || (dict == other) ||
+        (dict->frozen))
+        return(-1);
+
+    for (i = 0; i < other->size; i++) {
+        const xmlDictEntry *oentry = &other->table[i];
+        xmlDictEntry *entry;
+        unsigned hashValue;
+        size_t len;
+        int found;
+
+        if (oentry->hashValue == 0)
+            continue;
+
+        if (dict->nbElems + 1 > dict->size / MAX_FILL_DENOM * MAX_FILL_NUM) {
+            unsigned newSize;
+
+            newSize = (dict->size == 0) ? MIN_HASH_SIZE : dict->size * 2;
+            if ((dict->size >= MAX_HASH_SIZE) ||
+                (xmlDictGrow(dict, newSize) != 0)) {
+                ret = -1;
+                break;
+            }
+        }
+
+        hashValue = xmlDictHashName(dict->seed, oentry->name, SIZE_MAX,
+                                    &len);
+        entry = xmlDictFindEntry(dict, NULL, oentry->name, len, hashValue,
+                                 &found);
+        if (!found)
+            xmlDictInsertEntry(dict, entry, hashValue, oentry->name);
+        else if (entry->name != oentry->name)
+            dup = 1;
+    }
+
+    /* Move the string pools, so xmlDictOwns works */
+    while (other->strings != NULL) {
+        xmlDictStringsPtr pool = other->strings;
+
+        if (xmlDictAddMergedPool(dict, pool) < 0)
+            break;
+        other->strings = pool->next;
+    }
+    for (j = 0; j < other->nbMerged; j++) {
+        if (xmlDictAddMergedPool(dict, other->merged[j]) < 0)
+            break;
+    }
+    if ((other->strings != NULL) || (j < other->nbMerged)) {
+        /* Fall back to the list of pools */
+        last = &dict->strings;
+        while (*last != NULL)
+            last = &(*last)->next;
+        *last = other->strings;
+        other->strings = NULL;
+        for (; j < other->nbMerged; j++) {
+            other->merged[j]->next = *last;
+            *last = other->merged[j];
+        }
+        ret = -1;
+    }
+    xmlFree(other->merged);
+    other->merged = NULL;
+    other->nbMerged = 0;
+    other->maxMerged = 0;
+    other->mergedSize = 0;
+
+    xmlFree(other->table);
+    other->table = NULL;
+    other->size = 0;
+    other->nbElems = 0;
+
+    if ((ret == 0) && (dup))
+        ret = 1;
+    return(ret);
 }
 
 /**
@@ -45,6 +45,7 @@
 #include "private/enc.h"
 #include "private/error.h"
 #include "private/memory.h"
+#include "private/simd.h"
 
 #ifdef LIBXML_ICU_ENABLED
 #include <unicode/ucnv.h>
@@ -2299,17 +2300,13 @@ asciiToAscii(void *vctxt ATTRIBUTE_UNUSED,
     *poutlen = inlen;
     *pinlen = inlen;
 
-    while (in < inend) {
-	unsigned c = *in;
-
-        if (c >= 0x80) {
-	    *poutlen = in - instart;
-	    *pinlen = in - instart;
-	    return(XML_ENC_ERR_INPUT);
-	}
+    in = xmlSimdSkipAscii(in, inend);
+    memcpy(out, instart, in - instart);
 
-        in++;
-	*out++ = c;
+    if (in < inend) {
+        *poutlen = in - instart;
+        *pinlen = in - instart;
+        return(XML_ENC_ERR_INPUT);
     }
 
     return(ret);
@@ -2336,9 +2333,20 @@ latin1ToUTF8(void *vctxt ATTRIBUTE_UNUSED,
         unsigned c = *in;
 
 	if (c < 0x80) {
+            const unsigned char *run;
+
             if (out >= outend)
                 goto done;
-            *out++ = c;
+
+            /* Copy the whole ASCII run */
+            if (inend - in > outend - out)
+                run = xmlSimdSkipAscii(in, in + (outend - out));
+            else
+                run = xmlSimdSkipAscii(in, inend);
+            memcpy(out, in, run - in);
+            out += run - in;
+            in = run;
+            continue;
 	} else {
             if (outend - out < 2)
                 goto done;
@@ -2438,7 +2446,17 @@ UTF8ToLatin1(void *vctxt ATTRIBUTE_UNUSED,
 	c = *in;
 
         if (c < 0x80) {
-            *out++ = c;
+            const unsigned char *run;
+
+            /* Copy the whole ASCII run */
+            if (inend - in > outend - out)
+                run = xmlSimdSkipAscii(in, in + (outend - out));
+            else
+                run = xmlSimdSkipAscii(in, inend);
+            memcpy(out, in, run - in);
+            out += run - in;
+            in = run;
+            continue;
         } else if ((c >= 0xC2) && (c <= 0xC3)) {
             if (inend - in < 2)
                 break;
@@ -2500,11 +2518,20 @@ UTF16LEToUTF8(void *vctxt ATTRIBUTE_UNUSED,
         c = in[0] | (in[1] << 8);
 
         if (c < 0x80) {
+            int n;
+
             if (out >= outend)
                 goto done;
             out[0] = c;
             in += 2;
             out += 1;
+
+            n = (inend - in) / 2;
+            if (n > outend - out)
+                n = outend - out;
+            n = xmlSimdUtf16ToAscii(out, in, n, /* bigEndian */ 0);
+            in += 2 * n;
+            out += n;
         } else if (c < 0x800) {
             if (outend - out < 2)
                 goto done;
@@ -2580,12 +2607,21 @@ UTF8ToUTF16LE(void *vctxt ATTRIBUTE_UNUSED,
         c = in[0];
 
         if (c < 0x80) {
+            int n;
+
             if (out >= outend)
                 goto done;
             out[0] = c;
             out[1] = 0;
             in += 1;
             out += 2;
+
+            n = inend - in;
+            if (n > (outend - out) / 2)
+                n = (outend - out) / 2;
+            n = xmlSimdAsciiToUtf16(out, in, n, /* bigEndian */ 0);
+            in += n;
+            out += 2 * n;
         } else {
             int i, len;
             unsigned min;
@@ -2697,11 +2733,20 @@ UTF16BEToUTF8(void *vctxt ATTRIBUTE_UNUSED,
         c = (in[0] << 8) | in[1];
 
         if (c < 0x80) {
+            int n;
+
             if (out >= outend)
                 goto done;
             out[0] = c;
             in += 2;
             out += 1;
+
+            n = (inend - in) / 2;
+            if (n > outend - out)
+                n = outend - out;
+            n = xmlSimdUtf16ToAscii(out, in, n, /* bigEndian */ 1);
+            in += 2 * n;
+            out += n;
         } else if (c < 0x800) {
             if (outend - out < 2)
                 goto done;
@@ -2776,12 +2821,21 @@ UTF8ToUTF16BE(void *vctxt ATTRIBUTE_UNUSED,
         c = in[0];
 
         if (c < 0x80) {
+            int n;
+
             if (out >= outend)
                 goto done;
             out[0] = 0;
             out[1] = c;
             in += 1;
             out += 2;
+
+            n = inend - in;
+            if (n > (outend - out) / 2)
+                n = (outend - out) / 2;
+            n = xmlSimdAsciiToUtf16(out, in, n, /* bigEndian */ 1);
+            in += n;
+            out += 2 * n;
         } else {
             int i, len;
             unsigned min;
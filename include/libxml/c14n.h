@@ -26,6 +26,9 @@
 
 #include <libxml/tree.h>
 #include <libxml/xpath.h>
+#ifdef LIBXML_READER_ENABLED
+#include <libxml/xmlreader.h>
+#endif
 
 #ifdef __cplusplus
 extern "C" {
@@ -82,6 +85,15 @@ XMLPUBFUN int
 					 const char* filename,
 					 int compression);
 
+#ifdef LIBXML_READER_ENABLED
+XMLPUBFUN int
+		xmlC14NReaderSaveTo	(xmlTextReader *reader,
+					 int mode, /* a xmlC14NMode */
+					 xmlChar **inclusive_ns_prefixes,
+					 int with_comments,
+					 xmlOutputBuffer *buf);
+#endif /* LIBXML_READER_ENABLED */
+
 
 /**
  * This is the core C14N function
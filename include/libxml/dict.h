@@ -50,6 +50,8 @@ XMLPUBFUN int
 			xmlDictReference(xmlDict *dict);
 XMLPUBFUN void
 			xmlDictFree	(xmlDict *dict);
+XMLPUBFUN int
+			xmlDictFreeze	(xmlDict *dict);
 
 /*
  * Lookup of entry in the dictionary.
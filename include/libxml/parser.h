@@ -89,7 +89,16 @@ typedef enum {
     /** Allow network access. Unused internally. */
     XML_INPUT_NETWORK               = (1 << 4),
     /** Allow system catalog to resolve URIs. */
-    XML_INPUT_USE_SYS_CATALOG       = (1 << 5)
+    XML_INPUT_USE_SYS_CATALOG       = (1 << 5),
+    /**
+     * Memory-map large regular files instead of reading them, if
+     * supported by the platform. The file must not be truncated
+     * while the input is in use. Accessing the mapped data beyond
+     * the end of the file raises SIGBUS.
+     *
+     * @since 2.16.0
+     */
+    XML_INPUT_MMAP                  = (1 << 6)
 } xmlParserInputFlags;
 
 /* Deprecated */
@@ -641,6 +650,12 @@ struct _xmlParserCtxt {
 
     xmlCharEncConvImpl convImpl XML_DEPRECATED_MEMBER;
     void *convCtxt XML_DEPRECATED_MEMBER;
+
+    /* build lazy trees, see xmlCtxtSetLazyTree */
+    int lazyTree XML_DEPRECATED_MEMBER;
+
+    /* compact document builder, see xmlCtxtParseCompact */
+    void *compactBuilder XML_DEPRECATED_MEMBER;
 };
 
 /**
@@ -1626,6 +1641,17 @@ XMLPUBFUN int
 					 const char *chunk,
 					 int size,
 					 int terminate);
+XMLPUBFUN int
+		xmlParseChunkInPlace	(xmlParserCtxt *ctxt,
+					 char *chunk,
+					 int size,
+					 int terminate);
+XMLPUBFUN int
+		xmlParseChunks		(xmlParserCtxt *ctxt,
+					 char **chunks,
+					 const int *sizes,
+					 int nbChunks,
+					 int terminate);
 #endif /* LIBXML_PUSH_ENABLED */
 
 /*
@@ -1884,7 +1910,45 @@ typedef enum {
      *
      * @since 2.15.0
      */
-    XML_PARSE_SKIP_IDS = 1<<27
+    XML_PARSE_SKIP_IDS = 1<<27,
+    /**
+     * Allocate nodes and text content of the document from an arena
+     * which is released at once when the document is freed. Moving
+     * nodes to another document keeps the arena alive until both
+     * documents are freed. Moving nodes out of the document into a
+     * tree without a document fails, see xmlSetTreeDoc.
+     *
+     * @since 2.16.0
+     */
+    XML_PARSE_ARENA = 1<<28,
+    /**
+     * Parse the children of the root element in multiple threads.
+     * The input is read in windows of about one megabyte per thread,
+     * which are split at the start tags of children of the root
+     * element, and the parts are parsed concurrently. Only used when
+     * building a tree with the default SAX handlers. Documents with a
+     * DTD are parsed serially, so is the rest of a document after an
+     * error. One thread per CPU is used unless the environment
+     * variable XML_PARALLEL_THREADS sets another number.
+     *
+     * @since 2.16.0
+     */
+    XML_PARSE_PARALLEL = 1<<29,
+    /**
+     * Share parsed external subsets between documents and threads.
+     * DTDs are cached by public and resolved system identifier and
+     * reused if the internal subset has no declarations. Documents
+     * must not modify a shared DTD.
+     *
+     * The cache is bypassed if the parser context has a resource
+     * loader, a custom resolveEntity SAX handler or local catalogs.
+     * Cached DTDs are never reloaded, so later changes to the DTD
+     * files, the global entity loader or the global catalogs aren't
+     * picked up until #xmlCleanupDtdCache is called.
+     *
+     * @since 2.16.0
+     */
+    XML_PARSE_DTD_CACHE = 1<<30
 } xmlParserOption;
 
 XMLPUBFUN void
@@ -1980,6 +2044,9 @@ XMLPUBFUN void
 XMLPUBFUN void
 		xmlCtxtSetMaxAmplification(xmlParserCtxt *ctxt,
 					 unsigned maxAmpl);
+XMLPUBFUN void
+		xmlCtxtSetLazyTree	(xmlParserCtxt *ctxt,
+					 int lazy);
 XMLPUBFUN xmlDoc *
 		xmlReadDoc		(const xmlChar *cur,
 					 const char *URL,
@@ -2007,9 +2074,31 @@ XMLPUBFUN xmlDoc *
 					 const char *URL,
 					 const char *encoding,
 					 int options);
+XMLPUBFUN xmlDoc *
+		xmlReadBinary		(const char *buffer,
+					 size_t size,
+					 int options);
+XMLPUBFUN xmlDoc *
+		xmlReadBinaryFile	(const char *filename,
+					 int options);
 XMLPUBFUN xmlDoc *
 		xmlCtxtParseDocument	(xmlParserCtxt *ctxt,
 					 xmlParserInput *input);
+XMLPUBFUN xmlCompactDoc *
+		xmlCtxtParseCompact	(xmlParserCtxt *ctxt,
+					 xmlParserInput *input);
+XMLPUBFUN xmlCompactDoc *
+		xmlCtxtReadCompactFile	(xmlParserCtxt *ctxt,
+					 const char *filename,
+					 const char *encoding,
+					 int options);
+XMLPUBFUN xmlCompactDoc *
+		xmlCtxtReadCompactMemory(xmlParserCtxt *ctxt,
+					 const char *buffer,
+					 int size,
+					 const char *URL,
+					 const char *encoding,
+					 int options);
 XMLPUBFUN xmlNode *
 		xmlCtxtParseContent	(xmlParserCtxt *ctxt,
 					 xmlParserInput *input,
@@ -61,6 +61,10 @@ XMLPUBFUN int
 XMLPUBFUN int
 			xmlPatternMatch		(xmlPattern *comp,
 						 xmlNode *node);
+XMLPUBFUN int
+			xmlPatternSelectCompact	(xmlPattern *comp,
+						 const xmlCompactDoc *doc,
+						 unsigned **nodesOut);
 
 /** State object for streaming interface */
 typedef struct _xmlStreamCtxt xmlStreamCtxt;
@@ -775,7 +775,12 @@ typedef enum {
     /** built for internal processing */
     XML_DOC_INTERNAL		= 1<<6,
     /** parsed or built HTML document */
-    XML_DOC_HTML		= 1<<7
+    XML_DOC_HTML		= 1<<7,
+    /**
+     * elements can have deferred attributes and content, see
+     * #xmlCtxtSetLazyTree
+     */
+    XML_DOC_LAZY		= 1<<8
 } xmlDocProperties;
 
 /** XML or HTML document */
@@ -844,8 +849,26 @@ struct _xmlDoc {
     int             parseFlags;
     /** xmlDocProperties of the document */
     int             properties;
+    /** private: arena used to allocate nodes if any */
+    struct _xmlDocArena *arena;
+    /** private: incremented when the tree is modified */
+    unsigned long generation;
+    /** private: XPath data like the document order index if any */
+    struct _xmlXPathDocData *xpathData;
 };
 
+/**
+ * A read-only document stored as arrays of node records with 32-bit
+ * links instead of xmlNode structs, see #xmlCtxtParseCompact.
+ *
+ * Nodes are identified by unsigned indices in document order. 0
+ * means "no node". The attributes and namespace declarations of an
+ * element are nodes of type XML_ATTRIBUTE_NODE and
+ * XML_NAMESPACE_DECL.
+ *
+ * The structure is opaque.
+ */
+typedef struct _xmlCompactDoc xmlCompactDoc;
 
 /** Context for DOM wrapper operations */
 typedef struct _xmlDOMWrapCtxt xmlDOMWrapCtxt;
@@ -1271,6 +1294,8 @@ XMLPUBFUN int
 XMLPUBFUN int
 		xmlBufGetNodeContent	(xmlBuf *buf,
 					 const xmlNode *cur);
+XMLPUBFUN int
+		xmlNodeMaterialize	(xmlNode *node);
 
 XMLPUBFUN xmlChar *
 		xmlNodeGetLang		(const xmlNode *cur);
@@ -1474,6 +1499,59 @@ XMLPUBFUN xmlNode *
 XMLPUBFUN xmlNode *
             xmlPreviousElementSibling   (xmlNode *node);
 
+/*
+ * Read-only compact documents.
+ */
+XMLPUBFUN void
+		xmlFreeCompactDoc	(xmlCompactDoc *doc);
+XMLPUBFUN struct _xmlDict *
+		xmlCompactDocGetDict	(const xmlCompactDoc *doc);
+XMLPUBFUN unsigned
+		xmlCompactDocGetRootElement(const xmlCompactDoc *doc);
+XMLPUBFUN size_t
+		xmlCompactDocGetMemory	(const xmlCompactDoc *doc);
+XMLPUBFUN int
+		xmlCompactNodeGetType	(const xmlCompactDoc *doc,
+					 unsigned node);
+XMLPUBFUN const xmlChar *
+		xmlCompactNodeGetName	(const xmlCompactDoc *doc,
+					 unsigned node);
+XMLPUBFUN const xmlChar *
+		xmlCompactNodeGetPrefix	(const xmlCompactDoc *doc,
+					 unsigned node);
+XMLPUBFUN const xmlChar *
+		xmlCompactNodeGetNsURI	(const xmlCompactDoc *doc,
+					 unsigned node);
+XMLPUBFUN unsigned
+		xmlCompactNodeGetParent	(const xmlCompactDoc *doc,
+					 unsigned node);
+XMLPUBFUN unsigned
+		xmlCompactNodeGetFirstChild(const xmlCompactDoc *doc,
+					 unsigned node);
+XMLPUBFUN unsigned
+		xmlCompactNodeGetNext	(const xmlCompactDoc *doc,
+					 unsigned node);
+XMLPUBFUN unsigned
+		xmlCompactNodeGetAttributes(const xmlCompactDoc *doc,
+					 unsigned node);
+XMLPUBFUN const xmlChar *
+		xmlCompactNodeGetValue	(const xmlCompactDoc *doc,
+					 unsigned node);
+XMLPUBFUN xmlChar *
+		xmlCompactNodeGetContent(const xmlCompactDoc *doc,
+					 unsigned node);
+XMLPUBFUN const xmlChar *
+		xmlCompactNodeGetProp	(const xmlCompactDoc *doc,
+					 unsigned node,
+					 const xmlChar *name,
+					 const xmlChar *nsURI);
+XMLPUBFUN xmlNode *
+		xmlCompactNodeCopy	(const xmlCompactDoc *cdoc,
+					 unsigned node,
+					 xmlDoc *doc);
+XMLPUBFUN xmlDoc *
+		xmlCompactDocCopy	(const xmlCompactDoc *cdoc);
+
 XML_DEPRECATED
 XMLPUBFUN xmlRegisterNodeFunc
 	    xmlRegisterNodeDefault	(xmlRegisterNodeFunc func);
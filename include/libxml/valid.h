@@ -277,6 +277,10 @@ XMLPUBFUN xmlList *
 		xmlGetRefs	       (xmlDoc *doc,
 					const xmlChar *ID);
 
+/* Shared DTD cache */
+XMLPUBFUN void
+		xmlCleanupDtdCache     (void);
+
 /**
  * The public function calls related to validity checking.
  */
@@ -117,6 +117,16 @@ XMLPUBFUN long
 XMLPUBFUN long
 		xmlSaveTree		(xmlSaveCtxt *ctxt,
 					 xmlNode *node);
+XMLPUBFUN long
+		xmlSaveCompactDoc	(xmlSaveCtxt *ctxt,
+					 const xmlCompactDoc *doc);
+XMLPUBFUN long
+		xmlSaveCompactTree	(xmlSaveCtxt *ctxt,
+					 const xmlCompactDoc *doc,
+					 unsigned node);
+XMLPUBFUN int
+		xmlSaveBinary		(xmlOutputBuffer *buf,
+					 xmlDoc *doc);
 
 XMLPUBFUN int
 		xmlSaveFlush		(xmlSaveCtxt *ctxt);
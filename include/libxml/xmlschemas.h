@@ -70,10 +70,17 @@ typedef enum {
  * This is the set of XML Schema validation options.
  */
 typedef enum {
-    XML_SCHEMA_VAL_VC_I_CREATE			= 1<<0
+    XML_SCHEMA_VAL_VC_I_CREATE			= 1<<0,
 	/* Default/fixed: create an attribute node
 	* or an element's text node on the instance.
 	*/
+    XML_SCHEMA_VAL_PARALLEL			= 1<<2
+	/* Validate the children of the root element
+	* of a tree in multiple threads. The environment
+	* variable XML_PARALLEL_THREADS overrides the
+	* number of CPUs.
+	* Since 2.16.0
+	*/
 } xmlSchemaValidOption;
 
 /*
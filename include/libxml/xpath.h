@@ -239,6 +239,26 @@ typedef xmlXPathFunction (*xmlXPathFuncLookupFunc) (void *ctxt,
  * forbid variables in expression
  */
 #define XML_XPATH_NOVAR	  (1<<1)
+/**
+ * sort large node sets with multiple threads, one per CPU unless
+ * the environment variable XML_PARALLEL_THREADS is set
+ *
+ * @since 2.16.0
+ */
+#define XML_XPATH_PARALLEL_SORT (1<<2)
+/**
+ * answer descendant name tests with a per-document element name index
+ *
+ * @since 2.16.0
+ */
+#define XML_XPATH_NAME_INDEX (1<<3)
+/**
+ * answer "[@name = 'value']" predicates with a per-document attribute
+ * value index
+ *
+ * @since 2.16.0
+ */
+#define XML_XPATH_ATTR_INDEX (1<<4)
 
 /**
  * Expression evaluation occurs with respect to a context.
@@ -354,6 +374,9 @@ struct _xmlXPathContext {
     unsigned long opLimit;
     unsigned long opCount;
     int depth;
+
+    /* Cache of evaluation results */
+    void *resultCache;
 };
 
 /** Compiled XPath expression */
@@ -518,6 +541,9 @@ XMLPUBFUN int
 				            int active,
 					    int value,
 					    int options);
+XMLPUBFUN int
+		    xmlXPathContextSetResultCache(xmlXPathContext *ctxt,
+						  int maxEntries);
 /**
  * Evaluation functions.
  */
@@ -553,6 +579,13 @@ XMLPUBFUN xmlXPathObject *
 XMLPUBFUN int
 		    xmlXPathCompiledEvalToBoolean(xmlXPathCompExpr *comp,
 						 xmlXPathContext *ctxt);
+XMLPUBFUN int
+		    xmlXPathCompiledEvalMany	(xmlXPathCompExpr **comps,
+						 int nbComps,
+						 xmlXPathContext *ctxt,
+						 xmlXPathObject **results);
+XMLPUBFUN int
+		    xmlXPathCompiledSpecialize	(xmlXPathCompExpr *comp);
 XMLPUBFUN void
 		    xmlXPathFreeCompExpr	(xmlXPathCompExpr *comp);
 
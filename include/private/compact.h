@@ -0,0 +1,59 @@
+#ifndef XML_COMPACT_H_PRIVATE__
+#define XML_COMPACT_H_PRIVATE__
+
+#include <libxml/tree.h>
+#include <libxml/hash.h>
+
+/*
+ * The document node of a compact document. Index 0 is unused so
+ * that 0 can mean "no node" in the link arrays.
+ */
+#define XML_COMPACT_DOC_NODE 1
+
+/*
+ * Interned name of elements, attributes and PI targets. For namespace
+ * declarations, `name` is the prefix and `href` the namespace URI.
+ */
+typedef struct _xmlCompactName xmlCompactName;
+struct _xmlCompactName {
+    const xmlChar *name;
+    const xmlChar *prefix;
+    const xmlChar *href;
+};
+
+/*
+ * Nodes are stored in document order as a structure of arrays. The
+ * attributes and namespace declarations of an element follow the
+ * element and are linked through `nexts`, starting from `data`.
+ */
+struct _xmlCompactDoc {
+    xmlDict *dict;
+    xmlChar *URL;
+    xmlChar *version;
+    xmlChar *encoding;
+    int standalone;
+
+    unsigned nbNodes;
+    unsigned maxNodes;
+    unsigned char *types;
+    /* index into nameTab */
+    unsigned *names;
+    unsigned *parents;
+    unsigned *children;
+    unsigned *nexts;
+    /* first attribute of elements, offset into text otherwise */
+    unsigned *data;
+
+    xmlCompactName *nameTab;
+    unsigned nbNames;
+    unsigned maxNames;
+    /* only used while parsing */
+    xmlHashTable *nameHash;
+
+    /* null-terminated strings, offset 0 is the empty string */
+    xmlChar *text;
+    unsigned textSize;
+    unsigned textMax;
+};
+
+#endif /* XML_COMPACT_H_PRIVATE__ */
@@ -61,6 +61,10 @@ XML_HIDDEN unsigned
 xmlDictCombineHash(unsigned v1, unsigned v2);
 XML_HIDDEN xmlHashedString
 xmlDictLookupHashed(xmlDict *dict, const xmlChar *name, int len);
+XML_HIDDEN int
+xmlDictMerge(xmlDict *dict, xmlDict *other);
+XML_HIDDEN int
+xmlDictIsFrozen(const xmlDict *dict);
 
 XML_HIDDEN void
 xmlInitRandom(void);
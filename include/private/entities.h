@@ -15,10 +15,15 @@
  *
  * XML_ENT_VALIDATED: The entity contains a valid attribute value.
  * Only used when entities aren't substituted.
+ *
+ * XML_ENT_SHARED: The entity belongs to a DTD from the DTD cache which
+ * is shared between threads. It was parsed and checked in advance and
+ * must never be modified.
  */
 #define XML_ENT_PARSED      (1u << 0)
 #define XML_ENT_CHECKED     (1u << 1)
 #define XML_ENT_VALIDATED   (1u << 2)
 #define XML_ENT_EXPANDING   (1u << 3)
+#define XML_ENT_SHARED      (1u << 4)
 
 #endif /* XML_ENTITIES_H_PRIVATE__ */
@@ -40,6 +40,7 @@
 #define XML_INPUT_ENCODING_ERROR    (1u << 5)
 #define XML_INPUT_PROGRESSIVE       (1u << 6)
 #define XML_INPUT_MARKUP_DECL       (1u << 7)
+#define XML_INPUT_BORROWED          (1u << 8)
 
 #define PARSER_STOPPED(ctxt) ((ctxt)->disableSAX > 1)
 
@@ -159,6 +160,9 @@ xmlExpandEntitiesInAttValue(xmlParserCtxt *ctxt, const xmlChar *str,
 XML_HIDDEN void
 xmlParserCheckEOF(xmlParserCtxt *ctxt, xmlParserErrors code);
 
+XML_HIDDEN void
+xmlCtxtAddDtdDefaults(xmlParserCtxt *ctxt, xmlDtd *dtd);
+
 XML_HIDDEN void
 xmlParserInputGetWindow(xmlParserInput *input, const xmlChar **startOut,
                         int *sizeInOut, int *offsetOut);
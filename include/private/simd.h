@@ -0,0 +1,240 @@
+#ifndef XML_SIMD_H_PRIVATE__
+#define XML_SIMD_H_PRIVATE__
+
+#include "../../libxml.h"
+
+#include <string.h>
+
+#include <libxml/xmlstring.h>
+
+/*
+ * SSE2 is part of the x86-64 baseline, so there's no need for runtime
+ * detection. Other architectures use the portable word-at-a-time code
+ * below.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #define XML_SIMD_SSE2
+  #include <emmintrin.h>
+#endif
+
+#define XML_SIMD_WORD_ONES  ((uint64_t) 0x0101010101010101ull)
+#define XML_SIMD_WORD_HIGHS ((uint64_t) 0x8080808080808080ull)
+
+/*
+ * Nonzero if any byte in a 64-bit word is less than n (n <= 128).
+ */
+#define XML_SIMD_WORD_HAS_LESS(x, n) \
+    (((x) - XML_SIMD_WORD_ONES * (n)) & ~(x) & XML_SIMD_WORD_HIGHS)
+
+/*
+ * Nonzero if any byte in a 64-bit word equals c.
+ */
+#define XML_SIMD_WORD_HAS_BYTE(x, c) \
+    XML_SIMD_WORD_HAS_LESS((x) ^ (XML_SIMD_WORD_ONES * (c)), 1)
+
+#ifdef XML_SIMD_SSE2
+static XML_INLINE int
+xmlSimdFirstBit(unsigned mask) {
+#if defined(__GNUC__) || defined(__clang__)
+    return(__builtin_ctz(mask));
+#else
+    int i = 0;
+
+    while ((mask & 1) == 0) {
+        mask >>= 1;
+        i++;
+    }
+    return(i);
+#endif
+}
+#endif
+
+/**
+ * Skip a run of printable ASCII characters.
+ *
+ * Returns a pointer to the first byte in [cur, end) that is less than
+ * min, a non-ASCII byte or one of the delimiters d1, d2 and d3.
+ * Returns end if there's no such byte. With min set to 0x20, whitespace
+ * other than space stops the scan, so callers must still check the byte
+ * at the returned position against their own character classes.
+ *
+ * @param cur  start of the buffer
+ * @param end  end of the buffer
+ * @param min  smallest byte value allowed in the run (at most 0x80)
+ * @param d1  first delimiter
+ * @param d2  second delimiter
+ * @param d3  third delimiter
+ * @returns a pointer to the first byte which ends the run
+ */
+static XML_INLINE const xmlChar *
+xmlSimdSkipPlainAscii(const xmlChar *cur, const xmlChar *end, xmlChar min,
+                      xmlChar d1, xmlChar d2, xmlChar d3) {
+#ifdef XML_SIMD_SSE2
+    if (end - cur >= 16) {
+        const __m128i vmin = _mm_set1_epi8((char) min);
+        const __m128i v1 = _mm_set1_epi8((char) d1);
+        const __m128i v2 = _mm_set1_epi8((char) d2);
+        const __m128i v3 = _mm_set1_epi8((char) d3);
+
+        do {
+            __m128i v = _mm_loadu_si128((const __m128i *) cur);
+            __m128i m;
+            unsigned mask;
+
+            /* Signed compare also catches bytes >= 0x80 */
+            m = _mm_cmplt_epi8(v, vmin);
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, v1));
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, v2));
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(v, v3));
+            mask = _mm_movemask_epi8(m);
+            if (mask != 0)
+                return(cur + xmlSimdFirstBit(mask));
+            cur += 16;
+        } while (end - cur >= 16);
+    }
+#else
+    while (end - cur >= 8) {
+        uint64_t x;
+
+        memcpy(&x, cur, 8);
+        if ((XML_SIMD_WORD_HAS_LESS(x, min) |
+             (x & XML_SIMD_WORD_HIGHS) |
+             XML_SIMD_WORD_HAS_BYTE(x, d1) |
+             XML_SIMD_WORD_HAS_BYTE(x, d2) |
+             XML_SIMD_WORD_HAS_BYTE(x, d3)) != 0)
+            break;
+        cur += 8;
+    }
+#endif
+
+    while ((cur < end) &&
+           (*cur >= min) && (*cur < 0x80) &&
+           (*cur != d1) && (*cur != d2) && (*cur != d3))
+        cur++;
+
+    return(cur);
+}
+
+/**
+ * Skip ASCII bytes.
+ *
+ * @param cur  start of the buffer
+ * @param end  end of the buffer
+ * @returns a pointer to the first byte >= 0x80 or end
+ */
+static XML_INLINE const xmlChar *
+xmlSimdSkipAscii(const xmlChar *cur, const xmlChar *end) {
+#ifdef XML_SIMD_SSE2
+    while (end - cur >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) cur);
+        unsigned mask = _mm_movemask_epi8(v);
+
+        if (mask != 0)
+            return(cur + xmlSimdFirstBit(mask));
+        cur += 16;
+    }
+#else
+    while (end - cur >= 8) {
+        uint64_t x;
+
+        memcpy(&x, cur, 8);
+        if ((x & XML_SIMD_WORD_HIGHS) != 0)
+            break;
+        cur += 8;
+    }
+#endif
+
+    while ((cur < end) && (*cur < 0x80))
+        cur++;
+
+    return(cur);
+}
+
+/**
+ * Convert a run of UTF-16 code units below 0x80 to ASCII. Only whole
+ * blocks are converted, callers must handle the rest themselves.
+ *
+ * @param out  output buffer
+ * @param in  UTF-16 input
+ * @param n  maximum number of code units to convert
+ * @param bigEndian  whether the input is UTF-16BE
+ * @returns the number of code units converted
+ */
+static XML_INLINE int
+xmlSimdUtf16ToAscii(xmlChar *out, const xmlChar *in, int n, int bigEndian) {
+#ifdef XML_SIMD_SSE2
+    const __m128i nonAscii = _mm_set1_epi16(
+        (short) (bigEndian ? 0x80FF : 0xFF80));
+    int i = 0;
+
+    while (n - i >= 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + 2 * i));
+
+        if (_mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_and_si128(v, nonAscii),
+                               _mm_setzero_si128())) != 0xFFFF)
+            break;
+        if (bigEndian)
+            v = _mm_srli_epi16(v, 8);
+        _mm_storel_epi64((__m128i *) (out + i), _mm_packus_epi16(v, v));
+        i += 8;
+    }
+
+    return(i);
+#else
+    (void) out;
+    (void) in;
+    (void) n;
+    (void) bigEndian;
+
+    return(0);
+#endif
+}
+
+/**
+ * Convert a run of ASCII characters to UTF-16. Only whole blocks are
+ * converted, callers must handle the rest themselves.
+ *
+ * @param out  output buffer
+ * @param in  ASCII input
+ * @param n  maximum number of characters to convert
+ * @param bigEndian  whether to output UTF-16BE
+ * @returns the number of characters converted
+ */
+static XML_INLINE int
+xmlSimdAsciiToUtf16(xmlChar *out, const xmlChar *in, int n, int bigEndian) {
+#ifdef XML_SIMD_SSE2
+    const __m128i zero = _mm_setzero_si128();
+    int i = 0;
+
+    while (n - i >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (in + i));
+        __m128i lo, hi;
+
+        if (_mm_movemask_epi8(v) != 0)
+            break;
+        if (bigEndian) {
+            lo = _mm_unpacklo_epi8(zero, v);
+            hi = _mm_unpackhi_epi8(zero, v);
+        } else {
+            lo = _mm_unpacklo_epi8(v, zero);
+            hi = _mm_unpackhi_epi8(v, zero);
+        }
+        _mm_storeu_si128((__m128i *) (out + 2 * i), lo);
+        _mm_storeu_si128((__m128i *) (out + 2 * i + 16), hi);
+        i += 16;
+    }
+
+    return(i);
+#else
+    (void) out;
+    (void) in;
+    (void) n;
+    (void) bigEndian;
+
+    return(0);
+#endif
+}
+
+#endif /* XML_SIMD_H_PRIVATE__ */
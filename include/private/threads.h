@@ -58,6 +58,9 @@ xmlInitRMutex(xmlRMutex *mutex);
 XML_HIDDEN void
 xmlCleanupRMutex(xmlRMutex *mutex);
 
+XML_HIDDEN int
+xmlGetThreadCount(void);
+
 #ifdef LIBXML_SCHEMAS_ENABLED
 XML_HIDDEN void
 xmlInitSchemasTypesInternal(void);
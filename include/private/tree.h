@@ -4,6 +4,93 @@
 XML_HIDDEN extern int
 xmlRegisterCallbacks;
 
+typedef struct _xmlDocArena xmlDocArena;
+
+/*
+ * Must be used when nodes are inserted, unlinked, freed, renamed or
+ * moved to another document and when text content changes. Invalidates
+ * the XPath document order index and cached XPath results. Materializing
+ * nodes of lazy documents doesn't count as a change.
+ */
+#define XML_DOC_TREE_CHANGED(doc) \
+    do { if ((doc) != NULL) (doc)->generation += 1; } while (0)
+
+XML_HIDDEN void
+xmlInitTreeInternal(void);
+XML_HIDDEN void
+xmlCleanupTreeInternal(void);
+
+XML_HIDDEN int
+xmlDocCreateArena(xmlDoc *doc);
+XML_HIDDEN void *
+xmlDocArenaAlloc(xmlDoc *doc, size_t size);
+XML_HIDDEN xmlChar *
+xmlDocArenaStrndup(xmlDoc *doc, const xmlChar *str, int len);
+XML_HIDDEN int
+xmlDocArenaOwns(const xmlDoc *doc, const void *ptr);
+XML_HIDDEN int
+xmlDocArenaShare(xmlDoc *doc, xmlDoc *src);
+
+/*
+ * Deferred attributes and content of elements in lazy documents,
+ * see xmlCtxtSetLazyTree. The records are allocated from the arena.
+ * Until they're materialized, elements with a record have the
+ * XML_NODE_LAZY bit set in `extra` and the record is found with
+ * xmlLazyLookup. The `psvi` member is left to applications.
+ */
+#define XML_NODE_LAZY       (1 << 15)
+
+#define XML_LAZY_ATTRS      (1 << 0)
+#define XML_LAZY_CONTENT    (1 << 1)
+#define XML_LAZY_RECURSIVE  (1 << 2)
+
+#define XML_LAZY_DOC(doc) \
+    (((doc) != NULL) && ((doc)->properties & XML_DOC_LAZY))
+
+typedef struct _xmlLazyAttr xmlLazyAttr;
+struct _xmlLazyAttr {
+    const xmlChar *name;
+    xmlNs *ns;
+    xmlChar *value;
+    int len;
+    /* value contains references, see xmlNodeParseAttValue */
+    int parse;
+};
+
+typedef struct _xmlLazyItem xmlLazyItem;
+struct _xmlLazyItem {
+    xmlLazyItem *next;
+    /* PI target */
+    const xmlChar *name;
+    xmlChar *content;
+    int len;
+    int size;
+    /* number of preceding element siblings */
+    int position;
+    int line;
+    xmlElementType type;
+};
+
+typedef struct _xmlLazyElem xmlLazyElem;
+struct _xmlLazyElem {
+    xmlNode *elem;
+    /* XML_LAZY_ATTRS and XML_LAZY_CONTENT if still pending */
+    int flags;
+    /* number of element children */
+    int nbElems;
+    int nbAttrs;
+    xmlLazyAttr *attrs;
+    xmlLazyItem *first;
+    xmlLazyItem *last;
+};
+
+XML_HIDDEN xmlLazyElem *
+xmlLazyCreate(xmlNode *elem);
+XML_HIDDEN xmlLazyElem *
+xmlLazyLookup(const xmlNode *elem);
+XML_HIDDEN int
+xmlLazyMaterialize(xmlNode *node, int flags);
+
 XML_HIDDEN int
 xmlSearchNsSafe(xmlNode *node, const xmlChar *href, xmlNs **out);
 XML_HIDDEN int
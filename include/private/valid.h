@@ -0,0 +1,19 @@
+#ifndef XML_VALID_H_PRIVATE__
+#define XML_VALID_H_PRIVATE__
+
+#include <libxml/valid.h>
+
+XML_HIDDEN void
+xmlInitDtdCacheInternal(void);
+XML_HIDDEN void
+xmlCleanupDtdCacheInternal(void);
+
+XML_HIDDEN xmlDtd *
+xmlDtdCacheLookup(const xmlChar *publicId, const xmlChar *URI, int options);
+XML_HIDDEN int
+xmlDtdCacheAdd(xmlDtd *dtd, const xmlChar *publicId, const xmlChar *URI,
+               int options);
+XML_HIDDEN int
+xmlDtdCacheRelease(xmlDtd *dtd);
+
+#endif /* XML_VALID_H_PRIVATE__ */
@@ -11,6 +11,11 @@ XML_HIDDEN void
 xmlXPathErrMemory(xmlXPathContext *ctxt);
 XML_HIDDEN void
 xmlXPathPErrMemory(xmlXPathParserContext *ctxt);
+
+XML_HIDDEN void
+xmlCleanupXPathInternal(void);
+XML_HIDDEN void
+xmlXPathFreeDocData(struct _xmlXPathDocData *data);
 #endif
 
 #endif /* XML_XPATH_H_PRIVATE__ */
@@ -24,9 +24,16 @@
 
 /*
  * These files are generated by the build system and contain private
- * and public build configuration.
+ * and public build configuration. Build systems define HAVE_CONFIG_H
+ * and look up the generated config.h in the include path, so it takes
+ * precedence over the config.h in the source tree used by builds
+ * without a configure step.
  */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#else
 #include "config.h"
+#endif
 #include <libxml/xmlversion.h>
 
 #if defined(__has_attribute)
@@ -75,6 +75,8 @@
 #include "private/io.h"
 #include "private/memory.h"
 #include "private/parser.h"
+#include "private/simd.h"
+#include "private/threads.h"
 #include "private/tree.h"
 
 #define NS_INDEX_EMPTY  INT_MAX
@@ -136,6 +138,9 @@ xmlParseElementStart(xmlParserCtxtPtr ctxt);
 static void
 xmlParseElementEnd(xmlParserCtxtPtr ctxt);
 
+static void
+xmlParseContentParallel(xmlParserCtxtPtr ctxt);
+
 static xmlEntityPtr
 xmlLookupGeneralEntity(xmlParserCtxtPtr ctxt, const xmlChar *name, int inAttr);
 
@@ -878,6 +883,46 @@ encoding_error:
     return(0);
 }
 
+/*
+ * Returns the length of the well-formed UTF-8 sequence at str if it
+ * encodes a non-ASCII XML Char. Returns 0 for malformed or truncated
+ * sequences, and for U+FFFE and U+FFFF. Doesn't report errors.
+ */
+static int
+xmlUTF8CharLenNoErr(const xmlChar *str, const xmlChar *end) {
+    size_t avail = end - str;
+    int c = str[0];
+    int c1, c2;
+
+    if ((avail < 2) || ((str[1] & 0xC0) != 0x80))
+        return(0);
+    c1 = str[1];
+
+    if (c < 0xE0)
+        return((c >= 0xC2) ? 2 : 0);
+
+    if ((avail < 3) || ((str[2] & 0xC0) != 0x80))
+        return(0);
+    c2 = str[2];
+
+    if (c < 0xF0) {
+        if (((c == 0xE0) && (c1 < 0xA0)) ||
+            ((c == 0xED) && (c1 >= 0xA0)) ||
+            ((c == 0xEF) && (c1 == 0xBF) && (c2 >= 0xBE)))
+            return(0);
+        return(3);
+    }
+
+    if ((avail < 4) || ((str[3] & 0xC0) != 0x80))
+        return(0);
+    if (((c == 0xF0) && (c1 < 0x90)) ||
+        ((c == 0xF4) && (c1 >= 0x90)) ||
+        (c > 0xF4))
+        return(0);
+
+    return(4);
+}
+
 /************************************************************************
  *									*
  *		SAX2 defaulted attributes handling			*
@@ -1168,6 +1213,47 @@ mem_error:
     xmlErrMemory(ctxt);
 }
 
+/**
+ * Register the default values and types of the attributes declared
+ * in an external subset which wasn't parsed with this context, as if
+ * the declarations had been parsed.
+ *
+ * @param ctxt  an XML parser context
+ * @param dtd  the external subset
+ */
+void
+xmlCtxtAddDtdDefaults(xmlParserCtxt *ctxt, xmlDtd *dtd) {
+    xmlNodePtr cur;
+
+    if ((ctxt == NULL) || (dtd == NULL) || (!ctxt->sax2))
+        return;
+
+    for (cur = dtd->children; cur != NULL; cur = cur->next) {
+        xmlAttributePtr attr;
+        xmlChar buf[50];
+        xmlChar *fullattr;
+
+        if (cur->type != XML_ATTRIBUTE_DECL)
+            continue;
+        attr = (xmlAttributePtr) cur;
+
+        fullattr = xmlBuildQName(attr->name, attr->prefix, buf, sizeof(buf));
+        if (fullattr == NULL) {
+            xmlErrMemory(ctxt);
+            return;
+        }
+
+        if ((attr->defaultValue != NULL) &&
+            (attr->def != XML_ATTRIBUTE_IMPLIED) &&
+            (attr->def != XML_ATTRIBUTE_REQUIRED))
+            xmlAddDefAttrs(ctxt, attr->elem, fullattr, attr->defaultValue);
+        xmlAddSpecialAttr(ctxt, attr->elem, fullattr, attr->atype);
+
+        if ((fullattr != buf) && (fullattr != attr->name))
+            xmlFree(fullattr);
+    }
+}
+
 /**
  * Removes CDATA attributes from the special attribute table
  */
@@ -4054,18 +4140,18 @@ xmlParseAttValueInternal(xmlParserCtxtPtr ctxt, int *attlen, int *outFlags,
         if (PARSER_STOPPED(ctxt))
             goto error;
 
-        if (CUR_PTR >= ctxt->input->end) {
-            xmlFatalErrMsg(ctxt, XML_ERR_ATTRIBUTE_NOT_FINISHED,
-                           "AttValue: ' expected\n");
-            goto error;
-        }
-
         /*
          * TODO: Check growth threshold
          */
         if (ctxt->input->end - CUR_PTR < 10)
             GROW;
 
+        if (CUR_PTR >= ctxt->input->end) {
+            xmlFatalErrMsg(ctxt, XML_ERR_ATTRIBUTE_NOT_FINISHED,
+                           "AttValue: ' expected\n");
+            goto error;
+        }
+
         c = CUR;
 
         if (c >= 0x80) {
@@ -4086,13 +4172,26 @@ xmlParseAttValueInternal(xmlParserCtxtPtr ctxt, int *attlen, int *outFlags,
             inSpace = 0;
         } else if (c != '&') {
             if (c > 0x20) {
+                const xmlChar *run;
+                int n;
+
                 if (c == quote)
                     break;
 
                 if (c == '<')
                     xmlFatalErr(ctxt, XML_ERR_LT_IN_ATTRIBUTE, NULL);
 
-                chunkSize += 1;
+                /*
+                 * Consume the whole run of plain characters, the last
+                 * one is skipped below.
+                 */
+                run = xmlSimdSkipPlainAscii(CUR_PTR + 1, ctxt->input->end,
+                                            0x21, quote, '&', '<');
+                n = run - CUR_PTR;
+                CUR_PTR += n - 1;
+                ctxt->input->col += n - 1;
+
+                chunkSize += n;
                 inSpace = 0;
             } else if (!IS_BYTE_CHAR(c)) {
                 xmlFatalErrMsg(ctxt, XML_ERR_INVALID_CHAR,
@@ -4516,6 +4615,122 @@ xmlCharacters(xmlParserCtxtPtr ctxt, const xmlChar *buf, int size,
     }
 }
 
+/**
+ * Parse character data containing non-ASCII characters without copying
+ * it. The text is reported in the same chunks as
+ * #xmlParseCharDataComplex would use: every chunk ends after the first
+ * character reaching XML_PARSER_BIG_BUFFER_SIZE bytes, so chunks never
+ * split a multi-byte sequence. Line breaks other than plain LF, invalid
+ * characters and truncated input are handed over to
+ * #xmlParseCharDataComplex, starting at the last chunk boundary.
+ *
+ * @param ctxt  an XML parser context
+ * @param partial  whether the input can end with truncated UTF-8
+ */
+static void
+xmlParseCharDataUtf8(xmlParserCtxtPtr ctxt, int partial) {
+    const xmlChar *in = ctxt->input->cur;
+    int line = ctxt->input->line;
+    int col = ctxt->input->col;
+    int cline = line;
+    int ccol = col;
+
+    while (1) {
+        const xmlChar *end = ctxt->input->end;
+        const xmlChar *limit;
+        size_t off, avail;
+
+        if (end - ctxt->input->cur > XML_PARSER_BIG_BUFFER_SIZE)
+            limit = ctxt->input->cur + XML_PARSER_BIG_BUFFER_SIZE;
+        else
+            limit = end;
+
+        while (in < limit) {
+            int c = *in;
+
+            if (c < 0x80) {
+                const xmlChar *run;
+
+                run = xmlSimdSkipPlainAscii(in, limit, 0x20, '<', '&', ']');
+                ccol += run - in;
+                in = run;
+                if (in >= limit)
+                    break;
+                c = *in;
+                if (c >= 0x80)
+                    continue;
+                if (c == 0xA) {
+                    cline++;
+                    ccol = 1;
+                    in++;
+                    continue;
+                }
+                if (c == ']') {
+                    /*
+                     * Leave "]]>" and partial input to the slow path
+                     * which would report errors again after a handover.
+                     */
+                    if ((end - in < 3) ||
+                        ((in[1] == ']') && (in[2] == '>')))
+                        break;
+                } else if (c != 0x9) {
+                    break;
+                }
+                in++;
+            } else {
+                int len = xmlUTF8CharLenNoErr(in, end);
+
+                if (len == 0)
+                    break;
+                in += len;
+            }
+            ccol++;
+        }
+
+        ctxt->input->line = cline;
+        ctxt->input->col = ccol;
+
+        if (in - ctxt->input->cur >= XML_PARSER_BIG_BUFFER_SIZE) {
+            const xmlChar *tmp = ctxt->input->cur;
+
+            ctxt->input->cur = in;
+            xmlCharacters(ctxt, tmp, in - tmp, 0);
+            line = cline;
+            col = ccol;
+            SHRINK;
+            in = ctxt->input->cur;
+            continue;
+        }
+
+        /* Multi-byte sequences can be truncated at the end of the buffer */
+        if ((in < end) && ((*in < 0x80) || (end - in >= 4)))
+            break;
+
+        /* Grow the buffer, keeping the pending chunk */
+        off = in - ctxt->input->cur;
+        avail = end - in;
+        ctxt->input->cur = in;
+        xmlParserGrow(ctxt);
+        in = ctxt->input->cur;
+        ctxt->input->cur -= off;
+        if ((size_t) (ctxt->input->end - in) <= avail)
+            break;
+    }
+
+    if ((in >= ctxt->input->end) || (*in == '<') || (*in == '&')) {
+        const xmlChar *tmp = ctxt->input->cur;
+
+        ctxt->input->cur = in;
+        if (in > tmp)
+            xmlCharacters(ctxt, tmp, in - tmp, 0);
+        return;
+    }
+
+    ctxt->input->line = line;
+    ctxt->input->col = col;
+    xmlParseCharDataComplex(ctxt, partial);
+}
+
 /**
  * Parse character data. Always makes progress if the first char isn't
  * '<' or '&'.
@@ -4569,7 +4784,16 @@ get_more_space:
 
 get_more:
         ccol = ctxt->input->col;
-        while (test_char_data[*in]) {
+        while (1) {
+            const xmlChar *run;
+
+            run = xmlSimdSkipPlainAscii(in, ctxt->input->end, 0x20,
+                                        '<', '&', ']');
+            ccol += run - in;
+            in = run;
+            if (!test_char_data[*in])
+                break;
+            /* Tab */
             in++;
             ccol++;
         }
@@ -4643,7 +4867,7 @@ invoke_callback:
              (*in == 0x09) || (*in == 0x0a));
     ctxt->input->line = line;
     ctxt->input->col = col;
-    xmlParseCharDataComplex(ctxt, partial);
+    xmlParseCharDataUtf8(ctxt, partial);
 }
 
 /**
@@ -4965,11 +5189,17 @@ xmlParseComment(xmlParserCtxt *ctxt) {
 	}
 get_more:
         ccol = ctxt->input->col;
-	while (((*in > '-') && (*in <= 0x7F)) ||
-	       ((*in >= 0x20) && (*in < '-')) ||
-	       (*in == 0x09)) {
-		    in++;
-		    ccol++;
+	while (1) {
+            const xmlChar *run;
+
+            run = xmlSimdSkipPlainAscii(in, ctxt->input->end, 0x20,
+                                        '-', '-', '-');
+            ccol += run - in;
+            in = run;
+            if (*in != 0x09)
+                break;
+            in++;
+            ccol++;
 	}
 	ctxt->input->col = ccol;
 	if (*in == 0xA) {
@@ -9477,6 +9707,57 @@ xmlParseCDSect(xmlParserCtxt *ctxt) {
     }
     while (IS_CHAR(cur) &&
            ((r != ']') || (s != ']') || (cur != '>'))) {
+        /*
+         * Fast path: copy a run of plain ASCII characters at once. This
+         * can't skip the end of the section because the run contains
+         * no ']'. The last two characters of the run are kept in r and s.
+         */
+        if ((cur >= 0x20) && (cur < 0x80) && (cur != ']')) {
+            const xmlChar *end = ctxt->input->end;
+            const xmlChar *run;
+            int n;
+
+            if (end - CUR_PTR > maxLength)
+                end = CUR_PTR + maxLength;
+            run = xmlSimdSkipPlainAscii(CUR_PTR + 1, end, 0x20,
+                                        ']', ']', ']');
+            n = run - CUR_PTR;
+
+            if (n >= 2) {
+                while (len + n + 10 >= size) {
+                    xmlChar *tmp;
+                    int newSize;
+
+                    newSize = xmlGrowCapacity(size, 1, 1, maxLength);
+                    if (newSize < 0) {
+                        xmlFatalErrMsg(ctxt, XML_ERR_CDATA_NOT_FINISHED,
+                                       "CData section too big found\n");
+                        goto out;
+                    }
+                    tmp = xmlRealloc(buf, newSize);
+                    if (tmp == NULL) {
+                        xmlErrMemory(ctxt);
+                        goto out;
+                    }
+                    buf = tmp;
+                    size = newSize;
+                }
+
+                COPY_BUF(buf, len, r);
+                COPY_BUF(buf, len, s);
+                memcpy(&buf[len], CUR_PTR, n - 2);
+                len += n - 2;
+                r = CUR_PTR[n - 2];
+                rl = 1;
+                s = CUR_PTR[n - 1];
+                sl = 1;
+                CUR_PTR += n;
+                ctxt->input->col += n;
+                cur = xmlCurrentCharRecover(ctxt, &l);
+                continue;
+            }
+        }
+
 	if (len + 5 >= size) {
 	    xmlChar *tmp;
             int newSize;
@@ -9669,6 +9950,9 @@ xmlParseElement(xmlParserCtxt *ctxt) {
     if (xmlParseElementStart(ctxt) != 0)
         return;
 
+    if (ctxt->options & XML_PARSE_PARALLEL)
+        xmlParseContentParallel(ctxt);
+
     xmlParseContentInternal(ctxt);
 
     if (ctxt->input->cur >= ctxt->input->end) {
@@ -11325,6 +11609,198 @@ xmlParseChunk(xmlParserCtxt *ctxt, const char *chunk, int size,
         return(0);
 }
 
+/**
+ * Find the end of the token pending in the input buffer of a push
+ * parser in the next chunk. Comments, PIs and CDATA sections end with
+ * their terminator, which can start in the input buffer. Other tokens
+ * are assumed to end with the next '>'.
+ *
+ * @param ctxt  an XML parser context
+ * @param chunk  the next chunk
+ * @param size  size of the chunk
+ * @returns the number of bytes up to the end of the token or `size`
+ * if the token doesn't end in the chunk.
+ */
+static int
+xmlParseLookupPendingEnd(xmlParserCtxtPtr ctxt, const char *chunk,
+                         int size) {
+    const xmlChar *cur = ctxt->input->cur;
+    const xmlChar *end = ctxt->input->end;
+    const char *term = ">";
+    const char *p, *match;
+    int termLen, k;
+
+    if ((end - cur >= 9) && (memcmp(cur, "<![CDATA[", 9) == 0)) {
+        term = "]]>";
+        cur += 9;
+    } else if ((end - cur >= 4) && (memcmp(cur, "<!--", 4) == 0)) {
+        term = "-->";
+        cur += 4;
+    } else if ((end - cur >= 2) && (cur[0] == '<') && (cur[1] == '?')) {
+        term = "?>";
+        cur += 2;
+    }
+    termLen = strlen(term);
+
+    /* A terminator starting in the input buffer */
+    for (k = termLen - 1; k > 0; k--) {
+        if ((end - cur >= k) && (size >= termLen - k) &&
+            (memcmp(end - k, term, k) == 0) &&
+            (memcmp(chunk, term + k, termLen - k) == 0))
+            return(termLen - k);
+    }
+
+    p = chunk;
+    while ((match = memchr(p, term[termLen - 1],
+                           chunk + size - p)) != NULL) {
+        if ((match - chunk >= termLen - 1) &&
+            (memcmp(match - (termLen - 1), term, termLen - 1) == 0))
+            return(match - chunk + 1);
+        p = match + 1;
+    }
+
+    return(size);
+}
+
+/**
+ * Parse a chunk of memory in push parser mode without copying it
+ * to the input buffer.
+ *
+ * This works like #xmlParseChunk, but the parser tokenizes the
+ * chunk where it is. Only the unconsumed tail of the chunk, typically
+ * a token which continues in the next chunk, is copied to the input
+ * buffer. At the start of the next chunk, data is copied until this
+ * token is complete. Then the parser switches back to the caller's
+ * memory.
+ *
+ * The parser needs a terminating null byte after the available
+ * data. To provide it without copying, the chunk must be writable.
+ * The last byte is overwritten temporarily and restored before
+ * this function returns. The chunk can be reused or freed after
+ * the call.
+ *
+ * Input which must be converted to UTF-8 and the start of the
+ * document up to the XML declaration are always copied.
+ *
+ * @since 2.16.0
+ *
+ * @param ctxt  an XML parser context
+ * @param chunk  chunk of writable memory
+ * @param size  size of chunk in bytes
+ * @param terminate  last chunk indicator
+ * @returns an xmlParserErrors code (0 on success).
+ */
+int
+xmlParseChunkInPlace(xmlParserCtxt *ctxt, char *chunk, int size,
+                     int terminate) {
+    xmlParserInputPtr in;
+    size_t consumed;
+    int avail, res;
+    char last;
+
+    if ((ctxt == NULL) || (size < 0))
+        return(XML_ERR_ARGUMENT);
+    if ((chunk == NULL) && (size > 0))
+        return(XML_ERR_ARGUMENT);
+    if ((ctxt->input == NULL) || (ctxt->input->buf == NULL))
+        return(XML_ERR_ARGUMENT);
+
+    in = ctxt->input;
+
+    while ((size > 1) && (ctxt->disableSAX == 0) &&
+           (ctxt->inputNr == 1) && (in->buf->encoder == NULL) &&
+           (ctxt->instate != XML_PARSER_EOF)) {
+        if ((ctxt->instate == XML_PARSER_START) || (in->cur < in->end)) {
+            int len;
+
+            /*
+             * Copy data up to the likely end of the pending token.
+             * If the token is complete, the input buffer is empty
+             * and parsing continues in place with the next iteration.
+             * The push parser's lookups resume where they stopped,
+             * so tokens containing many '>' are scanned only once.
+             */
+            len = xmlParseLookupPendingEnd(ctxt, chunk, size);
+            res = xmlParseChunk(ctxt, chunk, len, 0);
+            if ((res != XML_ERR_OK) && (ctxt->disableSAX != 0))
+                return(res);
+            chunk += len;
+            size -= len;
+            continue;
+        }
+
+        /*
+         * The input buffer is fully consumed. Account for its content
+         * and point the input to the chunk. Hold back the last byte,
+         * which is replaced with the terminator, and a preceding
+         * carriage return which could start a CRLF sequence.
+         */
+        xmlSaturatedAddSizeT(&in->consumed, in->cur - in->base);
+        xmlBufEmpty(in->buf->buffer);
+
+        avail = size - 1;
+        if (chunk[avail - 1] == '\r')
+            avail--;
+        last = chunk[avail];
+        chunk[avail] = 0;
+
+        in->flags |= XML_INPUT_BORROWED;
+        in->base = BAD_CAST chunk;
+        in->cur = BAD_CAST chunk;
+        in->end = BAD_CAST chunk + avail;
+
+        xmlParseTryOrFinish(ctxt, 0);
+
+        consumed = in->cur - in->base;
+        xmlSaturatedAddSizeT(&in->consumed, consumed);
+        in->flags &= ~XML_INPUT_BORROWED;
+        xmlBufResetInput(in->buf->buffer, in);
+
+        chunk[avail] = last;
+        chunk += consumed;
+        size -= consumed;
+        break;
+    }
+
+    return(xmlParseChunk(ctxt, chunk, size, terminate));
+}
+
+/**
+ * Parse a list of chunks in push parser mode with
+ * #xmlParseChunkInPlace. This is useful to parse data which is
+ * scattered across several buffers, like segments of a ring buffer.
+ *
+ * @since 2.16.0
+ *
+ * @param ctxt  an XML parser context
+ * @param chunks  array of writable chunks
+ * @param sizes  array of chunk sizes in bytes
+ * @param nbChunks  number of chunks
+ * @param terminate  whether the last chunk ends the document
+ * @returns an xmlParserErrors code (0 on success).
+ */
+int
+xmlParseChunks(xmlParserCtxt *ctxt, char **chunks, const int *sizes,
+               int nbChunks, int terminate) {
+    int i, res = XML_ERR_OK;
+
+    if ((ctxt == NULL) || (nbChunks < 0) ||
+        ((nbChunks > 0) && ((chunks == NULL) || (sizes == NULL))))
+        return(XML_ERR_ARGUMENT);
+
+    if (nbChunks == 0)
+        return(xmlParseChunk(ctxt, NULL, 0, terminate));
+
+    for (i = 0; i < nbChunks; i++) {
+        res = xmlParseChunkInPlace(ctxt, chunks[i], sizes[i],
+                                   terminate && (i == nbChunks - 1));
+        if ((res != XML_ERR_OK) && (ctxt->disableSAX != 0))
+            break;
+    }
+
+    return(res);
+}
+
 /************************************************************************
  *									*
  *		I/O front end functions to the parser			*
@@ -11836,6 +12312,21 @@ xmlCtxtParseEntity(xmlParserCtxtPtr ctxt, xmlEntityPtr ent) {
         if (isExternal)
             xmlSaturatedAdd(&ctxt->sizeentities, consumed);
 
+        /*
+         * Nodes allocated from the document arena can't be moved to
+         * an entity without a document, so make a copy.
+         */
+        if ((list != NULL) && (ent->doc == NULL) &&
+            (list->doc != NULL) && (list->doc->arena != NULL)) {
+            xmlNodePtr copy;
+
+            copy = xmlStaticCopyNodeList(list, NULL, NULL);
+            if (copy == NULL)
+                xmlCtxtErrMemory(ctxt);
+            xmlFreeNodeList(list);
+            list = copy;
+        }
+
         ent->children = list;
 
         while (list != NULL) {
@@ -12123,49 +12614,787 @@ exit:
     return(list);
 }
 
-/**
- * Parse a well-balanced chunk of an XML document
- * within the context (DTD, namespaces, etc ...) of the given node.
- *
- * The allowed sequence for the data is a Well Balanced Chunk defined by
- * the content production in the XML grammar:
- *
- *     [43] content ::= (element | CharData | Reference | CDSect | PI |
- *                       Comment)*
- *
- * This function assumes the encoding of `node`'s document which is
- * typically not what you want. A better alternative is
- * #xmlCtxtParseContent.
- *
- * @param node  the context node
- * @param data  the input string
- * @param datalen  the input string length in bytes
- * @param options  a combination of xmlParserOption
- * @param listOut  the return value for the set of parsed nodes
- * @returns XML_ERR_OK if the chunk is well balanced, and the parser
- * error code otherwise
- */
-xmlParserErrors
-xmlParseInNodeContext(xmlNode *node, const char *data, int datalen,
-                      int options, xmlNode **listOut) {
-    xmlParserCtxtPtr ctxt;
-    xmlParserInputPtr input;
-    xmlDocPtr doc;
-    xmlNodePtr list;
-    xmlParserErrors ret;
+/************************************************************************
+ *									*
+ *		Parallel parsing of the root element			*
+ *									*
+ ************************************************************************/
 
-    if (listOut == NULL)
-        return(XML_ERR_INTERNAL_ERROR);
-    *listOut = NULL;
+#if defined(HAVE_POSIX_THREADS) || defined(HAVE_WIN32_THREADS)
 
-    if ((node == NULL) || (data == NULL) || (datalen < 0))
-        return(XML_ERR_INTERNAL_ERROR);
+#define XML_PARALLEL_MAX_THREADS 64
+#define XML_PARALLEL_CHUNK_SIZE (64 * 1024)
+/* Chunks per thread, so threads finishing early can pick up more work */
+#define XML_PARALLEL_CHUNKS_PER_THREAD 16
+#define XML_PARALLEL_READ_SIZE (1024 * 1024)
 
-    doc = node->doc;
-    if (doc == NULL)
-        return(XML_ERR_INTERNAL_ERROR);
+typedef struct {
+    const xmlChar *start;
+    const xmlChar *end;
+    int line;
+    xmlNodePtr list;
+    xmlNodePtr last;
+    xmlDocPtr doc;
+} xmlParallelChunk;
 
-#ifdef LIBXML_HTML_ENABLED
+typedef struct {
+    xmlMutex lock;
+    xmlParserCtxtPtr ctxt;
+    xmlParallelChunk *chunks;
+    int nbChunks;
+    int maxChunks;
+    int next;
+    int failed;
+} xmlParallelQueue;
+
+typedef struct {
+    xmlParallelQueue *queue;
+    xmlDictPtr dict;
+    xmlDocPtr doc;
+} xmlParallelWorker;
+
+/**
+ * @returns the number of threads to use.
+ */
+static int
+xmlParallelThreadCount(void) {
+    int ret = xmlGetThreadCount();
+
+    if (ret > XML_PARALLEL_MAX_THREADS)
+        ret = XML_PARALLEL_MAX_THREADS;
+
+    return(ret);
+}
+
+/**
+ * Find the end of a string in a buffer.
+ *
+ * @param cur  start of the buffer
+ * @param end  end of the buffer
+ * @param str  the string to find
+ * @param len  length of the string
+ * @returns a pointer after the first match or NULL if not found.
+ */
+static const xmlChar *
+xmlParallelSkipPast(const xmlChar *cur, const xmlChar *end,
+                    const char *str, size_t len) {
+    while ((size_t) (end - cur) >= len) {
+        const xmlChar *p;
+
+        p = memchr(cur, str[0], (end - cur) - len + 1);
+        if (p == NULL)
+            return(NULL);
+        if (memcmp(p, str, len) == 0)
+            return(p + len);
+        cur = p + 1;
+    }
+
+    return(NULL);
+}
+
+static int
+xmlParallelAddChunk(xmlParallelQueue *queue, const xmlChar *start,
+                    const xmlChar *end) {
+    xmlParallelChunk *chunk;
+
+    if (queue->nbChunks >= queue->maxChunks) {
+        xmlParallelChunk *tmp;
+        int newSize;
+
+        newSize = xmlGrowCapacity(queue->maxChunks, sizeof(tmp[0]),
+                                  16, XML_MAX_ITEMS);
+        if (newSize < 0)
+            return(-1);
+        tmp = xmlRealloc(queue->chunks, newSize * sizeof(tmp[0]));
+        if (tmp == NULL)
+            return(-1);
+        queue->chunks = tmp;
+        queue->maxChunks = newSize;
+    }
+
+    chunk = &queue->chunks[queue->nbChunks++];
+    chunk->start = start;
+    chunk->end = end;
+    chunk->line = 0;
+    chunk->list = NULL;
+    chunk->last = NULL;
+    chunk->doc = NULL;
+
+    return(0);
+}
+
+/**
+ * Split the content of the root element into chunks which start with
+ * the start tag of a child element. This only looks at markup
+ * delimiters, skipping comments, CDATA sections, PIs and quoted
+ * attribute values. Well-formedness is checked when parsing the
+ * chunks.
+ *
+ * Splitting stops after `maxChunks` chunks, at the end tag of the
+ * root element or at the last chunk boundary before the end of the
+ * buffer or anything the scan doesn't understand.
+ *
+ * @param queue  the job queue receiving the chunks
+ * @param cur  start of the content
+ * @param end  end of the buffer
+ * @param chunkSize  minimum size of a chunk
+ * @param maxChunks  maximum number of chunks
+ * @param stop  pointer to the end of the last chunk
+ * @param rootEnd  set to 1 if the last chunk ends with the end tag
+ * of the root element
+ * @returns 0 on success, 1 if no chunk was found and -1 if a memory
+ * allocation failed.
+ */
+static int
+xmlParallelSplit(xmlParallelQueue *queue, const xmlChar *cur,
+                 const xmlChar *end, size_t chunkSize, int maxChunks,
+                 const xmlChar **stop, int *rootEnd) {
+    const xmlChar *chunkStart = cur;
+    const xmlChar *p;
+    size_t depth = 0;
+
+    *rootEnd = 0;
+
+    while (1) {
+        p = memchr(cur, '<', end - cur);
+        if ((p == NULL) || (end - p < 2))
+            goto partial;
+
+        if (p[1] == '/') {
+            if (depth == 0)
+                break;
+            depth--;
+            cur = memchr(p, '>', end - p);
+            if (cur != NULL)
+                cur++;
+        } else if (p[1] == '?') {
+            cur = xmlParallelSkipPast(p + 2, end, "?>", 2);
+        } else if (p[1] == '!') {
+            if ((end - p >= 4) && (p[2] == '-') && (p[3] == '-'))
+                cur = xmlParallelSkipPast(p + 4, end, "-->", 3);
+            else if ((end - p >= 9) && (memcmp(p + 2, "[CDATA[", 7) == 0))
+                cur = xmlParallelSkipPast(p + 9, end, "]]>", 3);
+            else
+                goto partial;
+        } else {
+            if ((depth == 0) && ((size_t) (p - chunkStart) >= chunkSize)) {
+                if (xmlParallelAddChunk(queue, chunkStart, p) < 0)
+                    return(-1);
+                chunkStart = p;
+                if (queue->nbChunks >= maxChunks) {
+                    *stop = p;
+                    return(0);
+                }
+            }
+
+            cur = p + 1;
+            while ((cur < end) && (*cur != '>')) {
+                if ((*cur == '"') || (*cur == '\'')) {
+                    cur = memchr(cur + 1, *cur, end - cur - 1);
+                    if (cur == NULL)
+                        goto partial;
+                } else if (*cur == '<') {
+                    goto partial;
+                }
+                cur++;
+            }
+            if (cur >= end)
+                goto partial;
+            if (cur[-1] != '/')
+                depth++;
+            cur++;
+        }
+
+        if (cur == NULL)
+            goto partial;
+    }
+
+    if (xmlParallelAddChunk(queue, chunkStart, p) < 0)
+        return(-1);
+    *stop = p;
+    *rootEnd = 1;
+
+    return(0);
+
+partial:
+    /* Leave the rest to the next window or the serial parser */
+    if (queue->nbChunks == 0)
+        return(1);
+    *stop = chunkStart;
+
+    return(0);
+}
+
+static void
+xmlParallelErrorHandler(void *data, const xmlError *error ATTRIBUTE_UNUSED) {
+    int *nbErrors = data;
+
+    *nbErrors += 1;
+}
+
+/**
+ * Set the parent of a node list and the document of all nodes in the
+ * list. The strings and the memory of the nodes must already be owned
+ * by the new document or must be moved there later.
+ *
+ * @param list  the node list
+ * @param doc  the new document
+ * @param parent  the new parent
+ * @returns the last node of the list.
+ */
+static xmlNodePtr
+xmlParallelAdoptList(xmlNodePtr list, xmlDocPtr doc, xmlNodePtr parent) {
+    xmlNodePtr cur = list;
+    int depth = 0;
+
+    while (1) {
+        cur->doc = doc;
+        if (depth == 0)
+            cur->parent = parent;
+
+        if (cur->type == XML_ELEMENT_NODE) {
+            xmlAttrPtr attr;
+            xmlNodePtr text;
+
+            for (attr = cur->properties; attr != NULL; attr = attr->next) {
+                attr->doc = doc;
+                for (text = attr->children; text != NULL; text = text->next)
+                    text->doc = doc;
+            }
+
+            if (cur->children != NULL) {
+                cur = cur->children;
+                depth++;
+                continue;
+            }
+        }
+
+        while (cur->next == NULL) {
+            if (depth == 0)
+                return(cur);
+            cur = cur->parent;
+            depth--;
+        }
+        cur = cur->next;
+    }
+}
+
+/**
+ * Replace the names of nodes in a list with the copies found in the
+ * dictionary of the parser. Needed after merging worker dictionaries
+ * which interned the same new name.
+ *
+ * @param ctxt  an XML parser context
+ * @param list  the node list
+ */
+static void
+xmlParallelInternNames(xmlParserCtxtPtr ctxt, xmlNodePtr list) {
+    xmlDictPtr dict = ctxt->dict;
+    xmlNodePtr cur = list;
+    const xmlChar *name;
+    int docDict = (ctxt->myDoc->dict != NULL);
+    int depth = 0;
+
+    while (1) {
+        if (cur->type == XML_ELEMENT_NODE) {
+            xmlAttrPtr attr;
+
+            if (ctxt->dictNames) {
+                name = xmlDictExists(dict, cur->name, -1);
+                if (name != NULL)
+                    cur->name = name;
+
+                for (attr = cur->properties; attr != NULL; attr = attr->next) {
+                    name = xmlDictExists(dict, attr->name, -1);
+                    if (name != NULL)
+                        attr->name = name;
+                }
+            }
+
+            if (cur->children != NULL) {
+                cur = cur->children;
+                depth++;
+                continue;
+            }
+        } else if (((cur->type == XML_PI_NODE) ||
+                    (cur->type == XML_ENTITY_REF_NODE)) &&
+                   (docDict)) {
+            name = xmlDictExists(dict, cur->name, -1);
+            if (name != NULL)
+                cur->name = name;
+        }
+
+        while (cur->next == NULL) {
+            if (depth == 0)
+                return;
+            cur = cur->parent;
+            depth--;
+        }
+        cur = cur->next;
+    }
+}
+
+/**
+ * Parse a chunk with a separate parser context. The nodes are created
+ * in the worker's document and dictionary.
+ *
+ * @param worker  the worker
+ * @param chunk  the chunk to parse
+ * @returns 0 on success or -1 if the chunk must be parsed sequentially.
+ */
+static int
+xmlParallelParseChunk(xmlParallelWorker *worker, xmlParallelChunk *chunk) {
+    xmlParserCtxtPtr ctxt = worker->queue->ctxt;
+    xmlParserCtxtPtr wctxt;
+    xmlParserInputPtr input;
+    xmlNodePtr cur;
+    int nbErrors = 0, nsnr = 0, ret = -1;
+
+    wctxt = xmlNewParserCtxt();
+    if (wctxt == NULL)
+        return(-1);
+    xmlCtxtUseOptions(wctxt, ctxt->options & ~XML_PARSE_PARALLEL);
+    xmlCtxtSetDict(wctxt, worker->dict);
+    xmlCtxtSetErrorHandler(wctxt, xmlParallelErrorHandler, &nbErrors);
+    wctxt->myDoc = worker->doc;
+
+    input = xmlCtxtNewInputFromMemory(wctxt, NULL, chunk->start,
+                                      chunk->end - chunk->start, NULL, 0);
+    if (input == NULL)
+        goto done;
+    input->line = chunk->line;
+
+    xmlCtxtInitializeLate(wctxt);
+
+    /*
+     * The namespaces of the root element are in scope
+     */
+    for (cur = ctxt->node; cur != NULL; cur = cur->parent) {
+        xmlNsPtr ns;
+
+        if (cur->type != XML_ELEMENT_NODE)
+            break;
+
+        for (ns = cur->nsDef; ns != NULL; ns = ns->next) {
+            xmlHashedString hprefix, huri;
+
+            hprefix = xmlDictLookupHashed(wctxt->dict, ns->prefix, -1);
+            huri = xmlDictLookupHashed(wctxt->dict, ns->href, -1);
+            if (xmlParserNsPush(wctxt, &hprefix, &huri, ns, 1) > 0)
+                nsnr++;
+        }
+    }
+
+    chunk->list = xmlCtxtParseContentInternal(wctxt, input, 0, 1);
+
+    if (nsnr > 0)
+        xmlParserNsPop(wctxt, nsnr);
+
+    if ((wctxt->wellFormed) && (nbErrors == 0) &&
+        (worker->doc->ids == NULL) && (worker->doc->refs == NULL))
+        ret = 0;
+
+    /*
+     * Move the nodes to the main document while still running in
+     * parallel. This is undone if another chunk fails.
+     */
+    chunk->doc = worker->doc;
+    if ((ret == 0) && (chunk->list != NULL))
+        chunk->last = xmlParallelAdoptList(chunk->list, ctxt->myDoc,
+                                           ctxt->node);
+
+    xmlFreeInputStream(input);
+
+done:
+    wctxt->myDoc = NULL;
+    xmlFreeParserCtxt(wctxt);
+    return(ret);
+}
+
+/**
+ * Parse chunks from the job queue until it's empty or another
+ * worker failed.
+ *
+ * @param worker  the worker
+ */
+static void
+xmlParallelWorkerRun(xmlParallelWorker *worker) {
+    xmlParallelQueue *queue = worker->queue;
+    int i, failed;
+
+    while (1) {
+        xmlMutexLock(&queue->lock);
+        i = queue->next;
+        if (i < queue->nbChunks)
+            queue->next++;
+        failed = queue->failed;
+        xmlMutexUnlock(&queue->lock);
+
+        if ((i >= queue->nbChunks) || (failed))
+            break;
+
+        if (xmlParallelParseChunk(worker, &queue->chunks[i]) < 0) {
+            xmlMutexLock(&queue->lock);
+            queue->failed = 1;
+            xmlMutexUnlock(&queue->lock);
+            break;
+        }
+    }
+}
+
+#ifdef HAVE_POSIX_THREADS
+static void *
+xmlParallelWorkerThread(void *arg) {
+    xmlParallelWorkerRun(arg);
+    return(NULL);
+}
+#else
+static DWORD WINAPI
+xmlParallelWorkerThread(LPVOID arg) {
+    xmlParallelWorkerRun(arg);
+    return(0);
+}
+#endif
+
+/**
+ * @returns whether the content of the current element can be parsed
+ * speculatively. This requires the default SAX2 handlers building a
+ * tree and no DTD which could affect the content.
+ */
+static int
+xmlParallelCanParse(xmlParserCtxtPtr ctxt) {
+    xmlSAXHandlerPtr sax = ctxt->sax;
+    xmlParserInputPtr in = ctxt->input;
+
+    if ((ctxt->inputNr != 1) || (ctxt->nameNr != 1) ||
+        (in->buf == NULL) || (PARSER_PROGRESSIVE(ctxt)) ||
+        (ctxt->html) || (ctxt->disableSAX) || (!ctxt->wellFormed) ||
+        (ctxt->validate) || (ctxt->record_info) || (!ctxt->keepBlanks) ||
+        (ctxt->parseMode == XML_PARSE_READER) ||
+        (ctxt->dict == NULL) || (ctxt->node == NULL) ||
+        (ctxt->myDoc == NULL) || (ctxt->myDoc->intSubset != NULL) ||
+        (ctxt->myDoc->extSubset != NULL) || (xmlRegisterCallbacks))
+        return(0);
+
+    if ((sax == NULL) || (!ctxt->sax2) || (ctxt->userData != ctxt) ||
+        (sax->startElementNs != xmlSAX2StartElementNs) ||
+        (sax->endElementNs != xmlSAX2EndElementNs) ||
+        (sax->characters != xmlSAX2Characters) ||
+        (sax->ignorableWhitespace != xmlSAX2Characters) ||
+        (sax->cdataBlock != xmlSAX2CDataBlock) ||
+        (sax->comment != xmlSAX2Comment) ||
+        (sax->processingInstruction != xmlSAX2ProcessingInstruction) ||
+        (sax->reference != xmlSAX2Reference))
+        return(0);
+
+    return(1);
+}
+
+/**
+ * Parse the next window of the content of the root element in
+ * multiple threads.
+ *
+ * The input is read until the window is full. The window is split at
+ * the start tags of child elements with a fast scan and the chunks are
+ * parsed concurrently with the namespaces of the root element in
+ * scope, each thread using its own document and sub-dictionary. If all
+ * chunks are well-formed, the resulting nodes are appended to the root
+ * element in document order and the input is advanced to the end of
+ * the last chunk. Otherwise, nothing is changed.
+ *
+ * @param ctxt  an XML parser context
+ * @param nbThreads  the number of threads
+ * @returns 0 if the window was parsed and more content follows, 1 if
+ * the rest of the content must be parsed sequentially.
+ */
+static int
+xmlParallelParseWindow(xmlParserCtxtPtr ctxt, int nbThreads) {
+    xmlParallelWorker workers[XML_PARALLEL_MAX_THREADS];
+#ifdef HAVE_POSIX_THREADS
+    pthread_t threads[XML_PARALLEL_MAX_THREADS];
+#else
+    HANDLE threads[XML_PARALLEL_MAX_THREADS];
+#endif
+    int started[XML_PARALLEL_MAX_THREADS];
+    xmlParallelQueue queue;
+    xmlParserInputPtr in = ctxt->input;
+    xmlDocPtr doc = ctxt->myDoc;
+    xmlNodePtr root = ctxt->node;
+    const xmlChar *stop = NULL;
+    const xmlChar *cur, *lastNl = NULL;
+    size_t windowSize;
+    int maxChunks, nbWorkers = 0, rootEnd = 0, dupNames = 0, line, i, res;
+
+    maxChunks = nbThreads * XML_PARALLEL_CHUNKS_PER_THREAD;
+    windowSize = (size_t) maxChunks * XML_PARALLEL_CHUNK_SIZE;
+
+    /*
+     * Fill the window. Only this part of the input is kept in memory.
+     */
+    while ((size_t) (in->end - in->cur) < windowSize) {
+        size_t curBase = in->cur - in->base;
+
+        res = xmlParserInputBufferGrow(in->buf, XML_PARALLEL_READ_SIZE);
+        xmlBufUpdateInput(in->buf->buffer, in, curBase);
+        if (res < 0) {
+            xmlCtxtErrIO(ctxt, in->buf->error, NULL);
+            return(1);
+        }
+        if (res == 0)
+            break;
+    }
+
+    memset(&queue, 0, sizeof(queue));
+    queue.ctxt = ctxt;
+
+    res = xmlParallelSplit(&queue, in->cur, in->end, XML_PARALLEL_CHUNK_SIZE,
+                           maxChunks, &stop, &rootEnd);
+    if (res < 0)
+        xmlErrMemory(ctxt);
+    if ((res != 0) || (queue.nbChunks < 2)) {
+        xmlFree(queue.chunks);
+        return(1);
+    }
+
+    /*
+     * Compute the line numbers
+     */
+    line = in->line;
+    for (i = 0; i < queue.nbChunks; i++) {
+        xmlParallelChunk *chunk = &queue.chunks[i];
+
+        chunk->line = line;
+        cur = chunk->start;
+        while ((cur = memchr(cur, '\n', chunk->end - cur)) != NULL) {
+            lastNl = cur;
+            cur++;
+            if (line < INT_MAX)
+                line++;
+        }
+    }
+
+    xmlInitMutex(&queue.lock);
+
+    if (nbThreads > queue.nbChunks)
+        nbThreads = queue.nbChunks;
+    for (i = 0; i < nbThreads; i++) {
+        xmlParallelWorker *worker = &workers[i];
+
+        worker->queue = &queue;
+        /* The main dictionary isn't modified until the workers finish */
+        worker->dict = xmlDictCreateSub(ctxt->dict);
+        worker->doc = xmlNewDoc(NULL);
+        started[i] = 0;
+        if ((worker->dict == NULL) || (worker->doc == NULL) ||
+            ((doc->arena != NULL) && (xmlDocCreateArena(worker->doc) < 0))) {
+            xmlDictFree(worker->dict);
+            xmlFreeDoc(worker->doc);
+            break;
+        }
+        if (doc->dict != NULL) {
+            worker->doc->dict = worker->dict;
+            xmlDictReference(worker->dict);
+        }
+    }
+    nbWorkers = i;
+    if (nbWorkers == 0)
+        goto error;
+
+    /* The first worker runs in the calling thread */
+    for (i = 1; i < nbWorkers; i++) {
+#ifdef HAVE_POSIX_THREADS
+        started[i] = (pthread_create(&threads[i], NULL,
+                                     xmlParallelWorkerThread,
+                                     &workers[i]) == 0);
+#else
+        threads[i] = CreateThread(NULL, 0, xmlParallelWorkerThread,
+                                  &workers[i], 0, NULL);
+        started[i] = (threads[i] != NULL);
+#endif
+    }
+
+    xmlParallelWorkerRun(&workers[0]);
+
+    for (i = 1; i < nbWorkers; i++) {
+        if (!started[i])
+            continue;
+#ifdef HAVE_POSIX_THREADS
+        pthread_join(threads[i], NULL);
+#else
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#endif
+    }
+
+    if (queue.failed)
+        goto error;
+
+    /*
+     * Move the arenas first. This is the only step which can fail.
+     */
+    for (i = 0; i < nbWorkers; i++) {
+        if ((workers[i].doc->arena != NULL) &&
+            (xmlDocArenaShare(doc, workers[i].doc) < 0)) {
+            xmlErrMemory(ctxt);
+            goto error;
+        }
+    }
+
+    /*
+     * The strings are owned by the main dictionary from now on. If
+     * merging a hash table fails, the parse result is still valid.
+     * Names which were new to the main dictionary can have been
+     * interned by several workers, so they're looked up again to
+     * keep names comparable by address.
+     */
+    for (i = 0; i < nbWorkers; i++) {
+        res = xmlDictMerge(ctxt->dict, workers[i].dict);
+        if (res < 0)
+            xmlErrMemory(ctxt);
+        else if (res > 0)
+            dupNames = 1;
+    }
+
+    for (i = 0; i < queue.nbChunks; i++) {
+        xmlParallelChunk *chunk = &queue.chunks[i];
+
+        if (chunk->list == NULL)
+            continue;
+
+        if (dupNames)
+            xmlParallelInternNames(ctxt, chunk->list);
+
+        if (root->children == NULL) {
+            root->children = chunk->list;
+        } else {
+            root->last->next = chunk->list;
+            chunk->list->prev = root->last;
+        }
+        root->last = chunk->last;
+    }
+    XML_DOC_TREE_CHANGED(doc);
+
+    for (i = 0; i < nbWorkers; i++) {
+        xmlFreeDoc(workers[i].doc);
+        xmlDictFree(workers[i].dict);
+    }
+    xmlCleanupMutex(&queue.lock);
+    xmlFree(queue.chunks);
+
+    /*
+     * Continue after the last chunk and release the parsed input
+     */
+    if (lastNl == NULL) {
+        cur = in->cur;
+    } else {
+        cur = lastNl + 1;
+        in->col = 1;
+    }
+    for (; cur < stop; cur++) {
+        if ((*cur & 0xC0) != 0x80)
+            in->col++;
+    }
+    in->line = line;
+    in->cur = stop;
+    xmlParserShrink(ctxt);
+    return(rootEnd);
+
+error:
+    for (i = 0; i < queue.nbChunks; i++) {
+        xmlParallelChunk *chunk = &queue.chunks[i];
+
+        if (chunk->last != NULL)
+            xmlParallelAdoptList(chunk->list, chunk->doc, NULL);
+        xmlFreeNodeList(chunk->list);
+    }
+    for (i = 0; i < nbWorkers; i++) {
+        xmlFreeDoc(workers[i].doc);
+        xmlDictFree(workers[i].dict);
+    }
+    xmlCleanupMutex(&queue.lock);
+    xmlFree(queue.chunks);
+    return(1);
+}
+
+/**
+ * Try to parse the content of the root element in multiple threads.
+ * Called after the start tag of the root element was parsed.
+ *
+ * The content is processed in windows of a few chunks per thread, so
+ * memory usage doesn't depend on the size of the document. Parsing
+ * continues sequentially from the first window which can't be split
+ * or contains errors, which are then reported exactly like without
+ * parallel parsing. So are documents with a DTD and all documents on
+ * single-CPU systems.
+ *
+ * @param ctxt  an XML parser context
+ */
+static void
+xmlParseContentParallel(xmlParserCtxtPtr ctxt) {
+    int nbThreads;
+
+    if (!xmlParallelCanParse(ctxt))
+        return;
+
+    nbThreads = xmlParallelThreadCount();
+    if (nbThreads < 2)
+        return;
+
+    while (xmlParallelParseWindow(ctxt, nbThreads) == 0)
+        ;
+}
+
+#else /* !HAVE_POSIX_THREADS && !HAVE_WIN32_THREADS */
+
+static void
+xmlParseContentParallel(xmlParserCtxtPtr ctxt ATTRIBUTE_UNUSED) {
+}
+
+#endif /* HAVE_POSIX_THREADS || HAVE_WIN32_THREADS */
+
+/**
+ * Parse a well-balanced chunk of an XML document
+ * within the context (DTD, namespaces, etc ...) of the given node.
+ *
+ * The allowed sequence for the data is a Well Balanced Chunk defined by
+ * the content production in the XML grammar:
+ *
+ *     [43] content ::= (element | CharData | Reference | CDSect | PI |
+ *                       Comment)*
+ *
+ * This function assumes the encoding of `node`'s document which is
+ * typically not what you want. A better alternative is
+ * #xmlCtxtParseContent.
+ *
+ * @param node  the context node
+ * @param data  the input string
+ * @param datalen  the input string length in bytes
+ * @param options  a combination of xmlParserOption
+ * @param listOut  the return value for the set of parsed nodes
+ * @returns XML_ERR_OK if the chunk is well balanced, and the parser
+ * error code otherwise
+ */
+xmlParserErrors
+xmlParseInNodeContext(xmlNode *node, const char *data, int datalen,
+                      int options, xmlNode **listOut) {
+    xmlParserCtxtPtr ctxt;
+    xmlParserInputPtr input;
+    xmlDocPtr doc;
+    xmlNodePtr list;
+    xmlParserErrors ret;
+
+    if (listOut == NULL)
+        return(XML_ERR_INTERNAL_ERROR);
+    *listOut = NULL;
+
+    if ((node == NULL) || (data == NULL) || (datalen < 0))
+        return(XML_ERR_INTERNAL_ERROR);
+
+    doc = node->doc;
+    if (doc == NULL)
+        return(XML_ERR_INTERNAL_ERROR);
+
+#ifdef LIBXML_HTML_ENABLED
     if (doc->type == XML_HTML_DOCUMENT_NODE) {
         ctxt = htmlNewParserCtxt();
     }
@@ -13166,7 +14395,10 @@ xmlCtxtSetOptionsInternal(xmlParserCtxtPtr ctxt, int options, int keepMask)
               XML_PARSE_NO_XXE |
               XML_PARSE_UNZIP |
               XML_PARSE_NO_SYS_CATALOG |
-              XML_PARSE_CATALOG_PI;
+              XML_PARSE_CATALOG_PI |
+              XML_PARSE_ARENA |
+              XML_PARSE_PARALLEL |
+              XML_PARSE_DTD_CACHE;
 
     ctxt->options = (ctxt->options & keepMask) | (options & allMask);
 
@@ -13309,6 +14541,46 @@ xmlCtxtSetMaxAmplification(xmlParserCtxt *ctxt, unsigned maxAmpl)
     ctxt->maxAmpl = maxAmpl;
 }
 
+/**
+ * Enable or disable lazy trees. In lazy trees, attributes as well as
+ * text, CDATA, comment and PI children of elements are stored in a
+ * compact form when parsing and only turned into nodes when they're
+ * accessed. This makes parsing faster and reduces memory usage if
+ * only parts of a document are used.
+ *
+ * Lazy trees are only built for documents without DTD. They always
+ * use an arena like XML_PARSE_ARENA and can't be used with the
+ * reader or with XML_PARSE_NODICT and XML_PARSE_NOBLANKS.
+ *
+ * The functions in tree.c, the XPath engine, the serializer and the
+ * validators materialize nodes as needed. Materializing doesn't count
+ * as a modification of the document and keeps XPath indexes valid.
+ *
+ * Note that lazy trees relax two guarantees of regular trees, which
+ * is why they must be enabled explicitly:
+ *
+ * - Until an element is materialized, its `properties` member lacks
+ *   the parsed attributes and its `children` and `last` members only
+ *   link element children. Code which accesses these members directly
+ *   must call #xmlNodeMaterialize first.
+ * - Reading a lazy document with the functions above can modify it.
+ *   Concurrent read-only access from multiple threads is only safe
+ *   after the whole document was materialized with
+ *   #xmlNodeMaterialize.
+ *
+ * @since 2.16.0
+ *
+ * @param ctxt  an XML parser context
+ * @param lazy  whether to build lazy trees
+ */
+void
+xmlCtxtSetLazyTree(xmlParserCtxt *ctxt, int lazy)
+{
+    if (ctxt == NULL)
+        return;
+    ctxt->lazyTree = lazy ? 1 : 0;
+}
+
 /**
  * Parse an XML document and return the resulting document tree.
  * Takes ownership of the input object.
@@ -40,6 +40,7 @@
 #define END(ctxt) ctxt->input->end
 
 #include "private/buf.h"
+#include "private/dict.h"
 #include "private/enc.h"
 #include "private/error.h"
 #include "private/globals.h"
@@ -751,7 +752,8 @@ xmlParserShrink(xmlParserCtxt *ctxt) {
     xmlParserInputBufferPtr buf = in->buf;
     size_t used, res;
 
-    if (buf == NULL)
+    /* Borrowed memory from xmlParseChunkInPlace isn't in the buffer. */
+    if ((buf == NULL) || (in->flags & XML_INPUT_BORROWED))
         return;
 
     used = in->cur - in->base;
@@ -2424,6 +2426,9 @@ xmlCheckHTTPInput(xmlParserCtxt *ctxt ATTRIBUTE_UNUSED,
  *
  * The flag XML_INPUT_NETWORK allows network access.
  *
+ * The flag XML_INPUT_MMAP memory-maps large regular files. This
+ * is only safe if the file isn't truncated while parsing.
+ *
  * The following resource loaders will be called if they were
  * registered (in order of precedence):
  *
@@ -3145,6 +3150,10 @@ xmlCtxtGetDict(xmlParserCtxt *ctxt) {
  * Set the dictionary. This should only be done immediately after
  * creating a parser context.
  *
+ * If `dict` was frozen with xmlDictFreeze(), the parser uses a new
+ * sub-dictionary of `dict` to store additional strings. This allows
+ * to share a frozen dictionary between parsers in multiple threads.
+ *
  * @since 2.14.0
  *
  * @param ctxt  parser context
@@ -3155,6 +3164,19 @@ xmlCtxtSetDict(xmlParserCtxt *ctxt, xmlDict *dict) {
     if (ctxt == NULL)
         return;
 
+    if (xmlDictIsFrozen(dict)) {
+        xmlDict *sub = xmlDictCreateSub(dict);
+
+        if (sub == NULL) {
+            xmlCtxtErrMemory(ctxt);
+            return;
+        }
+        if (ctxt->dict != NULL)
+            xmlDictFree(ctxt->dict);
+        ctxt->dict = sub;
+        return;
+    }
+
     if (ctxt->dict != NULL)
         xmlDictFree(ctxt->dict);
 
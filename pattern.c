@@ -34,6 +34,7 @@
 #include <libxml/xmlerror.h>
 #include <libxml/parserInternals.h>
 
+#include "private/compact.h"
 #include "private/memory.h"
 #include "private/parser.h"
 
@@ -2231,6 +2232,189 @@ xmlPatternMatch(xmlPattern *comp, xmlNode *node)
     return(ret);
 }
 
+/*
+ * Check whether a pattern can select attributes.
+ */
+static int
+xmlPatternWantsAttrs(xmlPatternPtr comp) {
+    int i;
+
+    while (comp != NULL) {
+        for (i = 0; i < comp->stream->nbStep; i++) {
+            if (comp->stream->steps[i].flags & XML_STREAM_STEP_ATTR)
+                return(1);
+        }
+        comp = comp->next;
+    }
+
+    return(0);
+}
+
+static int
+xmlPatternAddCompactNode(unsigned **nodes, int *nbNodes, int *maxNodes,
+                         unsigned node) {
+    if (*nbNodes >= *maxNodes) {
+        unsigned *tmp;
+        int newSize;
+
+        newSize = xmlGrowCapacity(*maxNodes, sizeof(tmp[0]), 16,
+                                  XML_MAX_ITEMS);
+        if (newSize < 0)
+            return(-1);
+        tmp = xmlRealloc(*nodes, newSize * sizeof(tmp[0]));
+        if (tmp == NULL)
+            return(-1);
+        *nodes = tmp;
+        *maxNodes = newSize;
+    }
+
+    (*nodes)[(*nbNodes)++] = node;
+    return(0);
+}
+
+/**
+ * Select the nodes of a compact document matching a streamable
+ * pattern, for example a pattern compiled with XML_PATTERN_XPATH.
+ * This evaluates the pattern like the XPath engine evaluates
+ * streamable expressions, with the document node as context node.
+ *
+ * The nodes are returned in document order in a newly allocated
+ * array which must be freed with #xmlFree.
+ *
+ * @since 2.16.0
+ *
+ * @param comp  the precompiled pattern
+ * @param doc  a compact document
+ * @param nodesOut  pointer to the resulting array of nodes
+ * @returns the number of nodes found or -1 if the pattern isn't
+ * streamable or a memory allocation failed.
+ */
+int
+xmlPatternSelectCompact(xmlPattern *comp, const xmlCompactDoc *doc,
+                        unsigned **nodesOut) {
+    xmlStreamCtxtPtr stream;
+    unsigned *nodes = NULL;
+    int nbNodes = 0, maxNodes = 0;
+    int maxDepth, minDepth, fromRoot;
+    int wantsAny, wantsAttrs;
+    int ret, depth;
+    unsigned cur, attr;
+
+    if (nodesOut == NULL)
+        return(-1);
+    *nodesOut = NULL;
+    if ((comp == NULL) || (doc == NULL) || (xmlPatternStreamable(comp) != 1))
+        return(-1);
+
+    maxDepth = xmlPatternMaxDepth(comp);
+    if (maxDepth == -2)
+        maxDepth = INT_MAX;
+    minDepth = xmlPatternMinDepth(comp);
+    fromRoot = xmlPatternFromRoot(comp);
+    if ((maxDepth < 0) || (minDepth < 0) || (fromRoot < 0))
+        return(-1);
+
+    stream = xmlPatternGetStreamCtxt(comp);
+    if (stream == NULL)
+        return(-1);
+    wantsAny = xmlStreamWantsAnyNode(stream);
+    wantsAttrs = xmlPatternWantsAttrs(comp);
+
+    ret = 0;
+    if (fromRoot) {
+        ret = xmlStreamPush(stream, NULL, NULL);
+        if (ret < 0)
+            goto error;
+    }
+    /* "/" or "." */
+    if ((minDepth == 0) || (ret == 1)) {
+        if (xmlPatternAddCompactNode(&nodes, &nbNodes, &maxNodes,
+                                     XML_COMPACT_DOC_NODE) < 0)
+            goto error;
+    }
+    if (maxDepth == 0)
+        goto done;
+
+    depth = 1;
+    cur = doc->children[XML_COMPACT_DOC_NODE];
+    while (cur != 0) {
+        int type = doc->types[cur];
+        int descend = 0;
+
+        if (type == XML_ELEMENT_NODE) {
+            const xmlCompactName *name = &doc->nameTab[doc->names[cur]];
+
+            ret = xmlStreamPush(stream, name->name, name->href);
+            if (ret < 0)
+                goto error;
+            if ((ret == 1) &&
+                (xmlPatternAddCompactNode(&nodes, &nbNodes, &maxNodes,
+                                          cur) < 0))
+                goto error;
+
+            if ((wantsAttrs) && (depth < maxDepth)) {
+                for (attr = doc->data[cur]; attr != 0;
+                     attr = doc->nexts[attr]) {
+                    if (doc->types[attr] != XML_ATTRIBUTE_NODE)
+                        continue;
+                    name = &doc->nameTab[doc->names[attr]];
+                    ret = xmlStreamPushAttr(stream, name->name, name->href);
+                    if (ret < 0)
+                        goto error;
+                    if ((ret == 1) &&
+                        (xmlPatternAddCompactNode(&nodes, &nbNodes,
+                                                  &maxNodes, attr) < 0))
+                        goto error;
+                    xmlStreamPop(stream);
+                }
+            }
+
+            if ((doc->children[cur] != 0) && (depth < maxDepth))
+                descend = 1;
+            else
+                xmlStreamPop(stream);
+        } else if ((wantsAny) &&
+                   ((type == XML_TEXT_NODE) ||
+                    (type == XML_CDATA_SECTION_NODE) ||
+                    (type == XML_COMMENT_NODE) ||
+                    (type == XML_PI_NODE))) {
+            ret = xmlStreamPushNode(stream, NULL, NULL, type);
+            if (ret < 0)
+                goto error;
+            if ((ret == 1) &&
+                (xmlPatternAddCompactNode(&nodes, &nbNodes, &maxNodes,
+                                          cur) < 0))
+                goto error;
+            xmlStreamPop(stream);
+        }
+
+        if (descend) {
+            cur = doc->children[cur];
+            depth++;
+            continue;
+        }
+
+        while (doc->nexts[cur] == 0) {
+            cur = doc->parents[cur];
+            depth--;
+            if (cur == XML_COMPACT_DOC_NODE)
+                goto done;
+            xmlStreamPop(stream);
+        }
+        cur = doc->nexts[cur];
+    }
+
+done:
+    xmlFreeStreamCtxt(stream);
+    *nodesOut = nodes;
+    return(nbNodes);
+
+error:
+    xmlFreeStreamCtxt(stream);
+    xmlFree(nodes);
+    return(-1);
+}
+
 /**
  * Get a streaming context for that pattern
  * Use #xmlFreeStreamCtxt to free the context.
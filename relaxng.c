@@ -10686,6 +10686,14 @@ xmlRelaxNGValidateDoc(xmlRelaxNGValidCtxt *ctxt, xmlDoc *doc)
     if ((ctxt == NULL) || (doc == NULL))
         return (-1);
 
+    /*
+     * The validator stores state in the psvi member of elements
+     */
+    if (xmlNodeMaterialize((xmlNodePtr) doc) < 0) {
+        xmlRngVErrMemory(ctxt);
+        return (-1);
+    }
+
     ctxt->doc = doc;
 
     ret = xmlRelaxNGValidateDocument(ctxt, doc);
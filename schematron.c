@@ -708,6 +708,10 @@ xmlSchematronNewDocParserCtxt(xmlDoc *doc)
 
     if (doc == NULL)
         return (NULL);
+    if (xmlNodeMaterialize((xmlNodePtr) doc) < 0) {
+        xmlSchematronPErrMemory(NULL);
+        return (NULL);
+    }
 
     ret =
         (xmlSchematronParserCtxtPtr)
@@ -1913,6 +1917,10 @@ xmlSchematronValidateDoc(xmlSchematronValidCtxt *ctxt, xmlDoc *instance)
     if ((ctxt == NULL) || (ctxt->schema == NULL) ||
         (ctxt->schema->rules == NULL) || (instance == NULL))
         return(-1);
+    if (xmlNodeMaterialize((xmlNodePtr) instance) < 0) {
+        xmlSchematronVErrMemory(ctxt);
+        return(-1);
+    }
     ctxt->nberrors = 0;
     root = xmlDocGetRootElement(instance);
     if (root == NULL) {
@@ -1385,6 +1385,7 @@ main(int argc ATTRIBUTE_UNUSED, char **argv ATTRIBUTE_UNUSED) {
     xmlXPatherror(NULL, NULL, 0, 0);
 #ifdef LIBXML_DEBUG_ENABLED
     xmlXPathDebugDumpCompExpr(NULL, NULL, 0);
+    xmlXPathDebugDumpCompExprPlan(NULL, NULL, 0);
     xmlXPathDebugDumpObject(NULL, NULL, 0);
 #endif /* LIBXML_DEBUG_ENABLED */
 #endif /* LIBXML_XPATH_ENABLED */
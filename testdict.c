@@ -139,7 +139,7 @@ test_subdict(xmlDictPtr parent) {
 	exit(1);
     }
     /* Cast to avoid buggy warning on MSVC. */
-    memset((void *) test2, 0, sizeof(test2));
+    memset((void *) test2, 0, NB_STRINGS_MAX * sizeof(test2[0]));
 
     /*
      * Fill in NB_STRINGS_MIN, at this point the dictionary should not grow
@@ -395,6 +395,43 @@ test_dict(xmlDict *dict) {
     return(ret);
 }
 
+/*
+ * This tests freezing a dictionary
+ */
+static int
+test_frozen(xmlDictPtr dict) {
+    int i;
+    int ret = 0;
+    int size;
+
+    if (xmlDictFreeze(dict) != 0) {
+        fprintf(stderr, "Failed to freeze dictionary\n");
+        return(1);
+    }
+    size = xmlDictSize(dict);
+
+    for (i = 0;i < NB_STRINGS_MAX;i++) {
+        if (xmlDictLookup(dict, strings1[i], -1) != test1[i]) {
+	    fprintf(stderr, "Failed frozen lookup for '%s'\n", strings1[i]);
+	    ret = 1;
+	    nbErrors++;
+	}
+        if (xmlDictLookup(dict, strings2[i], -1) != NULL) {
+	    fprintf(stderr, "Frozen dictionary added '%s'\n", strings2[i]);
+	    ret = 1;
+	    nbErrors++;
+	}
+    }
+
+    if (xmlDictSize(dict) != size) {
+        fprintf(stderr, "Frozen dictionary changed size\n");
+        ret = 1;
+        nbErrors++;
+    }
+
+    return(ret);
+}
+
 static int
 testall_dict(void) {
     xmlDictPtr dict;
@@ -426,6 +463,12 @@ testall_dict(void) {
     if (test_subdict(dict) != 0) {
         ret = 1;
     }
+    if (test_frozen(dict) != 0) {
+        ret = 1;
+    }
+    if (test_subdict(dict) != 0) {
+        ret = 1;
+    }
     xmlDictFree(dict);
 
     clean_strings();
@@ -9,16 +9,42 @@
 #include "libxml.h"
 #include <libxml/parser.h>
 #include <libxml/parserInternals.h>
+#include <libxml/pattern.h>
 #include <libxml/uri.h>
 #include <libxml/xmlreader.h>
 #include <libxml/xmlsave.h>
 #include <libxml/xmlwriter.h>
+#include <libxml/xpath.h>
+#include <libxml/xpathInternals.h>
+#include <libxml/xmlschemas.h>
+#include <libxml/c14n.h>
 #include <libxml/HTMLparser.h>
 #include <libxml/HTMLtree.h>
 
 #include <string.h>
+#include <stdlib.h>
 
-#ifdef LIBXML_SAX1_ENABLED
+/*
+ * Force the number of threads used for parallel processing, so the
+ * parallel code also runs on machines with a single CPU. 0 restores
+ * the default.
+ */
+static void
+setThreadCount(int num) {
+    char buf[20];
+
+    snprintf(buf, sizeof(buf), "%d", num);
+#ifdef _WIN32
+    _putenv_s("XML_PARALLEL_THREADS", num > 0 ? buf : "");
+#else
+    if (num > 0)
+        setenv("XML_PARALLEL_THREADS", buf, 1);
+    else
+        unsetenv("XML_PARALLEL_THREADS");
+#endif
+}
+
+#if defined(LIBXML_SAX1_ENABLED) || defined(LIBXML_XPATH_ENABLED)
 static void
 ignoreError(void *ctxt ATTRIBUTE_UNUSED,
             const xmlError *error ATTRIBUTE_UNUSED) {
@@ -136,6 +162,109 @@ testCFileIO(void) {
     return err;
 }
 
+#ifdef LIBXML_OUTPUT_ENABLED
+#if HAVE_DECL_MMAP && defined(__linux__)
+static int
+isFileMapped(const char *filename) {
+    FILE *maps;
+    char line[1024];
+    int ret = 0;
+
+    maps = fopen("/proc/self/maps", "r");
+    if (maps == NULL)
+        return(-1);
+    while (fgets(line, sizeof(line), maps) != NULL) {
+        if (strstr(line, filename) != NULL) {
+            ret = 1;
+            break;
+        }
+    }
+    fclose(maps);
+
+    return(ret);
+}
+#endif
+
+static int
+testMappedFile(void) {
+    const char *filename = "testparser-mmap.xml";
+    /* A multiple of the page size, so no padding follows the data */
+    size_t size = 32 * 4096;
+    char *xml;
+    xmlDocPtr ref;
+    xmlChar *refDump;
+    FILE *out;
+    size_t len;
+    int i, refLen, err = 0;
+
+    xml = xmlMalloc(size + 1);
+    len = snprintf(xml, size, "<doc>\n");
+    while (len < size - 100)
+        len += snprintf(xml + len, size - len, "<a id='%d'>text</a>\n",
+                        (int) len);
+    memset(xml + len, ' ', size - len - 6);
+    memcpy(xml + size - 6, "</doc>", 6);
+    xml[size] = 0;
+
+    ref = xmlReadMemory(xml, size, NULL, NULL, 0);
+    xmlDocDumpMemory(ref, &refDump, &refLen);
+    xmlFreeDoc(ref);
+
+    out = fopen(filename, "wb");
+    if ((out == NULL) || (fwrite(xml, 1, size, out) != size)) {
+        fprintf(stderr, "testMappedFile: can't write %s\n", filename);
+        if (out != NULL)
+            fclose(out);
+        xmlFree(refDump);
+        xmlFree(xml);
+        return 1;
+    }
+    fclose(out);
+
+    /* The file is only mapped with XML_INPUT_MMAP */
+    for (i = 0; i < 2; i++) {
+        xmlParserCtxtPtr ctxt;
+        xmlParserInputPtr input = NULL;
+        xmlDocPtr doc = NULL;
+        xmlChar *dump = NULL;
+        int dumpLen;
+
+        ctxt = xmlNewParserCtxt();
+        xmlNewInputFromUrl(filename, i ? XML_INPUT_MMAP : 0, &input);
+        if (input == NULL) {
+            fprintf(stderr, "testMappedFile: can't open %s\n", filename);
+            err = 1;
+        } else {
+#if HAVE_DECL_MMAP && defined(__linux__)
+            int mapped = isFileMapped(filename);
+
+            if ((mapped >= 0) && (mapped != i)) {
+                fprintf(stderr, "testMappedFile: file %s mapped\n",
+                        mapped ? "was" : "wasn't");
+                err = 1;
+            }
+#endif
+            doc = xmlCtxtParseDocument(ctxt, input);
+        }
+        if (doc != NULL)
+            xmlDocDumpMemory(doc, &dump, &dumpLen);
+        if ((dump == NULL) || (strcmp((char *) dump, (char *) refDump))) {
+            fprintf(stderr, "testMappedFile: wrong result\n");
+            err = 1;
+        }
+
+        xmlFree(dump);
+        xmlFreeDoc(doc);
+        xmlFreeParserCtxt(ctxt);
+    }
+
+    remove(filename);
+    xmlFree(refDump);
+    xmlFree(xml);
+    return err;
+}
+#endif /* LIBXML_OUTPUT_ENABLED */
+
 /*
  * The exact rules when undeclared entities are a fatal error
  * depend on some conditions that aren't recovered from the
@@ -202,6 +331,168 @@ testInvalidCharRecovery(void) {
     return err;
 }
 
+/*
+ * Long runs of plain ASCII are skipped in blocks. Make sure that
+ * delimiters at arbitrary offsets and line numbers are still handled.
+ */
+static int
+testLongAsciiRuns(void) {
+    const char *xml =
+        "<doc a='0123456789abcdefghijklmnopqrstuvwxyz\tA  B'>"
+        "<!--0123456789abcdefghijklmnopqrstuvwxyz\n"
+        "0123456789abcdefghijklmnopqrstuvwxyz-->"
+        "<![CDATA[0123456789abcdefghijklmnopqrstuvwxyz]0123456789]]>"
+        "0123456789abcdefghijklmnopqrstuvwxyz\t0123456789\n"
+        "0123456789abcdefghijklmnopqrstuvwxyz&amp;0123456789abcdefghijklm"
+        "<e/></doc>";
+    const char *bad[] = {
+        "<doc a='0123456789abcdefghijklmnopqrstuvwxyz<'/>",
+        "<doc>0123456789abcdefghijklmnopqrstuvwxyz]]>xxx</doc>",
+        "<doc><!--0123456789abcdefghijklmnopqrstuvwxyz--0--></doc>"
+    };
+    xmlDoc *doc;
+    xmlNode *root, *node;
+    xmlChar *value;
+    int err = 0;
+    size_t i;
+
+    doc = xmlReadDoc(BAD_CAST xml, NULL, NULL, 0);
+    if (doc == NULL) {
+        fprintf(stderr, "Failed to parse document with long runs\n");
+        return 1;
+    }
+    root = xmlDocGetRootElement(doc);
+
+    value = xmlGetProp(root, BAD_CAST "a");
+    if (!xmlStrEqual(value,
+            BAD_CAST "0123456789abcdefghijklmnopqrstuvwxyz A  B")) {
+        fprintf(stderr, "Wrong attribute value: %s\n", value);
+        err = 1;
+    }
+    xmlFree(value);
+
+    node = root->children;
+    if ((node == NULL) || (node->type != XML_COMMENT_NODE) ||
+        (strcmp((char *) node->content,
+                "0123456789abcdefghijklmnopqrstuvwxyz\n"
+                "0123456789abcdefghijklmnopqrstuvwxyz") != 0)) {
+        fprintf(stderr, "Wrong comment\n");
+        err = 1;
+    }
+
+    node = node ? node->next : NULL;
+    if ((node == NULL) || (node->type != XML_CDATA_SECTION_NODE) ||
+        (strcmp((char *) node->content,
+                "0123456789abcdefghijklmnopqrstuvwxyz]0123456789") != 0)) {
+        fprintf(stderr, "Wrong CDATA section\n");
+        err = 1;
+    }
+
+    node = xmlGetLastChild(root);
+    if ((node == NULL) || (xmlGetLineNo(node) != 3)) {
+        fprintf(stderr, "Wrong line number after long runs\n");
+        err = 1;
+    }
+
+    xmlFreeDoc(doc);
+
+    for (i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        doc = xmlReadDoc(BAD_CAST bad[i], NULL, NULL, XML_PARSE_NOERROR);
+        if (doc != NULL) {
+            fprintf(stderr, "Failed to detect error in %s\n", bad[i]);
+            err = 1;
+        }
+        xmlFreeDoc(doc);
+    }
+
+    return err;
+}
+
+typedef struct {
+    int nbChunks;
+    int sizes[4];
+    xmlChar text[1000];
+    int len;
+} testTextChunks;
+
+static void
+testTextChunksCharacters(void *ctxt, const xmlChar *ch, int len) {
+    xmlParserCtxt *pctxt = ctxt;
+    testTextChunks *chunks = pctxt->_private;
+
+    if (chunks->nbChunks < 4)
+        chunks->sizes[chunks->nbChunks] = len;
+    chunks->nbChunks++;
+    if (chunks->len + len < (int) sizeof(chunks->text)) {
+        memcpy(chunks->text + chunks->len, ch, len);
+        chunks->len += len;
+    }
+}
+
+/*
+ * Text with non-ASCII characters is reported without copying, but in
+ * the same chunks as before: a chunk ends after the character which
+ * reaches XML_PARSER_BIG_BUFFER_SIZE bytes, never inside a multi-byte
+ * sequence.
+ */
+static int
+testUtf8TextChunks(void) {
+    xmlSAXHandler sax;
+    xmlParserCtxt *ctxt;
+    xmlDoc *doc;
+    testTextChunks chunks;
+    xmlChar text[500];
+    xmlChar xml[600];
+    int err = 0;
+    int len = 0;
+    int push;
+
+    /* U+00E9, 297 ASCII chars, then U+20AC straddling byte 300 */
+    memcpy(text, "\xC3\xA9", 2);
+    len += 2;
+    memset(text + len, 'x', 297);
+    len += 297;
+    memcpy(text + len, "\xE2\x82\xAC", 3);
+    len += 3;
+    memset(text + len, 'y', 100);
+    len += 100;
+    snprintf((char *) xml, sizeof(xml), "<doc>%.*s</doc>", len, text);
+
+    memset(&sax, 0, sizeof(sax));
+    xmlSAXVersion(&sax, 2);
+    sax.characters = testTextChunksCharacters;
+
+    for (push = 0; push < 2; push++) {
+        memset(&chunks, 0, sizeof(chunks));
+
+        if (push) {
+            ctxt = xmlCreatePushParserCtxt(&sax, NULL, NULL, 0, NULL);
+            ctxt->_private = &chunks;
+            xmlParseChunk(ctxt, (char *) xml, strlen((char *) xml), 1);
+            doc = ctxt->myDoc;
+        } else {
+            ctxt = xmlNewSAXParserCtxt(&sax, NULL);
+            ctxt->_private = &chunks;
+            doc = xmlCtxtReadDoc(ctxt, xml, NULL, NULL, 0);
+        }
+        if ((!ctxt->wellFormed) ||
+            (chunks.nbChunks != 2) ||
+            (chunks.sizes[0] != 302) || (chunks.sizes[1] != 100) ||
+            (chunks.len != len) ||
+            (memcmp(chunks.text, text, len) != 0)) {
+            fprintf(stderr, "Wrong text chunks (push=%d): %d chunks, "
+                    "sizes %d %d\n",
+                    push, chunks.nbChunks, chunks.sizes[0], chunks.sizes[1]);
+            err = 1;
+        }
+
+        xmlFreeDoc(doc);
+        xmlFreeParserCtxt(ctxt);
+    }
+
+    return err;
+}
+
 static void
 testCtxtInputGetterError(void *errCtxt, const xmlError *error) {
     int *err = errCtxt;
@@ -271,860 +562,3871 @@ testCtxtInputGetters(void) {
     return err;
 }
 
-#ifdef LIBXML_VALID_ENABLED
-static void
-testSwitchDtdExtSubset(void *vctxt, const xmlChar *name ATTRIBUTE_UNUSED,
-                       const xmlChar *externalId ATTRIBUTE_UNUSED,
-                       const xmlChar *systemId ATTRIBUTE_UNUSED) {
-    xmlParserCtxtPtr ctxt = vctxt;
-
-    ctxt->myDoc->extSubset = ctxt->_private;
-}
-
 static int
-testSwitchDtd(void) {
-    const char dtdContent[] =
-        "<!ENTITY test '<elem1/><elem2/>'>\n";
-    const char docContent[] =
-        "<!DOCTYPE doc SYSTEM 'entities.dtd'>\n"
-        "<doc>&test;</doc>\n";
-    xmlParserInputBufferPtr input;
-    xmlParserCtxtPtr ctxt;
-    xmlDtdPtr dtd;
-    xmlDocPtr doc;
-    xmlEntityPtr ent;
+testArena(void) {
+    const char xml1[] = "<doc1><a x='1'>text &amp; more</a><b/></doc1>";
+    const char xml2[] = "<doc2>abc<c/></doc2>";
+    xmlDocPtr doc1, doc2;
+    xmlNodePtr root1, root2, a, c;
+    xmlChar *content;
     int err = 0;
 
-    input = xmlParserInputBufferCreateStatic(dtdContent,
-                                             sizeof(dtdContent) - 1,
-                                             XML_CHAR_ENCODING_NONE);
-    dtd = xmlIOParseDTD(NULL, input, XML_CHAR_ENCODING_NONE);
+    doc1 = xmlReadDoc(BAD_CAST xml1, NULL, NULL, XML_PARSE_ARENA);
+    doc2 = xmlReadDoc(BAD_CAST xml2, NULL, NULL, XML_PARSE_ARENA);
+    if ((doc1 == NULL) || (doc2 == NULL)) {
+        fprintf(stderr, "testArena: parsing failed\n");
+        xmlFreeDoc(doc1);
+        xmlFreeDoc(doc2);
+        return 1;
+    }
+    root1 = xmlDocGetRootElement(doc1);
+    root2 = xmlDocGetRootElement(doc2);
+
+    /* Modify text allocated from the arena */
+    xmlNodeAddContent(root2->children, BAD_CAST "def");
+
+    /* Move nodes in both directions and free the source document */
+    a = root1->children;
+    c = root2->last;
+    xmlUnlinkNode(a);
+    xmlAddChild(root2, a);
+    xmlUnlinkNode(c);
+    xmlAddChild(root1, c);
+    xmlFreeDoc(doc1);
+
+    content = xmlNodeGetContent(root2);
+    if ((content == NULL) ||
+        (strcmp((char *) content, "abcdeftext & more") != 0)) {
+        fprintf(stderr, "testArena: wrong content %s\n", (char *) content);
+        err = 1;
+    }
+    xmlFree(content);
 
-    ctxt = xmlNewParserCtxt();
-    ctxt->_private = dtd;
-    ctxt->sax->externalSubset = testSwitchDtdExtSubset;
-    doc = xmlCtxtReadMemory(ctxt, docContent, sizeof(docContent) - 1, NULL,
-                            NULL, XML_PARSE_NOENT | XML_PARSE_DTDLOAD);
-    xmlFreeParserCtxt(ctxt);
+    xmlUnlinkNode(a);
+    xmlFreeNode(a);
+    xmlFreeDoc(doc2);
+
+    /* Moving nodes out of the document must fail */
+    doc1 = xmlReadDoc(BAD_CAST xml1, NULL, NULL, XML_PARSE_ARENA);
+    doc2 = xmlNewDoc(BAD_CAST "1.0");
+    if (doc1 == NULL || doc2 == NULL) {
+        fprintf(stderr, "testArena: parsing failed\n");
+        xmlFreeDoc(doc1);
+        xmlFreeDoc(doc2);
+        return 1;
+    }
+    root1 = xmlDocGetRootElement(doc1);
+    a = root1->children;
+    c = a->next;
+    xmlUnlinkNode(a);
+    if ((xmlSetTreeDoc(a, NULL) != -1) ||
+        (a->doc != doc1) ||
+        (a->properties->doc != doc1) ||
+        (a->children->doc != doc1)) {
+        fprintf(stderr, "testArena: moved node out of document\n");
+        err = 1;
+    }
+    xmlNodeAddContent(a->children, BAD_CAST "!");
+    xmlFreeNode(a);
+
+    /* Attach a node to a document without arena and free the source */
+    xmlUnlinkNode(c);
+    xmlDocSetRootElement(doc2, c);
+    xmlFreeDoc(doc1);
+    if ((c->doc != doc2) || (strcmp((char *) c->name, "b") != 0)) {
+        fprintf(stderr, "testArena: wrong moved node\n");
+        err = 1;
+    }
+    xmlFreeDoc(doc2);
 
-    ent = xmlGetDocEntity(doc, BAD_CAST "test");
-    if (ent->children->doc != NULL) {
-        fprintf(stderr, "Entity content should have NULL doc\n");
+    return err;
+}
+
+static int
+testFrozenDict(void) {
+    const char *names[] = { "doc", "item", "id" };
+    xmlDictPtr dict;
+    xmlDocPtr doc[2];
+    char *xml;
+    size_t size = 500000, len;
+    int i, dictSize, err = 0;
+
+    dict = xmlDictCreate();
+    for (i = 0; i < 3; i++)
+        xmlDictLookup(dict, BAD_CAST names[i], -1);
+    xmlDictFreeze(dict);
+    dictSize = xmlDictSize(dict);
+
+    xml = xmlMalloc(size);
+    len = snprintf(xml, size, "<doc>\n");
+    for (i = 0; i < 10000; i++)
+        len += snprintf(xml + len, size - len, "<item id='%d'/>\n", i);
+    snprintf(xml + len, size - len, "<other/></doc>\n");
+
+    setThreadCount(4);
+    for (i = 0; i < 2; i++) {
+        xmlParserCtxtPtr ctxt = xmlNewParserCtxt();
+
+        xmlCtxtSetDict(ctxt, dict);
+        doc[i] = xmlCtxtReadMemory(ctxt, xml, strlen(xml), NULL, NULL,
+                                   i ? XML_PARSE_PARALLEL : 0);
+        xmlFreeParserCtxt(ctxt);
+    }
+    setThreadCount(0);
+
+    if ((doc[0] == NULL) || (doc[1] == NULL)) {
+        fprintf(stderr, "testFrozenDict: parsing failed\n");
         err = 1;
+    } else {
+        xmlNodePtr root[2] = {
+            xmlDocGetRootElement(doc[0]),
+            xmlDocGetRootElement(doc[1])
+        };
+        const xmlChar *itemName = xmlDictLookup(dict, BAD_CAST "item", -1);
+        const xmlChar *idName = xmlDictLookup(dict, BAD_CAST "id", 2);
+        xmlNodePtr item;
+
+        if ((root[0]->name != root[1]->name) ||
+            (root[0]->name != xmlDictLookup(dict, BAD_CAST "doc", -1)) ||
+            (root[0]->children->next->name != itemName)) {
+            fprintf(stderr, "testFrozenDict: names differ\n");
+            err = 1;
+        }
+        for (item = root[1]->children; item != NULL; item = item->next) {
+            if ((item->type == XML_ELEMENT_NODE) &&
+                (item->properties != NULL) &&
+                ((item->name != itemName) ||
+                 (item->properties->name != idName))) {
+                fprintf(stderr, "testFrozenDict: names differ\n");
+                err = 1;
+                break;
+            }
+        }
+        if ((!xmlStrEqual(root[0]->last->name, BAD_CAST "other")) ||
+            (xmlDictOwns(dict, root[0]->last->name)) ||
+            (!xmlDictOwns(doc[1]->dict, root[1]->last->name))) {
+            fprintf(stderr, "testFrozenDict: new name in wrong dict\n");
+            err = 1;
+        }
     }
 
-    /* Free doc before DTD */
-    doc->extSubset = NULL;
-    xmlFreeDoc(doc);
-    xmlFreeDtd(dtd);
+    if (xmlDictSize(dict) != dictSize) {
+        fprintf(stderr, "testFrozenDict: frozen dict was modified\n");
+        err = 1;
+    }
 
+    xmlFreeDoc(doc[0]);
+    xmlFreeDoc(doc[1]);
+    xmlFree(xml);
+    xmlDictFree(dict);
     return err;
 }
-#endif /* LIBXML_VALID_ENABLED */
 
-#ifdef LIBXML_OUTPUT_ENABLED
+#if defined(LIBXML_OUTPUT_ENABLED) && defined(LIBXML_XPATH_ENABLED)
 static xmlChar *
-dumpNodeList(xmlNodePtr list) {
-    xmlBufferPtr buffer;
-    xmlSaveCtxtPtr save;
-    xmlNodePtr cur;
-    xmlChar *ret;
+testLazyTreeQuery(xmlDocPtr doc, const char *expr, int flags) {
+    xmlXPathContextPtr xpctxt;
+    xmlXPathObjectPtr res;
+    xmlChar *ret = NULL;
+    int i;
 
-    buffer = xmlBufferCreate();
-    save = xmlSaveToBuffer(buffer, "UTF-8", 0);
-    for (cur = list; cur != NULL; cur = cur->next)
-        xmlSaveTree(save, cur);
-    xmlSaveClose(save);
+    xpctxt = xmlXPathNewContext(doc);
+    xpctxt->flags |= flags;
+    xmlXPathRegisterNs(xpctxt, BAD_CAST "p", BAD_CAST "urn:p");
+    res = xmlXPathEval(BAD_CAST expr, xpctxt);
+    if ((res != NULL) && (res->type == XPATH_NODESET)) {
+        ret = xmlStrdup(BAD_CAST "");
+        for (i = 0; i < xmlXPathNodeSetGetLength(res->nodesetval); i++) {
+            xmlNodePtr node = res->nodesetval->nodeTab[i];
+            xmlChar *path = xmlGetNodePath(node);
+            xmlChar *content = xmlNodeGetContent(node);
+
+            ret = xmlStrcat(ret, path);
+            ret = xmlStrcat(ret, BAD_CAST "=");
+            ret = xmlStrcat(ret, content);
+            ret = xmlStrcat(ret, BAD_CAST "\n");
+            xmlFree(path);
+            xmlFree(content);
+        }
+    } else if (res != NULL) {
+        ret = xmlXPathCastToString(res);
+    }
+    xmlXPathFreeObject(res);
+    xmlXPathFreeContext(xpctxt);
 
-    ret = xmlBufferDetach(buffer);
-    xmlBufferFree(buffer);
     return ret;
 }
 
 static int
-testCtxtParseContent(void) {
-    xmlParserCtxtPtr ctxt;
-    xmlParserInputPtr input;
-    xmlDocPtr doc;
-    xmlNodePtr node, list;
-    const char *content;
-    xmlChar *output;
-    int i, j;
-    int err = 0;
-
-    static const char *const tests[] = {
-        "<!-- c -->\xF0\x9F\x98\x84<a/><b/>end",
-        "text<a:foo><b:foo/></a:foo>text<!-- c -->"
+testLazyTree(void) {
+    const char xml[] =
+        "<?xml version='1.0'?>\n"
+        "<!-- c0 -->\n"
+        "<doc xmlns:p='urn:p' a='1' p:b='x &amp; y'>\n"
+        "  text &lt;1&gt;<e xml:id='e1' c='&#65;'>in<![CDATA[cd]]>more</e>"
+        "<?pi data?>\n"
+        "  <f p:g='2'><g>deep</g>tail<g/></f><!-- c1 -->end &amp; more"
+        "</doc>\n";
+    const char *exprs[] = {
+        "//g",
+        "//*[@a]",
+        "//text()",
+        "//@*",
+        "//comment() | //processing-instruction()",
+        "/doc/e/following-sibling::node()",
+        "//g[2]/preceding-sibling::node()",
+        "id('e1')",
+        "//f/following::node()",
+        "string(/doc)",
+        "count(//node())",
+        "//*[. = 'deep']",
     };
+    xmlDocPtr doc[2];
+    xmlChar *out[2];
+    int size[2];
+    int i, j, err = 0;
 
-    doc = xmlReadDoc(BAD_CAST "<doc xmlns:a='a'><elem xmlns:b='b'/></doc>",
-                     NULL, NULL, 0);
-    node = doc->children->children;
+    for (i = 0; i < 2; i++) {
+        xmlParserCtxtPtr ctxt = xmlNewParserCtxt();
 
-    ctxt = xmlNewParserCtxt();
+        xmlCtxtSetLazyTree(ctxt, i);
+        doc[i] = xmlCtxtReadMemory(ctxt, xml, sizeof(xml) - 1, NULL, NULL,
+                                   0);
+        xmlFreeParserCtxt(ctxt);
+    }
+    if ((doc[0] == NULL) || (doc[1] == NULL)) {
+        fprintf(stderr, "testLazyTree: parsing failed\n");
+        err = 1;
+        goto done;
+    }
+    if (((doc[0]->properties & XML_DOC_LAZY) != 0) ||
+        ((doc[1]->properties & XML_DOC_LAZY) == 0)) {
+        fprintf(stderr, "testLazyTree: wrong document properties\n");
+        err = 1;
+    }
 
-    for (i = 0; (size_t) i < sizeof(tests) / sizeof(tests[0]); i++) {
-        content = tests[i];
+    for (j = 0; j < (int) (sizeof(exprs) / sizeof(exprs[0])); j++) {
+        for (i = 1; i >= 0; i--)
+            out[i] = testLazyTreeQuery(doc[i], exprs[j], 0);
+        if ((out[0] == NULL) || (!xmlStrEqual(out[0], out[1]))) {
+            fprintf(stderr, "testLazyTree: %s differs:\n%s---\n%s\n",
+                    exprs[j], (char *) out[0], (char *) out[1]);
+            err = 1;
+        }
+        xmlFree(out[0]);
+        xmlFree(out[1]);
+    }
 
-        for (j = 0; j < 2; j++) {
-            if (j == 0) {
-                input = xmlNewInputFromString(NULL, content,
-                                              XML_INPUT_BUF_STATIC);
-                list = xmlCtxtParseContent(ctxt, input, node, 0);
-            } else {
-                xmlParseInNodeContext(node, content, strlen(content), 0,
-                                      &list);
-            }
+    for (i = 0; i < 2; i++) {
+        xmlNodePtr root = xmlDocGetRootElement(doc[i]);
+        xmlNodePtr e = xmlFirstElementChild(root);
+        xmlNodePtr f = xmlNextElementSibling(e);
+        xmlChar *value = xmlGetNsProp(root, BAD_CAST "b", BAD_CAST "urn:p");
 
-            output = dumpNodeList(list);
+        if ((value == NULL) || (strcmp((char *) value, "x & y") != 0)) {
+            fprintf(stderr, "testLazyTree: wrong attribute %s\n",
+                    (char *) value);
+            err = 1;
+        }
+        xmlFree(value);
 
-            if ((j == 0 && ctxt->nsWellFormed == 0) ||
-                strcmp((char *) output, content) != 0) {
-                fprintf(stderr, "%s failed test %d, got:\n%s\n",
-                        j == 0 ?
-                            "xmlCtxtParseContent" :
-                            "xmlParseInNodeContext",
-                        i, output);
-                err = 1;
-            }
+        xmlSetProp(e, BAD_CAST "c", BAD_CAST "B");
+        xmlAddPrevSibling(f->children, xmlNewDocText(doc[i], BAD_CAST "1"));
+        xmlAddChild(f, xmlNewDocText(doc[i], BAD_CAST "2"));
+        xmlFreeNode(xmlReplaceNode(root->last,
+                                   xmlNewDocText(doc[i], BAD_CAST "3")));
 
-            xmlFree(output);
-            xmlFreeNodeList(list);
-        }
+        xmlDocDumpMemory(doc[i], &out[i], &size[i]);
+    }
+    if ((out[0] == NULL) || (!xmlStrEqual(out[0], out[1]))) {
+        fprintf(stderr, "testLazyTree: serialization differs:\n%s---\n%s",
+                (char *) out[0], (char *) out[1]);
+        err = 1;
     }
+    xmlFree(out[0]);
+    xmlFree(out[1]);
 
-    xmlFreeParserCtxt(ctxt);
-    xmlFreeDoc(doc);
+    if (xmlNodeMaterialize((xmlNodePtr) doc[1]) != 0) {
+        fprintf(stderr, "testLazyTree: materialization failed\n");
+        err = 1;
+    }
 
+done:
+    xmlFreeDoc(doc[0]);
+    xmlFreeDoc(doc[1]);
     return err;
 }
 
 static int
-testNoBlanks(void) {
-    const xmlChar xml[] =
-        "<refentry>\n"
-        "  <refsect1>\n"
-        "    <para>\n"
-        "      Run <command>tester --help</command> for more options.\n"
-        "    </para>\n"
-        "  </refsect1>\n"
-        "</refentry>\n";
-    const xmlChar expect[] =
-        "<?xml version=\"1.0\"?>\n"
-        "<refentry><refsect1><para>\n"
-        "      Run <command>tester --help</command> for more options.\n"
-        "    </para></refsect1></refentry>\n";
+testLazyTreePsvi(void) {
+    const char xml[] = "<d a='1'><e b='2'>t</e><f/></d>";
+    xmlParserCtxtPtr ctxt;
     xmlDocPtr doc;
-    xmlChar *out;
+    xmlNodePtr root, e;
+    xmlChar *value;
+    unsigned long generation;
+    int i, err = 0;
+
+    for (i = 0; i < 2; i++) {
+        ctxt = xmlNewParserCtxt();
+        xmlCtxtSetLazyTree(ctxt, 1);
+        doc = xmlCtxtReadMemory(ctxt, xml, sizeof(xml) - 1, NULL, NULL, 0);
+        xmlFreeParserCtxt(ctxt);
+        if (doc == NULL) {
+            fprintf(stderr, "testLazyTreePsvi: parsing failed\n");
+            return 1;
+        }
+        root = xmlDocGetRootElement(doc);
+        e = xmlFirstElementChild(root);
+
+        /* Materializing doesn't change the generation of the document */
+        generation = doc->generation;
+        if (i == 1)
+            xmlNodeMaterialize((xmlNodePtr) doc);
+
+        /* The psvi member is left to applications */
+        root->psvi = &err;
+        e->psvi = &err;
+
+        value = xmlGetProp(root, BAD_CAST "a");
+        if ((value == NULL) || (strcmp((char *) value, "1") != 0)) {
+            fprintf(stderr, "testLazyTreePsvi: wrong attribute\n");
+            err = 1;
+        }
+        xmlFree(value);
+        if (doc->generation != generation) {
+            fprintf(stderr, "testLazyTreePsvi: generation changed\n");
+            err = 1;
+        }
+
+        xmlNodeMaterialize((xmlNodePtr) doc);
+        value = xmlNodeGetContent(e);
+        if ((value == NULL) || (strcmp((char *) value, "t") != 0) ||
+            (!xmlHasProp(e, BAD_CAST "b")) ||
+            (root->psvi != &err) || (e->psvi != &err)) {
+            fprintf(stderr, "testLazyTreePsvi: wrong content\n");
+            err = 1;
+        }
+        xmlFree(value);
+
+        xmlFreeDoc(doc);
+    }
+
+    return err;
+}
+
+/*
+ * The XPath indexes are built from the nodes which exist and aren't
+ * invalidated when nodes are materialized.
+ */
+static int
+testLazyTreeIndex(void) {
+    const char xml[] =
+        "<doc>"
+        "<rec n='1' m='a &amp; b'>t1<name>x</name>u1</rec>"
+        "<rec n='2'>t2<name>y</name><!--c--></rec>"
+        "<rec n='2' m='c'><sub><name>z</name>t3</sub>u3</rec>"
+        "</doc>";
+    const char *exprs[] = {
+        "count(//rec[@n >= 0 and .//name])",
+        "//rec[@n = '2']",
+        "//rec[@n = '2']//name",
+        "//rec[@m = 'a & b']/text()",
+        "//rec[@m = 'c']//text()",
+        "//name/following::node()",
+        "//rec[@n = '1']//name | //rec[@n = '2']/comment()",
+        "//rec[.//name = 'z']/@n",
+        "//rec/following::node()",
+        "//name/preceding::node()",
+        "//@n/following::text()",
+    };
+    int flags = XML_XPATH_NAME_INDEX | XML_XPATH_ATTR_INDEX;
+    xmlDocPtr doc[2];
+    xmlChar *out[2];
+    unsigned long generation;
+    int i, j, err = 0;
+
+    for (i = 0; i < 2; i++) {
+        xmlParserCtxtPtr ctxt = xmlNewParserCtxt();
+
+        xmlCtxtSetLazyTree(ctxt, i);
+        doc[i] = xmlCtxtReadMemory(ctxt, xml, sizeof(xml) - 1, NULL, NULL,
+                                   0);
+        xmlFreeParserCtxt(ctxt);
+    }
+    if ((doc[0] == NULL) || (doc[1] == NULL)) {
+        fprintf(stderr, "testLazyTreeIndex: parsing failed\n");
+        err = 1;
+        goto done;
+    }
+
+    generation = doc[1]->generation;
+    for (j = 0; j < (int) (sizeof(exprs) / sizeof(exprs[0])); j++) {
+        for (i = 1; i >= 0; i--)
+            out[i] = testLazyTreeQuery(doc[i], exprs[j], flags);
+        if ((out[0] == NULL) || (!xmlStrEqual(out[0], out[1]))) {
+            fprintf(stderr, "testLazyTreeIndex: %s differs:\n%s---\n%s\n",
+                    exprs[j], (char *) out[0], (char *) out[1]);
+            err = 1;
+        }
+        xmlFree(out[0]);
+        xmlFree(out[1]);
+    }
+    if (doc[1]->generation != generation) {
+        fprintf(stderr, "testLazyTreeIndex: generation changed\n");
+        err = 1;
+    }
+
+done:
+    xmlFreeDoc(doc[0]);
+    xmlFreeDoc(doc[1]);
+    return err;
+}
+#endif /* LIBXML_OUTPUT_ENABLED && LIBXML_XPATH_ENABLED */
+
+#if defined(LIBXML_OUTPUT_ENABLED) && defined(LIBXML_XPATH_ENABLED) && \
+    defined(LIBXML_PATTERN_ENABLED)
+static xmlChar *
+testCompactDocSave(xmlDocPtr doc, const xmlCompactDoc *cdoc, int options) {
+    xmlBufferPtr buf = xmlBufferCreate();
+    xmlSaveCtxtPtr save = xmlSaveToBuffer(buf, NULL, options);
+    xmlChar *ret;
+
+    if (doc != NULL)
+        xmlSaveDoc(save, doc);
+    else
+        xmlSaveCompactDoc(save, cdoc);
+    xmlSaveClose(save);
+    ret = xmlBufferDetach(buf);
+    xmlBufferFree(buf);
+
+    return ret;
+}
+
+static int
+testCompactDoc(void) {
+    const char xml[] =
+        "<?xml version='1.0'?>\n"
+        "<!-- c0 -->\n"
+        "<doc xmlns='urn:d' xmlns:p='urn:p' a='1' p:b='x &amp; y'>\n"
+        "  text &lt;1&gt;<e xml:id='e1' c='&#65;'>in<![CDATA[cd]]>more</e>"
+        "<?pi data?><?empty?>\n"
+        "  <f p:g='2'><p:g>deep</p:g>tail<g xmlns=''/></f><!-- c1 -->"
+        "end &amp; more<h><i/><i>x</i></h>"
+        "</doc>\n"
+        "<?after?>\n";
+    const char xmlEnt[] =
+        "<!DOCTYPE doc [\n"
+        "  <!ENTITY ent 'ENT<b>&#38;amp;</b>'>\n"
+        "  <!ENTITY att 'A&#38;#38;B'>\n"
+        "  <!ATTLIST doc def CDATA 'dv'>\n"
+        "]>\n"
+        "<doc a='1&att;2'>pre &ent; post</doc>\n";
+    const xmlChar *namespaces[] = {
+        BAD_CAST "urn:d", BAD_CAST "d",
+        BAD_CAST "urn:p", BAD_CAST "p",
+        NULL, NULL
+    };
+    const char *exprs[] = {
+        "//d:g",
+        "/d:doc/d:f/p:g",
+        "//@a",
+        "//d:e/@c",
+        "//p:g | //d:i",
+        "//d:h/*",
+        "/d:doc/@p:b",
+        "//*",
+        "d:doc//d:i",
+    };
+    const int saveOptions[] = { 0, XML_SAVE_FORMAT, XML_SAVE_NO_EMPTY };
+    xmlParserCtxtPtr ctxt;
+    xmlDocPtr doc, copy;
+    xmlCompactDoc *cdoc;
+    xmlXPathContextPtr xpctxt;
+    xmlChar *out[2];
+    unsigned root, node;
+    const xmlChar *value;
+    int i, j, err = 0;
+
+    ctxt = xmlNewParserCtxt();
+    doc = xmlCtxtReadMemory(ctxt, xml, sizeof(xml) - 1, NULL, NULL, 0);
+    cdoc = xmlCtxtReadCompactMemory(ctxt, xml, sizeof(xml) - 1, NULL, NULL,
+                                    0);
+    if ((doc == NULL) || (cdoc == NULL)) {
+        fprintf(stderr, "testCompactDoc: parsing failed\n");
+        err = 1;
+        goto done;
+    }
+
+    for (i = 0; i < (int) (sizeof(saveOptions) / sizeof(saveOptions[0]));
+         i++) {
+        out[0] = testCompactDocSave(doc, NULL, saveOptions[i]);
+        out[1] = testCompactDocSave(NULL, cdoc, saveOptions[i]);
+        if ((out[0] == NULL) || (!xmlStrEqual(out[0], out[1]))) {
+            fprintf(stderr, "testCompactDoc: serialization differs:\n"
+                    "%s---\n%s", (char *) out[0], (char *) out[1]);
+            err = 1;
+        }
+        xmlFree(out[0]);
+        xmlFree(out[1]);
+    }
+
+    xpctxt = xmlXPathNewContext(doc);
+    xpctxt->node = (xmlNodePtr) doc;
+    xmlXPathRegisterNs(xpctxt, BAD_CAST "d", BAD_CAST "urn:d");
+    xmlXPathRegisterNs(xpctxt, BAD_CAST "p", BAD_CAST "urn:p");
+    for (j = 0; j < (int) (sizeof(exprs) / sizeof(exprs[0])); j++) {
+        xmlPatternPtr pattern;
+        xmlXPathObjectPtr res;
+        unsigned *nodes = NULL;
+        int nbNodes = -1;
+
+        pattern = xmlPatterncompile(BAD_CAST exprs[j],
+                                    xmlCompactDocGetDict(cdoc),
+                                    XML_PATTERN_XPATH, namespaces);
+        if (pattern != NULL)
+            nbNodes = xmlPatternSelectCompact(pattern, cdoc, &nodes);
+        xmlFreePattern(pattern);
+
+        out[0] = xmlStrdup(BAD_CAST "");
+        res = xmlXPathEval(BAD_CAST exprs[j], xpctxt);
+        for (i = 0; i < xmlXPathNodeSetGetLength(res->nodesetval); i++) {
+            xmlNodePtr cur = res->nodesetval->nodeTab[i];
+            xmlChar *content = xmlNodeGetContent(cur);
+
+            out[0] = xmlStrcat(out[0], cur->name);
+            out[0] = xmlStrcat(out[0], BAD_CAST "=");
+            out[0] = xmlStrcat(out[0], content);
+            out[0] = xmlStrcat(out[0], BAD_CAST "\n");
+            xmlFree(content);
+        }
+        xmlXPathFreeObject(res);
+
+        out[1] = xmlStrdup(BAD_CAST "");
+        for (i = 0; i < nbNodes; i++) {
+            xmlChar *content = xmlCompactNodeGetContent(cdoc, nodes[i]);
+            const xmlChar *name = xmlCompactNodeGetName(cdoc, nodes[i]);
+
+            switch (xmlCompactNodeGetType(cdoc, nodes[i])) {
+                case XML_TEXT_NODE:
+                    name = xmlStringText;
+                    break;
+                case XML_DOCUMENT_NODE:
+                    name = NULL;
+                    break;
+            }
+            out[1] = xmlStrcat(out[1], name);
+            out[1] = xmlStrcat(out[1], BAD_CAST "=");
+            out[1] = xmlStrcat(out[1], content);
+            out[1] = xmlStrcat(out[1], BAD_CAST "\n");
+            xmlFree(content);
+        }
+        xmlFree(nodes);
+
+        if ((nbNodes < 0) || (!xmlStrEqual(out[0], out[1]))) {
+            fprintf(stderr, "testCompactDoc: %s differs:\n%s---\n%s\n",
+                    exprs[j], (char *) out[0], (char *) out[1]);
+            err = 1;
+        }
+        xmlFree(out[0]);
+        xmlFree(out[1]);
+    }
+    xmlXPathFreeContext(xpctxt);
+
+    root = xmlCompactDocGetRootElement(cdoc);
+    value = xmlCompactNodeGetProp(cdoc, root, BAD_CAST "b", BAD_CAST "urn:p");
+    if ((value == NULL) || (strcmp((char *) value, "x & y") != 0) ||
+        (xmlCompactNodeGetProp(cdoc, root, BAD_CAST "b", NULL) != NULL)) {
+        fprintf(stderr, "testCompactDoc: wrong attribute\n");
+        err = 1;
+    }
+
+    /* Copy the f element which needs a declaration for prefix p */
+    node = xmlCompactNodeGetFirstChild(cdoc, root);
+    while ((node != 0) &&
+           (!xmlStrEqual(xmlCompactNodeGetName(cdoc, node), BAD_CAST "f")))
+        node = xmlCompactNodeGetNext(cdoc, node);
+    copy = xmlNewDoc(NULL);
+    xmlDocSetRootElement(copy, xmlCompactNodeCopy(cdoc, node, copy));
+    out[0] = testCompactDocSave(copy, NULL, XML_SAVE_NO_DECL);
+    if ((out[0] == NULL) ||
+        (strcmp((char *) out[0],
+                "<f xmlns=\"urn:d\" xmlns:p=\"urn:p\" p:g=\"2\">"
+                "<p:g>deep</p:g>tail<g xmlns=\"\"/></f>\n") != 0)) {
+        fprintf(stderr, "testCompactDoc: wrong node copy: %s\n",
+                (char *) out[0]);
+        err = 1;
+    }
+    xmlFree(out[0]);
+    xmlFreeDoc(copy);
+
+    copy = xmlCompactDocCopy(cdoc);
+    out[0] = testCompactDocSave(doc, NULL, 0);
+    out[1] = testCompactDocSave(copy, NULL, 0);
+    if ((out[0] == NULL) || (!xmlStrEqual(out[0], out[1]))) {
+        fprintf(stderr, "testCompactDoc: document copy differs:\n"
+                "%s---\n%s", (char *) out[0], (char *) out[1]);
+        err = 1;
+    }
+    xmlFree(out[0]);
+    xmlFree(out[1]);
+    xmlFreeDoc(copy);
+
+    /* Entities are substituted, the DTD isn't kept */
+    xmlFreeCompactDoc(cdoc);
+    cdoc = xmlCtxtReadCompactMemory(ctxt, xmlEnt, sizeof(xmlEnt) - 1, NULL,
+                                    NULL, 0);
+    out[0] = testCompactDocSave(NULL, cdoc, XML_SAVE_NO_DECL);
+    if ((out[0] == NULL) ||
+        (strcmp((char *) out[0],
+                "<doc a=\"1A&amp;B2\" def=\"dv\">"
+                "pre ENT<b>&amp;</b> post</doc>\n") != 0)) {
+        fprintf(stderr, "testCompactDoc: wrong entity expansion: %s\n",
+                (char *) out[0]);
+        err = 1;
+    }
+    xmlFree(out[0]);
+
+done:
+    xmlFreeParserCtxt(ctxt);
+    xmlFreeCompactDoc(cdoc);
+    xmlFreeDoc(doc);
+    return err;
+}
+#endif
+
+#ifdef LIBXML_OUTPUT_ENABLED
+static xmlChar *
+testBinaryDump(xmlDocPtr doc) {
+    xmlChar *ret = NULL;
     int size;
-    int err = 0;
 
-    doc = xmlReadDoc(xml, NULL, NULL, XML_PARSE_NOBLANKS);
-    xmlDocDumpMemory(doc, &out, &size);
+    if (doc != NULL)
+        xmlDocDumpMemory(doc, &ret, &size);
+    return ret;
+}
+
+static int
+testBinarySnapshot(void) {
+    const char xml[] =
+        "<?xml version='1.0' encoding='ISO-8859-1' standalone='yes'?>\n"
+        "<!DOCTYPE doc [\n"
+        "  <!ENTITY ent 'ENT<b>&#38;amp;</b>'><!ENTITY t 'T'>\n"
+        "]>\n"
+        "<!-- c0 -->\n"
+        "<doc xmlns='urn:d' xmlns:p='urn:p' a='1' p:b='x &amp; y'>\n"
+        "  text &lt;1&gt;<e xml:id='e1' c='&#65;'>in<![CDATA[cd]]>more</e>"
+        "<?pi data?><?empty?>\n"
+        "  <f p:g='2'><p:g>deep</p:g>&ent;<g xmlns=''/></f>"
+        "<h xml:lang='en'><i/><i>x&t;y</i></h>"
+        "</doc>\n"
+        "<?after?>\n";
+    const int options[] = { 0, XML_PARSE_ARENA };
+    xmlDocPtr doc, ref, copy;
+    xmlOutputBufferPtr out;
+    xmlChar *dump[2];
+    const char *snapshot;
+    char *corrupt;
+    size_t size, i;
+    xmlAttrPtr id;
+    int j, err = 0;
+
+    doc = xmlReadMemory(xml, sizeof(xml) - 1, "snapshot.xml", NULL, 0);
+
+    /* Entities are substituted, the DTD isn't kept */
+    ref = xmlReadMemory(xml, sizeof(xml) - 1, "snapshot.xml", NULL,
+                        XML_PARSE_NOENT);
+    if ((doc == NULL) || (ref == NULL)) {
+        fprintf(stderr, "testBinarySnapshot: parsing failed\n");
+        xmlFreeDoc(doc);
+        xmlFreeDoc(ref);
+        return 1;
+    }
+    copy = (xmlDocPtr) ref->intSubset;
+    xmlUnlinkNode((xmlNodePtr) copy);
+    xmlFreeDtd((xmlDtdPtr) copy);
+    dump[0] = testBinaryDump(ref);
+    xmlFreeDoc(ref);
+
+    out = xmlAllocOutputBuffer(NULL);
+    if (xmlSaveBinary(out, doc) < 0) {
+        fprintf(stderr, "testBinarySnapshot: saving failed\n");
+        err = 1;
+    }
+    snapshot = (const char *) xmlOutputBufferGetContent(out);
+    size = xmlOutputBufferGetSize(out);
+
+    for (j = 0; j < (int) (sizeof(options) / sizeof(options[0])); j++) {
+        copy = xmlReadBinary(snapshot, size, options[j]);
+        dump[1] = testBinaryDump(copy);
+        if ((dump[0] == NULL) || (dump[1] == NULL) ||
+            (!xmlStrEqual(dump[0], dump[1]))) {
+            fprintf(stderr, "testBinarySnapshot: round trip differs:\n"
+                    "%s---\n%s", (char *) dump[0], (char *) dump[1]);
+            err = 1;
+        }
+        xmlFree(dump[1]);
+
+        if (copy != NULL) {
+            xmlNodePtr root = xmlDocGetRootElement(copy);
+            xmlNodePtr last;
+
+            id = xmlGetID(copy, BAD_CAST "e1");
+            if ((id == NULL) || (!xmlStrEqual(id->parent->name, BAD_CAST "e"))) {
+                fprintf(stderr, "testBinarySnapshot: ID not found\n");
+                err = 1;
+            }
+            if ((xmlGetLineNo(root) != 6) ||
+                (xmlGetLineNo(xmlLastElementChild(root)) != 8)) {
+                fprintf(stderr, "testBinarySnapshot: wrong line numbers\n");
+                err = 1;
+            }
+            if (!xmlStrEqual(copy->URL, BAD_CAST "snapshot.xml")) {
+                fprintf(stderr, "testBinarySnapshot: wrong URL\n");
+                err = 1;
+            }
+
+            /* Text around entity references is merged */
+            last = xmlLastElementChild(xmlLastElementChild(root));
+            if ((last == NULL) || (last->children == NULL) ||
+                (last->children != last->last) ||
+                (!xmlStrEqual(last->children->content, BAD_CAST "xTy"))) {
+                fprintf(stderr, "testBinarySnapshot: text not merged\n");
+                err = 1;
+            }
+        }
+        xmlFreeDoc(copy);
+    }
+
+    /* Truncated and corrupted snapshots must be rejected */
+    corrupt = xmlMalloc(size);
+    for (i = 0; i < size; i++) {
+        copy = xmlReadBinary(snapshot, i, 0);
+        if (copy != NULL) {
+            fprintf(stderr, "testBinarySnapshot: truncated snapshot of "
+                    "size %lu accepted\n", (unsigned long) i);
+            xmlFreeDoc(copy);
+            err = 1;
+            break;
+        }
+    }
+    for (i = 0; i < size; i++) {
+        memcpy(corrupt, snapshot, size);
+        corrupt[i] ^= 0x80;
+        /* Must not crash, the result depends on the byte */
+        xmlFreeDoc(xmlReadBinary(corrupt, size, 0));
+    }
+    xmlFree(corrupt);
+
+    xmlOutputBufferClose(out);
+    xmlFree(dump[0]);
     xmlFreeDoc(doc);
+    return err;
+}
 
-    if (!xmlStrEqual(out, expect)) {
-        fprintf(stderr, "parsing with XML_PARSE_NOBLANKS failed\n");
+static int
+testBinarySnapshotLazy(void) {
+    const char xml[] =
+        "<d a='1'><i id='k'>text<j b='2'/></i>"
+        "<p:q xmlns:p='u'>t</p:q><!--c--><?pi x?></d>";
+    xmlParserCtxtPtr ctxt;
+    xmlDocPtr doc, copy;
+    xmlOutputBufferPtr out;
+    xmlChar *dump[2];
+    int err = 0;
+
+    ctxt = xmlNewParserCtxt();
+    xmlCtxtSetLazyTree(ctxt, 1);
+    doc = xmlCtxtReadMemory(ctxt, xml, sizeof(xml) - 1, NULL, NULL, 0);
+    xmlFreeParserCtxt(ctxt);
+
+    out = xmlAllocOutputBuffer(NULL);
+    if (xmlSaveBinary(out, doc) < 0) {
+        fprintf(stderr, "testBinarySnapshotLazy: saving failed\n");
+        err = 1;
+    }
+    copy = xmlReadBinary((const char *) xmlOutputBufferGetContent(out),
+                         xmlOutputBufferGetSize(out), 0);
+    xmlOutputBufferClose(out);
+
+    /* Deferred nodes must be materialized before saving */
+    dump[0] = testBinaryDump(doc);
+    dump[1] = testBinaryDump(copy);
+    if ((dump[0] == NULL) || (dump[1] == NULL) ||
+        (!xmlStrEqual(dump[0], dump[1]))) {
+        fprintf(stderr, "testBinarySnapshotLazy: round trip differs:\n"
+                "%s---\n%s", (char *) dump[0], (char *) dump[1]);
         err = 1;
     }
-    xmlFree(out);
 
+    xmlFree(dump[0]);
+    xmlFree(dump[1]);
+    xmlFreeDoc(copy);
+    xmlFreeDoc(doc);
     return err;
 }
+#endif
+
+#ifdef LIBXML_VALID_ENABLED
+static void
+testSwitchDtdExtSubset(void *vctxt, const xmlChar *name ATTRIBUTE_UNUSED,
+                       const xmlChar *externalId ATTRIBUTE_UNUSED,
+                       const xmlChar *systemId ATTRIBUTE_UNUSED) {
+    xmlParserCtxtPtr ctxt = vctxt;
+
+    ctxt->myDoc->extSubset = ctxt->_private;
+}
 
 static int
-testSaveNullEncDoc(const char *xml, const char *expect) {
+testSwitchDtd(void) {
+    const char dtdContent[] =
+        "<!ENTITY test '<elem1/><elem2/>'>\n";
+    const char docContent[] =
+        "<!DOCTYPE doc SYSTEM 'entities.dtd'>\n"
+        "<doc>&test;</doc>\n";
+    xmlParserInputBufferPtr input;
+    xmlParserCtxtPtr ctxt;
+    xmlDtdPtr dtd;
     xmlDocPtr doc;
-    xmlBufferPtr buffer;
-    xmlSaveCtxtPtr save;
-    const xmlChar *result;
+    xmlEntityPtr ent;
     int err = 0;
 
-    doc = xmlReadDoc(BAD_CAST xml, NULL, NULL, 0);
+    input = xmlParserInputBufferCreateStatic(dtdContent,
+                                             sizeof(dtdContent) - 1,
+                                             XML_CHAR_ENCODING_NONE);
+    dtd = xmlIOParseDTD(NULL, input, XML_CHAR_ENCODING_NONE);
 
-    buffer = xmlBufferCreate();
-    save = xmlSaveToBuffer(buffer, NULL, 0);
-    xmlSaveDoc(save, doc);
-    xmlSaveClose(save);
+    ctxt = xmlNewParserCtxt();
+    ctxt->_private = dtd;
+    ctxt->sax->externalSubset = testSwitchDtdExtSubset;
+    doc = xmlCtxtReadMemory(ctxt, docContent, sizeof(docContent) - 1, NULL,
+                            NULL, XML_PARSE_NOENT | XML_PARSE_DTDLOAD);
+    xmlFreeParserCtxt(ctxt);
 
-    result = xmlBufferContent(buffer);
-    if (strcmp((char *) result, expect) != 0) {
-        fprintf(stderr, "xmlSave with NULL encodíng failed\n");
+    ent = xmlGetDocEntity(doc, BAD_CAST "test");
+    if (ent->children->doc != NULL) {
+        fprintf(stderr, "Entity content should have NULL doc\n");
         err = 1;
     }
 
-    xmlBufferFree(buffer);
+    /* Free doc before DTD */
+    doc->extSubset = NULL;
     xmlFreeDoc(doc);
+    xmlFreeDtd(dtd);
 
     return err;
 }
+#endif /* LIBXML_VALID_ENABLED */
+
+#if defined(LIBXML_VALID_ENABLED) && defined(LIBXML_OUTPUT_ENABLED)
+static const char testDtdCacheDtd[] =
+    "<!ELEMENT doc (item+)>\n"
+    "<!ELEMENT item (#PCDATA)>\n"
+    "<!ATTLIST doc xmlns:x CDATA #FIXED 'urn:x'>\n"
+    "<!ATTLIST item type CDATA 'default'\n"
+    "               id ID #IMPLIED\n"
+    "               x:a NMTOKEN ' tok '>\n"
+    "<!ENTITY ent 'entity text'>\n"
+    "<!ENTITY copy '&#xA9;'>\n";
+
+static xmlParserErrors
+testDtdCacheLoader(void *vctxt, const char *url,
+                   const char *publicId ATTRIBUTE_UNUSED,
+                   xmlResourceType type ATTRIBUTE_UNUSED,
+                   xmlParserInputFlags flags ATTRIBUTE_UNUSED,
+                   xmlParserInputPtr *out) {
+    const char *dtd = vctxt;
+
+    if (strcmp(url, "http://example.org/x.dtd") != 0)
+        return(XML_IO_ENOENT);
+
+    *out = xmlNewInputFromString(url, dtd, XML_INPUT_BUF_STATIC);
+    return(*out == NULL ? XML_ERR_NO_MEMORY : XML_ERR_OK);
+}
+
+static xmlDocPtr
+testDtdCacheRead(const char *xml, int options, const char *loaderDtd) {
+    xmlParserCtxtPtr ctxt;
+    xmlDocPtr doc;
+
+    ctxt = xmlNewParserCtxt();
+    if (loaderDtd != NULL)
+        xmlCtxtSetResourceLoader(ctxt, testDtdCacheLoader,
+                                 (void *) loaderDtd);
+    doc = xmlCtxtReadDoc(ctxt, BAD_CAST xml,
+                         loaderDtd ? "http://example.org/doc.xml" :
+                                     "testparser-cache.xml",
+                         NULL, options);
+    if ((doc != NULL) && (xmlCtxtGetStatus(ctxt) != 0)) {
+        xmlFreeDoc(doc);
+        doc = NULL;
+    }
+    xmlFreeParserCtxt(ctxt);
+
+    return(doc);
+}
+
+/*
+ * Serialize the document and append the text content as well as the
+ * result of validating the document again.
+ */
+static xmlChar *
+testDtdCacheDump(xmlDocPtr doc) {
+    xmlValidCtxtPtr vctxt;
+    xmlChar *out, *content, *ret;
+    int size;
+
+    xmlDocDumpMemory(doc, &out, &size);
+    content = xmlNodeGetContent(xmlDocGetRootElement(doc));
+    ret = xmlStrcat(out, content);
+    xmlFree(content);
+
+    vctxt = xmlNewValidCtxt();
+    ret = xmlStrcat(ret, xmlValidateDocument(vctxt, doc) ?
+                         BAD_CAST " valid" : BAD_CAST " invalid");
+    xmlFreeValidCtxt(vctxt);
+
+    return(ret);
+}
 
 static int
-testSaveNullEnc(void) {
+testDtdCache(void) {
+    const char *filename = "testparser-cache.dtd";
+    const char xml[] =
+        "<!DOCTYPE doc SYSTEM 'testparser-cache.dtd'>\n"
+        "<doc><item id='a'>&ent; &copy;</item><item type='t'>x</item></doc>\n";
+    const char xmlIntSubset[] =
+        "<!DOCTYPE doc SYSTEM 'testparser-cache.dtd' "
+        "[<!ENTITY local 'x'>]>\n"
+        "<doc><item>&local;</item></doc>\n";
+    const char xmlLoader[] =
+        "<!DOCTYPE doc SYSTEM 'x.dtd'>\n"
+        "<doc>&e;</doc>\n";
+    static const char *const loaderDtds[] = {
+        "<!ENTITY e 'FROM-LOADER-ONE'>",
+        "<!ENTITY e 'FROM-LOADER-TWO'>"
+    };
+    static const char *const loaderContents[] = {
+        "FROM-LOADER-ONE", "FROM-LOADER-TWO"
+    };
+    static const int optionsTab[] = {
+        XML_PARSE_DTDLOAD,
+        XML_PARSE_DTDATTR,
+        XML_PARSE_DTDATTR | XML_PARSE_NOENT,
+        XML_PARSE_DTDVALID | XML_PARSE_DTDATTR | XML_PARSE_NOENT,
+        XML_PARSE_DTDVALID | XML_PARSE_SAX1
+    };
+    xmlDocPtr doc, docs[3], kept = NULL;
+    xmlChar *expected, *out;
+    FILE *file;
     int err = 0;
+    int i, j;
+
+    file = fopen(filename, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "testDtdCache: can't create %s\n", filename);
+        return(1);
+    }
+    fwrite(testDtdCacheDtd, 1, sizeof(testDtdCacheDtd) - 1, file);
+    fclose(file);
+
+    for (i = 0; (size_t) i < sizeof(optionsTab) / sizeof(optionsTab[0]); i++) {
+        int options = optionsTab[i];
+
+        doc = testDtdCacheRead(xml, options, NULL);
+        if (doc == NULL) {
+            fprintf(stderr, "testDtdCache: parsing failed\n");
+            err = 1;
+            break;
+        }
+        expected = testDtdCacheDump(doc);
+        xmlFreeDoc(doc);
+
+        xmlCleanupDtdCache();
+        for (j = 0; j < 3; j++) {
+            docs[j] = testDtdCacheRead(xml, options | XML_PARSE_DTD_CACHE,
+                                       NULL);
+            if (docs[j] == NULL) {
+                fprintf(stderr, "testDtdCache: parsing failed\n");
+                err = 1;
+                continue;
+            }
+            out = testDtdCacheDump(docs[j]);
+            if (!xmlStrEqual(out, expected)) {
+                fprintf(stderr, "testDtdCache: options %d, got\n%s\n"
+                        "expected\n%s\n", options, out, expected);
+                err = 1;
+            }
+            xmlFree(out);
+        }
+        /* The first document adds a copy of its DTD to the cache */
+        if ((docs[1] == NULL) || (docs[2] == NULL) ||
+            (docs[1]->extSubset != docs[2]->extSubset)) {
+            fprintf(stderr, "testDtdCache: options %d, DTD not shared\n",
+                    options);
+            err = 1;
+        }
+        if ((i == 0) && (kept == NULL)) {
+            kept = docs[1];
+            docs[1] = NULL;
+        }
+        for (j = 0; j < 3; j++)
+            xmlFreeDoc(docs[j]);
+        xmlFree(expected);
+    }
+
+    /* Declarations in the internal subset bypass the cache */
+    for (j = 0; j < 2; j++)
+        docs[j] = testDtdCacheRead(xmlIntSubset,
+                                   XML_PARSE_DTDLOAD | XML_PARSE_DTD_CACHE,
+                                   NULL);
+    if ((docs[0] == NULL) || (docs[1] == NULL) ||
+        (docs[0]->extSubset == docs[1]->extSubset)) {
+        fprintf(stderr, "testDtdCache: internal subset, DTD shared\n");
+        err = 1;
+    }
+    xmlFreeDoc(docs[0]);
+    xmlFreeDoc(docs[1]);
+
+    /* DTDs from resource loaders aren't shared with other contexts */
+    for (j = 0; j < 2; j++) {
+        doc = testDtdCacheRead(xmlLoader,
+                               XML_PARSE_DTDLOAD | XML_PARSE_NOENT |
+                               XML_PARSE_DTD_CACHE,
+                               loaderDtds[j]);
+        out = doc ? xmlNodeGetContent(xmlDocGetRootElement(doc)) : NULL;
+        if (!xmlStrEqual(out, BAD_CAST loaderContents[j])) {
+            fprintf(stderr, "testDtdCache: loader %d, got %s\n", j, out);
+            err = 1;
+        }
+        xmlFree(out);
+        xmlFreeDoc(doc);
+    }
+
+    /* Documents keep a DTD alive after it was removed from the cache */
+    xmlCleanupDtdCache();
+    doc = testDtdCacheRead(xml, XML_PARSE_DTDLOAD | XML_PARSE_DTD_CACHE,
+                           NULL);
+    if ((doc == NULL) || (kept == NULL) ||
+        (doc->extSubset == kept->extSubset)) {
+        fprintf(stderr, "testDtdCache: DTD not loaded after cleanup\n");
+        err = 1;
+    }
+    xmlFreeDoc(doc);
+    if (kept != NULL) {
+        out = xmlNodeGetContent(xmlDocGetRootElement(kept));
+        if (!xmlStrEqual(out, BAD_CAST "entity text \xC2\xA9x")) {
+            fprintf(stderr, "testDtdCache: wrong content %s\n", out);
+            err = 1;
+        }
+        xmlFree(out);
+        xmlFreeDoc(kept);
+    }
+    xmlCleanupDtdCache();
+    remove(filename);
+
+    return err;
+}
+#endif /* LIBXML_VALID_ENABLED && LIBXML_OUTPUT_ENABLED */
+
+#ifdef LIBXML_OUTPUT_ENABLED
+static xmlChar *
+dumpNodeList(xmlNodePtr list) {
+    xmlBufferPtr buffer;
+    xmlSaveCtxtPtr save;
+    xmlNodePtr cur;
+    xmlChar *ret;
+
+    buffer = xmlBufferCreate();
+    save = xmlSaveToBuffer(buffer, "UTF-8", 0);
+    for (cur = list; cur != NULL; cur = cur->next)
+        xmlSaveTree(save, cur);
+    xmlSaveClose(save);
+
+    ret = xmlBufferDetach(buffer);
+    xmlBufferFree(buffer);
+    return ret;
+}
+
+static int
+testCtxtParseContent(void) {
+    xmlParserCtxtPtr ctxt;
+    xmlParserInputPtr input;
+    xmlDocPtr doc;
+    xmlNodePtr node, list;
+    const char *content;
+    xmlChar *output;
+    int i, j;
+    int err = 0;
+
+    static const char *const tests[] = {
+        "<!-- c -->\xF0\x9F\x98\x84<a/><b/>end",
+        "text<a:foo><b:foo/></a:foo>text<!-- c -->"
+    };
+
+    doc = xmlReadDoc(BAD_CAST "<doc xmlns:a='a'><elem xmlns:b='b'/></doc>",
+                     NULL, NULL, 0);
+    node = doc->children->children;
+
+    ctxt = xmlNewParserCtxt();
+
+    for (i = 0; (size_t) i < sizeof(tests) / sizeof(tests[0]); i++) {
+        content = tests[i];
+
+        for (j = 0; j < 2; j++) {
+            if (j == 0) {
+                input = xmlNewInputFromString(NULL, content,
+                                              XML_INPUT_BUF_STATIC);
+                list = xmlCtxtParseContent(ctxt, input, node, 0);
+            } else {
+                xmlParseInNodeContext(node, content, strlen(content), 0,
+                                      &list);
+            }
+
+            output = dumpNodeList(list);
+
+            if ((j == 0 && ctxt->nsWellFormed == 0) ||
+                strcmp((char *) output, content) != 0) {
+                fprintf(stderr, "%s failed test %d, got:\n%s\n",
+                        j == 0 ?
+                            "xmlCtxtParseContent" :
+                            "xmlParseInNodeContext",
+                        i, output);
+                err = 1;
+            }
+
+            xmlFree(output);
+            xmlFreeNodeList(list);
+        }
+    }
+
+    xmlFreeParserCtxt(ctxt);
+    xmlFreeDoc(doc);
+
+    return err;
+}
+
+static int
+testNoBlanks(void) {
+    const xmlChar xml[] =
+        "<refentry>\n"
+        "  <refsect1>\n"
+        "    <para>\n"
+        "      Run <command>tester --help</command> for more options.\n"
+        "    </para>\n"
+        "  </refsect1>\n"
+        "</refentry>\n";
+    const xmlChar expect[] =
+        "<?xml version=\"1.0\"?>\n"
+        "<refentry><refsect1><para>\n"
+        "      Run <command>tester --help</command> for more options.\n"
+        "    </para></refsect1></refentry>\n";
+    xmlDocPtr doc;
+    xmlChar *out;
+    int size;
+    int err = 0;
+
+    doc = xmlReadDoc(xml, NULL, NULL, XML_PARSE_NOBLANKS);
+    xmlDocDumpMemory(doc, &out, &size);
+    xmlFreeDoc(doc);
+
+    if (!xmlStrEqual(out, expect)) {
+        fprintf(stderr, "parsing with XML_PARSE_NOBLANKS failed\n");
+        err = 1;
+    }
+    xmlFree(out);
+
+    return err;
+}
+
+static int
+testSaveNullEncDoc(const char *xml, const char *expect) {
+    xmlDocPtr doc;
+    xmlBufferPtr buffer;
+    xmlSaveCtxtPtr save;
+    const xmlChar *result;
+    int err = 0;
+
+    doc = xmlReadDoc(BAD_CAST xml, NULL, NULL, 0);
+
+    buffer = xmlBufferCreate();
+    save = xmlSaveToBuffer(buffer, NULL, 0);
+    xmlSaveDoc(save, doc);
+    xmlSaveClose(save);
+
+    result = xmlBufferContent(buffer);
+    if (strcmp((char *) result, expect) != 0) {
+        fprintf(stderr, "xmlSave with NULL encodíng failed\n");
+        err = 1;
+    }
+
+    xmlBufferFree(buffer);
+    xmlFreeDoc(doc);
+
+    return err;
+}
+
+static int
+testSaveNullEnc(void) {
+    int err = 0;
+
+    err |= testSaveNullEncDoc(
+        "<?xml version=\"1.0\"?><doc>\xC3\x98</doc>",
+        "<?xml version=\"1.0\"?>\n<doc>&#xD8;</doc>\n");
+    err |= testSaveNullEncDoc(
+        "<?xml version=\"1.0\" encoding=\"utf-8\"?><doc>\xC3\x98</doc>",
+        "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<doc>\xC3\x98</doc>\n");
+    err |= testSaveNullEncDoc(
+        "<?xml version=\"1.0\" encoding=\"iso-8859-1\"?><doc>\xD8</doc>",
+        "<?xml version=\"1.0\" encoding=\"iso-8859-1\"?>\n<doc>\xD8</doc>\n");
+
+    return err;
+}
+
+static int
+testDocDumpFormatMemoryEnc(void) {
+    const char *xml = "<doc>\xC3\x98</doc>";
+    const char *expect =
+        "<?xml version=\"1.0\" encoding=\"iso-8859-1\"?>\n"
+        "<doc>\xD8</doc>\n";
+    xmlDocPtr doc;
+    xmlChar *text;
+    int len;
+    int err = 0;
+
+    doc = xmlReadDoc(BAD_CAST xml, NULL, NULL, 0);
+    xmlDocDumpFormatMemoryEnc(doc, &text, &len, "iso-8859-1", 0);
+
+    if (strcmp((char *) text, expect) != 0) {
+        fprintf(stderr, "xmlDocDumpFormatMemoryEnc failed\n");
+        err = 1;
+    }
+
+    xmlFree(text);
+    xmlFreeDoc(doc);
+    return err;
+}
+
+static void
+testParseParallelError(void *data, const xmlError *error) {
+    int *pos = data;
+
+    if (pos[0] == 0) {
+        pos[0] = error->line;
+        pos[1] = error->int2;
+    }
+}
+
+static int
+testParseParallelDoc(const char *xml, int options) {
+    xmlDocPtr doc[2];
+    xmlChar *dump[2] = { NULL, NULL };
+    int errPos[2][2] = { { 0, 0 }, { 0, 0 } };
+    long line[2] = { 0, 0 };
+    int i, err = 0;
+
+    for (i = 0; i < 2; i++) {
+        xmlParserCtxtPtr ctxt;
+        int len;
+
+        ctxt = xmlNewParserCtxt();
+        xmlCtxtSetErrorHandler(ctxt, testParseParallelError, errPos[i]);
+        doc[i] = xmlCtxtReadMemory(ctxt, xml, strlen(xml), NULL, NULL,
+                                   options | (i ? XML_PARSE_PARALLEL : 0));
+        if (doc[i] != NULL) {
+            xmlDocDumpMemory(doc[i], &dump[i], &len);
+            line[i] = xmlGetLineNo(xmlDocGetRootElement(doc[i])->last);
+        }
+        xmlFreeParserCtxt(ctxt);
+    }
+
+    if ((doc[0] == NULL) != (doc[1] == NULL)) {
+        fprintf(stderr, "testParseParallel: parse results differ\n");
+        err = 1;
+    } else if ((dump[0] != NULL) &&
+               (strcmp((char *) dump[0], (char *) dump[1]) != 0)) {
+        fprintf(stderr, "testParseParallel: documents differ\n");
+        err = 1;
+    }
+    if (line[0] != line[1]) {
+        fprintf(stderr, "testParseParallel: line %ld != %ld\n",
+                line[0], line[1]);
+        err = 1;
+    }
+    if ((errPos[0][0] != errPos[1][0]) || (errPos[0][1] != errPos[1][1])) {
+        fprintf(stderr, "testParseParallel: error at %d:%d != %d:%d\n",
+                errPos[0][0], errPos[0][1], errPos[1][0], errPos[1][1]);
+        err = 1;
+    }
+
+    /* Names must be interned once, even if several threads found them */
+    if ((doc[1] != NULL) && (doc[1]->dict != NULL)) {
+        xmlNodePtr cur = xmlDocGetRootElement(doc[1])->children;
+
+        for (; cur != NULL; cur = cur->next) {
+            xmlAttrPtr attr;
+
+            if (cur->type != XML_ELEMENT_NODE)
+                continue;
+            if (cur->name != xmlDictLookup(doc[1]->dict, cur->name, -1)) {
+                fprintf(stderr, "testParseParallel: duplicate name %s\n",
+                        (char *) cur->name);
+                err = 1;
+                break;
+            }
+            for (attr = cur->properties; attr != NULL; attr = attr->next) {
+                if (attr->name !=
+                    xmlDictLookup(doc[1]->dict, attr->name, -1)) {
+                    fprintf(stderr, "testParseParallel: duplicate name %s\n",
+                            (char *) attr->name);
+                    err = 1;
+                }
+            }
+            if (err)
+                break;
+        }
+    }
+
+    for (i = 0; i < 2; i++) {
+        xmlFree(dump[i]);
+        xmlFreeDoc(doc[i]);
+    }
+    return err;
+}
+
+static int
+testParseParallel(void) {
+    const char *item =
+        "<b:item id='%d' t='/>'>text &amp; \xC3\xA9 %d<e/>"
+        "<!-- <c> --><![CDATA[<d>]]><?pi <f>?></b:item>\n";
+    const char *trailer[] = {
+        "</doc>\n",
+        "</doc>\n \xC3\xA9<junk/>",
+        "<b:item>&undeclared;</b:item></doc>\n"
+    };
+    size_t size = 3000000;
+    char *xml = xmlMalloc(size);
+    size_t len;
+    int i, j, err = 0;
+
+    /* Make sure that several threads run */
+    setThreadCount(4);
+
+    for (i = 0; i < 3; i++) {
+        len = snprintf(xml, size, "<doc xmlns='urn:a' xmlns:b='urn:b'>\n");
+        for (j = 0; j < 20000; j++)
+            len += snprintf(xml + len, size - len, item, j, j);
+        snprintf(xml + len, size - len, "%s", trailer[i]);
+
+        err |= testParseParallelDoc(xml, 0);
+        err |= testParseParallelDoc(xml, XML_PARSE_RECOVER);
+        err |= testParseParallelDoc(xml, XML_PARSE_ARENA);
+    }
+
+    setThreadCount(0);
+    xmlFree(xml);
+    return err;
+}
+#endif /* LIBXML_OUTPUT_ENABLED */
+
+#ifdef LIBXML_SAX1_ENABLED
+static int
+testBalancedChunk(void) {
+    xmlNodePtr list;
+    xmlNodePtr elem;
+    int ret;
+    int err = 0;
+
+    ret = xmlParseBalancedChunkMemory(NULL, NULL, NULL, 0,
+            BAD_CAST "start <node xml:lang='en'>abc</node> end", &list);
+
+    if ((ret != XML_ERR_OK) ||
+        (list == NULL) ||
+        ((elem = list->next) == NULL) ||
+        (elem->type != XML_ELEMENT_NODE) ||
+        (elem->nsDef == NULL) ||
+        (!xmlStrEqual(elem->nsDef->href, XML_XML_NAMESPACE))) {
+        fprintf(stderr, "xmlParseBalancedChunkMemory failed\n");
+        err = 1;
+    }
+
+    xmlFreeNodeList(list);
+
+    return(err);
+}
+#endif
+
+#ifdef LIBXML_PUSH_ENABLED
+static int
+testHugePush(void) {
+    xmlParserCtxtPtr ctxt;
+    int err, i;
+
+    ctxt = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL);
+
+    /*
+     * Push parse a document larger than XML_MAX_LOOKUP_LIMIT
+     * (10,000,000 bytes). This mainly tests whether shrinking the
+     * buffer works when push parsing.
+     */
+    xmlParseChunk(ctxt, "<doc>", 5, 0);
+    for (i = 0; i < 1000000; i++)
+        xmlParseChunk(ctxt, "<elem>text</elem>", 17, 0);
+    xmlParseChunk(ctxt, "</doc>", 6, 1);
+
+    err = ctxt->wellFormed ? 0 : 1;
+    xmlFreeDoc(ctxt->myDoc);
+    xmlFreeParserCtxt(ctxt);
+
+    return err;
+}
+
+static int
+testHugeEncodedChunk(void) {
+    xmlBufferPtr buf;
+    xmlChar *chunk;
+    xmlParserCtxtPtr ctxt;
+    int err = 0, i;
+
+    /*
+     * Test the push parser with a built-in encoding handler like ISO-8859-1
+     * and a chunk larger than the initial decoded buffer (currently 4 KB).
+     */
+    buf = xmlBufferCreate();
+    xmlBufferCat(buf,
+            BAD_CAST "<?xml version='1.0' encoding='ISO-8859-1'?>\n");
+    xmlBufferCat(buf, BAD_CAST "<doc><!-- ");
+    for (i = 0; i < 2000; i++)
+        xmlBufferCat(buf, BAD_CAST "0123456789");
+    xmlBufferCat(buf, BAD_CAST " --></doc>");
+    chunk = xmlBufferDetach(buf);
+    xmlBufferFree(buf);
+
+    ctxt = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL);
+
+    xmlParseChunk(ctxt, (char *) chunk, xmlStrlen(chunk), 0);
+    xmlParseChunk(ctxt, NULL, 0, 1);
+
+    if (!ctxt->wellFormed)
+        err = 1;
+    xmlFreeDoc(ctxt->myDoc);
+    xmlFreeParserCtxt(ctxt);
+    xmlFree(chunk);
+
+    /*
+     * Test the push parser with
+     *
+     * - a single call to xmlParseChunk,
+     * - a non-UTF8 encoding,
+     * - a chunk larger then MINLEN (4000 bytes).
+     *
+     * This verifies that the whole buffer is processed in the initial
+     * charset conversion.
+     */
+    buf = xmlBufferCreate();
+    xmlBufferCat(buf,
+            BAD_CAST "<?xml version='1.0' encoding='ISO-8859-1'?>\n");
+    xmlBufferCat(buf, BAD_CAST "<doc>");
+    /* 20,000 characters */
+    for (i = 0; i < 2000; i++)
+        xmlBufferCat(buf, BAD_CAST "0123456789");
+    xmlBufferCat(buf, BAD_CAST "</doc>");
+    chunk = xmlBufferDetach(buf);
+    xmlBufferFree(buf);
+
+    ctxt = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL);
+
+    xmlParseChunk(ctxt, (char *) chunk, xmlStrlen(chunk), 1);
+
+    if (!ctxt->wellFormed)
+        err = 1;
+    xmlFreeDoc(ctxt->myDoc);
+    xmlFreeParserCtxt(ctxt);
+    xmlFree(chunk);
+
+    return err;
+}
+
+static int
+testPushCDataEnd(void) {
+    int err = 0;
+    int k;
+
+    for (k = 0; k < 4; k++) {
+        xmlBufferPtr buf;
+        xmlChar *chunk;
+        xmlParserCtxtPtr ctxt;
+        int i;
+
+        ctxt = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL);
+        xmlCtxtSetOptions(ctxt, XML_PARSE_NOERROR);
+
+        /*
+         * Push parse text data with ']]>' split across chunks.
+         */
+        buf = xmlBufferCreate();
+        xmlBufferCCat(buf, "<doc>");
+
+        /*
+         * Also test xmlParseCharDataCopmlex
+         */
+        if (k & 1)
+            xmlBufferCCat(buf, "x");
+        else
+            xmlBufferCCat(buf, "\xC3\xA4");
+
+        /*
+         * Create enough data to trigger a "characters" SAX callback.
+         * (XML_PARSER_BIG_BUFFER_SIZE = 300)
+         */
+        for (i = 0; i < 2000; i++)
+            xmlBufferCCat(buf, "x");
+
+        if (k & 2)
+            xmlBufferCCat(buf, "]");
+        else
+            xmlBufferCCat(buf, "]]");
+
+        chunk = xmlBufferDetach(buf);
+        xmlBufferFree(buf);
+
+        xmlParseChunk(ctxt, (char *) chunk, xmlStrlen(chunk), 0);
+        if (k & 2)
+            xmlParseChunk(ctxt, "]>xxx</doc>", 11, 1);
+        else
+            xmlParseChunk(ctxt, ">xxx</doc>", 10, 1);
+
+        if (ctxt->errNo != XML_ERR_MISPLACED_CDATA_END) {
+            fprintf(stderr, "xmlParseChunk failed to detect CData end: %d\n",
+                    ctxt->errNo);
+            err = 1;
+        }
+
+        xmlFree(chunk);
+        xmlFreeDoc(ctxt->myDoc);
+        xmlFreeParserCtxt(ctxt);
+    }
+
+    return err;
+}
+
+#ifdef LIBXML_OUTPUT_ENABLED
+static xmlChar *
+testPushInPlaceDoc(const char *xml, int chunkSize, int mode,
+                   int *res, long *bytes) {
+    xmlParserCtxtPtr ctxt;
+    xmlChar *dump = NULL;
+    char *copy[4];
+    int sizes[4];
+    size_t starts[4];
+    size_t len = strlen(xml);
+    size_t pos = 0;
+    int i, size;
+
+    ctxt = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL);
+    xmlCtxtSetOptions(ctxt, XML_PARSE_NOERROR | XML_PARSE_NOENT);
+
+    while (pos < len) {
+        int n = 0;
+
+        /* Mode 2 passes up to four chunks at once like a ring buffer. */
+        do {
+            size = chunkSize;
+            if ((size_t) size > len - pos)
+                size = len - pos;
+            copy[n] = xmlMalloc(size + 1);
+            memcpy(copy[n], xml + pos, size);
+            copy[n][size] = 'X';
+            starts[n] = pos;
+            sizes[n++] = size;
+            pos += size;
+        } while ((mode == 2) && (n < 4) && (pos < len));
+
+        if (mode == 0)
+            *res = xmlParseChunk(ctxt, copy[0], size, 0);
+        else if (mode == 1)
+            *res = xmlParseChunkInPlace(ctxt, copy[0], size, 0);
+        else
+            *res = xmlParseChunks(ctxt, copy, sizes, n, 0);
+
+        for (i = 0; i < n; i++) {
+            if ((memcmp(copy[i], xml + starts[i], sizes[i]) != 0) ||
+                (copy[i][sizes[i]] != 'X')) {
+                fprintf(stderr, "testPushInPlace: chunk was modified\n");
+                *res = -1;
+            }
+            xmlFree(copy[i]);
+        }
+    }
+    if (*res >= 0)
+        *res = xmlParseChunk(ctxt, NULL, 0, 1);
+
+    *bytes = xmlByteConsumed(ctxt);
+    if (ctxt->myDoc != NULL) {
+        xmlNodePtr root = xmlDocGetRootElement(ctxt->myDoc);
+        int dumpLen;
+
+        xmlDocDumpMemory(ctxt->myDoc, &dump, &dumpLen);
+        if (root != NULL)
+            *bytes += xmlGetLineNo(root->last) << 24;
+    }
+    xmlFreeDoc(ctxt->myDoc);
+    xmlFreeParserCtxt(ctxt);
+
+    return(dump);
+}
+
+static int
+testPushInPlace(void) {
+    static const char *const items[] = {
+        "<item a='1' b=\"&amp;&#x20AC;\">text\r\nmore \xC3\xA9\xE2\x82\xAC"
+            "</item>\r\n",
+        "<!-- comment -> > --><?pi data > ?><![CDATA[<cdata>]]]]>\r",
+        "<e xmlns='urn:x'>&ent;&#60;</e>  \n<empty/>\n",
+        "<long>"
+        "text\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\n"
+        "text\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\n"
+        "text\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\n"
+        "text\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\n"
+        "text\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\n"
+        "text\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\n"
+        "text\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\n"
+        "text\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\n"
+        "text\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\n"
+        "text\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\n"
+        "text\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\n"
+        "text\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\ntext\r\n"
+        "</long>\n"
+    };
+    const char *trailers[] = { "</doc>\n", "</doc>\n<junk/>" };
+    const int chunkSizes[] = { 1, 2, 3, 7, 31, 200, 999, 4096, 100000 };
+    char *xml;
+    size_t size = 100000, len;
+    int i, j, mode, err = 0;
+
+    xml = xmlMalloc(size);
+
+    for (i = 0; i < 2; i++) {
+        len = snprintf(xml, size,
+                       "<?xml version='1.0' encoding='UTF-8'?>\r\n"
+                       "<!DOCTYPE doc [<!ENTITY ent '<sub>x</sub>'>]>\n"
+                       "<doc>\n");
+        for (j = 0; j < 200; j++)
+            len += snprintf(xml + len, size - len, "%s", items[j % 4]);
+        snprintf(xml + len, size - len, "%s", trailers[i]);
+
+        for (j = 0; j < (int) (sizeof(chunkSizes) / sizeof(chunkSizes[0]));
+             j++) {
+            xmlChar *dump[3];
+            int res[3] = { 0, 0, 0 };
+            long bytes[3] = { 0, 0, 0 };
+
+            for (mode = 0; mode < 3; mode++)
+                dump[mode] = testPushInPlaceDoc(xml, chunkSizes[j], mode,
+                                                &res[mode], &bytes[mode]);
+
+            for (mode = 1; mode < 3; mode++) {
+                if ((res[mode] != res[0]) || (bytes[mode] != bytes[0]) ||
+                    (!xmlStrEqual(dump[mode], dump[0]))) {
+                    fprintf(stderr, "testPushInPlace: mode %d with chunk "
+                            "size %d differs: %d/%ld != %d/%ld\n",
+                            mode, chunkSizes[j], res[mode], bytes[mode],
+                            res[0], bytes[0]);
+                    err = 1;
+                }
+            }
+
+            for (mode = 0; mode < 3; mode++)
+                xmlFree(dump[mode]);
+        }
+    }
+
+    xmlFree(xml);
+    return err;
+}
+
+static const char *testPushInPlaceChunk;
+static int testPushInPlaceChunkSize;
+static int testPushInPlaceInChunk;
+
+static void
+testPushInPlaceStartElement(void *ctx, const xmlChar *localname,
+                            const xmlChar *prefix, const xmlChar *URI,
+                            int nb_namespaces, const xmlChar **namespaces,
+                            int nb_attributes, int nb_defaulted,
+                            const xmlChar **attributes) {
+    xmlParserCtxtPtr ctxt = ctx;
+    const char *cur = (const char *) ctxt->input->cur;
+
+    if ((xmlStrEqual(localname, BAD_CAST "after")) &&
+        (testPushInPlaceChunk != NULL) &&
+        (cur >= testPushInPlaceChunk) &&
+        (cur < testPushInPlaceChunk + testPushInPlaceChunkSize))
+        testPushInPlaceInChunk = 1;
+
+    xmlSAX2StartElementNs(ctx, localname, prefix, URI, nb_namespaces,
+                          namespaces, nb_attributes, nb_defaulted,
+                          attributes);
+}
+
+static int
+testPushInPlaceCData(void) {
+    /* Split points relative to the end of the CDATA section */
+    static const int splits[] = { 4000, 100, 4, 3, 2, 1 };
+    xmlSAXHandler sax;
+    xmlChar *dump, *expected;
+    char *xml, *chunk;
+    int dumpLen, i, len, cdataEnd, split, err = 0;
+    xmlDocPtr doc;
+
+    xml = xmlMalloc(20000);
+    len = sprintf(xml, "<doc><![CDATA[");
+    for (i = 0; i < 2000; i++)
+        len += sprintf(xml + len, "a>b>");
+    len += sprintf(xml + len, "]]>");
+    cdataEnd = len;
+    len += sprintf(xml + len, "<after/></doc>\n");
+
+    doc = xmlReadMemory(xml, len, NULL, NULL, 0);
+    xmlDocDumpMemory(doc, &expected, &dumpLen);
+    xmlFreeDoc(doc);
+
+    xmlSAXVersion(&sax, 2);
+    sax.startElementNs = testPushInPlaceStartElement;
+
+    for (i = 0; i < (int) (sizeof(splits) / sizeof(splits[0])); i++) {
+        xmlParserCtxtPtr ctxt;
+        int res;
+
+        split = cdataEnd - splits[i];
+        ctxt = xmlCreatePushParserCtxt(&sax, NULL, NULL, 0, NULL);
+        testPushInPlaceInChunk = 0;
+
+        chunk = xmlMalloc(split);
+        memcpy(chunk, xml, split);
+        testPushInPlaceChunk = chunk;
+        testPushInPlaceChunkSize = split;
+        res = xmlParseChunkInPlace(ctxt, chunk, split, 0);
+        xmlFree(chunk);
+
+        chunk = xmlMalloc(len - split);
+        memcpy(chunk, xml + split, len - split);
+        testPushInPlaceChunk = chunk;
+        testPushInPlaceChunkSize = len - split;
+        if (res == XML_ERR_OK)
+            res = xmlParseChunkInPlace(ctxt, chunk, len - split, 0);
+        testPushInPlaceChunk = NULL;
+        xmlFree(chunk);
+
+        if (res == XML_ERR_OK)
+            res = xmlParseChunk(ctxt, NULL, 0, 1);
+
+        dump = NULL;
+        if (ctxt->myDoc != NULL)
+            xmlDocDumpMemory(ctxt->myDoc, &dump, &dumpLen);
+        if ((res != XML_ERR_OK) || (!xmlStrEqual(dump, expected))) {
+            fprintf(stderr, "testPushInPlaceCData: split %d: "
+                    "unexpected result %d\n", splits[i], res);
+            err = 1;
+        }
+        if (!testPushInPlaceInChunk) {
+            fprintf(stderr, "testPushInPlaceCData: split %d: "
+                    "element after CDATA section was copied\n", splits[i]);
+            err = 1;
+        }
+
+        xmlFree(dump);
+        xmlFreeDoc(ctxt->myDoc);
+        xmlFreeParserCtxt(ctxt);
+    }
+
+    xmlFree(expected);
+    xmlFree(xml);
+    return err;
+}
+#endif /* LIBXML_OUTPUT_ENABLED */
+#endif /* PUSH */
+
+#ifdef LIBXML_HTML_ENABLED
+static int
+testHtmlIds(void) {
+    const char *htmlContent =
+        "<html><body><div id='myId'>Hello, World!</div></body></html>";
+    htmlDocPtr doc;
+    xmlAttrPtr node;
+
+    doc = htmlReadDoc(BAD_CAST htmlContent, NULL, NULL, 0);
+    if (doc == NULL) {
+        fprintf(stderr, "could not parse HTML content\n");
+        return 1;
+    }
+
+    node = xmlGetID(doc, BAD_CAST "myId");
+    if (node == NULL) {
+        fprintf(stderr, "xmlGetID doesn't work on HTML\n");
+        return 1;
+    }
+
+    xmlFreeDoc(doc);
+    return 0;
+}
+
+#define MHE "meta http-equiv=\"Content-Type\""
+
+#ifdef LIBXML_OUTPUT_ENABLED
+static int
+testHtmlInsertMetaEncoding(void) {
+    /* We currently require a head element to be present. */
+    const char *html =
+        "<html>"
+        "<head></head>"
+        "<body>text</body>"
+        "</html>\n";
+    const char *expect =
+        "<html>"
+        "<head><meta charset=\"utf-8\"></head>"
+        "<body>text</body>"
+        "</html>\n";
+    htmlDocPtr doc;
+    xmlBufferPtr buf;
+    xmlSaveCtxtPtr save;
+    xmlChar *out;
+    int size, err = 0;
+
+
+    doc = htmlReadDoc(BAD_CAST html, NULL, NULL, HTML_PARSE_NODEFDTD);
+
+    /* xmlSave updates meta tags */
+    buf = xmlBufferCreate();
+    save = xmlSaveToBuffer(buf, "utf-8", 0);
+    xmlSaveDoc(save, doc);
+    xmlSaveClose(save);
+    if (!xmlStrEqual(xmlBufferContent(buf), BAD_CAST expect)) {
+        fprintf(stderr, "meta tag insertion failed when serializing\n");
+        err = 1;
+    }
+    xmlBufferFree(buf);
+
+    htmlSetMetaEncoding(doc, BAD_CAST "utf-8");
+    /* htmlDocDumpMemoryFormat doesn't update meta tags */
+    htmlDocDumpMemoryFormat(doc, &out, &size, 0);
+    if (!xmlStrEqual(out, BAD_CAST expect)) {
+        fprintf(stderr, "htmlSetMetaEncoding insertion failed\n");
+        err = 1;
+    }
+    xmlFree(out);
+
+    xmlFreeDoc(doc);
+    return err;
+}
+
+static int
+testHtmlUpdateMetaEncoding(void) {
+    /* We rely on the implementation adjusting all meta tags */
+    const char *html =
+        "<html>\n"
+        "    <head>\n"
+        "        <meta charset=\"utf-8\">\n"
+        "        <meta charset=\"  foo  \">\n"
+        "        <meta charset=\"\">\n"
+        "        <" MHE " content=\"text/html; ChArSeT=foo\">\n"
+        "        <" MHE " content=\"text/html; charset = \">\n"
+        "        <" MHE " content=\"text/html; charset = '  foo  '\">\n"
+        "        <" MHE " content=\"text/html; charset = '  foo  \">\n"
+        "        <" MHE " content='text/html; charset = \"  foo  \"'>\n"
+        "        <" MHE " content='text/html; charset = \"  foo  '>\n"
+        "        <" MHE " content=\"charset ; charset = bar; baz\">\n"
+        "        <" MHE " content=\"text/html\">\n"
+        "        <" MHE " content=\"\">\n"
+        "        <" MHE ">\n"
+        "    </head>\n"
+        "    <body></body>\n"
+        "</html>\n";
+    const char *expect =
+        "<html>\n"
+        "    <head>\n"
+        "        <meta charset=\"utf-8\">\n"
+        "        <meta charset=\"  utf-8  \">\n"
+        "        <meta charset=\"utf-8\">\n"
+        "        <" MHE " content=\"text/html; ChArSeT=utf-8\">\n"
+        "        <" MHE " content=\"text/html; charset = \">\n"
+        "        <" MHE " content=\"text/html; charset = '  utf-8  '\">\n"
+        "        <" MHE " content=\"text/html; charset = '  foo  \">\n"
+        "        <" MHE " content=\"text/html; charset = &quot;  utf-8  &quot;\">\n"
+        "        <" MHE " content=\"text/html; charset = &quot;  foo  \">\n"
+        "        <" MHE " content=\"charset ; charset = utf-8; baz\">\n"
+        "        <" MHE " content=\"text/html\">\n"
+        "        <" MHE " content=\"\">\n"
+        "        <" MHE ">\n"
+        "    </head>\n"
+        "    <body></body>\n"
+        "</html>\n";
+    htmlDocPtr doc;
+    xmlBufferPtr buf;
+    xmlSaveCtxtPtr save;
+    xmlChar *out;
+    int size, err = 0;
+
+    doc = htmlReadDoc(BAD_CAST html, NULL, NULL, HTML_PARSE_NODEFDTD);
+
+    /* xmlSave updates meta tags */
+    buf = xmlBufferCreate();
+    save = xmlSaveToBuffer(buf, NULL, 0);
+    xmlSaveDoc(save, doc);
+    xmlSaveClose(save);
+    if (!xmlStrEqual(xmlBufferContent(buf), BAD_CAST expect)) {
+        fprintf(stderr, "meta tag update failed when serializing\n");
+        err = 1;
+    }
+    xmlBufferFree(buf);
+
+    xmlFree((xmlChar *) doc->encoding);
+    doc->encoding = NULL;
+    htmlSetMetaEncoding(doc, BAD_CAST "utf-8");
+    /* htmlDocDumpMemoryFormat doesn't update meta tags */
+    htmlDocDumpMemoryFormat(doc, &out, &size, 0);
+    if (!xmlStrEqual(out, BAD_CAST expect)) {
+        fprintf(stderr, "htmlSetMetaEncoding update failed\n");
+        err = 1;
+    }
+    xmlFree(out);
+
+    xmlFreeDoc(doc);
+    return err;
+}
+#endif /* LIBXML_OUTPUT_ENABLED */
+
+#ifdef LIBXML_PUSH_ENABLED
+static int
+testHtmlPushWithEncoding(void) {
+    htmlParserCtxtPtr ctxt;
+    htmlDocPtr doc;
+    htmlNodePtr node;
+    int err = 0;
+
+    ctxt = htmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL,
+                                    XML_CHAR_ENCODING_UTF8);
+    htmlParseChunk(ctxt, "-\xC3\xA4-", 4, 1);
+
+    doc = ctxt->myDoc;
+    if (!xmlStrEqual(doc->encoding, BAD_CAST "UTF-8")) {
+        fprintf(stderr, "testHtmlPushWithEncoding failed\n");
+        err = 1;
+    }
+
+    node = xmlDocGetRootElement(doc)->children->children;
+    if (!xmlStrEqual(node->content, BAD_CAST "-\xC3\xA4-")) {
+        fprintf(stderr, "testHtmlPushWithEncoding failed\n");
+        err = 1;
+    }
+
+    xmlFreeDoc(doc);
+    htmlFreeParserCtxt(ctxt);
+    return err;
+}
+#endif
+#endif
+
+#ifdef LIBXML_READER_ENABLED
+static int
+testReaderEncoding(void) {
+    xmlBuffer *buf;
+    xmlTextReader *reader;
+    xmlChar *xml;
+    const xmlChar *encoding;
+    int err = 0;
+    int i;
+
+    buf = xmlBufferCreate();
+    xmlBufferCCat(buf, "<?xml version='1.0' encoding='ISO-8859-1'?>\n");
+    xmlBufferCCat(buf, "<doc>");
+    for (i = 0; i < 8192; i++)
+        xmlBufferCCat(buf, "x");
+    xmlBufferCCat(buf, "</doc>");
+    xml = xmlBufferDetach(buf);
+    xmlBufferFree(buf);
+
+    reader = xmlReaderForDoc(BAD_CAST xml, NULL, NULL, 0);
+    xmlTextReaderRead(reader);
+    encoding = xmlTextReaderConstEncoding(reader);
+
+    if (!xmlStrEqual(encoding, BAD_CAST "ISO-8859-1")) {
+        fprintf(stderr, "testReaderEncoding failed\n");
+        err = 1;
+    }
+
+    xmlFreeTextReader(reader);
+    xmlFree(xml);
+    return err;
+}
+
+#ifdef LIBXML_OUTPUT_ENABLED
+static int
+testReaderContent(void) {
+    xmlTextReader *reader;
+    const xmlChar *xml = BAD_CAST "<d>x<e>y</e><f>z</f></d>";
+    xmlChar *string;
+    int err = 0;
+
+    reader = xmlReaderForDoc(xml, NULL, NULL, 0);
+    xmlTextReaderRead(reader);
+
+    string = xmlTextReaderReadOuterXml(reader);
+    if (!xmlStrEqual(string, xml)) {
+        fprintf(stderr, "xmlTextReaderReadOuterXml failed\n");
+        err = 1;
+    }
+    xmlFree(string);
+
+    string = xmlTextReaderReadInnerXml(reader);
+    if (!xmlStrEqual(string, BAD_CAST "x<e>y</e><f>z</f>")) {
+        fprintf(stderr, "xmlTextReaderReadInnerXml failed\n");
+        err = 1;
+    }
+    xmlFree(string);
+
+    string = xmlTextReaderReadString(reader);
+    if (!xmlStrEqual(string, BAD_CAST "xyz")) {
+        fprintf(stderr, "xmlTextReaderReadString failed\n");
+        err = 1;
+    }
+    xmlFree(string);
+
+    xmlFreeTextReader(reader);
+    return err;
+}
+#endif /* LIBXML_OUTPUT_ENABLED */
+
+static int
+testReaderNode(xmlTextReader *reader) {
+    xmlChar *string;
+    int type;
+    int err = 0;
+
+    type = xmlTextReaderNodeType(reader);
+    string = xmlTextReaderReadString(reader);
+
+    if (type == XML_READER_TYPE_ELEMENT) {
+        xmlNodePtr node = xmlTextReaderCurrentNode(reader);
+
+        if ((node->children == NULL) != (string == NULL))
+            err = 1;
+    } else if (type == XML_READER_TYPE_TEXT ||
+               type == XML_READER_TYPE_CDATA ||
+               type == XML_READER_TYPE_WHITESPACE ||
+               type == XML_READER_TYPE_SIGNIFICANT_WHITESPACE) {
+        if (string == NULL)
+            err = 1;
+    } else {
+        if (string != NULL)
+            err = 1;
+    }
+
+    if (err)
+        fprintf(stderr, "xmlTextReaderReadString failed for %d\n", type);
+
+    xmlFree(string);
+
+    return err;
+}
+
+static int
+testReader(void) {
+    xmlTextReader *reader;
+    const xmlChar *xml = BAD_CAST
+        "<d>\n"
+        "  x<e a='v'>y</e><f>z</f>\n"
+        "  <![CDATA[cdata]]>\n"
+        "  <!-- comment -->\n"
+        "  <?pi content?>\n"
+        "  <empty/>\n"
+        "</d>";
+    int err = 0;
+
+    reader = xmlReaderForDoc(xml, NULL, NULL, 0);
+
+    while (xmlTextReaderRead(reader) > 0) {
+        if (testReaderNode(reader) > 0) {
+            err = 1;
+            break;
+        }
+
+        if (xmlTextReaderMoveToFirstAttribute(reader) > 0) {
+            do {
+                if (testReaderNode(reader) > 0) {
+                    err = 1;
+                    break;
+                }
+            } while (xmlTextReaderMoveToNextAttribute(reader) > 0);
+
+            xmlTextReaderMoveToElement(reader);
+        }
+    }
+
+    xmlFreeTextReader(reader);
+    return err;
+}
+
+#ifdef LIBXML_XINCLUDE_ENABLED
+typedef struct {
+    char *message;
+    int code;
+} testReaderErrorCtxt;
+
+static void
+testReaderError(void *arg, const char *msg,
+                xmlParserSeverities severity ATTRIBUTE_UNUSED,
+                xmlTextReaderLocatorPtr locator ATTRIBUTE_UNUSED) {
+    testReaderErrorCtxt *ctxt = arg;
+
+    if (ctxt->message != NULL)
+        xmlFree(ctxt->message);
+    ctxt->message = xmlMemStrdup(msg);
+}
+
+static void
+testStructuredReaderError(void *arg, const xmlError *error) {
+    testReaderErrorCtxt *ctxt = arg;
+
+    if (ctxt->message != NULL)
+        xmlFree(ctxt->message);
+    ctxt->message = xmlMemStrdup(error->message);
+    ctxt->code = error->code;
+}
+
+static int
+testReaderXIncludeError(void) {
+    /*
+     * Test whether XInclude errors are reported to the custom error
+     * handler of a reader.
+     */
+    const char *doc =
+        "<doc xmlns:xi='http://www.w3.org/2001/XInclude'>\n"
+        "  <xi:include/>\n"
+        "</doc>\n";
+    xmlTextReader *reader;
+    testReaderErrorCtxt errorCtxt;
+    int err = 0;
+
+    reader = xmlReaderForDoc(BAD_CAST doc, NULL, NULL, XML_PARSE_XINCLUDE);
+    xmlTextReaderSetErrorHandler(reader, testReaderError, &errorCtxt);
+    errorCtxt.message = NULL;
+    errorCtxt.code = 0;
+    while (xmlTextReaderRead(reader) > 0)
+        ;
+
+    if (errorCtxt.message == NULL ||
+        strstr(errorCtxt.message, "href or xpointer") == NULL) {
+        fprintf(stderr, "xmlTextReaderSetErrorHandler failed\n");
+        err = 1;
+    }
+
+    xmlFree(errorCtxt.message);
+    xmlFreeTextReader(reader);
+
+    reader = xmlReaderForDoc(BAD_CAST doc, NULL, NULL, XML_PARSE_XINCLUDE);
+    xmlTextReaderSetStructuredErrorHandler(reader, testStructuredReaderError,
+                                           &errorCtxt);
+    errorCtxt.message = NULL;
+    errorCtxt.code = 0;
+    while (xmlTextReaderRead(reader) > 0)
+        ;
+
+    if (errorCtxt.code != XML_XINCLUDE_NO_HREF ||
+        errorCtxt.message == NULL ||
+        strstr(errorCtxt.message, "href or xpointer") == NULL) {
+        fprintf(stderr, "xmlTextReaderSetStructuredErrorHandler failed\n");
+        err = 1;
+    }
+
+    xmlFree(errorCtxt.message);
+    xmlFreeTextReader(reader);
+
+    return err;
+}
+#endif
+#endif
+
+#ifdef LIBXML_WRITER_ENABLED
+static int
+testWriterIOWrite(void *ctxt, const char *data, int len) {
+    (void) ctxt;
+    (void) data;
+
+    return len;
+}
+
+static int
+testWriterIOClose(void *ctxt) {
+    (void) ctxt;
+
+    return XML_IO_ENAMETOOLONG;
+}
+
+static int
+testWriterClose(void){
+    xmlOutputBufferPtr out;
+    xmlTextWriterPtr writer;
+    int err = 0;
+    int result;
+
+    out = xmlOutputBufferCreateIO(testWriterIOWrite, testWriterIOClose,
+                                  NULL, NULL);
+    writer = xmlNewTextWriter(out);
+    xmlTextWriterStartDocument(writer, "1.0", "UTF-8", NULL);
+    xmlTextWriterStartElement(writer, BAD_CAST "elem");
+    xmlTextWriterEndElement(writer);
+    xmlTextWriterEndDocument(writer);
+    result = xmlTextWriterClose(writer);
+
+    if (result != XML_IO_ENAMETOOLONG) {
+        fprintf(stderr, "xmlTextWriterClose reported wrong error %d\n",
+                result);
+        err = 1;
+    }
+
+    xmlFreeTextWriter(writer);
+    return err;
+}
+#endif
 
-    err |= testSaveNullEncDoc(
-        "<?xml version=\"1.0\"?><doc>\xC3\x98</doc>",
-        "<?xml version=\"1.0\"?>\n<doc>&#xD8;</doc>\n");
-    err |= testSaveNullEncDoc(
-        "<?xml version=\"1.0\" encoding=\"utf-8\"?><doc>\xC3\x98</doc>",
-        "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n<doc>\xC3\x98</doc>\n");
-    err |= testSaveNullEncDoc(
-        "<?xml version=\"1.0\" encoding=\"iso-8859-1\"?><doc>\xD8</doc>",
-        "<?xml version=\"1.0\" encoding=\"iso-8859-1\"?>\n<doc>\xD8</doc>\n");
+#ifdef LIBXML_XPATH_ENABLED
+static int
+checkXPathLargeUnion(xmlXPathContextPtr ctxt, const char *expr, int n,
+                     int threads) {
+    xmlXPathObjectPtr res;
+    int i, err = 0;
+
+    setThreadCount(threads);
+    res = xmlXPathEval(BAD_CAST expr, ctxt);
+    setThreadCount(0);
+
+    if ((res == NULL) || (res->nodesetval == NULL) ||
+        (res->nodesetval->nodeNr != n)) {
+        fprintf(stderr, "large union returned wrong number of nodes\n");
+        err = 1;
+    } else {
+        for (i = 1; i < n; i++) {
+            if (res->nodesetval->nodeTab[i - 1]->next !=
+                res->nodesetval->nodeTab[i]) {
+                fprintf(stderr, "large union %s not in document order "
+                        "with %d threads\n", expr, threads);
+                err = 1;
+                break;
+            }
+        }
+    }
+    xmlXPathFreeObject(res);
 
     return err;
 }
 
 static int
-testDocDumpFormatMemoryEnc(void) {
-    const char *xml = "<doc>\xC3\x98</doc>";
-    const char *expect =
-        "<?xml version=\"1.0\" encoding=\"iso-8859-1\"?>\n"
-        "<doc>\xD8</doc>\n";
+testXPathLargeUnion(void) {
     xmlDocPtr doc;
-    xmlChar *text;
-    int len;
+    xmlNodePtr root;
+    xmlXPathContextPtr ctxt;
+    xmlXPathObjectPtr res;
+    /* Serial sort, odd number of chunks and more threads than chunks */
+    const int threads[] = { 1, 3, 8 };
+    int i, n = 60000;
     int err = 0;
 
-    doc = xmlReadDoc(BAD_CAST xml, NULL, NULL, 0);
-    xmlDocDumpFormatMemoryEnc(doc, &text, &len, "iso-8859-1", 0);
+    doc = xmlNewDoc(BAD_CAST "1.0");
+    root = xmlNewDocNode(doc, NULL, BAD_CAST "doc", NULL);
+    xmlDocSetRootElement(doc, root);
+    xmlAddChild(root, xmlNewDocComment(doc, BAD_CAST "c"));
+    for (i = 0; i < n; i++) {
+        xmlNewChild(root, NULL, BAD_CAST "a", NULL);
+        xmlNewChild(root, NULL, BAD_CAST "b", NULL);
+    }
 
-    if (strcmp((char *) text, expect) != 0) {
-        fprintf(stderr, "xmlDocDumpFormatMemoryEnc failed\n");
+    ctxt = xmlXPathNewContext(doc);
+    ctxt->flags |= XML_XPATH_PARALLEL_SORT;
+
+    err |= checkXPathLargeUnion(ctxt, "//b | //a", 2 * n, 1);
+
+    res = xmlXPathEval(BAD_CAST "//a[position() mod 2 = 0] | //a", ctxt);
+    if ((res == NULL) || (res->nodesetval == NULL) ||
+        (res->nodesetval->nodeNr != n)) {
+        fprintf(stderr, "large union didn't remove duplicates\n");
         err = 1;
     }
+    xmlXPathFreeObject(res);
 
-    xmlFree(text);
+    /*
+     * Nodes without a document can't use the document order index,
+     * so they're sorted in parallel. The comment is appended to the
+     * elements and must be moved to the front. Keep the element order
+     * computed by xmlXPathOrderDocElems to make comparisons cheap.
+     */
+    xmlXPathFreeContext(ctxt);
+    xmlXPathOrderDocElems(doc);
+    xmlUnlinkNode(root);
+    xmlSetTreeDoc(root, NULL);
+    ctxt = xmlXPathNewContext(NULL);
+    ctxt->flags |= XML_XPATH_PARALLEL_SORT;
+    xmlXPathSetContextNode(root, ctxt);
+    for (i = 0; i < 3; i++)
+        err |= checkXPathLargeUnion(ctxt, "* | comment()", 2 * n + 1,
+                                    threads[i]);
+
+    xmlXPathFreeContext(ctxt);
+    xmlFreeNode(root);
     xmlFreeDoc(doc);
     return err;
 }
-#endif /* LIBXML_OUTPUT_ENABLED */
 
-#ifdef LIBXML_SAX1_ENABLED
 static int
-testBalancedChunk(void) {
-    xmlNodePtr list;
-    xmlNodePtr elem;
-    int ret;
+checkXPathDocOrder(xmlXPathContextPtr ctxt, int expected) {
+    xmlXPathObjectPtr res;
+    int i;
     int err = 0;
 
-    ret = xmlParseBalancedChunkMemory(NULL, NULL, NULL, 0,
-            BAD_CAST "start <node xml:lang='en'>abc</node> end", &list);
-
-    if ((ret != XML_ERR_OK) ||
-        (list == NULL) ||
-        ((elem = list->next) == NULL) ||
-        (elem->type != XML_ELEMENT_NODE) ||
-        (elem->nsDef == NULL) ||
-        (!xmlStrEqual(elem->nsDef->href, XML_XML_NAMESPACE))) {
-        fprintf(stderr, "xmlParseBalancedChunkMemory failed\n");
+    res = xmlXPathEval(BAD_CAST "//node() | //@*", ctxt);
+    if ((res == NULL) || (res->nodesetval == NULL) ||
+        (res->nodesetval->nodeNr != expected)) {
+        fprintf(stderr, "document order: wrong number of nodes\n");
         err = 1;
+    } else {
+        for (i = 1; i < expected; i++) {
+            if (xmlXPathCmpNodes(res->nodesetval->nodeTab[i - 1],
+                                 res->nodesetval->nodeTab[i]) != 1) {
+                fprintf(stderr, "document order: wrong order at %d\n", i);
+                err = 1;
+                break;
+            }
+        }
+        /* Nodes which aren't adjacent */
+        for (i = 0; i < expected; i++) {
+            int j = (i * 7 + 3) % expected;
+            int cmp = (i < j) ? 1 : (i > j) ? -1 : 0;
+
+            if (xmlXPathCmpNodes(res->nodesetval->nodeTab[i],
+                                 res->nodesetval->nodeTab[j]) != cmp) {
+                fprintf(stderr, "document order: wrong order of %d and %d\n",
+                        i, j);
+                err = 1;
+                break;
+            }
+        }
     }
+    xmlXPathFreeObject(res);
 
-    xmlFreeNodeList(list);
-
-    return(err);
+    return err;
 }
-#endif
 
-#ifdef LIBXML_PUSH_ENABLED
 static int
-testHugePush(void) {
-    xmlParserCtxtPtr ctxt;
-    int err, i;
+testXPathDocOrder(void) {
+    xmlDocPtr doc;
+    xmlNodePtr root, node;
+    xmlXPathContextPtr ctxt;
+    int i, n = 1000;
+    int err = 0;
 
-    ctxt = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL);
+    doc = xmlNewDoc(BAD_CAST "1.0");
+    root = xmlNewDocNode(doc, NULL, BAD_CAST "doc", NULL);
+    xmlDocSetRootElement(doc, root);
+    for (i = 0; i < n; i++) {
+        node = xmlNewChild(root, NULL, BAD_CAST "a", BAD_CAST "text");
+        xmlNewProp(node, BAD_CAST "x", BAD_CAST "1");
+    }
 
-    /*
-     * Push parse a document larger than XML_MAX_LOOKUP_LIMIT
-     * (10,000,000 bytes). This mainly tests whether shrinking the
-     * buffer works when push parsing.
-     */
-    xmlParseChunk(ctxt, "<doc>", 5, 0);
-    for (i = 0; i < 1000000; i++)
-        xmlParseChunk(ctxt, "<elem>text</elem>", 17, 0);
-    xmlParseChunk(ctxt, "</doc>", 6, 1);
+    ctxt = xmlXPathNewContext(doc);
 
-    err = ctxt->wellFormed ? 0 : 1;
-    xmlFreeDoc(ctxt->myDoc);
-    xmlFreeParserCtxt(ctxt);
+    /* root, n elements, n text nodes and n attributes */
+    err |= checkXPathDocOrder(ctxt, 1 + 3 * n);
+
+    /* Move nodes around, free and create nodes */
+    for (i = 0; i < 10; i++)
+        xmlAddPrevSibling(root->children, root->last);
+    node = root->children->next;
+    xmlUnlinkNode(node);
+    xmlFreeNode(node);
+    xmlNewChild(root->children, NULL, BAD_CAST "b", NULL);
+    err |= checkXPathDocOrder(ctxt, 1 + 3 * n - 2);
+
+    xmlAddChild(root->last, root->children);
+    err |= checkXPathDocOrder(ctxt, 1 + 3 * n - 2);
 
+    xmlXPathFreeContext(ctxt);
+    xmlFreeDoc(doc);
     return err;
 }
 
+/*
+ * Compare the following and preceding axes of a set of context nodes
+ * with the union of the axes of each context node.
+ */
 static int
-testHugeEncodedChunk(void) {
-    xmlBufferPtr buf;
-    xmlChar *chunk;
-    xmlParserCtxtPtr ctxt;
-    int err = 0, i;
-
-    /*
-     * Test the push parser with a built-in encoding handler like ISO-8859-1
-     * and a chunk larger than the initial decoded buffer (currently 4 KB).
-     */
-    buf = xmlBufferCreate();
-    xmlBufferCat(buf,
-            BAD_CAST "<?xml version='1.0' encoding='ISO-8859-1'?>\n");
-    xmlBufferCat(buf, BAD_CAST "<doc><!-- ");
-    for (i = 0; i < 2000; i++)
-        xmlBufferCat(buf, BAD_CAST "0123456789");
-    xmlBufferCat(buf, BAD_CAST " --></doc>");
-    chunk = xmlBufferDetach(buf);
-    xmlBufferFree(buf);
-
-    ctxt = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL);
+checkXPathAxisUnion(xmlXPathContextPtr ctxt, const char *nodes,
+                    const char *axis) {
+    xmlXPathObjectPtr set, res, tmp;
+    xmlXPathCompExprPtr comp;
+    xmlNodeSetPtr ref;
+    char expr[200];
+    int i, spec, err = 0;
+
+    set = xmlXPathEval(BAD_CAST nodes, ctxt);
+    ref = xmlXPathNodeSetCreate(NULL);
+    for (i = 0; i < set->nodesetval->nodeNr; i++) {
+        tmp = xmlXPathNodeEval(set->nodesetval->nodeTab[i], BAD_CAST axis,
+                               ctxt);
+        ref = xmlXPathNodeSetMerge(ref, tmp->nodesetval);
+        xmlXPathFreeObject(tmp);
+    }
+    xmlXPathNodeSetSort(ref);
+
+    snprintf(expr, sizeof(expr), "%s/%s", nodes, axis);
+    for (spec = 0; spec <= 1; spec++) {
+        comp = xmlXPathCtxtCompile(ctxt, BAD_CAST expr);
+        if (spec)
+            xmlXPathCompiledSpecialize(comp);
+        xmlXPathSetContextNode((xmlNodePtr) ctxt->doc, ctxt);
+        res = xmlXPathCompiledEval(comp, ctxt);
+        if ((res == NULL) || (res->nodesetval == NULL) ||
+            (res->nodesetval->nodeNr != ref->nodeNr)) {
+            fprintf(stderr, "axis union: wrong number of nodes for %s\n",
+                    expr);
+            err = 1;
+        } else {
+            for (i = 0; i < ref->nodeNr; i++) {
+                if (res->nodesetval->nodeTab[i] != ref->nodeTab[i]) {
+                    fprintf(stderr, "axis union: wrong node for %s\n",
+                            expr);
+                    err = 1;
+                    break;
+                }
+            }
+        }
+        xmlXPathFreeObject(res);
+        xmlXPathFreeCompExpr(comp);
+    }
 
-    xmlParseChunk(ctxt, (char *) chunk, xmlStrlen(chunk), 0);
-    xmlParseChunk(ctxt, NULL, 0, 1);
+    xmlXPathFreeNodeSet(ref);
+    xmlXPathFreeObject(set);
 
-    if (!ctxt->wellFormed)
-        err = 1;
-    xmlFreeDoc(ctxt->myDoc);
-    xmlFreeParserCtxt(ctxt);
-    xmlFree(chunk);
+    return err;
+}
 
-    /*
-     * Test the push parser with
-     *
-     * - a single call to xmlParseChunk,
-     * - a non-UTF8 encoding,
-     * - a chunk larger then MINLEN (4000 bytes).
-     *
-     * This verifies that the whole buffer is processed in the initial
-     * charset conversion.
-     */
-    buf = xmlBufferCreate();
-    xmlBufferCat(buf,
-            BAD_CAST "<?xml version='1.0' encoding='ISO-8859-1'?>\n");
-    xmlBufferCat(buf, BAD_CAST "<doc>");
-    /* 20,000 characters */
-    for (i = 0; i < 2000; i++)
-        xmlBufferCat(buf, BAD_CAST "0123456789");
-    xmlBufferCat(buf, BAD_CAST "</doc>");
-    chunk = xmlBufferDetach(buf);
-    xmlBufferFree(buf);
+static int
+testXPathAxisUnion(void) {
+    static const char xml[] =
+        "<doc>"
+        "<a id='1'><b/><a id='2'><b/>t<b/></a><!--c--><b/></a>"
+        "<b/><a id='3'/>text"
+        "<b><a id='4'><b/><a id='5'/></a></b><?pi?>"
+        "</doc>";
+    static const char *const nodes[] = {
+        "//a",
+        "//a/@id",
+        "/doc/a//*",
+        "(//a | //b)",
+        "(//@id | //b)",
+        "(/doc | //a)",
+        "//a[@id > 1]",
+    };
+    static const char *const axes[] = {
+        "following::b",
+        "following::node()",
+        "preceding::b",
+        "preceding::node()",
+    };
+    xmlDocPtr doc;
+    xmlXPathContextPtr ctxt;
+    int i, j, err = 0;
 
-    ctxt = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL);
+    doc = xmlReadDoc(BAD_CAST xml, NULL, NULL, 0);
+    ctxt = xmlXPathNewContext(doc);
 
-    xmlParseChunk(ctxt, (char *) chunk, xmlStrlen(chunk), 1);
+    for (i = 0; i < (int) (sizeof(nodes) / sizeof(nodes[0])); i++) {
+        for (j = 0; j < (int) (sizeof(axes) / sizeof(axes[0])); j++)
+            err |= checkXPathAxisUnion(ctxt, nodes[i], axes[j]);
+    }
 
-    if (!ctxt->wellFormed)
-        err = 1;
-    xmlFreeDoc(ctxt->myDoc);
-    xmlFreeParserCtxt(ctxt);
-    xmlFree(chunk);
+    /* A new node invalidates the index */
+    xmlNewChild(xmlDocGetRootElement(doc)->children, NULL, BAD_CAST "b",
+                NULL);
+    err |= checkXPathAxisUnion(ctxt, "//a", "following::b");
+    err |= checkXPathAxisUnion(ctxt, "//a", "preceding::b");
+    err |= checkXPathDocOrder(ctxt, 23);
 
+    xmlXPathFreeContext(ctxt);
+    xmlFreeDoc(doc);
     return err;
 }
 
 static int
-testPushCDataEnd(void) {
+checkXPathNumber(xmlXPathContextPtr ctxt, xmlXPathCompExprPtr comp,
+                 double expected, const char *msg) {
+    xmlXPathObjectPtr res;
     int err = 0;
-    int k;
-
-    for (k = 0; k < 4; k++) {
-        xmlBufferPtr buf;
-        xmlChar *chunk;
-        xmlParserCtxtPtr ctxt;
-        int i;
-
-        ctxt = xmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL);
-        xmlCtxtSetOptions(ctxt, XML_PARSE_NOERROR);
-
-        /*
-         * Push parse text data with ']]>' split across chunks.
-         */
-        buf = xmlBufferCreate();
-        xmlBufferCCat(buf, "<doc>");
-
-        /*
-         * Also test xmlParseCharDataCopmlex
-         */
-        if (k & 1)
-            xmlBufferCCat(buf, "x");
-        else
-            xmlBufferCCat(buf, "\xC3\xA4");
 
-        /*
-         * Create enough data to trigger a "characters" SAX callback.
-         * (XML_PARSER_BIG_BUFFER_SIZE = 300)
-         */
-        for (i = 0; i < 2000; i++)
-            xmlBufferCCat(buf, "x");
+    res = xmlXPathCompiledEval(comp, ctxt);
+    if ((res == NULL) || (res->type != XPATH_NUMBER) ||
+        (res->floatval != expected)) {
+        fprintf(stderr, "result cache: %s\n", msg);
+        err = 1;
+    }
+    xmlXPathFreeObject(res);
 
-        if (k & 2)
-            xmlBufferCCat(buf, "]");
-        else
-            xmlBufferCCat(buf, "]]");
+    return err;
+}
 
-        chunk = xmlBufferDetach(buf);
-        xmlBufferFree(buf);
+static int
+testXPathResultCache(void) {
+    xmlDocPtr doc;
+    xmlNodePtr root, a, b;
+    xmlXPathContextPtr ctxt;
+    xmlXPathCompExprPtr count, vars;
+    const xmlChar *name;
+    int err = 0;
 
-        xmlParseChunk(ctxt, (char *) chunk, xmlStrlen(chunk), 0);
-        if (k & 2)
-            xmlParseChunk(ctxt, "]>xxx</doc>", 11, 1);
-        else
-            xmlParseChunk(ctxt, ">xxx</doc>", 10, 1);
+    doc = xmlReadDoc(BAD_CAST "<doc><a x='1'/><a x='2'/><b/></doc>",
+                     NULL, NULL, 0);
+    root = xmlDocGetRootElement(doc);
+    a = root->children;
+    b = root->last;
+
+    ctxt = xmlXPathNewContext(doc);
+    xmlXPathContextSetResultCache(ctxt, -1);
+    xmlXPathSetContextNode(root, ctxt);
+    count = xmlXPathCtxtCompile(ctxt, BAD_CAST "count(//a)");
+    vars = xmlXPathCtxtCompile(ctxt, BAD_CAST "count(//a[@x = $v])");
+
+    err |= checkXPathNumber(ctxt, count, 2, "wrong initial result");
+
+    /* Modifying names directly isn't tracked, so this returns a hit */
+    name = a->name;
+    a->name = b->name;
+    b->name = name;
+    err |= checkXPathNumber(ctxt, count, 2, "result not cached");
+    b->name = a->name;
+    a->name = name;
+
+    xmlNewChild(root, NULL, BAD_CAST "a", NULL);
+    err |= checkXPathNumber(ctxt, count, 3, "insertion not detected");
+    xmlNodeSetName(b, BAD_CAST "a");
+    err |= checkXPathNumber(ctxt, count, 4, "renaming not detected");
+    xmlUnlinkNode(a);
+    xmlFreeNode(a);
+    err |= checkXPathNumber(ctxt, count, 3, "removal not detected");
+
+    xmlXPathRegisterVariable(ctxt, BAD_CAST "v", xmlXPathNewCString("2"));
+    err |= checkXPathNumber(ctxt, vars, 1, "wrong variable result");
+    xmlXPathRegisterVariable(ctxt, BAD_CAST "v", xmlXPathNewCString("3"));
+    err |= checkXPathNumber(ctxt, vars, 0, "variable change not detected");
+
+    xmlXPathFreeCompExpr(vars);
+    xmlXPathFreeCompExpr(count);
+    xmlXPathFreeContext(ctxt);
+    xmlFreeDoc(doc);
+    return err;
+}
 
-        if (ctxt->errNo != XML_ERR_MISPLACED_CDATA_END) {
-            fprintf(stderr, "xmlParseChunk failed to detect CData end: %d\n",
-                    ctxt->errNo);
+static int
+checkXPathNameIndex(xmlXPathContextPtr ctxt) {
+    static const char *const exprs[] = {
+        "//b",
+        "//a//b",
+        "//x:b",
+        "//a[2]/descendant::b",
+        "//a/descendant-or-self::a",
+        "//b[2]",
+        "//c | //b",
+        "//missing",
+        "//b/text()/..//b"
+    };
+    xmlNodePtr node = ctxt->node;
+    int err = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+        xmlXPathObjectPtr expected, res;
+        int j;
+
+        ctxt->flags &= ~XML_XPATH_NAME_INDEX;
+        ctxt->node = node;
+        expected = xmlXPathEval(BAD_CAST exprs[i], ctxt);
+        ctxt->flags |= XML_XPATH_NAME_INDEX;
+        ctxt->node = node;
+        res = xmlXPathEval(BAD_CAST exprs[i], ctxt);
+
+        if ((expected == NULL) || (res == NULL) ||
+            (expected->nodesetval == NULL) || (res->nodesetval == NULL) ||
+            (expected->nodesetval->nodeNr != res->nodesetval->nodeNr)) {
+            fprintf(stderr, "name index: wrong result for %s\n", exprs[i]);
             err = 1;
+        } else {
+            for (j = 0; j < res->nodesetval->nodeNr; j++) {
+                if (res->nodesetval->nodeTab[j] !=
+                    expected->nodesetval->nodeTab[j]) {
+                    fprintf(stderr, "name index: wrong node for %s\n",
+                            exprs[i]);
+                    err = 1;
+                    break;
+                }
+            }
         }
 
-        xmlFree(chunk);
-        xmlFreeDoc(ctxt->myDoc);
-        xmlFreeParserCtxt(ctxt);
+        xmlXPathFreeObject(res);
+        xmlXPathFreeObject(expected);
     }
 
     return err;
 }
-#endif /* PUSH */
 
-#ifdef LIBXML_HTML_ENABLED
+/*
+ * Modify the tree and run a nested query using the name index while
+ * the calling step still iterates over the index.
+ */
+static void
+touchXPathFunc(xmlXPathParserContextPtr ctxt, int nargs) {
+    xmlXPathContextPtr xpctxt = ctxt->context;
+    xmlNodePtr node = xpctxt->node;
+    int size = xpctxt->contextSize;
+    int pos = xpctxt->proximityPosition;
+
+    (void) nargs;
+
+    xmlSetProp(node, BAD_CAST "t", BAD_CAST "1");
+    xmlXPathFreeObject(xmlXPathEval(BAD_CAST "//b", xpctxt));
+
+    xpctxt->node = node;
+    xpctxt->contextSize = size;
+    xpctxt->proximityPosition = pos;
+    xmlXPathValuePush(ctxt, xmlXPathNewBoolean(1));
+}
+
 static int
-testHtmlIds(void) {
-    const char *htmlContent =
-        "<html><body><div id='myId'>Hello, World!</div></body></html>";
-    htmlDocPtr doc;
-    xmlAttrPtr node;
+testXPathNameIndex(void) {
+    xmlDocPtr doc;
+    xmlNodePtr root;
+    xmlXPathContextPtr ctxt;
+    xmlXPathObjectPtr res;
+    int err = 0;
 
-    doc = htmlReadDoc(BAD_CAST htmlContent, NULL, NULL, 0);
-    if (doc == NULL) {
-        fprintf(stderr, "could not parse HTML content\n");
-        return 1;
-    }
+    doc = xmlReadDoc(BAD_CAST
+        "<doc xmlns:x='urn:x'>"
+        "<a><b>1</b><x:b/><c><b>2</b></c></a>"
+        "<a><a><b>3</b></a><b>4</b></a>"
+        "<b>5</b>"
+        "</doc>",
+        NULL, NULL, 0);
+    root = xmlDocGetRootElement(doc);
 
-    node = xmlGetID(doc, BAD_CAST "myId");
-    if (node == NULL) {
-        fprintf(stderr, "xmlGetID doesn't work on HTML\n");
-        return 1;
+    ctxt = xmlXPathNewContext(doc);
+    xmlXPathRegisterNs(ctxt, BAD_CAST "x", BAD_CAST "urn:x");
+
+    xmlXPathSetContextNode((xmlNodePtr) doc, ctxt);
+    err |= checkXPathNameIndex(ctxt);
+    xmlXPathSetContextNode(root->children, ctxt);
+    err |= checkXPathNameIndex(ctxt);
+
+    /* The index must be rebuilt after the tree changed */
+    xmlNewChild(root->children->next, NULL, BAD_CAST "b", NULL);
+    xmlAddChild(root->children, xmlNewDocNode(doc, NULL, BAD_CAST "a", NULL));
+    xmlXPathSetContextNode((xmlNodePtr) doc, ctxt);
+    err |= checkXPathNameIndex(ctxt);
+    xmlXPathSetContextNode(root->children->next, ctxt);
+    err |= checkXPathNameIndex(ctxt);
+
+    /* The index must stay valid while the step uses it */
+    xmlXPathRegisterFunc(ctxt, BAD_CAST "touch", touchXPathFunc);
+    ctxt->flags |= XML_XPATH_NAME_INDEX;
+    xmlXPathSetContextNode((xmlNodePtr) doc, ctxt);
+    res = xmlXPathEval(BAD_CAST "//a/descendant::b[touch()]", ctxt);
+    if ((res == NULL) || (res->nodesetval == NULL) ||
+        (res->nodesetval->nodeNr != 5)) {
+        fprintf(stderr, "name index: wrong result after tree change\n");
+        err = 1;
     }
+    xmlXPathFreeObject(res);
+    ctxt->flags &= ~XML_XPATH_NAME_INDEX;
 
+    xmlXPathFreeContext(ctxt);
     xmlFreeDoc(doc);
-    return 0;
+    return err;
 }
 
-#define MHE "meta http-equiv=\"Content-Type\""
-
-#ifdef LIBXML_OUTPUT_ENABLED
 static int
-testHtmlInsertMetaEncoding(void) {
-    /* We currently require a head element to be present. */
-    const char *html =
-        "<html>"
-        "<head></head>"
-        "<body>text</body>"
-        "</html>\n";
-    const char *expect =
-        "<html>"
-        "<head><meta charset=\"utf-8\"></head>"
-        "<body>text</body>"
-        "</html>\n";
-    htmlDocPtr doc;
-    xmlBufferPtr buf;
-    xmlSaveCtxtPtr save;
-    xmlChar *out;
-    int size, err = 0;
+checkXPathAttrIndex(xmlXPathContextPtr ctxt) {
+    static const char *const exprs[] = {
+        "//b[@id='k1']",
+        "//*[@id='k2']",
+        "//b[@ref=$v]",
+        "//*[$v=@ref]",
+        "//b[@n=$num]",
+        "//b[@x:id='k1']",
+        "//x:b[@id='k1']",
+        "//x:*[@id='k3']",
+        "//b[@id='k1'][2]",
+        "//b[@id='k1'][3]",
+        "/doc/a/b[@id='k1']",
+        "b[@id='k1']",
+        "descendant-or-self::*[@id='k1']",
+        "//b[@id='']",
+        "//b[@id='missing']",
+        "//a[@id='k1']/b[@id='k1']",
+        "//b[@ref=$num]",
+        "//b[@y:id='k1']"
+    };
+    xmlNodePtr node = ctxt->node;
+    int err = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+        xmlXPathObjectPtr expected, res;
+        int code, j;
+
+        ctxt->flags &= ~XML_XPATH_ATTR_INDEX;
+        ctxt->node = node;
+        xmlResetError(&ctxt->lastError);
+        expected = xmlXPathEval(BAD_CAST exprs[i], ctxt);
+        code = ctxt->lastError.code;
+        ctxt->flags |= XML_XPATH_ATTR_INDEX;
+        ctxt->node = node;
+        xmlResetError(&ctxt->lastError);
+        res = xmlXPathEval(BAD_CAST exprs[i], ctxt);
+
+        if ((expected == NULL) || (res == NULL)) {
+            if ((expected != NULL) || (res != NULL) ||
+                (ctxt->lastError.code != code)) {
+                fprintf(stderr, "attr index: wrong error for %s\n",
+                        exprs[i]);
+                err = 1;
+            }
+        } else if ((expected->nodesetval == NULL) ||
+                   (res->nodesetval == NULL) ||
+                   (expected->nodesetval->nodeNr !=
+                    res->nodesetval->nodeNr)) {
+            fprintf(stderr, "attr index: wrong result for %s\n", exprs[i]);
+            err = 1;
+        } else {
+            for (j = 0; j < res->nodesetval->nodeNr; j++) {
+                if (res->nodesetval->nodeTab[j] !=
+                    expected->nodesetval->nodeTab[j]) {
+                    fprintf(stderr, "attr index: wrong node for %s\n",
+                            exprs[i]);
+                    err = 1;
+                    break;
+                }
+            }
+        }
 
+        xmlXPathFreeObject(expected);
+        xmlXPathFreeObject(res);
+    }
 
-    doc = htmlReadDoc(BAD_CAST html, NULL, NULL, HTML_PARSE_NODEFDTD);
+    ctxt->flags &= ~XML_XPATH_ATTR_INDEX;
+    ctxt->node = node;
+    return err;
+}
 
-    /* xmlSave updates meta tags */
-    buf = xmlBufferCreate();
-    save = xmlSaveToBuffer(buf, "utf-8", 0);
-    xmlSaveDoc(save, doc);
-    xmlSaveClose(save);
-    if (!xmlStrEqual(xmlBufferContent(buf), BAD_CAST expect)) {
-        fprintf(stderr, "meta tag insertion failed when serializing\n");
-        err = 1;
-    }
-    xmlBufferFree(buf);
+static int
+testXPathAttrIndex(void) {
+    xmlDocPtr doc;
+    xmlNodePtr root, a;
+    xmlXPathContextPtr ctxt;
+    xmlXPathObjectPtr res;
+    int err = 0;
 
-    htmlSetMetaEncoding(doc, BAD_CAST "utf-8");
-    /* htmlDocDumpMemoryFormat doesn't update meta tags */
-    htmlDocDumpMemoryFormat(doc, &out, &size, 0);
-    if (!xmlStrEqual(out, BAD_CAST expect)) {
-        fprintf(stderr, "htmlSetMetaEncoding insertion failed\n");
+    doc = xmlReadDoc(BAD_CAST
+        "<doc xmlns:x='urn:x'>"
+        "<a id='k1'><b id='k1' ref='r'/><x:b id='k1' x:id='k1'/>"
+        "<c><b id='k1' n='1.0'/></c><b id='k2' ref='s'/></a>"
+        "<a><a><b id='k1' ref='r' n='1'/></a><b id=''/></a>"
+        "<x:c id='k3'/><b id='k&#x31;' ref='&#x72;'/>"
+        "</doc>",
+        NULL, NULL, 0);
+    root = xmlDocGetRootElement(doc);
+    a = root->children;
+
+    ctxt = xmlXPathNewContext(doc);
+    xmlXPathRegisterNs(ctxt, BAD_CAST "x", BAD_CAST "urn:x");
+    xmlXPathRegisterVariable(ctxt, BAD_CAST "v",
+                             xmlXPathNewString(BAD_CAST "r"));
+    xmlXPathRegisterVariable(ctxt, BAD_CAST "num", xmlXPathNewFloat(1.0));
+    xmlXPathSetErrorHandler(ctxt, ignoreError, NULL);
+
+    /* Undefined prefixes are reported when evaluating the predicate */
+    ctxt->flags |= XML_XPATH_ATTR_INDEX;
+    xmlXPathSetContextNode((xmlNodePtr) doc, ctxt);
+    xmlResetError(&ctxt->lastError);
+    res = xmlXPathEval(BAD_CAST "//b[@y:id='k1']", ctxt);
+    if ((res != NULL) ||
+        (ctxt->lastError.code != XML_XPATH_UNDEF_PREFIX_ERROR)) {
+        fprintf(stderr, "attr index: undefined prefix not reported\n");
         err = 1;
     }
-    xmlFree(out);
-
+    xmlXPathFreeObject(res);
+    ctxt->flags &= ~XML_XPATH_ATTR_INDEX;
+
+    xmlXPathSetContextNode((xmlNodePtr) doc, ctxt);
+    err |= checkXPathAttrIndex(ctxt);
+    xmlXPathSetContextNode(a, ctxt);
+    err |= checkXPathAttrIndex(ctxt);
+
+    /* The index must be rebuilt after the tree changed */
+    xmlSetProp(a->children, BAD_CAST "id", BAD_CAST "k2");
+    xmlNodeSetContent((xmlNodePtr) xmlHasProp(a->children->next->next,
+                                               BAD_CAST "id"),
+                      BAD_CAST "k1");
+    xmlAddChild(a, xmlNewDocNode(doc, NULL, BAD_CAST "b", NULL));
+    xmlSetProp(a->last, BAD_CAST "id", BAD_CAST "k1");
+    xmlXPathSetContextNode((xmlNodePtr) doc, ctxt);
+    err |= checkXPathAttrIndex(ctxt);
+    xmlXPathSetContextNode(a, ctxt);
+    err |= checkXPathAttrIndex(ctxt);
+
+    xmlXPathFreeContext(ctxt);
     xmlFreeDoc(doc);
     return err;
 }
 
 static int
-testHtmlUpdateMetaEncoding(void) {
-    /* We rely on the implementation adjusting all meta tags */
-    const char *html =
-        "<html>\n"
-        "    <head>\n"
-        "        <meta charset=\"utf-8\">\n"
-        "        <meta charset=\"  foo  \">\n"
-        "        <meta charset=\"\">\n"
-        "        <" MHE " content=\"text/html; ChArSeT=foo\">\n"
-        "        <" MHE " content=\"text/html; charset = \">\n"
-        "        <" MHE " content=\"text/html; charset = '  foo  '\">\n"
-        "        <" MHE " content=\"text/html; charset = '  foo  \">\n"
-        "        <" MHE " content='text/html; charset = \"  foo  \"'>\n"
-        "        <" MHE " content='text/html; charset = \"  foo  '>\n"
-        "        <" MHE " content=\"charset ; charset = bar; baz\">\n"
-        "        <" MHE " content=\"text/html\">\n"
-        "        <" MHE " content=\"\">\n"
-        "        <" MHE ">\n"
-        "    </head>\n"
-        "    <body></body>\n"
-        "</html>\n";
-    const char *expect =
-        "<html>\n"
-        "    <head>\n"
-        "        <meta charset=\"utf-8\">\n"
-        "        <meta charset=\"  utf-8  \">\n"
-        "        <meta charset=\"utf-8\">\n"
-        "        <" MHE " content=\"text/html; ChArSeT=utf-8\">\n"
-        "        <" MHE " content=\"text/html; charset = \">\n"
-        "        <" MHE " content=\"text/html; charset = '  utf-8  '\">\n"
-        "        <" MHE " content=\"text/html; charset = '  foo  \">\n"
-        "        <" MHE " content=\"text/html; charset = &quot;  utf-8  &quot;\">\n"
-        "        <" MHE " content=\"text/html; charset = &quot;  foo  \">\n"
-        "        <" MHE " content=\"charset ; charset = utf-8; baz\">\n"
-        "        <" MHE " content=\"text/html\">\n"
-        "        <" MHE " content=\"\">\n"
-        "        <" MHE ">\n"
-        "    </head>\n"
-        "    <body></body>\n"
-        "</html>\n";
-    htmlDocPtr doc;
-    xmlBufferPtr buf;
-    xmlSaveCtxtPtr save;
-    xmlChar *out;
-    int size, err = 0;
+checkXPathMulti(xmlXPathContextPtr ctxt, int expected) {
+    static const char *const exprs[] = {
+        "//b",
+        "/doc/a/b",
+        "//a//b",
+        "//x:b | //c",
+        "//*",
+        "//x:*",
+        "//@id",
+        "//b/@*",
+        "//@x:id",
+        "//text()",
+        "//comment() | //processing-instruction('pi')",
+        "//node()",
+        "/descendant-or-self::node()",
+        "//a/self::a",
+        "//*//*//b",
+        "b",
+        "c/b",
+        ".//b",
+        "self::node()",
+        "descendant-or-self::node()",
+        "//b[1]",
+        "count(//b)",
+        "//b/..",
+        "//b[@id]",
+        "//missing"
+    };
+    xmlXPathCompExprPtr comps[sizeof(exprs) / sizeof(exprs[0])];
+    xmlXPathObjectPtr results[sizeof(exprs) / sizeof(exprs[0])];
+    int nb = sizeof(exprs) / sizeof(exprs[0]);
+    int err = 0;
+    int i, j, ret;
 
-    doc = htmlReadDoc(BAD_CAST html, NULL, NULL, HTML_PARSE_NODEFDTD);
+    for (i = 0; i < nb; i++)
+        comps[i] = xmlXPathCtxtCompile(ctxt, BAD_CAST exprs[i]);
 
-    /* xmlSave updates meta tags */
-    buf = xmlBufferCreate();
-    save = xmlSaveToBuffer(buf, NULL, 0);
-    xmlSaveDoc(save, doc);
-    xmlSaveClose(save);
-    if (!xmlStrEqual(xmlBufferContent(buf), BAD_CAST expect)) {
-        fprintf(stderr, "meta tag update failed when serializing\n");
+    ret = xmlXPathCompiledEvalMany(comps, nb, ctxt, results);
+    if (ret != expected) {
+        fprintf(stderr, "xmlXPathCompiledEvalMany: got %d, expected %d\n",
+                ret, expected);
         err = 1;
     }
-    xmlBufferFree(buf);
 
-    xmlFree((xmlChar *) doc->encoding);
-    doc->encoding = NULL;
-    htmlSetMetaEncoding(doc, BAD_CAST "utf-8");
-    /* htmlDocDumpMemoryFormat doesn't update meta tags */
-    htmlDocDumpMemoryFormat(doc, &out, &size, 0);
-    if (!xmlStrEqual(out, BAD_CAST expect)) {
-        fprintf(stderr, "htmlSetMetaEncoding update failed\n");
-        err = 1;
+    for (i = 0; i < nb; i++) {
+        xmlXPathObjectPtr ref = xmlXPathCompiledEval(comps[i], ctxt);
+
+        if ((ref == NULL) || (results[i] == NULL)) {
+            if ((ref != NULL) || (results[i] != NULL)) {
+                fprintf(stderr, "multi: wrong error for %s\n", exprs[i]);
+                err = 1;
+            }
+        } else if (ref->type != results[i]->type) {
+            fprintf(stderr, "multi: wrong type for %s\n", exprs[i]);
+            err = 1;
+        } else if (ref->type == XPATH_NODESET) {
+            xmlNodeSetPtr set = results[i]->nodesetval;
+
+            if ((xmlXPathNodeSetGetLength(ref->nodesetval) !=
+                 xmlXPathNodeSetGetLength(set))) {
+                fprintf(stderr, "multi: wrong result for %s\n", exprs[i]);
+                err = 1;
+            } else {
+                for (j = 0; j < xmlXPathNodeSetGetLength(set); j++) {
+                    if (ref->nodesetval->nodeTab[j] != set->nodeTab[j]) {
+                        fprintf(stderr, "multi: wrong node for %s\n",
+                                exprs[i]);
+                        err = 1;
+                        break;
+                    }
+                }
+            }
+        } else if (xmlXPathCastToNumber(ref) !=
+                   xmlXPathCastToNumber(results[i])) {
+            fprintf(stderr, "multi: wrong value for %s\n", exprs[i]);
+            err = 1;
+        }
+
+        xmlXPathFreeObject(ref);
+        xmlXPathFreeObject(results[i]);
+        xmlXPathFreeCompExpr(comps[i]);
     }
-    xmlFree(out);
 
-    xmlFreeDoc(doc);
     return err;
 }
-#endif /* LIBXML_OUTPUT_ENABLED */
 
-#ifdef LIBXML_PUSH_ENABLED
 static int
-testHtmlPushWithEncoding(void) {
-    htmlParserCtxtPtr ctxt;
-    htmlDocPtr doc;
-    htmlNodePtr node;
+testXPathMulti(void) {
+    xmlDocPtr doc;
+    xmlNodePtr root;
+    xmlXPathContextPtr ctxt;
     int err = 0;
 
-    ctxt = htmlCreatePushParserCtxt(NULL, NULL, NULL, 0, NULL,
-                                    XML_CHAR_ENCODING_UTF8);
-    htmlParseChunk(ctxt, "-\xC3\xA4-", 4, 1);
+    doc = xmlReadDoc(BAD_CAST
+        "<?pi top?>"
+        "<doc xmlns:x='urn:x'>"
+        "<a id='1'><b x:id='2'>t<![CDATA[c]]></b><x:b/><c><b id='3'/></c>"
+        "<!--c--><?pi x?></a>"
+        "<a><a><b>u</b></a><b/></a>"
+        "<c><b/></c>"
+        "</doc>",
+        NULL, NULL, 0);
+    root = xmlDocGetRootElement(doc);
 
-    doc = ctxt->myDoc;
-    if (!xmlStrEqual(doc->encoding, BAD_CAST "UTF-8")) {
-        fprintf(stderr, "testHtmlPushWithEncoding failed\n");
-        err = 1;
-    }
+    ctxt = xmlXPathNewContext(doc);
+    xmlXPathRegisterNs(ctxt, BAD_CAST "x", BAD_CAST "urn:x");
 
-    node = xmlDocGetRootElement(doc)->children->children;
-    if (!xmlStrEqual(node->content, BAD_CAST "-\xC3\xA4-")) {
-        fprintf(stderr, "testHtmlPushWithEncoding failed\n");
-        err = 1;
-    }
+    xmlXPathSetContextNode((xmlNodePtr) doc, ctxt);
+    err |= checkXPathMulti(ctxt, 21);
+    xmlXPathSetContextNode(root->children, ctxt);
+    err |= checkXPathMulti(ctxt, 21);
 
+    /* Relative paths can't be evaluated in the shared walk */
+    xmlXPathSetContextNode((xmlNodePtr) root->children->properties, ctxt);
+    err |= checkXPathMulti(ctxt, 16);
+    xmlXPathSetContextNode(xmlNewDocNode(doc, NULL, BAD_CAST "b", NULL),
+                           ctxt);
+    err |= checkXPathMulti(ctxt, 16);
+    xmlFreeNode(ctxt->node);
+
+    xmlXPathFreeContext(ctxt);
     xmlFreeDoc(doc);
-    htmlFreeParserCtxt(ctxt);
+
+    /* Paths with many descendant steps in a deep document */
+    {
+        xmlXPathCompExprPtr comp;
+        xmlXPathObjectPtr res = NULL;
+        xmlNodePtr cur;
+        int i;
+
+        doc = xmlNewDoc(BAD_CAST "1.0");
+        cur = xmlNewDocNode(doc, NULL, BAD_CAST "z", NULL);
+        xmlDocSetRootElement(doc, cur);
+        for (i = 0; i < 200; i++)
+            cur = xmlNewChild(cur, NULL, BAD_CAST "x", NULL);
+        xmlNewChild(cur, NULL, BAD_CAST "y", NULL);
+
+        ctxt = xmlXPathNewContext(doc);
+        comp = xmlXPathCtxtCompile(ctxt,
+                BAD_CAST "/z//x//x//x//x//x//x//x//x//y");
+        if ((xmlXPathCompiledEvalMany(&comp, 1, ctxt, &res) != 1) ||
+            (res == NULL) || (res->type != XPATH_NODESET) ||
+            (xmlXPathNodeSetGetLength(res->nodesetval) != 1)) {
+            fprintf(stderr, "multi: wrong result for deep document\n");
+            err = 1;
+        }
+        xmlXPathFreeObject(res);
+        xmlXPathFreeCompExpr(comp);
+        xmlXPathFreeContext(ctxt);
+        xmlFreeDoc(doc);
+    }
+
     return err;
 }
-#endif
-#endif
 
-#ifdef LIBXML_READER_ENABLED
 static int
-testReaderEncoding(void) {
-    xmlBuffer *buf;
-    xmlTextReader *reader;
-    xmlChar *xml;
-    const xmlChar *encoding;
+checkXPathSpecialize(xmlXPathContextPtr ctxt, int expected) {
+    static const char *const exprs[] = {
+        "//b",
+        "/doc/a/b",
+        "//a//b",
+        "//a/b[1]",
+        "//b[2]",
+        "//a/b[@id='k1']",
+        "//b[@id!='k1']",
+        "//b[@n > 1]",
+        "//b[@n <= 5]",
+        "//b['3' > @n]",
+        "//b[@n <= 1.5]",
+        "//b[@n >= 7]",
+        "//b['7' <= @n]",
+        "//b[@n = 7]",
+        "//b[@n != 1.5]",
+        "//b[@n = '7']",
+        "//*[@x:id='k1']",
+        "//x:b",
+        "//b[not(@id)]",
+        "//b[@id and @n]",
+        "//b[@id or text()]",
+        "//a[b/@id='k1']",
+        "//a[.//b = 'u']",
+        "//b[. = 'tc']",
+        "//b[contains(., 'c')]",
+        "//b[starts-with(@id, 'k')]",
+        "//b[boolean(../@n > 6)]",
+        "//b/ancestor::a",
+        "//b/..",
+        "//b/parent::*/@n",
+        "//b/following-sibling::*",
+        "//b/preceding-sibling::b",
+        "//a/descendant::b[1]",
+        "//b[@id='k1'][1]",
+        "//b[1][@id='k1']",
+        "//b[@n > 0][2]",
+        "//text()",
+        "//comment()",
+        "//processing-instruction('pi')",
+        "//node()[self::b]",
+        "//@*",
+        "//b[true()]",
+        "//b[false() or @n < 0]",
+        "count(//b)",
+        "count(//a//b)",
+        "count(//b/..)",
+        "string(//b/@id)",
+        "string(//b)",
+        "string(//missing)",
+        "string(//b/ancestor::*)",
+        "boolean(//b[@id='k2'])",
+        "not(//missing)",
+        "//b[@id='k1'] = 'u'",
+        "b",
+        "c/b",
+        ".//b",
+        "@n > 3",
+        "self::a[@n=5]",
+        "..",
+        /* not supported */
+        "count(//b) > 2",
+        "//b[position() = 1]",
+        "//b[last()]",
+        "//b[@n > $num]",
+        "//b | //c",
+        "(//b)[1]",
+        "//b[@n = ../@n]",
+        "//b[0.5]",
+        "1 + 2"
+    };
+    int nb = sizeof(exprs) / sizeof(exprs[0]);
+    xmlNodePtr node = ctxt->node;
+    int specialized = 0;
     int err = 0;
-    int i;
+    int i, j;
 
-    buf = xmlBufferCreate();
-    xmlBufferCCat(buf, "<?xml version='1.0' encoding='ISO-8859-1'?>\n");
-    xmlBufferCCat(buf, "<doc>");
-    for (i = 0; i < 8192; i++)
-        xmlBufferCCat(buf, "x");
-    xmlBufferCCat(buf, "</doc>");
-    xml = xmlBufferDetach(buf);
-    xmlBufferFree(buf);
+    for (i = 0; i < nb; i++) {
+        xmlXPathCompExprPtr comp, spec;
+        xmlXPathObjectPtr ref, res;
+        xmlChar *refStr, *resStr;
+        int ret;
+
+        comp = xmlXPathCtxtCompile(ctxt, BAD_CAST exprs[i]);
+        spec = xmlXPathCtxtCompile(ctxt, BAD_CAST exprs[i]);
+        ret = xmlXPathCompiledSpecialize(spec);
+        if (ret < 0) {
+            fprintf(stderr, "xmlXPathCompiledSpecialize failed for %s\n",
+                    exprs[i]);
+            err = 1;
+        }
+        specialized += ret;
+
+        ctxt->node = node;
+        ref = xmlXPathCompiledEval(comp, ctxt);
+        ctxt->node = node;
+        res = xmlXPathCompiledEval(spec, ctxt);
+        if (ctxt->node != node) {
+            fprintf(stderr, "specialize: context node changed by %s\n",
+                    exprs[i]);
+            err = 1;
+        }
 
-    reader = xmlReaderForDoc(BAD_CAST xml, NULL, NULL, 0);
-    xmlTextReaderRead(reader);
-    encoding = xmlTextReaderConstEncoding(reader);
+        if ((ref == NULL) || (res == NULL)) {
+            if ((ref != NULL) || (res != NULL)) {
+                fprintf(stderr, "specialize: wrong error for %s\n",
+                        exprs[i]);
+                err = 1;
+            }
+        } else if (ref->type != res->type) {
+            fprintf(stderr, "specialize: wrong type for %s\n", exprs[i]);
+            err = 1;
+        } else if (ref->type == XPATH_NODESET) {
+            /* Casting to a string would sort the node-sets */
+            xmlNodeSetPtr set = res->nodesetval;
+
+            if (xmlXPathNodeSetGetLength(ref->nodesetval) !=
+                xmlXPathNodeSetGetLength(set)) {
+                fprintf(stderr, "specialize: wrong result for %s\n",
+                        exprs[i]);
+                err = 1;
+            } else {
+                for (j = 0; j < xmlXPathNodeSetGetLength(set); j++) {
+                    if (ref->nodesetval->nodeTab[j] != set->nodeTab[j]) {
+                        fprintf(stderr, "specialize: wrong node for %s\n",
+                                exprs[i]);
+                        err = 1;
+                        break;
+                    }
+                }
+            }
+        } else {
+            refStr = xmlXPathCastToString(ref);
+            resStr = xmlXPathCastToString(res);
+            if (!xmlStrEqual(refStr, resStr)) {
+                fprintf(stderr, "specialize: %s: got '%s', expected '%s'\n",
+                        exprs[i], resStr, refStr);
+                err = 1;
+            }
+            xmlFree(refStr);
+            xmlFree(resStr);
+        }
 
-    if (!xmlStrEqual(encoding, BAD_CAST "ISO-8859-1")) {
-        fprintf(stderr, "testReaderEncoding failed\n");
+        ctxt->node = node;
+        ret = xmlXPathCompiledEvalToBoolean(spec, ctxt);
+        if ((ref != NULL) && (ret != xmlXPathCastToBoolean(ref))) {
+            fprintf(stderr, "specialize: wrong boolean for %s\n", exprs[i]);
+            err = 1;
+        }
+
+        xmlXPathFreeObject(ref);
+        xmlXPathFreeObject(res);
+        xmlXPathFreeCompExpr(comp);
+        xmlXPathFreeCompExpr(spec);
+    }
+
+    if (specialized != expected) {
+        fprintf(stderr, "xmlXPathCompiledSpecialize: specialized %d, "
+                "expected %d\n", specialized, expected);
         err = 1;
     }
 
-    xmlFreeTextReader(reader);
-    xmlFree(xml);
+    ctxt->node = node;
     return err;
 }
 
-#ifdef LIBXML_OUTPUT_ENABLED
 static int
-testReaderContent(void) {
-    xmlTextReader *reader;
-    const xmlChar *xml = BAD_CAST "<d>x<e>y</e><f>z</f></d>";
-    xmlChar *string;
+testXPathSpecialize(void) {
+    static const char xml[] =
+        "<doc xmlns:x='urn:x'>"
+        "<a id='1' n='5'><b id='k1' n='1.5'>t<![CDATA[c]]></b>"
+        "<x:b x:id='k1'/><c><b id='k2' n='NaN'/>text</c>"
+        "<!--c--><?pi x?></a>"
+        "<a n='10'><a><b id='k1' n='-2'>u</b></a><b n=' 7 '/>"
+        "<b n='Infinity'/></a>"
+        "<c><b id=''/><b>1e3</b></c>"
+        "</doc>";
+    int lazy, err = 0;
+
+    for (lazy = 0; lazy <= 1; lazy++) {
+        xmlParserCtxtPtr pctxt;
+        xmlDocPtr doc;
+        xmlNodePtr root;
+        xmlXPathContextPtr ctxt;
+
+        pctxt = xmlNewParserCtxt();
+        xmlCtxtSetLazyTree(pctxt, lazy);
+        doc = xmlCtxtReadMemory(pctxt, xml, sizeof(xml) - 1, NULL, NULL, 0);
+        xmlFreeParserCtxt(pctxt);
+        root = xmlDocGetRootElement(doc);
+
+        ctxt = xmlXPathNewContext(doc);
+        xmlXPathRegisterNs(ctxt, BAD_CAST "x", BAD_CAST "urn:x");
+        xmlXPathRegisterVariable(ctxt, BAD_CAST "num",
+                                 xmlXPathNewFloat(1.0));
+
+        xmlXPathSetContextNode((xmlNodePtr) doc, ctxt);
+        err |= checkXPathSpecialize(ctxt, 59);
+        xmlXPathSetContextNode(root->children, ctxt);
+        err |= checkXPathSpecialize(ctxt, 59);
+        xmlXPathSetContextNode(root->children->next->children, ctxt);
+        err |= checkXPathSpecialize(ctxt, 59);
+        xmlXPathSetContextNode((xmlNodePtr) root->children->properties,
+                               ctxt);
+        err |= checkXPathSpecialize(ctxt, 59);
+
+        /* The interpreter reports undefined prefixes */
+        xmlXPathRegisteredNsCleanup(ctxt);
+        xmlXPathSetErrorHandler(ctxt, ignoreError, NULL);
+        xmlXPathSetContextNode((xmlNodePtr) doc, ctxt);
+        err |= checkXPathSpecialize(ctxt, 59);
+
+        xmlXPathFreeContext(ctxt);
+        xmlFreeDoc(doc);
+    }
+
+    return err;
+}
+
+/*
+ * Compare rewritten expressions with equivalent expressions that
+ * can't be rewritten. Predicates and operands with variables aren't
+ * folded, reordered or pruned, and steps after a union don't know
+ * the order of their context nodes.
+ */
+static int
+checkXPathRewrite(xmlXPathContextPtr ctxt) {
+    static const char *const exprs[] = {
+        "//a//b", "(//a | /..)//b",
+        "//a//b[@n > 1]", "(//a | /..)//b[@n > 1]",
+        "//a//b[1]", "(//a | /..)//b[1]",
+        "//a/descendant::b[1]", "(//a | /..)/descendant::b[1]",
+        "//a/descendant::b[last()]", "(//a | /..)/descendant::b[last()]",
+        "//a/descendant-or-self::b", "(//a | /..)/descendant-or-self::b",
+        "//a//@n", "(//a | /..)//@n",
+        "//a//text()", "(//a | /..)//text()",
+        "//c//b//node()", "((//c | /..)//b | /..)//node()",
+        "//b/@n/descendant-or-self::node()",
+        "(//b/@n | /..)/descendant-or-self::node()",
+        "//node()[self::b]", "//b",
+        "//*[self::node()][1]", "//*[1]",
+        "//*[self::*][@n]", "//*[@n]",
+        "//node()[self::x:*]", "//x:*",
+        "//x:*[self::b]", "//x:*[$t][self::b]",
+        "//b[self::x:*]", "//b[$t][self::x:*]",
+        "//a/self::node()", "//a",
+        "//a/self::node()/self::node()", "//a[$t]",
+        "//*[@n]/self::b", "//b[@n]",
+        "//*[1]/self::b", "//*[1][self::b]",
+        "//b[contains(., 'c') and @n > 1]",
+        "//b[contains(., $c) and @n > $one]",
+        "//b[.//c and @id and @n]", "//b[.//c and @id and @n][$t]",
+        "//b[count(.//c) and @n]", "//b[count(.//c) and @n and $t]",
+        "//b[name() = 'b'][@n > 1]", "//b[name() = 'b'][@n > $one]",
+        "//b[contains(., 'c')][@n > 1]", "//b[contains(., $c)][@n > $one]",
+        "//b[contains(., 'c')][1][@n > 1]",
+        "//b[contains(., $c)][1][@n > $one]",
+        "//b[position() < 3 and contains(., 'c')][@n > 1]",
+        "//b[position() < 3 and contains(., $c)][@n > $one]",
+        "//b[1 + 1]", "//b[$one + 1]",
+        "//b[false() or @n]", "//b[$f or @n]",
+        "//b[true()]", "//b[$t]",
+        "1 + 2 * 3", "$one + 2 * 3",
+        "-2 - -1", "-2 - -$one",
+        "10 mod 4 div 2", "10 mod 4 div ($one + $one)",
+        "concat('a', 'b', string(1 div 0))",
+        "concat('a', 'b', string($one div 0))",
+        "substring('abcd', 2) = 'bcd'", "substring('abcd', $one + 1) = 'bcd'",
+        "not(true()) or starts-with('ab', 'a')",
+        "not($t) or starts-with('ab', 'a')",
+        "false() and $undefined", "$f",
+        "true() or $undefined", "$t",
+        "string(false())", "string($f)",
+        "number('x') = number('x')", "number('x') = $one"
+    };
+    int nb = sizeof(exprs) / sizeof(exprs[0]);
+    xmlNodePtr node = ctxt->node;
     int err = 0;
+    int i, j;
 
-    reader = xmlReaderForDoc(xml, NULL, NULL, 0);
-    xmlTextReaderRead(reader);
+    for (i = 0; i < nb; i += 2) {
+        xmlXPathObjectPtr res, ref;
+        xmlChar *resStr, *refStr;
 
-    string = xmlTextReaderReadOuterXml(reader);
-    if (!xmlStrEqual(string, xml)) {
-        fprintf(stderr, "xmlTextReaderReadOuterXml failed\n");
-        err = 1;
+        ctxt->node = node;
+        res = xmlXPathEval(BAD_CAST exprs[i], ctxt);
+        ctxt->node = node;
+        ref = xmlXPathEval(BAD_CAST exprs[i + 1], ctxt);
+
+        if ((res == NULL) || (ref == NULL)) {
+            fprintf(stderr, "rewrite: evaluation failed for %s\n", exprs[i]);
+            err = 1;
+        } else if (res->type == XPATH_NODESET) {
+            /* Compare the nodes in the order they were returned */
+            xmlNodeSetPtr set = res->nodesetval;
+
+            if ((ref->type != XPATH_NODESET) ||
+                (xmlXPathNodeSetGetLength(ref->nodesetval) !=
+                 xmlXPathNodeSetGetLength(set))) {
+                fprintf(stderr, "rewrite: wrong result for %s\n", exprs[i]);
+                err = 1;
+            } else {
+                for (j = 0; j < xmlXPathNodeSetGetLength(set); j++) {
+                    if (ref->nodesetval->nodeTab[j] != set->nodeTab[j]) {
+                        fprintf(stderr, "rewrite: wrong node for %s\n",
+                                exprs[i]);
+                        err = 1;
+                        break;
+                    }
+                }
+            }
+        } else {
+            resStr = xmlXPathCastToString(res);
+            refStr = xmlXPathCastToString(ref);
+            if ((res->type != ref->type) || (!xmlStrEqual(resStr, refStr))) {
+                fprintf(stderr, "rewrite: %s: got '%s', expected '%s'\n",
+                        exprs[i], resStr, refStr);
+                err = 1;
+            }
+            xmlFree(resStr);
+            xmlFree(refStr);
+        }
+
+        xmlXPathFreeObject(res);
+        xmlXPathFreeObject(ref);
     }
-    xmlFree(string);
 
-    string = xmlTextReaderReadInnerXml(reader);
-    if (!xmlStrEqual(string, BAD_CAST "x<e>y</e><f>z</f>")) {
-        fprintf(stderr, "xmlTextReaderReadInnerXml failed\n");
-        err = 1;
+    ctxt->node = node;
+    return err;
+}
+
+#ifdef LIBXML_DEBUG_ENABLED
+/*
+ * Check that the plan dump contains a string.
+ */
+static int
+checkXPathPlan(const char *expr, const char *expected) {
+    xmlXPathCompExprPtr comp;
+    FILE *out;
+    char buf[4096];
+    size_t len;
+    int err = 0;
+
+    comp = xmlXPathCompile(BAD_CAST expr);
+    out = tmpfile();
+    if ((comp == NULL) || (out == NULL)) {
+        fprintf(stderr, "rewrite: can't dump plan of %s\n", expr);
+        xmlXPathFreeCompExpr(comp);
+        if (out != NULL)
+            fclose(out);
+        return 1;
     }
-    xmlFree(string);
 
-    string = xmlTextReaderReadString(reader);
-    if (!xmlStrEqual(string, BAD_CAST "xyz")) {
-        fprintf(stderr, "xmlTextReaderReadString failed\n");
+    xmlXPathDebugDumpCompExprPlan(out, comp, 0);
+    rewind(out);
+    len = fread(buf, 1, sizeof(buf) - 1, out);
+    buf[len] = 0;
+    if (strstr(buf, expected) == NULL) {
+        fprintf(stderr, "rewrite: plan of %s lacks '%s':\n%s",
+                expr, expected, buf);
         err = 1;
     }
-    xmlFree(string);
 
-    xmlFreeTextReader(reader);
+    fclose(out);
+    xmlXPathFreeCompExpr(comp);
     return err;
 }
-#endif /* LIBXML_OUTPUT_ENABLED */
+#endif
 
 static int
-testReaderNode(xmlTextReader *reader) {
-    xmlChar *string;
-    int type;
-    int err = 0;
-
-    type = xmlTextReaderNodeType(reader);
-    string = xmlTextReaderReadString(reader);
-
-    if (type == XML_READER_TYPE_ELEMENT) {
-        xmlNodePtr node = xmlTextReaderCurrentNode(reader);
+testXPathRewrite(void) {
+    static const char xml[] =
+        "<doc xmlns:x='urn:x'>"
+        "<a n='1'><b n='2'>c<c><b n='3'>x</b></c></b>"
+        "<a n='4'><b>cc</b><x:b n='5'/><a><b n='6' id='i'><c/>c</b></a></a>"
+        "text</a>"
+        "<c><b n='0'><b n='7'>c</b></b><b>c</b><b n='9'>c</b><b n='10'/></c>"
+        "<a><b>1</b></a><b n='8'/>"
+        "</doc>";
+    static const char *const errExprs[] = {
+        "//c[count(1) and @zz]",
+        "//c[sum('a') and @zz]",
+        "//c[name(1) and @zz]",
+        "//c[count(1) = 0 and @zz]",
+        "//c[count(1) = 0][@zz]",
+        "//c[string(1 | 2)][@zz]",
+        "//c[substring('a') and @zz]"
+    };
+    int lazy, i, err = 0;
+
+    for (lazy = 0; lazy <= 1; lazy++) {
+        xmlParserCtxtPtr pctxt;
+        xmlDocPtr doc;
+        xmlNodePtr root;
+        xmlXPathContextPtr ctxt;
+
+        pctxt = xmlNewParserCtxt();
+        xmlCtxtSetLazyTree(pctxt, lazy);
+        doc = xmlCtxtReadMemory(pctxt, xml, sizeof(xml) - 1, NULL, NULL, 0);
+        xmlFreeParserCtxt(pctxt);
+        root = xmlDocGetRootElement(doc);
+
+        ctxt = xmlXPathNewContext(doc);
+        xmlXPathRegisterNs(ctxt, BAD_CAST "x", BAD_CAST "urn:x");
+        xmlXPathRegisterVariable(ctxt, BAD_CAST "t", xmlXPathNewBoolean(1));
+        xmlXPathRegisterVariable(ctxt, BAD_CAST "f", xmlXPathNewBoolean(0));
+        xmlXPathRegisterVariable(ctxt, BAD_CAST "one",
+                                 xmlXPathNewFloat(1.0));
+        xmlXPathRegisterVariable(ctxt, BAD_CAST "c",
+                                 xmlXPathNewString(BAD_CAST "c"));
+
+        xmlXPathSetContextNode((xmlNodePtr) doc, ctxt);
+        err |= checkXPathRewrite(ctxt);
+        xmlXPathSetContextNode(root->children->children, ctxt);
+        err |= checkXPathRewrite(ctxt);
+
+        /* Cheaper operands must not hide errors */
+        xmlXPathSetErrorHandler(ctxt, ignoreError, NULL);
+        xmlXPathSetContextNode((xmlNodePtr) doc, ctxt);
+        for (i = 0; i < (int) (sizeof(errExprs) / sizeof(errExprs[0]));
+             i++) {
+            xmlXPathObjectPtr res = xmlXPathEval(BAD_CAST errExprs[i], ctxt);
+
+            if (res != NULL) {
+                fprintf(stderr, "rewrite: no error for %s\n", errExprs[i]);
+                xmlXPathFreeObject(res);
+                err = 1;
+            }
+        }
 
-        if ((node->children == NULL) != (string == NULL))
-            err = 1;
-    } else if (type == XML_READER_TYPE_TEXT ||
-               type == XML_READER_TYPE_CDATA ||
-               type == XML_READER_TYPE_WHITESPACE ||
-               type == XML_READER_TYPE_SIGNIFICANT_WHITESPACE) {
-        if (string == NULL)
-            err = 1;
-    } else {
-        if (string != NULL)
-            err = 1;
+        xmlXPathFreeContext(ctxt);
+        xmlFreeDoc(doc);
     }
 
-    if (err)
-        fprintf(stderr, "xmlTextReaderReadString failed for %d\n", type);
-
-    xmlFree(string);
+#ifdef LIBXML_DEBUG_ENABLED
+    err |= checkXPathPlan("//a//b", "outermost context nodes");
+    err |= checkXPathPlan("//a[b][@n]",
+                          "PREDICATE [cost 4]\n"
+                          "          COLLECT  'attributes'");
+    err |= checkXPathPlan("//node()[self::b]",
+                          "COLLECT  'descendant' 'name' 'node' b");
+    err |= checkXPathPlan("1 + 2 * 3", "Object is a number : 7");
+#endif
 
     return err;
 }
 
+/*
+ * Compare the result of early-terminating evaluation with the same
+ * expression where the path is wrapped in a union, which always builds
+ * the full node-set.
+ */
 static int
-testReader(void) {
-    xmlTextReader *reader;
-    const xmlChar *xml = BAD_CAST
-        "<d>\n"
-        "  x<e a='v'>y</e><f>z</f>\n"
-        "  <![CDATA[cdata]]>\n"
-        "  <!-- comment -->\n"
-        "  <?pi content?>\n"
-        "  <empty/>\n"
-        "</d>";
+checkXPathLazy(xmlXPathContextPtr ctxt, const char *func, const char *path) {
+    xmlXPathObjectPtr lazy, full;
+    xmlChar *lazyStr, *fullStr;
+    char wrapped[100];
+    char expr[200];
     int err = 0;
 
-    reader = xmlReaderForDoc(xml, NULL, NULL, 0);
+    snprintf(expr, sizeof(expr), func, path);
+    lazy = xmlXPathEval(BAD_CAST expr, ctxt);
+    snprintf(wrapped, sizeof(wrapped), "(%s | /..)", path);
+    snprintf(expr, sizeof(expr), func, wrapped);
+    full = xmlXPathEval(BAD_CAST expr, ctxt);
 
-    while (xmlTextReaderRead(reader) > 0) {
-        if (testReaderNode(reader) > 0) {
+    if ((lazy == NULL) || (full == NULL)) {
+        if ((lazy != NULL) || (full != NULL)) {
+            fprintf(stderr, "XPath lazy: error mismatch for %s\n", expr);
             err = 1;
-            break;
         }
+        xmlXPathFreeObject(lazy);
+        xmlXPathFreeObject(full);
+        return err;
+    }
 
-        if (xmlTextReaderMoveToFirstAttribute(reader) > 0) {
-            do {
-                if (testReaderNode(reader) > 0) {
-                    err = 1;
-                    break;
-                }
-            } while (xmlTextReaderMoveToNextAttribute(reader) > 0);
+    lazyStr = xmlXPathCastToString(lazy);
+    fullStr = xmlXPathCastToString(full);
+    if ((lazy->type != full->type) || (!xmlStrEqual(lazyStr, fullStr))) {
+        fprintf(stderr, "XPath lazy: %s: got '%s', expected '%s'\n",
+                expr, lazyStr, fullStr);
+        err = 1;
+    }
+    if ((lazy->type == XPATH_NODESET) &&
+        (xmlXPathNodeSetGetLength(lazy->nodesetval) !=
+         xmlXPathNodeSetGetLength(full->nodesetval))) {
+        fprintf(stderr, "XPath lazy: %s: node count mismatch\n", expr);
+        err = 1;
+    }
 
-            xmlTextReaderMoveToElement(reader);
+    xmlFree(lazyStr);
+    xmlFree(fullStr);
+    xmlXPathFreeObject(lazy);
+    xmlXPathFreeObject(full);
+    return err;
+}
+
+static int
+testXPathLazy(void) {
+    static const char *const funcs[] = {
+        "boolean(%s)", "not(%s)", "count(%s)", "string(%s)", "number(%s)",
+        "name(%s)", "concat(%s, '-')", "(%s)[1]", "/doc/a[%s]"
+    };
+    static const char *const paths[] = {
+        "//b", "/doc/a/b", "//a/b", "//a//b", "//x:b", "//*", "//@id",
+        "//b/text()", "//b[2]", "//b[@id][1]", "//b[. = '3']",
+        "//a[b][2]/b", "//b[position() = 2]", "//b[last()]",
+        "descendant::b[3]", "b", "../b", "ancestor::*", "ancestor::*[1]",
+        "preceding-sibling::*", "following::b", "following-sibling::b[2]",
+        "//a/ancestor-or-self::*", "//comment()", "//z", "//b[9]",
+        "//b[count(../b) > 1]", "//a[not(c)]/b"
+    };
+    xmlDocPtr doc;
+    xmlNodePtr root;
+    xmlXPathContextPtr ctxt;
+    size_t i, j;
+    int err = 0;
+
+    doc = xmlReadDoc(BAD_CAST
+        "<doc xmlns:x='urn:x'>"
+        "<a><b id='i1'>1</b><x:b/><c><b>2</b></c><!--c--></a>"
+        "<a><a><b id='i2'>3</b></a><b>4</b></a>"
+        "<b>5</b>"
+        "</doc>",
+        NULL, NULL, 0);
+    root = xmlDocGetRootElement(doc);
+
+    ctxt = xmlXPathNewContext(doc);
+    xmlXPathRegisterNs(ctxt, BAD_CAST "x", BAD_CAST "urn:x");
+
+    for (i = 0; i < sizeof(funcs) / sizeof(funcs[0]); i++) {
+        for (j = 0; j < sizeof(paths) / sizeof(paths[0]); j++) {
+            xmlXPathSetContextNode((xmlNodePtr) doc, ctxt);
+            err |= checkXPathLazy(ctxt, funcs[i], paths[j]);
+            xmlXPathSetContextNode(root->children->next, ctxt);
+            err |= checkXPathLazy(ctxt, funcs[i], paths[j]);
+            xmlXPathSetContextNode(root->children->children->next, ctxt);
+            err |= checkXPathLazy(ctxt, funcs[i], paths[j]);
         }
     }
 
-    xmlFreeTextReader(reader);
+    xmlXPathFreeContext(ctxt);
+    xmlFreeDoc(doc);
     return err;
 }
+#endif /* LIBXML_XPATH_ENABLED */
 
-#ifdef LIBXML_XINCLUDE_ENABLED
+#ifdef LIBXML_SCHEMAS_ENABLED
 typedef struct {
-    char *message;
-    int code;
-} testReaderErrorCtxt;
+    int codes[64];
+    int lines[64];
+    int nb;
+} schemaErrors;
 
 static void
-testReaderError(void *arg, const char *msg,
-                xmlParserSeverities severity ATTRIBUTE_UNUSED,
-                xmlTextReaderLocatorPtr locator ATTRIBUTE_UNUSED) {
-    testReaderErrorCtxt *ctxt = arg;
+schemaErrorHandler(void *data, const xmlError *error) {
+    schemaErrors *errors = data;
 
-    if (ctxt->message != NULL)
-        xmlFree(ctxt->message);
-    ctxt->message = xmlMemStrdup(msg);
+    if (errors->nb < 64) {
+        errors->codes[errors->nb] = error->code;
+        errors->lines[errors->nb] = error->line;
+    }
+    errors->nb++;
 }
 
-static void
-testStructuredReaderError(void *arg, const xmlError *error) {
-    testReaderErrorCtxt *ctxt = arg;
+static int
+validateWithOptions(xmlSchemaPtr schema, xmlDocPtr doc, int options,
+                    schemaErrors *errors) {
+    xmlSchemaValidCtxtPtr vctxt;
+    int ret;
 
-    if (ctxt->message != NULL)
-        xmlFree(ctxt->message);
-    ctxt->message = xmlMemStrdup(error->message);
-    ctxt->code = error->code;
+    memset(errors, 0, sizeof(*errors));
+    vctxt = xmlSchemaNewValidCtxt(schema);
+    xmlSchemaSetValidStructuredErrors(vctxt, schemaErrorHandler, errors);
+    xmlSchemaSetValidOptions(vctxt, options);
+    ret = xmlSchemaValidateDoc(vctxt, doc);
+    xmlSchemaFreeValidCtxt(vctxt);
+
+    return ret;
 }
 
 static int
-testReaderXIncludeError(void) {
-    /*
-     * Test whether XInclude errors are reported to the custom error
-     * handler of a reader.
-     */
-    const char *doc =
-        "<doc xmlns:xi='http://www.w3.org/2001/XInclude'>\n"
-        "  <xi:include/>\n"
-        "</doc>\n";
-    xmlTextReader *reader;
-    testReaderErrorCtxt errorCtxt;
-    int err = 0;
+testSchemaParallel(void) {
+    static const char schemaStr[] =
+        "<xs:schema xmlns:xs='http://www.w3.org/2001/XMLSchema'>"
+        "<xs:element name='doc'><xs:complexType><xs:sequence>"
+        "<xs:element name='rec' maxOccurs='unbounded'>"
+        "<xs:complexType><xs:sequence>"
+        "<xs:element name='v' type='xs:int' maxOccurs='2'/>"
+        "</xs:sequence>"
+        "<xs:attribute name='id' type='xs:ID'/>"
+        "</xs:complexType></xs:element>"
+        "<xs:element name='end' minOccurs='0'/>"
+        "</xs:sequence></xs:complexType></xs:element>"
+        "</xs:schema>";
+    xmlSchemaParserCtxtPtr pctxt;
+    xmlSchemaPtr schema;
+    xmlBufferPtr buf;
+    xmlDocPtr doc1, doc2;
+    schemaErrors serial, parallel;
+    int i, j, ret1, ret2, err = 0;
+
+    pctxt = xmlSchemaNewMemParserCtxt(schemaStr, sizeof(schemaStr) - 1);
+    schema = xmlSchemaParse(pctxt);
+    xmlSchemaFreeParserCtxt(pctxt);
+    if (schema == NULL) {
+        fprintf(stderr, "schema parallel: failed to parse schema\n");
+        return 1;
+    }
 
-    reader = xmlReaderForDoc(BAD_CAST doc, NULL, NULL, XML_PARSE_XINCLUDE);
-    xmlTextReaderSetErrorHandler(reader, testReaderError, &errorCtxt);
-    errorCtxt.message = NULL;
-    errorCtxt.code = 0;
-    while (xmlTextReaderRead(reader) > 0)
-        ;
+    /* Make sure that several workers report errors */
+    setThreadCount(4);
 
-    if (errorCtxt.message == NULL ||
-        strstr(errorCtxt.message, "href or xpointer") == NULL) {
-        fprintf(stderr, "xmlTextReaderSetErrorHandler failed\n");
-        err = 1;
+    for (j = 0; j < 2; j++) {
+        buf = xmlBufferCreate();
+        xmlBufferCat(buf, BAD_CAST "<doc>\n");
+        for (i = 0; i < 500; i++) {
+            char rec[100];
+
+            if (i % 97 == 13)
+                snprintf(rec, sizeof(rec), "<rec id='r%d'><v>x</v></rec>\n", i);
+            else if (i % 89 == 7)
+                snprintf(rec, sizeof(rec),
+                         "<rec id='r%d'><v>1</v><v>2</v><v>3</v></rec>\n", i);
+            else
+                snprintf(rec, sizeof(rec), "<rec id='r%d'><v>%d</v></rec>\n",
+                         i, i);
+            xmlBufferCat(buf, BAD_CAST rec);
+        }
+        /* The second document has invalid content in the root */
+        if (j == 1)
+            xmlBufferCat(buf, BAD_CAST "<end/><rec/>\n");
+        xmlBufferCat(buf, BAD_CAST "</doc>\n");
+
+        doc1 = xmlReadMemory((const char *) xmlBufferContent(buf),
+                             xmlBufferLength(buf), NULL, NULL, 0);
+        doc2 = xmlReadMemory((const char *) xmlBufferContent(buf),
+                             xmlBufferLength(buf), NULL, NULL, 0);
+        ret1 = validateWithOptions(schema, doc1, 0, &serial);
+        ret2 = validateWithOptions(schema, doc2, XML_SCHEMA_VAL_PARALLEL,
+                                   &parallel);
+
+        if ((ret1 <= 0) || (ret1 != ret2) || (serial.nb != parallel.nb) ||
+            (serial.nb > 64) ||
+            (memcmp(serial.codes, parallel.codes,
+                    sizeof(serial.codes)) != 0) ||
+            (memcmp(serial.lines, parallel.lines,
+                    sizeof(serial.lines)) != 0)) {
+            fprintf(stderr, "schema parallel: results differ (%d, %d)\n",
+                    ret1, ret2);
+            err = 1;
+        }
+        if (parallel.nb < 12) {
+            fprintf(stderr, "schema parallel: missing errors\n");
+            err = 1;
+        }
+        for (i = 1; (i < parallel.nb) && (i < 64); i++) {
+            if (parallel.lines[i] < parallel.lines[i-1]) {
+                fprintf(stderr, "schema parallel: errors out of order\n");
+                err = 1;
+                break;
+            }
+        }
+        if (xmlGetID(doc2, BAD_CAST "r123") == NULL) {
+            fprintf(stderr, "schema parallel: ID not registered\n");
+            err = 1;
+        }
+
+        xmlFreeDoc(doc1);
+        xmlFreeDoc(doc2);
+        xmlBufferFree(buf);
     }
 
-    xmlFree(errorCtxt.message);
-    xmlFreeTextReader(reader);
+    setThreadCount(0);
+    xmlSchemaFree(schema);
+    return err;
+}
 
-    reader = xmlReaderForDoc(BAD_CAST doc, NULL, NULL, XML_PARSE_XINCLUDE);
-    xmlTextReaderSetStructuredErrorHandler(reader, testStructuredReaderError,
-                                           &errorCtxt);
-    errorCtxt.message = NULL;
-    errorCtxt.code = 0;
-    while (xmlTextReaderRead(reader) > 0)
-        ;
+static int
+testSchemaIDCTables(void) {
+    static const char schemaStr[] =
+        "<xs:schema xmlns:xs='http://www.w3.org/2001/XMLSchema'>"
+        "<xs:element name='doc'><xs:complexType><xs:sequence>"
+        "<xs:element name='sec' maxOccurs='unbounded'>"
+        "<xs:complexType><xs:sequence>"
+        "<xs:element name='item' maxOccurs='unbounded'><xs:complexType>"
+        "<xs:attribute name='id' type='xs:int'/>"
+        "</xs:complexType></xs:element>"
+        "</xs:sequence></xs:complexType>"
+        "<xs:key name='k'><xs:selector xpath='item'/>"
+        "<xs:field xpath='@id'/></xs:key>"
+        "</xs:element>"
+        "<xs:element name='ref' maxOccurs='unbounded'><xs:complexType>"
+        "<xs:attribute name='to' type='xs:int'/>"
+        "</xs:complexType></xs:element>"
+        "</xs:sequence></xs:complexType>"
+        "<xs:keyref name='r' refer='k'><xs:selector xpath='ref'/>"
+        "<xs:field xpath='@to'/></xs:keyref>"
+        "</xs:element>"
+        "</xs:schema>";
+    xmlSchemaParserCtxtPtr pctxt;
+    xmlSchemaPtr schema;
+    xmlBufferPtr buf;
+    xmlDocPtr doc;
+    schemaErrors errors;
+    char str[100];
+    int i, j, ret, err = 0;
+
+    pctxt = xmlSchemaNewMemParserCtxt(schemaStr, sizeof(schemaStr) - 1);
+    schema = xmlSchemaParse(pctxt);
+    xmlSchemaFreeParserCtxt(pctxt);
+    if (schema == NULL) {
+        fprintf(stderr, "schema IDC tables: failed to parse schema\n");
+        return 1;
+    }
 
-    if (errorCtxt.code != XML_XINCLUDE_NO_HREF ||
-        errorCtxt.message == NULL ||
-        strstr(errorCtxt.message, "href or xpointer") == NULL) {
-        fprintf(stderr, "xmlTextReaderSetStructuredErrorHandler failed\n");
+    /*
+     * Keys of many sections are merged into the table of the root.
+     * Key 0 appears in two sections, key 1000000 doesn't exist.
+     */
+    buf = xmlBufferCreate();
+    xmlBufferCat(buf, BAD_CAST "<doc>\n");
+    for (i = 0; i < 300; i++) {
+        xmlBufferCat(buf, BAD_CAST "<sec>");
+        for (j = 0; j < 10; j++) {
+            snprintf(str, sizeof(str), "<item id='%d'/>", i * 10 + j);
+            xmlBufferCat(buf, BAD_CAST str);
+        }
+        xmlBufferCat(buf, BAD_CAST "</sec>\n");
+    }
+    xmlBufferCat(buf, BAD_CAST "<sec><item id='00'/></sec>\n");
+    for (i = 2999; i > 0; i -= 7) {
+        snprintf(str, sizeof(str), "<ref to='%d'/>\n", i);
+        xmlBufferCat(buf, BAD_CAST str);
+    }
+    xmlBufferCat(buf, BAD_CAST "<ref to='0'/>\n<ref to='1000000'/>\n");
+    xmlBufferCat(buf, BAD_CAST "</doc>\n");
+
+    doc = xmlReadMemory((const char *) xmlBufferContent(buf),
+                        xmlBufferLength(buf), NULL, NULL, 0);
+    ret = validateWithOptions(schema, doc, 0, &errors);
+    if ((ret != XML_SCHEMAV_CVC_IDC) || (errors.nb != 2) ||
+        (errors.lines[0] != 732) || (errors.lines[1] != 733)) {
+        fprintf(stderr, "schema IDC tables: unexpected result %d (%d)\n",
+                ret, errors.nb);
         err = 1;
     }
 
-    xmlFree(errorCtxt.message);
-    xmlFreeTextReader(reader);
-
+    xmlFreeDoc(doc);
+    xmlBufferFree(buf);
+    xmlSchemaFree(schema);
     return err;
 }
-#endif
-#endif
+#endif /* LIBXML_SCHEMAS_ENABLED */
 
-#ifdef LIBXML_WRITER_ENABLED
+#if defined(LIBXML_C14N_ENABLED) && defined(LIBXML_XPATH_ENABLED)
 static int
-testWriterIOWrite(void *ctxt, const char *data, int len) {
-    (void) ctxt;
-    (void) data;
+testC14NNodeSet(void) {
+    static const char *const exprs[] = {
+        "//*[local-name() != 'c'] | //*[local-name() != 'c']/namespace::* | "
+        "//@* | //text() | //comment()",
+        "//*[local-name() = 'b' or local-name() = 'e'] | "
+        "//*[local-name() = 'e']/namespace::*"
+    };
+    static const char *const expected[][3] = {
+        {
+            "<a xmlns=\"urn:d\" xmlns:p=\"urn:p\">"
+            "<p:b xmlns:q=\"urn:q\" q:x=\"1\">t</p:b>"
+            "<d xmlns:p=\"urn:p2\"><p:e></p:e></d></a>",
+            "<a xmlns=\"urn:d\" xmlns:p=\"urn:p\">"
+            "<p:b xmlns:q=\"urn:q\" q:x=\"1\">t<!--k--></p:b>"
+            "<d xmlns:p=\"urn:p2\"><p:e></p:e></d></a>",
+            "<a xmlns=\"urn:d\">"
+            "<p:b xmlns:p=\"urn:p\" xmlns:q=\"urn:q\" q:x=\"1\">t</p:b>"
+            "<d><p:e xmlns:p=\"urn:p2\"></p:e></d></a>"
+        }, {
+            "<p:b></p:b>"
+            "<p:e xmlns=\"urn:d\" xmlns:p=\"urn:p2\"></p:e>",
+            "<p:b></p:b>"
+            "<p:e xmlns=\"urn:d\" xmlns:p=\"urn:p2\"></p:e>",
+            "<p:b></p:b>"
+            "<p:e xmlns:p=\"urn:p2\"></p:e>"
+        }
+    };
+    xmlDocPtr doc;
+    xmlXPathContextPtr ctxt;
+    size_t i;
+    int err = 0;
 
-    return len;
-}
+    doc = xmlReadDoc(BAD_CAST
+        "<a xmlns='urn:d' xmlns:p='urn:p'>"
+        "<p:b xmlns:q='urn:q' q:x='1'><c xmlns=''>t</c><!--k--></p:b>"
+        "<d xmlns:p='urn:p2'><p:e/></d>"
+        "</a>",
+        NULL, NULL, 0);
+    ctxt = xmlXPathNewContext(doc);
+
+    for (i = 0; i < sizeof(exprs) / sizeof(exprs[0]); i++) {
+        xmlXPathObjectPtr obj;
+        int mode;
+
+        obj = xmlXPathEval(BAD_CAST exprs[i], ctxt);
+
+        for (mode = 0; mode < 3; mode++) {
+            xmlChar *out = NULL;
+            int withComments = (mode == 1);
+            int c14nMode = (mode == 2) ? XML_C14N_EXCLUSIVE_1_0 : XML_C14N_1_0;
+
+            xmlC14NDocDumpMemory(doc, obj->nodesetval, c14nMode, NULL,
+                                 withComments, &out);
+            if ((out == NULL) ||
+                (strcmp((char *) out, expected[i][mode]) != 0)) {
+                fprintf(stderr, "c14n node set %d/%d: got %s\n",
+                        (int) i, mode, out ? (char *) out : "(null)");
+                err = 1;
+            }
+            xmlFree(out);
+        }
 
-static int
-testWriterIOClose(void *ctxt) {
-    (void) ctxt;
+        xmlXPathFreeObject(obj);
+    }
 
-    return XML_IO_ENAMETOOLONG;
+    xmlXPathFreeContext(ctxt);
+    xmlFreeDoc(doc);
+    return err;
 }
+#endif /* LIBXML_C14N_ENABLED && LIBXML_XPATH_ENABLED */
 
+#if defined(LIBXML_C14N_ENABLED) && defined(LIBXML_READER_ENABLED)
 static int
-testWriterClose(void){
-    xmlOutputBufferPtr out;
-    xmlTextWriterPtr writer;
+testC14NReader(void) {
+    static const char xml[] =
+        "<?xml version='1.0'?>\n"
+        "<?pi before?>\n"
+        "<!DOCTYPE a [<!ATTLIST c d CDATA 'dflt'><!ENTITY e 'ent'>]>\n"
+        "<a xmlns='urn:d' xmlns:p='urn:p' xmlns:u='urn:u'>\n"
+        "  <p:b xmlns:q='urn:q' q:x='1' z=\"&lt;\t&quot;\"><c xmlns=''/>"
+        "<![CDATA[a<b]]>&e;\r</p:b>"
+        "<!--k--><c xmlns:p='urn:p'>y</c>"
+        "</a>\n"
+        "<!--after-->";
+    static xmlChar *prefixes[] = { BAD_CAST "u", NULL };
+    int mode, comments;
     int err = 0;
-    int result;
 
-    out = xmlOutputBufferCreateIO(testWriterIOWrite, testWriterIOClose,
-                                  NULL, NULL);
-    writer = xmlNewTextWriter(out);
-    xmlTextWriterStartDocument(writer, "1.0", "UTF-8", NULL);
-    xmlTextWriterStartElement(writer, BAD_CAST "elem");
-    xmlTextWriterEndElement(writer);
-    xmlTextWriterEndDocument(writer);
-    result = xmlTextWriterClose(writer);
+    for (mode = XML_C14N_1_0; mode <= XML_C14N_1_1; mode++) {
+        for (comments = 0; comments <= 1; comments++) {
+            xmlTextReaderPtr reader;
+            xmlDocPtr doc;
+            xmlChar *expected = NULL;
+            xmlBufferPtr buffer;
+            xmlOutputBufferPtr out;
+            int ret;
+
+            /* The tree-based output is the reference */
+            doc = xmlReadMemory(xml, sizeof(xml) - 1, NULL, NULL,
+                                XML_PARSE_DTDATTR | XML_PARSE_NOENT);
+            xmlC14NDocDumpMemory(doc, NULL, mode, prefixes, comments,
+                                 &expected);
+            xmlFreeDoc(doc);
+
+            reader = xmlReaderForMemory(xml, sizeof(xml) - 1, NULL, NULL,
+                                        XML_PARSE_DTDATTR | XML_PARSE_NOENT);
+            buffer = xmlBufferCreate();
+            out = xmlOutputBufferCreateBuffer(buffer, NULL);
+            ret = xmlC14NReaderSaveTo(reader, mode, prefixes, comments, out);
+            xmlOutputBufferClose(out);
+
+            if ((ret < 0) || (expected == NULL) ||
+                (strcmp((char *) xmlBufferContent(buffer),
+                        (char *) expected) != 0)) {
+                fprintf(stderr, "c14n reader %d/%d: got %s\n",
+                        mode, comments, (char *) xmlBufferContent(buffer));
+                err = 1;
+            }
 
-    if (result != XML_IO_ENAMETOOLONG) {
-        fprintf(stderr, "xmlTextWriterClose reported wrong error %d\n",
-                result);
-        err = 1;
+            xmlBufferFree(buffer);
+            xmlFreeTextReader(reader);
+            xmlFree(expected);
+        }
     }
 
-    xmlFreeTextWriter(writer);
     return err;
 }
-#endif
+#endif /* LIBXML_C14N_ENABLED && LIBXML_READER_ENABLED */
 
 typedef struct {
     const char *uri;
@@ -1460,6 +4762,55 @@ rot13ConvImpl(void *vctxt ATTRIBUTE_UNUSED, const char *name,
                                       out);
 }
 
+#ifdef LIBXML_OUTPUT_ENABLED
+/*
+ * Round-trip text with long ASCII runs through the built-in converters
+ * which have block-wise fast paths.
+ */
+static int
+testBuiltinConvRoundTrip(void) {
+    const char *encodings[] = { "UTF-16LE", "UTF-16BE", "ISO-8859-1" };
+    const char *text =
+        "0123456789abcdefghijklmnopqrstuvwxyz0123456789\xC3\xA9"
+        "abcdefghijklmnopqrstuvwxyz\xC3\xBF" "0123456789abcdefghijklmnopq"
+        "0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopq"
+        "\xC3\xA0";
+    int err = 0;
+    size_t i;
+
+    for (i = 0; i < sizeof(encodings) / sizeof(encodings[0]); i++) {
+        xmlCharEncodingHandler *handler;
+        xmlBuffer *in, *encoded, *out;
+
+        if (xmlOpenCharEncodingHandler(encodings[i], /* output */ 1,
+                                       &handler) != XML_ERR_OK) {
+            fprintf(stderr, "Failed to open %s handler\n", encodings[i]);
+            err = 1;
+            continue;
+        }
+
+        in = xmlBufferCreate();
+        encoded = xmlBufferCreate();
+        out = xmlBufferCreate();
+        xmlBufferCCat(in, text);
+
+        if ((xmlCharEncOutFunc(handler, encoded, in) < 0) ||
+            (xmlCharEncInFunc(handler, out, encoded) < 0) ||
+            (strcmp((char *) xmlBufferContent(out), text) != 0)) {
+            fprintf(stderr, "Round trip through %s failed\n", encodings[i]);
+            err = 1;
+        }
+
+        xmlBufferFree(in);
+        xmlBufferFree(encoded);
+        xmlBufferFree(out);
+        xmlCharEncCloseFunc(handler);
+    }
+
+    return err;
+}
+#endif /* LIBXML_OUTPUT_ENABLED */
+
 static int
 testCharEncConvImpl(void) {
     xmlParserCtxtPtr ctxt;
@@ -1496,9 +4847,29 @@ main(void) {
     err |= testUnsupportedEncoding();
     err |= testNodeGetContent();
     err |= testCFileIO();
+#ifdef LIBXML_OUTPUT_ENABLED
+    err |= testMappedFile();
+#endif
     err |= testUndeclEntInContent();
     err |= testInvalidCharRecovery();
+    err |= testLongAsciiRuns();
+    err |= testUtf8TextChunks();
     err |= testCtxtInputGetters();
+    err |= testArena();
+    err |= testFrozenDict();
+#if defined(LIBXML_OUTPUT_ENABLED) && defined(LIBXML_XPATH_ENABLED)
+    err |= testLazyTree();
+    err |= testLazyTreePsvi();
+    err |= testLazyTreeIndex();
+#endif
+#if defined(LIBXML_OUTPUT_ENABLED) && defined(LIBXML_XPATH_ENABLED) && \
+    defined(LIBXML_PATTERN_ENABLED)
+    err |= testCompactDoc();
+#endif
+#ifdef LIBXML_OUTPUT_ENABLED
+    err |= testBinarySnapshot();
+    err |= testBinarySnapshotLazy();
+#endif
 #ifdef LIBXML_VALID_ENABLED
     err |= testSwitchDtd();
 #endif
@@ -1507,6 +4878,10 @@ main(void) {
     err |= testNoBlanks();
     err |= testSaveNullEnc();
     err |= testDocDumpFormatMemoryEnc();
+    err |= testParseParallel();
+#endif
+#if defined(LIBXML_VALID_ENABLED) && defined(LIBXML_OUTPUT_ENABLED)
+    err |= testDtdCache();
 #endif
 #ifdef LIBXML_SAX1_ENABLED
     err |= testBalancedChunk();
@@ -1515,6 +4890,10 @@ main(void) {
     err |= testHugePush();
     err |= testHugeEncodedChunk();
     err |= testPushCDataEnd();
+#ifdef LIBXML_OUTPUT_ENABLED
+    err |= testPushInPlace();
+    err |= testPushInPlaceCData();
+#endif
 #endif
 #ifdef LIBXML_HTML_ENABLED
     err |= testHtmlIds();
@@ -1538,6 +4917,28 @@ main(void) {
 #endif
 #ifdef LIBXML_WRITER_ENABLED
     err |= testWriterClose();
+#endif
+#ifdef LIBXML_XPATH_ENABLED
+    err |= testXPathLargeUnion();
+    err |= testXPathDocOrder();
+    err |= testXPathAxisUnion();
+    err |= testXPathResultCache();
+    err |= testXPathNameIndex();
+    err |= testXPathLazy();
+    err |= testXPathAttrIndex();
+    err |= testXPathMulti();
+    err |= testXPathSpecialize();
+    err |= testXPathRewrite();
+#endif
+#ifdef LIBXML_SCHEMAS_ENABLED
+    err |= testSchemaParallel();
+    err |= testSchemaIDCTables();
+#endif
+#if defined(LIBXML_C14N_ENABLED) && defined(LIBXML_XPATH_ENABLED)
+    err |= testC14NNodeSet();
+#endif
+#if defined(LIBXML_C14N_ENABLED) && defined(LIBXML_READER_ENABLED)
+    err |= testC14NReader();
 #endif
     err |= testBuildRelativeUri();
 #if defined(_WIN32) || defined(__CYGWIN__)
@@ -1547,6 +4948,9 @@ main(void) {
     err |= testTruncatedMultiByte();
 #endif
     err |= testCharEncConvImpl();
+#ifdef LIBXML_OUTPUT_ENABLED
+    err |= testBuiltinConvRoundTrip();
+#endif
 
     return err;
 }
@@ -12,6 +12,7 @@
 #include <string.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <limits.h>
 
 #include <libxml/threads.h>
 #include <libxml/parser.h>
@@ -29,6 +30,10 @@
 #include <note.h>
 #endif
 
+#ifdef HAVE_POSIX_THREADS
+  #include <unistd.h>
+#endif
+
 #include "private/cata.h"
 #include "private/dict.h"
 #include "private/enc.h"
@@ -37,6 +42,8 @@
 #include "private/io.h"
 #include "private/memory.h"
 #include "private/threads.h"
+#include "private/tree.h"
+#include "private/valid.h"
 #include "private/xpath.h"
 
 /*
@@ -306,6 +313,48 @@ xmlUnlockLibrary(void)
     xmlRMutexUnlock(&xmlLibraryLock);
 }
 
+/**
+ * Get the number of threads for parallel processing. This is the
+ * number of online CPUs unless the environment variable
+ * XML_PARALLEL_THREADS is set to a positive number, which is mainly
+ * useful to test parallel code on machines with a single CPU.
+ *
+ * @returns the number of threads, at least 1.
+ */
+int
+xmlGetThreadCount(void) {
+    const char *env;
+    long ncpu = 1;
+
+    env = getenv("XML_PARALLEL_THREADS");
+    if (env != NULL) {
+        ncpu = strtol(env, NULL, 10);
+        if (ncpu >= 1)
+            return(ncpu > INT_MAX ? INT_MAX : ncpu);
+        ncpu = 1;
+    }
+
+#ifdef HAVE_POSIX_THREADS
+#ifdef _SC_NPROCESSORS_ONLN
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+#elif defined HAVE_WIN32_THREADS
+    {
+        SYSTEM_INFO info;
+
+        GetSystemInfo(&info);
+        ncpu = info.dwNumberOfProcessors;
+    }
+#endif
+
+    if (ncpu < 1)
+        ncpu = 1;
+    if (ncpu > INT_MAX)
+        ncpu = INT_MAX;
+
+    return(ncpu);
+}
+
 /**
  * @deprecated Alias for #xmlInitParser.
  */
@@ -362,6 +411,8 @@ xmlInitParserInternal(void) {
     xmlInitThreadsInternal();
     xmlInitGlobalsInternal();
     xmlInitDictInternal();
+    xmlInitTreeInternal();
+    xmlInitDtdCacheInternal();
     xmlInitEncodingInternal();
 #if defined(LIBXML_XPATH_ENABLED)
     xmlInitXPathInternal();
@@ -450,6 +501,7 @@ xmlCleanupParser(void) {
     if (!xmlParserInitialized)
         return;
 
+    xmlCleanupDtdCacheInternal();
     xmlCleanupCharEncodingHandlers();
 #ifdef LIBXML_CATALOG_ENABLED
     xmlCatalogCleanup();
@@ -469,7 +521,11 @@ xmlCleanupParser(void) {
 #ifdef LIBXML_RELAXNG_ENABLED
     xmlCleanupRelaxNGInternal();
 #endif
+#ifdef LIBXML_XPATH_ENABLED
+    xmlCleanupXPathInternal();
+#endif
 
+    xmlCleanupTreeInternal();
     xmlCleanupDictInternal();
     xmlCleanupRandom();
     xmlCleanupGlobalsInternal();
@@ -45,7 +45,10 @@
 #include "private/memory.h"
 #include "private/io.h"
 #include "private/parser.h"
+#include "private/threads.h"
 #include "private/tree.h"
+#include "private/valid.h"
+#include "private/xpath.h"
 
 #ifndef SIZE_MAX
   #define SIZE_MAX ((size_t) -1)
@@ -491,6 +494,863 @@ xmlValidateNMToken(const xmlChar *value, int space) {
     return(*cur != 0);
 }
 
+/************************************************************************
+ *									*
+ *			Document arenas					*
+ *									*
+ ************************************************************************/
+
+/*
+ * Documents parsed with XML_PARSE_ARENA allocate nodes and text content
+ * from large chunks owned by the document. This memory is never freed
+ * individually but released with the last document referencing the
+ * arena.
+ *
+ * If nodes are moved to another document, the arenas of both documents
+ * are merged, so allocations stay valid as long as one of the documents
+ * is alive. Arenas of nodes moved out of any document are kept in a
+ * global list until the library is cleaned up.
+ *
+ * Once an arena is shared, it can be used concurrently by documents
+ * in different threads, so allocations and lookups take the arena
+ * mutex.
+ */
+
+#define XML_ARENA_MIN_CHUNK (4 * 1024)
+#define XML_ARENA_MAX_CHUNK (1024 * 1024)
+#define XML_ARENA_ALIGN (sizeof(void *) > 8 ? sizeof(void *) : 8)
+
+typedef struct {
+    char *start;
+    char *end;
+} xmlDocArenaChunk;
+
+struct _xmlDocArena {
+    /* number of documents and merged arenas referencing the arena */
+    int ref;
+    /* the arena this one was merged into */
+    xmlDocArena *merged;
+    /* set once the arena was shared, never cleared */
+    int shared;
+    /* chunks sorted by address */
+    xmlDocArenaChunk *chunks;
+    int nbChunks;
+    int maxChunks;
+    /* free space in the current chunk */
+    char *cur;
+    char *end;
+    size_t chunkSize;
+    /*
+     * Open addressing hash table of lazy element records, see
+     * xmlLazyLookup. It belongs to the document which created the
+     * arena and isn't moved when arenas are merged.
+     */
+    xmlLazyElem **lazyTable;
+    size_t lazyNr;
+    size_t lazyMask;
+    int lazyShift;
+};
+
+/*
+ * A mutex for reference counting and merging of arenas shared
+ * by several documents.
+ */
+static xmlMutex xmlArenaMutex;
+
+/**
+ * Initialize mutex.
+ */
+void
+xmlInitTreeInternal(void) {
+    xmlInitMutex(&xmlArenaMutex);
+}
+
+/**
+ * Free the arena mutex.
+ */
+void
+xmlCleanupTreeInternal(void) {
+    xmlCleanupMutex(&xmlArenaMutex);
+}
+
+static xmlDocArena *
+xmlArenaResolve(xmlDocArena *arena) {
+    while (arena->merged != NULL)
+        arena = arena->merged;
+
+    return(arena);
+}
+
+static int
+xmlArenaAddChunk(xmlDocArena *arena, char *start, size_t size) {
+    int i;
+
+    if (arena->nbChunks >= arena->maxChunks) {
+        xmlDocArenaChunk *tmp;
+        int newSize;
+
+        newSize = xmlGrowCapacity(arena->maxChunks, sizeof(tmp[0]),
+                                  8, XML_MAX_ITEMS);
+        if (newSize < 0)
+            return(-1);
+        tmp = xmlRealloc(arena->chunks, newSize * sizeof(tmp[0]));
+        if (tmp == NULL)
+            return(-1);
+        arena->chunks = tmp;
+        arena->maxChunks = newSize;
+    }
+
+    i = arena->nbChunks;
+    while ((i > 0) && (arena->chunks[i-1].start > start)) {
+        arena->chunks[i] = arena->chunks[i-1];
+        i--;
+    }
+    arena->chunks[i].start = start;
+    arena->chunks[i].end = start + size;
+    arena->nbChunks++;
+
+    return(0);
+}
+
+/**
+ * Create an empty arena for a document.
+ *
+ * @param doc  the document
+ * @returns 0 on success, -1 if a memory allocation failed.
+ */
+int
+xmlDocCreateArena(xmlDoc *doc) {
+    xmlDocArena *arena;
+
+    if (doc->arena != NULL)
+        return(0);
+
+    arena = xmlMalloc(sizeof(*arena));
+    if (arena == NULL)
+        return(-1);
+    memset(arena, 0, sizeof(*arena));
+    arena->ref = 1;
+    arena->chunkSize = XML_ARENA_MIN_CHUNK;
+
+    doc->arena = arena;
+    return(0);
+}
+
+static void *
+xmlArenaAlloc(xmlDocArena *arena, size_t size) {
+    char *ret;
+
+    if ((size_t) (arena->end - arena->cur) < size) {
+        size_t chunkSize = arena->chunkSize;
+        char *chunk;
+
+        /* Large blocks get their own chunk */
+        if (size > chunkSize / 4) {
+            chunk = xmlMalloc(size);
+            if (chunk == NULL)
+                return(NULL);
+            if (xmlArenaAddChunk(arena, chunk, size) < 0) {
+                xmlFree(chunk);
+                return(NULL);
+            }
+            return(chunk);
+        }
+
+        chunk = xmlMalloc(chunkSize);
+        if (chunk == NULL)
+            return(NULL);
+        if (xmlArenaAddChunk(arena, chunk, chunkSize) < 0) {
+            xmlFree(chunk);
+            return(NULL);
+        }
+        arena->cur = chunk;
+        arena->end = chunk + chunkSize;
+        if (chunkSize < XML_ARENA_MAX_CHUNK)
+            arena->chunkSize = chunkSize * 2;
+    }
+
+    ret = arena->cur;
+    arena->cur += size;
+
+    return(ret);
+}
+
+/**
+ * Allocate memory from the arena of a document. The memory is
+ * suitably aligned for node structs.
+ *
+ * @param doc  a document with an arena
+ * @param size  number of bytes
+ * @returns a pointer to the memory or NULL if a memory allocation
+ * failed.
+ */
+void *
+xmlDocArenaAlloc(xmlDoc *doc, size_t size) {
+    void *ret;
+
+    if (size > SIZE_MAX - XML_ARENA_ALIGN)
+        return(NULL);
+    size = (size + XML_ARENA_ALIGN - 1) & ~(XML_ARENA_ALIGN - 1);
+
+    if (!doc->arena->shared)
+        return(xmlArenaAlloc(doc->arena, size));
+
+    xmlMutexLock(&xmlArenaMutex);
+    ret = xmlArenaAlloc(xmlArenaResolve(doc->arena), size);
+    xmlMutexUnlock(&xmlArenaMutex);
+
+    return(ret);
+}
+
+/**
+ * Copy a string into the arena of a document.
+ *
+ * @param doc  a document with an arena
+ * @param str  the string
+ * @param len  length of the string in bytes
+ * @returns the copy or NULL if a memory allocation failed.
+ */
+xmlChar *
+xmlDocArenaStrndup(xmlDoc *doc, const xmlChar *str, int len) {
+    xmlChar *ret;
+
+    if ((str == NULL) || (len < 0))
+        return(NULL);
+
+    ret = xmlDocArenaAlloc(doc, (size_t) len + 1);
+    if (ret == NULL)
+        return(NULL);
+    memcpy(ret, str, len);
+    ret[len] = 0;
+
+    return(ret);
+}
+
+static int
+xmlArenaOwns(const xmlDocArena *arena, const char *p) {
+    int lo, hi;
+
+    /* Find the last chunk starting at or before ptr */
+    lo = 0;
+    hi = arena->nbChunks;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (arena->chunks[mid].start <= p)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return((lo > 0) && (p < arena->chunks[lo-1].end));
+}
+
+/**
+ * Check whether memory was allocated from the arena of a document.
+ * Nodes without a document never use an arena, see xmlSetTreeDoc.
+ *
+ * @param doc  the document (optional)
+ * @param ptr  pointer to the memory
+ * @returns 1 if the arena owns the memory, 0 otherwise.
+ */
+int
+xmlDocArenaOwns(const xmlDoc *doc, const void *ptr) {
+    int ret;
+
+    if ((ptr == NULL) || (doc == NULL) || (doc->arena == NULL))
+        return(0);
+
+    if (!doc->arena->shared)
+        return(xmlArenaOwns(doc->arena, ptr));
+
+    xmlMutexLock(&xmlArenaMutex);
+    ret = xmlArenaOwns(xmlArenaResolve(doc->arena), ptr);
+    xmlMutexUnlock(&xmlArenaMutex);
+
+    return(ret);
+}
+
+static void
+xmlArenaRelease(xmlDocArena *arena) {
+    while (arena != NULL) {
+        xmlDocArena *next;
+        int i, ref;
+
+        xmlMutexLock(&xmlArenaMutex);
+        ref = --arena->ref;
+        xmlMutexUnlock(&xmlArenaMutex);
+        if (ref > 0)
+            break;
+
+        next = arena->merged;
+        for (i = 0; i < arena->nbChunks; i++)
+            xmlFree(arena->chunks[i].start);
+        xmlFree(arena->chunks);
+        xmlFree(arena->lazyTable);
+        xmlFree(arena);
+        arena = next;
+    }
+}
+
+/*
+ * Move all chunks from src to dst. Called with the arena mutex held.
+ */
+static int
+xmlArenaMerge(xmlDocArena *dst, xmlDocArena *src) {
+    int i, j, k, nb;
+
+    if (src->nbChunks > XML_MAX_ITEMS - dst->nbChunks)
+        return(-1);
+    nb = dst->nbChunks + src->nbChunks;
+
+    if (nb > dst->maxChunks) {
+        xmlDocArenaChunk *tmp;
+
+        tmp = xmlRealloc(dst->chunks, nb * sizeof(tmp[0]));
+        if (tmp == NULL)
+            return(-1);
+        dst->chunks = tmp;
+        dst->maxChunks = nb;
+    }
+
+    /* Merge sorted chunk arrays from the back */
+    i = dst->nbChunks - 1;
+    j = src->nbChunks - 1;
+    k = nb - 1;
+    while (j >= 0) {
+        if ((i >= 0) && (dst->chunks[i].start > src->chunks[j].start))
+            dst->chunks[k--] = dst->chunks[i--];
+        else
+            dst->chunks[k--] = src->chunks[j--];
+    }
+    dst->nbChunks = nb;
+
+    xmlFree(src->chunks);
+    src->chunks = NULL;
+    src->nbChunks = 0;
+    src->maxChunks = 0;
+    src->cur = NULL;
+    src->end = NULL;
+
+    src->merged = dst;
+    src->shared = 1;
+    dst->shared = 1;
+    dst->ref++;
+
+    return(0);
+}
+
+/*
+ * Make sure that memory allocated from the arena of src stays valid
+ * as long as doc is alive. Called when moving nodes between
+ * documents. Nodes can't be moved out of a document with an arena,
+ * so doc must not be NULL.
+ */
+int
+xmlDocArenaShare(xmlDoc *doc, xmlDoc *src) {
+    xmlDocArena *a, *b;
+    int ret = 0;
+
+    if ((src == NULL) || (src->arena == NULL) || (doc == src))
+        return(0);
+    if (doc == NULL)
+        return(-1);
+
+    xmlMutexLock(&xmlArenaMutex);
+    b = xmlArenaResolve(src->arena);
+    if (doc->arena == NULL) {
+        doc->arena = b;
+        b->shared = 1;
+        b->ref++;
+    } else {
+        a = xmlArenaResolve(doc->arena);
+        /* Move the smaller chunk array */
+        if (a == b)
+            ret = 0;
+        else if (a->nbChunks >= b->nbChunks)
+            ret = xmlArenaMerge(a, b);
+        else
+            ret = xmlArenaMerge(b, a);
+    }
+    xmlMutexUnlock(&xmlArenaMutex);
+
+    return(ret);
+}
+
+/************************************************************************
+ *									*
+ *		Lazy documents						*
+ *									*
+ ************************************************************************/
+
+/*
+ * Fibonacci hashing of an element address.
+ */
+static XML_INLINE size_t
+xmlLazyHash(const xmlDocArena *arena, const xmlNode *elem) {
+    uint64_t h = (uint64_t) XML_PTR_TO_INT(elem);
+
+    return((size_t) ((h * 0x9E3779B97F4A7C15ull) >> arena->lazyShift));
+}
+
+static void
+xmlLazyInsert(xmlDocArena *arena, xmlLazyElem *lazy) {
+    size_t i = xmlLazyHash(arena, lazy->elem);
+
+    while ((arena->lazyTable[i] != NULL) &&
+           (arena->lazyTable[i]->elem != lazy->elem))
+        i = (i + 1) & arena->lazyMask;
+    if (arena->lazyTable[i] == NULL)
+        arena->lazyNr += 1;
+    arena->lazyTable[i] = lazy;
+}
+
+/**
+ * Create the record of deferred attributes and content of an element
+ * in a lazy document.
+ *
+ * @param elem  the element
+ * @returns the record or NULL if a memory allocation failed.
+ */
+xmlLazyElem *
+xmlLazyCreate(xmlNode *elem) {
+    xmlDocArena *arena = elem->doc->arena;
+    xmlLazyElem *lazy;
+
+    /* Keep the load factor at or below 50% */
+    if ((arena->lazyNr + 1) * 2 > arena->lazyMask + 1) {
+        xmlLazyElem **oldTable = arena->lazyTable;
+        size_t oldSize = (oldTable != NULL) ? arena->lazyMask + 1 : 0;
+        size_t size = (oldSize > 0) ? oldSize * 2 : 64;
+        xmlLazyElem **table;
+        size_t i;
+
+        if (size > SIZE_MAX / sizeof(table[0]))
+            return(NULL);
+        table = xmlMalloc(size * sizeof(table[0]));
+        if (table == NULL)
+            return(NULL);
+        memset(table, 0, size * sizeof(table[0]));
+
+        arena->lazyTable = table;
+        arena->lazyMask = size - 1;
+        arena->lazyShift = (oldSize > 0) ? arena->lazyShift - 1 : 58;
+        arena->lazyNr = 0;
+        for (i = 0; i < oldSize; i++) {
+            if (oldTable[i] != NULL)
+                xmlLazyInsert(arena, oldTable[i]);
+        }
+        xmlFree(oldTable);
+    }
+
+    lazy = xmlDocArenaAlloc(elem->doc, sizeof(*lazy));
+    if (lazy == NULL)
+        return(NULL);
+    memset(lazy, 0, sizeof(*lazy));
+    lazy->elem = elem;
+    lazy->flags = XML_LAZY_CONTENT;
+
+    xmlLazyInsert(arena, lazy);
+    elem->extra |= XML_NODE_LAZY;
+
+    return(lazy);
+}
+
+/**
+ * Find the record of deferred attributes and content of an element.
+ *
+ * @param elem  the element
+ * @returns the record or NULL if the element has no pending record.
+ */
+xmlLazyElem *
+xmlLazyLookup(const xmlNode *elem) {
+    const xmlDocArena *arena;
+    size_t i;
+
+    if ((elem->type != XML_ELEMENT_NODE) ||
+        ((elem->extra & XML_NODE_LAZY) == 0) ||
+        (!XML_LAZY_DOC(elem->doc)))
+        return(NULL);
+
+    arena = elem->doc->arena;
+    if (arena->lazyTable == NULL)
+        return(NULL);
+
+    i = xmlLazyHash(arena, elem);
+    while (arena->lazyTable[i] != NULL) {
+        if (arena->lazyTable[i]->elem == elem)
+            return(arena->lazyTable[i]);
+        i = (i + 1) & arena->lazyMask;
+    }
+
+    return(NULL);
+}
+
+/*
+ * Remove the record of an element after it was materialized. Entries
+ * following the removed one are moved back, so lookups don't need
+ * tombstones.
+ */
+static void
+xmlLazyRemove(xmlLazyElem *lazy) {
+    xmlNodePtr elem = lazy->elem;
+    xmlDocArena *arena = elem->doc->arena;
+    size_t i, j;
+
+    elem->extra &= ~XML_NODE_LAZY;
+
+    i = xmlLazyHash(arena, elem);
+    while (arena->lazyTable[i] != lazy) {
+        if (arena->lazyTable[i] == NULL)
+            return;
+        i = (i + 1) & arena->lazyMask;
+    }
+    arena->lazyTable[i] = NULL;
+    arena->lazyNr -= 1;
+
+    j = i;
+    while (1) {
+        size_t k;
+
+        j = (j + 1) & arena->lazyMask;
+        if (arena->lazyTable[j] == NULL)
+            break;
+
+        /* Move the entry unless its home slot lies in (i, j] */
+        k = xmlLazyHash(arena, arena->lazyTable[j]->elem);
+        if ((i < j) ? ((k <= i) || (k > j)) : ((k <= i) && (k > j))) {
+            arena->lazyTable[i] = arena->lazyTable[j];
+            arena->lazyTable[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+static xmlNodePtr
+xmlLazyNewNode(xmlDocPtr doc, xmlElementType type, const xmlChar *name,
+               xmlChar *content, int len) {
+    xmlNodePtr cur;
+
+    cur = xmlDocArenaAlloc(doc, sizeof(xmlNode));
+    if (cur == NULL)
+        return(NULL);
+    memset(cur, 0, sizeof(xmlNode));
+    cur->type = type;
+    cur->doc = doc;
+    cur->name = name;
+
+    /* Store short text in the node like xmlSAX2TextNode */
+    if ((type == XML_TEXT_NODE) &&
+        (len < (int) (2 * sizeof(void *))) &&
+        (doc->parseFlags & XML_PARSE_COMPACT)) {
+        xmlChar *tmp = (xmlChar *) &cur->properties;
+
+        memcpy(tmp, content, len);
+        tmp[len] = 0;
+        cur->content = tmp;
+    } else {
+        cur->content = content;
+    }
+
+    if ((xmlRegisterCallbacks) && (xmlRegisterNodeDefaultValue))
+	xmlRegisterNodeDefaultValue(cur);
+    return(cur);
+}
+
+/*
+ * Create the deferred attributes of an element and insert them
+ * before existing attributes.
+ */
+static int
+xmlLazyMaterializeAttrs(xmlNodePtr elem, xmlLazyElem *lazy) {
+    xmlDocPtr doc = elem->doc;
+    xmlAttrPtr first = NULL, last = NULL, attr;
+    int i;
+
+    for (i = 0; i < lazy->nbAttrs; i++) {
+        xmlLazyAttr *lattr = &lazy->attrs[i];
+
+        attr = xmlDocArenaAlloc(doc, sizeof(xmlAttr));
+        if (attr == NULL)
+            goto error;
+        memset(attr, 0, sizeof(xmlAttr));
+        attr->type = XML_ATTRIBUTE_NODE;
+        attr->name = lattr->name;
+        attr->ns = lattr->ns;
+        attr->parent = elem;
+        attr->doc = doc;
+
+        if ((xmlRegisterCallbacks) && (xmlRegisterNodeDefaultValue))
+            xmlRegisterNodeDefaultValue((xmlNodePtr) attr);
+
+        if (last == NULL) {
+            first = attr;
+        } else {
+            last->next = attr;
+            attr->prev = last;
+        }
+        last = attr;
+
+        if (lattr->parse) {
+            xmlNodePtr list, cur;
+
+            /* Passing the attribute would bump the generation */
+            if (xmlNodeParseAttValue(doc, NULL, lattr->value, lattr->len,
+                                     &list) < 0)
+                goto error;
+            attr->children = list;
+            for (cur = list; cur != NULL; cur = cur->next) {
+                cur->parent = (xmlNodePtr) attr;
+                attr->last = cur;
+            }
+        } else {
+            xmlNodePtr text;
+
+            text = xmlLazyNewNode(doc, XML_TEXT_NODE, xmlStringText,
+                                  lattr->value, lattr->len);
+            if (text == NULL)
+                goto error;
+            text->parent = (xmlNodePtr) attr;
+            attr->children = text;
+            attr->last = text;
+        }
+    }
+
+    if (last != NULL) {
+        last->next = elem->properties;
+        if (elem->properties != NULL)
+            elem->properties->prev = last;
+        elem->properties = first;
+    }
+
+    return(0);
+
+error:
+    xmlFreePropList(first);
+    return(-1);
+}
+
+/*
+ * Create the deferred text, comment and PI children of an element
+ * and insert them between the existing element children.
+ */
+static int
+xmlLazyMaterializeContent(xmlNodePtr elem, xmlLazyElem *lazy) {
+    xmlDocPtr doc = elem->doc;
+    xmlLazyItem *item;
+    xmlNodePtr first = NULL, last = NULL, node, prev, next;
+    int count;
+
+    /*
+     * Create all nodes first, chained through `next`, so the tree
+     * isn't modified if an allocation fails.
+     */
+    for (item = lazy->first; item != NULL; item = item->next) {
+        const xmlChar *name;
+
+        switch (item->type) {
+            case XML_TEXT_NODE:
+                name = xmlStringText;
+                break;
+            case XML_COMMENT_NODE:
+                name = xmlStringComment;
+                break;
+            case XML_PI_NODE:
+                name = item->name;
+                break;
+            default:
+                name = NULL;
+                break;
+        }
+
+        node = xmlLazyNewNode(doc, item->type, name, item->content,
+                              item->len);
+        if (node == NULL) {
+            xmlFreeNodeList(first);
+            return(-1);
+        }
+
+        if ((unsigned) item->line < (unsigned) USHRT_MAX) {
+            node->line = item->line;
+        } else {
+            node->line = USHRT_MAX;
+            if ((item->type == XML_TEXT_NODE) &&
+                (doc->parseFlags & XML_PARSE_BIG_LINES))
+                node->psvi = XML_INT_TO_PTR(item->line);
+        }
+
+        if (last == NULL)
+            first = node;
+        else
+            last->next = node;
+        last = node;
+    }
+
+    /*
+     * Each node follows the element child at its recorded position.
+     */
+    item = lazy->first;
+    prev = NULL;
+    next = elem->children;
+    count = 0;
+    while (first != NULL) {
+        node = first;
+        first = first->next;
+
+        while ((count < item->position) && (next != NULL)) {
+            if (next->type == XML_ELEMENT_NODE)
+                count++;
+            prev = next;
+            next = next->next;
+        }
+
+        node->parent = elem;
+        node->prev = prev;
+        node->next = next;
+        if (prev == NULL)
+            elem->children = node;
+        else
+            prev->next = node;
+        if (next == NULL)
+            elem->last = node;
+        else
+            next->prev = node;
+        prev = node;
+
+        item = item->next;
+    }
+
+    return(0);
+}
+
+static int
+xmlLazyMaterializeElem(xmlNodePtr elem, int flags) {
+    xmlLazyElem *lazy = xmlLazyLookup(elem);
+    int ret = 0;
+
+    if (lazy == NULL)
+        return(0);
+
+    /*
+     * Materializing doesn't change the logical tree, so it doesn't
+     * bump the generation of the document. Otherwise, every read
+     * would invalidate the XPath indexes and cached results. The
+     * XPath indexes only contain nodes which existed when they were
+     * built and fall back to tree walks for new nodes.
+     */
+    if ((flags & XML_LAZY_ATTRS) && (lazy->flags & XML_LAZY_ATTRS)) {
+        if (xmlLazyMaterializeAttrs(elem, lazy) < 0)
+            ret = -1;
+        else
+            lazy->flags &= ~XML_LAZY_ATTRS;
+    }
+
+    if ((flags & XML_LAZY_CONTENT) && (lazy->flags & XML_LAZY_CONTENT)) {
+        if (xmlLazyMaterializeContent(elem, lazy) < 0)
+            ret = -1;
+        else
+            lazy->flags &= ~XML_LAZY_CONTENT;
+    }
+
+    if (lazy->flags == 0)
+        xmlLazyRemove(lazy);
+
+    return(ret);
+}
+
+/**
+ * Materialize deferred attributes or content of an element in a
+ * lazy document. With XML_LAZY_RECURSIVE, all elements in the
+ * subtree of `node` are handled.
+ *
+ * @param node  the node
+ * @param flags  XML_LAZY_ATTRS, XML_LAZY_CONTENT, XML_LAZY_RECURSIVE
+ * @returns 0 on success or -1 if a memory allocation failed.
+ */
+int
+xmlLazyMaterialize(xmlNode *node, int flags) {
+    xmlNodePtr cur;
+    int ret = 0;
+
+    if ((node == NULL) || (!XML_LAZY_DOC(node->doc)))
+        return(0);
+
+    if ((flags & XML_LAZY_RECURSIVE) == 0) {
+        if ((node->type != XML_ELEMENT_NODE) ||
+            ((node->extra & XML_NODE_LAZY) == 0))
+            return(0);
+        return(xmlLazyMaterializeElem(node, flags));
+    }
+
+    switch (node->type) {
+        case XML_ELEMENT_NODE:
+        case XML_DOCUMENT_NODE:
+        case XML_DOCUMENT_FRAG_NODE:
+            break;
+        default:
+            return(0);
+    }
+
+    cur = node;
+    while (1) {
+        if ((cur->type == XML_ELEMENT_NODE) &&
+            (cur->extra & XML_NODE_LAZY)) {
+            if (xmlLazyMaterializeElem(cur, flags) < 0)
+                ret = -1;
+        }
+
+        if ((cur->children != NULL) &&
+            ((cur == node) || (cur->type == XML_ELEMENT_NODE))) {
+            cur = cur->children;
+            continue;
+        }
+
+        if (cur == node)
+            break;
+
+        while (cur->next == NULL) {
+            cur = cur->parent;
+            if (cur == node)
+                return(ret);
+        }
+        cur = cur->next;
+    }
+
+    return(ret);
+}
+
+/**
+ * Materialize the deferred attributes and content of all elements in
+ * the subtree of `node`. This is only needed for documents parsed
+ * with #xmlCtxtSetLazyTree before accessing the `properties`,
+ * `children` or `last` members of element nodes directly. Tree,
+ * XPath and serialization functions materialize nodes as needed.
+ * After materializing a whole document, it can be read from multiple
+ * threads like a regular document.
+ *
+ * @since 2.16.0
+ *
+ * @param node  an element, document or document fragment
+ * @returns 0 on success or -1 if a memory allocation failed.
+ */
+int
+xmlNodeMaterialize(xmlNode *node) {
+    return(xmlLazyMaterialize(node, XML_LAZY_ATTRS | XML_LAZY_CONTENT |
+                                    XML_LAZY_RECURSIVE));
+}
+
+/*
+ * Materialize the siblings of a node in a lazy document before the
+ * sibling list is modified.
+ */
+static void
+xmlLazyMaterializeSiblings(xmlNodePtr node) {
+    if ((XML_LAZY_DOC(node->doc)) &&
+        (node->type != XML_ATTRIBUTE_NODE) &&
+        (node->parent != NULL))
+        xmlLazyMaterialize(node->parent, XML_LAZY_CONTENT);
+}
+
 /************************************************************************
  *									*
  *		Allocation and deallocation of basic structures		*
@@ -561,6 +1421,7 @@ xmlNewNs(xmlNode *node, const xmlChar *href, const xmlChar *prefix) {
 	    }
 	    prev->next = cur;
 	}
+        XML_DOC_TREE_CHANGED(node->doc);
     }
     return(cur);
 
@@ -582,8 +1443,10 @@ xmlSetNs(xmlNode *node, xmlNs *ns) {
 	return;
     }
     if ((node->type == XML_ELEMENT_NODE) ||
-        (node->type == XML_ATTRIBUTE_NODE))
+        (node->type == XML_ATTRIBUTE_NODE)) {
 	node->ns = ns;
+        XML_DOC_TREE_CHANGED(node->doc);
+    }
 }
 
 /**
@@ -811,6 +1674,16 @@ error:
 	    (xmlDictOwns(dict, (const xmlChar *)(str)) == 0)))	\
 	    xmlFree((char *)(str));
 
+/**
+ * Free memory if it wasn't allocated from the arena of document "doc"
+ *
+ * @param doc  the document
+ * @param ptr  the memory
+ */
+#define ARENA_FREE(doc, ptr)					\
+	if (!xmlDocArenaOwns(doc, ptr))				\
+	    xmlFree(ptr);
+
 /**
  * Free a DTD structure.
  *
@@ -923,6 +1796,7 @@ void
 xmlFreeDoc(xmlDoc *cur) {
     xmlDtdPtr extSubset, intSubset;
     xmlDictPtr dict = NULL;
+    xmlDocArena *arena;
 
     if (cur == NULL) {
 	return;
@@ -944,6 +1818,11 @@ xmlFreeDoc(xmlDoc *cur) {
     intSubset = cur->intSubset;
     if (intSubset == extSubset)
 	extSubset = NULL;
+    if ((extSubset != NULL) && (extSubset->doc != cur) &&
+        (xmlDtdCacheRelease(extSubset))) {
+        cur->extSubset = NULL;
+        extSubset = NULL;
+    }
     if (extSubset != NULL) {
 	xmlUnlinkNodeInternal((xmlNodePtr) cur->extSubset);
 	cur->extSubset = NULL;
@@ -966,9 +1845,14 @@ xmlFreeDoc(xmlDoc *cur) {
         xmlFree(cur->encoding);
     if (cur->URL != NULL)
         xmlFree(cur->URL);
+#ifdef LIBXML_XPATH_ENABLED
+    xmlXPathFreeDocData(cur->xpathData);
+#endif
 
+    arena = cur->arena;
     xmlFree(cur);
     if (dict) xmlDictFree(dict);
+    if (arena != NULL) xmlArenaRelease(arena);
 }
 
 /**
@@ -1226,6 +2110,7 @@ done:
             xmlFreeNodeList(attr->children);
         attr->children = head;
         attr->last = last;
+        XML_DOC_TREE_CHANGED(attr->doc);
     }
 
     if (listPtr != NULL)
@@ -1444,6 +2329,9 @@ xmlNewPropInternal(xmlNodePtr node, xmlNsPtr ns,
         return (NULL);
     }
 
+    if ((node != NULL) && (XML_LAZY_DOC(node->doc)))
+        xmlLazyMaterialize(node, XML_LAZY_ATTRS);
+
     /*
      * Allocate a new property and fill the fields.
      */
@@ -1505,6 +2393,7 @@ xmlNewPropInternal(xmlNodePtr node, xmlNsPtr ns,
      * Add it at the end to preserve parsing order ...
      */
     if (node != NULL) {
+        XML_DOC_TREE_CHANGED(doc);
         if (node->properties == NULL) {
             node->properties = cur;
         } else {
@@ -1686,6 +2575,7 @@ xmlFreeProp(xmlAttr *cur) {
     if (cur == NULL) return;
 
     if (cur->doc != NULL) dict = cur->doc->dict;
+    XML_DOC_TREE_CHANGED(cur->doc);
 
     if ((xmlRegisterCallbacks) && (xmlDeregisterNodeDefaultValue))
 	xmlDeregisterNodeDefaultValue((xmlNodePtr)cur);
@@ -1696,7 +2586,7 @@ xmlFreeProp(xmlAttr *cur) {
     }
     if (cur->children != NULL) xmlFreeNodeList(cur->children);
     DICT_FREE(cur->name)
-    xmlFree(cur);
+    ARENA_FREE(cur->doc, cur)
 }
 
 /**
@@ -2108,6 +2998,7 @@ xmlNewTextChild(xmlNode *parent, xmlNs *ns,
     /*
      * add the new element at the end of the children list.
      */
+    XML_DOC_TREE_CHANGED(parent->doc);
     cur->parent = parent;
     if (parent->children == NULL) {
         parent->children = cur;
@@ -2468,6 +3359,9 @@ xmlNodeSetDoc(xmlNodePtr node, xmlDocPtr doc) {
     oldDict = oldDoc ? oldDoc->dict : NULL;
     newDict = doc ? doc->dict : NULL;
 
+    if (oldDoc != doc)
+        XML_DOC_TREE_CHANGED(oldDoc);
+
     if ((oldDict != NULL) && (oldDict != newDict)) {
         if ((node->name != NULL) &&
             ((node->type == XML_ELEMENT_NODE) ||
@@ -2493,6 +3387,14 @@ xmlNodeSetDoc(xmlNodePtr node, xmlDocPtr doc) {
         }
     }
 
+    /*
+     * Keep memory allocated from the old document's arena alive
+     */
+    if ((oldDoc != NULL) && (oldDoc->arena != NULL) && (oldDoc != doc)) {
+        if (xmlDocArenaShare(doc, oldDoc) < 0)
+            ret = -1;
+    }
+
     switch (node->type) {
         case XML_ATTRIBUTE_NODE: {
             xmlAttrPtr attr = (xmlAttrPtr) node;
@@ -2577,11 +3479,17 @@ xmlNodeSetDoc(xmlNodePtr node, xmlDocPtr doc) {
  * Also copy strings from the old document's dictionary and
  * remove ID attributes from the old ID table.
  *
+ * Nodes allocated from the arena of a document parsed with
+ * XML_PARSE_ARENA can't outlive their document, so they can only be
+ * moved to another document. Moving them to a tree without a
+ * document fails without modifying the tree.
+ *
  * @param tree  root of a subtree
  * @param doc  new document
- * @returns 0 on success. If a memory allocation fails, returns -1.
- * The whole tree will be updated on failure but some strings
- * may be lost.
+ * @returns 0 on success. If a memory allocation fails or the
+ * nodes can't leave their arena, returns -1. After a memory
+ * allocation failure, the whole tree will be updated but some
+ * strings may be lost.
  */
 int
 xmlSetTreeDoc(xmlNode *tree, xmlDoc *doc) {
@@ -2591,6 +3499,12 @@ xmlSetTreeDoc(xmlNode *tree, xmlDoc *doc) {
 	return(0);
     if (tree->doc == doc)
         return(0);
+    if ((doc == NULL) && (tree->doc != NULL) && (tree->doc->arena != NULL))
+        return(-1);
+
+    /* Descendants are materialized when they're visited */
+    if (XML_LAZY_DOC(tree->doc))
+        xmlLazyMaterialize(tree, XML_LAZY_ATTRS | XML_LAZY_CONTENT);
 
     if (tree->type == XML_ELEMENT_NODE) {
         xmlAttrPtr prop = tree->properties;
@@ -2699,6 +3613,7 @@ xmlNewChild(xmlNode *parent, xmlNs *ns,
     /*
      * add the new element at the end of the children list.
      */
+    XML_DOC_TREE_CHANGED(parent->doc);
     cur->parent = parent;
     if (parent->children == NULL) {
         parent->children = cur;
@@ -2719,14 +3634,16 @@ xmlTextSetContent(xmlNodePtr text, xmlChar *content) {
         (text->content != (xmlChar *) &text->properties)) {
         xmlDocPtr doc = text->doc;
 
-        if ((doc == NULL) ||
-            (doc->dict == NULL) ||
-            (!xmlDictOwns(doc->dict, text->content)))
+        if (((doc == NULL) ||
+             (doc->dict == NULL) ||
+             (!xmlDictOwns(doc->dict, text->content))) &&
+            (!xmlDocArenaOwns(doc, text->content)))
             xmlFree(text->content);
     }
 
     text->content = content;
     text->properties = NULL;
+    XML_DOC_TREE_CHANGED(text->doc);
 }
 
 static int
@@ -2764,6 +3681,7 @@ xmlInsertProp(xmlDocPtr doc, xmlNodePtr cur, xmlNodePtr parent,
             return(NULL);
     }
 
+    XML_DOC_TREE_CHANGED(doc);
     cur->parent = parent;
     cur->prev = prev;
     cur->next = next;
@@ -2825,7 +3743,10 @@ xmlInsertNode(xmlDocPtr doc, xmlNodePtr cur, xmlNodePtr parent,
     }
 
     /* Unlink */
+    xmlLazyMaterializeSiblings(cur);
     oldParent = cur->parent;
+    if ((oldParent != NULL) || (cur->prev != NULL) || (cur->next != NULL))
+        XML_DOC_TREE_CHANGED(cur->doc);
     if (oldParent != NULL) {
         if (oldParent->children == cur)
             oldParent->children = cur->next;
@@ -2853,6 +3774,7 @@ xmlInsertNode(xmlDocPtr doc, xmlNodePtr cur, xmlNodePtr parent,
         }
     }
 
+    XML_DOC_TREE_CHANGED(doc);
     cur->parent = parent;
     cur->prev = prev;
     cur->next = next;
@@ -2896,6 +3818,8 @@ xmlAddNextSibling(xmlNode *prev, xmlNode *cur) {
         (cur == prev))
 	return(NULL);
 
+    xmlLazyMaterializeSiblings(prev);
+
     if (cur == prev->next)
         return(cur);
 
@@ -2925,6 +3849,8 @@ xmlAddPrevSibling(xmlNode *next, xmlNode *cur) {
         (cur == next))
 	return(NULL);
 
+    xmlLazyMaterializeSiblings(next);
+
     if (cur == next->prev)
         return(cur);
 
@@ -2956,6 +3882,8 @@ xmlAddSibling(xmlNode *node, xmlNode *cur) {
         (cur == node))
 	return(NULL);
 
+    xmlLazyMaterializeSiblings(node);
+
     /*
      * Constant time is we can rely on the ->parent->last to find
      * the last sibling.
@@ -2997,6 +3925,9 @@ xmlAddChildList(xmlNode *parent, xmlNode *cur) {
 	return(NULL);
     }
 
+    if (XML_LAZY_DOC(parent->doc))
+        xmlLazyMaterialize(parent, XML_LAZY_CONTENT);
+
     oom = 0;
     for (iter = cur; iter != NULL; iter = iter->next) {
 	if (iter->doc != parent->doc) {
@@ -3011,6 +3942,7 @@ xmlAddChildList(xmlNode *parent, xmlNode *cur) {
      * add the first element at the end of the children list.
      */
 
+    XML_DOC_TREE_CHANGED(parent->doc);
     if (parent->children == NULL) {
         parent->children = cur;
     } else {
@@ -3114,6 +4046,9 @@ xmlAddChild(xmlNode *parent, xmlNode *cur) {
         return(parent);
     }
 
+    if (XML_LAZY_DOC(parent->doc))
+        xmlLazyMaterialize(parent, XML_LAZY_ATTRS | XML_LAZY_CONTENT);
+
     if (cur->type == XML_ATTRIBUTE_NODE) {
         prev = (xmlNodePtr) parent->properties;
         if (prev != NULL) {
@@ -3141,6 +4076,8 @@ xmlGetLastChild(const xmlNode *parent) {
     if ((parent == NULL) || (parent->type == XML_NAMESPACE_DECL)) {
 	return(NULL);
     }
+    if (XML_LAZY_DOC(parent->doc))
+        xmlLazyMaterialize((xmlNodePtr) parent, XML_LAZY_CONTENT);
     return(parent->last);
 }
 
@@ -3336,6 +4273,7 @@ xmlFreeNodeList(xmlNode *cur) {
 	return;
     }
     if (cur->doc != NULL) dict = cur->doc->dict;
+    XML_DOC_TREE_CHANGED(cur->doc);
     while (1) {
         while ((cur->children != NULL) &&
                (cur->type != XML_DOCUMENT_NODE) &&
@@ -3371,7 +4309,8 @@ xmlFreeNodeList(xmlNode *cur) {
 		(cur->type != XML_XINCLUDE_START) &&
 		(cur->type != XML_XINCLUDE_END) &&
 		(cur->type != XML_ENTITY_REF_NODE) &&
-		(cur->content != (xmlChar *) &(cur->properties))) {
+		(cur->content != (xmlChar *) &(cur->properties)) &&
+                (!xmlDocArenaOwns(cur->doc, cur->content))) {
 		DICT_FREE(cur->content)
 	    }
 	    if (((cur->type == XML_ELEMENT_NODE) ||
@@ -3390,7 +4329,7 @@ xmlFreeNodeList(xmlNode *cur) {
 		(cur->type != XML_TEXT_NODE) &&
 		(cur->type != XML_COMMENT_NODE))
 		DICT_FREE(cur->name)
-	    xmlFree(cur);
+	    ARENA_FREE(cur->doc, cur)
 	}
 
         if (next != NULL) {
@@ -3441,6 +4380,7 @@ xmlFreeNode(xmlNode *cur) {
 	xmlDeregisterNodeDefaultValue(cur);
 
     if (cur->doc != NULL) dict = cur->doc->dict;
+    XML_DOC_TREE_CHANGED(cur->doc);
 
     if ((cur->children != NULL) &&
 	(cur->type != XML_ENTITY_REF_NODE))
@@ -3455,7 +4395,8 @@ xmlFreeNode(xmlNode *cur) {
             xmlFreeNsList(cur->nsDef);
     } else if ((cur->content != NULL) &&
                (cur->type != XML_ENTITY_REF_NODE) &&
-               (cur->content != (xmlChar *) &(cur->properties))) {
+               (cur->content != (xmlChar *) &(cur->properties)) &&
+               (!xmlDocArenaOwns(cur->doc, cur->content))) {
         DICT_FREE(cur->content)
     }
 
@@ -3469,7 +4410,7 @@ xmlFreeNode(xmlNode *cur) {
         (cur->type != XML_COMMENT_NODE))
 	DICT_FREE(cur->name)
 
-    xmlFree(cur);
+    ARENA_FREE(cur->doc, cur)
 }
 
 /**
@@ -3482,6 +4423,11 @@ xmlFreeNode(xmlNode *cur) {
  */
 static void
 xmlUnlinkNodeInternal(xmlNodePtr cur) {
+    if ((cur->parent != NULL) || (cur->prev != NULL) || (cur->next != NULL))
+        XML_DOC_TREE_CHANGED(cur->doc);
+
+    xmlLazyMaterializeSiblings(cur);
+
     if (cur->parent != NULL) {
 	xmlNodePtr parent;
 	parent = cur->parent;
@@ -3572,6 +4518,7 @@ xmlReplaceNode(xmlNode *old, xmlNode *cur) {
     if ((cur->type==XML_ATTRIBUTE_NODE) && (old->type!=XML_ATTRIBUTE_NODE)) {
 	return(old);
     }
+    xmlLazyMaterializeSiblings(old);
     xmlUnlinkNodeInternal(cur);
     if (xmlSetTreeDoc(cur, old->doc) < 0)
         return(NULL);
@@ -3595,6 +4542,7 @@ xmlReplaceNode(xmlNode *old, xmlNode *cur) {
     }
     old->next = old->prev = NULL;
     old->parent = NULL;
+    XML_DOC_TREE_CHANGED(old->doc);
     return(old);
 }
 
@@ -3884,6 +4832,10 @@ xmlStaticCopyNode(xmlNode *node, xmlDoc *doc, xmlNode *parent,
             return(NULL);
     }
 
+    /* Children are copied after this call when extended is 2 */
+    if (XML_LAZY_DOC(node->doc))
+        xmlLazyMaterialize(node, XML_LAZY_ATTRS | XML_LAZY_CONTENT);
+
     /*
      * Allocate a new node and fill the fields.
      */
@@ -4902,6 +5854,7 @@ xmlNodeSetName(xmlNode *cur, const xmlChar *name) {
 
     oldName = cur->name;
     cur->name = copy;
+    XML_DOC_TREE_CHANGED(doc);
     if ((oldName != NULL) &&
         ((dict == NULL) || (!xmlDictOwns(dict, oldName))))
         xmlFree((xmlChar *) oldName);
@@ -5143,6 +6096,12 @@ xmlBufGetEntityRefContent(xmlBufPtr buf, const xmlNode *ref) {
         return;
     }
 
+    /* Shared entities only contain text and must not be modified */
+    if (ent->flags & XML_ENT_SHARED) {
+        xmlBufGetChildContent(buf, (xmlNodePtr) ent);
+        return;
+    }
+
     if (ent->flags & XML_ENT_EXPANDING)
         return;
 
@@ -5201,6 +6160,10 @@ xmlBufGetNodeContent(xmlBuf *buf, const xmlNode *cur)
     if ((cur == NULL) || (buf == NULL))
         return(-1);
 
+    if (XML_LAZY_DOC(cur->doc))
+        xmlLazyMaterialize((xmlNodePtr) cur,
+                           XML_LAZY_CONTENT | XML_LAZY_RECURSIVE);
+
     switch (cur->type) {
         case XML_DOCUMENT_NODE:
         case XML_HTML_DOCUMENT_NODE:
@@ -5265,8 +6228,13 @@ xmlNodeGetContent(const xmlNode *cur)
         case XML_ELEMENT_NODE:
         case XML_ATTRIBUTE_NODE:
         case XML_ENTITY_DECL: {
-            xmlNodePtr children = cur->children;
+            xmlNodePtr children;
 
+            if (xmlLazyMaterialize((xmlNodePtr) cur, XML_LAZY_CONTENT |
+                                                     XML_LAZY_RECURSIVE) < 0)
+                return(NULL);
+
+            children = cur->children;
             if (children == NULL)
                 return(xmlStrdup(BAD_CAST ""));
 
@@ -5313,6 +6281,8 @@ xmlNodeSetContentInternal(xmlNodePtr cur, const xmlChar *content, int len) {
     if (cur == NULL) {
 	return(1);
     }
+    if (XML_LAZY_DOC(cur->doc))
+        xmlLazyMaterialize(cur, XML_LAZY_CONTENT);
     switch (cur->type) {
         case XML_DOCUMENT_FRAG_NODE:
         case XML_ELEMENT_NODE:
@@ -6005,6 +6975,8 @@ xmlReconciliateNs(xmlDoc *doc, xmlNode *tree) {
 
     if ((node == NULL) || (node->type != XML_ELEMENT_NODE)) return(-1);
     if (node->doc != doc) return(-1);
+    if (xmlNodeMaterialize(tree) < 0)
+        return(-1);
     while (node != NULL) {
         /*
 	 * Reconciliate the node namespace
@@ -6123,6 +7095,9 @@ xmlGetPropNodeInternal(const xmlNode *node, const xmlChar *name,
     if ((node == NULL) || (node->type != XML_ELEMENT_NODE) || (name == NULL))
 	return(NULL);
 
+    if (XML_LAZY_DOC(node->doc))
+        xmlLazyMaterialize((xmlNodePtr) node, XML_LAZY_ATTRS);
+
     if (node->properties != NULL) {
 	prop = node->properties;
 	if (nsName == NULL) {
@@ -6273,6 +7248,10 @@ xmlHasProp(const xmlNode *node, const xmlChar *name) {
 
     if ((node == NULL) || (node->type != XML_ELEMENT_NODE) || (name == NULL))
         return(NULL);
+
+    if (XML_LAZY_DOC(node->doc))
+        xmlLazyMaterialize((xmlNodePtr) node, XML_LAZY_ATTRS);
+
     /*
      * Check on the properties attached to the node
      */
@@ -6578,6 +7557,7 @@ xmlSetNsProp(xmlNode *node, xmlNs *ns, const xmlChar *name,
 	prop->children = NULL;
 	prop->last = NULL;
 	prop->ns = ns;
+        XML_DOC_TREE_CHANGED(node->doc);
 	if (value != NULL) {
 	    xmlNodePtr tmp;
 
@@ -7114,6 +8094,8 @@ xmlDOMWrapRemoveNode(xmlDOMWrapCtxt *ctxt, xmlDoc *doc,
 	    return (1);
     }
     xmlUnlinkNodeInternal(node);
+    if (xmlNodeMaterialize(node) < 0)
+        return (-1);
     /*
     * Save out-of-scope ns-references in doc->oldNs.
     */
@@ -7619,6 +8601,8 @@ xmlDOMWrapReconcileNamespaces(xmlDOMWrapCtxt *ctxt ATTRIBUTE_UNUSED,
     if ((elem == NULL) || (elem->doc == NULL) ||
 	(elem->type != XML_ELEMENT_NODE))
 	return (-1);
+    if (xmlNodeMaterialize(elem) < 0)
+        return (-1);
 
     doc = elem->doc;
     cur = elem;
@@ -8180,6 +9164,8 @@ xmlDOMWrapCloneNode(xmlDOMWrapCtxt *ctxt,
     */
     if (node->type != XML_ELEMENT_NODE)
 	return(1);
+    if (xmlNodeMaterialize(node) < 0)
+        return(-1);
     /*
     * Check node->doc sanity.
     */
@@ -8777,6 +9763,8 @@ xmlDOMWrapAdoptNode(xmlDOMWrapCtxt *ctxt,
      */
     if (sourceDoc == destDoc)
 	return (-1);
+    if (xmlNodeMaterialize(node) < 0)
+        return (-1);
 
     switch (node->type) {
 	case XML_ELEMENT_NODE:
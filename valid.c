@@ -14,6 +14,7 @@
 #include <stdlib.h>
 
 #include <libxml/xmlmemory.h>
+#include <libxml/entities.h>
 #include <libxml/hash.h>
 #include <libxml/uri.h>
 #include <libxml/valid.h>
@@ -23,12 +24,15 @@
 #include <libxml/list.h>
 #include <libxml/xmlsave.h>
 
+#include "private/entities.h"
 #include "private/error.h"
 #include "private/memory.h"
 #include "private/parser.h"
 #include "private/regexp.h"
 #include "private/save.h"
+#include "private/threads.h"
 #include "private/tree.h"
+#include "private/valid.h"
 
 static xmlElementPtr
 xmlGetDtdElementDesc2(xmlValidCtxtPtr ctxt, xmlDtdPtr dtd, const xmlChar *name);
@@ -1550,6 +1554,44 @@ xmlFreeAttribute(xmlAttributePtr attr) {
 }
 
 
+/**
+ * Add an attribute declaration to the attribute list of its element.
+ *
+ * @param elemDef  the element declaration
+ * @param attr  the attribute declaration
+ */
+static void
+xmlLinkAttributeDecl(xmlElementPtr elemDef, xmlAttributePtr attr) {
+    /*
+     * Insert namespace default def first they need to be
+     * processed first.
+     */
+    if ((xmlStrEqual(attr->name, BAD_CAST "xmlns")) ||
+        ((attr->prefix != NULL &&
+         (xmlStrEqual(attr->prefix, BAD_CAST "xmlns"))))) {
+        attr->nexth = elemDef->attributes;
+        elemDef->attributes = attr;
+    } else {
+        xmlAttributePtr tmp = elemDef->attributes;
+
+        while ((tmp != NULL) &&
+               ((xmlStrEqual(tmp->name, BAD_CAST "xmlns")) ||
+                ((attr->prefix != NULL &&
+                 (xmlStrEqual(attr->prefix, BAD_CAST "xmlns")))))) {
+            if (tmp->nexth == NULL)
+                break;
+            tmp = tmp->nexth;
+        }
+        if (tmp != NULL) {
+            attr->nexth = tmp->nexth;
+            tmp->nexth = attr;
+        } else {
+            attr->nexth = elemDef->attributes;
+            elemDef->attributes = attr;
+        }
+    }
+}
+
 /**
  * Register a new attribute declaration.
  *
@@ -1697,34 +1739,7 @@ xmlAddAttributeDecl(xmlValidCtxt *ctxt,
 	return(NULL);
     }
 
-    /*
-     * Insert namespace default def first they need to be
-     * processed first.
-     */
-    if ((xmlStrEqual(ret->name, BAD_CAST "xmlns")) ||
-        ((ret->prefix != NULL &&
-         (xmlStrEqual(ret->prefix, BAD_CAST "xmlns"))))) {
-        ret->nexth = elemDef->attributes;
-        elemDef->attributes = ret;
-    } else {
-        xmlAttributePtr tmp = elemDef->attributes;
-
-        while ((tmp != NULL) &&
-               ((xmlStrEqual(tmp->name, BAD_CAST "xmlns")) ||
-                ((ret->prefix != NULL &&
-                 (xmlStrEqual(ret->prefix, BAD_CAST "xmlns")))))) {
-            if (tmp->nexth == NULL)
-                break;
-            tmp = tmp->nexth;
-        }
-        if (tmp != NULL) {
-            ret->nexth = tmp->nexth;
-            tmp->nexth = ret;
-        } else {
-            ret->nexth = elemDef->attributes;
-            elemDef->attributes = ret;
-        }
-    }
+    xmlLinkAttributeDecl(elemDef, ret);
 
     /*
      * Link it to the DTD
@@ -5805,6 +5820,11 @@ xmlValidateElement(xmlValidCtxt *ctxt, xmlDoc *doc, xmlNode *root) {
 
     CHECK_DTD;
 
+    if (xmlNodeMaterialize(root) < 0) {
+        xmlVErrMemory(ctxt);
+        return(0);
+    }
+
     elem = root;
     while (1) {
         ret &= xmlValidateOneElement(ctxt, doc, elem);
@@ -6261,6 +6281,11 @@ xmlValidateDocumentInternal(xmlParserCtxtPtr ctxt, xmlValidCtxtPtr vctxt,
 	return(0);
     }
 
+    if (xmlNodeMaterialize((xmlNodePtr) doc) < 0) {
+        xmlVErrMemory(vctxt);
+        return(0);
+    }
+
     if ((doc->intSubset != NULL) && ((doc->intSubset->SystemID != NULL) ||
 	(doc->intSubset->ExternalID != NULL)) && (doc->extSubset == NULL)) {
 	xmlChar *sysID = NULL;
@@ -6561,3 +6586,392 @@ xmlValidGetValidElements(xmlNode *prev, xmlNode *next, const xmlChar **names,
     return(nb_valid_elements);
 }
 #endif /* LIBXML_VALID_ENABLED */
+
+/************************************************************************
+ *									*
+ *			Shared DTD cache				*
+ *									*
+ ************************************************************************/
+
+/*
+ * Parser options which can change the declarations parsed from an
+ * external subset or the errors reported for it.
+ */
+#define XML_DTD_CACHE_OPTIONS \
+    (XML_PARSE_NOENT | XML_PARSE_DTDVALID | XML_PARSE_PEDANTIC | \
+     XML_PARSE_NONET | XML_PARSE_OLD10 | XML_PARSE_HUGE | \
+     XML_PARSE_IGNORE_ENC | XML_PARSE_NO_SYS_CATALOG | \
+     XML_PARSE_CATALOG_PI)
+
+#define XML_DTD_CACHE_MAX 64
+
+typedef struct _xmlDtdCacheEntry xmlDtdCacheEntry;
+struct _xmlDtdCacheEntry {
+    xmlDtdCacheEntry *next;
+    xmlChar *publicId;
+    xmlChar *URI;
+    int options;
+    /* One reference for the cache and one for each document */
+    int refs;
+    int cached;
+    /* Document owning the shared DTD */
+    xmlDocPtr doc;
+};
+
+/*
+ * Entries are kept in the list until their last reference is released,
+ * even after they were removed from the cache.
+ */
+static xmlMutex xmlDtdCacheMutex;
+static xmlDtdCacheEntry *xmlDtdCacheList;
+static int xmlDtdCacheNr;
+
+/**
+ * Initialize the DTD cache mutex.
+ */
+void
+xmlInitDtdCacheInternal(void) {
+    xmlInitMutex(&xmlDtdCacheMutex);
+}
+
+static void
+xmlDtdCacheFreeEntry(xmlDtdCacheEntry *entry) {
+    xmlFree(entry->publicId);
+    xmlFree(entry->URI);
+    xmlFreeDoc(entry->doc);
+    xmlFree(entry);
+}
+
+static void
+xmlDtdCacheClear(void) {
+    xmlDtdCacheEntry **prev, *entry, *unused = NULL;
+
+    xmlMutexLock(&xmlDtdCacheMutex);
+
+    prev = &xmlDtdCacheList;
+    while ((entry = *prev) != NULL) {
+        if (entry->cached) {
+            entry->cached = 0;
+            entry->refs -= 1;
+        }
+        if (entry->refs == 0) {
+            *prev = entry->next;
+            entry->next = unused;
+            unused = entry;
+        } else {
+            prev = &entry->next;
+        }
+    }
+    xmlDtdCacheNr = 0;
+
+    xmlMutexUnlock(&xmlDtdCacheMutex);
+
+    while (unused != NULL) {
+        entry = unused;
+        unused = entry->next;
+        xmlDtdCacheFreeEntry(entry);
+    }
+}
+
+/**
+ * Free the DTD cache.
+ */
+void
+xmlCleanupDtdCacheInternal(void) {
+    xmlDtdCacheClear();
+    xmlCleanupMutex(&xmlDtdCacheMutex);
+}
+
+/**
+ * Remove all DTDs from the cache used with XML_PARSE_DTD_CACHE.
+ * The next document referencing one of them will parse the external
+ * subset again. DTDs still used by documents are freed together with
+ * the last of these documents.
+ *
+ * @since 2.16.0
+ */
+void
+xmlCleanupDtdCache(void) {
+    xmlInitParser();
+    xmlDtdCacheClear();
+}
+
+/**
+ * Look up a DTD in the cache. The DTD is shared with other documents
+ * and must not be modified. If a DTD is returned, the caller must
+ * release it with xmlDtdCacheRelease.
+ *
+ * @param publicId  the public identifier (optional)
+ * @param URI  the resolved system identifier
+ * @param options  the parser options
+ * @returns the shared DTD or NULL if it isn't cached.
+ */
+xmlDtdPtr
+xmlDtdCacheLookup(const xmlChar *publicId, const xmlChar *URI,
+                  int options) {
+    xmlDtdCacheEntry *entry;
+    xmlDtdPtr ret = NULL;
+
+    if (URI == NULL)
+        return(NULL);
+
+    options &= XML_DTD_CACHE_OPTIONS;
+
+    xmlMutexLock(&xmlDtdCacheMutex);
+    for (entry = xmlDtdCacheList; entry != NULL; entry = entry->next) {
+        if ((entry->cached) &&
+            (entry->options == options) &&
+            (xmlStrEqual(entry->URI, URI)) &&
+            (xmlStrEqual(entry->publicId, publicId))) {
+            entry->refs += 1;
+            ret = entry->doc->extSubset;
+            break;
+        }
+    }
+    xmlMutexUnlock(&xmlDtdCacheMutex);
+
+    return(ret);
+}
+
+/**
+ * Release a reference to a DTD returned by xmlDtdCacheLookup.
+ *
+ * @param dtd  the DTD
+ * @returns 1 if the DTD came from the cache, 0 otherwise.
+ */
+int
+xmlDtdCacheRelease(xmlDtdPtr dtd) {
+    xmlDtdCacheEntry **prev, *entry;
+    xmlDtdCacheEntry *unused = NULL;
+    int found = 0;
+
+    if (dtd == NULL)
+        return(0);
+
+    xmlMutexLock(&xmlDtdCacheMutex);
+    for (prev = &xmlDtdCacheList; *prev != NULL; prev = &entry->next) {
+        entry = *prev;
+        if (entry->doc->extSubset == dtd) {
+            entry->refs -= 1;
+            if (entry->refs == 0) {
+                *prev = entry->next;
+                unused = entry;
+            }
+            found = 1;
+            break;
+        }
+    }
+    xmlMutexUnlock(&xmlDtdCacheMutex);
+
+    if (unused != NULL)
+        xmlDtdCacheFreeEntry(unused);
+
+    return(found);
+}
+
+/*
+ * Prepare an entity for sharing. Parsing an entity reference for the
+ * first time stores the result in the entity, so entities are parsed
+ * in advance. Only text content is supported.
+ */
+static int
+xmlDtdCacheFreezeEntity(xmlEntityPtr ent) {
+    const xmlChar *cur;
+    xmlNodePtr text;
+    int blank = 1;
+
+    if ((ent->etype == XML_EXTERNAL_GENERAL_UNPARSED_ENTITY) ||
+        (ent->etype == XML_INTERNAL_PARAMETER_ENTITY) ||
+        (ent->etype == XML_EXTERNAL_PARAMETER_ENTITY))
+        return(0);
+
+    /* Redeclared predefined entities are never expanded */
+    if (xmlGetPredefinedEntity(ent->name) != NULL)
+        return(0);
+
+    if ((ent->etype != XML_INTERNAL_GENERAL_ENTITY) ||
+        (ent->content == NULL))
+        return(-1);
+
+    /*
+     * Character references were already replaced when the entity
+     * was declared. Reject everything that the parser wouldn't turn
+     * into a single, non-blank text node.
+     */
+    for (cur = ent->content; *cur != 0; cur++) {
+        if ((*cur == '<') || (*cur == '&') || (*cur == '\r'))
+            return(-1);
+        if ((*cur == '>') && (cur - ent->content >= 2) &&
+            (cur[-1] == ']') && (cur[-2] == ']'))
+            return(-1);
+        if (!IS_BLANK_CH(*cur))
+            blank = 0;
+    }
+    if (blank)
+        return(-1);
+
+    text = xmlNewDocText(ent->doc, ent->content);
+    if (text == NULL)
+        return(-1);
+    text->parent = (xmlNodePtr) ent;
+    ent->children = text;
+    ent->last = text;
+    ent->length = cur - ent->content;
+    ent->expandedSize = ent->length;
+    ent->flags = XML_ENT_PARSED | XML_ENT_CHECKED | XML_ENT_VALIDATED |
+                 XML_ENT_SHARED;
+
+    return(0);
+}
+
+#if defined(LIBXML_VALID_ENABLED) && defined(LIBXML_REGEXP_ENABLED)
+static void
+xmlDtdCacheIgnoreError(void *ctx ATTRIBUTE_UNUSED,
+                       const char *msg ATTRIBUTE_UNUSED, ...) {
+}
+
+static void
+xmlDtdCacheBuildContentModel(void *payload, void *data,
+                             const xmlChar *name ATTRIBUTE_UNUSED) {
+    xmlElementPtr elem = (xmlElementPtr) payload;
+    xmlValidCtxtPtr vctxt = (xmlValidCtxtPtr) data;
+
+    if ((elem->etype == XML_ELEMENT_TYPE_ELEMENT) &&
+        (xmlValidBuildContentModel(vctxt, elem) != 1))
+        vctxt->valid = 0;
+}
+#endif
+
+/*
+ * Make a DTD immutable. Attribute lists and content models which
+ * are normally built lazily are built in advance.
+ */
+static int
+xmlDtdCacheFreeze(xmlDtdPtr dtd) {
+    xmlNodePtr cur;
+
+    for (cur = dtd->children; cur != NULL; cur = cur->next) {
+        cur->doc = dtd->doc;
+
+        if (cur->type == XML_ENTITY_DECL) {
+            if (xmlDtdCacheFreezeEntity((xmlEntityPtr) cur) < 0)
+                return(-1);
+        } else if (cur->type == XML_ATTRIBUTE_DECL) {
+            xmlAttributePtr attr = (xmlAttributePtr) cur;
+            xmlElementPtr elemDef;
+
+            /* xmlCopyDtd doesn't rebuild the attribute lists */
+            elemDef = xmlGetDtdElementDesc2(NULL, dtd, attr->elem);
+            if (elemDef == NULL)
+                return(-1);
+            xmlLinkAttributeDecl(elemDef, attr);
+        }
+    }
+
+#if defined(LIBXML_VALID_ENABLED) && defined(LIBXML_REGEXP_ENABLED)
+    if (dtd->elements != NULL) {
+        xmlValidCtxt vctxt;
+
+        memset(&vctxt, 0, sizeof(vctxt));
+        vctxt.error = xmlDtdCacheIgnoreError;
+        vctxt.warning = xmlDtdCacheIgnoreError;
+        vctxt.valid = 1;
+
+        xmlHashScan(dtd->elements, xmlDtdCacheBuildContentModel, &vctxt);
+        if (!vctxt.valid)
+            return(-1);
+    }
+#endif
+
+    return(0);
+}
+
+/**
+ * Add a copy of an external subset to the cache. The DTD must have
+ * been parsed without errors or warnings and without declarations in
+ * the internal subset. DTDs with general entities that contain markup
+ * or entity references aren't cached.
+ *
+ * @param dtd  the parsed external subset
+ * @param publicId  the public identifier (optional)
+ * @param URI  the resolved system identifier
+ * @param options  the parser options
+ * @returns 0 if the DTD was added or is already cached, -1 if it can't
+ * be cached, the cache is full or a memory allocation failed.
+ */
+int
+xmlDtdCacheAdd(xmlDtdPtr dtd, const xmlChar *publicId, const xmlChar *URI,
+               int options) {
+    xmlDtdCacheEntry *entry, *cur;
+    xmlDocPtr doc;
+    xmlDtdPtr copy;
+    int ret = 0;
+
+    if ((dtd == NULL) || (URI == NULL))
+        return(-1);
+
+    options &= XML_DTD_CACHE_OPTIONS;
+
+    doc = xmlNewDoc(NULL);
+    if (doc == NULL)
+        return(-1);
+    copy = xmlCopyDtd(dtd);
+    if (copy == NULL) {
+        xmlFreeDoc(doc);
+        return(-1);
+    }
+    copy->doc = doc;
+    doc->extSubset = copy;
+
+    entry = xmlMalloc(sizeof(*entry));
+    if (entry == NULL) {
+        xmlFreeDoc(doc);
+        return(-1);
+    }
+    memset(entry, 0, sizeof(*entry));
+    entry->doc = doc;
+    entry->options = options;
+    entry->refs = 1;
+    entry->cached = 1;
+
+    if (publicId != NULL) {
+        entry->publicId = xmlStrdup(publicId);
+        if (entry->publicId == NULL)
+            goto error;
+    }
+    entry->URI = xmlStrdup(URI);
+    if (entry->URI == NULL)
+        goto error;
+
+    if (xmlDtdCacheFreeze(copy) < 0)
+        goto error;
+
+    xmlMutexLock(&xmlDtdCacheMutex);
+    if (xmlDtdCacheNr >= XML_DTD_CACHE_MAX) {
+        ret = -1;
+    } else {
+        /* Another thread might have added the same DTD */
+        for (cur = xmlDtdCacheList; cur != NULL; cur = cur->next) {
+            if ((cur->cached) &&
+                (cur->options == options) &&
+                (xmlStrEqual(cur->URI, URI)) &&
+                (xmlStrEqual(cur->publicId, publicId)))
+                break;
+        }
+        if (cur == NULL) {
+            entry->next = xmlDtdCacheList;
+            xmlDtdCacheList = entry;
+            xmlDtdCacheNr += 1;
+            entry = NULL;
+        }
+    }
+    xmlMutexUnlock(&xmlDtdCacheMutex);
+
+    if (entry != NULL)
+        xmlDtdCacheFreeEntry(entry);
+    return(ret);
+
+error:
+    xmlDtdCacheFreeEntry(entry);
+    return(-1);
+}
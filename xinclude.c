@@ -1426,10 +1426,20 @@ xmlXIncludeLoadTxt(xmlXIncludeCtxtPtr ctxt, xmlXIncludeRefPtr ref) {
     buf = inputStream->buf;
     if (buf == NULL)
 	goto error;
-    if (buf->encoder)
-	xmlCharEncCloseFunc(buf->encoder);
-    buf->encoder = handler;
+
+    /*
+     * The input may already be fully buffered, for example if the
+     * file was memory-mapped, so the raw content has to be moved aside.
+     */
+    res = xmlInputSetEncodingHandler(inputStream, handler);
     handler = NULL;
+    if (res != XML_ERR_OK) {
+        if (res == XML_ERR_NO_MEMORY)
+            xmlXIncludeErrMemory(ctxt);
+        else
+            xmlXIncludeErr(ctxt, NULL, res, "encoding error", NULL);
+        goto error;
+    }
 
     node = xmlNewDocText(ctxt->doc, NULL);
     if (node == NULL) {
@@ -1962,6 +1972,11 @@ xmlXIncludeDoProcessRoot(xmlXIncludeCtxtPtr ctxt, xmlNodePtr tree) {
     if (ctxt == NULL)
 	return(-1);
 
+    if (xmlNodeMaterialize(tree) < 0) {
+        xmlXIncludeErrMemory(ctxt);
+        return(-1);
+    }
+
     return(xmlXIncludeDoProcess(ctxt, tree));
 }
 
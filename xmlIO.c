@@ -25,6 +25,20 @@
   #include <unistd.h>
 #endif
 
+#if HAVE_DECL_MMAP
+  #include <sys/mman.h>
+  /* seems needed for Solaris */
+  #ifndef MAP_FAILED
+    #define MAP_FAILED ((void *) -1)
+  #endif
+  #if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+    #define MAP_ANONYMOUS MAP_ANON
+  #endif
+  #ifdef MAP_ANONYMOUS
+    #define XML_IO_MMAP
+  #endif
+#endif
+
 #ifdef LIBXML_ZLIB_ENABLED
 #include <zlib.h>
 #endif
@@ -51,6 +65,12 @@
 
 #define MINLEN 4000
 
+/*
+ * With XML_INPUT_MMAP, regular files at least this large are
+ * memory-mapped instead of read.
+ */
+#define XML_IO_MMAP_MIN_SIZE (64 * 1024)
+
 #ifndef STDOUT_FILENO
   #define STDOUT_FILENO 1
 #endif
@@ -1245,6 +1265,119 @@ xmlInputFromFd(xmlParserInputBuffer *buf, int fd,
     return(XML_ERR_OK);
 }
 
+#ifdef XML_IO_MMAP
+typedef struct {
+    void *addr;
+    size_t size;
+} xmlMmapIOCtxt;
+
+static int
+xmlMmapClose(void *context) {
+    xmlMmapIOCtxt *ctxt = context;
+
+    munmap(ctxt->addr, ctxt->size);
+    xmlFree(ctxt);
+
+    return(XML_ERR_OK);
+}
+
+/**
+ * Try to map a regular file into memory and use the mapping as static
+ * buffer. This avoids copying the file contents and growing the buffer
+ * while parsing.
+ *
+ * The anonymous mapping reserved first makes sure that the file data
+ * is followed by a zero byte even if its size is a multiple of the
+ * page size.
+ *
+ * Accessing a mapping beyond the end of a file which was truncated
+ * raises SIGBUS, so this is only done with XML_INPUT_MMAP. Files
+ * whose size changes while they are mapped are read like pipes.
+ *
+ * @param buf  parser input buffer
+ * @param fd  file descriptor positioned at the start of the file
+ * @param flags  flags
+ * @returns 0 if the file was mapped, 1 if the caller should fall back
+ * to reading the file or an xmlParserErrors code.
+ */
+static int
+xmlInputFromMappedFd(xmlParserInputBuffer *buf, int fd,
+                     xmlParserInputFlags flags) {
+    xmlMmapIOCtxt *ctxt;
+    xmlBufPtr mem;
+    struct stat info, check;
+    size_t size, mapSize;
+    long pageSize;
+    void *addr;
+
+    if (((flags & XML_INPUT_MMAP) == 0) ||
+        (fstat(fd, &info) < 0) ||
+        (!S_ISREG(info.st_mode)) ||
+        (info.st_size < XML_IO_MMAP_MIN_SIZE))
+        return(1);
+
+    pageSize = sysconf(_SC_PAGESIZE);
+    if ((pageSize <= 0) ||
+        ((unsigned long long) info.st_size > SIZE_MAX - pageSize))
+        return(1);
+    size = info.st_size;
+    mapSize = (size / pageSize + 1) * pageSize;
+
+#ifdef LIBXML_ZLIB_ENABLED
+    /* Leave gzip-compressed files to zlib */
+    if (flags & XML_INPUT_UNZIP) {
+        unsigned char magic[2];
+
+        if ((pread(fd, magic, 2, 0) != 2) ||
+            ((magic[0] == 0x1F) && (magic[1] == 0x8B)))
+            return(1);
+    }
+#endif
+
+    addr = mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS,
+                -1, 0);
+    if (addr == MAP_FAILED)
+        return(1);
+    if (mmap(addr, size, PROT_READ, MAP_PRIVATE | MAP_FIXED,
+             fd, 0) == MAP_FAILED) {
+        munmap(addr, mapSize);
+        return(1);
+    }
+    /* Fall back to read() if the file is growing or shrinking */
+    if ((fstat(fd, &check) < 0) ||
+        (check.st_size != info.st_size)) {
+        munmap(addr, mapSize);
+        return(1);
+    }
+#ifdef MADV_SEQUENTIAL
+    madvise(addr, size, MADV_SEQUENTIAL);
+#endif
+
+    ctxt = xmlMalloc(sizeof(*ctxt));
+    if (ctxt == NULL) {
+        munmap(addr, mapSize);
+        return(XML_ERR_NO_MEMORY);
+    }
+    ctxt->addr = addr;
+    ctxt->size = mapSize;
+
+    mem = xmlBufCreateMem(addr, size, /* isStatic */ 1);
+    if (mem == NULL) {
+        xmlMmapClose(ctxt);
+        return(XML_ERR_NO_MEMORY);
+    }
+
+    xmlBufFree(buf->buffer);
+    buf->buffer = mem;
+    buf->context = ctxt;
+    buf->readcallback = NULL;
+    buf->closecallback = xmlMmapClose;
+    buf->compressed = 0;
+
+    return(XML_ERR_OK);
+}
+#endif /* XML_IO_MMAP */
+
 #ifdef LIBXML_OUTPUT_ENABLED
 /**
  * @param buf  input buffer to be filled
@@ -1526,7 +1659,13 @@ xmlParserInputBufferCreateUrl(const char *URI, xmlCharEncoding enc,
             ret = xmlFdOpen(URI, 0, &fd);
 
             if (ret == XML_ERR_OK) {
+#ifdef XML_IO_MMAP
+                ret = xmlInputFromMappedFd(buf, fd, flags);
+                if (ret == 1)
+                    ret = xmlInputFromFd(buf, fd, flags);
+#else
                 ret = xmlInputFromFd(buf, fd, flags);
+#endif
                 close(fd);
                 break;
             } else if (ret != XML_IO_ENOENT) {
@@ -163,7 +163,9 @@ typedef enum {
     /** Print trace of all external entities loaded */
     XML_LINT_USE_LOAD_TRACE = (1 << 23),
     /** Return application failure if document has any namespace errors */
-    XML_LINT_STRICT_NAMESPACE = (1 << 24)
+    XML_LINT_STRICT_NAMESPACE = (1 << 24),
+    /** Build lazy trees */
+    XML_LINT_LAZY_TREE = (1 << 25)
 
 
 } xmllintAppOptions;
@@ -2323,6 +2325,9 @@ static void usage(FILE *f, const char *name) {
     fprintf(f, "\t--load-trace : print trace of all external entities loaded\n");
     fprintf(f, "\t--nonet : refuse to fetch DTDs or entities over network\n");
     fprintf(f, "\t--nocompact : do not generate compact text nodes\n");
+    fprintf(f, "\t--arena : allocate the tree from a per-document arena\n");
+    fprintf(f, "\t--parallel : parse the children of the root element in parallel\n");
+    fprintf(f, "\t--lazy : defer building attributes and text of elements\n");
 #ifdef LIBXML_VALID_ENABLED
     fprintf(f, "\t--valid : validate the document in addition to std well-formed check\n");
     fprintf(f, "\t--postvalid : do a posteriori validation, i.e after parsing\n");
@@ -2387,6 +2392,7 @@ static void usage(FILE *f, const char *name) {
 #endif
     fprintf(f, "\t--loaddtd : fetch external DTD\n");
     fprintf(f, "\t--dtdattr : loaddtd + populate the tree with inherited attributes \n");
+    fprintf(f, "\t--dtdcache : share parsed external DTDs between documents\n");
 #ifdef LIBXML_READER_ENABLED
     fprintf(f, "\t--stream : use the streaming interface to process very large files\n");
     fprintf(f, "\t--walker : create a reader and walk though the resulting doc\n");
@@ -2594,6 +2600,9 @@ xmllintParseOptions(xmllintState *lint, int argc, const char **argv) {
         } else if ((!strcmp(argv[i], "-dtdattr")) ||
                    (!strcmp(argv[i], "--dtdattr"))) {
             lint->parseOptions |= XML_PARSE_DTDATTR;
+        } else if ((!strcmp(argv[i], "-dtdcache")) ||
+                   (!strcmp(argv[i], "--dtdcache"))) {
+            lint->parseOptions |= XML_PARSE_DTD_CACHE;
 #ifdef LIBXML_VALID_ENABLED
         } else if ((!strcmp(argv[i], "-valid")) ||
                    (!strcmp(argv[i], "--valid"))) {
@@ -2794,6 +2803,15 @@ xmllintParseOptions(xmllintState *lint, int argc, const char **argv) {
 #ifdef LIBXML_HTML_ENABLED
             lint->htmlOptions &= ~HTML_PARSE_COMPACT;
 #endif
+        } else if ((!strcmp(argv[i], "-arena")) ||
+                   (!strcmp(argv[i], "--arena"))) {
+            lint->parseOptions |= XML_PARSE_ARENA;
+        } else if ((!strcmp(argv[i], "-parallel")) ||
+                   (!strcmp(argv[i], "--parallel"))) {
+            lint->parseOptions |= XML_PARSE_PARALLEL;
+        } else if ((!strcmp(argv[i], "-lazy")) ||
+                   (!strcmp(argv[i], "--lazy"))) {
+            lint->appOptions |= XML_LINT_LAZY_TREE;
         } else if ((!strcmp(argv[i], "-load-trace")) ||
                    (!strcmp(argv[i], "--load-trace"))) {
             lint->appOptions |= XML_LINT_USE_LOAD_TRACE;
@@ -3216,6 +3234,8 @@ xmllintMain(int argc, const char **argv, FILE *errStream,
                     ctxt = xmlNewParserCtxt();
                 }
                 xmlCtxtUseOptions(ctxt, lint->parseOptions);
+                if (lint->appOptions & XML_LINT_LAZY_TREE)
+                    xmlCtxtSetLazyTree(ctxt, 1);
             }
             if (ctxt == NULL) {
                 lint->progresult = XMLLINT_ERR_MEM;
@@ -3239,7 +3259,15 @@ xmllintMain(int argc, const char **argv, FILE *errStream,
                 ctxt->userData = lint;
             }
 
-            xmlCtxtSetResourceLoader(ctxt, xmllintResourceLoader, lint);
+            /*
+             * The DTD cache is bypassed with a resource loader. Only
+             * install it if it does more than the default loader.
+             */
+            if (((lint->parseOptions & XML_PARSE_DTD_CACHE) == 0) ||
+                (lint->defaultResourceLoader != NULL) ||
+                (lint->nbpaths > 0) ||
+                (lint->appOptions & XML_LINT_USE_LOAD_TRACE))
+                xmlCtxtSetResourceLoader(ctxt, xmllintResourceLoader, lint);
             if (lint->maxAmpl > 0)
                 xmlCtxtSetMaxAmplification(ctxt, lint->maxAmpl);
 
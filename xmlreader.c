@@ -47,6 +47,8 @@
 #include "private/memory.h"
 #include "private/parser.h"
 #include "private/tree.h"
+#include "private/valid.h"
+#include "private/xpath.h"
 #ifdef LIBXML_XINCLUDE_ENABLED
 #include "private/xinclude.h"
 #endif
@@ -282,6 +284,7 @@ xmlTextReaderFreeProp(xmlTextReaderPtr reader, xmlAttrPtr cur) {
     else
         dict = NULL;
     if (cur == NULL) return;
+    XML_DOC_TREE_CHANGED(cur->doc);
 
     if ((xmlRegisterCallbacks) && (xmlDeregisterNodeDefaultValue))
 	xmlDeregisterNodeDefaultValue((xmlNodePtr) cur);
@@ -357,6 +360,7 @@ xmlTextReaderFreeNodeList(xmlTextReaderPtr reader, xmlNodePtr cur) {
 	xmlFreeDoc((xmlDocPtr) cur);
 	return;
     }
+    XML_DOC_TREE_CHANGED(cur->doc);
     while (1) {
         while ((cur->type != XML_DTD_NODE) &&
                (cur->type != XML_ENTITY_REF_NODE) &&
@@ -450,6 +454,7 @@ xmlTextReaderFreeNode(xmlTextReaderPtr reader, xmlNodePtr cur) {
 	xmlTextReaderFreeProp(reader, (xmlAttrPtr) cur);
 	return;
     }
+    XML_DOC_TREE_CHANGED(cur->doc);
 
     if ((cur->children != NULL) &&
 	(cur->type != XML_ENTITY_REF_NODE)) {
@@ -524,6 +529,11 @@ xmlTextReaderFreeDoc(xmlTextReaderPtr reader, xmlDocPtr cur) {
     intSubset = cur->intSubset;
     if (intSubset == extSubset)
 	extSubset = NULL;
+    if ((extSubset != NULL) && (extSubset->doc != cur) &&
+        (xmlDtdCacheRelease(extSubset))) {
+        cur->extSubset = NULL;
+        extSubset = NULL;
+    }
     if (extSubset != NULL) {
 	xmlUnlinkNode((xmlNodePtr) cur->extSubset);
 	cur->extSubset = NULL;
@@ -543,6 +553,9 @@ xmlTextReaderFreeDoc(xmlTextReaderPtr reader, xmlDocPtr cur) {
     if (cur->oldNs != NULL) xmlFreeNsList(cur->oldNs);
     if (cur->URL != NULL) xmlFree(cur->URL);
     if (cur->dict != NULL) xmlDictFree(cur->dict);
+#ifdef LIBXML_XPATH_ENABLED
+    xmlXPathFreeDocData(cur->xpathData);
+#endif
 
     xmlFree(cur);
 }
@@ -4956,6 +4969,8 @@ xmlReaderWalker(xmlDoc *doc)
 
     if (doc == NULL)
         return(NULL);
+    if (xmlNodeMaterialize((xmlNodePtr) doc) < 0)
+        return(NULL);
 
     ret = xmlMalloc(sizeof(xmlTextReader));
     if (ret == NULL) {
@@ -5171,6 +5186,8 @@ xmlReaderNewWalker(xmlTextReader *reader, xmlDoc *doc)
         return (-1);
     if (reader == NULL)
         return (-1);
+    if (xmlNodeMaterialize((xmlNodePtr) doc) < 0)
+        return (-1);
 
     if (reader->input != NULL) {
         xmlFreeParserInputBuffer(reader->input);
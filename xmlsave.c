@@ -22,11 +22,13 @@
 #include <libxml/HTMLtree.h>
 
 #include "private/buf.h"
+#include "private/compact.h"
 #include "private/enc.h"
 #include "private/error.h"
 #include "private/html.h"
 #include "private/io.h"
 #include "private/save.h"
+#include "private/tree.h"
 
 #ifdef LIBXML_OUTPUT_ENABLED
 
@@ -1006,6 +1008,9 @@ xmlNodeDumpOutputInternal(xmlSaveCtxtPtr ctxt, xmlNodePtr cur) {
 	    if ((cur != root) && (ctxt->format == 1))
                 xmlSaveWriteIndent(ctxt, 0);
 
+            if (XML_LAZY_DOC(cur->doc))
+                xmlLazyMaterialize(cur, XML_LAZY_ATTRS | XML_LAZY_CONTENT);
+
             /*
              * Some users like lxml are known to pass nodes with a corrupted
              * tree structure. Fall back to a recursive call to handle this
@@ -1339,6 +1344,302 @@ xmlSaveDocInternal(xmlSaveCtxtPtr ctxt, xmlDocPtr cur,
     return(0);
 }
 
+/************************************************************************
+ *									*
+ *		Dumping compact documents				*
+ *									*
+ ************************************************************************/
+
+static void
+xmlCompactWriteQName(xmlOutputBufferPtr buf, const xmlCompactName *name) {
+    if (name->prefix != NULL) {
+        xmlOutputBufferWriteString(buf, (const char *) name->prefix);
+        xmlOutputBufferWrite(buf, 1, ":");
+    }
+    xmlOutputBufferWriteString(buf, (const char *) name->name);
+}
+
+/**
+ * Dump an attribute or namespace declaration of a compact document.
+ *
+ * @param ctxt  the save context
+ * @param doc  the compact document
+ * @param attr  the attribute or namespace declaration
+ */
+static void
+xmlCompactAttrDumpOutput(xmlSaveCtxtPtr ctxt, const xmlCompactDoc *doc,
+                         unsigned attr) {
+    xmlOutputBufferPtr buf = ctxt->buf;
+    const xmlCompactName *name = &doc->nameTab[doc->names[attr]];
+
+    if (doc->types[attr] == XML_NAMESPACE_DECL) {
+	if (xmlStrEqual(name->name, BAD_CAST "xml"))
+	    return;
+
+        if (ctxt->format == 2)
+            xmlOutputBufferWriteWSNonSig(ctxt, 2);
+        else
+            xmlOutputBufferWrite(buf, 1, " ");
+	if (name->name != NULL) {
+	    xmlOutputBufferWrite(buf, 6, "xmlns:");
+	    xmlOutputBufferWriteString(buf, (const char *) name->name);
+	} else
+	    xmlOutputBufferWrite(buf, 5, "xmlns");
+        xmlOutputBufferWrite(buf, 2, "=\"");
+        xmlSaveWriteText(ctxt, name->href, XML_ESCAPE_ATTR);
+        xmlOutputBufferWrite(buf, 1, "\"");
+        return;
+    }
+
+    if (ctxt->format == 2)
+        xmlOutputBufferWriteWSNonSig(ctxt, 2);
+    else
+        xmlOutputBufferWrite(buf, 1, " ");
+    xmlCompactWriteQName(buf, name);
+    xmlOutputBufferWrite(buf, 2, "=\"");
+    xmlSaveWriteText(ctxt, doc->text + doc->data[attr], XML_ESCAPE_ATTR);
+    xmlOutputBufferWrite(buf, 1, "\"");
+}
+
+static int
+xmlSaveCompactDocInternal(xmlSaveCtxtPtr ctxt, const xmlCompactDoc *doc,
+                          const xmlChar *encoding);
+
+/**
+ * Dump a node of a compact document, children are printed too.
+ * Mirrors xmlNodeDumpOutputInternal.
+ *
+ * @param ctxt  the save context
+ * @param doc  the compact document
+ * @param root  the node
+ */
+static void
+xmlCompactDumpOutputInternal(xmlSaveCtxtPtr ctxt, const xmlCompactDoc *doc,
+                             unsigned root) {
+    int format = ctxt->format;
+    unsigned cur, tmp, attr, unformattedNode = 0;
+    const xmlCompactName *name;
+    const xmlChar *content, *start, *end;
+    xmlOutputBufferPtr buf = ctxt->buf;
+
+    cur = root;
+    while (1) {
+        name = &doc->nameTab[doc->names[cur]];
+        content = doc->text + doc->data[cur];
+
+        switch (doc->types[cur]) {
+        case XML_DOCUMENT_NODE:
+            xmlSaveCompactDocInternal(ctxt, doc, ctxt->encoding);
+            break;
+
+        case XML_ELEMENT_NODE:
+	    if ((cur != root) && (ctxt->format == 1))
+                xmlSaveWriteIndent(ctxt, 0);
+
+            xmlOutputBufferWrite(buf, 1, "<");
+            xmlCompactWriteQName(buf, name);
+            for (attr = doc->data[cur]; attr != 0; attr = doc->nexts[attr])
+                xmlCompactAttrDumpOutput(ctxt, doc, attr);
+
+            if (doc->children[cur] == 0) {
+                if ((ctxt->options & XML_SAVE_NO_EMPTY) == 0) {
+                    if (ctxt->format == 2)
+                        xmlOutputBufferWriteWSNonSig(ctxt, 0);
+                    xmlOutputBufferWrite(buf, 2, "/>");
+                } else {
+                    if (ctxt->format == 2)
+                        xmlOutputBufferWriteWSNonSig(ctxt, 1);
+                    xmlOutputBufferWrite(buf, 3, "></");
+                    xmlCompactWriteQName(buf, name);
+                    if (ctxt->format == 2)
+                        xmlOutputBufferWriteWSNonSig(ctxt, 0);
+                    xmlOutputBufferWrite(buf, 1, ">");
+                }
+            } else {
+                if (ctxt->format == 1) {
+                    for (tmp = doc->children[cur]; tmp != 0;
+                         tmp = doc->nexts[tmp]) {
+                        if ((doc->types[tmp] == XML_TEXT_NODE) ||
+                            (doc->types[tmp] == XML_CDATA_SECTION_NODE)) {
+                            ctxt->format = 0;
+                            unformattedNode = cur;
+                            break;
+                        }
+                    }
+                }
+                if (ctxt->format == 2)
+                    xmlOutputBufferWriteWSNonSig(ctxt, 1);
+                xmlOutputBufferWrite(buf, 1, ">");
+                if (ctxt->format == 1) xmlOutputBufferWrite(buf, 1, "\n");
+                if (ctxt->level >= 0) ctxt->level++;
+                cur = doc->children[cur];
+                continue;
+            }
+
+            break;
+
+        case XML_TEXT_NODE:
+            if (ctxt->escape)
+                xmlOutputBufferWriteEscape(buf, content, ctxt->escape);
+            else
+                xmlSaveWriteText(ctxt, content, /* flags */ 0);
+	    break;
+
+        case XML_PI_NODE:
+	    if ((cur != root) && (ctxt->format == 1))
+                xmlSaveWriteIndent(ctxt, 0);
+
+            xmlOutputBufferWrite(buf, 2, "<?");
+            xmlOutputBufferWriteString(buf, (const char *) name->name);
+            if (doc->data[cur] != 0) {
+                if (ctxt->format == 2)
+                    xmlOutputBufferWriteWSNonSig(ctxt, 0);
+                else
+                    xmlOutputBufferWrite(buf, 1, " ");
+                xmlOutputBufferWriteString(buf, (const char *) content);
+            } else if (ctxt->format == 2) {
+                xmlOutputBufferWriteWSNonSig(ctxt, 0);
+            }
+            xmlOutputBufferWrite(buf, 2, "?>");
+            break;
+
+        case XML_COMMENT_NODE:
+	    if ((cur != root) && (ctxt->format == 1))
+                xmlSaveWriteIndent(ctxt, 0);
+
+            xmlOutputBufferWrite(buf, 4, "<!--");
+            xmlOutputBufferWriteString(buf, (const char *) content);
+            xmlOutputBufferWrite(buf, 3, "-->");
+            break;
+
+        case XML_CDATA_SECTION_NODE:
+            if (*content == '\0') {
+                xmlOutputBufferWrite(buf, 12, "<![CDATA[]]>");
+            } else {
+                start = end = content;
+                while (*end != '\0') {
+                    if ((*end == ']') && (*(end + 1) == ']') &&
+                        (*(end + 2) == '>')) {
+                        end = end + 2;
+                        xmlOutputBufferWrite(buf, 9, "<![CDATA[");
+                        xmlOutputBufferWrite(buf, end - start,
+                                (const char *)start);
+                        xmlOutputBufferWrite(buf, 3, "]]>");
+                        start = end;
+                    }
+                    end++;
+                }
+                if (start != end) {
+                    xmlOutputBufferWrite(buf, 9, "<![CDATA[");
+                    xmlOutputBufferWriteString(buf, (const char *)start);
+                    xmlOutputBufferWrite(buf, 3, "]]>");
+                }
+            }
+            break;
+
+        case XML_ATTRIBUTE_NODE:
+        case XML_NAMESPACE_DECL:
+            xmlCompactAttrDumpOutput(ctxt, doc, cur);
+            break;
+
+        default:
+            break;
+        }
+
+        while (1) {
+            if (cur == root)
+                return;
+            if (ctxt->format == 1)
+                xmlOutputBufferWrite(buf, 1, "\n");
+            if (doc->nexts[cur] != 0) {
+                cur = doc->nexts[cur];
+                break;
+            }
+
+            cur = doc->parents[cur];
+            name = &doc->nameTab[doc->names[cur]];
+
+            if (ctxt->level > 0) ctxt->level--;
+            if (ctxt->format == 1)
+                xmlSaveWriteIndent(ctxt, 0);
+
+            xmlOutputBufferWrite(buf, 2, "</");
+            xmlCompactWriteQName(buf, name);
+            if (ctxt->format == 2)
+                xmlOutputBufferWriteWSNonSig(ctxt, 0);
+            xmlOutputBufferWrite(buf, 1, ">");
+
+            if (cur == unformattedNode) {
+                ctxt->format = format;
+                unformattedNode = 0;
+            }
+        }
+    }
+}
+
+/**
+ * Dump a compact document. Mirrors the XML case of
+ * xmlSaveDocInternal.
+ *
+ * @param ctxt  the save context
+ * @param doc  the compact document
+ * @param encoding  character encoding (optional)
+ */
+static int
+xmlSaveCompactDocInternal(xmlSaveCtxtPtr ctxt, const xmlCompactDoc *doc,
+                          const xmlChar *encoding) {
+    xmlOutputBufferPtr buf = ctxt->buf;
+    int switched_encoding = 0;
+    unsigned child;
+
+    xmlInitParser();
+
+    if (encoding == NULL)
+	encoding = doc->encoding;
+
+    if ((encoding != NULL) && (ctxt->encoding == NULL)) {
+        if (xmlSaveSwitchEncoding(ctxt, (const char *) encoding) < 0)
+            return(-1);
+        switched_encoding = 1;
+    }
+
+    if ((ctxt->options & XML_SAVE_NO_DECL) == 0) {
+        xmlOutputBufferWrite(buf, 15, "<?xml version=\"");
+        if (doc->version != NULL)
+            xmlOutputBufferWriteString(buf, (char *) doc->version);
+        else
+            xmlOutputBufferWrite(buf, 3, "1.0");
+        xmlOutputBufferWrite(buf, 1, "\"");
+        if (encoding != NULL) {
+            xmlOutputBufferWrite(buf, 11, " encoding=\"");
+            xmlOutputBufferWriteString(buf, (char *) encoding);
+            xmlOutputBufferWrite(buf, 1, "\"");
+        }
+        switch (doc->standalone) {
+            case 0:
+                xmlOutputBufferWrite(buf, 16, " standalone=\"no\"");
+                break;
+            case 1:
+                xmlOutputBufferWrite(buf, 17, " standalone=\"yes\"");
+                break;
+        }
+        xmlOutputBufferWrite(buf, 3, "?>\n");
+    }
+
+    for (child = doc->children[XML_COMPACT_DOC_NODE]; child != 0;
+         child = doc->nexts[child]) {
+        ctxt->level = 0;
+        xmlCompactDumpOutputInternal(ctxt, doc, child);
+        xmlOutputBufferWrite(buf, 1, "\n");
+    }
+
+    if (switched_encoding) {
+	xmlSaveClearEncoding(ctxt);
+    }
+
+    return(0);
+}
+
 #ifdef LIBXML_HTML_ENABLED
 /************************************************************************
  *									*
@@ -1541,6 +1842,9 @@ xhtmlNodeDumpOutput(xmlSaveCtxtPtr ctxt, xmlNodePtr cur) {
 	    if ((cur != root) && (ctxt->format == 1))
                 xmlSaveWriteIndent(ctxt, 0);
 
+            if (XML_LAZY_DOC(cur->doc))
+                xmlLazyMaterialize(cur, XML_LAZY_ATTRS | XML_LAZY_CONTENT);
+
             /*
              * Some users like lxml are known to pass nodes with a corrupted
              * tree structure. Fall back to a recursive call to handle this
@@ -1997,6 +2301,50 @@ xmlSaveTree(xmlSaveCtxt *ctxt, xmlNode *cur)
     return(ret);
 }
 
+/**
+ * Serialize a compact document, see #xmlSaveDoc.
+ *
+ * Compact documents don't keep the DTD, so the document type
+ * declaration is omitted and entity references appear substituted.
+ * Otherwise, the output is the same as for a regular document
+ * parsed with XML_PARSE_NOENT.
+ *
+ * @since 2.16.0
+ *
+ * @param ctxt  a document saving context
+ * @param doc  a compact document
+ * @returns 0 on success or -1 in case of error.
+ */
+long
+xmlSaveCompactDoc(xmlSaveCtxt *ctxt, const xmlCompactDoc *doc)
+{
+    if ((ctxt == NULL) || (doc == NULL)) return(-1);
+    if (xmlSaveCompactDocInternal(ctxt, doc, ctxt->encoding) < 0)
+        return(-1);
+    return(0);
+}
+
+/**
+ * Serialize a subtree of a compact document, see #xmlSaveTree.
+ *
+ * @since 2.16.0
+ *
+ * @param ctxt  a document saving context
+ * @param doc  a compact document
+ * @param node  the root of the subtree to save
+ * @returns 0 on success or -1 in case of error.
+ */
+long
+xmlSaveCompactTree(xmlSaveCtxt *ctxt, const xmlCompactDoc *doc,
+                   unsigned node)
+{
+    if ((ctxt == NULL) || (doc == NULL) ||
+        (node == 0) || (node >= doc->nbNodes))
+        return(-1);
+    xmlCompactDumpOutputInternal(ctxt, doc, node);
+    return(0);
+}
+
 /**
  * Serialize a notation declaration.
  *
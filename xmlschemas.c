@@ -55,6 +55,7 @@
 
 #ifdef LIBXML_SCHEMAS_ENABLED
 
+#include <stdlib.h>
 #include <string.h>
 #include <libxml/xmlmemory.h>
 #include <libxml/parser.h>
@@ -79,6 +80,7 @@
 #include "private/error.h"
 #include "private/memory.h"
 #include "private/string.h"
+#include "private/threads.h"
 
 /* #define WXS_ELEM_DECL_CONS_ENABLED */
 
@@ -779,6 +781,8 @@ struct _xmlSchemaPSVIIDCBinding {
     int nbNodes; /* number of entries in the node table */
     int sizeNodes; /* size of the node table */
     xmlSchemaItemListPtr dupls;
+    xmlHashTablePtr htab; /* hashed key-sequences of the node table */
+    xmlHashTablePtr duplsHtab; /* hashed key-sequences of the duplicates */
 };
 
 
@@ -929,6 +933,19 @@ struct _xmlSchemaAttrInfo {
 
 
 #define XML_SCHEMA_VALID_CTXT_FLAG_STREAM 1
+
+/**
+ * An error buffered during parallel validation
+ */
+typedef struct _xmlSchemaBufferedError xmlSchemaBufferedError;
+typedef xmlSchemaBufferedError *xmlSchemaBufferedErrorPtr;
+struct _xmlSchemaBufferedError {
+    int job;       /* index of the subtree being validated */
+    int source;    /* 0 for the main context, 1 for workers */
+    int seq;       /* sequence number */
+    xmlError error;
+};
+
 /**
  * A Schemas validation context
  */
@@ -1004,6 +1021,18 @@ struct _xmlSchemaValidCtxt {
     /* Locator for error reporting in streaming mode */
     xmlSchemaValidityLocatorFunc locFunc;
     void *locCtxt;
+
+    /* Declaration and type of the validation root if already known */
+    int presetRoot;
+    xmlSchemaElementPtr rootDecl;
+    xmlSchemaTypePtr rootType;
+
+    /* Errors buffered during parallel validation */
+    int bufferErrors;
+    int bufJob;
+    xmlSchemaBufferedErrorPtr bufErrors;
+    int nbBufErrors;
+    int sizeBufErrors;
 };
 
 typedef struct _xmlSchemaSubstGroup xmlSchemaSubstGroup;
@@ -2006,6 +2035,68 @@ xmlSchemaVErrMemory(xmlSchemaValidCtxtPtr ctxt)
     xmlRaiseMemoryError(schannel, channel, data, XML_FROM_SCHEMASV, NULL);
 }
 
+/**
+ * Structured error handler storing errors of a validation context
+ * which are replayed later in document order.
+ *
+ * @param data  the validation context
+ * @param error  the error
+ */
+static void
+xmlSchemaVBufferError(void *data, const xmlError *error) {
+    xmlSchemaValidCtxtPtr vctxt = data;
+    xmlSchemaBufferedErrorPtr buf;
+
+    if (vctxt->nbBufErrors >= vctxt->sizeBufErrors) {
+        xmlSchemaBufferedErrorPtr tmp;
+        int newSize;
+
+        newSize = xmlGrowCapacity(vctxt->sizeBufErrors, sizeof(tmp[0]),
+                                  16, XML_MAX_ITEMS);
+        if (newSize < 0) {
+            xmlSchemaVErrMemory(vctxt);
+            return;
+        }
+        tmp = xmlRealloc(vctxt->bufErrors, newSize * sizeof(tmp[0]));
+        if (tmp == NULL) {
+            xmlSchemaVErrMemory(vctxt);
+            return;
+        }
+        vctxt->bufErrors = tmp;
+        vctxt->sizeBufErrors = newSize;
+    }
+
+    buf = &vctxt->bufErrors[vctxt->nbBufErrors];
+    memset(buf, 0, sizeof(*buf));
+    if (xmlCopyError(error, &buf->error) < 0) {
+        xmlResetError(&buf->error);
+        xmlSchemaVErrMemory(vctxt);
+        return;
+    }
+    buf->job = vctxt->bufJob;
+    /* Errors in a subtree follow the content model errors of its root */
+    buf->source = vctxt->presetRoot;
+    buf->seq = vctxt->nbBufErrors;
+    vctxt->nbBufErrors += 1;
+}
+
+/**
+ * Free the buffered errors of a validation context.
+ *
+ * @param vctxt  the schema validation context
+ */
+static void
+xmlSchemaVFreeBufferedErrors(xmlSchemaValidCtxtPtr vctxt) {
+    int i;
+
+    for (i = 0; i < vctxt->nbBufErrors; i++)
+        xmlResetError(&vctxt->bufErrors[i].error);
+    xmlFree(vctxt->bufErrors);
+    vctxt->bufErrors = NULL;
+    vctxt->nbBufErrors = 0;
+    vctxt->sizeBufErrors = 0;
+}
+
 static void LIBXML_ATTR_FORMAT(11,12)
 xmlSchemaVErrFull(xmlSchemaValidCtxtPtr ctxt, xmlNodePtr node, int code,
                   xmlErrorLevel level, const char *file, int line,
@@ -2033,7 +2124,11 @@ xmlSchemaVErrFull(xmlSchemaValidCtxtPtr ctxt, xmlNodePtr node, int code,
         schannel = ctxt->serror;
     }
 
-    if ((channel == NULL) && (schannel == NULL)) {
+    if ((ctxt != NULL) && (ctxt->bufferErrors)) {
+        schannel = xmlSchemaVBufferError;
+        channel = NULL;
+        data = ctxt;
+    } else if ((channel == NULL) && (schannel == NULL)) {
         channel = xmlGenericError;
         data = xmlGenericErrorContext;
     }
@@ -12217,6 +12312,8 @@ xmlSchemaNewDocParserCtxt(xmlDoc *doc)
 
     if (doc == NULL)
       return (NULL);
+    if (xmlNodeMaterialize((xmlNodePtr) doc) < 0)
+        return (NULL);
     ret = xmlSchemaParserCtxtCreate();
     if (ret == NULL)
 	return(NULL);
@@ -21808,6 +21905,17 @@ xmlSchemaIDCFreeKey(xmlSchemaPSVIIDCKeyPtr key)
     xmlFree(key);
 }
 
+static void
+xmlFreeIDCHashEntry (void *payload, const xmlChar *name ATTRIBUTE_UNUSED)
+{
+    xmlIDCHashEntryPtr e = payload, n;
+    while (e) {
+	n = e->next;
+	xmlFree(e);
+	e = n;
+    }
+}
+
 /**
  * Frees an IDC binding. Note that the node table-items
  * are not freed.
@@ -21819,6 +21927,10 @@ xmlSchemaIDCFreeBinding(xmlSchemaPSVIIDCBindingPtr bind)
 	xmlFree(bind->nodeTable);
     if (bind->dupls != NULL)
 	xmlSchemaItemListFree(bind->dupls);
+    if (bind->htab != NULL)
+	xmlHashFree(bind->htab, xmlFreeIDCHashEntry);
+    if (bind->duplsHtab != NULL)
+	xmlHashFree(bind->duplsHtab, xmlFreeIDCHashEntry);
     xmlFree(bind);
 }
 
@@ -21839,17 +21951,6 @@ xmlSchemaIDCFreeIDCTable(xmlSchemaPSVIIDCBindingPtr bind)
     }
 }
 
-static void
-xmlFreeIDCHashEntry (void *payload, const xmlChar *name ATTRIBUTE_UNUSED)
-{
-    xmlIDCHashEntryPtr e = payload, n;
-    while (e) {
-	n = e->next;
-	xmlFree(e);
-	e = n;
-    }
-}
-
 /**
  * Frees a list of IDC matchers.
  *
@@ -22189,6 +22290,214 @@ xmlSchemaHashKeySequence(xmlSchemaValidCtxtPtr vctxt,
     return xmlSchemaFormatIDCKeySequence_1(vctxt, buf, seq, count, 1);
 }
 
+/**
+ * Adds an item to a hash table of key-sequences. Items with the
+ * same hash key are chained.
+ *
+ * @param vctxt  the WXS validation context
+ * @param table  the hash table, created if NULL
+ * @param hkey  the hash key of the item's key-sequence
+ * @param index  the index of the item
+ * @returns 0 on success and -1 on internal errors.
+ */
+static int
+xmlSchemaIDCHashAdd(xmlSchemaValidCtxtPtr vctxt, xmlHashTablePtr *table,
+		    const xmlChar *hkey, int index)
+{
+    xmlIDCHashEntryPtr r, e;
+
+    if (*table == NULL) {
+	*table = xmlHashCreate(0);
+	if (*table == NULL) {
+	    xmlSchemaVErrMemory(vctxt);
+	    return (-1);
+	}
+    }
+    e = xmlMalloc(sizeof(*e));
+    if (e == NULL) {
+	xmlSchemaVErrMemory(vctxt);
+	return (-1);
+    }
+    e->index = index;
+    r = xmlHashLookup(*table, hkey);
+    if (r != NULL) {
+	e->next = r->next;
+	r->next = e;
+    } else {
+	e->next = NULL;
+	if (xmlHashAddEntry(*table, hkey, e) < 0) {
+	    xmlSchemaVErrMemory(vctxt);
+	    xmlFree(e);
+	    return (-1);
+	}
+    }
+    return (0);
+}
+
+/**
+ * Looks up an item with an equal key-sequence in a hash table of
+ * key-sequences.
+ *
+ * @param table  the hash table or NULL
+ * @param items  the items indexed by the table
+ * @param hkey  the hash key of the key-sequence
+ * @param keys  the key-sequence
+ * @param nbFields  the number of keys
+ * @returns the index of the item, -1 if no item was found and -2
+ * on internal errors.
+ */
+static int
+xmlSchemaIDCHashFind(xmlHashTablePtr table, xmlSchemaPSVIIDCNodePtr *items,
+		     const xmlChar *hkey, xmlSchemaPSVIIDCKeyPtr *keys,
+		     int nbFields)
+{
+    xmlIDCHashEntryPtr e;
+    xmlSchemaPSVIIDCKeyPtr *ikeys;
+    int k, res;
+
+    if (table == NULL)
+	return (-1);
+    for (e = xmlHashLookup(table, hkey); e != NULL; e = e->next) {
+	ikeys = items[e->index]->keys;
+	res = 1;
+	for (k = 0; k < nbFields; k++) {
+	    res = xmlSchemaAreValuesEqual(keys[k]->val, ikeys[k]->val);
+	    if (res == -1)
+		return (-2);
+	    if (res == 0)
+		break;
+	}
+	if (res == 1)
+	    return (e->index);
+    }
+    return (-1);
+}
+
+/**
+ * Changes the index of an item in a hash table of key-sequences or
+ * removes the item if `to` is negative.
+ *
+ * @param table  the hash table
+ * @param hkey  the hash key of the item's key-sequence
+ * @param from  the old index of the item
+ * @param to  the new index of the item
+ */
+static void
+xmlSchemaIDCHashMove(xmlHashTablePtr table, const xmlChar *hkey,
+		     int from, int to)
+{
+    xmlIDCHashEntryPtr e, prev = NULL;
+
+    for (e = xmlHashLookup(table, hkey); e != NULL; e = e->next) {
+	if (e->index == from)
+	    break;
+	prev = e;
+    }
+    if (e == NULL)
+	return;
+    if (to >= 0) {
+	e->index = to;
+	return;
+    }
+    if (prev != NULL)
+	prev->next = e->next;
+    else if (e->next != NULL)
+	xmlHashUpdateEntry(table, hkey, e->next, NULL);
+    else
+	xmlHashRemoveEntry(table, hkey, NULL);
+    xmlFree(e);
+}
+
+/**
+ * Creates the hash tables of the node-table and the duplicates of
+ * an IDC binding if they don't exist yet. Once created, the tables
+ * must be updated whenever entries are added or removed.
+ *
+ * @param vctxt  the WXS validation context
+ * @param bind  the IDC binding
+ * @returns 0 on success and -1 on internal errors.
+ */
+static int
+xmlSchemaIDCIndexBinding(xmlSchemaValidCtxtPtr vctxt,
+			 xmlSchemaPSVIIDCBindingPtr bind)
+{
+    xmlSchemaPSVIIDCNodePtr item;
+    xmlChar *hkey = NULL;
+    int nbFields = bind->definition->nbFields;
+    int i;
+
+    if ((bind->htab == NULL) && (bind->nbNodes > 0)) {
+	for (i = 0; i < bind->nbNodes; i++) {
+	    xmlSchemaHashKeySequence(vctxt, &hkey, bind->nodeTable[i]->keys,
+		nbFields);
+	    if ((hkey == NULL) ||
+		(xmlSchemaIDCHashAdd(vctxt, &bind->htab, hkey, i) < 0))
+		goto error;
+	    FREE_AND_NULL(hkey);
+	}
+    }
+    if ((bind->duplsHtab == NULL) && (! WXS_ILIST_IS_EMPTY(bind->dupls))) {
+	for (i = 0; i < bind->dupls->nbItems; i++) {
+	    item = bind->dupls->items[i];
+	    xmlSchemaHashKeySequence(vctxt, &hkey, item->keys, nbFields);
+	    if ((hkey == NULL) ||
+		(xmlSchemaIDCHashAdd(vctxt, &bind->duplsHtab, hkey, i) < 0))
+		goto error;
+	    FREE_AND_NULL(hkey);
+	}
+    }
+    return (0);
+
+error:
+    FREE_AND_NULL(hkey);
+    return (-1);
+}
+
+/**
+ * Moves the node-table entry at index `j` of an IDC binding to the
+ * list of duplicates. The last node-table entry takes its place.
+ *
+ * @param vctxt  the WXS validation context
+ * @param bind  the indexed IDC binding
+ * @param j  the index of the node-table entry
+ * @param hkey  the hash key of the entry's key-sequence
+ * @returns 0 on success and -1 on internal errors.
+ */
+static int
+xmlSchemaIDCBindingAddDupl(xmlSchemaValidCtxtPtr vctxt,
+			   xmlSchemaPSVIIDCBindingPtr bind,
+			   int j, const xmlChar *hkey)
+{
+    xmlSchemaPSVIIDCNodePtr item = bind->nodeTable[j];
+    int last = bind->nbNodes - 1;
+
+    if (bind->dupls == NULL) {
+	bind->dupls = xmlSchemaItemListCreate();
+	if (bind->dupls == NULL)
+	    return (-1);
+    }
+    if (xmlSchemaItemListAdd(bind->dupls, item) == -1)
+	return (-1);
+    if (xmlSchemaIDCHashAdd(vctxt, &bind->duplsHtab, hkey,
+			    bind->dupls->nbItems - 1) < 0)
+	return (-1);
+
+    xmlSchemaIDCHashMove(bind->htab, hkey, j, -1);
+    if (j != last) {
+	xmlChar *lastKey = NULL;
+
+	xmlSchemaHashKeySequence(vctxt, &lastKey,
+	    bind->nodeTable[last]->keys, bind->definition->nbFields);
+	if (lastKey == NULL)
+	    return (-1);
+	xmlSchemaIDCHashMove(bind->htab, lastKey, last, j);
+	xmlFree(lastKey);
+	bind->nodeTable[j] = bind->nodeTable[last];
+    }
+    bind->nbNodes--;
+    return (0);
+}
+
 /**
  * Pops all XPath states.
  *
@@ -22449,7 +22758,7 @@ create_key:
 	    xmlSchemaIDCMatcherPtr matcher;
 	    xmlSchemaIDCPtr idc;
 	    xmlSchemaItemListPtr targets;
-	    int pos, i, j, nbKeys;
+	    int pos, i, nbKeys;
 	    /*
 	    * Here we have the following scenario:
 	    * An IDC 'selector' state object resolved to a target node,
@@ -22520,49 +22829,20 @@ create_key:
                 return(-1);
 
 	    if ((idc->type != XML_SCHEMA_TYPE_IDC_KEYREF) &&
-		(targets->nbItems != 0)) {
-		xmlSchemaPSVIIDCKeyPtr ckey, bkey, *bkeySeq;
-		xmlIDCHashEntryPtr e;
-
-		res = 0;
-
-		if (!matcher->htab)
-		    e = NULL;
-		else {
-		    xmlChar *value = NULL;
-		    xmlSchemaHashKeySequence(vctxt, &value, *keySeq, nbKeys);
-		    e = xmlHashLookup(matcher->htab, value);
-		    FREE_AND_NULL(value);
-		}
+		(matcher->htab != NULL)) {
+		xmlChar *value = NULL;
 
 		/*
 		* Compare the key-sequences, key by key.
 		*/
-		for (;e; e = e->next) {
-		    bkeySeq =
-			((xmlSchemaPSVIIDCNodePtr) targets->items[e->index])->keys;
-		    for (j = 0; j < nbKeys; j++) {
-			ckey = (*keySeq)[j];
-			bkey = bkeySeq[j];
-			res = xmlSchemaAreValuesEqual(ckey->val, bkey->val);
-			if (res == -1) {
-			    return (-1);
-			} else if (res == 0) {
-			    /*
-			    * One of the keys differs, so the key-sequence
-			    * won't be equal; get out.
-			    */
-			    break;
-			}
-		    }
-		    if (res == 1) {
-			/*
-			* Duplicate key-sequence found.
-			*/
-			break;
-		    }
-		}
-		if (e) {
+		xmlSchemaHashKeySequence(vctxt, &value, *keySeq, nbKeys);
+		res = xmlSchemaIDCHashFind(matcher->htab,
+		    (xmlSchemaPSVIIDCNodePtr *) targets->items,
+		    value, *keySeq, nbKeys);
+		FREE_AND_NULL(value);
+		if (res == -2)
+		    return (-1);
+		if (res >= 0) {
 		    xmlChar *str = NULL, *strB = NULL;
 		    /*
 		    * TODO: Try to report the key-sequence.
@@ -22641,28 +22921,13 @@ create_key:
 	    }
 	    if (idc->type != XML_SCHEMA_TYPE_IDC_KEYREF) {
 		xmlChar *value = NULL;
-		xmlIDCHashEntryPtr r, e;
-		if (!matcher->htab)
-		  matcher->htab = xmlHashCreate(4);
+
 		xmlSchemaHashKeySequence(vctxt, &value, ntItem->keys, nbKeys);
-		e = xmlMalloc(sizeof *e);
-                if (e == NULL) {
-                    xmlSchemaVErrMemory(vctxt);
-                    goto mem_error;
-                }
-		e->index = targets->nbItems - 1;
-		r = xmlHashLookup(matcher->htab, value);
-		if (r) {
-		    e->next = r->next;
-		    r->next = e;
-		} else {
-		    e->next = NULL;
-		    if (xmlHashAddEntry(matcher->htab, value, e) < 0) {
-                        xmlSchemaVErrMemory(vctxt);
-                        xmlFree(e);
-                    }
-		}
-mem_error:
+		if (value == NULL)
+		    xmlSchemaVErrMemory(vctxt);
+		else
+		    xmlSchemaIDCHashAdd(vctxt, &matcher->htab, value,
+			targets->nbItems - 1);
 		FREE_AND_NULL(value);
 	    }
 
@@ -22842,9 +23107,10 @@ xmlSchemaIDCFillNodeTables(xmlSchemaValidCtxtPtr vctxt,
 			   xmlSchemaNodeInfoPtr ielem)
 {
     xmlSchemaPSVIIDCBindingPtr bind;
-    int res, i, j, k, nbTargets, nbFields, nbDupls, nbNodeTable;
-    xmlSchemaPSVIIDCKeyPtr *keys, *ntkeys;
-    xmlSchemaPSVIIDCNodePtr *targets, *dupls;
+    int i, j, nbTargets, nbFields, nbDupls, nbNodeTable;
+    xmlSchemaPSVIIDCKeyPtr *keys;
+    xmlSchemaPSVIIDCNodePtr *targets;
+    xmlChar *hkey = NULL;
 
     xmlSchemaIDCMatcherPtr matcher = ielem->idcMatchers;
     /* vctxt->createIDCNodeTables */
@@ -22876,13 +23142,10 @@ xmlSchemaIDCFillNodeTables(xmlSchemaValidCtxtPtr vctxt,
 	if (bind == NULL)
 	   goto internal_error;
 
-	if (! WXS_ILIST_IS_EMPTY(bind->dupls)) {
-	    dupls = (xmlSchemaPSVIIDCNodePtr *) bind->dupls->items;
+	if (! WXS_ILIST_IS_EMPTY(bind->dupls))
 	    nbDupls = bind->dupls->nbItems;
-	} else {
-	    dupls = NULL;
+	else
 	    nbDupls = 0;
-	}
 	if (bind->nodeTable != NULL) {
 	    nbNodeTable = bind->nbNodes;
 	} else {
@@ -22903,131 +23166,77 @@ xmlSchemaIDCFillNodeTables(xmlSchemaValidCtxtPtr vctxt,
 	    matcher->targets->items = NULL;
 	    matcher->targets->sizeItems = 0;
 	    matcher->targets->nbItems = 0;
-	    if (matcher->htab) {
-		xmlHashFree(matcher->htab, xmlFreeIDCHashEntry);
-		matcher->htab = NULL;
-	    }
+	    /*
+	    * The hash table of the targets indexes the node-table now.
+	    */
+	    if (bind->htab != NULL)
+		xmlHashFree(bind->htab, xmlFreeIDCHashEntry);
+	    bind->htab = matcher->htab;
+	    matcher->htab = NULL;
 	} else {
 	    /*
 	    * Compare the key-sequences and add to the IDC node-table.
 	    */
+	    if (xmlSchemaIDCIndexBinding(vctxt, bind) < 0)
+		goto internal_error;
 	    nbTargets = matcher->targets->nbItems;
 	    targets = (xmlSchemaPSVIIDCNodePtr *) matcher->targets->items;
 	    nbFields = matcher->aidc->def->nbFields;
-	    i = 0;
-	    do {
+	    for (i = 0; i < nbTargets; i++) {
 		keys = targets[i]->keys;
-		if (nbDupls) {
-		    /*
-		    * Search in already found duplicates first.
-		    */
-		    j = 0;
-		    do {
-			if (nbFields == 1) {
-			    res = xmlSchemaAreValuesEqual(keys[0]->val,
-				dupls[j]->keys[0]->val);
-			    if (res == -1)
-				goto internal_error;
-			    if (res == 1) {
-				/*
-				* Equal key-sequence.
-				*/
-				goto next_target;
-			    }
-			} else {
-			    res = 0;
-			    ntkeys = dupls[j]->keys;
-			    for (k = 0; k < nbFields; k++) {
-				res = xmlSchemaAreValuesEqual(keys[k]->val,
-				    ntkeys[k]->val);
-				if (res == -1)
-				    goto internal_error;
-				if (res == 0) {
-				    /*
-				    * One of the keys differs.
-				    */
-				    break;
-				}
-			    }
-			    if (res == 1) {
-				/*
-				* Equal key-sequence found.
-				*/
-				goto next_target;
-			    }
-			}
-			j++;
-		    } while (j < nbDupls);
+		xmlSchemaHashKeySequence(vctxt, &hkey, keys, nbFields);
+		if (hkey == NULL) {
+		    xmlSchemaVErrMemory(vctxt);
+		    goto internal_error;
 		}
-		if (bind->nbNodes) {
-		    j = 0;
-		    do {
-			if (nbFields == 1) {
-			    res = xmlSchemaAreValuesEqual(keys[0]->val,
-				bind->nodeTable[j]->keys[0]->val);
-			    if (res == -1)
-				goto internal_error;
-			    if (res == 0) {
-				/*
-				* The key-sequence differs.
-				*/
-				goto next_node_table_entry;
-			    }
-			} else {
-			    res = 0;
-			    ntkeys = bind->nodeTable[j]->keys;
-			    for (k = 0; k < nbFields; k++) {
-				res = xmlSchemaAreValuesEqual(keys[k]->val,
-				    ntkeys[k]->val);
-				if (res == -1)
-				    goto internal_error;
-				if (res == 0) {
-				    /*
-				    * One of the keys differs.
-				    */
-				    goto next_node_table_entry;
-				}
-			    }
-			}
-			/*
-			* Add the duplicate to the list of duplicates.
-			*/
-			if (bind->dupls == NULL) {
-			    bind->dupls = xmlSchemaItemListCreate();
-			    if (bind->dupls == NULL)
-				goto internal_error;
-			}
-			if (xmlSchemaItemListAdd(bind->dupls, bind->nodeTable[j]) == -1)
-			    goto internal_error;
-                        dupls = (xmlSchemaPSVIIDCNodePtr *) bind->dupls->items;
+		/*
+		* Search in already found duplicates first.
+		*/
+		if (bind->dupls != NULL) {
+		    j = xmlSchemaIDCHashFind(bind->duplsHtab,
+			(xmlSchemaPSVIIDCNodePtr *) bind->dupls->items,
+			hkey, keys, nbFields);
+		    if (j == -2)
+			goto internal_error;
+		    if (j >= 0) {
 			/*
-			* Remove the duplicate entry from the IDC node-table.
+			* Equal key-sequence.
 			*/
-			bind->nodeTable[j] = bind->nodeTable[bind->nbNodes -1];
-			bind->nbNodes--;
-
-			goto next_target;
-
-next_node_table_entry:
-			j++;
-		    } while (j < bind->nbNodes);
+			FREE_AND_NULL(hkey);
+			continue;
+		    }
 		}
-		/*
-		* If everything is fine, then add the IDC target-node to
-		* the IDC node-table.
-		*/
-		if (xmlSchemaIDCAppendNodeTableItem(bind, targets[i]) == -1)
+		j = xmlSchemaIDCHashFind(bind->htab, bind->nodeTable,
+		    hkey, keys, nbFields);
+		if (j == -2)
 		    goto internal_error;
-
-next_target:
-		i++;
-	    } while (i < nbTargets);
+		if (j >= 0) {
+		    /*
+		    * Move the duplicate entry from the IDC node-table
+		    * to the list of duplicates.
+		    */
+		    if (xmlSchemaIDCBindingAddDupl(vctxt, bind, j, hkey) < 0)
+			goto internal_error;
+		} else {
+		    /*
+		    * If everything is fine, then add the IDC target-node to
+		    * the IDC node-table.
+		    */
+		    if ((xmlSchemaIDCAppendNodeTableItem(bind,
+			    targets[i]) == -1) ||
+			(xmlSchemaIDCHashAdd(vctxt, &bind->htab, hkey,
+			    bind->nbNodes - 1) < 0))
+			goto internal_error;
+		}
+		FREE_AND_NULL(hkey);
+	    }
 	}
 	matcher = matcher->next;
     }
     return(0);
 
 internal_error:
+    FREE_AND_NULL(hkey);
     return(-1);
 }
 
@@ -23045,9 +23254,10 @@ xmlSchemaBubbleIDCNodeTables(xmlSchemaValidCtxtPtr vctxt)
 {
     xmlSchemaPSVIIDCBindingPtr bind; /* IDC bindings of the current node. */
     xmlSchemaPSVIIDCBindingPtr *parTable, parBind = NULL; /* parent IDC bindings. */
-    xmlSchemaPSVIIDCNodePtr node, parNode = NULL, *dupls, *parNodes; /* node-table entries. */
+    xmlSchemaPSVIIDCNodePtr node; /* node-table entries. */
     xmlSchemaIDCAugPtr aidc;
-    int i, j, k, ret = 0, nbFields, oldNum, oldDupls;
+    xmlChar *hkey = NULL;
+    int i, j, nbFields;
 
     bind = vctxt->inode->idcTable;
     if (bind == NULL) {
@@ -23098,160 +23308,63 @@ xmlSchemaBubbleIDCNodeTables(xmlSchemaValidCtxtPtr vctxt)
 	    * Compare every node-table entry of the child node,
 	    * i.e. the key-sequence within, ...
 	    */
-	    oldNum = parBind->nbNodes; /* Skip newly added items. */
-
-	    if (! WXS_ILIST_IS_EMPTY(parBind->dupls)) {
-		oldDupls = parBind->dupls->nbItems;
-		dupls = (xmlSchemaPSVIIDCNodePtr *) parBind->dupls->items;
-	    } else {
-		dupls = NULL;
-		oldDupls = 0;
-	    }
-
-	    parNodes = parBind->nodeTable;
+	    if (xmlSchemaIDCIndexBinding(vctxt, parBind) < 0)
+		goto internal_error;
 	    nbFields = bind->definition->nbFields;
 
 	    for (i = 0; i < bind->nbNodes; i++) {
 		node = bind->nodeTable[i];
 		if (node == NULL)
 		    continue;
+		xmlSchemaHashKeySequence(vctxt, &hkey, node->keys, nbFields);
+		if (hkey == NULL) {
+		    xmlSchemaVErrMemory(vctxt);
+		    goto internal_error;
+		}
 		/*
 		* ...with every key-sequence of the parent node, already
 		* evaluated to be a duplicate key-sequence.
 		*/
-		if (oldDupls) {
-		    j = 0;
-		    while (j < oldDupls) {
-			if (nbFields == 1) {
-			    ret = xmlSchemaAreValuesEqual(
-				node->keys[0]->val,
-				dupls[j]->keys[0]->val);
-			    if (ret == -1)
-				goto internal_error;
-			    if (ret == 0) {
-				j++;
-				continue;
-			    }
-			} else {
-			    parNode = dupls[j];
-			    for (k = 0; k < nbFields; k++) {
-				ret = xmlSchemaAreValuesEqual(
-				    node->keys[k]->val,
-				    parNode->keys[k]->val);
-				if (ret == -1)
-				    goto internal_error;
-				if (ret == 0)
-				    break;
-			    }
-			}
-			if (ret == 1)
-			    /* Duplicate found. */
-			    break;
-			j++;
-		    }
-		    if (j != oldDupls) {
+		if (parBind->dupls != NULL) {
+		    j = xmlSchemaIDCHashFind(parBind->duplsHtab,
+			(xmlSchemaPSVIIDCNodePtr *) parBind->dupls->items,
+			hkey, node->keys, nbFields);
+		    if (j == -2)
+			goto internal_error;
+		    if (j >= 0) {
 			/* Duplicate found. Skip this entry. */
+			FREE_AND_NULL(hkey);
 			continue;
 		    }
 		}
 		/*
 		* ... and with every key-sequence of the parent node.
+		* The entries of the child node are distinct, so entries
+		* added by this loop never match.
 		*/
-		if (oldNum) {
-		    j = 0;
-		    while (j < oldNum) {
-			parNode = parNodes[j];
-			if (nbFields == 1) {
-			    ret = xmlSchemaAreValuesEqual(
-				node->keys[0]->val,
-				parNode->keys[0]->val);
-			    if (ret == -1)
-				goto internal_error;
-			    if (ret == 0) {
-				j++;
-				continue;
-			    }
-			} else {
-			    for (k = 0; k < nbFields; k++) {
-				ret = xmlSchemaAreValuesEqual(
-				    node->keys[k]->val,
-				    parNode->keys[k]->val);
-				if (ret == -1)
-				    goto internal_error;
-				if (ret == 0)
-				    break;
-			    }
-			}
-			if (ret == 1)
-			    /* Duplicate found. */
-			    break;
-			j++;
-		    }
-		    if (j != oldNum) {
-			/*
-			* Handle duplicates. Move the duplicate in
-			* the parent's node-table to the list of
-			* duplicates.
-			*/
-			oldNum--;
-			parBind->nbNodes--;
-			/*
-			* Move last old item to pos of duplicate.
-			*/
-			parNodes[j] = parNodes[oldNum];
-
-			if (parBind->nbNodes != oldNum) {
-			    /*
-			    * If new items exist, move last new item to
-			    * last of old items.
-			    */
-			    parNodes[oldNum] =
-				parNodes[parBind->nbNodes];
-			}
-			if (parBind->dupls == NULL) {
-			    parBind->dupls = xmlSchemaItemListCreate();
-			    if (parBind->dupls == NULL)
-				goto internal_error;
-			}
-			xmlSchemaItemListAdd(parBind->dupls, parNode);
-		        dupls = (xmlSchemaPSVIIDCNodePtr *)
-                            parBind->dupls->items;
-		    } else {
-			/*
-			* Add the node-table entry (node and key-sequence) of
-			* the child node to the node table of the parent node.
-			*/
-                        if (parBind->nbNodes >= parBind->sizeNodes) {
-                            xmlSchemaPSVIIDCNodePtr *tmp;
-                            int newSize;
-
-                            newSize = xmlGrowCapacity(parBind->sizeNodes,
-                                                      sizeof(tmp[0]),
-                                                      10, XML_MAX_ITEMS);
-                            if (newSize < 0) {
-                                xmlSchemaVErrMemory(vctxt);
-                                goto internal_error;
-                            }
-                            tmp = xmlRealloc(parBind->nodeTable,
-                                             newSize * sizeof(tmp[0]));
-                            if (tmp == NULL) {
-                                xmlSchemaVErrMemory(vctxt);
-                                goto internal_error;
-                            }
-
-                            parBind->nodeTable = tmp;
-                            parBind->sizeNodes = newSize;
-			}
-			parNodes = parBind->nodeTable;
-			/*
-			* Append the new node-table entry to the 'new node-table
-			* entries' section.
-			*/
-			parNodes[parBind->nbNodes++] = node;
-		    }
-
+		j = xmlSchemaIDCHashFind(parBind->htab, parBind->nodeTable,
+		    hkey, node->keys, nbFields);
+		if (j == -2)
+		    goto internal_error;
+		if (j >= 0) {
+		    /*
+		    * Handle duplicates. Move the duplicate in
+		    * the parent's node-table to the list of
+		    * duplicates.
+		    */
+		    if (xmlSchemaIDCBindingAddDupl(vctxt, parBind, j, hkey) < 0)
+			goto internal_error;
+		} else {
+		    /*
+		    * Add the node-table entry (node and key-sequence) of
+		    * the child node to the node table of the parent node.
+		    */
+		    if ((xmlSchemaIDCAppendNodeTableItem(parBind, node) == -1) ||
+			(xmlSchemaIDCHashAdd(vctxt, &parBind->htab, hkey,
+			    parBind->nbNodes - 1) < 0))
+			goto internal_error;
 		}
-
+		FREE_AND_NULL(hkey);
 	    }
 	} else {
 	    /*
@@ -23283,6 +23396,8 @@ xmlSchemaBubbleIDCNodeTables(xmlSchemaValidCtxtPtr vctxt)
 		    bind->sizeNodes = 0;
 		    parBind->nbNodes = bind->nbNodes;
 		    bind->nbNodes = 0;
+		    parBind->htab = bind->htab;
+		    bind->htab = NULL;
 		} else {
 		    /*
 		    * Copy the entries.
@@ -23309,6 +23424,8 @@ xmlSchemaBubbleIDCNodeTables(xmlSchemaValidCtxtPtr vctxt)
 		    xmlSchemaItemListFree(parBind->dupls);
 		parBind->dupls = bind->dupls;
 		bind->dupls = NULL;
+		parBind->duplsHtab = bind->duplsHtab;
+		bind->duplsHtab = NULL;
 	    }
             if (parTable != NULL) {
                 if (*parTable == NULL)
@@ -23326,6 +23443,7 @@ next_binding:
     return (0);
 
 internal_error:
+    FREE_AND_NULL(hkey);
     return(-1);
 }
 
@@ -23349,10 +23467,8 @@ xmlSchemaCheckCVCIDCKeyRef(xmlSchemaValidCtxtPtr vctxt)
 	    matcher->targets &&
 	    matcher->targets->nbItems)
 	{
-	    int i, j, k, res, nbFields, hasDupls;
-	    xmlSchemaPSVIIDCKeyPtr *refKeys, *keys;
+	    int i, j, res, nbFields;
 	    xmlSchemaPSVIIDCNodePtr refNode = NULL;
-	    xmlHashTablePtr table = NULL;
 
 	    nbFields = matcher->aidc->def->nbFields;
 
@@ -23366,103 +23482,54 @@ xmlSchemaCheckCVCIDCKeyRef(xmlSchemaValidCtxtPtr vctxt)
 		    break;
 		bind = bind->next;
 	    }
-	    hasDupls = (bind && bind->dupls && bind->dupls->nbItems) ? 1 : 0;
+	    if ((bind != NULL) && (xmlSchemaIDCIndexBinding(vctxt, bind) < 0))
+		return (-1);
 	    /*
 	    * Search for a matching key-sequences.
 	    */
-	    if (bind) {
-		table = xmlHashCreate(bind->nbNodes * 2);
-		for (j = 0; j < bind->nbNodes; j++) {
-		    xmlChar *value;
-		    xmlIDCHashEntryPtr r, e;
-		    keys = bind->nodeTable[j]->keys;
-		    xmlSchemaHashKeySequence(vctxt, &value, keys, nbFields);
-		    e = xmlMalloc(sizeof *e);
-                    if (e == NULL) {
-                        xmlSchemaVErrMemory(vctxt);
-                        goto mem_error;
-                    }
-		    e->index = j;
-		    r = xmlHashLookup(table, value);
-		    if (r) {
-			e->next = r->next;
-			r->next = e;
-		    } else {
-			e->next = NULL;
-                        if (xmlHashAddEntry(table, value, e) < 0) {
-                            xmlSchemaVErrMemory(vctxt);
-                            xmlFree(e);
-                        }
-		    }
-mem_error:
-		    FREE_AND_NULL(value);
-		}
-	    }
 	    for (i = 0; i < matcher->targets->nbItems; i++) {
 		res = 0;
 		refNode = matcher->targets->items[i];
 		if (bind != NULL) {
-		    xmlChar *value;
-		    xmlIDCHashEntryPtr e;
-		    refKeys = refNode->keys;
-		    xmlSchemaHashKeySequence(vctxt, &value, refKeys, nbFields);
-		    e = xmlHashLookup(table, value);
-		    FREE_AND_NULL(value);
-		    res = 0;
-		    for (;e; e = e->next) {
-			keys = bind->nodeTable[e->index]->keys;
-			for (k = 0; k < nbFields; k++) {
-			    res = xmlSchemaAreValuesEqual(keys[k]->val,
-							  refKeys[k]->val);
-			    if (res == 0)
-			        break;
-			    else if (res == -1) {
-				return (-1);
-			    }
-			}
-			if (res == 1) {
-			    /*
-			     * Match found.
-			     */
-			    break;
-			}
+		    xmlChar *value = NULL;
+
+		    xmlSchemaHashKeySequence(vctxt, &value, refNode->keys,
+			nbFields);
+		    if (value == NULL) {
+			xmlSchemaVErrMemory(vctxt);
+			return (-1);
 		    }
-		    if ((res == 0) && hasDupls) {
+		    j = xmlSchemaIDCHashFind(bind->htab, bind->nodeTable,
+			value, refNode->keys, nbFields);
+		    if ((j == -1) && (bind->dupls != NULL)) {
 			/*
 			* Search in duplicates
 			*/
-			for (j = 0; j < bind->dupls->nbItems; j++) {
-			    keys = ((xmlSchemaPSVIIDCNodePtr)
-				bind->dupls->items[j])->keys;
-			    for (k = 0; k < nbFields; k++) {
-				res = xmlSchemaAreValuesEqual(keys[k]->val,
-				    refKeys[k]->val);
-				if (res == 0)
-				    break;
-				else if (res == -1) {
-				    return (-1);
-				}
-			    }
-			    if (res == 1) {
-				/*
-				* Match in duplicates found.
-				*/
-				xmlChar *str = NULL, *strB = NULL;
-				xmlSchemaKeyrefErr(vctxt,
-				    XML_SCHEMAV_CVC_IDC, refNode,
-				    (xmlSchemaTypePtr) matcher->aidc->def,
-				    "More than one match found for "
-				    "key-sequence %s of keyref '%s'",
-				    xmlSchemaFormatIDCKeySequence(vctxt, &str,
-					refNode->keys, nbFields),
-				    xmlSchemaGetComponentQName(&strB,
-					matcher->aidc->def));
-				FREE_AND_NULL(str);
-				FREE_AND_NULL(strB);
-				break;
-			    }
+			j = xmlSchemaIDCHashFind(bind->duplsHtab,
+			    (xmlSchemaPSVIIDCNodePtr *) bind->dupls->items,
+			    value, refNode->keys, nbFields);
+			if (j >= 0) {
+			    /*
+			    * Match in duplicates found.
+			    */
+			    xmlChar *str = NULL, *strB = NULL;
+			    xmlSchemaKeyrefErr(vctxt,
+				XML_SCHEMAV_CVC_IDC, refNode,
+				(xmlSchemaTypePtr) matcher->aidc->def,
+				"More than one match found for "
+				"key-sequence %s of keyref '%s'",
+				xmlSchemaFormatIDCKeySequence(vctxt, &str,
+				    refNode->keys, nbFields),
+				xmlSchemaGetComponentQName(&strB,
+				    matcher->aidc->def));
+			    FREE_AND_NULL(str);
+			    FREE_AND_NULL(strB);
 			}
 		    }
+		    FREE_AND_NULL(value);
+		    if (j == -2)
+			return (-1);
+		    res = (j >= 0);
 		}
 
 		if (res == 0) {
@@ -23478,9 +23545,6 @@ mem_error:
 		    FREE_AND_NULL(strB);
 		}
 	    }
-	    if (table) {
-		xmlHashFree(table, xmlFreeIDCHashEntry);
-	    }
 	}
 	matcher = matcher->next;
     }
@@ -26419,6 +26483,20 @@ xmlSchemaValidateElem(xmlSchemaValidCtxtPtr vctxt)
 		"declaration nor the type was set");
 	    goto internal_error;
 	}
+    } else if (vctxt->presetRoot) {
+	/*
+	* The declaration of the validation root was determined by the
+	* content model of its parent, see xmlSchemaVDocWalkParallel.
+	*/
+	vctxt->inode->decl = vctxt->rootDecl;
+	vctxt->inode->typeDef = vctxt->rootType;
+	if ((vctxt->inode->decl == NULL) &&
+	    (vctxt->inode->typeDef == NULL)) {
+	    VERROR_INT("xmlSchemaValidateElem",
+		"neither the declaration nor the type of the "
+		"validation root was set");
+	    goto internal_error;
+	}
     } else {
 	/*
 	* Get the declaration of the validation root.
@@ -27176,6 +27254,7 @@ xmlSchemaClearValidCtxt(xmlSchemaValidCtxtPtr vctxt)
         xmlFree(vctxt->filename);
 	vctxt->filename = NULL;
     }
+    xmlSchemaVFreeBufferedErrors(vctxt);
 
     /*
      * Note that some cleanup functions can move items to the cache,
@@ -27277,6 +27356,7 @@ xmlSchemaFreeValidCtxt(xmlSchemaValidCtxt *ctxt)
 	xmlDictFree(ctxt->dict);
     if (ctxt->filename != NULL)
 	xmlFree(ctxt->filename);
+    xmlSchemaVFreeBufferedErrors(ctxt);
     xmlFree(ctxt);
 }
 
@@ -27379,20 +27459,14 @@ xmlSchemaSetValidOptions(xmlSchemaValidCtxt *ctxt,
 			 int options)
 
 {
-    int i;
-
     if (ctxt == NULL)
 	return (-1);
     /*
-    * WARNING: Change the start value if adding to the
+    * WARNING: Update the mask if adding to the
     * xmlSchemaValidOption.
-    * TODO: Is there an other, more easy to maintain,
-    * way?
     */
-    for (i = 1; i < (int) sizeof(int) * 8; i++) {
-        if (options & 1<<i)
-	    return (-1);
-    }
+    if (options & ~(XML_SCHEMA_VAL_VC_I_CREATE | XML_SCHEMA_VAL_PARALLEL))
+	return (-1);
     ctxt->options = options;
     return (0);
 }
@@ -27413,6 +27487,9 @@ xmlSchemaValidCtxtGetOptions(xmlSchemaValidCtxt *ctxt)
 	return (ctxt->options);
 }
 
+static int
+xmlSchemaVDocWalkParallel(xmlSchemaValidCtxtPtr vctxt);
+
 static int
 xmlSchemaVDocWalk(xmlSchemaValidCtxtPtr vctxt)
 {
@@ -27507,6 +27584,17 @@ xmlSchemaVDocWalk(xmlSchemaValidCtxtPtr vctxt)
 	    if ((vctxt->skipDepth != -1) &&
 		(vctxt->depth >= vctxt->skipDepth))
 		goto leave_node;
+	    if ((vctxt->depth == 0) &&
+		(vctxt->options & XML_SCHEMA_VAL_PARALLEL) &&
+		(node->children != NULL)) {
+		ret = xmlSchemaVDocWalkParallel(vctxt);
+		if (ret < 0)
+		    goto internal_error;
+		if (ret == 0)
+		    goto leave_node;
+		/* Not applicable, continue sequentially */
+		ret = 0;
+	    }
 	} else if ((node->type == XML_TEXT_NODE) ||
 	    (node->type == XML_CDATA_SECTION_NODE)) {
 	    /*
@@ -27657,6 +27745,483 @@ xmlSchemaPostRun(xmlSchemaValidCtxtPtr vctxt) {
     xmlSchemaClearValidCtxt(vctxt);
 }
 
+/************************************************************************
+ *									*
+ *			Parallel validation				*
+ *									*
+ ************************************************************************/
+
+#if defined(HAVE_POSIX_THREADS) || defined(HAVE_WIN32_THREADS)
+
+#define XML_SCHEMA_PARALLEL_MAX_THREADS 64
+/* Number of subtrees a worker grabs at once */
+#define XML_SCHEMA_PARALLEL_BATCH 16
+
+typedef struct _xmlSchemaVJob xmlSchemaVJob;
+typedef xmlSchemaVJob *xmlSchemaVJobPtr;
+struct _xmlSchemaVJob {
+    xmlNodePtr node;
+    xmlSchemaElementPtr decl;
+    xmlSchemaTypePtr type;
+};
+
+typedef struct _xmlSchemaVJobQueue xmlSchemaVJobQueue;
+typedef xmlSchemaVJobQueue *xmlSchemaVJobQueuePtr;
+struct _xmlSchemaVJobQueue {
+    xmlMutex lock;
+    xmlSchemaVJobPtr jobs;
+    int nbJobs;
+    int next;
+};
+
+typedef struct _xmlSchemaVWorker xmlSchemaVWorker;
+typedef xmlSchemaVWorker *xmlSchemaVWorkerPtr;
+struct _xmlSchemaVWorker {
+    xmlSchemaVJobQueuePtr queue;
+    xmlSchemaValidCtxtPtr vctxt;
+    int failed;
+};
+
+/**
+ * Validate subtrees from the job queue until it's empty.
+ *
+ * @param worker  the worker
+ */
+static void
+xmlSchemaVWorkerRun(xmlSchemaVWorkerPtr worker) {
+    xmlSchemaVJobQueuePtr queue = worker->queue;
+    xmlSchemaValidCtxtPtr vctxt = worker->vctxt;
+    xmlSchemaIDCAugPtr aidc;
+    int start, end, i;
+
+    while (1) {
+        xmlMutexLock(&queue->lock);
+        start = queue->next;
+        end = start + XML_SCHEMA_PARALLEL_BATCH;
+        if (end > queue->nbJobs)
+            end = queue->nbJobs;
+        queue->next = end;
+        xmlMutexUnlock(&queue->lock);
+
+        if (start >= end)
+            break;
+
+        for (i = start; i < end; i++) {
+            xmlSchemaVJobPtr job = &queue->jobs[i];
+
+            vctxt->bufJob = i;
+            vctxt->validationRoot = job->node;
+            vctxt->presetRoot = 1;
+            vctxt->rootDecl = job->decl;
+            vctxt->rootType = job->type;
+            vctxt->skipDepth = -1;
+            for (aidc = vctxt->aidcs; aidc != NULL; aidc = aidc->next)
+                aidc->keyrefDepth = -1;
+
+            if ((xmlSchemaVDocWalk(vctxt) < 0) ||
+                (vctxt->err == XML_ERR_NO_MEMORY)) {
+                worker->failed = 1;
+                return;
+            }
+        }
+    }
+}
+
+#ifdef HAVE_POSIX_THREADS
+static void *
+xmlSchemaVWorkerThread(void *arg) {
+    xmlSchemaVWorkerRun(arg);
+    return(NULL);
+}
+#else
+static DWORD WINAPI
+xmlSchemaVWorkerThread(LPVOID arg) {
+    xmlSchemaVWorkerRun(arg);
+    return(0);
+}
+#endif
+
+/**
+ * @returns the number of threads to use for `nbJobs` subtrees.
+ */
+static int
+xmlSchemaVThreadCount(int nbJobs) {
+    int ncpu = xmlGetThreadCount();
+    int ret;
+
+    if (ncpu > XML_SCHEMA_PARALLEL_MAX_THREADS)
+        ncpu = XML_SCHEMA_PARALLEL_MAX_THREADS;
+
+    ret = nbJobs / XML_SCHEMA_PARALLEL_BATCH;
+    if (ret > ncpu)
+        ret = ncpu;
+    if (ret < 1)
+        ret = 1;
+
+    return(ret);
+}
+
+static int
+xmlSchemaCmpBufferedErrors(const void *p1, const void *p2) {
+    const xmlSchemaBufferedError *e1 = p1;
+    const xmlSchemaBufferedError *e2 = p2;
+
+    if (e1->job != e2->job)
+        return(e1->job < e2->job ? -1 : 1);
+    if (e1->source != e2->source)
+        return(e1->source < e2->source ? -1 : 1);
+    if (e1->seq != e2->seq)
+        return(e1->seq < e2->seq ? -1 : 1);
+    return(0);
+}
+
+/**
+ * Report a buffered error to the handlers of a validation context.
+ * The error was already counted when it was buffered.
+ *
+ * @param vctxt  the schema validation context
+ * @param err  the buffered error
+ */
+static void
+xmlSchemaVReplayError(xmlSchemaValidCtxtPtr vctxt, const xmlError *err) {
+    xmlGenericErrorFunc channel;
+    xmlStructuredErrorFunc schannel;
+    void *data;
+
+    if (err->message == NULL)
+        return;
+
+    if (err->level == XML_ERR_WARNING) {
+        channel = vctxt->warning;
+    } else {
+        channel = vctxt->error;
+        vctxt->err = err->code;
+    }
+    data = vctxt->errCtxt;
+    schannel = vctxt->serror;
+    if ((channel == NULL) && (schannel == NULL)) {
+        channel = xmlGenericError;
+        data = xmlGenericErrorContext;
+    }
+
+    if (xmlRaiseError(schannel, channel, data, vctxt, err->node,
+                      err->domain, err->code, err->level, err->file,
+                      err->line, err->str1, err->str2, err->str3,
+                      err->int1, err->int2, "%s", err->message) < 0)
+        xmlSchemaVErrMemory(vctxt);
+}
+
+/**
+ * Report the errors buffered by the main context and the workers in
+ * document order.
+ *
+ * @param vctxt  the main validation context
+ * @param workers  the workers
+ * @param nbWorkers  the number of workers
+ * @returns 0 on success, -1 if a memory allocation failed.
+ */
+static int
+xmlSchemaVMergeErrors(xmlSchemaValidCtxtPtr vctxt,
+                      xmlSchemaVWorkerPtr workers, int nbWorkers) {
+    xmlSchemaBufferedErrorPtr all;
+    int total, i, j, k;
+
+    total = vctxt->nbBufErrors;
+    for (i = 0; i < nbWorkers; i++) {
+        xmlSchemaValidCtxtPtr wctxt = workers[i].vctxt;
+
+        total += wctxt->nbBufErrors;
+        vctxt->nberrors += wctxt->nberrors;
+    }
+    if (total == 0)
+        return(0);
+
+    all = xmlMalloc(total * sizeof(all[0]));
+    if (all == NULL) {
+        xmlSchemaVErrMemory(vctxt);
+        return(-1);
+    }
+
+    /*
+     * Errors are moved into the merged array, so only free the
+     * buffers of the contexts.
+     */
+    k = 0;
+    for (i = -1; i < nbWorkers; i++) {
+        xmlSchemaValidCtxtPtr src = (i < 0) ? vctxt : workers[i].vctxt;
+
+        for (j = 0; j < src->nbBufErrors; j++)
+            all[k++] = src->bufErrors[j];
+        xmlFree(src->bufErrors);
+        src->bufErrors = NULL;
+        src->nbBufErrors = 0;
+        src->sizeBufErrors = 0;
+    }
+
+    qsort(all, total, sizeof(all[0]), xmlSchemaCmpBufferedErrors);
+
+    for (k = 0; k < total; k++) {
+        xmlSchemaVReplayError(vctxt, &all[k].error);
+        xmlResetError(&all[k].error);
+    }
+    xmlFree(all);
+
+    return(0);
+}
+
+/**
+ * Validate the content of the validation root in parallel.
+ *
+ * The content model of the root element is checked by the calling
+ * thread which also assigns the declaration of each child element.
+ * The subtrees of the children are then validated concurrently with
+ * a separate validation context per thread. Errors are buffered and
+ * reported in document order afterwards.
+ *
+ * Identity-constraints of the root element can span several subtrees,
+ * so such documents are validated sequentially.
+ *
+ * @param vctxt  the schema validation context positioned on the root
+ * @returns 0 if the content was validated, 1 if the content must be
+ * validated sequentially and -1 in case of an internal error.
+ */
+static int
+xmlSchemaVDocWalkParallel(xmlSchemaValidCtxtPtr vctxt)
+{
+    xmlSchemaVWorker workers[XML_SCHEMA_PARALLEL_MAX_THREADS];
+#ifdef HAVE_POSIX_THREADS
+    pthread_t threads[XML_SCHEMA_PARALLEL_MAX_THREADS];
+#else
+    HANDLE threads[XML_SCHEMA_PARALLEL_MAX_THREADS];
+#endif
+    int started[XML_SCHEMA_PARALLEL_MAX_THREADS];
+    xmlSchemaVJobQueue queue;
+    xmlSchemaNodeInfoPtr root = vctxt->inode;
+    xmlSchemaNodeInfoPtr ielem;
+    xmlNodePtr node;
+    xmlAttrPtr attr;
+    int nbElems = 0, nbWorkers = 0, i, ret = 0;
+
+    if ((vctxt->xsiAssemble) ||
+        (vctxt->options & XML_SCHEMA_VAL_VC_I_CREATE) ||
+        (vctxt->xpathStates != NULL) ||
+        (root->idcMatchers != NULL) ||
+        (root->typeDef == NULL))
+        return(1);
+
+    for (node = root->node->children; node != NULL; node = node->next) {
+        if (node->type == XML_ELEMENT_NODE)
+            nbElems++;
+    }
+    if (nbElems < 2 * XML_SCHEMA_PARALLEL_BATCH)
+        return(1);
+
+    memset(&queue, 0, sizeof(queue));
+    queue.jobs = xmlMalloc(nbElems * sizeof(queue.jobs[0]));
+    if (queue.jobs == NULL) {
+        xmlSchemaVErrMemory(vctxt);
+        return(-1);
+    }
+    xmlInitMutex(&queue.lock);
+
+    /*
+    * Validate the children against the content model of the root.
+    */
+    vctxt->bufferErrors = 1;
+    for (node = root->node->children; node != NULL; node = node->next) {
+        if ((node->type == XML_TEXT_NODE) ||
+            (node->type == XML_CDATA_SECTION_NODE)) {
+            if (root->flags & XML_SCHEMA_ELEM_INFO_EMPTY)
+                root->flags ^= XML_SCHEMA_ELEM_INFO_EMPTY;
+            vctxt->bufJob = queue.nbJobs;
+            if (xmlSchemaVPushText(vctxt, node->type, node->content,
+                    -1, XML_SCHEMA_PUSH_TEXT_PERSIST, NULL) < 0) {
+                VERROR_INT("xmlSchemaVDocWalkParallel",
+                    "calling xmlSchemaVPushText()");
+                goto internal_error;
+            }
+        } else if ((node->type == XML_ENTITY_NODE) ||
+                   (node->type == XML_ENTITY_REF_NODE)) {
+            VERROR_INT("xmlSchemaVDocWalkParallel",
+                "there is at least one entity reference in the node-tree "
+                "currently being validated. Processing of entities with "
+                "this XML Schema processor is not supported (yet). Please "
+                "substitute entities before validation.");
+            goto internal_error;
+        } else if (node->type == XML_ELEMENT_NODE) {
+            vctxt->depth++;
+            if (xmlSchemaValidatorPushElem(vctxt) == -1)
+                goto internal_error;
+            ielem = vctxt->inode;
+            ielem->node = node;
+            ielem->nodeLine = node->line;
+            ielem->localName = node->name;
+            if (node->ns != NULL)
+                ielem->nsName = node->ns->href;
+            ielem->flags |= XML_SCHEMA_ELEM_INFO_EMPTY;
+            /*
+            * Only xsi:type can be examined by the content model
+            * check, the other attributes are handled by the workers.
+            */
+            for (attr = node->properties; attr != NULL; attr = attr->next) {
+                xmlChar *content;
+
+                if ((attr->ns == NULL) ||
+                    (!xmlStrEqual(attr->ns->href, xmlSchemaInstanceNs)))
+                    continue;
+                content = xmlNodeListGetString(attr->doc, attr->children, 1);
+                if (xmlSchemaValidatorPushAttribute(vctxt, (xmlNodePtr) attr,
+                        ielem->nodeLine, attr->name, attr->ns->href, 0,
+                        content, 1) == -1) {
+                    VERROR_INT("xmlSchemaVDocWalkParallel",
+                        "calling xmlSchemaValidatorPushAttribute()");
+                    xmlFree(content);
+                    goto internal_error;
+                }
+            }
+
+            vctxt->bufJob = queue.nbJobs;
+            ret = xmlSchemaValidateChildElem(vctxt);
+            if (ret < 0) {
+                VERROR_INT("xmlSchemaVDocWalkParallel",
+                    "calling xmlSchemaValidateChildElem()");
+                goto internal_error;
+            }
+            if ((ret == 0) && (vctxt->depth != vctxt->skipDepth)) {
+                if ((ielem->decl == NULL) && (ielem->typeDef == NULL)) {
+                    VERROR_INT("xmlSchemaVDocWalkParallel",
+                        "the child element was valid but neither the "
+                        "declaration nor the type was set");
+                    goto internal_error;
+                }
+                queue.jobs[queue.nbJobs].node = node;
+                queue.jobs[queue.nbJobs].decl = ielem->decl;
+                queue.jobs[queue.nbJobs].type = ielem->typeDef;
+                queue.nbJobs++;
+
+                /* The subtree is validated later, discard the element */
+                if (vctxt->nbAttrInfos != 0)
+                    xmlSchemaClearAttrInfos(vctxt);
+                xmlSchemaClearElemInfo(vctxt, ielem);
+                vctxt->depth--;
+                vctxt->inode = root;
+            } else {
+                if (ret != 0)
+                    vctxt->skipDepth = vctxt->depth;
+                if (xmlSchemaValidatorPopElem(vctxt) < 0) {
+                    VERROR_INT("xmlSchemaVDocWalkParallel",
+                        "calling xmlSchemaValidatorPopElem()");
+                    goto internal_error;
+                }
+                /* Invalid content, the rest of the root is skipped */
+                if (vctxt->skipDepth == 0)
+                    break;
+            }
+            ret = 0;
+        }
+    }
+
+    /*
+    * Validate the subtrees.
+    */
+    nbWorkers = xmlSchemaVThreadCount(queue.nbJobs);
+    for (i = 0; i < nbWorkers; i++) {
+        xmlSchemaValidCtxtPtr wctxt;
+
+        wctxt = xmlSchemaNewValidCtxt(vctxt->schema);
+        if (wctxt == NULL)
+            break;
+        workers[i].queue = &queue;
+        workers[i].vctxt = wctxt;
+        workers[i].failed = 0;
+        started[i] = 0;
+
+        wctxt->options = vctxt->options & ~XML_SCHEMA_VAL_PARALLEL;
+        wctxt->doc = vctxt->doc;
+        wctxt->bufferErrors = 1;
+        xmlSchemaValidateSetFilename(wctxt, vctxt->filename);
+        if (((vctxt->filename != NULL) && (wctxt->filename == NULL)) ||
+            (xmlSchemaPreRun(wctxt) < 0) ||
+            (wctxt->err == XML_ERR_NO_MEMORY)) {
+            xmlSchemaFreeValidCtxt(wctxt);
+            break;
+        }
+    }
+    nbWorkers = i;
+    if (nbWorkers == 0) {
+        xmlSchemaVErrMemory(vctxt);
+        goto internal_error;
+    }
+
+    /* The first worker runs in the calling thread */
+    for (i = 1; i < nbWorkers; i++) {
+#ifdef HAVE_POSIX_THREADS
+        started[i] = (pthread_create(&threads[i], NULL,
+                                     xmlSchemaVWorkerThread,
+                                     &workers[i]) == 0);
+#else
+        threads[i] = CreateThread(NULL, 0, xmlSchemaVWorkerThread,
+                                  &workers[i], 0, NULL);
+        started[i] = (threads[i] != NULL);
+#endif
+    }
+
+    xmlSchemaVWorkerRun(&workers[0]);
+
+    for (i = 1; i < nbWorkers; i++) {
+        if (!started[i])
+            continue;
+#ifdef HAVE_POSIX_THREADS
+        pthread_join(threads[i], NULL);
+#else
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#endif
+    }
+
+    vctxt->bufferErrors = 0;
+    for (i = 0; i < nbWorkers; i++) {
+        if (workers[i].vctxt->err == XML_ERR_NO_MEMORY) {
+            xmlSchemaVErrMemory(vctxt);
+            ret = -1;
+        } else if (workers[i].failed) {
+            ret = -1;
+        }
+    }
+    /*
+    * Report the buffered errors even after a failure, they would have
+    * been reported by a sequential validation as well.
+    */
+    if (xmlSchemaVMergeErrors(vctxt, workers, nbWorkers) < 0)
+        ret = -1;
+
+    for (i = 0; i < nbWorkers; i++) {
+        xmlSchemaPostRun(workers[i].vctxt);
+        xmlSchemaFreeValidCtxt(workers[i].vctxt);
+    }
+    xmlCleanupMutex(&queue.lock);
+    xmlFree(queue.jobs);
+
+    return(ret);
+
+internal_error:
+    vctxt->bufferErrors = 0;
+    xmlSchemaVMergeErrors(vctxt, NULL, 0);
+    xmlCleanupMutex(&queue.lock);
+    xmlFree(queue.jobs);
+    return(-1);
+}
+
+#else /* !HAVE_POSIX_THREADS && !HAVE_WIN32_THREADS */
+
+static int
+xmlSchemaVDocWalkParallel(xmlSchemaValidCtxtPtr vctxt ATTRIBUTE_UNUSED)
+{
+    return(1);
+}
+
+#endif /* HAVE_POSIX_THREADS || HAVE_WIN32_THREADS */
+
 static int
 xmlSchemaVStart(xmlSchemaValidCtxtPtr vctxt)
 {
@@ -27713,6 +28278,11 @@ xmlSchemaValidateOneElement(xmlSchemaValidCtxt *ctxt, xmlNode *elem)
     if (ctxt->schema == NULL)
 	return (-1);
 
+    if (xmlNodeMaterialize(elem) < 0) {
+        xmlSchemaVErrMemory(ctxt);
+        return (-1);
+    }
+
     ctxt->doc = elem->doc;
     ctxt->node = elem;
     ctxt->validationRoot = elem;
@@ -27733,6 +28303,11 @@ xmlSchemaValidateDoc(xmlSchemaValidCtxt *ctxt, xmlDoc *doc)
     if ((ctxt == NULL) || (doc == NULL))
         return (-1);
 
+    if (xmlNodeMaterialize((xmlNodePtr) doc) < 0) {
+        xmlSchemaVErrMemory(ctxt);
+        return (-1);
+    }
+
     ctxt->doc = doc;
     ctxt->node = xmlDocGetRootElement(doc);
     if (ctxt->node == NULL) {
@@ -3047,12 +3047,18 @@ xmlSchemaValAtomicType(xmlSchemaTypePtr type, const xmlChar * value,
                     xmlChar *strip;
                     int res;
 
+                    /*
+                     * The ID table of the document is shared by
+                     * the threads of a parallel validation.
+                     */
                     strip = xmlSchemaStrip(value);
+                    xmlMutexLock(&xmlSchemasTypesMutex);
                     if (strip != NULL) {
                         res = xmlAddIDSafe(attr, strip);
                         xmlFree(strip);
                     } else
                         res = xmlAddIDSafe(attr, value);
+                    xmlMutexUnlock(&xmlSchemasTypesMutex);
                     if (res < 0) {
                         goto error;
                     } else if (res == 0) {
@@ -3076,11 +3082,13 @@ xmlSchemaValAtomicType(xmlSchemaTypePtr type, const xmlChar * value,
                 xmlChar *strip;
 
                 strip = xmlSchemaStrip(value);
+                xmlMutexLock(&xmlSchemasTypesMutex);
                 if (strip != NULL) {
                     xmlAddRef(NULL, node->doc, strip, attr);
                     xmlFree(strip);
                 } else
                     xmlAddRef(NULL, node->doc, value, attr);
+                xmlMutexUnlock(&xmlSchemasTypesMutex);
                 attr->atype = XML_ATTRIBUTE_IDREF;
             }
             goto done;
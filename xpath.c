@@ -47,6 +47,8 @@
 #include "private/error.h"
 #include "private/memory.h"
 #include "private/parser.h"
+#include "private/threads.h"
+#include "private/tree.h"
 #include "private/xpath.h"
 
 /* Disabled for now */
@@ -73,6 +75,25 @@
 */
 #define XP_OPTIMIZED_NON_ELEM_COMPARISON
 
+#ifdef XP_OPTIMIZED_NON_ELEM_COMPARISON
+#define XP_CMP_NODES(n1, n2) xmlXPathCmpNodesExt(n1, n2)
+#else
+#define XP_CMP_NODES(n1, n2) xmlXPathCmpNodes(n1, n2)
+#endif
+
+/*
+* Node sets with at least this many nodes are sorted with several
+* threads if XML_XPATH_PARALLEL_SORT is set.
+*/
+#define XP_PARALLEL_SORT_MIN 100000
+#define XP_PARALLEL_SORT_MAX_THREADS 8
+
+/*
+* Unions of node sets with at least this many nodes each are computed
+* with a linear merge of the sorted sets.
+*/
+#define XP_UNION_MERGE_MIN 32
+
 /*
 * If defined, this will optimize expressions like "key('foo', 'val')[b][1]"
 * in a way, that it stop evaluation at the first node.
@@ -193,6 +214,12 @@ xmlXPathSFComputeHash(const xmlChar *name) {
     return(hashValue);
 }
 
+/*
+ * A mutex protecting data attached to documents and serial numbers.
+ */
+static xmlMutex xmlXPathDocDataMutex;
+static unsigned long xmlXPathSerial;
+
 /**
  * Initialize the XPath environment
  */
@@ -232,6 +259,16 @@ xmlInitXPathInternal(void) {
 
         xmlXPathSFHash[bucketIndex] = i;
     }
+
+    xmlInitMutex(&xmlXPathDocDataMutex);
+}
+
+/**
+ * Free the mutex protecting document order indices.
+ */
+void
+xmlCleanupXPathInternal(void) {
+    xmlCleanupMutex(&xmlXPathDocDataMutex);
 }
 
 /************************************************************************
@@ -291,6 +328,8 @@ static const xmlNs *const xmlXPathXMLNamespace = &xmlXPathXMLNamespaceStruct;
 
 static void
 xmlXPathNodeSetClear(xmlNodeSetPtr set, int hasNsNodes);
+static int
+xmlXPathCmpNodesIndexed(xmlNodePtr node1, xmlNodePtr node2);
 
 #define XML_NODE_SORT_VALUE(n) XML_PTR_TO_INT((n)->content)
 
@@ -310,8 +349,10 @@ xmlXPathCmpNodesExt(xmlNodePtr node1, xmlNodePtr node2) {
     int depth1, depth2;
     int misc = 0, precedence1 = 0, precedence2 = 0;
     xmlNodePtr miscNode1 = NULL, miscNode2 = NULL;
+    xmlNodePtr orig1 = node1, orig2 = node2;
     xmlNodePtr cur, root;
     XML_INTPTR_T l1, l2;
+    int ret;
 
     if ((node1 == NULL) || (node2 == NULL))
 	return(-2);
@@ -516,6 +557,12 @@ turtle_comparison:
 	return(1);
     if (node1 == node2->next)
 	return(-1);
+    /*
+     * Use the document order index if available.
+     */
+    ret = xmlXPathCmpNodesIndexed(orig1, orig2);
+    if (ret != -2)
+        return(ret);
     /*
      * compute depth to root
      */
@@ -620,6468 +667,9171 @@ int wrap_cmp( xmlNodePtr x, xmlNodePtr y );
 
 /************************************************************************
  *									*
- *			Error handling routines				*
+ *			Document order index				*
  *									*
  ************************************************************************/
 
-/**
- * Macro to raise an XPath error and return NULL.
- *
- * @param X  the error code
+/*
+ * Node sets with at least this many nodes can create a document order
+ * index. The index is only created if the document has at most
+ * XP_DOC_ORDER_RATIO times more nodes than the node set.
  */
-#define XP_ERRORNULL(X)							\
-    { xmlXPathErr(ctxt, X); return(NULL); }
+#define XP_DOC_ORDER_MIN 64
+#define XP_DOC_ORDER_RATIO 32
+
+typedef struct {
+    const void *node;
+    size_t order;
+} xmlXPathDocOrderEntry;
 
 /*
- * The array xmlXPathErrorMessages corresponds to the enum xmlXPathError
+ * XPath data attached to a document.
+ *
+ * The document order index maps the nodes of a document to their
+ * position in document order. It's valid as long as the document's
+ * generation counter doesn't change and covers all nodes reachable
+ * through child and attribute axes except namespace nodes. In lazy
+ * documents, it's built from the nodes which exist at that time.
+ * Nodes materialized later aren't found, like new nodes from other
+ * documents, and callers fall back to comparing nodes in the tree.
+ *
+ * Location steps using the name or attribute value index hold a
+ * reference. If the indexes must be rebuilt while referenced, the
+ * data is detached from the document and freed with the last
+ * reference, see xmlXPathReleaseDocData.
  */
-static const char* const xmlXPathErrorMessages[] = {
-    "Ok",
-    "Number encoding",
-    "Unfinished literal",
-    "Start of literal",
-    "Expected $ for variable reference",
-    "Undefined variable",
-    "Invalid predicate",
-    "Invalid expression",
-    "Missing closing curly brace",
-    "Unregistered function",
-    "Invalid operand",
-    "Invalid type",
-    "Invalid number of arguments",
-    "Invalid context size",
-    "Invalid context position",
-    "Memory allocation error",
-    "Syntax error",
-    "Resource error",
-    "Sub resource error",
-    "Undefined namespace prefix",
-    "Encoding error",
-    "Char out of XML range",
-    "Invalid or incomplete context",
-    "Stack usage error",
-    "Forbidden variable",
-    "Operation limit exceeded",
-    "Recursion limit exceeded",
-    "?? Unknown error ??"	/* Must be last in the list! */
+struct _xmlXPathDocData {
+    /* number of location steps using the indexes */
+    int ref;
+    /* serial number telling apart documents at the same address */
+    unsigned long serial;
+    /* generation of the document order index */
+    unsigned long generation;
+    /* number of nodes or lower bound if the index wasn't built */
+    size_t nodeNr;
+    /* open addressing hash table */
+    xmlXPathDocOrderEntry *table;
+    size_t mask;
+    int shift;
+    /* element name index, see xmlXPathGetNameIndex */
+    xmlHashTablePtr names;
+    /* attribute value indexes, see xmlXPathGetAttrIndex */
+    xmlHashTablePtr attrs;
 };
-#define MAXERRNO ((int)(sizeof(xmlXPathErrorMessages) /	\
-		   sizeof(xmlXPathErrorMessages[0])) - 1)
-/**
- * Handle a memory allocation failure.
- *
- * @param ctxt  an XPath context
+
+/*
+ * The elements with a given name and namespace in document order
  */
-void
-xmlXPathErrMemory(xmlXPathContext *ctxt)
-{
-    if (ctxt == NULL)
-        return;
-    xmlRaiseMemoryError(ctxt->error, NULL, ctxt->userData, XML_FROM_XPATH,
-                        &ctxt->lastError);
+typedef struct {
+    int nodeNr;
+    int nodeMax;
+    xmlXPathDocOrderEntry *entries;
+} xmlXPathNameList;
+
+typedef struct _xmlXPathDocData xmlXPathDocData;
+typedef xmlXPathDocData *xmlXPathDocDataPtr;
+
+/*
+ * Fibonacci hashing, the upper bits of the product are well mixed even
+ * though the lower bits of node addresses are always zero.
+ */
+static XML_INLINE size_t
+xmlXPathDocOrderHash(xmlXPathDocDataPtr order, const void *node) {
+    uint64_t h = (uint64_t) XML_PTR_TO_INT(node);
+
+    return((size_t) ((h * 0x9E3779B97F4A7C15ull) >> order->shift));
 }
 
 /**
- * Handle a memory allocation failure.
+ * Look up the document order of a node.
  *
- * @param ctxt  an XPath parser context
+ * @param order  the index
+ * @param node  the node
+ * @returns the 1-based position of the node in document order or 0
+ * if the node isn't in the index.
  */
-void
-xmlXPathPErrMemory(xmlXPathParserContext *ctxt)
-{
-    if (ctxt == NULL)
-        return;
-    ctxt->error = XPATH_MEMORY_ERROR;
-    xmlXPathErrMemory(ctxt->context);
+static size_t
+xmlXPathDocOrderLookup(xmlXPathDocDataPtr order, const void *node) {
+    size_t i = xmlXPathDocOrderHash(order, node);
+
+    while (order->table[i].node != NULL) {
+        if (order->table[i].node == node)
+            return(order->table[i].order);
+        i = (i + 1) & order->mask;
+    }
+
+    return(0);
 }
 
 /**
- * Handle an XPath error
+ * Walk the tree in document order and add the nodes to the index
+ * if it has a table. Stops after `max` nodes.
  *
- * @param ctxt  a XPath parser context
- * @param code  the error code
- * @param fmt  format string for error message
- * @param ...  extra args
+ * @param order  the index
+ * @param doc  the document
+ * @param max  maximum number of nodes
+ * @returns the number of nodes or `max + 1` if there are more.
  */
+static size_t
+xmlXPathDocOrderWalk(xmlXPathDocDataPtr order, xmlDocPtr doc, size_t max) {
+    xmlNodePtr cur = (xmlNodePtr) doc;
+    size_t count = 0;
+
+    while (1) {
+        if (count >= max)
+            return(max + 1);
+        count += 1;
+        if (order->table != NULL) {
+            size_t i = xmlXPathDocOrderHash(order, cur);
+
+            while (order->table[i].node != NULL)
+                i = (i + 1) & order->mask;
+            order->table[i].node = cur;
+            order->table[i].order = count;
+        }
+
+        if (cur->type == XML_ELEMENT_NODE) {
+            xmlAttrPtr attr;
+
+            for (attr = cur->properties; attr != NULL; attr = attr->next) {
+                if (count >= max)
+                    return(max + 1);
+                count += 1;
+                if (order->table != NULL) {
+                    size_t i = xmlXPathDocOrderHash(order, attr);
+
+                    while (order->table[i].node != NULL)
+                        i = (i + 1) & order->mask;
+                    order->table[i].node = attr;
+                    order->table[i].order = count;
+                }
+            }
+        }
+
+        if ((cur->children != NULL) &&
+            ((cur->type == XML_ELEMENT_NODE) ||
+             (cur->type == XML_DOCUMENT_NODE) ||
+             (cur->type == XML_HTML_DOCUMENT_NODE))) {
+            cur = cur->children;
+            continue;
+        }
+
+        while ((cur != NULL) && (cur != (xmlNodePtr) doc) &&
+               (cur->next == NULL))
+            cur = cur->parent;
+        if ((cur == (xmlNodePtr) doc) || (cur == NULL))
+            break;
+        cur = cur->next;
+    }
+
+    return(count);
+}
+
 static void
-xmlXPathErrFmt(xmlXPathParserContext *ctxt, int code, const char *fmt, ...) {
-    va_list ap;
-    xmlStructuredErrorFunc schannel = NULL;
-    xmlGenericErrorFunc channel = NULL;
-    void *data = NULL;
-    xmlNodePtr node = NULL;
-    int res;
+xmlXPathFreeNameList(void *payload, const xmlChar *name ATTRIBUTE_UNUSED) {
+    xmlXPathNameList *list = payload;
 
-    if (ctxt == NULL)
-        return;
-    if ((code < 0) || (code > MAXERRNO))
-	code = MAXERRNO;
-    /* Only report the first error */
-    if (ctxt->error != 0)
+    xmlFree(list->entries);
+    xmlFree(list);
+}
+
+static void
+xmlXPathFreeAttrValues(void *payload,
+                       const xmlChar *name ATTRIBUTE_UNUSED) {
+    xmlHashFree(payload, xmlXPathFreeNameList);
+}
+
+/**
+ * Free XPath data attached to a document.
+ *
+ * @param data  the data (optional)
+ */
+void
+xmlXPathFreeDocData(xmlXPathDocData *data) {
+    if (data == NULL)
         return;
+    xmlHashFree(data->names, xmlXPathFreeNameList);
+    xmlHashFree(data->attrs, xmlXPathFreeAttrValues);
+    xmlFree(data->table);
+    xmlFree(data);
+}
 
-    ctxt->error = code;
+/**
+ * Get the XPath data of a document, creating it if necessary. Must be
+ * called with xmlXPathDocDataMutex held.
+ *
+ * @param doc  the document
+ * @returns the data or NULL if a memory allocation failed.
+ */
+static xmlXPathDocDataPtr
+xmlXPathGetDocData(xmlDocPtr doc) {
+    xmlXPathDocDataPtr data = doc->xpathData;
 
-    if (ctxt->context != NULL) {
-        xmlErrorPtr err = &ctxt->context->lastError;
+    if (data == NULL) {
+        data = xmlMalloc(sizeof(*data));
+        if (data == NULL)
+            return(NULL);
+        memset(data, 0, sizeof(*data));
+        data->serial = ++xmlXPathSerial;
+        data->generation = doc->generation;
+        doc->xpathData = data;
+    }
 
-        /* Don't overwrite memory error. */
-        if (err->code == XML_ERR_NO_MEMORY)
-            return;
+    return(data);
+}
 
-        /* cleanup current last error */
-        xmlResetError(err);
+/**
+ * Get the serial number of a document.
+ *
+ * @param doc  the document
+ * @returns the serial number or 0 if a memory allocation failed.
+ */
+static unsigned long
+xmlXPathGetDocSerial(xmlDocPtr doc) {
+    xmlXPathDocDataPtr data;
+    unsigned long serial = 0;
+
+    xmlMutexLock(&xmlXPathDocDataMutex);
+    data = xmlXPathGetDocData(doc);
+    if (data != NULL)
+        serial = data->serial;
+    xmlMutexUnlock(&xmlXPathDocDataMutex);
+
+    return(serial);
+}
 
-        err->domain = XML_FROM_XPATH;
-        err->code = code + XML_XPATH_EXPRESSION_OK - XPATH_EXPRESSION_OK;
-        err->level = XML_ERR_ERROR;
-        if (ctxt->base != NULL) {
-            err->str1 = (char *) xmlStrdup(ctxt->base);
-            if (err->str1 == NULL) {
-                xmlXPathPErrMemory(ctxt);
-                return;
-            }
+/**
+ * Get a valid document order index for a document, creating it if
+ * the cost is justified by sorting `nodeNr` nodes. A negative
+ * `nodeNr` always creates the index. Must be called with
+ * xmlXPathDocDataMutex held.
+ *
+ * @param doc  the document
+ * @param nodeNr  the number of nodes to sort
+ * @returns the index or NULL.
+ */
+static xmlXPathDocDataPtr
+xmlXPathGetDocOrderLocked(xmlDocPtr doc, int nodeNr) {
+    xmlXPathDocDataPtr order;
+    size_t max, count, size;
+    int shift;
+
+    order = doc->xpathData;
+    if (order == NULL) {
+        if ((nodeNr >= 0) && (nodeNr < XP_DOC_ORDER_MIN))
+            goto done;
+        order = xmlXPathGetDocData(doc);
+        if (order == NULL)
+            goto done;
+    } else if ((order->generation != doc->generation) && (order->ref > 0)) {
+        xmlXPathDocDataPtr data;
+
+        /* Still used by a location step, detach it */
+        data = xmlMalloc(sizeof(*data));
+        if (data == NULL) {
+            order = NULL;
+            goto done;
+        }
+        memset(data, 0, sizeof(*data));
+        data->serial = order->serial;
+        data->generation = doc->generation;
+        doc->xpathData = data;
+        order = data;
+    } else if (order->generation != doc->generation) {
+        xmlHashFree(order->names, xmlXPathFreeNameList);
+        order->names = NULL;
+        xmlHashFree(order->attrs, xmlXPathFreeAttrValues);
+        order->attrs = NULL;
+        xmlFree(order->table);
+        order->table = NULL;
+        order->nodeNr = 0;
+        order->generation = doc->generation;
+    }
+
+    if ((order->table != NULL) ||
+        ((nodeNr >= 0) && (nodeNr < XP_DOC_ORDER_MIN)))
+        goto done;
+
+    if (nodeNr < 0) {
+        count = xmlXPathDocOrderWalk(order, doc, SIZE_MAX - 1);
+    } else {
+        /*
+         * Only create the index if the document isn't much larger than
+         * the node set. Count nodes up to the limit first.
+         */
+        max = (size_t) nodeNr * XP_DOC_ORDER_RATIO;
+        if (order->nodeNr > max)
+            goto done;
+        count = xmlXPathDocOrderWalk(order, doc, max);
+        if (count > max) {
+            order->nodeNr = count;
+            goto done;
         }
-        err->int1 = ctxt->cur - ctxt->base;
-        err->node = ctxt->context->debugNode;
-
-        schannel = ctxt->context->error;
-        data = ctxt->context->userData;
-        node = ctxt->context->debugNode;
     }
 
-    if (schannel == NULL) {
-        channel = xmlGenericError;
-        data = xmlGenericErrorContext;
+    size = 16;
+    shift = 60;
+    while (size < count * 2) {
+        size *= 2;
+        shift -= 1;
     }
+    order->table = xmlMalloc(size * sizeof(order->table[0]));
+    if (order->table == NULL)
+        goto done;
+    memset(order->table, 0, size * sizeof(order->table[0]));
+    order->mask = size - 1;
+    order->shift = shift;
+    order->nodeNr = xmlXPathDocOrderWalk(order, doc, count);
 
-    va_start(ap, fmt);
-    res = xmlVRaiseError(schannel, channel, data, NULL, node, XML_FROM_XPATH,
-                         code + XML_XPATH_EXPRESSION_OK - XPATH_EXPRESSION_OK,
-                         XML_ERR_ERROR, NULL, 0,
-                         (const char *) ctxt->base, NULL, NULL,
-                         ctxt->cur - ctxt->base, 0,
-                         fmt, ap);
-    va_end(ap);
-    if (res < 0)
-        xmlXPathPErrMemory(ctxt);
+done:
+    if ((order == NULL) || (order->table == NULL))
+        return(NULL);
+    return(order);
 }
 
 /**
- * Handle an XPath error
+ * Get a valid document order index for a document, creating it if
+ * the cost is justified by sorting `nodeNr` nodes.
  *
- * @param ctxt  a XPath parser context
- * @param code  the error code
+ * The index can be used without holding a lock. It's only replaced
+ * after the tree was modified which can't happen while other threads
+ * are evaluating XPath expressions on the document.
+ *
+ * @param doc  the document
+ * @param nodeNr  the number of nodes to sort
+ * @returns the index or NULL.
  */
-void
-xmlXPathErr(xmlXPathParserContext *ctxt, int code) {
-    xmlXPathErrFmt(ctxt, code, "%s\n", xmlXPathErrorMessages[code]);
+static xmlXPathDocDataPtr
+xmlXPathGetDocOrder(xmlDocPtr doc, int nodeNr) {
+    xmlXPathDocDataPtr order;
+
+    xmlInitParser();
+    xmlMutexLock(&xmlXPathDocDataMutex);
+    order = xmlXPathGetDocOrderLocked(doc, nodeNr);
+    xmlMutexUnlock(&xmlXPathDocDataMutex);
+
+    return(order);
 }
 
 /**
- * Formats an error message.
+ * Compare two nodes using the document order index. Never creates
+ * the index.
  *
- * @param ctxt  the XPath Parser context
- * @param file  the file name
- * @param line  the line number
- * @param no  the error number
+ * @param node1  the first node
+ * @param node2  the second node
+ * @returns 1 if the first node comes before the second node, -1 if it
+ * comes after the second node or -2 if the index can't be used.
  */
-void
-xmlXPatherror(xmlXPathParserContext *ctxt, const char *file ATTRIBUTE_UNUSED,
-              int line ATTRIBUTE_UNUSED, int no) {
-    xmlXPathErr(ctxt, no);
+static int
+xmlXPathCmpNodesIndexed(xmlNodePtr node1, xmlNodePtr node2) {
+    xmlXPathDocDataPtr order;
+    xmlDocPtr doc = node1->doc;
+    size_t order1, order2;
+
+    if ((doc == NULL) || (node2->doc != doc) ||
+        (node1->type == XML_NAMESPACE_DECL) ||
+        (node2->type == XML_NAMESPACE_DECL))
+        return(-2);
+    order = xmlXPathGetDocOrder(doc, 0);
+    if (order == NULL)
+        return(-2);
+
+    /* Nodes materialized after the index was built are missing */
+    order1 = xmlXPathDocOrderLookup(order, node1);
+    if (order1 == 0)
+        return(-2);
+    order2 = xmlXPathDocOrderLookup(order, node2);
+    if ((order2 == 0) || (order1 == order2))
+        return(-2);
+
+    return((order1 < order2) ? 1 : -1);
 }
 
 /**
- * Adds opCount to the running total of operations and returns -1 if the
- * operation limit is exceeded. Returns 0 otherwise.
+ * Release a reference to document data obtained from
+ * xmlXPathGetNameIndex or xmlXPathGetAttrIndex. Detached data is freed with the last
+ * reference.
  *
- * @param ctxt  the XPath Parser context
- * @param opCount  the number of operations to be added
+ * @param doc  the document
+ * @param data  the document data
+ */
+static void
+xmlXPathReleaseDocData(xmlDocPtr doc, xmlXPathDocDataPtr data) {
+    xmlMutexLock(&xmlXPathDocDataMutex);
+    data->ref -= 1;
+    if ((data->ref == 0) && (doc->xpathData != data))
+        xmlXPathFreeDocData(data);
+    xmlMutexUnlock(&xmlXPathDocDataMutex);
+}
+
+/**
+ * Append an element to an element list.
+ *
+ * @param list  the element list
+ * @param node  the element
+ * @param order  the document order of the element
+ * @returns 0 on success or -1 if a memory allocation failed.
  */
 static int
-xmlXPathCheckOpLimit(xmlXPathParserContextPtr ctxt, unsigned long opCount) {
-    xmlXPathContextPtr xpctxt = ctxt->context;
+xmlXPathNameListAdd(xmlXPathNameList *list, xmlNodePtr node, size_t order) {
+    if (list->nodeNr >= list->nodeMax) {
+        xmlXPathDocOrderEntry *tmp;
+        int newSize;
 
-    if ((opCount > xpctxt->opLimit) ||
-        (xpctxt->opCount > xpctxt->opLimit - opCount)) {
-        xpctxt->opCount = xpctxt->opLimit;
-        xmlXPathErr(ctxt, XPATH_OP_LIMIT_EXCEEDED);
-        return(-1);
+        newSize = xmlGrowCapacity(list->nodeMax, sizeof(tmp[0]),
+                                  4, XPATH_MAX_NODESET_LENGTH);
+        if (newSize < 0)
+            return(-1);
+        tmp = xmlRealloc(list->entries, newSize * sizeof(tmp[0]));
+        if (tmp == NULL)
+            return(-1);
+        list->entries = tmp;
+        list->nodeMax = newSize;
     }
+    list->entries[list->nodeNr].node = node;
+    list->entries[list->nodeNr].order = order;
+    list->nodeNr += 1;
 
-    xpctxt->opCount += opCount;
     return(0);
 }
 
-#define OP_LIMIT_EXCEEDED(ctxt, n) \
-    ((ctxt->context->opLimit != 0) && (xmlXPathCheckOpLimit(ctxt, n) < 0))
-
-/************************************************************************
- *									*
- *			Parser Types					*
- *									*
- ************************************************************************/
-
-/*
- * Types are private:
+/**
+ * Add all elements of a document to the name index.
+ *
+ * @param order  the document order index
+ * @param doc  the document
+ * @returns 0 on success or -1 if a memory allocation failed.
  */
+static int
+xmlXPathBuildNameIndex(xmlXPathDocDataPtr order, xmlDocPtr doc) {
+    xmlHashTablePtr names;
+    xmlNodePtr cur;
 
-typedef enum {
-    XPATH_OP_END=0,
-    XPATH_OP_AND,
-    XPATH_OP_OR,
-    XPATH_OP_EQUAL,
-    XPATH_OP_CMP,
-    XPATH_OP_PLUS,
-    XPATH_OP_MULT,
-    XPATH_OP_UNION,
-    XPATH_OP_ROOT,
-    XPATH_OP_NODE,
-    XPATH_OP_COLLECT,
-    XPATH_OP_VALUE, /* 11 */
-    XPATH_OP_VARIABLE,
-    XPATH_OP_FUNCTION,
-    XPATH_OP_ARG,
-    XPATH_OP_PREDICATE,
-    XPATH_OP_FILTER, /* 16 */
-    XPATH_OP_SORT /* 17 */
-} xmlXPathOp;
-
-typedef enum {
-    AXIS_ANCESTOR = 1,
-    AXIS_ANCESTOR_OR_SELF,
-    AXIS_ATTRIBUTE,
-    AXIS_CHILD,
-    AXIS_DESCENDANT,
-    AXIS_DESCENDANT_OR_SELF,
-    AXIS_FOLLOWING,
-    AXIS_FOLLOWING_SIBLING,
-    AXIS_NAMESPACE,
-    AXIS_PARENT,
-    AXIS_PRECEDING,
-    AXIS_PRECEDING_SIBLING,
-    AXIS_SELF
-} xmlXPathAxisVal;
+    names = xmlHashCreate(0);
+    if (names == NULL)
+        return(-1);
 
-typedef enum {
-    NODE_TEST_NONE = 0,
-    NODE_TEST_TYPE = 1,
-    NODE_TEST_PI = 2,
-    NODE_TEST_ALL = 3,
-    NODE_TEST_NS = 4,
-    NODE_TEST_NAME = 5
-} xmlXPathTestVal;
+    cur = doc->children;
+    while (cur != NULL) {
+        if (cur->type == XML_ELEMENT_NODE) {
+            xmlXPathNameList *list;
+            const xmlChar *URI = (cur->ns != NULL) ? cur->ns->href : NULL;
+
+            list = xmlHashLookup2(names, cur->name, URI);
+            if (list == NULL) {
+                list = xmlMalloc(sizeof(*list));
+                if (list == NULL)
+                    goto error;
+                memset(list, 0, sizeof(*list));
+                if (xmlHashAdd2(names, cur->name, URI, list) < 0) {
+                    xmlFree(list);
+                    goto error;
+                }
+            }
+            if (xmlXPathNameListAdd(list, cur,
+                                    xmlXPathDocOrderLookup(order, cur)) < 0)
+                goto error;
 
-typedef enum {
-    NODE_TYPE_NODE = 0,
-    NODE_TYPE_COMMENT = XML_COMMENT_NODE,
-    NODE_TYPE_TEXT = XML_TEXT_NODE,
-    NODE_TYPE_PI = XML_PI_NODE
-} xmlXPathTypeVal;
+            if (cur->children != NULL) {
+                cur = cur->children;
+                continue;
+            }
+        }
 
-typedef struct _xmlXPathStepOp xmlXPathStepOp;
-typedef xmlXPathStepOp *xmlXPathStepOpPtr;
-struct _xmlXPathStepOp {
-    xmlXPathOp op;		/* The identifier of the operation */
-    int ch1;			/* First child */
-    int ch2;			/* Second child */
-    int value;
-    int value2;
-    int value3;
-    void *value4;
-    void *value5;
-    xmlXPathFunction cache;
-    void *cacheURI;
-};
+        while ((cur->next == NULL) && (cur->parent != NULL) &&
+               (cur->parent != (xmlNodePtr) doc))
+            cur = cur->parent;
+        cur = cur->next;
+    }
 
-struct _xmlXPathCompExpr {
-    int nbStep;			/* Number of steps in this expression */
-    int maxStep;		/* Maximum number of steps allocated */
-    xmlXPathStepOp *steps;	/* ops for computation of this expression */
-    int last;			/* index of last step in expression */
-    xmlChar *expr;		/* the expression being computed */
-    xmlDictPtr dict;		/* the dictionary to use if any */
-#ifdef XPATH_STREAMING
-    xmlPatternPtr stream;
-#endif
-};
+    order->names = names;
+    return(0);
 
-/************************************************************************
- *									*
- *			Forward declarations				*
- *									*
- ************************************************************************/
+error:
+    xmlHashFree(names, xmlXPathFreeNameList);
+    return(-1);
+}
 
-static void
-xmlXPathReleaseObject(xmlXPathContextPtr ctxt, xmlXPathObjectPtr obj);
-static int
-xmlXPathCompOpEvalFirst(xmlXPathParserContextPtr ctxt,
-                        xmlXPathStepOpPtr op, xmlNodePtr *first);
-static int
-xmlXPathCompOpEvalToBoolean(xmlXPathParserContextPtr ctxt,
-			    xmlXPathStepOpPtr op,
-			    int isPredicate);
-static void
-xmlXPathFreeObjectEntry(void *obj, const xmlChar *name);
+/**
+ * Get a valid element name index for a document, creating it if
+ * necessary. The name index maps element names and namespace URIs
+ * to the list of matching elements in document order. Like the
+ * document order index, it's rebuilt after the tree was modified.
+ *
+ * The caller holds a reference to the result which keeps the index
+ * alive even if the tree is modified, for example by extension
+ * functions or materializing lazy nodes while evaluating predicates.
+ * It must be released with xmlXPathReleaseDocData.
+ *
+ * @param doc  the document
+ * @returns the document data with name index or NULL.
+ */
+static xmlXPathDocDataPtr
+xmlXPathGetNameIndex(xmlDocPtr doc) {
+    xmlXPathDocDataPtr order;
 
-/************************************************************************
- *									*
- *			Parser Type functions				*
- *									*
- ************************************************************************/
+    xmlInitParser();
+    xmlMutexLock(&xmlXPathDocDataMutex);
+    order = xmlXPathGetDocOrderLocked(doc, -1);
+    if ((order != NULL) && (order->names == NULL) &&
+        (xmlXPathBuildNameIndex(order, doc) < 0))
+        order = NULL;
+    if (order != NULL)
+        order->ref += 1;
+    xmlMutexUnlock(&xmlXPathDocDataMutex);
+
+    return(order);
+}
 
 /**
- * Create a new Xpath component
+ * Find the end of the subtree of a node in the document order index.
  *
- * @returns the newly allocated xmlXPathCompExpr or NULL in case of error
+ * The subtree ends before the next node which isn't a descendant.
+ * Nodes materialized after the index was built are skipped, so the
+ * result can be larger than the order of the next node in the tree.
+ *
+ * @param order  the document order index
+ * @param node  a node which isn't an attribute or namespace node
+ * @returns the order of the first indexed node after the subtree,
+ * SIZE_MAX if the subtree extends to the end of the document or 0 if
+ * the node isn't in a document.
  */
-static xmlXPathCompExprPtr
-xmlXPathNewCompExpr(void) {
-    xmlXPathCompExprPtr cur;
-
-    cur = (xmlXPathCompExprPtr) xmlMalloc(sizeof(xmlXPathCompExpr));
-    if (cur == NULL)
-	return(NULL);
-    memset(cur, 0, sizeof(xmlXPathCompExpr));
-#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
-    cur->maxStep = 1;
-#else
-    cur->maxStep = 10;
-#endif
-    cur->nbStep = 0;
-    cur->steps = (xmlXPathStepOp *) xmlMalloc(cur->maxStep *
-	                                   sizeof(xmlXPathStepOp));
-    if (cur->steps == NULL) {
-	xmlFree(cur);
-	return(NULL);
+static size_t
+xmlXPathDocOrderSubtreeEnd(xmlXPathDocDataPtr order, xmlNodePtr node) {
+    xmlNodePtr cur = node;
+
+    while ((cur->type != XML_DOCUMENT_NODE) &&
+           (cur->type != XML_HTML_DOCUMENT_NODE)) {
+        xmlNodePtr next;
+        size_t last;
+
+        for (next = cur->next; next != NULL; next = next->next) {
+            last = xmlXPathDocOrderLookup(order, next);
+            if (last != 0)
+                return(last);
+        }
+        cur = cur->parent;
+        if (cur == NULL)
+            return(0);
     }
-    memset(cur->steps, 0, cur->maxStep * sizeof(xmlXPathStepOp));
-    cur->last = -1;
-    return(cur);
+
+    return(SIZE_MAX);
 }
 
 /**
- * Free up the memory allocated by `comp`
- *
- * @param comp  an XPATH comp
+ * Find a context node whose following or preceding axis contains the
+ * axes of all other context nodes. Attributes have the same axes as
+ * their owner element.
+ *
+ * The following axis of a node with the earliest subtree end contains
+ * the following axes of the other nodes. If the ends are equal, the
+ * nodes are nested and the descendant comes later. The preceding axis
+ * of the node which comes last contains the preceding axes of the
+ * other nodes.
+ *
+ * Creates the index which is justified because traversing the axis
+ * of a single node can visit the whole document.
+ *
+ * @param set  the context nodes
+ * @param following  whether to select the following axis
+ * @returns the index of the context node or -1 if the document order
+ * index can't be used.
  */
-void
-xmlXPathFreeCompExpr(xmlXPathCompExpr *comp)
-{
-    xmlXPathStepOpPtr op;
-    int i;
+static int
+xmlXPathAxisContextIndex(xmlNodeSetPtr set, int following) {
+    xmlXPathDocDataPtr order;
+    xmlDocPtr doc;
+    size_t bestOrder = 0, bestEnd = 0;
+    int i, best = -1;
 
-    if (comp == NULL)
-        return;
-    if (comp->dict == NULL) {
-	for (i = 0; i < comp->nbStep; i++) {
-	    op = &comp->steps[i];
-	    if (op->value4 != NULL) {
-		if (op->op == XPATH_OP_VALUE)
-		    xmlXPathFreeObject(op->value4);
-		else
-		    xmlFree(op->value4);
-	    }
-	    if (op->value5 != NULL)
-		xmlFree(op->value5);
-	}
-    } else {
-	for (i = 0; i < comp->nbStep; i++) {
-	    op = &comp->steps[i];
-	    if (op->value4 != NULL) {
-		if (op->op == XPATH_OP_VALUE)
-		    xmlXPathFreeObject(op->value4);
-	    }
-	}
-        xmlDictFree(comp->dict);
-    }
-    if (comp->steps != NULL) {
-        xmlFree(comp->steps);
+    if (set->nodeTab[0]->type == XML_NAMESPACE_DECL)
+        return(-1);
+    doc = set->nodeTab[0]->doc;
+    if (doc == NULL)
+        return(-1);
+    order = xmlXPathGetDocOrder(doc, -1);
+    if (order == NULL)
+        return(-1);
+
+    for (i = 0; i < set->nodeNr; i++) {
+        xmlNodePtr node = set->nodeTab[i];
+        size_t nodeOrder, end;
+
+        if ((node->type == XML_NAMESPACE_DECL) || (node->doc != doc))
+            return(-1);
+        if (node->type == XML_ATTRIBUTE_NODE) {
+            node = node->parent;
+            if (node == NULL)
+                return(-1);
+        }
+        /* Nodes materialized after the index was built are missing */
+        nodeOrder = xmlXPathDocOrderLookup(order, node);
+        if (nodeOrder == 0)
+            return(-1);
+
+        if (following) {
+            end = xmlXPathDocOrderSubtreeEnd(order, node);
+            if (end == 0)
+                return(-1);
+            if ((best < 0) || (end < bestEnd) ||
+                ((end == bestEnd) && (nodeOrder > bestOrder))) {
+                best = i;
+                bestOrder = nodeOrder;
+                bestEnd = end;
+            }
+        } else {
+            if ((best < 0) || (nodeOrder > bestOrder)) {
+                best = i;
+                bestOrder = nodeOrder;
+            }
+        }
     }
-#ifdef XPATH_STREAMING
-    if (comp->stream != NULL) {
-        xmlFreePatternList(comp->stream);
+
+    return(best);
+}
+
+/**
+ * Find the range of entries of an element list in the descendant or
+ * descendant-or-self axis of a node.
+ *
+ * @param order  the document order index
+ * @param node  the context node
+ * @param orSelf  whether to include the context node
+ * @param list  the element list in document order (optional)
+ * @param start  set to the start of the range
+ * @param end  set to the end of the range
+ * @returns 0 on success or -1 if the index can't be used for the node.
+ */
+static int
+xmlXPathIndexListRange(xmlXPathDocDataPtr order, xmlNodePtr node, int orSelf,
+                       const xmlXPathNameList *list, int *start, int *end) {
+    size_t first, last;
+    int lo, hi;
+
+    if ((node->type != XML_ELEMENT_NODE) &&
+        (node->type != XML_DOCUMENT_NODE) &&
+        (node->type != XML_HTML_DOCUMENT_NODE))
+        return(-1);
+    first = xmlXPathDocOrderLookup(order, node);
+    if (first == 0)
+        return(-1);
+    if (!orSelf)
+        first += 1;
+
+    /*
+     * Nodes materialized after the index was built are never elements,
+     * so the lists can't contain them.
+     */
+    last = xmlXPathDocOrderSubtreeEnd(order, node);
+    if (last == 0)
+        return(-1);
+
+    *start = 0;
+    *end = 0;
+    if (list == NULL)
+        return(0);
+
+    lo = 0;
+    hi = list->nodeNr;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (list->entries[mid].order < first)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-#endif
-    if (comp->expr != NULL) {
-        xmlFree(comp->expr);
+    *start = lo;
+    hi = list->nodeNr;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (list->entries[mid].order < last)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    *end = lo;
 
-    xmlFree(comp);
+    return(0);
 }
 
 /**
- * Add a step to an XPath Compiled Expression
- *
- * @param ctxt  XPath parser context
- * @param ch1  first child index
- * @param ch2  second child index
- * @param op  an op
- * @param value  the first int value
- * @param value2  the second int value
- * @param value3  the third int value
- * @param value4  the first string value
- * @param value5  the second string value
- * @returns -1 in case of failure, the index otherwise
+ * Find the range of elements with a given name in the descendant or
+ * descendant-or-self axis of a node.
+ *
+ * @param order  document data with name index
+ * @param node  the context node
+ * @param name  the local name
+ * @param URI  the namespace URI or NULL
+ * @param orSelf  whether to include the context node
+ * @param list  set to the element list
+ * @param start  set to the start of the range
+ * @param end  set to the end of the range
+ * @returns 0 on success or -1 if the index can't be used for the node.
  */
 static int
-xmlXPathCompExprAdd(xmlXPathParserContextPtr ctxt, int ch1, int ch2,
-   xmlXPathOp op, int value,
-   int value2, int value3, void *value4, void *value5) {
-    xmlXPathCompExprPtr comp = ctxt->comp;
-    if (comp->nbStep >= comp->maxStep) {
-	xmlXPathStepOp *real;
-        int newSize;
+xmlXPathNameIndexRange(xmlXPathDocDataPtr order, xmlNodePtr node,
+                       const xmlChar *name, const xmlChar *URI, int orSelf,
+                       xmlXPathNameList **list, int *start, int *end) {
+    xmlXPathNameList *names;
+
+    *list = NULL;
+    names = xmlHashLookup2(order->names, name, URI);
+    if (xmlXPathIndexListRange(order, node, orSelf, names, start, end) < 0)
+        return(-1);
+    *list = names;
 
-        newSize = xmlGrowCapacity(comp->maxStep, sizeof(real[0]),
-                                  10, XPATH_MAX_STEPS);
-        if (newSize < 0) {
-	    xmlXPathPErrMemory(ctxt);
-	    return(-1);
-        }
-	real = xmlRealloc(comp->steps, newSize * sizeof(real[0]));
-	if (real == NULL) {
-	    xmlXPathPErrMemory(ctxt);
-	    return(-1);
-	}
-	comp->steps = real;
-	comp->maxStep = newSize;
-    }
-    comp->last = comp->nbStep;
-    comp->steps[comp->nbStep].ch1 = ch1;
-    comp->steps[comp->nbStep].ch2 = ch2;
-    comp->steps[comp->nbStep].op = op;
-    comp->steps[comp->nbStep].value = value;
-    comp->steps[comp->nbStep].value2 = value2;
-    comp->steps[comp->nbStep].value3 = value3;
-    if ((comp->dict != NULL) &&
-        ((op == XPATH_OP_FUNCTION) || (op == XPATH_OP_VARIABLE) ||
-	 (op == XPATH_OP_COLLECT))) {
-        if (value4 != NULL) {
-	    comp->steps[comp->nbStep].value4 = (xmlChar *)
-	        (void *)xmlDictLookup(comp->dict, value4, -1);
-	    xmlFree(value4);
-	} else
-	    comp->steps[comp->nbStep].value4 = NULL;
-        if (value5 != NULL) {
-	    comp->steps[comp->nbStep].value5 = (xmlChar *)
-	        (void *)xmlDictLookup(comp->dict, value5, -1);
-	    xmlFree(value5);
-	} else
-	    comp->steps[comp->nbStep].value5 = NULL;
-    } else {
-	comp->steps[comp->nbStep].value4 = value4;
-	comp->steps[comp->nbStep].value5 = value5;
-    }
-    comp->steps[comp->nbStep].cache = NULL;
-    return(comp->nbStep++);
+    return(0);
 }
 
-#define PUSH_FULL_EXPR(op, op1, op2, val, val2, val3, val4, val5)	\
-    xmlXPathCompExprAdd(ctxt, (op1), (op2),			\
-	                (op), (val), (val2), (val3), (val4), (val5))
-#define PUSH_LONG_EXPR(op, val, val2, val3, val4, val5)			\
-    xmlXPathCompExprAdd(ctxt, ctxt->comp->last, -1,		\
-	                (op), (val), (val2), (val3), (val4), (val5))
-
-#define PUSH_LEAVE_EXPR(op, val, val2)					\
-xmlXPathCompExprAdd(ctxt, -1, -1, (op), (val), (val2), 0 ,NULL ,NULL)
+/**
+ * Check whether an attribute matches an attribute name test. Like
+ * the node test of the attribute axis, a test without prefix also
+ * matches attributes with a namespace but without a prefix.
+ *
+ * @param attrName  the name of the attribute
+ * @param attrNs  the namespace of the attribute
+ * @param name  the local name
+ * @param URI  the namespace URI or NULL for names without prefix
+ * @returns 1 if the attribute matches, 0 otherwise.
+ */
+static int
+xmlXPathAttrNameMatch(const xmlChar *attrName, const xmlNs *attrNs,
+                      const xmlChar *name, const xmlChar *URI) {
+    if (!xmlStrEqual(attrName, name))
+        return(0);
+    if (URI == NULL)
+        return((attrNs == NULL) || (attrNs->prefix == NULL));
+    return((attrNs != NULL) && (xmlStrEqual(attrNs->href, URI)));
+}
 
-#define PUSH_UNARY_EXPR(op, ch, val, val2)				\
-xmlXPathCompExprAdd(ctxt, (ch), -1, (op), (val), (val2), 0 ,NULL ,NULL)
+/**
+ * Add an element to the list of an attribute value.
+ *
+ * @param order  the document order index
+ * @param values  the hash table of values
+ * @param elem  the owner element
+ * @param value  the attribute value
+ * @returns 0 on success or -1 if a memory allocation failed.
+ */
+static int
+xmlXPathAttrIndexAdd(xmlXPathDocDataPtr order, xmlHashTablePtr values,
+                     xmlNodePtr elem, const xmlChar *value) {
+    xmlXPathNameList *list;
+
+    list = xmlHashLookup(values, value);
+    if (list == NULL) {
+        list = xmlMalloc(sizeof(*list));
+        if (list == NULL)
+            return(-1);
+        memset(list, 0, sizeof(*list));
+        if (xmlHashAdd(values, value, list) < 0) {
+            xmlFree(list);
+            return(-1);
+        }
+    }
 
-#define PUSH_BINARY_EXPR(op, ch1, ch2, val, val2)			\
-xmlXPathCompExprAdd(ctxt, (ch1), (ch2), (op),			\
-			(val), (val2), 0 ,NULL ,NULL)
+    /* Several attributes of an element can match */
+    if ((list->nodeNr > 0) &&
+        (list->entries[list->nodeNr - 1].node == elem))
+        return(0);
+    return(xmlXPathNameListAdd(list, elem,
+                               xmlXPathDocOrderLookup(order, elem)));
+}
 
-/************************************************************************
- *									*
- *		XPath object cache structures				*
- *									*
- ************************************************************************/
+/**
+ * Build the attribute value index for an attribute name. It maps the
+ * values of matching attributes to the list of owner elements in
+ * document order.
+ *
+ * Deferred attributes of lazy documents are read from their records
+ * without materializing them, unless their value contains references.
+ *
+ * @param order  the document order index
+ * @param doc  the document
+ * @param name  the local name of the attribute
+ * @param URI  the namespace URI or NULL for names without prefix
+ * @returns the hash table of values or NULL if a memory allocation
+ * failed.
+ */
+static xmlHashTablePtr
+xmlXPathBuildAttrIndex(xmlXPathDocDataPtr order, xmlDocPtr doc,
+                       const xmlChar *name, const xmlChar *URI) {
+    xmlHashTablePtr values;
+    xmlNodePtr cur;
 
-/* #define XP_DEFAULT_CACHE_ON */
+    values = xmlHashCreate(0);
+    if (values == NULL)
+        return(NULL);
 
-typedef struct _xmlXPathContextCache xmlXPathContextCache;
-typedef xmlXPathContextCache *xmlXPathContextCachePtr;
-struct _xmlXPathContextCache {
-    xmlXPathObjectPtr nodesetObjs;  /* stringval points to next */
-    xmlXPathObjectPtr miscObjs;     /* stringval points to next */
-    int numNodeset;
-    int maxNodeset;
-    int numMisc;
-    int maxMisc;
-};
+    cur = doc->children;
+    while (cur != NULL) {
+        if (cur->type == XML_ELEMENT_NODE) {
+            xmlLazyElem *lazy = xmlLazyLookup(cur);
+            xmlAttrPtr attr;
+            int i;
+
+            if ((lazy != NULL) && (lazy->flags & XML_LAZY_ATTRS)) {
+                for (i = 0; i < lazy->nbAttrs; i++) {
+                    const xmlLazyAttr *lattr = &lazy->attrs[i];
+
+                    if (!xmlXPathAttrNameMatch(lattr->name, lattr->ns,
+                                               name, URI))
+                        continue;
+                    if (lattr->parse) {
+                        if (xmlLazyMaterialize(cur, XML_LAZY_ATTRS) < 0)
+                            goto error;
+                        break;
+                    }
+                    if (xmlXPathAttrIndexAdd(order, values, cur,
+                                             lattr->value) < 0)
+                        goto error;
+                }
+            }
 
-/************************************************************************
- *									*
- *		Debugging related functions				*
- *									*
- ************************************************************************/
+            for (attr = cur->properties; attr != NULL; attr = attr->next) {
+                xmlChar *copy = NULL;
+                const xmlChar *value;
+                int res;
+
+                if (!xmlXPathAttrNameMatch(attr->name, attr->ns, name, URI))
+                    continue;
+
+                if (attr->children == NULL) {
+                    value = BAD_CAST "";
+                } else if ((attr->children->type == XML_TEXT_NODE) &&
+                           (attr->children->next == NULL)) {
+                    value = attr->children->content;
+                } else {
+                    copy = xmlNodeGetContent((xmlNodePtr) attr);
+                    if (copy == NULL)
+                        goto error;
+                    value = copy;
+                }
 
-#ifdef LIBXML_DEBUG_ENABLED
-static void
-xmlXPathDebugDumpNode(FILE *output, xmlNodePtr cur, int depth) {
-    int i;
-    char shift[100];
+                res = xmlXPathAttrIndexAdd(order, values, cur, value);
+                xmlFree(copy);
+                if (res < 0)
+                    goto error;
+            }
 
-    for (i = 0;((i < depth) && (i < 25));i++)
-        shift[2 * i] = shift[2 * i + 1] = ' ';
-    shift[2 * i] = shift[2 * i + 1] = 0;
-    if (cur == NULL) {
-	fprintf(output, "%s", shift);
-	fprintf(output, "Node is NULL !\n");
-	return;
+            if (cur->children != NULL) {
+                cur = cur->children;
+                continue;
+            }
+        }
 
+        while ((cur->next == NULL) && (cur->parent != NULL) &&
+               (cur->parent != (xmlNodePtr) doc))
+            cur = cur->parent;
+        cur = cur->next;
     }
 
-    if ((cur->type == XML_DOCUMENT_NODE) ||
-	     (cur->type == XML_HTML_DOCUMENT_NODE)) {
-	fprintf(output, "%s", shift);
-	fprintf(output, " /\n");
-    } else if (cur->type == XML_ATTRIBUTE_NODE)
-	xmlDebugDumpAttr(output, (xmlAttrPtr)cur, depth);
-    else
-	xmlDebugDumpOneNode(output, cur, depth);
+    return(values);
+
+error:
+    xmlHashFree(values, xmlXPathFreeNameList);
+    return(NULL);
 }
-static void
-xmlXPathDebugDumpNodeList(FILE *output, xmlNodePtr cur, int depth) {
-    xmlNodePtr tmp;
-    int i;
-    char shift[100];
 
-    for (i = 0;((i < depth) && (i < 25));i++)
-        shift[2 * i] = shift[2 * i + 1] = ' ';
-    shift[2 * i] = shift[2 * i + 1] = 0;
-    if (cur == NULL) {
-	fprintf(output, "%s", shift);
-	fprintf(output, "Node is NULL !\n");
-	return;
+/**
+ * Get a valid attribute value index for an attribute name, creating
+ * it if necessary. The index is built separately for every attribute
+ * name the first time it's requested and, like the document order
+ * index, rebuilt after the tree was modified.
+ *
+ * Like with xmlXPathGetNameIndex, the caller holds a reference to the
+ * result which must be released with xmlXPathReleaseDocData.
+ *
+ * @param doc  the document
+ * @param name  the local name of the attribute
+ * @param URI  the namespace URI or NULL for names without prefix
+ * @param values  set to the hash table mapping attribute values to
+ * element lists
+ * @returns the document data or NULL.
+ */
+static xmlXPathDocDataPtr
+xmlXPathGetAttrIndex(xmlDocPtr doc, const xmlChar *name, const xmlChar *URI,
+                     xmlHashTablePtr *values) {
+    xmlXPathDocDataPtr order;
+    xmlHashTablePtr table = NULL;
 
+    *values = NULL;
+    xmlInitParser();
+    xmlMutexLock(&xmlXPathDocDataMutex);
+    order = xmlXPathGetDocOrderLocked(doc, -1);
+    if ((order != NULL) && (order->attrs == NULL))
+        order->attrs = xmlHashCreate(0);
+    if ((order != NULL) && (order->attrs != NULL)) {
+        table = xmlHashLookup2(order->attrs, name, URI);
+        if (table == NULL) {
+            table = xmlXPathBuildAttrIndex(order, doc, name, URI);
+            if ((table != NULL) &&
+                (xmlHashAdd2(order->attrs, name, URI, table) < 0)) {
+                xmlHashFree(table, xmlXPathFreeNameList);
+                table = NULL;
+            }
+        }
     }
+    if (table != NULL)
+        order->ref += 1;
+    xmlMutexUnlock(&xmlXPathDocDataMutex);
 
-    while (cur != NULL) {
-	tmp = cur;
-	cur = cur->next;
-	xmlDebugDumpOneNode(output, tmp, depth);
-    }
+    *values = table;
+    if (table == NULL)
+        return(NULL);
+    return(order);
 }
 
-static void
-xmlXPathDebugDumpNodeSet(FILE *output, xmlNodeSetPtr cur, int depth) {
+/**
+ * Sort index entries by document order with a radix sort.
+ *
+ * @param entries  the entries
+ * @param tmp  scratch space for `num` entries
+ * @param num  number of entries
+ * @param max  largest document order
+ * @returns a pointer to the sorted entries, either `entries` or `tmp`.
+ */
+static xmlXPathDocOrderEntry *
+xmlXPathDocOrderRadixSort(xmlXPathDocOrderEntry *entries,
+                          xmlXPathDocOrderEntry *tmp, int num, size_t max) {
+    size_t counts[256];
+    unsigned shift;
     int i;
-    char shift[100];
 
-    for (i = 0;((i < depth) && (i < 25));i++)
-        shift[2 * i] = shift[2 * i + 1] = ' ';
-    shift[2 * i] = shift[2 * i + 1] = 0;
+    for (shift = 0;
+         (shift < sizeof(size_t) * 8) && ((max >> shift) != 0);
+         shift += 8) {
+        xmlXPathDocOrderEntry *swap;
+        size_t pos = 0;
 
-    if (cur == NULL) {
-	fprintf(output, "%s", shift);
-	fprintf(output, "NodeSet is NULL !\n");
-	return;
+        memset(counts, 0, sizeof(counts));
+        for (i = 0; i < num; i++)
+            counts[(entries[i].order >> shift) & 0xFF] += 1;
+        for (i = 0; i < 256; i++) {
+            size_t c = counts[i];
 
-    }
+            counts[i] = pos;
+            pos += c;
+        }
+        for (i = 0; i < num; i++)
+            tmp[counts[(entries[i].order >> shift) & 0xFF]++] = entries[i];
 
-    if (cur != NULL) {
-	fprintf(output, "Set contains %d nodes:\n", cur->nodeNr);
-	for (i = 0;i < cur->nodeNr;i++) {
-	    fprintf(output, "%s", shift);
-	    fprintf(output, "%d", i + 1);
-	    xmlXPathDebugDumpNode(output, cur->nodeTab[i], depth + 1);
-	}
+        swap = entries;
+        entries = tmp;
+        tmp = swap;
     }
+
+    return(entries);
 }
 
-static void
-xmlXPathDebugDumpValueTree(FILE *output, xmlNodeSetPtr cur, int depth) {
+/**
+ * Sort a node set using the document order index.
+ *
+ * @param set  the node set
+ * @returns 0 on success or -1 if the index can't be used.
+ */
+static int
+xmlXPathNodeSetSortIndexed(xmlNodeSetPtr set) {
+    xmlXPathDocDataPtr order;
+    xmlXPathDocOrderEntry *entries, *sorted;
+    xmlDocPtr doc;
     int i;
-    char shift[100];
 
-    for (i = 0;((i < depth) && (i < 25));i++)
-        shift[2 * i] = shift[2 * i + 1] = ' ';
-    shift[2 * i] = shift[2 * i + 1] = 0;
+    /*
+     * Node sets are often sorted already. Checking is cheaper than
+     * looking up the nodes in the index.
+     */
+    for (i = 1; i < set->nodeNr; i++) {
+        if (XP_CMP_NODES(set->nodeTab[i - 1], set->nodeTab[i]) == -1)
+            break;
+    }
+    if (i >= set->nodeNr)
+        return(0);
 
-    if ((cur == NULL) || (cur->nodeNr == 0) || (cur->nodeTab[0] == NULL)) {
-	fprintf(output, "%s", shift);
-	fprintf(output, "Value Tree is NULL !\n");
-	return;
+    if (set->nodeTab[0]->type == XML_NAMESPACE_DECL)
+        return(-1);
+    doc = set->nodeTab[0]->doc;
+    if (doc == NULL)
+        return(-1);
+    order = xmlXPathGetDocOrder(doc, set->nodeNr);
+    if (order == NULL)
+        return(-1);
+
+    entries = xmlMalloc(set->nodeNr * 2 * sizeof(entries[0]));
+    if (entries == NULL)
+        return(-1);
 
+    for (i = 0; i < set->nodeNr; i++) {
+        xmlNodePtr node = set->nodeTab[i];
+
+        /* Namespace nodes, new nodes and nodes from other documents */
+        if ((node->type == XML_NAMESPACE_DECL) || (node->doc != doc))
+            break;
+        entries[i].order = xmlXPathDocOrderLookup(order, node);
+        if (entries[i].order == 0)
+            break;
+        entries[i].node = node;
+    }
+    if (i < set->nodeNr) {
+        xmlFree(entries);
+        return(-1);
     }
 
-    fprintf(output, "%s", shift);
-    fprintf(output, "%d", i + 1);
-    xmlXPathDebugDumpNodeList(output, cur->nodeTab[0]->children, depth + 1);
+    sorted = xmlXPathDocOrderRadixSort(entries, entries + set->nodeNr,
+                                       set->nodeNr, order->nodeNr);
+    for (i = 0; i < set->nodeNr; i++)
+        set->nodeTab[i] = (xmlNodePtr) sorted[i].node;
+
+    xmlFree(entries);
+    return(0);
 }
 
+/************************************************************************
+ *									*
+ *			Error handling routines				*
+ *									*
+ ************************************************************************/
+
 /**
- * Dump the content of the object for debugging purposes
+ * Macro to raise an XPath error and return NULL.
  *
- * @param output  the FILE * to dump the output
- * @param cur  the object to inspect
- * @param depth  indentation level
+ * @param X  the error code
  */
-void
-xmlXPathDebugDumpObject(FILE *output, xmlXPathObject *cur, int depth) {
-    int i;
-    char shift[100];
-
-    if (output == NULL) return;
-
-    for (i = 0;((i < depth) && (i < 25));i++)
-        shift[2 * i] = shift[2 * i + 1] = ' ';
-    shift[2 * i] = shift[2 * i + 1] = 0;
-
-
-    fprintf(output, "%s", shift);
+#define XP_ERRORNULL(X)							\
+    { xmlXPathErr(ctxt, X); return(NULL); }
 
-    if (cur == NULL) {
-        fprintf(output, "Object is empty (NULL)\n");
-	return;
-    }
-    switch(cur->type) {
-        case XPATH_UNDEFINED:
-	    fprintf(output, "Object is uninitialized\n");
-	    break;
-        case XPATH_NODESET:
-	    fprintf(output, "Object is a Node Set :\n");
-	    xmlXPathDebugDumpNodeSet(output, cur->nodesetval, depth);
-	    break;
-	case XPATH_XSLT_TREE:
-	    fprintf(output, "Object is an XSLT value tree :\n");
-	    xmlXPathDebugDumpValueTree(output, cur->nodesetval, depth);
-	    break;
-        case XPATH_BOOLEAN:
-	    fprintf(output, "Object is a Boolean : ");
-	    if (cur->boolval) fprintf(output, "true\n");
-	    else fprintf(output, "false\n");
-	    break;
-        case XPATH_NUMBER:
-	    switch (xmlXPathIsInf(cur->floatval)) {
-	    case 1:
-		fprintf(output, "Object is a number : Infinity\n");
-		break;
-	    case -1:
-		fprintf(output, "Object is a number : -Infinity\n");
-		break;
-	    default:
-		if (xmlXPathIsNaN(cur->floatval)) {
-		    fprintf(output, "Object is a number : NaN\n");
-		} else if (cur->floatval == 0) {
-                    /* Omit sign for negative zero. */
-		    fprintf(output, "Object is a number : 0\n");
-		} else {
-		    fprintf(output, "Object is a number : %0g\n", cur->floatval);
-		}
-	    }
-	    break;
-        case XPATH_STRING:
-	    fprintf(output, "Object is a string : ");
-	    xmlDebugDumpString(output, cur->stringval);
-	    fprintf(output, "\n");
-	    break;
-	case XPATH_USERS:
-	    fprintf(output, "Object is user defined\n");
-	    break;
-    }
+/*
+ * The array xmlXPathErrorMessages corresponds to the enum xmlXPathError
+ */
+static const char* const xmlXPathErrorMessages[] = {
+    "Ok",
+    "Number encoding",
+    "Unfinished literal",
+    "Start of literal",
+    "Expected $ for variable reference",
+    "Undefined variable",
+    "Invalid predicate",
+    "Invalid expression",
+    "Missing closing curly brace",
+    "Unregistered function",
+    "Invalid operand",
+    "Invalid type",
+    "Invalid number of arguments",
+    "Invalid context size",
+    "Invalid context position",
+    "Memory allocation error",
+    "Syntax error",
+    "Resource error",
+    "Sub resource error",
+    "Undefined namespace prefix",
+    "Encoding error",
+    "Char out of XML range",
+    "Invalid or incomplete context",
+    "Stack usage error",
+    "Forbidden variable",
+    "Operation limit exceeded",
+    "Recursion limit exceeded",
+    "?? Unknown error ??"	/* Must be last in the list! */
+};
+#define MAXERRNO ((int)(sizeof(xmlXPathErrorMessages) /	\
+		   sizeof(xmlXPathErrorMessages[0])) - 1)
+/**
+ * Handle a memory allocation failure.
+ *
+ * @param ctxt  an XPath context
+ */
+void
+xmlXPathErrMemory(xmlXPathContext *ctxt)
+{
+    if (ctxt == NULL)
+        return;
+    xmlRaiseMemoryError(ctxt->error, NULL, ctxt->userData, XML_FROM_XPATH,
+                        &ctxt->lastError);
+}
+
+/**
+ * Handle a memory allocation failure.
+ *
+ * @param ctxt  an XPath parser context
+ */
+void
+xmlXPathPErrMemory(xmlXPathParserContext *ctxt)
+{
+    if (ctxt == NULL)
+        return;
+    ctxt->error = XPATH_MEMORY_ERROR;
+    xmlXPathErrMemory(ctxt->context);
 }
 
+/**
+ * Handle an XPath error
+ *
+ * @param ctxt  a XPath parser context
+ * @param code  the error code
+ * @param fmt  format string for error message
+ * @param ...  extra args
+ */
 static void
-xmlXPathDebugDumpStepOp(FILE *output, xmlXPathCompExprPtr comp,
-	                     xmlXPathStepOpPtr op, int depth) {
-    int i;
-    char shift[100];
+xmlXPathErrFmt(xmlXPathParserContext *ctxt, int code, const char *fmt, ...) {
+    va_list ap;
+    xmlStructuredErrorFunc schannel = NULL;
+    xmlGenericErrorFunc channel = NULL;
+    void *data = NULL;
+    xmlNodePtr node = NULL;
+    int res;
 
-    for (i = 0;((i < depth) && (i < 25));i++)
-        shift[2 * i] = shift[2 * i + 1] = ' ';
-    shift[2 * i] = shift[2 * i + 1] = 0;
+    if (ctxt == NULL)
+        return;
+    if ((code < 0) || (code > MAXERRNO))
+	code = MAXERRNO;
+    /* Only report the first error */
+    if (ctxt->error != 0)
+        return;
 
-    fprintf(output, "%s", shift);
-    if (op == NULL) {
-	fprintf(output, "Step is NULL\n");
-	return;
-    }
-    switch (op->op) {
-        case XPATH_OP_END:
-	    fprintf(output, "END"); break;
-        case XPATH_OP_AND:
-	    fprintf(output, "AND"); break;
-        case XPATH_OP_OR:
-	    fprintf(output, "OR"); break;
-        case XPATH_OP_EQUAL:
-	     if (op->value)
-		 fprintf(output, "EQUAL =");
-	     else
-		 fprintf(output, "EQUAL !=");
-	     break;
-        case XPATH_OP_CMP:
-	     if (op->value)
-		 fprintf(output, "CMP <");
-	     else
-		 fprintf(output, "CMP >");
-	     if (!op->value2)
-		 fprintf(output, "=");
-	     break;
-        case XPATH_OP_PLUS:
-	     if (op->value == 0)
-		 fprintf(output, "PLUS -");
-	     else if (op->value == 1)
-		 fprintf(output, "PLUS +");
-	     else if (op->value == 2)
-		 fprintf(output, "PLUS unary -");
-	     else if (op->value == 3)
-		 fprintf(output, "PLUS unary - -");
-	     break;
-        case XPATH_OP_MULT:
-	     if (op->value == 0)
-		 fprintf(output, "MULT *");
-	     else if (op->value == 1)
-		 fprintf(output, "MULT div");
-	     else
-		 fprintf(output, "MULT mod");
-	     break;
-        case XPATH_OP_UNION:
-	     fprintf(output, "UNION"); break;
-        case XPATH_OP_ROOT:
-	     fprintf(output, "ROOT"); break;
-        case XPATH_OP_NODE:
-	     fprintf(output, "NODE"); break;
-        case XPATH_OP_SORT:
-	     fprintf(output, "SORT"); break;
-        case XPATH_OP_COLLECT: {
-	    xmlXPathAxisVal axis = (xmlXPathAxisVal)op->value;
-	    xmlXPathTestVal test = (xmlXPathTestVal)op->value2;
-	    xmlXPathTypeVal type = (xmlXPathTypeVal)op->value3;
-	    const xmlChar *prefix = op->value4;
-	    const xmlChar *name = op->value5;
+    ctxt->error = code;
 
-	    fprintf(output, "COLLECT ");
-	    switch (axis) {
-		case AXIS_ANCESTOR:
-		    fprintf(output, " 'ancestors' "); break;
-		case AXIS_ANCESTOR_OR_SELF:
-		    fprintf(output, " 'ancestors-or-self' "); break;
-		case AXIS_ATTRIBUTE:
-		    fprintf(output, " 'attributes' "); break;
-		case AXIS_CHILD:
-		    fprintf(output, " 'child' "); break;
-		case AXIS_DESCENDANT:
-		    fprintf(output, " 'descendant' "); break;
-		case AXIS_DESCENDANT_OR_SELF:
-		    fprintf(output, " 'descendant-or-self' "); break;
-		case AXIS_FOLLOWING:
-		    fprintf(output, " 'following' "); break;
-		case AXIS_FOLLOWING_SIBLING:
-		    fprintf(output, " 'following-siblings' "); break;
-		case AXIS_NAMESPACE:
-		    fprintf(output, " 'namespace' "); break;
-		case AXIS_PARENT:
-		    fprintf(output, " 'parent' "); break;
-		case AXIS_PRECEDING:
-		    fprintf(output, " 'preceding' "); break;
-		case AXIS_PRECEDING_SIBLING:
-		    fprintf(output, " 'preceding-sibling' "); break;
-		case AXIS_SELF:
-		    fprintf(output, " 'self' "); break;
-	    }
-	    switch (test) {
-                case NODE_TEST_NONE:
-		    fprintf(output, "'none' "); break;
-                case NODE_TEST_TYPE:
-		    fprintf(output, "'type' "); break;
-                case NODE_TEST_PI:
-		    fprintf(output, "'PI' "); break;
-                case NODE_TEST_ALL:
-		    fprintf(output, "'all' "); break;
-                case NODE_TEST_NS:
-		    fprintf(output, "'namespace' "); break;
-                case NODE_TEST_NAME:
-		    fprintf(output, "'name' "); break;
-	    }
-	    switch (type) {
-                case NODE_TYPE_NODE:
-		    fprintf(output, "'node' "); break;
-                case NODE_TYPE_COMMENT:
-		    fprintf(output, "'comment' "); break;
-                case NODE_TYPE_TEXT:
-		    fprintf(output, "'text' "); break;
-                case NODE_TYPE_PI:
-		    fprintf(output, "'PI' "); break;
-	    }
-	    if (prefix != NULL)
-		fprintf(output, "%s:", prefix);
-	    if (name != NULL)
-		fprintf(output, "%s", (const char *) name);
-	    break;
+    if (ctxt->context != NULL) {
+        xmlErrorPtr err = &ctxt->context->lastError;
 
-        }
-	case XPATH_OP_VALUE: {
-	    xmlXPathObjectPtr object = (xmlXPathObjectPtr) op->value4;
+        /* Don't overwrite memory error. */
+        if (err->code == XML_ERR_NO_MEMORY)
+            return;
 
-	    fprintf(output, "ELEM ");
-	    xmlXPathDebugDumpObject(output, object, 0);
-	    goto finish;
-	}
-	case XPATH_OP_VARIABLE: {
-	    const xmlChar *prefix = op->value5;
-	    const xmlChar *name = op->value4;
+        /* cleanup current last error */
+        xmlResetError(err);
 
-	    if (prefix != NULL)
-		fprintf(output, "VARIABLE %s:%s", prefix, name);
-	    else
-		fprintf(output, "VARIABLE %s", name);
-	    break;
-	}
-	case XPATH_OP_FUNCTION: {
-	    int nbargs = op->value;
-	    const xmlChar *prefix = op->value5;
-	    const xmlChar *name = op->value4;
+        err->domain = XML_FROM_XPATH;
+        err->code = code + XML_XPATH_EXPRESSION_OK - XPATH_EXPRESSION_OK;
+        err->level = XML_ERR_ERROR;
+        if (ctxt->base != NULL) {
+            err->str1 = (char *) xmlStrdup(ctxt->base);
+            if (err->str1 == NULL) {
+                xmlXPathPErrMemory(ctxt);
+                return;
+            }
+        }
+        err->int1 = ctxt->cur - ctxt->base;
+        err->node = ctxt->context->debugNode;
 
-	    if (prefix != NULL)
-		fprintf(output, "FUNCTION %s:%s(%d args)",
-			prefix, name, nbargs);
-	    else
-		fprintf(output, "FUNCTION %s(%d args)", name, nbargs);
-	    break;
-	}
-        case XPATH_OP_ARG: fprintf(output, "ARG"); break;
-        case XPATH_OP_PREDICATE: fprintf(output, "PREDICATE"); break;
-        case XPATH_OP_FILTER: fprintf(output, "FILTER"); break;
-	default:
-        fprintf(output, "UNKNOWN %d\n", op->op); return;
+        schannel = ctxt->context->error;
+        data = ctxt->context->userData;
+        node = ctxt->context->debugNode;
     }
-    fprintf(output, "\n");
-finish:
-    /* OP_VALUE has invalid ch1. */
-    if (op->op == XPATH_OP_VALUE)
-        return;
 
-    if (op->ch1 >= 0)
-	xmlXPathDebugDumpStepOp(output, comp, &comp->steps[op->ch1], depth + 1);
-    if (op->ch2 >= 0)
-	xmlXPathDebugDumpStepOp(output, comp, &comp->steps[op->ch2], depth + 1);
+    if (schannel == NULL) {
+        channel = xmlGenericError;
+        data = xmlGenericErrorContext;
+    }
+
+    va_start(ap, fmt);
+    res = xmlVRaiseError(schannel, channel, data, NULL, node, XML_FROM_XPATH,
+                         code + XML_XPATH_EXPRESSION_OK - XPATH_EXPRESSION_OK,
+                         XML_ERR_ERROR, NULL, 0,
+                         (const char *) ctxt->base, NULL, NULL,
+                         ctxt->cur - ctxt->base, 0,
+                         fmt, ap);
+    va_end(ap);
+    if (res < 0)
+        xmlXPathPErrMemory(ctxt);
 }
 
 /**
- * Dumps the tree of the compiled XPath expression.
+ * Handle an XPath error
  *
- * @param output  the FILE * for the output
- * @param comp  the precompiled XPath expression
- * @param depth  the indentation level.
+ * @param ctxt  a XPath parser context
+ * @param code  the error code
  */
 void
-xmlXPathDebugDumpCompExpr(FILE *output, xmlXPathCompExpr *comp,
-	                  int depth) {
-    int i;
-    char shift[100];
-
-    if ((output == NULL) || (comp == NULL)) return;
+xmlXPathErr(xmlXPathParserContext *ctxt, int code) {
+    xmlXPathErrFmt(ctxt, code, "%s\n", xmlXPathErrorMessages[code]);
+}
 
-    for (i = 0;((i < depth) && (i < 25));i++)
-        shift[2 * i] = shift[2 * i + 1] = ' ';
-    shift[2 * i] = shift[2 * i + 1] = 0;
+/**
+ * Formats an error message.
+ *
+ * @param ctxt  the XPath Parser context
+ * @param file  the file name
+ * @param line  the line number
+ * @param no  the error number
+ */
+void
+xmlXPatherror(xmlXPathParserContext *ctxt, const char *file ATTRIBUTE_UNUSED,
+              int line ATTRIBUTE_UNUSED, int no) {
+    xmlXPathErr(ctxt, no);
+}
 
-    fprintf(output, "%s", shift);
+/**
+ * Adds opCount to the running total of operations and returns -1 if the
+ * operation limit is exceeded. Returns 0 otherwise.
+ *
+ * @param ctxt  the XPath Parser context
+ * @param opCount  the number of operations to be added
+ */
+static int
+xmlXPathCheckOpLimit(xmlXPathParserContextPtr ctxt, unsigned long opCount) {
+    xmlXPathContextPtr xpctxt = ctxt->context;
 
-#ifdef XPATH_STREAMING
-    if (comp->stream) {
-        fprintf(output, "Streaming Expression\n");
-    } else
-#endif
-    {
-        fprintf(output, "Compiled Expression : %d elements\n",
-                comp->nbStep);
-        i = comp->last;
-        xmlXPathDebugDumpStepOp(output, comp, &comp->steps[i], depth + 1);
+    if ((opCount > xpctxt->opLimit) ||
+        (xpctxt->opCount > xpctxt->opLimit - opCount)) {
+        xpctxt->opCount = xpctxt->opLimit;
+        xmlXPathErr(ctxt, XPATH_OP_LIMIT_EXCEEDED);
+        return(-1);
     }
+
+    xpctxt->opCount += opCount;
+    return(0);
 }
 
-#endif /* LIBXML_DEBUG_ENABLED */
+#define OP_LIMIT_EXCEEDED(ctxt, n) \
+    ((ctxt->context->opLimit != 0) && (xmlXPathCheckOpLimit(ctxt, n) < 0))
 
 /************************************************************************
  *									*
- *			XPath object caching				*
+ *			Parser Types					*
  *									*
  ************************************************************************/
 
-/**
- * Create a new object cache
- *
- * @returns the xmlXPathCache just allocated.
+/*
+ * Types are private:
  */
-static xmlXPathContextCachePtr
-xmlXPathNewCache(void)
-{
-    xmlXPathContextCachePtr ret;
-
-    ret = (xmlXPathContextCachePtr) xmlMalloc(sizeof(xmlXPathContextCache));
-    if (ret == NULL)
-	return(NULL);
-    memset(ret, 0 , sizeof(xmlXPathContextCache));
-    ret->maxNodeset = 100;
-    ret->maxMisc = 100;
-    return(ret);
-}
 
-static void
-xmlXPathCacheFreeObjectList(xmlXPathObjectPtr list)
-{
-    while (list != NULL) {
-        xmlXPathObjectPtr next;
+typedef enum {
+    XPATH_OP_END=0,
+    XPATH_OP_AND,
+    XPATH_OP_OR,
+    XPATH_OP_EQUAL,
+    XPATH_OP_CMP,
+    XPATH_OP_PLUS,
+    XPATH_OP_MULT,
+    XPATH_OP_UNION,
+    XPATH_OP_ROOT,
+    XPATH_OP_NODE,
+    XPATH_OP_COLLECT,
+    XPATH_OP_VALUE, /* 11 */
+    XPATH_OP_VARIABLE,
+    XPATH_OP_FUNCTION,
+    XPATH_OP_ARG,
+    XPATH_OP_PREDICATE,
+    XPATH_OP_FILTER, /* 16 */
+    XPATH_OP_SORT /* 17 */
+} xmlXPathOp;
 
-        next = (void *) list->stringval;
+typedef enum {
+    AXIS_ANCESTOR = 1,
+    AXIS_ANCESTOR_OR_SELF,
+    AXIS_ATTRIBUTE,
+    AXIS_CHILD,
+    AXIS_DESCENDANT,
+    AXIS_DESCENDANT_OR_SELF,
+    AXIS_FOLLOWING,
+    AXIS_FOLLOWING_SIBLING,
+    AXIS_NAMESPACE,
+    AXIS_PARENT,
+    AXIS_PRECEDING,
+    AXIS_PRECEDING_SIBLING,
+    AXIS_SELF
+} xmlXPathAxisVal;
 
-	if (list->nodesetval != NULL) {
-	    if (list->nodesetval->nodeTab != NULL)
-		xmlFree(list->nodesetval->nodeTab);
-	    xmlFree(list->nodesetval);
-	}
-	xmlFree(list);
+typedef enum {
+    NODE_TEST_NONE = 0,
+    NODE_TEST_TYPE = 1,
+    NODE_TEST_PI = 2,
+    NODE_TEST_ALL = 3,
+    NODE_TEST_NS = 4,
+    NODE_TEST_NAME = 5
+} xmlXPathTestVal;
 
-        list = next;
-    }
-}
+typedef enum {
+    NODE_TYPE_NODE = 0,
+    NODE_TYPE_COMMENT = XML_COMMENT_NODE,
+    NODE_TYPE_TEXT = XML_TEXT_NODE,
+    NODE_TYPE_PI = XML_PI_NODE
+} xmlXPathTypeVal;
 
-static void
-xmlXPathFreeCache(xmlXPathContextCachePtr cache)
-{
-    if (cache == NULL)
-	return;
-    if (cache->nodesetObjs)
-	xmlXPathCacheFreeObjectList(cache->nodesetObjs);
-    if (cache->miscObjs)
-	xmlXPathCacheFreeObjectList(cache->miscObjs);
-    xmlFree(cache);
-}
+typedef struct _xmlXPathStepOp xmlXPathStepOp;
+typedef xmlXPathStepOp *xmlXPathStepOpPtr;
+struct _xmlXPathStepOp {
+    xmlXPathOp op;		/* The identifier of the operation */
+    int ch1;			/* First child */
+    int ch2;			/* Second child */
+    int value;
+    int value2;
+    int value3;
+    void *value4;
+    void *value5;
+    xmlXPathFunction cache;
+    void *cacheURI;
+    int flags;			/* XP_STEP_* flags set by the planner */
+};
 
-/**
- * Creates/frees an object cache on the XPath context.
- * If activates XPath objects (xmlXPathObject) will be cached internally
- * to be reused.
- *
- * `options` must be set to 0 to enable XPath object caching.
- * Other values for `options` have currently no effect.
- *
- * `value` sets the maximum number of XPath objects to be cached per slot.
- * There are two slots for node-set and misc objects.
- * Use <0 for the default number (100).
- *
- * @param ctxt  the XPath context
- * @param active  enables/disables (creates/frees) the cache
- * @param value  a value with semantics dependent on `options`
- * @param options  options (currently only the value 0 is used)
- * @returns 0 if the setting succeeded, and -1 on API or internal errors.
+/*
+ * The node-sets selected from different context nodes don't overlap,
+ * so they can be merged without checking for duplicates.
  */
-int
-xmlXPathContextSetCache(xmlXPathContext *ctxt,
-			int active,
-			int value,
-			int options)
-{
-    if (ctxt == NULL)
-	return(-1);
-    if (active) {
-	xmlXPathContextCachePtr cache;
-
-	if (ctxt->cache == NULL) {
-	    ctxt->cache = xmlXPathNewCache();
-	    if (ctxt->cache == NULL) {
-                xmlXPathErrMemory(ctxt);
-		return(-1);
-            }
-	}
-	cache = (xmlXPathContextCachePtr) ctxt->cache;
-	if (options == 0) {
-	    if (value < 0)
-		value = 100;
-	    cache->maxNodeset = value;
-	    cache->maxMisc = value;
-	}
-    } else if (ctxt->cache != NULL) {
-	xmlXPathFreeCache((xmlXPathContextCachePtr) ctxt->cache);
-	ctxt->cache = NULL;
-    }
-    return(0);
-}
+#define XP_STEP_NO_DUPS     (1 << 0)
+/*
+ * Skip context nodes inside the subtree of an earlier context node.
+ * Only used for descendant axes whose predicates ignore the position.
+ */
+#define XP_STEP_PRUNE       (1 << 1)
 
-/**
- * This is the cached version of #xmlXPathWrapNodeSet.
- * Wrap the Nodeset `val` in a new xmlXPathObject
- *
- * In case of error the node set is destroyed and NULL is returned.
- *
- * @param pctxt  the XPath context
- * @param val  the NodePtr value
- * @returns the created or reused object.
+/*
+ * The expression only calls standard functions, so its result only
+ * depends on the tree, the context node and variables.
  */
-static xmlXPathObjectPtr
-xmlXPathCacheWrapNodeSet(xmlXPathParserContextPtr pctxt, xmlNodeSetPtr val)
-{
-    xmlXPathObjectPtr ret;
-    xmlXPathContextPtr ctxt = pctxt->context;
+#define XP_COMP_CACHEABLE   (1 << 0)
+/* The expression references variables */
+#define XP_COMP_HAS_VARS    (1 << 1)
 
-    if ((ctxt != NULL) && (ctxt->cache != NULL)) {
-	xmlXPathContextCachePtr cache =
-	    (xmlXPathContextCachePtr) ctxt->cache;
+/* Specialized evaluation functions, see xmlXPathCompiledSpecialize */
+typedef struct _xmlXPathSpec xmlXPathSpec;
 
-	if (cache->miscObjs != NULL) {
-	    ret = cache->miscObjs;
-            cache->miscObjs = (void *) ret->stringval;
-            cache->numMisc -= 1;
-            ret->stringval = NULL;
-	    ret->type = XPATH_NODESET;
-	    ret->nodesetval = val;
-	    return(ret);
-	}
-    }
+struct _xmlXPathCompExpr {
+    int nbStep;			/* Number of steps in this expression */
+    int maxStep;		/* Maximum number of steps allocated */
+    xmlXPathStepOp *steps;	/* ops for computation of this expression */
+    int last;			/* index of last step in expression */
+    xmlChar *expr;		/* the expression being computed */
+    xmlDictPtr dict;		/* the dictionary to use if any */
+    unsigned long serial;	/* serial number if results can be cached */
+    int cacheFlags;		/* XP_COMP_* flags */
+    xmlXPathSpec *spec;		/* specialized form or NULL */
+#ifdef XPATH_STREAMING
+    xmlPatternPtr stream;
+#endif
+};
 
-    ret = xmlXPathWrapNodeSet(val);
-    if (ret == NULL)
-        xmlXPathPErrMemory(pctxt);
-    return(ret);
-}
+/************************************************************************
+ *									*
+ *			Forward declarations				*
+ *									*
+ ************************************************************************/
+
+static void
+xmlXPathReleaseObject(xmlXPathContextPtr ctxt, xmlXPathObjectPtr obj);
+static int
+xmlXPathCompOpEvalFirst(xmlXPathParserContextPtr ctxt,
+                        xmlXPathStepOpPtr op, xmlNodePtr *first);
+static int
+xmlXPathCompOpEvalToBoolean(xmlXPathParserContextPtr ctxt,
+			    xmlXPathStepOpPtr op,
+			    int isPredicate);
+static void
+xmlXPathFreeObjectEntry(void *obj, const xmlChar *name);
+static void
+xmlXPathSpecFree(xmlXPathSpec *spec);
+static int
+xmlXPathEstimateCost(xmlXPathCompExprPtr comp, xmlXPathStepOpPtr op,
+                     int depth);
+
+/************************************************************************
+ *									*
+ *			Parser Type functions				*
+ *									*
+ ************************************************************************/
 
 /**
- * This is the cached version of #xmlXPathWrapString.
- * Wraps the `val` string into an XPath object.
+ * Create a new Xpath component
  *
- * @param pctxt  the XPath context
- * @param val  the xmlChar * value
- * @returns the created or reused object.
+ * @returns the newly allocated xmlXPathCompExpr or NULL in case of error
  */
-static xmlXPathObjectPtr
-xmlXPathCacheWrapString(xmlXPathParserContextPtr pctxt, xmlChar *val)
-{
-    xmlXPathObjectPtr ret;
-    xmlXPathContextPtr ctxt = pctxt->context;
-
-    if ((ctxt != NULL) && (ctxt->cache != NULL)) {
-	xmlXPathContextCachePtr cache = (xmlXPathContextCachePtr) ctxt->cache;
+static xmlXPathCompExprPtr
+xmlXPathNewCompExpr(void) {
+    xmlXPathCompExprPtr cur;
 
-	if (cache->miscObjs != NULL) {
-	    ret = cache->miscObjs;
-            cache->miscObjs = (void *) ret->stringval;
-            cache->numMisc -= 1;
-	    ret->type = XPATH_STRING;
-	    ret->stringval = val;
-	    return(ret);
-	}
+    cur = (xmlXPathCompExprPtr) xmlMalloc(sizeof(xmlXPathCompExpr));
+    if (cur == NULL)
+	return(NULL);
+    memset(cur, 0, sizeof(xmlXPathCompExpr));
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+    cur->maxStep = 1;
+#else
+    cur->maxStep = 10;
+#endif
+    cur->nbStep = 0;
+    cur->steps = (xmlXPathStepOp *) xmlMalloc(cur->maxStep *
+	                                   sizeof(xmlXPathStepOp));
+    if (cur->steps == NULL) {
+	xmlFree(cur);
+	return(NULL);
     }
-
-    ret = xmlXPathWrapString(val);
-    if (ret == NULL)
-        xmlXPathPErrMemory(pctxt);
-    return(ret);
+    memset(cur->steps, 0, cur->maxStep * sizeof(xmlXPathStepOp));
+    cur->last = -1;
+    return(cur);
 }
 
 /**
- * This is the cached version of #xmlXPathNewNodeSet.
- * Acquire an xmlXPathObject of type NodeSet and initialize
- * it with the single Node `val`
+ * Free up the memory allocated by `comp`
  *
- * @param pctxt  the XPath context
- * @param val  the NodePtr value
- * @returns the created or reused object.
+ * @param comp  an XPATH comp
  */
-static xmlXPathObjectPtr
-xmlXPathCacheNewNodeSet(xmlXPathParserContextPtr pctxt, xmlNodePtr val)
+void
+xmlXPathFreeCompExpr(xmlXPathCompExpr *comp)
 {
-    xmlXPathObjectPtr ret;
-    xmlXPathContextPtr ctxt = pctxt->context;
-
-    if ((ctxt != NULL) && (ctxt->cache != NULL)) {
-	xmlXPathContextCachePtr cache = (xmlXPathContextCachePtr) ctxt->cache;
+    xmlXPathStepOpPtr op;
+    int i;
 
-	if (cache->nodesetObjs != NULL) {
-	    /*
-	    * Use the nodeset-cache.
-	    */
-	    ret = cache->nodesetObjs;
-            cache->nodesetObjs = (void *) ret->stringval;
-            cache->numNodeset -= 1;
-            ret->stringval = NULL;
-	    ret->type = XPATH_NODESET;
-	    ret->boolval = 0;
-	    if (val) {
-		if ((ret->nodesetval->nodeMax == 0) ||
-		    (val->type == XML_NAMESPACE_DECL))
-		{
-		    if (xmlXPathNodeSetAddUnique(ret->nodesetval, val) < 0)
-                        xmlXPathPErrMemory(pctxt);
-		} else {
-		    ret->nodesetval->nodeTab[0] = val;
-		    ret->nodesetval->nodeNr = 1;
-		}
+    if (comp == NULL)
+        return;
+    if (comp->dict == NULL) {
+	for (i = 0; i < comp->nbStep; i++) {
+	    op = &comp->steps[i];
+	    if (op->value4 != NULL) {
+		if (op->op == XPATH_OP_VALUE)
+		    xmlXPathFreeObject(op->value4);
+		else
+		    xmlFree(op->value4);
 	    }
-	    return(ret);
-	} else if (cache->miscObjs != NULL) {
-            xmlNodeSetPtr set;
-	    /*
-	    * Fallback to misc-cache.
-	    */
-
-	    set = xmlXPathNodeSetCreate(val);
-	    if (set == NULL) {
-                xmlXPathPErrMemory(pctxt);
-		return(NULL);
+	    if (op->value5 != NULL)
+		xmlFree(op->value5);
+	}
+    } else {
+	for (i = 0; i < comp->nbStep; i++) {
+	    op = &comp->steps[i];
+	    if (op->value4 != NULL) {
+		if (op->op == XPATH_OP_VALUE)
+		    xmlXPathFreeObject(op->value4);
 	    }
-
-	    ret = cache->miscObjs;
-            cache->miscObjs = (void *) ret->stringval;
-            cache->numMisc -= 1;
-            ret->stringval = NULL;
-	    ret->type = XPATH_NODESET;
-	    ret->boolval = 0;
-	    ret->nodesetval = set;
-	    return(ret);
 	}
+        xmlDictFree(comp->dict);
     }
-    ret = xmlXPathNewNodeSet(val);
-    if (ret == NULL)
-        xmlXPathPErrMemory(pctxt);
-    return(ret);
+    if (comp->steps != NULL) {
+        xmlFree(comp->steps);
+    }
+    xmlXPathSpecFree(comp->spec);
+#ifdef XPATH_STREAMING
+    if (comp->stream != NULL) {
+        xmlFreePatternList(comp->stream);
+    }
+#endif
+    if (comp->expr != NULL) {
+        xmlFree(comp->expr);
+    }
+
+    xmlFree(comp);
 }
 
 /**
- * This is the cached version of #xmlXPathNewString.
- * Acquire an xmlXPathObject of type string and of value `val`
+ * Add a step to an XPath Compiled Expression
  *
- * @param pctxt  the XPath context
- * @param val  the xmlChar * value
- * @returns the created or reused object.
- */
-static xmlXPathObjectPtr
-xmlXPathCacheNewString(xmlXPathParserContextPtr pctxt, const xmlChar *val)
-{
-    xmlXPathObjectPtr ret;
-    xmlXPathContextPtr ctxt = pctxt->context;
+ * @param ctxt  XPath parser context
+ * @param ch1  first child index
+ * @param ch2  second child index
+ * @param op  an op
+ * @param value  the first int value
+ * @param value2  the second int value
+ * @param value3  the third int value
+ * @param value4  the first string value
+ * @param value5  the second string value
+ * @returns -1 in case of failure, the index otherwise
+ */
+static int
+xmlXPathCompExprAdd(xmlXPathParserContextPtr ctxt, int ch1, int ch2,
+   xmlXPathOp op, int value,
+   int value2, int value3, void *value4, void *value5) {
+    xmlXPathCompExprPtr comp = ctxt->comp;
+    if (comp->nbStep >= comp->maxStep) {
+	xmlXPathStepOp *real;
+        int newSize;
 
-    if ((ctxt != NULL) && (ctxt->cache != NULL)) {
-	xmlXPathContextCachePtr cache = (xmlXPathContextCachePtr) ctxt->cache;
+        newSize = xmlGrowCapacity(comp->maxStep, sizeof(real[0]),
+                                  10, XPATH_MAX_STEPS);
+        if (newSize < 0) {
+	    xmlXPathPErrMemory(ctxt);
+	    return(-1);
+        }
+	real = xmlRealloc(comp->steps, newSize * sizeof(real[0]));
+	if (real == NULL) {
+	    xmlXPathPErrMemory(ctxt);
+	    return(-1);
+	}
+	comp->steps = real;
+	comp->maxStep = newSize;
+    }
+    comp->last = comp->nbStep;
+    comp->steps[comp->nbStep].ch1 = ch1;
+    comp->steps[comp->nbStep].ch2 = ch2;
+    comp->steps[comp->nbStep].op = op;
+    comp->steps[comp->nbStep].value = value;
+    comp->steps[comp->nbStep].value2 = value2;
+    comp->steps[comp->nbStep].value3 = value3;
+    if ((comp->dict != NULL) &&
+        ((op == XPATH_OP_FUNCTION) || (op == XPATH_OP_VARIABLE) ||
+	 (op == XPATH_OP_COLLECT))) {
+        if (value4 != NULL) {
+	    comp->steps[comp->nbStep].value4 = (xmlChar *)
+	        (void *)xmlDictLookup(comp->dict, value4, -1);
+	    xmlFree(value4);
+	} else
+	    comp->steps[comp->nbStep].value4 = NULL;
+        if (value5 != NULL) {
+	    comp->steps[comp->nbStep].value5 = (xmlChar *)
+	        (void *)xmlDictLookup(comp->dict, value5, -1);
+	    xmlFree(value5);
+	} else
+	    comp->steps[comp->nbStep].value5 = NULL;
+    } else {
+	comp->steps[comp->nbStep].value4 = value4;
+	comp->steps[comp->nbStep].value5 = value5;
+    }
+    comp->steps[comp->nbStep].cache = NULL;
+    comp->steps[comp->nbStep].flags = 0;
+    return(comp->nbStep++);
+}
 
-	if (cache->miscObjs != NULL) {
-            xmlChar *copy;
+#define PUSH_FULL_EXPR(op, op1, op2, val, val2, val3, val4, val5)	\
+    xmlXPathCompExprAdd(ctxt, (op1), (op2),			\
+	                (op), (val), (val2), (val3), (val4), (val5))
+#define PUSH_LONG_EXPR(op, val, val2, val3, val4, val5)			\
+    xmlXPathCompExprAdd(ctxt, ctxt->comp->last, -1,		\
+	                (op), (val), (val2), (val3), (val4), (val5))
 
-            if (val == NULL)
-                val = BAD_CAST "";
-            copy = xmlStrdup(val);
-            if (copy == NULL) {
-                xmlXPathPErrMemory(pctxt);
-                return(NULL);
-            }
+#define PUSH_LEAVE_EXPR(op, val, val2)					\
+xmlXPathCompExprAdd(ctxt, -1, -1, (op), (val), (val2), 0 ,NULL ,NULL)
 
-	    ret = cache->miscObjs;
-            cache->miscObjs = (void *) ret->stringval;
-            cache->numMisc -= 1;
-	    ret->type = XPATH_STRING;
-            ret->stringval = copy;
-	    return(ret);
-	}
-    }
+#define PUSH_UNARY_EXPR(op, ch, val, val2)				\
+xmlXPathCompExprAdd(ctxt, (ch), -1, (op), (val), (val2), 0 ,NULL ,NULL)
 
-    ret = xmlXPathNewString(val);
-    if (ret == NULL)
-        xmlXPathPErrMemory(pctxt);
-    return(ret);
-}
+#define PUSH_BINARY_EXPR(op, ch1, ch2, val, val2)			\
+xmlXPathCompExprAdd(ctxt, (ch1), (ch2), (op),			\
+			(val), (val2), 0 ,NULL ,NULL)
 
-/**
- * This is the cached version of #xmlXPathNewCString.
- * Acquire an xmlXPathObject of type string and of value `val`
- *
- * @param pctxt  the XPath context
- * @param val  the char * value
- * @returns the created or reused object.
- */
-static xmlXPathObjectPtr
-xmlXPathCacheNewCString(xmlXPathParserContextPtr pctxt, const char *val)
-{
-    return xmlXPathCacheNewString(pctxt, BAD_CAST val);
-}
+/************************************************************************
+ *									*
+ *		XPath object cache structures				*
+ *									*
+ ************************************************************************/
 
-/**
- * This is the cached version of #xmlXPathNewBoolean.
- * Acquires an xmlXPathObject of type boolean and of value `val`
- *
- * @param pctxt  the XPath context
- * @param val  the boolean value
- * @returns the created or reused object.
- */
-static xmlXPathObjectPtr
-xmlXPathCacheNewBoolean(xmlXPathParserContextPtr pctxt, int val)
-{
-    xmlXPathObjectPtr ret;
-    xmlXPathContextPtr ctxt = pctxt->context;
+/* #define XP_DEFAULT_CACHE_ON */
 
-    if ((ctxt != NULL) && (ctxt->cache != NULL)) {
-	xmlXPathContextCachePtr cache = (xmlXPathContextCachePtr) ctxt->cache;
+typedef struct _xmlXPathContextCache xmlXPathContextCache;
+typedef xmlXPathContextCache *xmlXPathContextCachePtr;
+struct _xmlXPathContextCache {
+    xmlXPathObjectPtr nodesetObjs;  /* stringval points to next */
+    xmlXPathObjectPtr miscObjs;     /* stringval points to next */
+    int numNodeset;
+    int maxNodeset;
+    int numMisc;
+    int maxMisc;
+};
+
+/************************************************************************
+ *									*
+ *		Debugging related functions				*
+ *									*
+ ************************************************************************/
+
+#ifdef LIBXML_DEBUG_ENABLED
+static void
+xmlXPathDebugDumpNode(FILE *output, xmlNodePtr cur, int depth) {
+    int i;
+    char shift[100];
+
+    for (i = 0;((i < depth) && (i < 25));i++)
+        shift[2 * i] = shift[2 * i + 1] = ' ';
+    shift[2 * i] = shift[2 * i + 1] = 0;
+    if (cur == NULL) {
+	fprintf(output, "%s", shift);
+	fprintf(output, "Node is NULL !\n");
+	return;
 
-	if (cache->miscObjs != NULL) {
-	    ret = cache->miscObjs;
-            cache->miscObjs = (void *) ret->stringval;
-            cache->numMisc -= 1;
-            ret->stringval = NULL;
-	    ret->type = XPATH_BOOLEAN;
-	    ret->boolval = (val != 0);
-	    return(ret);
-	}
     }
 
-    ret = xmlXPathNewBoolean(val);
-    if (ret == NULL)
-        xmlXPathPErrMemory(pctxt);
-    return(ret);
+    if ((cur->type == XML_DOCUMENT_NODE) ||
+	     (cur->type == XML_HTML_DOCUMENT_NODE)) {
+	fprintf(output, "%s", shift);
+	fprintf(output, " /\n");
+    } else if (cur->type == XML_ATTRIBUTE_NODE)
+	xmlDebugDumpAttr(output, (xmlAttrPtr)cur, depth);
+    else
+	xmlDebugDumpOneNode(output, cur, depth);
 }
+static void
+xmlXPathDebugDumpNodeList(FILE *output, xmlNodePtr cur, int depth) {
+    xmlNodePtr tmp;
+    int i;
+    char shift[100];
 
-/**
- * This is the cached version of #xmlXPathNewFloat.
- * Acquires an xmlXPathObject of type double and of value `val`
- *
- * @param pctxt  the XPath context
- * @param val  the double value
- * @returns the created or reused object.
- */
-static xmlXPathObjectPtr
-xmlXPathCacheNewFloat(xmlXPathParserContextPtr pctxt, double val)
-{
-    xmlXPathObjectPtr ret;
-    xmlXPathContextPtr ctxt = pctxt->context;
-
-    if ((ctxt != NULL) && (ctxt->cache != NULL)) {
-	xmlXPathContextCachePtr cache = (xmlXPathContextCachePtr) ctxt->cache;
+    for (i = 0;((i < depth) && (i < 25));i++)
+        shift[2 * i] = shift[2 * i + 1] = ' ';
+    shift[2 * i] = shift[2 * i + 1] = 0;
+    if (cur == NULL) {
+	fprintf(output, "%s", shift);
+	fprintf(output, "Node is NULL !\n");
+	return;
 
-	if (cache->miscObjs != NULL) {
-	    ret = cache->miscObjs;
-            cache->miscObjs = (void *) ret->stringval;
-            cache->numMisc -= 1;
-            ret->stringval = NULL;
-	    ret->type = XPATH_NUMBER;
-	    ret->floatval = val;
-	    return(ret);
-	}
     }
 
-    ret = xmlXPathNewFloat(val);
-    if (ret == NULL)
-        xmlXPathPErrMemory(pctxt);
-    return(ret);
+    while (cur != NULL) {
+	tmp = cur;
+	cur = cur->next;
+	xmlDebugDumpOneNode(output, tmp, depth);
+    }
 }
 
-/**
- * This is the cached version of #xmlXPathObjectCopy.
- * Acquire a copy of a given object
- *
- * @param pctxt  the XPath context
- * @param val  the original object
- * @returns a created or reused created object.
- */
-static xmlXPathObjectPtr
-xmlXPathCacheObjectCopy(xmlXPathParserContextPtr pctxt, xmlXPathObjectPtr val)
-{
-    xmlXPathObjectPtr ret;
-    xmlXPathContextPtr ctxt = pctxt->context;
+static void
+xmlXPathDebugDumpNodeSet(FILE *output, xmlNodeSetPtr cur, int depth) {
+    int i;
+    char shift[100];
 
-    if (val == NULL)
-	return(NULL);
+    for (i = 0;((i < depth) && (i < 25));i++)
+        shift[2 * i] = shift[2 * i + 1] = ' ';
+    shift[2 * i] = shift[2 * i + 1] = 0;
 
-    if ((ctxt != NULL) && (ctxt->cache != NULL)) {
-	switch (val->type) {
-            case XPATH_NODESET: {
-                xmlNodeSetPtr set;
+    if (cur == NULL) {
+	fprintf(output, "%s", shift);
+	fprintf(output, "NodeSet is NULL !\n");
+	return;
 
-                set = xmlXPathNodeSetMerge(NULL, val->nodesetval);
-                if (set == NULL) {
-                    xmlXPathPErrMemory(pctxt);
-                    return(NULL);
-                }
-                return(xmlXPathCacheWrapNodeSet(pctxt, set));
-            }
-	    case XPATH_STRING:
-		return(xmlXPathCacheNewString(pctxt, val->stringval));
-	    case XPATH_BOOLEAN:
-		return(xmlXPathCacheNewBoolean(pctxt, val->boolval));
-	    case XPATH_NUMBER:
-		return(xmlXPathCacheNewFloat(pctxt, val->floatval));
-	    default:
-		break;
+    }
+
+    if (cur != NULL) {
+	fprintf(output, "Set contains %d nodes:\n", cur->nodeNr);
+	for (i = 0;i < cur->nodeNr;i++) {
+	    fprintf(output, "%s", shift);
+	    fprintf(output, "%d", i + 1);
+	    xmlXPathDebugDumpNode(output, cur->nodeTab[i], depth + 1);
 	}
     }
-    ret = xmlXPathObjectCopy(val);
-    if (ret == NULL)
-        xmlXPathPErrMemory(pctxt);
-    return(ret);
 }
 
-/************************************************************************
- *									*
- *		Parser stacks related functions and macros		*
- *									*
- ************************************************************************/
+static void
+xmlXPathDebugDumpValueTree(FILE *output, xmlNodeSetPtr cur, int depth) {
+    int i;
+    char shift[100];
 
-/**
- * Converts an XPath object to its number value
- *
- * @param ctxt  parser context
- * @param val  an XPath object
- * @returns the number value
- */
-static double
-xmlXPathCastToNumberInternal(xmlXPathParserContextPtr ctxt,
-                             xmlXPathObjectPtr val) {
-    double ret = 0.0;
+    for (i = 0;((i < depth) && (i < 25));i++)
+        shift[2 * i] = shift[2 * i + 1] = ' ';
+    shift[2 * i] = shift[2 * i + 1] = 0;
 
-    if (val == NULL)
-	return(xmlXPathNAN);
-    switch (val->type) {
-    case XPATH_UNDEFINED:
-	ret = xmlXPathNAN;
-	break;
-    case XPATH_NODESET:
-    case XPATH_XSLT_TREE: {
-        xmlChar *str;
+    if ((cur == NULL) || (cur->nodeNr == 0) || (cur->nodeTab[0] == NULL)) {
+	fprintf(output, "%s", shift);
+	fprintf(output, "Value Tree is NULL !\n");
+	return;
 
-	str = xmlXPathCastNodeSetToString(val->nodesetval);
-        if (str == NULL) {
-            xmlXPathPErrMemory(ctxt);
-            ret = xmlXPathNAN;
-        } else {
-	    ret = xmlXPathCastStringToNumber(str);
-            xmlFree(str);
-        }
-	break;
-    }
-    case XPATH_STRING:
-	ret = xmlXPathCastStringToNumber(val->stringval);
-	break;
-    case XPATH_NUMBER:
-	ret = val->floatval;
-	break;
-    case XPATH_BOOLEAN:
-	ret = xmlXPathCastBooleanToNumber(val->boolval);
-	break;
-    case XPATH_USERS:
-	/* TODO */
-	ret = xmlXPathNAN;
-	break;
     }
-    return(ret);
+
+    fprintf(output, "%s", shift);
+    fprintf(output, "%d", i + 1);
+    xmlXPathDebugDumpNodeList(output, cur->nodeTab[0]->children, depth + 1);
 }
 
 /**
- * Pops the top XPath object from the value stack
+ * Dump the content of the object for debugging purposes
  *
- * @param ctxt  an XPath evaluation context
- * @returns the XPath object just removed
+ * @param output  the FILE * to dump the output
+ * @param cur  the object to inspect
+ * @param depth  indentation level
  */
-xmlXPathObject *
-xmlXPathValuePop(xmlXPathParserContext *ctxt)
-{
-    xmlXPathObjectPtr ret;
+void
+xmlXPathDebugDumpObject(FILE *output, xmlXPathObject *cur, int depth) {
+    int i;
+    char shift[100];
 
-    if ((ctxt == NULL) || (ctxt->valueNr <= 0))
-        return (NULL);
+    if (output == NULL) return;
 
-    ctxt->valueNr--;
-    if (ctxt->valueNr > 0)
-        ctxt->value = ctxt->valueTab[ctxt->valueNr - 1];
-    else
-        ctxt->value = NULL;
-    ret = ctxt->valueTab[ctxt->valueNr];
-    ctxt->valueTab[ctxt->valueNr] = NULL;
-    return (ret);
-}
+    for (i = 0;((i < depth) && (i < 25));i++)
+        shift[2 * i] = shift[2 * i + 1] = ' ';
+    shift[2 * i] = shift[2 * i + 1] = 0;
 
-/**
- * Pushes a new XPath object on top of the value stack. If value is NULL,
- * a memory error is recorded in the parser context.
- *
- * The object is destroyed in case of error.
- *
- * @param ctxt  an XPath evaluation context
- * @param value  the XPath object
- * @returns the number of items on the value stack, or -1 in case of error.
- */
-int
-xmlXPathValuePush(xmlXPathParserContext *ctxt, xmlXPathObject *value)
-{
-    if (ctxt == NULL) return(-1);
-    if (value == NULL) {
-        /*
-         * A NULL value typically indicates that a memory allocation failed.
-         */
-        xmlXPathPErrMemory(ctxt);
-        return(-1);
-    }
-    if (ctxt->valueNr >= ctxt->valueMax) {
-        xmlXPathObjectPtr *tmp;
-        int newSize;
 
-        newSize = xmlGrowCapacity(ctxt->valueMax, sizeof(tmp[0]),
-                                  10, XPATH_MAX_STACK_DEPTH);
-        if (newSize < 0) {
-            xmlXPathPErrMemory(ctxt);
-            xmlXPathFreeObject(value);
-            return (-1);
-        }
-        tmp = xmlRealloc(ctxt->valueTab, newSize * sizeof(tmp[0]));
-        if (tmp == NULL) {
-            xmlXPathPErrMemory(ctxt);
-            xmlXPathFreeObject(value);
-            return (-1);
-        }
-	ctxt->valueTab = tmp;
-        ctxt->valueMax = newSize;
+    fprintf(output, "%s", shift);
+
+    if (cur == NULL) {
+        fprintf(output, "Object is empty (NULL)\n");
+	return;
+    }
+    switch(cur->type) {
+        case XPATH_UNDEFINED:
+	    fprintf(output, "Object is uninitialized\n");
+	    break;
+        case XPATH_NODESET:
+	    fprintf(output, "Object is a Node Set :\n");
+	    xmlXPathDebugDumpNodeSet(output, cur->nodesetval, depth);
+	    break;
+	case XPATH_XSLT_TREE:
+	    fprintf(output, "Object is an XSLT value tree :\n");
+	    xmlXPathDebugDumpValueTree(output, cur->nodesetval, depth);
+	    break;
+        case XPATH_BOOLEAN:
+	    fprintf(output, "Object is a Boolean : ");
+	    if (cur->boolval) fprintf(output, "true\n");
+	    else fprintf(output, "false\n");
+	    break;
+        case XPATH_NUMBER:
+	    switch (xmlXPathIsInf(cur->floatval)) {
+	    case 1:
+		fprintf(output, "Object is a number : Infinity\n");
+		break;
+	    case -1:
+		fprintf(output, "Object is a number : -Infinity\n");
+		break;
+	    default:
+		if (xmlXPathIsNaN(cur->floatval)) {
+		    fprintf(output, "Object is a number : NaN\n");
+		} else if (cur->floatval == 0) {
+                    /* Omit sign for negative zero. */
+		    fprintf(output, "Object is a number : 0\n");
+		} else {
+		    fprintf(output, "Object is a number : %0g\n", cur->floatval);
+		}
+	    }
+	    break;
+        case XPATH_STRING:
+	    fprintf(output, "Object is a string : ");
+	    xmlDebugDumpString(output, cur->stringval);
+	    fprintf(output, "\n");
+	    break;
+	case XPATH_USERS:
+	    fprintf(output, "Object is user defined\n");
+	    break;
     }
-    ctxt->valueTab[ctxt->valueNr] = value;
-    ctxt->value = value;
-    return (ctxt->valueNr++);
 }
 
-/**
- * Pops a boolean from the stack, handling conversion if needed.
- * Check error with xmlXPathCheckError.
- *
- * @param ctxt  an XPath parser context
- * @returns the boolean
- */
-int
-xmlXPathPopBoolean (xmlXPathParserContext *ctxt) {
-    xmlXPathObjectPtr obj;
-    int ret;
+static void
+xmlXPathDebugDumpStepOp(FILE *output, xmlXPathCompExprPtr comp,
+	                     xmlXPathStepOpPtr op, int depth, int plan) {
+    int i;
+    char shift[100];
 
-    obj = xmlXPathValuePop(ctxt);
-    if (obj == NULL) {
-	xmlXPathSetError(ctxt, XPATH_INVALID_OPERAND);
-	return(0);
-    }
-    if (obj->type != XPATH_BOOLEAN)
-	ret = xmlXPathCastToBoolean(obj);
-    else
-        ret = obj->boolval;
-    xmlXPathReleaseObject(ctxt->context, obj);
-    return(ret);
-}
+    for (i = 0;((i < depth) && (i < 25));i++)
+        shift[2 * i] = shift[2 * i + 1] = ' ';
+    shift[2 * i] = shift[2 * i + 1] = 0;
 
-/**
- * Pops a number from the stack, handling conversion if needed.
- * Check error with xmlXPathCheckError.
- *
- * @param ctxt  an XPath parser context
- * @returns the number
- */
-double
-xmlXPathPopNumber (xmlXPathParserContext *ctxt) {
-    xmlXPathObjectPtr obj;
-    double ret;
-
-    obj = xmlXPathValuePop(ctxt);
-    if (obj == NULL) {
-	xmlXPathSetError(ctxt, XPATH_INVALID_OPERAND);
-	return(0);
+    fprintf(output, "%s", shift);
+    if (op == NULL) {
+	fprintf(output, "Step is NULL\n");
+	return;
     }
-    if (obj->type != XPATH_NUMBER)
-	ret = xmlXPathCastToNumberInternal(ctxt, obj);
-    else
-        ret = obj->floatval;
-    xmlXPathReleaseObject(ctxt->context, obj);
-    return(ret);
-}
+    switch (op->op) {
+        case XPATH_OP_END:
+	    fprintf(output, "END"); break;
+        case XPATH_OP_AND:
+	    fprintf(output, "AND"); break;
+        case XPATH_OP_OR:
+	    fprintf(output, "OR"); break;
+        case XPATH_OP_EQUAL:
+	     if (op->value)
+		 fprintf(output, "EQUAL =");
+	     else
+		 fprintf(output, "EQUAL !=");
+	     break;
+        case XPATH_OP_CMP:
+	     if (op->value)
+		 fprintf(output, "CMP <");
+	     else
+		 fprintf(output, "CMP >");
+	     if (!op->value2)
+		 fprintf(output, "=");
+	     break;
+        case XPATH_OP_PLUS:
+	     if (op->value == 0)
+		 fprintf(output, "PLUS -");
+	     else if (op->value == 1)
+		 fprintf(output, "PLUS +");
+	     else if (op->value == 2)
+		 fprintf(output, "PLUS unary -");
+	     else if (op->value == 3)
+		 fprintf(output, "PLUS unary - -");
+	     break;
+        case XPATH_OP_MULT:
+	     if (op->value == 0)
+		 fprintf(output, "MULT *");
+	     else if (op->value == 1)
+		 fprintf(output, "MULT div");
+	     else
+		 fprintf(output, "MULT mod");
+	     break;
+        case XPATH_OP_UNION:
+	     fprintf(output, "UNION"); break;
+        case XPATH_OP_ROOT:
+	     fprintf(output, "ROOT"); break;
+        case XPATH_OP_NODE:
+	     fprintf(output, "NODE"); break;
+        case XPATH_OP_SORT:
+	     fprintf(output, "SORT"); break;
+        case XPATH_OP_COLLECT: {
+	    xmlXPathAxisVal axis = (xmlXPathAxisVal)op->value;
+	    xmlXPathTestVal test = (xmlXPathTestVal)op->value2;
+	    xmlXPathTypeVal type = (xmlXPathTypeVal)op->value3;
+	    const xmlChar *prefix = op->value4;
+	    const xmlChar *name = op->value5;
 
-/**
- * Pops a string from the stack, handling conversion if needed.
- * Check error with xmlXPathCheckError.
- *
- * @param ctxt  an XPath parser context
- * @returns the string
- */
-xmlChar *
-xmlXPathPopString (xmlXPathParserContext *ctxt) {
-    xmlXPathObjectPtr obj;
-    xmlChar * ret;
+	    fprintf(output, "COLLECT ");
+	    switch (axis) {
+		case AXIS_ANCESTOR:
+		    fprintf(output, " 'ancestors' "); break;
+		case AXIS_ANCESTOR_OR_SELF:
+		    fprintf(output, " 'ancestors-or-self' "); break;
+		case AXIS_ATTRIBUTE:
+		    fprintf(output, " 'attributes' "); break;
+		case AXIS_CHILD:
+		    fprintf(output, " 'child' "); break;
+		case AXIS_DESCENDANT:
+		    fprintf(output, " 'descendant' "); break;
+		case AXIS_DESCENDANT_OR_SELF:
+		    fprintf(output, " 'descendant-or-self' "); break;
+		case AXIS_FOLLOWING:
+		    fprintf(output, " 'following' "); break;
+		case AXIS_FOLLOWING_SIBLING:
+		    fprintf(output, " 'following-siblings' "); break;
+		case AXIS_NAMESPACE:
+		    fprintf(output, " 'namespace' "); break;
+		case AXIS_PARENT:
+		    fprintf(output, " 'parent' "); break;
+		case AXIS_PRECEDING:
+		    fprintf(output, " 'preceding' "); break;
+		case AXIS_PRECEDING_SIBLING:
+		    fprintf(output, " 'preceding-sibling' "); break;
+		case AXIS_SELF:
+		    fprintf(output, " 'self' "); break;
+	    }
+	    switch (test) {
+                case NODE_TEST_NONE:
+		    fprintf(output, "'none' "); break;
+                case NODE_TEST_TYPE:
+		    fprintf(output, "'type' "); break;
+                case NODE_TEST_PI:
+		    fprintf(output, "'PI' "); break;
+                case NODE_TEST_ALL:
+		    fprintf(output, "'all' "); break;
+                case NODE_TEST_NS:
+		    fprintf(output, "'namespace' "); break;
+                case NODE_TEST_NAME:
+		    fprintf(output, "'name' "); break;
+	    }
+	    switch (type) {
+                case NODE_TYPE_NODE:
+		    fprintf(output, "'node' "); break;
+                case NODE_TYPE_COMMENT:
+		    fprintf(output, "'comment' "); break;
+                case NODE_TYPE_TEXT:
+		    fprintf(output, "'text' "); break;
+                case NODE_TYPE_PI:
+		    fprintf(output, "'PI' "); break;
+	    }
+	    if (prefix != NULL)
+		fprintf(output, "%s:", prefix);
+	    if (name != NULL)
+		fprintf(output, "%s", (const char *) name);
+	    break;
 
-    obj = xmlXPathValuePop(ctxt);
-    if (obj == NULL) {
-	xmlXPathSetError(ctxt, XPATH_INVALID_OPERAND);
-	return(NULL);
+        }
+	case XPATH_OP_VALUE: {
+	    xmlXPathObjectPtr object = (xmlXPathObjectPtr) op->value4;
+
+	    fprintf(output, "ELEM ");
+	    xmlXPathDebugDumpObject(output, object, 0);
+	    goto finish;
+	}
+	case XPATH_OP_VARIABLE: {
+	    const xmlChar *prefix = op->value5;
+	    const xmlChar *name = op->value4;
+
+	    if (prefix != NULL)
+		fprintf(output, "VARIABLE %s:%s", prefix, name);
+	    else
+		fprintf(output, "VARIABLE %s", name);
+	    break;
+	}
+	case XPATH_OP_FUNCTION: {
+	    int nbargs = op->value;
+	    const xmlChar *prefix = op->value5;
+	    const xmlChar *name = op->value4;
+
+	    if (prefix != NULL)
+		fprintf(output, "FUNCTION %s:%s(%d args)",
+			prefix, name, nbargs);
+	    else
+		fprintf(output, "FUNCTION %s(%d args)", name, nbargs);
+	    break;
+	}
+        case XPATH_OP_ARG: fprintf(output, "ARG"); break;
+        case XPATH_OP_PREDICATE: fprintf(output, "PREDICATE"); break;
+        case XPATH_OP_FILTER: fprintf(output, "FILTER"); break;
+	default:
+        fprintf(output, "UNKNOWN %d\n", op->op); return;
     }
-    ret = xmlXPathCastToString(obj);
-    if (ret == NULL)
-        xmlXPathPErrMemory(ctxt);
-    xmlXPathReleaseObject(ctxt->context, obj);
-    return(ret);
+    if (plan) {
+        fprintf(output, " [cost %d",
+                xmlXPathEstimateCost(comp, op, 0));
+        if (op->flags & XP_STEP_PRUNE)
+            fprintf(output, ", outermost context nodes");
+        if (op->flags & XP_STEP_NO_DUPS)
+            fprintf(output, ", no duplicates");
+        fprintf(output, "]");
+    }
+    fprintf(output, "\n");
+finish:
+    /* OP_VALUE has invalid ch1. */
+    if (op->op == XPATH_OP_VALUE)
+        return;
+
+    if (op->ch1 >= 0)
+	xmlXPathDebugDumpStepOp(output, comp, &comp->steps[op->ch1], depth + 1,
+                                plan);
+    if (op->ch2 >= 0)
+	xmlXPathDebugDumpStepOp(output, comp, &comp->steps[op->ch2], depth + 1,
+                                plan);
 }
 
 /**
- * Pops a node-set from the stack, handling conversion if needed.
- * Check error with xmlXPathCheckError.
+ * Dumps the tree of the compiled XPath expression.
  *
- * @param ctxt  an XPath parser context
- * @returns the node-set
+ * @param output  the FILE * for the output
+ * @param comp  the precompiled XPath expression
+ * @param depth  the indentation level.
  */
-xmlNodeSet *
-xmlXPathPopNodeSet (xmlXPathParserContext *ctxt) {
-    xmlXPathObjectPtr obj;
-    xmlNodeSetPtr ret;
+void
+xmlXPathDebugDumpCompExpr(FILE *output, xmlXPathCompExpr *comp,
+	                  int depth) {
+    int i;
+    char shift[100];
 
-    if (ctxt == NULL) return(NULL);
-    if (ctxt->value == NULL) {
-	xmlXPathSetError(ctxt, XPATH_INVALID_OPERAND);
-	return(NULL);
-    }
-    if (!xmlXPathStackIsNodeSet(ctxt)) {
-	xmlXPathSetTypeError(ctxt);
-	return(NULL);
+    if ((output == NULL) || (comp == NULL)) return;
+
+    for (i = 0;((i < depth) && (i < 25));i++)
+        shift[2 * i] = shift[2 * i + 1] = ' ';
+    shift[2 * i] = shift[2 * i + 1] = 0;
+
+    fprintf(output, "%s", shift);
+
+#ifdef XPATH_STREAMING
+    if (comp->stream) {
+        fprintf(output, "Streaming Expression\n");
+    } else
+#endif
+    {
+        fprintf(output, "Compiled Expression : %d elements\n",
+                comp->nbStep);
+        i = comp->last;
+        xmlXPathDebugDumpStepOp(output, comp, &comp->steps[i], depth + 1, 0);
     }
-    obj = xmlXPathValuePop(ctxt);
-    ret = obj->nodesetval;
-    obj->nodesetval = NULL;
-    xmlXPathReleaseObject(ctxt->context, obj);
-    return(ret);
 }
 
 /**
- * Pops an external object from the stack, handling conversion if needed.
- * Check error with xmlXPathCheckError.
+ * Dumps the plan of a compiled XPath expression after rewriting.
  *
- * @param ctxt  an XPath parser context
- * @returns the object
+ * Like #xmlXPathDebugDumpCompExpr, but every op is annotated with
+ * its estimated cost, and steps with the optimizations chosen for
+ * them. Constants are folded, "[self::T]" predicates are merged into
+ * node tests, and the operands of "and" and the predicates of a
+ * step are ordered by cost.
+ *
+ * @since 2.16.0
+ *
+ * @param output  the FILE * for the output
+ * @param comp  the precompiled XPath expression
+ * @param depth  the indentation level.
  */
-void *
-xmlXPathPopExternal (xmlXPathParserContext *ctxt) {
-    xmlXPathObjectPtr obj;
-    void * ret;
-
-    if ((ctxt == NULL) || (ctxt->value == NULL)) {
-	xmlXPathSetError(ctxt, XPATH_INVALID_OPERAND);
-	return(NULL);
-    }
-    if (ctxt->value->type != XPATH_USERS) {
-	xmlXPathSetTypeError(ctxt);
-	return(NULL);
-    }
-    obj = xmlXPathValuePop(ctxt);
-    ret = obj->user;
-    obj->user = NULL;
-    xmlXPathReleaseObject(ctxt->context, obj);
-    return(ret);
-}
-
-/*
- * Macros for accessing the content. Those should be used only by the parser,
- * and not exported.
- *
- * Dirty macros, i.e. one need to make assumption on the context to use them
- *
- *   CUR_PTR return the current pointer to the xmlChar to be parsed.
- *   CUR     returns the current xmlChar value, i.e. a 8 bit value
- *           in ISO-Latin or UTF-8.
- *           This should be used internally by the parser
- *           only to compare to ASCII values otherwise it would break when
- *           running with UTF-8 encoding.
- *   NXT(n)  returns the n'th next xmlChar. Same as CUR is should be used only
- *           to compare on ASCII based substring.
- *   SKIP(n) Skip n xmlChar, and must also be used only to skip ASCII defined
- *           strings within the parser.
- *   CURRENT Returns the current char value, with the full decoding of
- *           UTF-8 if we are using this mode. It returns an int.
- *   NEXT    Skip to the next character, this does the proper decoding
- *           in UTF-8 mode. It also pop-up unfinished entities on the fly.
- *           It returns the pointer to the current xmlChar.
- */
-
-#define CUR (*ctxt->cur)
-#define SKIP(val) ctxt->cur += (val)
-#define NXT(val) ctxt->cur[(val)]
-#define CUR_PTR ctxt->cur
+void
+xmlXPathDebugDumpCompExprPlan(FILE *output, xmlXPathCompExpr *comp,
+	                      int depth) {
+    int i;
+    char shift[100];
 
-#define SKIP_BLANKS							\
-    while (IS_BLANK_CH(*(ctxt->cur))) NEXT
+    if ((output == NULL) || (comp == NULL)) return;
 
-#define CURRENT (*ctxt->cur)
-#define NEXT ((*ctxt->cur) ?  ctxt->cur++: ctxt->cur)
+    for (i = 0;((i < depth) && (i < 25));i++)
+        shift[2 * i] = shift[2 * i + 1] = ' ';
+    shift[2 * i] = shift[2 * i + 1] = 0;
 
+    fprintf(output, "%s", shift);
 
-#ifndef DBL_DIG
-#define DBL_DIG 16
-#endif
-#ifndef DBL_EPSILON
-#define DBL_EPSILON 1E-9
+#ifdef XPATH_STREAMING
+    if (comp->stream) {
+        fprintf(output, "Streaming Expression\n");
+    } else
 #endif
+    if (comp->last < 0) {
+        fprintf(output, "Empty Plan\n");
+    } else {
+        i = comp->last;
+        fprintf(output, "Optimized Plan : %d elements, cost %d\n",
+                comp->nbStep, xmlXPathEstimateCost(comp, &comp->steps[i], 0));
+        xmlXPathDebugDumpStepOp(output, comp, &comp->steps[i], depth + 1, 1);
+    }
+}
 
-#define UPPER_DOUBLE 1E9
-#define LOWER_DOUBLE 1E-5
-#define	LOWER_DOUBLE_EXP 5
+#endif /* LIBXML_DEBUG_ENABLED */
 
-#define INTEGER_DIGITS DBL_DIG
-#define FRACTION_DIGITS (DBL_DIG + 1 + (LOWER_DOUBLE_EXP))
-#define EXPONENT_DIGITS (3 + 2)
+/************************************************************************
+ *									*
+ *			XPath object caching				*
+ *									*
+ ************************************************************************/
 
 /**
- * Convert the number into a string representation.
+ * Create a new object cache
  *
- * @param number  number to format
- * @param buffer  output buffer
- * @param buffersize  size of output buffer
+ * @returns the xmlXPathCache just allocated.
  */
-static void
-xmlXPathFormatNumber(double number, char buffer[], int buffersize)
+static xmlXPathContextCachePtr
+xmlXPathNewCache(void)
 {
-    switch (xmlXPathIsInf(number)) {
-    case 1:
-	if (buffersize > (int)sizeof("Infinity"))
-	    snprintf(buffer, buffersize, "Infinity");
-	break;
-    case -1:
-	if (buffersize > (int)sizeof("-Infinity"))
-	    snprintf(buffer, buffersize, "-Infinity");
-	break;
-    default:
-	if (xmlXPathIsNaN(number)) {
-	    if (buffersize > (int)sizeof("NaN"))
-		snprintf(buffer, buffersize, "NaN");
-	} else if (number == 0) {
-            /* Omit sign for negative zero. */
-	    snprintf(buffer, buffersize, "0");
-	} else if ((number > INT_MIN) && (number < INT_MAX) &&
-                   (number == (int) number)) {
-	    char work[30];
-	    char *ptr, *cur;
-	    int value = (int) number;
-
-            ptr = &buffer[0];
-	    if (value == 0) {
-		*ptr++ = '0';
-	    } else {
-		snprintf(work, 29, "%d", value);
-		cur = &work[0];
-		while ((*cur) && (ptr - buffer < buffersize)) {
-		    *ptr++ = *cur++;
-		}
-	    }
-	    if (ptr - buffer < buffersize) {
-		*ptr = 0;
-	    } else if (buffersize > 0) {
-		ptr--;
-		*ptr = 0;
-	    }
-	} else {
-	    /*
-	      For the dimension of work,
-	          DBL_DIG is number of significant digits
-		  EXPONENT is only needed for "scientific notation"
-	          3 is sign, decimal point, and terminating zero
-		  LOWER_DOUBLE_EXP is max number of leading zeroes in fraction
-	      Note that this dimension is slightly (a few characters)
-	      larger than actually necessary.
-	    */
-	    char work[DBL_DIG + EXPONENT_DIGITS + 3 + LOWER_DOUBLE_EXP];
-	    int integer_place, fraction_place;
-	    char *ptr;
-	    char *after_fraction;
-	    double absolute_value;
-	    int size;
-
-	    absolute_value = fabs(number);
-
-	    /*
-	     * First choose format - scientific or regular floating point.
-	     * In either case, result is in work, and after_fraction points
-	     * just past the fractional part.
-	    */
-	    if ( ((absolute_value > UPPER_DOUBLE) ||
-		  (absolute_value < LOWER_DOUBLE)) &&
-		 (absolute_value != 0.0) ) {
-		/* Use scientific notation */
-		integer_place = DBL_DIG + EXPONENT_DIGITS + 1;
-		fraction_place = DBL_DIG - 1;
-		size = snprintf(work, sizeof(work),"%*.*e",
-			 integer_place, fraction_place, number);
-		while ((size > 0) && (work[size] != 'e')) size--;
+    xmlXPathContextCachePtr ret;
 
-	    }
-	    else {
-		/* Use regular notation */
-		if (absolute_value > 0.0) {
-		    integer_place = (int)log10(absolute_value);
-		    if (integer_place > 0)
-		        fraction_place = DBL_DIG - integer_place - 1;
-		    else
-		        fraction_place = DBL_DIG - integer_place;
-		} else {
-		    fraction_place = 1;
-		}
-		size = snprintf(work, sizeof(work), "%0.*f",
-				fraction_place, number);
-	    }
+    ret = (xmlXPathContextCachePtr) xmlMalloc(sizeof(xmlXPathContextCache));
+    if (ret == NULL)
+	return(NULL);
+    memset(ret, 0 , sizeof(xmlXPathContextCache));
+    ret->maxNodeset = 100;
+    ret->maxMisc = 100;
+    return(ret);
+}
 
-	    /* Remove leading spaces sometimes inserted by snprintf */
-	    while (work[0] == ' ') {
-	        for (ptr = &work[0];(ptr[0] = ptr[1]);ptr++);
-		size--;
-	    }
+static void
+xmlXPathCacheFreeObjectList(xmlXPathObjectPtr list)
+{
+    while (list != NULL) {
+        xmlXPathObjectPtr next;
 
-	    /* Remove fractional trailing zeroes */
-	    after_fraction = work + size;
-	    ptr = after_fraction;
-	    while (*(--ptr) == '0')
-		;
-	    if (*ptr != '.')
-	        ptr++;
-	    while ((*ptr++ = *after_fraction++) != 0);
+        next = (void *) list->stringval;
 
-	    /* Finally copy result back to caller */
-	    size = strlen(work) + 1;
-	    if (size > buffersize) {
-		work[buffersize - 1] = 0;
-		size = buffersize;
-	    }
-	    memmove(buffer, work, size);
+	if (list->nodesetval != NULL) {
+	    if (list->nodesetval->nodeTab != NULL)
+		xmlFree(list->nodesetval->nodeTab);
+	    xmlFree(list->nodesetval);
 	}
-	break;
+	xmlFree(list);
+
+        list = next;
     }
 }
 
-
-/************************************************************************
- *									*
- *			Routines to handle NodeSets			*
- *									*
- ************************************************************************/
+static void
+xmlXPathFreeCache(xmlXPathContextCachePtr cache)
+{
+    if (cache == NULL)
+	return;
+    if (cache->nodesetObjs)
+	xmlXPathCacheFreeObjectList(cache->nodesetObjs);
+    if (cache->miscObjs)
+	xmlXPathCacheFreeObjectList(cache->miscObjs);
+    xmlFree(cache);
+}
 
 /**
- * Call this routine to speed up XPath computation on static documents.
- * This stamps all the element nodes with the document order
- * Like for line information, the order is kept in the element->content
- * field, the value stored is actually - the node number (starting at -1)
- * to be able to differentiate from line numbers.
+ * Creates/frees an object cache on the XPath context.
+ * If activates XPath objects (xmlXPathObject) will be cached internally
+ * to be reused.
  *
- * @param doc  an input document
- * @returns the number of elements found in the document or -1 in case
- *    of error.
- */
-long
-xmlXPathOrderDocElems(xmlDoc *doc) {
-    XML_INTPTR_T count = 0;
-    xmlNodePtr cur;
-
-    if (doc == NULL)
-	return(-1);
-    cur = doc->children;
-    while (cur != NULL) {
-	if (cur->type == XML_ELEMENT_NODE) {
-            count += 1;
-            cur->content = XML_INT_TO_PTR(-count);
-	    if (cur->children != NULL) {
-		cur = cur->children;
-		continue;
-	    }
+ * `options` must be set to 0 to enable XPath object caching.
+ * Other values for `options` have currently no effect.
+ *
+ * `value` sets the maximum number of XPath objects to be cached per slot.
+ * There are two slots for node-set and misc objects.
+ * Use <0 for the default number (100).
+ *
+ * @param ctxt  the XPath context
+ * @param active  enables/disables (creates/frees) the cache
+ * @param value  a value with semantics dependent on `options`
+ * @param options  options (currently only the value 0 is used)
+ * @returns 0 if the setting succeeded, and -1 on API or internal errors.
+ */
+int
+xmlXPathContextSetCache(xmlXPathContext *ctxt,
+			int active,
+			int value,
+			int options)
+{
+    if (ctxt == NULL)
+	return(-1);
+    if (active) {
+	xmlXPathContextCachePtr cache;
+
+	if (ctxt->cache == NULL) {
+	    ctxt->cache = xmlXPathNewCache();
+	    if (ctxt->cache == NULL) {
+                xmlXPathErrMemory(ctxt);
+		return(-1);
+            }
 	}
-	if (cur->next != NULL) {
-	    cur = cur->next;
-	    continue;
+	cache = (xmlXPathContextCachePtr) ctxt->cache;
+	if (options == 0) {
+	    if (value < 0)
+		value = 100;
+	    cache->maxNodeset = value;
+	    cache->maxMisc = value;
 	}
-	do {
-	    cur = cur->parent;
-	    if (cur == NULL)
-		break;
-	    if (cur == (xmlNodePtr) doc) {
-		cur = NULL;
-		break;
-	    }
-	    if (cur->next != NULL) {
-		cur = cur->next;
-		break;
-	    }
-	} while (cur != NULL);
+    } else if (ctxt->cache != NULL) {
+	xmlXPathFreeCache((xmlXPathContextCachePtr) ctxt->cache);
+	ctxt->cache = NULL;
     }
-    return(count);
+    return(0);
+}
+
+/************************************************************************
+ *									*
+ *			Result cache					*
+ *									*
+ ************************************************************************/
+
+#define XP_RESULT_CACHE_DEFAULT 64
+
+typedef struct {
+    /* the compiled expression and its serial number */
+    xmlXPathCompExprPtr comp;
+    unsigned long compSerial;
+    /* the evaluation context */
+    xmlNodePtr node;
+    xmlDocPtr doc;
+    unsigned long docSerial;
+    unsigned long generation;
+    int contextSize;
+    int proximityPosition;
+    /* a private copy of the result */
+    xmlXPathObjectPtr value;
+} xmlXPathResultCacheEntry;
+
+typedef struct {
+    int maxEntries;
+    int nbEntries;
+    int next;
+    xmlXPathResultCacheEntry *entries;
+} xmlXPathResultCache;
+
+static void
+xmlXPathFlushResultCache(xmlXPathContextPtr ctxt) {
+    xmlXPathResultCache *cache;
+    int i;
+
+    if ((ctxt == NULL) || (ctxt->resultCache == NULL))
+        return;
+    cache = ctxt->resultCache;
+
+    for (i = 0; i < cache->nbEntries; i++)
+        xmlXPathFreeObject(cache->entries[i].value);
+    cache->nbEntries = 0;
+    cache->next = 0;
+}
+
+static void
+xmlXPathFreeResultCache(xmlXPathContextPtr ctxt) {
+    xmlXPathResultCache *cache = ctxt->resultCache;
+
+    if (cache == NULL)
+        return;
+    xmlXPathFlushResultCache(ctxt);
+    xmlFree(cache->entries);
+    xmlFree(cache);
+    ctxt->resultCache = NULL;
 }
 
 /**
- * Compare two nodes w.r.t document order
+ * Enable or disable the result cache of an XPath context.
  *
- * @param node1  the first node
- * @param node2  the second node
- * @returns -2 in case of error 1 if first point < second point, 0 if
- *         it's the same node, -1 otherwise
+ * If enabled, the results of #xmlXPathCompiledEval and
+ * #xmlXPathCompiledEvalToBoolean are remembered and returned again
+ * when the same compiled expression is evaluated with the same context
+ * node, size and position, as long as the document wasn't modified
+ * with the tree API in the meantime. Expressions calling extension
+ * functions and contexts with an array of in-scope namespaces or
+ * a variable lookup function bypass the cache.
+ *
+ * The cache is flushed when variables or namespaces are registered.
+ * Code modifying nodes directly instead of using the tree API must
+ * disable the cache.
+ *
+ * Only expressions compiled with #xmlXPathCtxtCompile or
+ * #xmlXPathCompile can be cached.
+ *
+ * @since 2.16.0
+ * @param ctxt  the XPath context
+ * @param maxEntries  maximum number of results to keep, 0 to disable
+ *                    the cache or <0 for the default (64)
+ * @returns 0 on success or -1 on API or memory allocation errors.
  */
 int
-xmlXPathCmpNodes(xmlNode *node1, xmlNode *node2) {
-    int depth1, depth2;
-    int attr1 = 0, attr2 = 0;
-    xmlNodePtr attrNode1 = NULL, attrNode2 = NULL;
-    xmlNodePtr cur, root;
-
-    if ((node1 == NULL) || (node2 == NULL))
-	return(-2);
-    /*
-     * a couple of optimizations which will avoid computations in most cases
-     */
-    if (node1 == node2)		/* trivial case */
-	return(0);
-    if (node1->type == XML_ATTRIBUTE_NODE) {
-	attr1 = 1;
-	attrNode1 = node1;
-	node1 = node1->parent;
-    }
-    if (node2->type == XML_ATTRIBUTE_NODE) {
-	attr2 = 1;
-	attrNode2 = node2;
-	node2 = node2->parent;
-    }
-    if (node1 == node2) {
-	if (attr1 == attr2) {
-	    /* not required, but we keep attributes in order */
-	    if (attr1 != 0) {
-	        cur = attrNode2->prev;
-		while (cur != NULL) {
-		    if (cur == attrNode1)
-		        return (1);
-		    cur = cur->prev;
-		}
-		return (-1);
-	    }
-	    return(0);
-	}
-	if (attr2 == 1)
-	    return(1);
-	return(-1);
-    }
-    if ((node1->type == XML_NAMESPACE_DECL) ||
-        (node2->type == XML_NAMESPACE_DECL))
-	return(1);
-    if (node1 == node2->prev)
-	return(1);
-    if (node1 == node2->next)
-	return(-1);
+xmlXPathContextSetResultCache(xmlXPathContext *ctxt, int maxEntries) {
+    xmlXPathResultCache *cache;
+    xmlXPathResultCacheEntry *entries;
 
-    /*
-     * Speedup using document order if available.
-     */
-    if ((node1->type == XML_ELEMENT_NODE) &&
-	(node2->type == XML_ELEMENT_NODE) &&
-	(0 > XML_NODE_SORT_VALUE(node1)) &&
-	(0 > XML_NODE_SORT_VALUE(node2)) &&
-	(node1->doc == node2->doc)) {
-	XML_INTPTR_T l1, l2;
+    if (ctxt == NULL)
+        return(-1);
 
-	l1 = -XML_NODE_SORT_VALUE(node1);
-	l2 = -XML_NODE_SORT_VALUE(node2);
-	if (l1 < l2)
-	    return(1);
-	if (l1 > l2)
-	    return(-1);
-    }
+    xmlXPathFreeResultCache(ctxt);
+    if (maxEntries == 0)
+        return(0);
+    if (maxEntries < 0)
+        maxEntries = XP_RESULT_CACHE_DEFAULT;
 
-    /*
-     * compute depth to root
-     */
-    for (depth2 = 0, cur = node2;cur->parent != NULL;cur = cur->parent) {
-	if (cur->parent == node1)
-	    return(1);
-	depth2++;
-    }
-    root = cur;
-    for (depth1 = 0, cur = node1;cur->parent != NULL;cur = cur->parent) {
-	if (cur->parent == node2)
-	    return(-1);
-	depth1++;
-    }
-    /*
-     * Distinct document (or distinct entities :-( ) case.
-     */
-    if (root != cur) {
-	return(-2);
-    }
-    /*
-     * get the nearest common ancestor.
-     */
-    while (depth1 > depth2) {
-	depth1--;
-	node1 = node1->parent;
-    }
-    while (depth2 > depth1) {
-	depth2--;
-	node2 = node2->parent;
+    cache = xmlMalloc(sizeof(*cache));
+    if (cache == NULL) {
+        xmlXPathErrMemory(ctxt);
+        return(-1);
     }
-    while (node1->parent != node2->parent) {
-	node1 = node1->parent;
-	node2 = node2->parent;
-	/* should not happen but just in case ... */
-	if ((node1 == NULL) || (node2 == NULL))
-	    return(-2);
+    entries = xmlMalloc(maxEntries * sizeof(entries[0]));
+    if (entries == NULL) {
+        xmlFree(cache);
+        xmlXPathErrMemory(ctxt);
+        return(-1);
     }
-    /*
-     * Find who's first.
-     */
-    if (node1 == node2->prev)
-	return(1);
-    if (node1 == node2->next)
-	return(-1);
-    /*
-     * Speedup using document order if available.
-     */
-    if ((node1->type == XML_ELEMENT_NODE) &&
-	(node2->type == XML_ELEMENT_NODE) &&
-	(0 > XML_NODE_SORT_VALUE(node1)) &&
-	(0 > XML_NODE_SORT_VALUE(node2)) &&
-	(node1->doc == node2->doc)) {
-	XML_INTPTR_T l1, l2;
+    cache->maxEntries = maxEntries;
+    cache->nbEntries = 0;
+    cache->next = 0;
+    cache->entries = entries;
+    ctxt->resultCache = cache;
 
-	l1 = -XML_NODE_SORT_VALUE(node1);
-	l2 = -XML_NODE_SORT_VALUE(node2);
-	if (l1 < l2)
-	    return(1);
-	if (l1 > l2)
-	    return(-1);
-    }
+    return(0);
+}
 
-    for (cur = node1->next;cur != NULL;cur = cur->next)
-	if (cur == node2)
-	    return(1);
-    return(-1); /* assume there is no sibling list corruption */
+/**
+ * Compute the key of an evaluation for the result cache.
+ *
+ * @param comp  the compiled expression
+ * @param ctxt  the XPath context
+ * @param key  entry to fill in
+ * @returns 1 if the result can be cached, 0 otherwise.
+ */
+static int
+xmlXPathResultCacheKey(xmlXPathCompExprPtr comp, xmlXPathContextPtr ctxt,
+                       xmlXPathResultCacheEntry *key) {
+    xmlNodePtr node = ctxt->node;
+
+    if ((comp->serial == 0) ||
+        ((comp->cacheFlags & XP_COMP_CACHEABLE) == 0) ||
+        (((comp->cacheFlags & XP_COMP_HAS_VARS) != 0) &&
+         (ctxt->varLookupFunc != NULL)) ||
+        (ctxt->namespaces != NULL) ||
+        (ctxt->xptr) ||
+        (node == NULL) ||
+        (node->type == XML_NAMESPACE_DECL) ||
+        (node->doc == NULL) ||
+        (node->doc != ctxt->doc))
+        return(0);
+
+    key->comp = comp;
+    key->compSerial = comp->serial;
+    key->node = node;
+    key->doc = node->doc;
+    key->docSerial = xmlXPathGetDocSerial(node->doc);
+    key->generation = node->doc->generation;
+    key->contextSize = ctxt->contextSize;
+    key->proximityPosition = ctxt->proximityPosition;
+    key->value = NULL;
+
+    return(key->docSerial != 0);
 }
 
 /**
- * Sort the node set in document order
+ * Look up a cached result. Entries for an older generation of the
+ * same document are removed.
  *
- * @param set  the node set
+ * @param cache  the result cache
+ * @param key  the key
+ * @returns the cached value or NULL.
  */
-void
-xmlXPathNodeSetSort(xmlNodeSet *set) {
-#ifndef WITH_TIM_SORT
-    int i, j, incr, len;
-    xmlNodePtr tmp;
-#endif
+static xmlXPathObjectPtr
+xmlXPathResultCacheLookup(xmlXPathResultCache *cache,
+                          const xmlXPathResultCacheEntry *key) {
+    int i;
 
-    if (set == NULL)
-	return;
+    for (i = 0; i < cache->nbEntries; i++) {
+        xmlXPathResultCacheEntry *entry = &cache->entries[i];
 
-#ifndef WITH_TIM_SORT
-    /*
-     * Use the old Shell's sort implementation to sort the node-set
-     * Timsort ought to be quite faster
-     */
-    len = set->nodeNr;
-    for (incr = len / 2; incr > 0; incr /= 2) {
-	for (i = incr; i < len; i++) {
-	    j = i - incr;
-	    while (j >= 0) {
-#ifdef XP_OPTIMIZED_NON_ELEM_COMPARISON
-		if (xmlXPathCmpNodesExt(set->nodeTab[j],
-			set->nodeTab[j + incr]) == -1)
-#else
-		if (xmlXPathCmpNodes(set->nodeTab[j],
-			set->nodeTab[j + incr]) == -1)
-#endif
-		{
-		    tmp = set->nodeTab[j];
-		    set->nodeTab[j] = set->nodeTab[j + incr];
-		    set->nodeTab[j + incr] = tmp;
-		    j -= incr;
-		} else
-		    break;
-	    }
-	}
+        if ((entry->comp != key->comp) ||
+            (entry->compSerial != key->compSerial) ||
+            (entry->node != key->node) ||
+            (entry->contextSize != key->contextSize) ||
+            (entry->proximityPosition != key->proximityPosition) ||
+            (entry->doc != key->doc) ||
+            (entry->docSerial != key->docSerial))
+            continue;
+
+        if (entry->generation == key->generation)
+            return(entry->value);
+
+        xmlXPathFreeObject(entry->value);
+        cache->nbEntries -= 1;
+        *entry = cache->entries[cache->nbEntries];
+        if (cache->next > cache->nbEntries)
+            cache->next = cache->nbEntries;
+        break;
     }
-#else /* WITH_TIM_SORT */
-    libxml_domnode_tim_sort(set->nodeTab, set->nodeNr);
-#endif /* WITH_TIM_SORT */
+
+    return(NULL);
 }
 
-#define XML_NODESET_DEFAULT	10
 /**
- * Namespace node in libxml don't match the XPath semantic. In a node set
- * the namespace nodes are duplicated and the next pointer is set to the
- * parent node in the XPath semantic.
+ * Store a copy of a result in the cache, evicting entries in
+ * round-robin order.
  *
- * @param node  the parent node of the namespace XPath node
- * @param ns  the libxml namespace declaration node.
- * @returns the newly created object.
+ * @param cache  the result cache
+ * @param key  the key
+ * @param value  the result
  */
-static xmlNodePtr
-xmlXPathNodeSetDupNs(xmlNodePtr node, xmlNsPtr ns) {
-    xmlNsPtr cur;
-
-    if ((ns == NULL) || (ns->type != XML_NAMESPACE_DECL))
-	return(NULL);
-    if ((node == NULL) || (node->type == XML_NAMESPACE_DECL))
-	return((xmlNodePtr) ns);
+static void
+xmlXPathResultCacheStore(xmlXPathResultCache *cache,
+                         const xmlXPathResultCacheEntry *key,
+                         xmlXPathObjectPtr value) {
+    xmlXPathResultCacheEntry *entry;
+    xmlXPathObjectPtr copy;
 
-    /*
-     * Allocate a new Namespace and fill the fields.
-     */
-    cur = (xmlNsPtr) xmlMalloc(sizeof(xmlNs));
-    if (cur == NULL)
-	return(NULL);
-    memset(cur, 0, sizeof(xmlNs));
-    cur->type = XML_NAMESPACE_DECL;
-    if (ns->href != NULL) {
-	cur->href = xmlStrdup(ns->href);
-        if (cur->href == NULL) {
-            xmlFree(cur);
-            return(NULL);
-        }
+    switch (value->type) {
+        case XPATH_NODESET:
+        case XPATH_BOOLEAN:
+        case XPATH_NUMBER:
+        case XPATH_STRING:
+            break;
+        default:
+            return;
     }
-    if (ns->prefix != NULL) {
-	cur->prefix = xmlStrdup(ns->prefix);
-        if (cur->prefix == NULL) {
-            xmlFree((xmlChar *) cur->href);
-            xmlFree(cur);
-            return(NULL);
-        }
+
+    copy = xmlXPathObjectCopy(value);
+    if (copy == NULL)
+        return;
+
+    if (cache->nbEntries < cache->maxEntries) {
+        entry = &cache->entries[cache->nbEntries++];
+    } else {
+        if (cache->next >= cache->nbEntries)
+            cache->next = 0;
+        entry = &cache->entries[cache->next++];
+        xmlXPathFreeObject(entry->value);
     }
-    cur->next = (xmlNsPtr) node;
-    return((xmlNodePtr) cur);
+
+    *entry = *key;
+    entry->value = copy;
 }
 
 /**
- * Namespace nodes in libxml don't match the XPath semantic. In a node set
- * the namespace nodes are duplicated and the next pointer is set to the
- * parent node in the XPath semantic. Check if such a node needs to be freed
+ * Compute the result cache flags of a compiled expression and assign
+ * a serial number to it.
  *
- * @param ns  the XPath namespace node found in a nodeset.
+ * @param comp  the compiled expression
  */
-void
-xmlXPathNodeSetFreeNs(xmlNs *ns) {
-    if ((ns == NULL) || (ns->type != XML_NAMESPACE_DECL))
-	return;
+static void
+xmlXPathCompSetCacheInfo(xmlXPathCompExprPtr comp) {
+    int flags = XP_COMP_CACHEABLE;
+    int i;
 
-    if ((ns->next != NULL) && (ns->next->type != XML_NAMESPACE_DECL)) {
-	if (ns->href != NULL)
-	    xmlFree((xmlChar *)ns->href);
-	if (ns->prefix != NULL)
-	    xmlFree((xmlChar *)ns->prefix);
-	xmlFree(ns);
+    for (i = 0; i < comp->nbStep; i++) {
+        xmlXPathStepOpPtr op = &comp->steps[i];
+
+        if (op->op == XPATH_OP_VARIABLE) {
+            flags |= XP_COMP_HAS_VARS;
+        } else if (op->op == XPATH_OP_FUNCTION) {
+            const xmlChar *name = op->value4;
+            int bucketIndex, found = 0;
+
+            if ((op->value5 != NULL) || (name == NULL)) {
+                flags &= ~XP_COMP_CACHEABLE;
+                break;
+            }
+
+            bucketIndex = xmlXPathSFComputeHash(name) % SF_HASH_SIZE;
+            while (xmlXPathSFHash[bucketIndex] != UCHAR_MAX) {
+                int funcIndex = xmlXPathSFHash[bucketIndex];
+
+                if (strcmp(xmlXPathStandardFunctions[funcIndex].name,
+                           (char *) name) == 0) {
+                    found = 1;
+                    break;
+                }
+
+                bucketIndex += 1;
+                if (bucketIndex >= SF_HASH_SIZE)
+                    bucketIndex = 0;
+            }
+            if (!found) {
+                flags &= ~XP_COMP_CACHEABLE;
+                break;
+            }
+        }
     }
+
+    comp->cacheFlags = flags;
+
+    xmlMutexLock(&xmlXPathDocDataMutex);
+    comp->serial = ++xmlXPathSerial;
+    xmlMutexUnlock(&xmlXPathDocDataMutex);
 }
 
 /**
- * Create a new xmlNodeSet of type double and of value `val`
+ * This is the cached version of #xmlXPathWrapNodeSet.
+ * Wrap the Nodeset `val` in a new xmlXPathObject
  *
- * @param val  an initial xmlNode, or NULL
- * @returns the newly created object.
+ * In case of error the node set is destroyed and NULL is returned.
+ *
+ * @param pctxt  the XPath context
+ * @param val  the NodePtr value
+ * @returns the created or reused object.
  */
-xmlNodeSet *
-xmlXPathNodeSetCreate(xmlNode *val) {
-    xmlNodeSetPtr ret;
+static xmlXPathObjectPtr
+xmlXPathCacheWrapNodeSet(xmlXPathParserContextPtr pctxt, xmlNodeSetPtr val)
+{
+    xmlXPathObjectPtr ret;
+    xmlXPathContextPtr ctxt = pctxt->context;
 
-    ret = (xmlNodeSetPtr) xmlMalloc(sizeof(xmlNodeSet));
-    if (ret == NULL)
-	return(NULL);
-    memset(ret, 0 , sizeof(xmlNodeSet));
-    if (val != NULL) {
-        ret->nodeTab = (xmlNodePtr *) xmlMalloc(XML_NODESET_DEFAULT *
-					     sizeof(xmlNodePtr));
-	if (ret->nodeTab == NULL) {
-	    xmlFree(ret);
-	    return(NULL);
-	}
-	memset(ret->nodeTab, 0 ,
-	       XML_NODESET_DEFAULT * sizeof(xmlNodePtr));
-        ret->nodeMax = XML_NODESET_DEFAULT;
-	if (val->type == XML_NAMESPACE_DECL) {
-	    xmlNsPtr ns = (xmlNsPtr) val;
-            xmlNodePtr nsNode = xmlXPathNodeSetDupNs((xmlNodePtr) ns->next, ns);
+    if ((ctxt != NULL) && (ctxt->cache != NULL)) {
+	xmlXPathContextCachePtr cache =
+	    (xmlXPathContextCachePtr) ctxt->cache;
 
-            if (nsNode == NULL) {
-                xmlXPathFreeNodeSet(ret);
-                return(NULL);
-            }
-	    ret->nodeTab[ret->nodeNr++] = nsNode;
-	} else
-	    ret->nodeTab[ret->nodeNr++] = val;
+	if (cache->miscObjs != NULL) {
+	    ret = cache->miscObjs;
+            cache->miscObjs = (void *) ret->stringval;
+            cache->numMisc -= 1;
+            ret->stringval = NULL;
+	    ret->type = XPATH_NODESET;
+	    ret->nodesetval = val;
+	    return(ret);
+	}
     }
+
+    ret = xmlXPathWrapNodeSet(val);
+    if (ret == NULL)
+        xmlXPathPErrMemory(pctxt);
     return(ret);
 }
 
 /**
- * checks whether `cur` contains `val`
+ * This is the cached version of #xmlXPathWrapString.
+ * Wraps the `val` string into an XPath object.
  *
- * @param cur  the node-set
- * @param val  the node
- * @returns true (1) if `cur` contains `val`, false (0) otherwise
+ * @param pctxt  the XPath context
+ * @param val  the xmlChar * value
+ * @returns the created or reused object.
  */
-int
-xmlXPathNodeSetContains (xmlNodeSet *cur, xmlNode *val) {
-    int i;
+static xmlXPathObjectPtr
+xmlXPathCacheWrapString(xmlXPathParserContextPtr pctxt, xmlChar *val)
+{
+    xmlXPathObjectPtr ret;
+    xmlXPathContextPtr ctxt = pctxt->context;
 
-    if ((cur == NULL) || (val == NULL)) return(0);
-    if (val->type == XML_NAMESPACE_DECL) {
-	for (i = 0; i < cur->nodeNr; i++) {
-	    if (cur->nodeTab[i]->type == XML_NAMESPACE_DECL) {
-		xmlNsPtr ns1, ns2;
+    if ((ctxt != NULL) && (ctxt->cache != NULL)) {
+	xmlXPathContextCachePtr cache = (xmlXPathContextCachePtr) ctxt->cache;
 
-		ns1 = (xmlNsPtr) val;
-		ns2 = (xmlNsPtr) cur->nodeTab[i];
-		if (ns1 == ns2)
-		    return(1);
-		if ((ns1->next != NULL) && (ns2->next == ns1->next) &&
-	            (xmlStrEqual(ns1->prefix, ns2->prefix)))
-		    return(1);
-	    }
-	}
-    } else {
-	for (i = 0; i < cur->nodeNr; i++) {
-	    if (cur->nodeTab[i] == val)
-		return(1);
+	if (cache->miscObjs != NULL) {
+	    ret = cache->miscObjs;
+            cache->miscObjs = (void *) ret->stringval;
+            cache->numMisc -= 1;
+	    ret->type = XPATH_STRING;
+	    ret->stringval = val;
+	    return(ret);
 	}
     }
-    return(0);
-}
-
-static int
-xmlXPathNodeSetGrow(xmlNodeSetPtr cur) {
-    xmlNodePtr *temp;
-    int newSize;
-
-    newSize = xmlGrowCapacity(cur->nodeMax, sizeof(temp[0]),
-                              XML_NODESET_DEFAULT, XPATH_MAX_NODESET_LENGTH);
-    if (newSize < 0)
-        return(-1);
-    temp = xmlRealloc(cur->nodeTab, newSize * sizeof(temp[0]));
-    if (temp == NULL)
-        return(-1);
-    cur->nodeMax = newSize;
-    cur->nodeTab = temp;
 
-    return(0);
+    ret = xmlXPathWrapString(val);
+    if (ret == NULL)
+        xmlXPathPErrMemory(pctxt);
+    return(ret);
 }
 
 /**
- * add a new namespace node to an existing NodeSet
+ * This is the cached version of #xmlXPathNewNodeSet.
+ * Acquire an xmlXPathObject of type NodeSet and initialize
+ * it with the single Node `val`
  *
- * @param cur  the initial node set
- * @param node  the hosting node
- * @param ns  a the namespace node
- * @returns 0 in case of success and -1 in case of error
+ * @param pctxt  the XPath context
+ * @param val  the NodePtr value
+ * @returns the created or reused object.
  */
-int
-xmlXPathNodeSetAddNs(xmlNodeSet *cur, xmlNode *node, xmlNs *ns) {
-    int i;
-    xmlNodePtr nsNode;
+static xmlXPathObjectPtr
+xmlXPathCacheNewNodeSet(xmlXPathParserContextPtr pctxt, xmlNodePtr val)
+{
+    xmlXPathObjectPtr ret;
+    xmlXPathContextPtr ctxt = pctxt->context;
 
-    if ((cur == NULL) || (ns == NULL) || (node == NULL) ||
-        (ns->type != XML_NAMESPACE_DECL) ||
-	(node->type != XML_ELEMENT_NODE))
-	return(-1);
+    if ((ctxt != NULL) && (ctxt->cache != NULL)) {
+	xmlXPathContextCachePtr cache = (xmlXPathContextCachePtr) ctxt->cache;
 
-    /* @@ with_ns to check whether namespace nodes should be looked at @@ */
-    /*
-     * prevent duplicates
-     */
-    for (i = 0;i < cur->nodeNr;i++) {
-        if ((cur->nodeTab[i] != NULL) &&
-	    (cur->nodeTab[i]->type == XML_NAMESPACE_DECL) &&
-	    (((xmlNsPtr)cur->nodeTab[i])->next == (xmlNsPtr) node) &&
-	    (xmlStrEqual(ns->prefix, ((xmlNsPtr)cur->nodeTab[i])->prefix)))
-	    return(0);
-    }
+	if (cache->nodesetObjs != NULL) {
+	    /*
+	    * Use the nodeset-cache.
+	    */
+	    ret = cache->nodesetObjs;
+            cache->nodesetObjs = (void *) ret->stringval;
+            cache->numNodeset -= 1;
+            ret->stringval = NULL;
+	    ret->type = XPATH_NODESET;
+	    ret->boolval = 0;
+	    if (val) {
+		if ((ret->nodesetval->nodeMax == 0) ||
+		    (val->type == XML_NAMESPACE_DECL))
+		{
+		    if (xmlXPathNodeSetAddUnique(ret->nodesetval, val) < 0)
+                        xmlXPathPErrMemory(pctxt);
+		} else {
+		    ret->nodesetval->nodeTab[0] = val;
+		    ret->nodesetval->nodeNr = 1;
+		}
+	    }
+	    return(ret);
+	} else if (cache->miscObjs != NULL) {
+            xmlNodeSetPtr set;
+	    /*
+	    * Fallback to misc-cache.
+	    */
 
-    /*
-     * grow the nodeTab if needed
-     */
-    if (cur->nodeNr >= cur->nodeMax) {
-        if (xmlXPathNodeSetGrow(cur) < 0)
-            return(-1);
+	    set = xmlXPathNodeSetCreate(val);
+	    if (set == NULL) {
+                xmlXPathPErrMemory(pctxt);
+		return(NULL);
+	    }
+
+	    ret = cache->miscObjs;
+            cache->miscObjs = (void *) ret->stringval;
+            cache->numMisc -= 1;
+            ret->stringval = NULL;
+	    ret->type = XPATH_NODESET;
+	    ret->boolval = 0;
+	    ret->nodesetval = set;
+	    return(ret);
+	}
     }
-    nsNode = xmlXPathNodeSetDupNs(node, ns);
-    if(nsNode == NULL)
-        return(-1);
-    cur->nodeTab[cur->nodeNr++] = nsNode;
-    return(0);
+    ret = xmlXPathNewNodeSet(val);
+    if (ret == NULL)
+        xmlXPathPErrMemory(pctxt);
+    return(ret);
 }
 
 /**
- * add a new xmlNode to an existing NodeSet
+ * This is the cached version of #xmlXPathNewString.
+ * Acquire an xmlXPathObject of type string and of value `val`
  *
- * @param cur  the initial node set
- * @param val  a new xmlNode
- * @returns 0 in case of success, and -1 in case of error
+ * @param pctxt  the XPath context
+ * @param val  the xmlChar * value
+ * @returns the created or reused object.
  */
-int
-xmlXPathNodeSetAdd(xmlNodeSet *cur, xmlNode *val) {
-    int i;
+static xmlXPathObjectPtr
+xmlXPathCacheNewString(xmlXPathParserContextPtr pctxt, const xmlChar *val)
+{
+    xmlXPathObjectPtr ret;
+    xmlXPathContextPtr ctxt = pctxt->context;
 
-    if ((cur == NULL) || (val == NULL)) return(-1);
+    if ((ctxt != NULL) && (ctxt->cache != NULL)) {
+	xmlXPathContextCachePtr cache = (xmlXPathContextCachePtr) ctxt->cache;
 
-    /* @@ with_ns to check whether namespace nodes should be looked at @@ */
-    /*
-     * prevent duplicates
-     */
-    for (i = 0;i < cur->nodeNr;i++)
-        if (cur->nodeTab[i] == val) return(0);
+	if (cache->miscObjs != NULL) {
+            xmlChar *copy;
 
-    /*
-     * grow the nodeTab if needed
-     */
-    if (cur->nodeNr >= cur->nodeMax) {
-        if (xmlXPathNodeSetGrow(cur) < 0)
-            return(-1);
+            if (val == NULL)
+                val = BAD_CAST "";
+            copy = xmlStrdup(val);
+            if (copy == NULL) {
+                xmlXPathPErrMemory(pctxt);
+                return(NULL);
+            }
+
+	    ret = cache->miscObjs;
+            cache->miscObjs = (void *) ret->stringval;
+            cache->numMisc -= 1;
+	    ret->type = XPATH_STRING;
+            ret->stringval = copy;
+	    return(ret);
+	}
     }
 
-    if (val->type == XML_NAMESPACE_DECL) {
-	xmlNsPtr ns = (xmlNsPtr) val;
-        xmlNodePtr nsNode = xmlXPathNodeSetDupNs((xmlNodePtr) ns->next, ns);
+    ret = xmlXPathNewString(val);
+    if (ret == NULL)
+        xmlXPathPErrMemory(pctxt);
+    return(ret);
+}
 
-        if (nsNode == NULL)
-            return(-1);
-	cur->nodeTab[cur->nodeNr++] = nsNode;
-    } else
-	cur->nodeTab[cur->nodeNr++] = val;
-    return(0);
+/**
+ * This is the cached version of #xmlXPathNewCString.
+ * Acquire an xmlXPathObject of type string and of value `val`
+ *
+ * @param pctxt  the XPath context
+ * @param val  the char * value
+ * @returns the created or reused object.
+ */
+static xmlXPathObjectPtr
+xmlXPathCacheNewCString(xmlXPathParserContextPtr pctxt, const char *val)
+{
+    return xmlXPathCacheNewString(pctxt, BAD_CAST val);
 }
 
 /**
- * add a new xmlNode to an existing NodeSet, optimized version
- * when we are sure the node is not already in the set.
+ * This is the cached version of #xmlXPathNewBoolean.
+ * Acquires an xmlXPathObject of type boolean and of value `val`
  *
- * @param cur  the initial node set
- * @param val  a new xmlNode
- * @returns 0 in case of success and -1 in case of failure
+ * @param pctxt  the XPath context
+ * @param val  the boolean value
+ * @returns the created or reused object.
  */
-int
-xmlXPathNodeSetAddUnique(xmlNodeSet *cur, xmlNode *val) {
-    if ((cur == NULL) || (val == NULL)) return(-1);
+static xmlXPathObjectPtr
+xmlXPathCacheNewBoolean(xmlXPathParserContextPtr pctxt, int val)
+{
+    xmlXPathObjectPtr ret;
+    xmlXPathContextPtr ctxt = pctxt->context;
 
-    /* @@ with_ns to check whether namespace nodes should be looked at @@ */
-    /*
-     * grow the nodeTab if needed
-     */
-    if (cur->nodeNr >= cur->nodeMax) {
-        if (xmlXPathNodeSetGrow(cur) < 0)
-            return(-1);
-    }
+    if ((ctxt != NULL) && (ctxt->cache != NULL)) {
+	xmlXPathContextCachePtr cache = (xmlXPathContextCachePtr) ctxt->cache;
 
-    if (val->type == XML_NAMESPACE_DECL) {
-	xmlNsPtr ns = (xmlNsPtr) val;
-        xmlNodePtr nsNode = xmlXPathNodeSetDupNs((xmlNodePtr) ns->next, ns);
+	if (cache->miscObjs != NULL) {
+	    ret = cache->miscObjs;
+            cache->miscObjs = (void *) ret->stringval;
+            cache->numMisc -= 1;
+            ret->stringval = NULL;
+	    ret->type = XPATH_BOOLEAN;
+	    ret->boolval = (val != 0);
+	    return(ret);
+	}
+    }
 
-        if (nsNode == NULL)
-            return(-1);
-	cur->nodeTab[cur->nodeNr++] = nsNode;
-    } else
-	cur->nodeTab[cur->nodeNr++] = val;
-    return(0);
+    ret = xmlXPathNewBoolean(val);
+    if (ret == NULL)
+        xmlXPathPErrMemory(pctxt);
+    return(ret);
 }
 
 /**
- * Merges two nodesets, all nodes from `val2` are added to `val1`
- * if `val1` is NULL, a new set is created and copied from `val2`
- *
- * Frees `val1` in case of error.
+ * This is the cached version of #xmlXPathNewFloat.
+ * Acquires an xmlXPathObject of type double and of value `val`
  *
- * @param val1  the first NodeSet or NULL
- * @param val2  the second NodeSet
- * @returns `val1` once extended or NULL in case of error.
+ * @param pctxt  the XPath context
+ * @param val  the double value
+ * @returns the created or reused object.
  */
-xmlNodeSet *
-xmlXPathNodeSetMerge(xmlNodeSet *val1, xmlNodeSet *val2) {
-    int i, j, initNr, skip;
-    xmlNodePtr n1, n2;
+static xmlXPathObjectPtr
+xmlXPathCacheNewFloat(xmlXPathParserContextPtr pctxt, double val)
+{
+    xmlXPathObjectPtr ret;
+    xmlXPathContextPtr ctxt = pctxt->context;
 
-    if (val1 == NULL) {
-	val1 = xmlXPathNodeSetCreate(NULL);
-        if (val1 == NULL)
-            return (NULL);
+    if ((ctxt != NULL) && (ctxt->cache != NULL)) {
+	xmlXPathContextCachePtr cache = (xmlXPathContextCachePtr) ctxt->cache;
+
+	if (cache->miscObjs != NULL) {
+	    ret = cache->miscObjs;
+            cache->miscObjs = (void *) ret->stringval;
+            cache->numMisc -= 1;
+            ret->stringval = NULL;
+	    ret->type = XPATH_NUMBER;
+	    ret->floatval = val;
+	    return(ret);
+	}
     }
-    if (val2 == NULL)
-        return(val1);
-
-    /* @@ with_ns to check whether namespace nodes should be looked at @@ */
-    initNr = val1->nodeNr;
-
-    for (i = 0;i < val2->nodeNr;i++) {
-	n2 = val2->nodeTab[i];
-	/*
-	 * check against duplicates
-	 */
-	skip = 0;
-	for (j = 0; j < initNr; j++) {
-	    n1 = val1->nodeTab[j];
-	    if (n1 == n2) {
-		skip = 1;
-		break;
-	    } else if ((n1->type == XML_NAMESPACE_DECL) &&
-		       (n2->type == XML_NAMESPACE_DECL)) {
-		if ((((xmlNsPtr) n1)->next == ((xmlNsPtr) n2)->next) &&
-		    (xmlStrEqual(((xmlNsPtr) n1)->prefix,
-			((xmlNsPtr) n2)->prefix)))
-		{
-		    skip = 1;
-		    break;
-		}
-	    }
-	}
-	if (skip)
-	    continue;
-
-	/*
-	 * grow the nodeTab if needed
-	 */
-        if (val1->nodeNr >= val1->nodeMax) {
-            if (xmlXPathNodeSetGrow(val1) < 0)
-                goto error;
-        }
-	if (n2->type == XML_NAMESPACE_DECL) {
-	    xmlNsPtr ns = (xmlNsPtr) n2;
-            xmlNodePtr nsNode = xmlXPathNodeSetDupNs((xmlNodePtr) ns->next, ns);
-
-            if (nsNode == NULL)
-                goto error;
-	    val1->nodeTab[val1->nodeNr++] = nsNode;
-	} else
-	    val1->nodeTab[val1->nodeNr++] = n2;
-    }
-
-    return(val1);
-
-error:
-    xmlXPathFreeNodeSet(val1);
-    return(NULL);
-}
 
+    ret = xmlXPathNewFloat(val);
+    if (ret == NULL)
+        xmlXPathPErrMemory(pctxt);
+    return(ret);
+}
 
 /**
- * Merges two nodesets, all nodes from `set2` are added to `set1`.
- * Checks for duplicate nodes. Clears set2.
- *
- * Frees `set1` in case of error.
+ * This is the cached version of #xmlXPathObjectCopy.
+ * Acquire a copy of a given object
  *
- * @param set1  the first NodeSet or NULL
- * @param set2  the second NodeSet
- * @returns `set1` once extended or NULL in case of error.
+ * @param pctxt  the XPath context
+ * @param val  the original object
+ * @returns a created or reused created object.
  */
-static xmlNodeSetPtr
-xmlXPathNodeSetMergeAndClear(xmlNodeSetPtr set1, xmlNodeSetPtr set2)
+static xmlXPathObjectPtr
+xmlXPathCacheObjectCopy(xmlXPathParserContextPtr pctxt, xmlXPathObjectPtr val)
 {
-    {
-	int i, j, initNbSet1;
-	xmlNodePtr n1, n2;
+    xmlXPathObjectPtr ret;
+    xmlXPathContextPtr ctxt = pctxt->context;
 
-	initNbSet1 = set1->nodeNr;
-	for (i = 0;i < set2->nodeNr;i++) {
-	    n2 = set2->nodeTab[i];
-	    /*
-	    * Skip duplicates.
-	    */
-	    for (j = 0; j < initNbSet1; j++) {
-		n1 = set1->nodeTab[j];
-		if (n1 == n2) {
-		    goto skip_node;
-		} else if ((n1->type == XML_NAMESPACE_DECL) &&
-		    (n2->type == XML_NAMESPACE_DECL))
-		{
-		    if ((((xmlNsPtr) n1)->next == ((xmlNsPtr) n2)->next) &&
-			(xmlStrEqual(((xmlNsPtr) n1)->prefix,
-			((xmlNsPtr) n2)->prefix)))
-		    {
-			/*
-			* Free the namespace node.
-			*/
-			xmlXPathNodeSetFreeNs((xmlNsPtr) n2);
-			goto skip_node;
-		    }
-		}
-	    }
-	    /*
-	    * grow the nodeTab if needed
-	    */
-            if (set1->nodeNr >= set1->nodeMax) {
-                if (xmlXPathNodeSetGrow(set1) < 0)
-                    goto error;
+    if (val == NULL)
+	return(NULL);
+
+    if ((ctxt != NULL) && (ctxt->cache != NULL)) {
+	switch (val->type) {
+            case XPATH_NODESET: {
+                xmlNodeSetPtr set;
+
+                set = xmlXPathNodeSetMerge(NULL, val->nodesetval);
+                if (set == NULL) {
+                    xmlXPathPErrMemory(pctxt);
+                    return(NULL);
+                }
+                return(xmlXPathCacheWrapNodeSet(pctxt, set));
             }
-	    set1->nodeTab[set1->nodeNr++] = n2;
-skip_node:
-            set2->nodeTab[i] = NULL;
+	    case XPATH_STRING:
+		return(xmlXPathCacheNewString(pctxt, val->stringval));
+	    case XPATH_BOOLEAN:
+		return(xmlXPathCacheNewBoolean(pctxt, val->boolval));
+	    case XPATH_NUMBER:
+		return(xmlXPathCacheNewFloat(pctxt, val->floatval));
+	    default:
+		break;
 	}
     }
-    set2->nodeNr = 0;
-    return(set1);
-
-error:
-    xmlXPathFreeNodeSet(set1);
-    xmlXPathNodeSetClear(set2, 1);
-    return(NULL);
+    ret = xmlXPathObjectCopy(val);
+    if (ret == NULL)
+        xmlXPathPErrMemory(pctxt);
+    return(ret);
 }
 
+/************************************************************************
+ *									*
+ *		Parser stacks related functions and macros		*
+ *									*
+ ************************************************************************/
+
 /**
- * Merges two nodesets, all nodes from `set2` are added to `set1`.
- * Doesn't check for duplicate nodes. Clears set2.
- *
- * Frees `set1` in case of error.
+ * Converts an XPath object to its number value
  *
- * @param set1  the first NodeSet or NULL
- * @param set2  the second NodeSet
- * @returns `set1` once extended or NULL in case of error.
+ * @param ctxt  parser context
+ * @param val  an XPath object
+ * @returns the number value
  */
-static xmlNodeSetPtr
-xmlXPathNodeSetMergeAndClearNoDupls(xmlNodeSetPtr set1, xmlNodeSetPtr set2)
-{
-    {
-	int i;
-	xmlNodePtr n2;
+static double
+xmlXPathCastToNumberInternal(xmlXPathParserContextPtr ctxt,
+                             xmlXPathObjectPtr val) {
+    double ret = 0.0;
 
-	for (i = 0;i < set2->nodeNr;i++) {
-	    n2 = set2->nodeTab[i];
-            if (set1->nodeNr >= set1->nodeMax) {
-                if (xmlXPathNodeSetGrow(set1) < 0)
-                    goto error;
-            }
-	    set1->nodeTab[set1->nodeNr++] = n2;
-            set2->nodeTab[i] = NULL;
-	}
-    }
-    set2->nodeNr = 0;
-    return(set1);
+    if (val == NULL)
+	return(xmlXPathNAN);
+    switch (val->type) {
+    case XPATH_UNDEFINED:
+	ret = xmlXPathNAN;
+	break;
+    case XPATH_NODESET:
+    case XPATH_XSLT_TREE: {
+        xmlChar *str;
 
-error:
-    xmlXPathFreeNodeSet(set1);
-    xmlXPathNodeSetClear(set2, 1);
-    return(NULL);
+	str = xmlXPathCastNodeSetToString(val->nodesetval);
+        if (str == NULL) {
+            xmlXPathPErrMemory(ctxt);
+            ret = xmlXPathNAN;
+        } else {
+	    ret = xmlXPathCastStringToNumber(str);
+            xmlFree(str);
+        }
+	break;
+    }
+    case XPATH_STRING:
+	ret = xmlXPathCastStringToNumber(val->stringval);
+	break;
+    case XPATH_NUMBER:
+	ret = val->floatval;
+	break;
+    case XPATH_BOOLEAN:
+	ret = xmlXPathCastBooleanToNumber(val->boolval);
+	break;
+    case XPATH_USERS:
+	/* TODO */
+	ret = xmlXPathNAN;
+	break;
+    }
+    return(ret);
 }
 
 /**
- * Removes an xmlNode from an existing NodeSet
+ * Pops the top XPath object from the value stack
  *
- * @param cur  the initial node set
- * @param val  an xmlNode
+ * @param ctxt  an XPath evaluation context
+ * @returns the XPath object just removed
  */
-void
-xmlXPathNodeSetDel(xmlNodeSet *cur, xmlNode *val) {
-    int i;
-
-    if (cur == NULL) return;
-    if (val == NULL) return;
+xmlXPathObject *
+xmlXPathValuePop(xmlXPathParserContext *ctxt)
+{
+    xmlXPathObjectPtr ret;
 
-    /*
-     * find node in nodeTab
-     */
-    for (i = 0;i < cur->nodeNr;i++)
-        if (cur->nodeTab[i] == val) break;
+    if ((ctxt == NULL) || (ctxt->valueNr <= 0))
+        return (NULL);
 
-    if (i >= cur->nodeNr) {	/* not found */
-        return;
-    }
-    if ((cur->nodeTab[i] != NULL) &&
-	(cur->nodeTab[i]->type == XML_NAMESPACE_DECL))
-	xmlXPathNodeSetFreeNs((xmlNsPtr) cur->nodeTab[i]);
-    cur->nodeNr--;
-    for (;i < cur->nodeNr;i++)
-        cur->nodeTab[i] = cur->nodeTab[i + 1];
-    cur->nodeTab[cur->nodeNr] = NULL;
+    ctxt->valueNr--;
+    if (ctxt->valueNr > 0)
+        ctxt->value = ctxt->valueTab[ctxt->valueNr - 1];
+    else
+        ctxt->value = NULL;
+    ret = ctxt->valueTab[ctxt->valueNr];
+    ctxt->valueTab[ctxt->valueNr] = NULL;
+    return (ret);
 }
 
 /**
- * Removes an entry from an existing NodeSet list.
+ * Pushes a new XPath object on top of the value stack. If value is NULL,
+ * a memory error is recorded in the parser context.
  *
- * @param cur  the initial node set
- * @param val  the index to remove
- */
-void
-xmlXPathNodeSetRemove(xmlNodeSet *cur, int val) {
-    if (cur == NULL) return;
-    if (val >= cur->nodeNr) return;
-    if ((cur->nodeTab[val] != NULL) &&
-	(cur->nodeTab[val]->type == XML_NAMESPACE_DECL))
-	xmlXPathNodeSetFreeNs((xmlNsPtr) cur->nodeTab[val]);
-    cur->nodeNr--;
-    for (;val < cur->nodeNr;val++)
-        cur->nodeTab[val] = cur->nodeTab[val + 1];
-    cur->nodeTab[cur->nodeNr] = NULL;
-}
-
-/**
- * Free the NodeSet compound (not the actual nodes !).
+ * The object is destroyed in case of error.
  *
- * @param obj  the xmlNodeSet to free
+ * @param ctxt  an XPath evaluation context
+ * @param value  the XPath object
+ * @returns the number of items on the value stack, or -1 in case of error.
  */
-void
-xmlXPathFreeNodeSet(xmlNodeSet *obj) {
-    if (obj == NULL) return;
-    if (obj->nodeTab != NULL) {
-	int i;
+int
+xmlXPathValuePush(xmlXPathParserContext *ctxt, xmlXPathObject *value)
+{
+    if (ctxt == NULL) return(-1);
+    if (value == NULL) {
+        /*
+         * A NULL value typically indicates that a memory allocation failed.
+         */
+        xmlXPathPErrMemory(ctxt);
+        return(-1);
+    }
+    if (ctxt->valueNr >= ctxt->valueMax) {
+        xmlXPathObjectPtr *tmp;
+        int newSize;
 
-	/* @@ with_ns to check whether namespace nodes should be looked at @@ */
-	for (i = 0;i < obj->nodeNr;i++)
-	    if ((obj->nodeTab[i] != NULL) &&
-		(obj->nodeTab[i]->type == XML_NAMESPACE_DECL))
-		xmlXPathNodeSetFreeNs((xmlNsPtr) obj->nodeTab[i]);
-	xmlFree(obj->nodeTab);
+        newSize = xmlGrowCapacity(ctxt->valueMax, sizeof(tmp[0]),
+                                  10, XPATH_MAX_STACK_DEPTH);
+        if (newSize < 0) {
+            xmlXPathPErrMemory(ctxt);
+            xmlXPathFreeObject(value);
+            return (-1);
+        }
+        tmp = xmlRealloc(ctxt->valueTab, newSize * sizeof(tmp[0]));
+        if (tmp == NULL) {
+            xmlXPathPErrMemory(ctxt);
+            xmlXPathFreeObject(value);
+            return (-1);
+        }
+	ctxt->valueTab = tmp;
+        ctxt->valueMax = newSize;
     }
-    xmlFree(obj);
+    ctxt->valueTab[ctxt->valueNr] = value;
+    ctxt->value = value;
+    return (ctxt->valueNr++);
 }
 
 /**
- * Clears the list from temporary XPath objects (e.g. namespace nodes
- * are feed) starting with the entry at `pos`, but does *not* free the list
- * itself. Sets the length of the list to `pos`.
+ * Pops a boolean from the stack, handling conversion if needed.
+ * Check error with xmlXPathCheckError.
  *
- * @param set  the node set to be cleared
- * @param pos  the start position to clear from
- * @param hasNsNodes  the node set might contain namespace nodes
+ * @param ctxt  an XPath parser context
+ * @returns the boolean
  */
-static void
-xmlXPathNodeSetClearFromPos(xmlNodeSetPtr set, int pos, int hasNsNodes)
-{
-    if ((set == NULL) || (pos >= set->nodeNr))
-	return;
-    else if ((hasNsNodes)) {
-	int i;
-	xmlNodePtr node;
+int
+xmlXPathPopBoolean (xmlXPathParserContext *ctxt) {
+    xmlXPathObjectPtr obj;
+    int ret;
 
-	for (i = pos; i < set->nodeNr; i++) {
-	    node = set->nodeTab[i];
-	    if ((node != NULL) &&
-		(node->type == XML_NAMESPACE_DECL))
-		xmlXPathNodeSetFreeNs((xmlNsPtr) node);
-	}
+    obj = xmlXPathValuePop(ctxt);
+    if (obj == NULL) {
+	xmlXPathSetError(ctxt, XPATH_INVALID_OPERAND);
+	return(0);
     }
-    set->nodeNr = pos;
-}
-
-/**
- * Clears the list from all temporary XPath objects (e.g. namespace nodes
- * are feed), but does *not* free the list itself. Sets the length of the
- * list to 0.
- *
- * @param set  the node set to clear
- * @param hasNsNodes  the node set might contain namespace nodes
- */
-static void
-xmlXPathNodeSetClear(xmlNodeSetPtr set, int hasNsNodes)
-{
-    xmlXPathNodeSetClearFromPos(set, 0, hasNsNodes);
+    if (obj->type != XPATH_BOOLEAN)
+	ret = xmlXPathCastToBoolean(obj);
+    else
+        ret = obj->boolval;
+    xmlXPathReleaseObject(ctxt->context, obj);
+    return(ret);
 }
 
 /**
- * Move the last node to the first position and clear temporary XPath objects
- * (e.g. namespace nodes) from all other nodes. Sets the length of the list
- * to 1.
+ * Pops a number from the stack, handling conversion if needed.
+ * Check error with xmlXPathCheckError.
  *
- * @param set  the node set to be cleared
+ * @param ctxt  an XPath parser context
+ * @returns the number
  */
-static void
-xmlXPathNodeSetKeepLast(xmlNodeSetPtr set)
-{
-    int i;
-    xmlNodePtr node;
+double
+xmlXPathPopNumber (xmlXPathParserContext *ctxt) {
+    xmlXPathObjectPtr obj;
+    double ret;
 
-    if ((set == NULL) || (set->nodeNr <= 1))
-	return;
-    for (i = 0; i < set->nodeNr - 1; i++) {
-        node = set->nodeTab[i];
-        if ((node != NULL) &&
-            (node->type == XML_NAMESPACE_DECL))
-            xmlXPathNodeSetFreeNs((xmlNsPtr) node);
+    obj = xmlXPathValuePop(ctxt);
+    if (obj == NULL) {
+	xmlXPathSetError(ctxt, XPATH_INVALID_OPERAND);
+	return(0);
     }
-    set->nodeTab[0] = set->nodeTab[set->nodeNr-1];
-    set->nodeNr = 1;
+    if (obj->type != XPATH_NUMBER)
+	ret = xmlXPathCastToNumberInternal(ctxt, obj);
+    else
+        ret = obj->floatval;
+    xmlXPathReleaseObject(ctxt->context, obj);
+    return(ret);
 }
 
 /**
- * Create a new xmlXPathObject of type NodeSet and initialize
- * it with the single Node `val`
+ * Pops a string from the stack, handling conversion if needed.
+ * Check error with xmlXPathCheckError.
  *
- * @param val  the NodePtr value
- * @returns the newly created object.
+ * @param ctxt  an XPath parser context
+ * @returns the string
  */
-xmlXPathObject *
-xmlXPathNewNodeSet(xmlNode *val) {
-    xmlXPathObjectPtr ret;
+xmlChar *
+xmlXPathPopString (xmlXPathParserContext *ctxt) {
+    xmlXPathObjectPtr obj;
+    xmlChar * ret;
 
-    ret = (xmlXPathObjectPtr) xmlMalloc(sizeof(xmlXPathObject));
-    if (ret == NULL)
+    obj = xmlXPathValuePop(ctxt);
+    if (obj == NULL) {
+	xmlXPathSetError(ctxt, XPATH_INVALID_OPERAND);
 	return(NULL);
-    memset(ret, 0 , sizeof(xmlXPathObject));
-    ret->type = XPATH_NODESET;
-    ret->boolval = 0;
-    ret->nodesetval = xmlXPathNodeSetCreate(val);
-    if (ret->nodesetval == NULL) {
-        xmlFree(ret);
-        return(NULL);
     }
-    /* @@ with_ns to check whether namespace nodes should be looked at @@ */
+    ret = xmlXPathCastToString(obj);
+    if (ret == NULL)
+        xmlXPathPErrMemory(ctxt);
+    xmlXPathReleaseObject(ctxt->context, obj);
     return(ret);
 }
 
 /**
- * Create a new xmlXPathObject of type Value Tree (XSLT) and initialize
- * it with the tree root `val`
+ * Pops a node-set from the stack, handling conversion if needed.
+ * Check error with xmlXPathCheckError.
  *
- * @param val  the NodePtr value
- * @returns the newly created object.
+ * @param ctxt  an XPath parser context
+ * @returns the node-set
  */
-xmlXPathObject *
-xmlXPathNewValueTree(xmlNode *val) {
-    xmlXPathObjectPtr ret;
+xmlNodeSet *
+xmlXPathPopNodeSet (xmlXPathParserContext *ctxt) {
+    xmlXPathObjectPtr obj;
+    xmlNodeSetPtr ret;
 
-    ret = xmlXPathNewNodeSet(val);
-    if (ret == NULL)
+    if (ctxt == NULL) return(NULL);
+    if (ctxt->value == NULL) {
+	xmlXPathSetError(ctxt, XPATH_INVALID_OPERAND);
 	return(NULL);
-    ret->type = XPATH_XSLT_TREE;
-
+    }
+    if (!xmlXPathStackIsNodeSet(ctxt)) {
+	xmlXPathSetTypeError(ctxt);
+	return(NULL);
+    }
+    obj = xmlXPathValuePop(ctxt);
+    ret = obj->nodesetval;
+    obj->nodesetval = NULL;
+    xmlXPathReleaseObject(ctxt->context, obj);
     return(ret);
 }
 
 /**
- * Create a new xmlXPathObject of type NodeSet and initialize
- * it with the Nodeset `val`
+ * Pops an external object from the stack, handling conversion if needed.
+ * Check error with xmlXPathCheckError.
  *
- * @param val  an existing NodeSet
- * @returns the newly created object.
+ * @param ctxt  an XPath parser context
+ * @returns the object
  */
-xmlXPathObject *
-xmlXPathNewNodeSetList(xmlNodeSet *val)
-{
-    xmlXPathObjectPtr ret;
+void *
+xmlXPathPopExternal (xmlXPathParserContext *ctxt) {
+    xmlXPathObjectPtr obj;
+    void * ret;
 
-    if (val == NULL)
-        ret = NULL;
-    else if (val->nodeTab == NULL)
-        ret = xmlXPathNewNodeSet(NULL);
-    else {
-        ret = xmlXPathNewNodeSet(val->nodeTab[0]);
-        if (ret) {
-            ret->nodesetval = xmlXPathNodeSetMerge(NULL, val);
-            if (ret->nodesetval == NULL) {
-                xmlFree(ret);
-                return(NULL);
-            }
-        }
+    if ((ctxt == NULL) || (ctxt->value == NULL)) {
+	xmlXPathSetError(ctxt, XPATH_INVALID_OPERAND);
+	return(NULL);
     }
-
-    return (ret);
+    if (ctxt->value->type != XPATH_USERS) {
+	xmlXPathSetTypeError(ctxt);
+	return(NULL);
+    }
+    obj = xmlXPathValuePop(ctxt);
+    ret = obj->user;
+    obj->user = NULL;
+    xmlXPathReleaseObject(ctxt->context, obj);
+    return(ret);
 }
 
-/**
- * Wrap the Nodeset `val` in a new xmlXPathObject
+/*
+ * Macros for accessing the content. Those should be used only by the parser,
+ * and not exported.
  *
- * In case of error the node set is destroyed and NULL is returned.
+ * Dirty macros, i.e. one need to make assumption on the context to use them
  *
- * @param val  the NodePtr value
- * @returns the newly created object.
+ *   CUR_PTR return the current pointer to the xmlChar to be parsed.
+ *   CUR     returns the current xmlChar value, i.e. a 8 bit value
+ *           in ISO-Latin or UTF-8.
+ *           This should be used internally by the parser
+ *           only to compare to ASCII values otherwise it would break when
+ *           running with UTF-8 encoding.
+ *   NXT(n)  returns the n'th next xmlChar. Same as CUR is should be used only
+ *           to compare on ASCII based substring.
+ *   SKIP(n) Skip n xmlChar, and must also be used only to skip ASCII defined
+ *           strings within the parser.
+ *   CURRENT Returns the current char value, with the full decoding of
+ *           UTF-8 if we are using this mode. It returns an int.
+ *   NEXT    Skip to the next character, this does the proper decoding
+ *           in UTF-8 mode. It also pop-up unfinished entities on the fly.
+ *           It returns the pointer to the current xmlChar.
  */
-xmlXPathObject *
-xmlXPathWrapNodeSet(xmlNodeSet *val) {
-    xmlXPathObjectPtr ret;
 
-    ret = (xmlXPathObjectPtr) xmlMalloc(sizeof(xmlXPathObject));
-    if (ret == NULL) {
-        xmlXPathFreeNodeSet(val);
-	return(NULL);
-    }
-    memset(ret, 0 , sizeof(xmlXPathObject));
-    ret->type = XPATH_NODESET;
-    ret->nodesetval = val;
-    return(ret);
-}
+#define CUR (*ctxt->cur)
+#define SKIP(val) ctxt->cur += (val)
+#define NXT(val) ctxt->cur[(val)]
+#define CUR_PTR ctxt->cur
 
-/**
- * Free up the xmlXPathObject `obj` but don't deallocate the objects in
- * the list contrary to #xmlXPathFreeObject.
- *
- * @param obj  an existing NodeSetList object
- */
-void
-xmlXPathFreeNodeSetList(xmlXPathObject *obj) {
-    if (obj == NULL) return;
-    xmlFree(obj);
-}
+#define SKIP_BLANKS							\
+    while (IS_BLANK_CH(*(ctxt->cur))) NEXT
 
-/**
- * Implements the EXSLT - Sets difference() function:
- *    node-set set:difference (node-set, node-set)
- *
- * @param nodes1  a node-set
- * @param nodes2  a node-set
- * @returns the difference between the two node sets, or nodes1 if
- *         nodes2 is empty
- */
-xmlNodeSet *
-xmlXPathDifference (xmlNodeSet *nodes1, xmlNodeSet *nodes2) {
-    xmlNodeSetPtr ret;
-    int i, l1;
-    xmlNodePtr cur;
+#define CURRENT (*ctxt->cur)
+#define NEXT ((*ctxt->cur) ?  ctxt->cur++: ctxt->cur)
 
-    if (xmlXPathNodeSetIsEmpty(nodes2))
-	return(nodes1);
 
-    ret = xmlXPathNodeSetCreate(NULL);
-    if (ret == NULL)
-        return(NULL);
-    if (xmlXPathNodeSetIsEmpty(nodes1))
-	return(ret);
+#ifndef DBL_DIG
+#define DBL_DIG 16
+#endif
+#ifndef DBL_EPSILON
+#define DBL_EPSILON 1E-9
+#endif
 
-    l1 = xmlXPathNodeSetGetLength(nodes1);
+#define UPPER_DOUBLE 1E9
+#define LOWER_DOUBLE 1E-5
+#define	LOWER_DOUBLE_EXP 5
 
-    for (i = 0; i < l1; i++) {
-	cur = xmlXPathNodeSetItem(nodes1, i);
-	if (!xmlXPathNodeSetContains(nodes2, cur)) {
-	    if (xmlXPathNodeSetAddUnique(ret, cur) < 0) {
-                xmlXPathFreeNodeSet(ret);
-	        return(NULL);
-            }
-	}
-    }
-    return(ret);
-}
+#define INTEGER_DIGITS DBL_DIG
+#define FRACTION_DIGITS (DBL_DIG + 1 + (LOWER_DOUBLE_EXP))
+#define EXPONENT_DIGITS (3 + 2)
 
 /**
- * Implements the EXSLT - Sets intersection() function:
- *    node-set set:intersection (node-set, node-set)
+ * Convert the number into a string representation.
  *
- * @param nodes1  a node-set
- * @param nodes2  a node-set
- * @returns a node set comprising the nodes that are within both the
- *         node sets passed as arguments
+ * @param number  number to format
+ * @param buffer  output buffer
+ * @param buffersize  size of output buffer
  */
-xmlNodeSet *
-xmlXPathIntersection (xmlNodeSet *nodes1, xmlNodeSet *nodes2) {
-    xmlNodeSetPtr ret = xmlXPathNodeSetCreate(NULL);
-    int i, l1;
-    xmlNodePtr cur;
+static void
+xmlXPathFormatNumber(double number, char buffer[], int buffersize)
+{
+    switch (xmlXPathIsInf(number)) {
+    case 1:
+	if (buffersize > (int)sizeof("Infinity"))
+	    snprintf(buffer, buffersize, "Infinity");
+	break;
+    case -1:
+	if (buffersize > (int)sizeof("-Infinity"))
+	    snprintf(buffer, buffersize, "-Infinity");
+	break;
+    default:
+	if (xmlXPathIsNaN(number)) {
+	    if (buffersize > (int)sizeof("NaN"))
+		snprintf(buffer, buffersize, "NaN");
+	} else if (number == 0) {
+            /* Omit sign for negative zero. */
+	    snprintf(buffer, buffersize, "0");
+	} else if ((number > INT_MIN) && (number < INT_MAX) &&
+                   (number == (int) number)) {
+	    char work[30];
+	    char *ptr, *cur;
+	    int value = (int) number;
 
-    if (ret == NULL)
-        return(ret);
-    if (xmlXPathNodeSetIsEmpty(nodes1))
-	return(ret);
-    if (xmlXPathNodeSetIsEmpty(nodes2))
-	return(ret);
+            ptr = &buffer[0];
+	    if (value == 0) {
+		*ptr++ = '0';
+	    } else {
+		snprintf(work, 29, "%d", value);
+		cur = &work[0];
+		while ((*cur) && (ptr - buffer < buffersize)) {
+		    *ptr++ = *cur++;
+		}
+	    }
+	    if (ptr - buffer < buffersize) {
+		*ptr = 0;
+	    } else if (buffersize > 0) {
+		ptr--;
+		*ptr = 0;
+	    }
+	} else {
+	    /*
+	      For the dimension of work,
+	          DBL_DIG is number of significant digits
+		  EXPONENT is only needed for "scientific notation"
+	          3 is sign, decimal point, and terminating zero
+		  LOWER_DOUBLE_EXP is max number of leading zeroes in fraction
+	      Note that this dimension is slightly (a few characters)
+	      larger than actually necessary.
+	    */
+	    char work[DBL_DIG + EXPONENT_DIGITS + 3 + LOWER_DOUBLE_EXP];
+	    int integer_place, fraction_place;
+	    char *ptr;
+	    char *after_fraction;
+	    double absolute_value;
+	    int size;
 
-    l1 = xmlXPathNodeSetGetLength(nodes1);
+	    absolute_value = fabs(number);
 
-    for (i = 0; i < l1; i++) {
-	cur = xmlXPathNodeSetItem(nodes1, i);
-	if (xmlXPathNodeSetContains(nodes2, cur)) {
-	    if (xmlXPathNodeSetAddUnique(ret, cur) < 0) {
-                xmlXPathFreeNodeSet(ret);
-	        return(NULL);
-            }
+	    /*
+	     * First choose format - scientific or regular floating point.
+	     * In either case, result is in work, and after_fraction points
+	     * just past the fractional part.
+	    */
+	    if ( ((absolute_value > UPPER_DOUBLE) ||
+		  (absolute_value < LOWER_DOUBLE)) &&
+		 (absolute_value != 0.0) ) {
+		/* Use scientific notation */
+		integer_place = DBL_DIG + EXPONENT_DIGITS + 1;
+		fraction_place = DBL_DIG - 1;
+		size = snprintf(work, sizeof(work),"%*.*e",
+			 integer_place, fraction_place, number);
+		while ((size > 0) && (work[size] != 'e')) size--;
+
+	    }
+	    else {
+		/* Use regular notation */
+		if (absolute_value > 0.0) {
+		    integer_place = (int)log10(absolute_value);
+		    if (integer_place > 0)
+		        fraction_place = DBL_DIG - integer_place - 1;
+		    else
+		        fraction_place = DBL_DIG - integer_place;
+		} else {
+		    fraction_place = 1;
+		}
+		size = snprintf(work, sizeof(work), "%0.*f",
+				fraction_place, number);
+	    }
+
+	    /* Remove leading spaces sometimes inserted by snprintf */
+	    while (work[0] == ' ') {
+	        for (ptr = &work[0];(ptr[0] = ptr[1]);ptr++);
+		size--;
+	    }
+
+	    /* Remove fractional trailing zeroes */
+	    after_fraction = work + size;
+	    ptr = after_fraction;
+	    while (*(--ptr) == '0')
+		;
+	    if (*ptr != '.')
+	        ptr++;
+	    while ((*ptr++ = *after_fraction++) != 0);
+
+	    /* Finally copy result back to caller */
+	    size = strlen(work) + 1;
+	    if (size > buffersize) {
+		work[buffersize - 1] = 0;
+		size = buffersize;
+	    }
+	    memmove(buffer, work, size);
 	}
+	break;
     }
-    return(ret);
 }
 
+
+/************************************************************************
+ *									*
+ *			Routines to handle NodeSets			*
+ *									*
+ ************************************************************************/
+
 /**
- * Implements the EXSLT - Sets distinct() function:
- *    node-set set:distinct (node-set)
+ * Call this routine to speed up XPath computation on static documents.
+ * This stamps all the element nodes with the document order
+ * Like for line information, the order is kept in the element->content
+ * field, the value stored is actually - the node number (starting at -1)
+ * to be able to differentiate from line numbers.
  *
- * @param nodes  a node-set, sorted by document order
- * @returns a subset of the nodes contained in `nodes`, or `nodes` if
- *         it is empty
+ * @param doc  an input document
+ * @returns the number of elements found in the document or -1 in case
+ *    of error.
  */
-xmlNodeSet *
-xmlXPathDistinctSorted (xmlNodeSet *nodes) {
-    xmlNodeSetPtr ret;
-    xmlHashTablePtr hash;
-    int i, l;
-    xmlChar * strval;
+long
+xmlXPathOrderDocElems(xmlDoc *doc) {
+    XML_INTPTR_T count = 0;
     xmlNodePtr cur;
 
-    if (xmlXPathNodeSetIsEmpty(nodes))
-	return(nodes);
-
-    ret = xmlXPathNodeSetCreate(NULL);
-    if (ret == NULL)
-        return(ret);
-    l = xmlXPathNodeSetGetLength(nodes);
-    hash = xmlHashCreate (l);
-    for (i = 0; i < l; i++) {
-	cur = xmlXPathNodeSetItem(nodes, i);
-	strval = xmlXPathCastNodeToString(cur);
-	if (xmlHashLookup(hash, strval) == NULL) {
-	    if (xmlHashAddEntry(hash, strval, strval) < 0) {
-                xmlFree(strval);
-                goto error;
-            }
-	    if (xmlXPathNodeSetAddUnique(ret, cur) < 0)
-	        goto error;
-	} else {
-	    xmlFree(strval);
+    if (doc == NULL)
+	return(-1);
+    cur = doc->children;
+    while (cur != NULL) {
+	if (cur->type == XML_ELEMENT_NODE) {
+            count += 1;
+            cur->content = XML_INT_TO_PTR(-count);
+	    if (cur->children != NULL) {
+		cur = cur->children;
+		continue;
+	    }
+	}
+	if (cur->next != NULL) {
+	    cur = cur->next;
+	    continue;
 	}
+	do {
+	    cur = cur->parent;
+	    if (cur == NULL)
+		break;
+	    if (cur == (xmlNodePtr) doc) {
+		cur = NULL;
+		break;
+	    }
+	    if (cur->next != NULL) {
+		cur = cur->next;
+		break;
+	    }
+	} while (cur != NULL);
     }
-    xmlHashFree(hash, xmlHashDefaultDeallocator);
-    return(ret);
-
-error:
-    xmlHashFree(hash, xmlHashDefaultDeallocator);
-    xmlXPathFreeNodeSet(ret);
-    return(NULL);
-}
-
-/**
- * Implements the EXSLT - Sets distinct() function:
- *    node-set set:distinct (node-set)
- * `nodes` is sorted by document order, then exslSetsDistinctSorted
- * is called with the sorted node-set
- *
- * @param nodes  a node-set
- * @returns a subset of the nodes contained in `nodes`, or `nodes` if
- *         it is empty
- */
-xmlNodeSet *
-xmlXPathDistinct (xmlNodeSet *nodes) {
-    if (xmlXPathNodeSetIsEmpty(nodes))
-	return(nodes);
-
-    xmlXPathNodeSetSort(nodes);
-    return(xmlXPathDistinctSorted(nodes));
+    return(count);
 }
 
 /**
- * Implements the EXSLT - Sets has-same-nodes function:
- *    boolean set:has-same-node(node-set, node-set)
+ * Compare two nodes w.r.t document order
  *
- * @param nodes1  a node-set
- * @param nodes2  a node-set
- * @returns true (1) if `nodes1` shares any node with `nodes2`, false (0)
- *         otherwise
+ * @param node1  the first node
+ * @param node2  the second node
+ * @returns -2 in case of error 1 if first point < second point, 0 if
+ *         it's the same node, -1 otherwise
  */
 int
-xmlXPathHasSameNodes (xmlNodeSet *nodes1, xmlNodeSet *nodes2) {
-    int i, l;
-    xmlNodePtr cur;
+xmlXPathCmpNodes(xmlNode *node1, xmlNode *node2) {
+    int depth1, depth2;
+    int attr1 = 0, attr2 = 0;
+    xmlNodePtr attrNode1 = NULL, attrNode2 = NULL;
+    xmlNodePtr cur, root;
+    int ret;
 
-    if (xmlXPathNodeSetIsEmpty(nodes1) ||
-	xmlXPathNodeSetIsEmpty(nodes2))
+    if ((node1 == NULL) || (node2 == NULL))
+	return(-2);
+    /*
+     * a couple of optimizations which will avoid computations in most cases
+     */
+    if (node1 == node2)		/* trivial case */
 	return(0);
-
-    l = xmlXPathNodeSetGetLength(nodes1);
-    for (i = 0; i < l; i++) {
-	cur = xmlXPathNodeSetItem(nodes1, i);
-	if (xmlXPathNodeSetContains(nodes2, cur))
+    if (node1->type == XML_ATTRIBUTE_NODE) {
+	attr1 = 1;
+	attrNode1 = node1;
+	node1 = node1->parent;
+    }
+    if (node2->type == XML_ATTRIBUTE_NODE) {
+	attr2 = 1;
+	attrNode2 = node2;
+	node2 = node2->parent;
+    }
+    if (node1 == node2) {
+	if (attr1 == attr2) {
+	    /* not required, but we keep attributes in order */
+	    if (attr1 != 0) {
+	        cur = attrNode2->prev;
+		while (cur != NULL) {
+		    if (cur == attrNode1)
+		        return (1);
+		    cur = cur->prev;
+		}
+		return (-1);
+	    }
+	    return(0);
+	}
+	if (attr2 == 1)
 	    return(1);
+	return(-1);
     }
-    return(0);
-}
+    if ((node1->type == XML_NAMESPACE_DECL) ||
+        (node2->type == XML_NAMESPACE_DECL))
+	return(1);
+    if (node1 == node2->prev)
+	return(1);
+    if (node1 == node2->next)
+	return(-1);
 
-/**
- * Implements the EXSLT - Sets leading() function:
- *    node-set set:leading (node-set, node-set)
- *
- * @param nodes  a node-set, sorted by document order
- * @param node  a node
- * @returns the nodes in `nodes` that precede `node` in document order,
- *         `nodes` if `node` is NULL or an empty node-set if `nodes`
- *         doesn't contain `node`
- */
-xmlNodeSet *
-xmlXPathNodeLeadingSorted (xmlNodeSet *nodes, xmlNode *node) {
-    int i, l;
-    xmlNodePtr cur;
-    xmlNodeSetPtr ret;
+    /*
+     * Speedup using document order if available.
+     */
+    if ((node1->type == XML_ELEMENT_NODE) &&
+	(node2->type == XML_ELEMENT_NODE) &&
+	(0 > XML_NODE_SORT_VALUE(node1)) &&
+	(0 > XML_NODE_SORT_VALUE(node2)) &&
+	(node1->doc == node2->doc)) {
+	XML_INTPTR_T l1, l2;
 
-    if (node == NULL)
-	return(nodes);
+	l1 = -XML_NODE_SORT_VALUE(node1);
+	l2 = -XML_NODE_SORT_VALUE(node2);
+	if (l1 < l2)
+	    return(1);
+	if (l1 > l2)
+	    return(-1);
+    }
 
-    ret = xmlXPathNodeSetCreate(NULL);
-    if (ret == NULL)
+    /*
+     * Use the document order index if available.
+     */
+    ret = xmlXPathCmpNodesIndexed(attr1 ? attrNode1 : node1,
+                                  attr2 ? attrNode2 : node2);
+    if (ret != -2)
         return(ret);
-    if (xmlXPathNodeSetIsEmpty(nodes) ||
-	(!xmlXPathNodeSetContains(nodes, node)))
-	return(ret);
 
-    l = xmlXPathNodeSetGetLength(nodes);
-    for (i = 0; i < l; i++) {
-	cur = xmlXPathNodeSetItem(nodes, i);
-	if (cur == node)
-	    break;
-	if (xmlXPathNodeSetAddUnique(ret, cur) < 0) {
-            xmlXPathFreeNodeSet(ret);
-	    return(NULL);
-        }
+    /*
+     * compute depth to root
+     */
+    for (depth2 = 0, cur = node2;cur->parent != NULL;cur = cur->parent) {
+	if (cur->parent == node1)
+	    return(1);
+	depth2++;
     }
-    return(ret);
-}
-
-/**
- * Implements the EXSLT - Sets leading() function:
- *    node-set set:leading (node-set, node-set)
- * `nodes` is sorted by document order, then exslSetsNodeLeadingSorted
- * is called.
- *
- * @param nodes  a node-set
- * @param node  a node
- * @returns the nodes in `nodes` that precede `node` in document order,
- *         `nodes` if `node` is NULL or an empty node-set if `nodes`
- *         doesn't contain `node`
- */
-xmlNodeSet *
-xmlXPathNodeLeading (xmlNodeSet *nodes, xmlNode *node) {
-    xmlXPathNodeSetSort(nodes);
-    return(xmlXPathNodeLeadingSorted(nodes, node));
-}
-
-/**
- * Implements the EXSLT - Sets leading() function:
- *    node-set set:leading (node-set, node-set)
- *
- * @param nodes1  a node-set, sorted by document order
- * @param nodes2  a node-set, sorted by document order
- * @returns the nodes in `nodes1` that precede the first node in `nodes2`
- *         in document order, `nodes1` if `nodes2` is NULL or empty or
- *         an empty node-set if `nodes1` doesn't contain `nodes2`
- */
-xmlNodeSet *
-xmlXPathLeadingSorted (xmlNodeSet *nodes1, xmlNodeSet *nodes2) {
-    if (xmlXPathNodeSetIsEmpty(nodes2))
-	return(nodes1);
-    return(xmlXPathNodeLeadingSorted(nodes1,
-				     xmlXPathNodeSetItem(nodes2, 1)));
-}
-
-/**
- * Implements the EXSLT - Sets leading() function:
- *    node-set set:leading (node-set, node-set)
- * `nodes1` and `nodes2` are sorted by document order, then
- * exslSetsLeadingSorted is called.
- *
- * @param nodes1  a node-set
- * @param nodes2  a node-set
- * @returns the nodes in `nodes1` that precede the first node in `nodes2`
- *         in document order, `nodes1` if `nodes2` is NULL or empty or
- *         an empty node-set if `nodes1` doesn't contain `nodes2`
- */
-xmlNodeSet *
-xmlXPathLeading (xmlNodeSet *nodes1, xmlNodeSet *nodes2) {
-    if (xmlXPathNodeSetIsEmpty(nodes2))
-	return(nodes1);
-    if (xmlXPathNodeSetIsEmpty(nodes1))
-	return(xmlXPathNodeSetCreate(NULL));
-    xmlXPathNodeSetSort(nodes1);
-    xmlXPathNodeSetSort(nodes2);
-    return(xmlXPathNodeLeadingSorted(nodes1,
-				     xmlXPathNodeSetItem(nodes2, 1)));
+    root = cur;
+    for (depth1 = 0, cur = node1;cur->parent != NULL;cur = cur->parent) {
+	if (cur->parent == node2)
+	    return(-1);
+	depth1++;
+    }
+    /*
+     * Distinct document (or distinct entities :-( ) case.
+     */
+    if (root != cur) {
+	return(-2);
+    }
+    /*
+     * get the nearest common ancestor.
+     */
+    while (depth1 > depth2) {
+	depth1--;
+	node1 = node1->parent;
+    }
+    while (depth2 > depth1) {
+	depth2--;
+	node2 = node2->parent;
+    }
+    while (node1->parent != node2->parent) {
+	node1 = node1->parent;
+	node2 = node2->parent;
+	/* should not happen but just in case ... */
+	if ((node1 == NULL) || (node2 == NULL))
+	    return(-2);
+    }
+    /*
+     * Find who's first.
+     */
+    if (node1 == node2->prev)
+	return(1);
+    if (node1 == node2->next)
+	return(-1);
+    /*
+     * Speedup using document order if available.
+     */
+    if ((node1->type == XML_ELEMENT_NODE) &&
+	(node2->type == XML_ELEMENT_NODE) &&
+	(0 > XML_NODE_SORT_VALUE(node1)) &&
+	(0 > XML_NODE_SORT_VALUE(node2)) &&
+	(node1->doc == node2->doc)) {
+	XML_INTPTR_T l1, l2;
+
+	l1 = -XML_NODE_SORT_VALUE(node1);
+	l2 = -XML_NODE_SORT_VALUE(node2);
+	if (l1 < l2)
+	    return(1);
+	if (l1 > l2)
+	    return(-1);
+    }
+
+    for (cur = node1->next;cur != NULL;cur = cur->next)
+	if (cur == node2)
+	    return(1);
+    return(-1); /* assume there is no sibling list corruption */
 }
 
 /**
- * Implements the EXSLT - Sets trailing() function:
- *    node-set set:trailing (node-set, node-set)
+ * Sort the node set in document order without using the document
+ * order index.
  *
- * @param nodes  a node-set, sorted by document order
- * @param node  a node
- * @returns the nodes in `nodes` that follow `node` in document order,
- *         `nodes` if `node` is NULL or an empty node-set if `nodes`
- *         doesn't contain `node`
+ * @param set  the node set
  */
-xmlNodeSet *
-xmlXPathNodeTrailingSorted (xmlNodeSet *nodes, xmlNode *node) {
-    int i, l;
-    xmlNodePtr cur;
-    xmlNodeSetPtr ret;
-
-    if (node == NULL)
-	return(nodes);
-
-    ret = xmlXPathNodeSetCreate(NULL);
-    if (ret == NULL)
-        return(ret);
-    if (xmlXPathNodeSetIsEmpty(nodes) ||
-	(!xmlXPathNodeSetContains(nodes, node)))
-	return(ret);
+static void
+xmlXPathNodeSetSortNoIndex(xmlNodeSetPtr set) {
+#ifndef WITH_TIM_SORT
+    int i, j, incr, len;
+    xmlNodePtr tmp;
+#endif
 
-    l = xmlXPathNodeSetGetLength(nodes);
-    for (i = l - 1; i >= 0; i--) {
-	cur = xmlXPathNodeSetItem(nodes, i);
-	if (cur == node)
-	    break;
-	if (xmlXPathNodeSetAddUnique(ret, cur) < 0) {
-            xmlXPathFreeNodeSet(ret);
-	    return(NULL);
-        }
+#ifndef WITH_TIM_SORT
+    /*
+     * Use the old Shell's sort implementation to sort the node-set
+     * Timsort ought to be quite faster
+     */
+    len = set->nodeNr;
+    for (incr = len / 2; incr > 0; incr /= 2) {
+	for (i = incr; i < len; i++) {
+	    j = i - incr;
+	    while (j >= 0) {
+#ifdef XP_OPTIMIZED_NON_ELEM_COMPARISON
+		if (xmlXPathCmpNodesExt(set->nodeTab[j],
+			set->nodeTab[j + incr]) == -1)
+#else
+		if (xmlXPathCmpNodes(set->nodeTab[j],
+			set->nodeTab[j + incr]) == -1)
+#endif
+		{
+		    tmp = set->nodeTab[j];
+		    set->nodeTab[j] = set->nodeTab[j + incr];
+		    set->nodeTab[j + incr] = tmp;
+		    j -= incr;
+		} else
+		    break;
+	    }
+	}
     }
-    xmlXPathNodeSetSort(ret);	/* bug 413451 */
-    return(ret);
+#else /* WITH_TIM_SORT */
+    libxml_domnode_tim_sort(set->nodeTab, set->nodeNr);
+#endif /* WITH_TIM_SORT */
 }
 
 /**
- * Implements the EXSLT - Sets trailing() function:
- *    node-set set:trailing (node-set, node-set)
- * `nodes` is sorted by document order, then #xmlXPathNodeTrailingSorted
- * is called.
+ * Sort the node set in document order
  *
- * @param nodes  a node-set
- * @param node  a node
- * @returns the nodes in `nodes` that follow `node` in document order,
- *         `nodes` if `node` is NULL or an empty node-set if `nodes`
- *         doesn't contain `node`
+ * @param set  the node set
  */
-xmlNodeSet *
-xmlXPathNodeTrailing (xmlNodeSet *nodes, xmlNode *node) {
-    xmlXPathNodeSetSort(nodes);
-    return(xmlXPathNodeTrailingSorted(nodes, node));
+void
+xmlXPathNodeSetSort(xmlNodeSet *set) {
+    if ((set == NULL) || (set->nodeNr <= 1))
+	return;
+
+    if (xmlXPathNodeSetSortIndexed(set) == 0)
+        return;
+    xmlXPathNodeSetSortNoIndex(set);
 }
 
 /**
- * Implements the EXSLT - Sets trailing() function:
- *    node-set set:trailing (node-set, node-set)
- *
- * @param nodes1  a node-set, sorted by document order
- * @param nodes2  a node-set, sorted by document order
- * @returns the nodes in `nodes1` that follow the first node in `nodes2`
- *         in document order, `nodes1` if `nodes2` is NULL or empty or
- *         an empty node-set if `nodes1` doesn't contain `nodes2`
+ * Merge two arrays of nodes sorted in document order. Nodes found in
+ * both arrays are only copied once.
+ *
+ * @param dst  the output array with room for `num1 + num2` nodes
+ * @param nodes1  the first array
+ * @param num1  size of the first array
+ * @param nodes2  the second array
+ * @param num2  size of the second array
+ * @returns the number of nodes written to `dst`.
  */
-xmlNodeSet *
-xmlXPathTrailingSorted (xmlNodeSet *nodes1, xmlNodeSet *nodes2) {
-    if (xmlXPathNodeSetIsEmpty(nodes2))
-	return(nodes1);
-    return(xmlXPathNodeTrailingSorted(nodes1,
-				      xmlXPathNodeSetItem(nodes2, 0)));
+static int
+xmlXPathMergeSortedNodes(xmlNodePtr *dst, xmlNodePtr *nodes1, int num1,
+                         xmlNodePtr *nodes2, int num2) {
+    int i = 0, j = 0, k = 0;
+
+    while ((i < num1) && (j < num2)) {
+        if (nodes1[i] == nodes2[j]) {
+            dst[k++] = nodes1[i++];
+            j++;
+        } else if (XP_CMP_NODES(nodes1[i], nodes2[j]) == -1) {
+            dst[k++] = nodes2[j++];
+        } else {
+            dst[k++] = nodes1[i++];
+        }
+    }
+    if (i < num1) {
+        memcpy(&dst[k], &nodes1[i], (num1 - i) * sizeof(dst[0]));
+        k += num1 - i;
+    }
+    if (j < num2) {
+        memcpy(&dst[k], &nodes2[j], (num2 - j) * sizeof(dst[0]));
+        k += num2 - j;
+    }
+
+    return(k);
 }
 
-/**
- * Implements the EXSLT - Sets trailing() function:
- *    node-set set:trailing (node-set, node-set)
- * `nodes1` and `nodes2` are sorted by document order, then
- * #xmlXPathTrailingSorted is called.
- *
- * @param nodes1  a node-set
- * @param nodes2  a node-set
- * @returns the nodes in `nodes1` that follow the first node in `nodes2`
- *         in document order, `nodes1` if `nodes2` is NULL or empty or
- *         an empty node-set if `nodes1` doesn't contain `nodes2`
- */
-xmlNodeSet *
-xmlXPathTrailing (xmlNodeSet *nodes1, xmlNodeSet *nodes2) {
-    if (xmlXPathNodeSetIsEmpty(nodes2))
-	return(nodes1);
-    if (xmlXPathNodeSetIsEmpty(nodes1))
-	return(xmlXPathNodeSetCreate(NULL));
-    xmlXPathNodeSetSort(nodes1);
-    xmlXPathNodeSetSort(nodes2);
-    return(xmlXPathNodeTrailingSorted(nodes1,
-				      xmlXPathNodeSetItem(nodes2, 0)));
+#if defined(WITH_TIM_SORT) && \
+    (defined(HAVE_POSIX_THREADS) || defined(HAVE_WIN32_THREADS))
+
+typedef struct {
+    xmlNodePtr *nodes;
+    size_t num;
+} xmlXPathSortChunk;
+
+#ifdef HAVE_POSIX_THREADS
+static void *
+xmlXPathSortChunkThread(void *arg) {
+    xmlXPathSortChunk *chunk = arg;
+
+    libxml_domnode_tim_sort(chunk->nodes, chunk->num);
+    return(NULL);
 }
+#else
+static DWORD WINAPI
+xmlXPathSortChunkThread(LPVOID arg) {
+    xmlXPathSortChunk *chunk = arg;
 
-/************************************************************************
- *									*
- *		Routines to handle extra functions			*
- *									*
- ************************************************************************/
+    libxml_domnode_tim_sort(chunk->nodes, chunk->num);
+    return(0);
+}
+#endif
 
 /**
- * Register a new function. If `f` is NULL it unregisters the function
- *
- * @param ctxt  the XPath context
- * @param name  the function name
- * @param f  the function implementation or NULL
- * @returns 0 in case of success, -1 in case of error
+ * @returns the number of threads to use for sorting `num` nodes.
  */
-int
-xmlXPathRegisterFunc(xmlXPathContext *ctxt, const xmlChar *name,
-		     xmlXPathFunction f) {
-    return(xmlXPathRegisterFuncNS(ctxt, name, NULL, f));
+static int
+xmlXPathSortThreadCount(int num) {
+    int ncpu = xmlGetThreadCount();
+    int ret;
+
+    if (ncpu > XP_PARALLEL_SORT_MAX_THREADS)
+        ncpu = XP_PARALLEL_SORT_MAX_THREADS;
+
+    /* Don't hand out tiny chunks */
+    ret = num / (XP_PARALLEL_SORT_MIN / 4);
+    if (ret > ncpu)
+        ret = ncpu;
+
+    return(ret);
 }
 
 /**
- * Register a new function. If `f` is NULL it unregisters the function
+ * Sort a large node set with several threads. The set is split into
+ * chunks which are sorted concurrently and then merged. Falls back to
+ * a single-threaded sort if threads or memory can't be allocated.
  *
- * @param ctxt  the XPath context
- * @param name  the function name
- * @param ns_uri  the function namespace URI
- * @param f  the function implementation or NULL
- * @returns 0 in case of success, -1 in case of error
+ * @param set  the node set
  */
-int
-xmlXPathRegisterFuncNS(xmlXPathContext *ctxt, const xmlChar *name,
-		       const xmlChar *ns_uri, xmlXPathFunction f) {
-    int ret;
-    void *payload;
+static void
+xmlXPathNodeSetSortParallel(xmlNodeSetPtr set) {
+    xmlXPathSortChunk chunks[XP_PARALLEL_SORT_MAX_THREADS];
+#ifdef HAVE_POSIX_THREADS
+    pthread_t threads[XP_PARALLEL_SORT_MAX_THREADS];
+#else
+    HANDLE threads[XP_PARALLEL_SORT_MAX_THREADS];
+#endif
+    int started[XP_PARALLEL_SORT_MAX_THREADS];
+    int bounds[XP_PARALLEL_SORT_MAX_THREADS + 1];
+    xmlNodePtr *src, *dst, *tmp;
+    int nchunks, i;
+
+    nchunks = xmlXPathSortThreadCount(set->nodeNr);
+    if (nchunks < 2) {
+        libxml_domnode_tim_sort(set->nodeTab, set->nodeNr);
+        return;
+    }
 
-    if (ctxt == NULL)
-	return(-1);
-    if (name == NULL)
-	return(-1);
+    tmp = xmlMalloc(set->nodeNr * sizeof(tmp[0]));
+    if (tmp == NULL) {
+        libxml_domnode_tim_sort(set->nodeTab, set->nodeNr);
+        return;
+    }
 
-    if (ctxt->funcHash == NULL)
-	ctxt->funcHash = xmlHashCreate(0);
-    if (ctxt->funcHash == NULL) {
-        xmlXPathErrMemory(ctxt);
-	return(-1);
+    for (i = 0; i <= nchunks; i++)
+        bounds[i] = (int) ((long long) set->nodeNr * i / nchunks);
+
+    for (i = 0; i < nchunks; i++) {
+        chunks[i].nodes = set->nodeTab + bounds[i];
+        chunks[i].num = bounds[i + 1] - bounds[i];
+        started[i] = 0;
     }
-    if (f == NULL)
-        return(xmlHashRemoveEntry2(ctxt->funcHash, name, ns_uri, NULL));
-    memcpy(&payload, &f, sizeof(f));
-    ret = xmlHashAddEntry2(ctxt->funcHash, name, ns_uri, payload);
-    if (ret < 0) {
-        xmlXPathErrMemory(ctxt);
-        return(-1);
+
+    /* The first chunk is sorted by the calling thread */
+    for (i = 1; i < nchunks; i++) {
+#ifdef HAVE_POSIX_THREADS
+        started[i] = (pthread_create(&threads[i], NULL,
+                                     xmlXPathSortChunkThread,
+                                     &chunks[i]) == 0);
+#else
+        threads[i] = CreateThread(NULL, 0, xmlXPathSortChunkThread,
+                                  &chunks[i], 0, NULL);
+        started[i] = (threads[i] != NULL);
+#endif
     }
 
-    return(0);
-}
+    for (i = 0; i < nchunks; i++) {
+        if (!started[i])
+            libxml_domnode_tim_sort(chunks[i].nodes, chunks[i].num);
+    }
 
-/**
- * Registers an external mechanism to do function lookup.
- *
- * @param ctxt  the XPath context
- * @param f  the lookup function
- * @param funcCtxt  the lookup data
- */
-void
-xmlXPathRegisterFuncLookup (xmlXPathContext *ctxt,
-			    xmlXPathFuncLookupFunc f,
-			    void *funcCtxt) {
-    if (ctxt == NULL)
-	return;
-    ctxt->funcLookupFunc = f;
-    ctxt->funcLookupData = funcCtxt;
+    for (i = 1; i < nchunks; i++) {
+        if (!started[i])
+            continue;
+#ifdef HAVE_POSIX_THREADS
+        pthread_join(threads[i], NULL);
+#else
+        WaitForSingleObject(threads[i], INFINITE);
+        CloseHandle(threads[i]);
+#endif
+    }
+
+    /* Merge adjacent runs until a single one is left */
+    src = set->nodeTab;
+    dst = tmp;
+    while (nchunks > 1) {
+        int n = 0;
+
+        for (i = 0; i < nchunks; i += 2) {
+            int start = bounds[i];
+
+            if (i + 1 < nchunks) {
+                xmlXPathMergeSortedNodes(dst + start,
+                        src + start, bounds[i + 1] - start,
+                        src + bounds[i + 1], bounds[i + 2] - bounds[i + 1]);
+            } else {
+                memcpy(dst + start, src + start,
+                       (bounds[i + 1] - start) * sizeof(dst[0]));
+            }
+            bounds[n++] = start;
+        }
+        bounds[n] = set->nodeNr;
+        nchunks = n;
+
+        tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+
+    if (src != set->nodeTab) {
+        memcpy(set->nodeTab, src, set->nodeNr * sizeof(src[0]));
+        xmlFree(src);
+    } else {
+        xmlFree(dst);
+    }
 }
 
+#endif /* WITH_TIM_SORT && threads */
+
 /**
- * Search in the Function array of the context for the given
- * function.
+ * Sort the node set in document order. Uses the document order index
+ * if possible or several threads for large sets if enabled in the
+ * context.
  *
  * @param ctxt  the XPath context
- * @param name  the function name
- * @returns the xmlXPathFunction or NULL if not found
+ * @param set  the node set
  */
-xmlXPathFunction
-xmlXPathFunctionLookup(xmlXPathContext *ctxt, const xmlChar *name) {
-    return(xmlXPathFunctionLookupNS(ctxt, name, NULL));
+static void
+xmlXPathNodeSetSortCtxt(xmlXPathContextPtr ctxt, xmlNodeSetPtr set) {
+    if ((set == NULL) || (set->nodeNr <= 1))
+        return;
+
+    if (xmlXPathNodeSetSortIndexed(set) == 0)
+        return;
+
+#if defined(WITH_TIM_SORT) && \
+    (defined(HAVE_POSIX_THREADS) || defined(HAVE_WIN32_THREADS))
+    if ((ctxt != NULL) &&
+        (ctxt->flags & XML_XPATH_PARALLEL_SORT) &&
+        (set->nodeNr >= XP_PARALLEL_SORT_MIN)) {
+        xmlXPathNodeSetSortParallel(set);
+        return;
+    }
+#else
+    (void) ctxt;
+#endif
+
+    xmlXPathNodeSetSortNoIndex(set);
 }
 
+#define XML_NODESET_DEFAULT	10
 /**
- * Search in the Function array of the context for the given
- * function.
+ * Namespace node in libxml don't match the XPath semantic. In a node set
+ * the namespace nodes are duplicated and the next pointer is set to the
+ * parent node in the XPath semantic.
  *
- * @param ctxt  the XPath context
- * @param name  the function name
- * @param ns_uri  the function namespace URI
- * @returns the xmlXPathFunction or NULL if not found
+ * @param node  the parent node of the namespace XPath node
+ * @param ns  the libxml namespace declaration node.
+ * @returns the newly created object.
  */
-xmlXPathFunction
-xmlXPathFunctionLookupNS(xmlXPathContext *ctxt, const xmlChar *name,
-			 const xmlChar *ns_uri) {
-    xmlXPathFunction ret;
-    void *payload;
+static xmlNodePtr
+xmlXPathNodeSetDupNs(xmlNodePtr node, xmlNsPtr ns) {
+    xmlNsPtr cur;
 
-    if (ctxt == NULL)
-	return(NULL);
-    if (name == NULL)
+    if ((ns == NULL) || (ns->type != XML_NAMESPACE_DECL))
 	return(NULL);
+    if ((node == NULL) || (node->type == XML_NAMESPACE_DECL))
+	return((xmlNodePtr) ns);
 
-    if (ns_uri == NULL) {
-        int bucketIndex = xmlXPathSFComputeHash(name) % SF_HASH_SIZE;
-
-        while (xmlXPathSFHash[bucketIndex] != UCHAR_MAX) {
-            int funcIndex = xmlXPathSFHash[bucketIndex];
-
-            if (strcmp(xmlXPathStandardFunctions[funcIndex].name,
-                       (char *) name) == 0)
-                return(xmlXPathStandardFunctions[funcIndex].func);
-
-            bucketIndex += 1;
-            if (bucketIndex >= SF_HASH_SIZE)
-                bucketIndex = 0;
+    /*
+     * Allocate a new Namespace and fill the fields.
+     */
+    cur = (xmlNsPtr) xmlMalloc(sizeof(xmlNs));
+    if (cur == NULL)
+	return(NULL);
+    memset(cur, 0, sizeof(xmlNs));
+    cur->type = XML_NAMESPACE_DECL;
+    if (ns->href != NULL) {
+	cur->href = xmlStrdup(ns->href);
+        if (cur->href == NULL) {
+            xmlFree(cur);
+            return(NULL);
         }
     }
-
-    if (ctxt->funcLookupFunc != NULL) {
-	xmlXPathFuncLookupFunc f;
-
-	f = ctxt->funcLookupFunc;
-	ret = f(ctxt->funcLookupData, name, ns_uri);
-	if (ret != NULL)
-	    return(ret);
+    if (ns->prefix != NULL) {
+	cur->prefix = xmlStrdup(ns->prefix);
+        if (cur->prefix == NULL) {
+            xmlFree((xmlChar *) cur->href);
+            xmlFree(cur);
+            return(NULL);
+        }
     }
-
-    if (ctxt->funcHash == NULL)
-	return(NULL);
-
-    payload = xmlHashLookup2(ctxt->funcHash, name, ns_uri);
-    memcpy(&ret, &payload, sizeof(payload));
-
-    return(ret);
+    cur->next = (xmlNsPtr) node;
+    return((xmlNodePtr) cur);
 }
 
 /**
- * Cleanup the XPath context data associated to registered functions
+ * Namespace nodes in libxml don't match the XPath semantic. In a node set
+ * the namespace nodes are duplicated and the next pointer is set to the
+ * parent node in the XPath semantic. Check if such a node needs to be freed
  *
- * @param ctxt  the XPath context
+ * @param ns  the XPath namespace node found in a nodeset.
  */
 void
-xmlXPathRegisteredFuncsCleanup(xmlXPathContext *ctxt) {
-    if (ctxt == NULL)
+xmlXPathNodeSetFreeNs(xmlNs *ns) {
+    if ((ns == NULL) || (ns->type != XML_NAMESPACE_DECL))
 	return;
 
-    xmlHashFree(ctxt->funcHash, NULL);
-    ctxt->funcHash = NULL;
+    if ((ns->next != NULL) && (ns->next->type != XML_NAMESPACE_DECL)) {
+	if (ns->href != NULL)
+	    xmlFree((xmlChar *)ns->href);
+	if (ns->prefix != NULL)
+	    xmlFree((xmlChar *)ns->prefix);
+	xmlFree(ns);
+    }
 }
 
-/************************************************************************
- *									*
- *			Routines to handle Variables			*
- *									*
- ************************************************************************/
-
 /**
- * Register a new variable value. If `value` is NULL it unregisters
- * the variable
+ * Create a new xmlNodeSet of type double and of value `val`
  *
- * @param ctxt  the XPath context
- * @param name  the variable name
- * @param value  the variable value or NULL
- * @returns 0 in case of success, -1 in case of error
+ * @param val  an initial xmlNode, or NULL
+ * @returns the newly created object.
  */
-int
-xmlXPathRegisterVariable(xmlXPathContext *ctxt, const xmlChar *name,
-			 xmlXPathObject *value) {
-    return(xmlXPathRegisterVariableNS(ctxt, name, NULL, value));
+xmlNodeSet *
+xmlXPathNodeSetCreate(xmlNode *val) {
+    xmlNodeSetPtr ret;
+
+    ret = (xmlNodeSetPtr) xmlMalloc(sizeof(xmlNodeSet));
+    if (ret == NULL)
+	return(NULL);
+    memset(ret, 0 , sizeof(xmlNodeSet));
+    if (val != NULL) {
+        ret->nodeTab = (xmlNodePtr *) xmlMalloc(XML_NODESET_DEFAULT *
+					     sizeof(xmlNodePtr));
+	if (ret->nodeTab == NULL) {
+	    xmlFree(ret);
+	    return(NULL);
+	}
+	memset(ret->nodeTab, 0 ,
+	       XML_NODESET_DEFAULT * sizeof(xmlNodePtr));
+        ret->nodeMax = XML_NODESET_DEFAULT;
+	if (val->type == XML_NAMESPACE_DECL) {
+	    xmlNsPtr ns = (xmlNsPtr) val;
+            xmlNodePtr nsNode = xmlXPathNodeSetDupNs((xmlNodePtr) ns->next, ns);
+
+            if (nsNode == NULL) {
+                xmlXPathFreeNodeSet(ret);
+                return(NULL);
+            }
+	    ret->nodeTab[ret->nodeNr++] = nsNode;
+	} else
+	    ret->nodeTab[ret->nodeNr++] = val;
+    }
+    return(ret);
 }
 
 /**
- * Register a new variable value. If `value` is NULL it unregisters
- * the variable
+ * checks whether `cur` contains `val`
  *
- * @param ctxt  the XPath context
- * @param name  the variable name
- * @param ns_uri  the variable namespace URI
- * @param value  the variable value or NULL
- * @returns 0 in case of success, -1 in case of error
+ * @param cur  the node-set
+ * @param val  the node
+ * @returns true (1) if `cur` contains `val`, false (0) otherwise
  */
 int
-xmlXPathRegisterVariableNS(xmlXPathContext *ctxt, const xmlChar *name,
-			   const xmlChar *ns_uri,
-			   xmlXPathObject *value) {
-    if (ctxt == NULL)
-	return(-1);
-    if (name == NULL)
-	return(-1);
+xmlXPathNodeSetContains (xmlNodeSet *cur, xmlNode *val) {
+    int i;
 
-    if (ctxt->varHash == NULL)
-	ctxt->varHash = xmlHashCreate(0);
-    if (ctxt->varHash == NULL)
-	return(-1);
-    if (value == NULL)
-        return(xmlHashRemoveEntry2(ctxt->varHash, name, ns_uri,
-	                           xmlXPathFreeObjectEntry));
-    return(xmlHashUpdateEntry2(ctxt->varHash, name, ns_uri,
-			       (void *) value, xmlXPathFreeObjectEntry));
-}
+    if ((cur == NULL) || (val == NULL)) return(0);
+    if (val->type == XML_NAMESPACE_DECL) {
+	for (i = 0; i < cur->nodeNr; i++) {
+	    if (cur->nodeTab[i]->type == XML_NAMESPACE_DECL) {
+		xmlNsPtr ns1, ns2;
 
-/**
- * register an external mechanism to do variable lookup
- *
- * @param ctxt  the XPath context
- * @param f  the lookup function
- * @param data  the lookup data
- */
-void
-xmlXPathRegisterVariableLookup(xmlXPathContext *ctxt,
-	 xmlXPathVariableLookupFunc f, void *data) {
-    if (ctxt == NULL)
-	return;
-    ctxt->varLookupFunc = f;
-    ctxt->varLookupData = data;
+		ns1 = (xmlNsPtr) val;
+		ns2 = (xmlNsPtr) cur->nodeTab[i];
+		if (ns1 == ns2)
+		    return(1);
+		if ((ns1->next != NULL) && (ns2->next == ns1->next) &&
+	            (xmlStrEqual(ns1->prefix, ns2->prefix)))
+		    return(1);
+	    }
+	}
+    } else {
+	for (i = 0; i < cur->nodeNr; i++) {
+	    if (cur->nodeTab[i] == val)
+		return(1);
+	}
+    }
+    return(0);
 }
 
-/**
- * Search in the Variable array of the context for the given
- * variable value.
- *
- * @param ctxt  the XPath context
- * @param name  the variable name
- * @returns a copy of the value or NULL if not found
- */
-xmlXPathObject *
-xmlXPathVariableLookup(xmlXPathContext *ctxt, const xmlChar *name) {
-    if (ctxt == NULL)
-	return(NULL);
+static int
+xmlXPathNodeSetGrow(xmlNodeSetPtr cur) {
+    xmlNodePtr *temp;
+    int newSize;
 
-    if (ctxt->varLookupFunc != NULL) {
-	xmlXPathObjectPtr ret;
+    newSize = xmlGrowCapacity(cur->nodeMax, sizeof(temp[0]),
+                              XML_NODESET_DEFAULT, XPATH_MAX_NODESET_LENGTH);
+    if (newSize < 0)
+        return(-1);
+    temp = xmlRealloc(cur->nodeTab, newSize * sizeof(temp[0]));
+    if (temp == NULL)
+        return(-1);
+    cur->nodeMax = newSize;
+    cur->nodeTab = temp;
 
-	ret = ((xmlXPathVariableLookupFunc)ctxt->varLookupFunc)
-	        (ctxt->varLookupData, name, NULL);
-	return(ret);
-    }
-    return(xmlXPathVariableLookupNS(ctxt, name, NULL));
+    return(0);
 }
 
 /**
- * Search in the Variable array of the context for the given
- * variable value.
+ * add a new namespace node to an existing NodeSet
  *
- * @param ctxt  the XPath context
- * @param name  the variable name
- * @param ns_uri  the variable namespace URI
- * @returns the a copy of the value or NULL if not found
+ * @param cur  the initial node set
+ * @param node  the hosting node
+ * @param ns  a the namespace node
+ * @returns 0 in case of success and -1 in case of error
  */
-xmlXPathObject *
-xmlXPathVariableLookupNS(xmlXPathContext *ctxt, const xmlChar *name,
-			 const xmlChar *ns_uri) {
-    if (ctxt == NULL)
-	return(NULL);
+int
+xmlXPathNodeSetAddNs(xmlNodeSet *cur, xmlNode *node, xmlNs *ns) {
+    int i;
+    xmlNodePtr nsNode;
 
-    if (ctxt->varLookupFunc != NULL) {
-	xmlXPathObjectPtr ret;
+    if ((cur == NULL) || (ns == NULL) || (node == NULL) ||
+        (ns->type != XML_NAMESPACE_DECL) ||
+	(node->type != XML_ELEMENT_NODE))
+	return(-1);
 
-	ret = ((xmlXPathVariableLookupFunc)ctxt->varLookupFunc)
-	        (ctxt->varLookupData, name, ns_uri);
-	if (ret != NULL) return(ret);
+    /* @@ with_ns to check whether namespace nodes should be looked at @@ */
+    /*
+     * prevent duplicates
+     */
+    for (i = 0;i < cur->nodeNr;i++) {
+        if ((cur->nodeTab[i] != NULL) &&
+	    (cur->nodeTab[i]->type == XML_NAMESPACE_DECL) &&
+	    (((xmlNsPtr)cur->nodeTab[i])->next == (xmlNsPtr) node) &&
+	    (xmlStrEqual(ns->prefix, ((xmlNsPtr)cur->nodeTab[i])->prefix)))
+	    return(0);
     }
 
-    if (ctxt->varHash == NULL)
-	return(NULL);
-    if (name == NULL)
-	return(NULL);
-
-    return(xmlXPathObjectCopy(xmlHashLookup2(ctxt->varHash, name, ns_uri)));
-}
-
-/**
- * Cleanup the XPath context data associated to registered variables
- *
- * @param ctxt  the XPath context
- */
-void
-xmlXPathRegisteredVariablesCleanup(xmlXPathContext *ctxt) {
-    if (ctxt == NULL)
-	return;
-
-    xmlHashFree(ctxt->varHash, xmlXPathFreeObjectEntry);
-    ctxt->varHash = NULL;
+    /*
+     * grow the nodeTab if needed
+     */
+    if (cur->nodeNr >= cur->nodeMax) {
+        if (xmlXPathNodeSetGrow(cur) < 0)
+            return(-1);
+    }
+    nsNode = xmlXPathNodeSetDupNs(node, ns);
+    if(nsNode == NULL)
+        return(-1);
+    cur->nodeTab[cur->nodeNr++] = nsNode;
+    return(0);
 }
 
 /**
- * Register a new namespace. If `ns_uri` is NULL it unregisters
- * the namespace
+ * add a new xmlNode to an existing NodeSet
  *
- * @param ctxt  the XPath context
- * @param prefix  the namespace prefix cannot be NULL or empty string
- * @param ns_uri  the namespace name
- * @returns 0 in case of success, -1 in case of error
+ * @param cur  the initial node set
+ * @param val  a new xmlNode
+ * @returns 0 in case of success, and -1 in case of error
  */
 int
-xmlXPathRegisterNs(xmlXPathContext *ctxt, const xmlChar *prefix,
-			   const xmlChar *ns_uri) {
-    xmlChar *copy;
+xmlXPathNodeSetAdd(xmlNodeSet *cur, xmlNode *val) {
+    int i;
 
-    if (ctxt == NULL)
-	return(-1);
-    if (prefix == NULL)
-	return(-1);
-    if (prefix[0] == 0)
-	return(-1);
+    if ((cur == NULL) || (val == NULL)) return(-1);
 
-    if (ctxt->nsHash == NULL)
-	ctxt->nsHash = xmlHashCreate(10);
-    if (ctxt->nsHash == NULL) {
-        xmlXPathErrMemory(ctxt);
-	return(-1);
-    }
-    if (ns_uri == NULL)
-        return(xmlHashRemoveEntry(ctxt->nsHash, prefix,
-	                          xmlHashDefaultDeallocator));
+    /* @@ with_ns to check whether namespace nodes should be looked at @@ */
+    /*
+     * prevent duplicates
+     */
+    for (i = 0;i < cur->nodeNr;i++)
+        if (cur->nodeTab[i] == val) return(0);
 
-    copy = xmlStrdup(ns_uri);
-    if (copy == NULL) {
-        xmlXPathErrMemory(ctxt);
-        return(-1);
-    }
-    if (xmlHashUpdateEntry(ctxt->nsHash, prefix, copy,
-                           xmlHashDefaultDeallocator) < 0) {
-        xmlXPathErrMemory(ctxt);
-        xmlFree(copy);
-        return(-1);
+    /*
+     * grow the nodeTab if needed
+     */
+    if (cur->nodeNr >= cur->nodeMax) {
+        if (xmlXPathNodeSetGrow(cur) < 0)
+            return(-1);
     }
 
+    if (val->type == XML_NAMESPACE_DECL) {
+	xmlNsPtr ns = (xmlNsPtr) val;
+        xmlNodePtr nsNode = xmlXPathNodeSetDupNs((xmlNodePtr) ns->next, ns);
+
+        if (nsNode == NULL)
+            return(-1);
+	cur->nodeTab[cur->nodeNr++] = nsNode;
+    } else
+	cur->nodeTab[cur->nodeNr++] = val;
     return(0);
 }
 
 /**
- * Search in the namespace declaration array of the context for the given
- * namespace name associated to the given prefix
+ * add a new xmlNode to an existing NodeSet, optimized version
+ * when we are sure the node is not already in the set.
  *
- * @param ctxt  the XPath context
- * @param prefix  the namespace prefix value
- * @returns the value or NULL if not found
+ * @param cur  the initial node set
+ * @param val  a new xmlNode
+ * @returns 0 in case of success and -1 in case of failure
  */
-const xmlChar *
-xmlXPathNsLookup(xmlXPathContext *ctxt, const xmlChar *prefix) {
-    if (ctxt == NULL)
-	return(NULL);
-    if (prefix == NULL)
-	return(NULL);
-
-    if (xmlStrEqual(prefix, (const xmlChar *) "xml"))
-	return(XML_XML_NAMESPACE);
-
-    if (ctxt->namespaces != NULL) {
-	int i;
+int
+xmlXPathNodeSetAddUnique(xmlNodeSet *cur, xmlNode *val) {
+    if ((cur == NULL) || (val == NULL)) return(-1);
 
-	for (i = 0;i < ctxt->nsNr;i++) {
-	    if ((ctxt->namespaces[i] != NULL) &&
-		(xmlStrEqual(ctxt->namespaces[i]->prefix, prefix)))
-		return(ctxt->namespaces[i]->href);
-	}
+    /* @@ with_ns to check whether namespace nodes should be looked at @@ */
+    /*
+     * grow the nodeTab if needed
+     */
+    if (cur->nodeNr >= cur->nodeMax) {
+        if (xmlXPathNodeSetGrow(cur) < 0)
+            return(-1);
     }
 
-    return((const xmlChar *) xmlHashLookup(ctxt->nsHash, prefix));
+    if (val->type == XML_NAMESPACE_DECL) {
+	xmlNsPtr ns = (xmlNsPtr) val;
+        xmlNodePtr nsNode = xmlXPathNodeSetDupNs((xmlNodePtr) ns->next, ns);
+
+        if (nsNode == NULL)
+            return(-1);
+	cur->nodeTab[cur->nodeNr++] = nsNode;
+    } else
+	cur->nodeTab[cur->nodeNr++] = val;
+    return(0);
 }
 
 /**
- * Cleanup the XPath context data associated to registered variables
+ * Merges two nodesets, all nodes from `val2` are added to `val1`
+ * if `val1` is NULL, a new set is created and copied from `val2`
  *
- * @param ctxt  the XPath context
+ * Frees `val1` in case of error.
+ *
+ * @param val1  the first NodeSet or NULL
+ * @param val2  the second NodeSet
+ * @returns `val1` once extended or NULL in case of error.
  */
-void
-xmlXPathRegisteredNsCleanup(xmlXPathContext *ctxt) {
-    if (ctxt == NULL)
-	return;
+xmlNodeSet *
+xmlXPathNodeSetMerge(xmlNodeSet *val1, xmlNodeSet *val2) {
+    int i, j, initNr, skip;
+    xmlNodePtr n1, n2;
 
-    xmlHashFree(ctxt->nsHash, xmlHashDefaultDeallocator);
-    ctxt->nsHash = NULL;
-}
+    if (val1 == NULL) {
+	val1 = xmlXPathNodeSetCreate(NULL);
+        if (val1 == NULL)
+            return (NULL);
+    }
+    if (val2 == NULL)
+        return(val1);
 
-/************************************************************************
- *									*
- *			Routines to handle Values			*
- *									*
- ************************************************************************/
+    /* @@ with_ns to check whether namespace nodes should be looked at @@ */
+    initNr = val1->nodeNr;
 
-/* Allocations are terrible, one needs to optimize all this !!! */
+    for (i = 0;i < val2->nodeNr;i++) {
+	n2 = val2->nodeTab[i];
+	/*
+	 * check against duplicates
+	 */
+	skip = 0;
+	for (j = 0; j < initNr; j++) {
+	    n1 = val1->nodeTab[j];
+	    if (n1 == n2) {
+		skip = 1;
+		break;
+	    } else if ((n1->type == XML_NAMESPACE_DECL) &&
+		       (n2->type == XML_NAMESPACE_DECL)) {
+		if ((((xmlNsPtr) n1)->next == ((xmlNsPtr) n2)->next) &&
+		    (xmlStrEqual(((xmlNsPtr) n1)->prefix,
+			((xmlNsPtr) n2)->prefix)))
+		{
+		    skip = 1;
+		    break;
+		}
+	    }
+	}
+	if (skip)
+	    continue;
 
-/**
- * Create a new xmlXPathObject of type double and of value `val`
- *
- * @param val  the double value
- * @returns the newly created object.
- */
-xmlXPathObject *
-xmlXPathNewFloat(double val) {
-    xmlXPathObjectPtr ret;
+	/*
+	 * grow the nodeTab if needed
+	 */
+        if (val1->nodeNr >= val1->nodeMax) {
+            if (xmlXPathNodeSetGrow(val1) < 0)
+                goto error;
+        }
+	if (n2->type == XML_NAMESPACE_DECL) {
+	    xmlNsPtr ns = (xmlNsPtr) n2;
+            xmlNodePtr nsNode = xmlXPathNodeSetDupNs((xmlNodePtr) ns->next, ns);
 
-    ret = (xmlXPathObjectPtr) xmlMalloc(sizeof(xmlXPathObject));
-    if (ret == NULL)
-	return(NULL);
-    memset(ret, 0 , sizeof(xmlXPathObject));
-    ret->type = XPATH_NUMBER;
-    ret->floatval = val;
-    return(ret);
+            if (nsNode == NULL)
+                goto error;
+	    val1->nodeTab[val1->nodeNr++] = nsNode;
+	} else
+	    val1->nodeTab[val1->nodeNr++] = n2;
+    }
+
+    return(val1);
+
+error:
+    xmlXPathFreeNodeSet(val1);
+    return(NULL);
 }
 
 /**
- * Create a new xmlXPathObject of type boolean and of value `val`
+ * Check whether a node set contains namespace nodes.
  *
- * @param val  the boolean value
- * @returns the newly created object.
+ * @param set  the node set
+ * @returns 1 if the set contains namespace nodes, 0 otherwise.
  */
-xmlXPathObject *
-xmlXPathNewBoolean(int val) {
-    xmlXPathObjectPtr ret;
+static int
+xmlXPathNodeSetHasNs(xmlNodeSetPtr set) {
+    int i;
 
-    ret = (xmlXPathObjectPtr) xmlMalloc(sizeof(xmlXPathObject));
-    if (ret == NULL)
-	return(NULL);
-    memset(ret, 0 , sizeof(xmlXPathObject));
-    ret->type = XPATH_BOOLEAN;
-    ret->boolval = (val != 0);
-    return(ret);
+    for (i = 0; i < set->nodeNr; i++) {
+        if (set->nodeTab[i]->type == XML_NAMESPACE_DECL)
+            return(1);
+    }
+    return(0);
 }
 
 /**
- * Create a new xmlXPathObject of type string and of value `val`
+ * Merges two nodesets without namespace nodes in linear time. Both
+ * sets are sorted in document order first which is cheap if they're
+ * already sorted. The result in `set1` is sorted as well.
  *
- * @param val  the xmlChar * value
- * @returns the newly created object.
+ * Frees `set1` in case of error.
+ *
+ * @param ctxt  the XPath context
+ * @param set1  the first NodeSet
+ * @param set2  the second NodeSet
+ * @returns `set1` once extended or NULL in case of error.
  */
-xmlXPathObject *
-xmlXPathNewString(const xmlChar *val) {
-    xmlXPathObjectPtr ret;
+static xmlNodeSetPtr
+xmlXPathNodeSetMergeSorted(xmlXPathContextPtr ctxt, xmlNodeSetPtr set1,
+                           xmlNodeSetPtr set2) {
+    xmlNodePtr *nodeTab;
+    int total;
 
-    ret = (xmlXPathObjectPtr) xmlMalloc(sizeof(xmlXPathObject));
-    if (ret == NULL)
-	return(NULL);
-    memset(ret, 0 , sizeof(xmlXPathObject));
-    ret->type = XPATH_STRING;
-    if (val == NULL)
-        val = BAD_CAST "";
-    ret->stringval = xmlStrdup(val);
-    if (ret->stringval == NULL) {
-        xmlFree(ret);
-        return(NULL);
-    }
-    return(ret);
+    if (set1->nodeNr > XPATH_MAX_NODESET_LENGTH - set2->nodeNr)
+        goto error;
+    total = set1->nodeNr + set2->nodeNr;
+
+    nodeTab = xmlMalloc(total * sizeof(nodeTab[0]));
+    if (nodeTab == NULL)
+        goto error;
+
+    xmlXPathNodeSetSortCtxt(ctxt, set1);
+    xmlXPathNodeSetSortCtxt(ctxt, set2);
+    set1->nodeNr = xmlXPathMergeSortedNodes(nodeTab,
+            set1->nodeTab, set1->nodeNr, set2->nodeTab, set2->nodeNr);
+
+    xmlFree(set1->nodeTab);
+    set1->nodeTab = nodeTab;
+    set1->nodeMax = total;
+
+    return(set1);
+
+error:
+    xmlXPathFreeNodeSet(set1);
+    return(NULL);
 }
 
+
 /**
- * Wraps the `val` string into an XPath object.
+ * Merges two nodesets, all nodes from `set2` are added to `set1`.
+ * Checks for duplicate nodes. Clears set2.
  *
- * Frees `val` in case of error.
+ * Frees `set1` in case of error.
  *
- * @param val  the xmlChar * value
- * @returns the newly created object.
+ * @param set1  the first NodeSet or NULL
+ * @param set2  the second NodeSet
+ * @returns `set1` once extended or NULL in case of error.
  */
-xmlXPathObject *
-xmlXPathWrapString (xmlChar *val) {
-    xmlXPathObjectPtr ret;
+static xmlNodeSetPtr
+xmlXPathNodeSetMergeAndClear(xmlNodeSetPtr set1, xmlNodeSetPtr set2)
+{
+    {
+	int i, j, initNbSet1;
+	xmlNodePtr n1, n2;
 
-    ret = (xmlXPathObjectPtr) xmlMalloc(sizeof(xmlXPathObject));
-    if (ret == NULL) {
-        xmlFree(val);
-	return(NULL);
+	initNbSet1 = set1->nodeNr;
+	for (i = 0;i < set2->nodeNr;i++) {
+	    n2 = set2->nodeTab[i];
+	    /*
+	    * Skip duplicates.
+	    */
+	    for (j = 0; j < initNbSet1; j++) {
+		n1 = set1->nodeTab[j];
+		if (n1 == n2) {
+		    goto skip_node;
+		} else if ((n1->type == XML_NAMESPACE_DECL) &&
+		    (n2->type == XML_NAMESPACE_DECL))
+		{
+		    if ((((xmlNsPtr) n1)->next == ((xmlNsPtr) n2)->next) &&
+			(xmlStrEqual(((xmlNsPtr) n1)->prefix,
+			((xmlNsPtr) n2)->prefix)))
+		    {
+			/*
+			* Free the namespace node.
+			*/
+			xmlXPathNodeSetFreeNs((xmlNsPtr) n2);
+			goto skip_node;
+		    }
+		}
+	    }
+	    /*
+	    * grow the nodeTab if needed
+	    */
+            if (set1->nodeNr >= set1->nodeMax) {
+                if (xmlXPathNodeSetGrow(set1) < 0)
+                    goto error;
+            }
+	    set1->nodeTab[set1->nodeNr++] = n2;
+skip_node:
+            set2->nodeTab[i] = NULL;
+	}
     }
-    memset(ret, 0 , sizeof(xmlXPathObject));
-    ret->type = XPATH_STRING;
-    ret->stringval = val;
-    return(ret);
+    set2->nodeNr = 0;
+    return(set1);
+
+error:
+    xmlXPathFreeNodeSet(set1);
+    xmlXPathNodeSetClear(set2, 1);
+    return(NULL);
 }
 
 /**
- * Create a new xmlXPathObject of type string and of value `val`
+ * Merges two nodesets, all nodes from `set2` are added to `set1`.
+ * Doesn't check for duplicate nodes. Clears set2.
  *
- * @param val  the char * value
- * @returns the newly created object.
+ * Frees `set1` in case of error.
+ *
+ * @param set1  the first NodeSet or NULL
+ * @param set2  the second NodeSet
+ * @returns `set1` once extended or NULL in case of error.
  */
-xmlXPathObject *
-xmlXPathNewCString(const char *val) {
-    return(xmlXPathNewString(BAD_CAST val));
+static xmlNodeSetPtr
+xmlXPathNodeSetMergeAndClearNoDupls(xmlNodeSetPtr set1, xmlNodeSetPtr set2)
+{
+    {
+	int i;
+	xmlNodePtr n2;
+
+	for (i = 0;i < set2->nodeNr;i++) {
+	    n2 = set2->nodeTab[i];
+            if (set1->nodeNr >= set1->nodeMax) {
+                if (xmlXPathNodeSetGrow(set1) < 0)
+                    goto error;
+            }
+	    set1->nodeTab[set1->nodeNr++] = n2;
+            set2->nodeTab[i] = NULL;
+	}
+    }
+    set2->nodeNr = 0;
+    return(set1);
+
+error:
+    xmlXPathFreeNodeSet(set1);
+    xmlXPathNodeSetClear(set2, 1);
+    return(NULL);
 }
 
 /**
- * Wraps a string into an XPath object.
+ * Removes an xmlNode from an existing NodeSet
  *
- * @param val  the char * value
- * @returns the newly created object.
+ * @param cur  the initial node set
+ * @param val  an xmlNode
  */
-xmlXPathObject *
-xmlXPathWrapCString (char * val) {
-    return(xmlXPathWrapString((xmlChar *)(val)));
+void
+xmlXPathNodeSetDel(xmlNodeSet *cur, xmlNode *val) {
+    int i;
+
+    if (cur == NULL) return;
+    if (val == NULL) return;
+
+    /*
+     * find node in nodeTab
+     */
+    for (i = 0;i < cur->nodeNr;i++)
+        if (cur->nodeTab[i] == val) break;
+
+    if (i >= cur->nodeNr) {	/* not found */
+        return;
+    }
+    if ((cur->nodeTab[i] != NULL) &&
+	(cur->nodeTab[i]->type == XML_NAMESPACE_DECL))
+	xmlXPathNodeSetFreeNs((xmlNsPtr) cur->nodeTab[i]);
+    cur->nodeNr--;
+    for (;i < cur->nodeNr;i++)
+        cur->nodeTab[i] = cur->nodeTab[i + 1];
+    cur->nodeTab[cur->nodeNr] = NULL;
 }
 
 /**
- * Wraps the `val` data into an XPath object.
+ * Removes an entry from an existing NodeSet list.
  *
- * @param val  the user data
+ * @param cur  the initial node set
+ * @param val  the index to remove
+ */
+void
+xmlXPathNodeSetRemove(xmlNodeSet *cur, int val) {
+    if (cur == NULL) return;
+    if (val >= cur->nodeNr) return;
+    if ((cur->nodeTab[val] != NULL) &&
+	(cur->nodeTab[val]->type == XML_NAMESPACE_DECL))
+	xmlXPathNodeSetFreeNs((xmlNsPtr) cur->nodeTab[val]);
+    cur->nodeNr--;
+    for (;val < cur->nodeNr;val++)
+        cur->nodeTab[val] = cur->nodeTab[val + 1];
+    cur->nodeTab[cur->nodeNr] = NULL;
+}
+
+/**
+ * Free the NodeSet compound (not the actual nodes !).
+ *
+ * @param obj  the xmlNodeSet to free
+ */
+void
+xmlXPathFreeNodeSet(xmlNodeSet *obj) {
+    if (obj == NULL) return;
+    if (obj->nodeTab != NULL) {
+	int i;
+
+	/* @@ with_ns to check whether namespace nodes should be looked at @@ */
+	for (i = 0;i < obj->nodeNr;i++)
+	    if ((obj->nodeTab[i] != NULL) &&
+		(obj->nodeTab[i]->type == XML_NAMESPACE_DECL))
+		xmlXPathNodeSetFreeNs((xmlNsPtr) obj->nodeTab[i]);
+	xmlFree(obj->nodeTab);
+    }
+    xmlFree(obj);
+}
+
+/**
+ * Clears the list from temporary XPath objects (e.g. namespace nodes
+ * are feed) starting with the entry at `pos`, but does *not* free the list
+ * itself. Sets the length of the list to `pos`.
+ *
+ * @param set  the node set to be cleared
+ * @param pos  the start position to clear from
+ * @param hasNsNodes  the node set might contain namespace nodes
+ */
+static void
+xmlXPathNodeSetClearFromPos(xmlNodeSetPtr set, int pos, int hasNsNodes)
+{
+    if ((set == NULL) || (pos >= set->nodeNr))
+	return;
+    else if ((hasNsNodes)) {
+	int i;
+	xmlNodePtr node;
+
+	for (i = pos; i < set->nodeNr; i++) {
+	    node = set->nodeTab[i];
+	    if ((node != NULL) &&
+		(node->type == XML_NAMESPACE_DECL))
+		xmlXPathNodeSetFreeNs((xmlNsPtr) node);
+	}
+    }
+    set->nodeNr = pos;
+}
+
+/**
+ * Clears the list from all temporary XPath objects (e.g. namespace nodes
+ * are feed), but does *not* free the list itself. Sets the length of the
+ * list to 0.
+ *
+ * @param set  the node set to clear
+ * @param hasNsNodes  the node set might contain namespace nodes
+ */
+static void
+xmlXPathNodeSetClear(xmlNodeSetPtr set, int hasNsNodes)
+{
+    xmlXPathNodeSetClearFromPos(set, 0, hasNsNodes);
+}
+
+/**
+ * Move the last node to the first position and clear temporary XPath objects
+ * (e.g. namespace nodes) from all other nodes. Sets the length of the list
+ * to 1.
+ *
+ * @param set  the node set to be cleared
+ */
+static void
+xmlXPathNodeSetKeepLast(xmlNodeSetPtr set)
+{
+    int i;
+    xmlNodePtr node;
+
+    if ((set == NULL) || (set->nodeNr <= 1))
+	return;
+    for (i = 0; i < set->nodeNr - 1; i++) {
+        node = set->nodeTab[i];
+        if ((node != NULL) &&
+            (node->type == XML_NAMESPACE_DECL))
+            xmlXPathNodeSetFreeNs((xmlNsPtr) node);
+    }
+    set->nodeTab[0] = set->nodeTab[set->nodeNr-1];
+    set->nodeNr = 1;
+}
+
+/**
+ * Create a new xmlXPathObject of type NodeSet and initialize
+ * it with the single Node `val`
+ *
+ * @param val  the NodePtr value
  * @returns the newly created object.
  */
 xmlXPathObject *
-xmlXPathWrapExternal (void *val) {
+xmlXPathNewNodeSet(xmlNode *val) {
     xmlXPathObjectPtr ret;
 
     ret = (xmlXPathObjectPtr) xmlMalloc(sizeof(xmlXPathObject));
     if (ret == NULL)
 	return(NULL);
     memset(ret, 0 , sizeof(xmlXPathObject));
-    ret->type = XPATH_USERS;
-    ret->user = val;
+    ret->type = XPATH_NODESET;
+    ret->boolval = 0;
+    ret->nodesetval = xmlXPathNodeSetCreate(val);
+    if (ret->nodesetval == NULL) {
+        xmlFree(ret);
+        return(NULL);
+    }
+    /* @@ with_ns to check whether namespace nodes should be looked at @@ */
     return(ret);
 }
 
 /**
- * allocate a new copy of a given object
+ * Create a new xmlXPathObject of type Value Tree (XSLT) and initialize
+ * it with the tree root `val`
  *
- * @param val  the original object
+ * @param val  the NodePtr value
  * @returns the newly created object.
  */
 xmlXPathObject *
-xmlXPathObjectCopy(xmlXPathObject *val) {
+xmlXPathNewValueTree(xmlNode *val) {
     xmlXPathObjectPtr ret;
 
-    if (val == NULL)
-	return(NULL);
-
-    ret = (xmlXPathObjectPtr) xmlMalloc(sizeof(xmlXPathObject));
+    ret = xmlXPathNewNodeSet(val);
     if (ret == NULL)
 	return(NULL);
-    memcpy(ret, val , sizeof(xmlXPathObject));
-    switch (val->type) {
-	case XPATH_BOOLEAN:
-	case XPATH_NUMBER:
-	    break;
-	case XPATH_STRING:
-	    ret->stringval = xmlStrdup(val->stringval);
-            if (ret->stringval == NULL) {
-                xmlFree(ret);
-                return(NULL);
-            }
-	    break;
-	case XPATH_XSLT_TREE:
-	case XPATH_NODESET:
-	    ret->nodesetval = xmlXPathNodeSetMerge(NULL, val->nodesetval);
+    ret->type = XPATH_XSLT_TREE;
+
+    return(ret);
+}
+
+/**
+ * Create a new xmlXPathObject of type NodeSet and initialize
+ * it with the Nodeset `val`
+ *
+ * @param val  an existing NodeSet
+ * @returns the newly created object.
+ */
+xmlXPathObject *
+xmlXPathNewNodeSetList(xmlNodeSet *val)
+{
+    xmlXPathObjectPtr ret;
+
+    if (val == NULL)
+        ret = NULL;
+    else if (val->nodeTab == NULL)
+        ret = xmlXPathNewNodeSet(NULL);
+    else {
+        ret = xmlXPathNewNodeSet(val->nodeTab[0]);
+        if (ret) {
+            ret->nodesetval = xmlXPathNodeSetMerge(NULL, val);
             if (ret->nodesetval == NULL) {
                 xmlFree(ret);
                 return(NULL);
             }
-	    /* Do not deallocate the copied tree value */
-	    ret->boolval = 0;
-	    break;
-        case XPATH_USERS:
-	    ret->user = val->user;
-	    break;
-        default:
-            xmlFree(ret);
-            ret = NULL;
-	    break;
+        }
+    }
+
+    return (ret);
+}
+
+/**
+ * Wrap the Nodeset `val` in a new xmlXPathObject
+ *
+ * In case of error the node set is destroyed and NULL is returned.
+ *
+ * @param val  the NodePtr value
+ * @returns the newly created object.
+ */
+xmlXPathObject *
+xmlXPathWrapNodeSet(xmlNodeSet *val) {
+    xmlXPathObjectPtr ret;
+
+    ret = (xmlXPathObjectPtr) xmlMalloc(sizeof(xmlXPathObject));
+    if (ret == NULL) {
+        xmlXPathFreeNodeSet(val);
+	return(NULL);
     }
+    memset(ret, 0 , sizeof(xmlXPathObject));
+    ret->type = XPATH_NODESET;
+    ret->nodesetval = val;
     return(ret);
 }
 
 /**
- * Free up an xmlXPathObject object.
+ * Free up the xmlXPathObject `obj` but don't deallocate the objects in
+ * the list contrary to #xmlXPathFreeObject.
  *
- * @param obj  the object to free
+ * @param obj  an existing NodeSetList object
  */
 void
-xmlXPathFreeObject(xmlXPathObject *obj) {
+xmlXPathFreeNodeSetList(xmlXPathObject *obj) {
     if (obj == NULL) return;
-    if ((obj->type == XPATH_NODESET) || (obj->type == XPATH_XSLT_TREE)) {
-        if (obj->nodesetval != NULL)
-            xmlXPathFreeNodeSet(obj->nodesetval);
-    } else if (obj->type == XPATH_STRING) {
-	if (obj->stringval != NULL)
-	    xmlFree(obj->stringval);
-    }
     xmlFree(obj);
 }
 
-static void
-xmlXPathFreeObjectEntry(void *obj, const xmlChar *name ATTRIBUTE_UNUSED) {
-    xmlXPathFreeObject((xmlXPathObjectPtr) obj);
-}
-
 /**
- * Depending on the state of the cache this frees the given
- * XPath object or stores it in the cache.
+ * Implements the EXSLT - Sets difference() function:
+ *    node-set set:difference (node-set, node-set)
  *
- * @param ctxt  XPath context
- * @param obj  the xmlXPathObject to free or to cache
+ * @param nodes1  a node-set
+ * @param nodes2  a node-set
+ * @returns the difference between the two node sets, or nodes1 if
+ *         nodes2 is empty
  */
-static void
-xmlXPathReleaseObject(xmlXPathContextPtr ctxt, xmlXPathObjectPtr obj)
-{
-    if (obj == NULL)
-	return;
-    if ((ctxt == NULL) || (ctxt->cache == NULL)) {
-	 xmlXPathFreeObject(obj);
-    } else {
-	xmlXPathContextCachePtr cache =
-	    (xmlXPathContextCachePtr) ctxt->cache;
-
-	switch (obj->type) {
-	    case XPATH_NODESET:
-	    case XPATH_XSLT_TREE:
-		if (obj->nodesetval != NULL) {
-		    if ((obj->nodesetval->nodeMax <= 40) &&
-			(cache->numNodeset < cache->maxNodeset)) {
-                        obj->stringval = (void *) cache->nodesetObjs;
-                        cache->nodesetObjs = obj;
-                        cache->numNodeset += 1;
-			goto obj_cached;
-		    } else {
-			xmlXPathFreeNodeSet(obj->nodesetval);
-			obj->nodesetval = NULL;
-		    }
-		}
-		break;
-	    case XPATH_STRING:
-		if (obj->stringval != NULL)
-		    xmlFree(obj->stringval);
-                obj->stringval = NULL;
-		break;
-	    case XPATH_BOOLEAN:
-	    case XPATH_NUMBER:
-		break;
-	    default:
-		goto free_obj;
-	}
-
-	/*
-	* Fallback to adding to the misc-objects slot.
-	*/
-        if (cache->numMisc >= cache->maxMisc)
-	    goto free_obj;
-        obj->stringval = (void *) cache->miscObjs;
-        cache->miscObjs = obj;
-        cache->numMisc += 1;
-
-obj_cached:
-        obj->boolval = 0;
-	if (obj->nodesetval != NULL) {
-	    xmlNodeSetPtr tmpset = obj->nodesetval;
+xmlNodeSet *
+xmlXPathDifference (xmlNodeSet *nodes1, xmlNodeSet *nodes2) {
+    xmlNodeSetPtr ret;
+    int i, l1;
+    xmlNodePtr cur;
 
-	    /*
-	    * Due to those nasty ns-nodes, we need to traverse
-	    * the list and free the ns-nodes.
-	    */
-	    if (tmpset->nodeNr > 0) {
-		int i;
-		xmlNodePtr node;
+    if (xmlXPathNodeSetIsEmpty(nodes2))
+	return(nodes1);
 
-		for (i = 0; i < tmpset->nodeNr; i++) {
-		    node = tmpset->nodeTab[i];
-		    if ((node != NULL) &&
-			(node->type == XML_NAMESPACE_DECL))
-		    {
-			xmlXPathNodeSetFreeNs((xmlNsPtr) node);
-		    }
-		}
-	    }
-	    tmpset->nodeNr = 0;
-        }
+    ret = xmlXPathNodeSetCreate(NULL);
+    if (ret == NULL)
+        return(NULL);
+    if (xmlXPathNodeSetIsEmpty(nodes1))
+	return(ret);
 
-	return;
+    l1 = xmlXPathNodeSetGetLength(nodes1);
 
-free_obj:
-	/*
-	* Cache is full; free the object.
-	*/
-	if (obj->nodesetval != NULL)
-	    xmlXPathFreeNodeSet(obj->nodesetval);
-	xmlFree(obj);
+    for (i = 0; i < l1; i++) {
+	cur = xmlXPathNodeSetItem(nodes1, i);
+	if (!xmlXPathNodeSetContains(nodes2, cur)) {
+	    if (xmlXPathNodeSetAddUnique(ret, cur) < 0) {
+                xmlXPathFreeNodeSet(ret);
+	        return(NULL);
+            }
+	}
     }
+    return(ret);
 }
 
-
-/************************************************************************
- *									*
- *			Type Casting Routines				*
- *									*
- ************************************************************************/
-
 /**
- * Converts a boolean to its string value.
+ * Implements the EXSLT - Sets intersection() function:
+ *    node-set set:intersection (node-set, node-set)
  *
- * @param val  a boolean
- * @returns a newly allocated string.
+ * @param nodes1  a node-set
+ * @param nodes2  a node-set
+ * @returns a node set comprising the nodes that are within both the
+ *         node sets passed as arguments
  */
-xmlChar *
-xmlXPathCastBooleanToString (int val) {
-    xmlChar *ret;
-    if (val)
-	ret = xmlStrdup((const xmlChar *) "true");
-    else
-	ret = xmlStrdup((const xmlChar *) "false");
+xmlNodeSet *
+xmlXPathIntersection (xmlNodeSet *nodes1, xmlNodeSet *nodes2) {
+    xmlNodeSetPtr ret = xmlXPathNodeSetCreate(NULL);
+    int i, l1;
+    xmlNodePtr cur;
+
+    if (ret == NULL)
+        return(ret);
+    if (xmlXPathNodeSetIsEmpty(nodes1))
+	return(ret);
+    if (xmlXPathNodeSetIsEmpty(nodes2))
+	return(ret);
+
+    l1 = xmlXPathNodeSetGetLength(nodes1);
+
+    for (i = 0; i < l1; i++) {
+	cur = xmlXPathNodeSetItem(nodes1, i);
+	if (xmlXPathNodeSetContains(nodes2, cur)) {
+	    if (xmlXPathNodeSetAddUnique(ret, cur) < 0) {
+                xmlXPathFreeNodeSet(ret);
+	        return(NULL);
+            }
+	}
+    }
     return(ret);
 }
 
 /**
- * Converts a number to its string value.
+ * Implements the EXSLT - Sets distinct() function:
+ *    node-set set:distinct (node-set)
  *
- * @param val  a number
- * @returns a newly allocated string.
+ * @param nodes  a node-set, sorted by document order
+ * @returns a subset of the nodes contained in `nodes`, or `nodes` if
+ *         it is empty
  */
-xmlChar *
-xmlXPathCastNumberToString (double val) {
-    xmlChar *ret;
-    switch (xmlXPathIsInf(val)) {
-    case 1:
-	ret = xmlStrdup((const xmlChar *) "Infinity");
-	break;
-    case -1:
-	ret = xmlStrdup((const xmlChar *) "-Infinity");
-	break;
-    default:
-	if (xmlXPathIsNaN(val)) {
-	    ret = xmlStrdup((const xmlChar *) "NaN");
-	} else if (val == 0) {
-            /* Omit sign for negative zero. */
-	    ret = xmlStrdup((const xmlChar *) "0");
+xmlNodeSet *
+xmlXPathDistinctSorted (xmlNodeSet *nodes) {
+    xmlNodeSetPtr ret;
+    xmlHashTablePtr hash;
+    int i, l;
+    xmlChar * strval;
+    xmlNodePtr cur;
+
+    if (xmlXPathNodeSetIsEmpty(nodes))
+	return(nodes);
+
+    ret = xmlXPathNodeSetCreate(NULL);
+    if (ret == NULL)
+        return(ret);
+    l = xmlXPathNodeSetGetLength(nodes);
+    hash = xmlHashCreate (l);
+    for (i = 0; i < l; i++) {
+	cur = xmlXPathNodeSetItem(nodes, i);
+	strval = xmlXPathCastNodeToString(cur);
+	if (xmlHashLookup(hash, strval) == NULL) {
+	    if (xmlHashAddEntry(hash, strval, strval) < 0) {
+                xmlFree(strval);
+                goto error;
+            }
+	    if (xmlXPathNodeSetAddUnique(ret, cur) < 0)
+	        goto error;
 	} else {
-	    /* could be improved */
-	    char buf[100];
-	    xmlXPathFormatNumber(val, buf, 99);
-	    buf[99] = 0;
-	    ret = xmlStrdup((const xmlChar *) buf);
+	    xmlFree(strval);
 	}
     }
+    xmlHashFree(hash, xmlHashDefaultDeallocator);
     return(ret);
-}
 
-/**
- * Converts a node to its string value.
- *
- * @param node  a node
- * @returns a newly allocated string.
- */
-xmlChar *
-xmlXPathCastNodeToString (xmlNode *node) {
-    return(xmlNodeGetContent(node));
+error:
+    xmlHashFree(hash, xmlHashDefaultDeallocator);
+    xmlXPathFreeNodeSet(ret);
+    return(NULL);
 }
 
 /**
- * Converts a node-set to its string value.
+ * Implements the EXSLT - Sets distinct() function:
+ *    node-set set:distinct (node-set)
+ * `nodes` is sorted by document order, then exslSetsDistinctSorted
+ * is called with the sorted node-set
  *
- * @param ns  a node-set
- * @returns a newly allocated string.
+ * @param nodes  a node-set
+ * @returns a subset of the nodes contained in `nodes`, or `nodes` if
+ *         it is empty
  */
-xmlChar *
-xmlXPathCastNodeSetToString (xmlNodeSet *ns) {
-    if ((ns == NULL) || (ns->nodeNr == 0) || (ns->nodeTab == NULL))
-	return(xmlStrdup((const xmlChar *) ""));
+xmlNodeSet *
+xmlXPathDistinct (xmlNodeSet *nodes) {
+    if (xmlXPathNodeSetIsEmpty(nodes))
+	return(nodes);
 
-    if (ns->nodeNr > 1)
-	xmlXPathNodeSetSort(ns);
-    return(xmlXPathCastNodeToString(ns->nodeTab[0]));
+    xmlXPathNodeSetSort(nodes);
+    return(xmlXPathDistinctSorted(nodes));
 }
 
 /**
- * Converts an existing object to its string() equivalent
+ * Implements the EXSLT - Sets has-same-nodes function:
+ *    boolean set:has-same-node(node-set, node-set)
  *
- * @param val  an XPath object
- * @returns the allocated string value of the object, NULL in case of error.
- *         It's up to the caller to free the string memory with #xmlFree.
- */
-xmlChar *
-xmlXPathCastToString(xmlXPathObject *val) {
-    xmlChar *ret = NULL;
+ * @param nodes1  a node-set
+ * @param nodes2  a node-set
+ * @returns true (1) if `nodes1` shares any node with `nodes2`, false (0)
+ *         otherwise
+ */
+int
+xmlXPathHasSameNodes (xmlNodeSet *nodes1, xmlNodeSet *nodes2) {
+    int i, l;
+    xmlNodePtr cur;
 
-    if (val == NULL)
-	return(xmlStrdup((const xmlChar *) ""));
-    switch (val->type) {
-	case XPATH_UNDEFINED:
-	    ret = xmlStrdup((const xmlChar *) "");
-	    break;
-        case XPATH_NODESET:
-        case XPATH_XSLT_TREE:
-	    ret = xmlXPathCastNodeSetToString(val->nodesetval);
-	    break;
-	case XPATH_STRING:
-	    return(xmlStrdup(val->stringval));
-        case XPATH_BOOLEAN:
-	    ret = xmlXPathCastBooleanToString(val->boolval);
-	    break;
-	case XPATH_NUMBER: {
-	    ret = xmlXPathCastNumberToString(val->floatval);
-	    break;
-	}
-	case XPATH_USERS:
-	    /* TODO */
-	    ret = xmlStrdup((const xmlChar *) "");
-	    break;
+    if (xmlXPathNodeSetIsEmpty(nodes1) ||
+	xmlXPathNodeSetIsEmpty(nodes2))
+	return(0);
+
+    l = xmlXPathNodeSetGetLength(nodes1);
+    for (i = 0; i < l; i++) {
+	cur = xmlXPathNodeSetItem(nodes1, i);
+	if (xmlXPathNodeSetContains(nodes2, cur))
+	    return(1);
     }
-    return(ret);
+    return(0);
 }
 
 /**
- * Converts an existing object to its string() equivalent
+ * Implements the EXSLT - Sets leading() function:
+ *    node-set set:leading (node-set, node-set)
  *
- * @param val  an XPath object
- * @returns the new object, the old one is freed (or the operation
- *         is done directly on `val`)
+ * @param nodes  a node-set, sorted by document order
+ * @param node  a node
+ * @returns the nodes in `nodes` that precede `node` in document order,
+ *         `nodes` if `node` is NULL or an empty node-set if `nodes`
+ *         doesn't contain `node`
  */
-xmlXPathObject *
-xmlXPathConvertString(xmlXPathObject *val) {
-    xmlChar *res = NULL;
+xmlNodeSet *
+xmlXPathNodeLeadingSorted (xmlNodeSet *nodes, xmlNode *node) {
+    int i, l;
+    xmlNodePtr cur;
+    xmlNodeSetPtr ret;
 
-    if (val == NULL)
-	return(xmlXPathNewCString(""));
+    if (node == NULL)
+	return(nodes);
 
-    switch (val->type) {
-    case XPATH_UNDEFINED:
-	break;
-    case XPATH_NODESET:
-    case XPATH_XSLT_TREE:
-	res = xmlXPathCastNodeSetToString(val->nodesetval);
-	break;
-    case XPATH_STRING:
-	return(val);
-    case XPATH_BOOLEAN:
-	res = xmlXPathCastBooleanToString(val->boolval);
-	break;
-    case XPATH_NUMBER:
-	res = xmlXPathCastNumberToString(val->floatval);
-	break;
-    case XPATH_USERS:
-	/* TODO */
-	break;
+    ret = xmlXPathNodeSetCreate(NULL);
+    if (ret == NULL)
+        return(ret);
+    if (xmlXPathNodeSetIsEmpty(nodes) ||
+	(!xmlXPathNodeSetContains(nodes, node)))
+	return(ret);
+
+    l = xmlXPathNodeSetGetLength(nodes);
+    for (i = 0; i < l; i++) {
+	cur = xmlXPathNodeSetItem(nodes, i);
+	if (cur == node)
+	    break;
+	if (xmlXPathNodeSetAddUnique(ret, cur) < 0) {
+            xmlXPathFreeNodeSet(ret);
+	    return(NULL);
+        }
     }
-    xmlXPathFreeObject(val);
-    if (res == NULL)
-	return(xmlXPathNewCString(""));
-    return(xmlXPathWrapString(res));
+    return(ret);
 }
 
 /**
- * Converts a boolean to its number value
+ * Implements the EXSLT - Sets leading() function:
+ *    node-set set:leading (node-set, node-set)
+ * `nodes` is sorted by document order, then exslSetsNodeLeadingSorted
+ * is called.
  *
- * @param val  a boolean
- * @returns the number value
+ * @param nodes  a node-set
+ * @param node  a node
+ * @returns the nodes in `nodes` that precede `node` in document order,
+ *         `nodes` if `node` is NULL or an empty node-set if `nodes`
+ *         doesn't contain `node`
  */
-double
-xmlXPathCastBooleanToNumber(int val) {
-    if (val)
-	return(1.0);
-    return(0.0);
+xmlNodeSet *
+xmlXPathNodeLeading (xmlNodeSet *nodes, xmlNode *node) {
+    xmlXPathNodeSetSort(nodes);
+    return(xmlXPathNodeLeadingSorted(nodes, node));
 }
 
 /**
- * Converts a string to its number value
+ * Implements the EXSLT - Sets leading() function:
+ *    node-set set:leading (node-set, node-set)
  *
- * @param val  a string
- * @returns the number value
+ * @param nodes1  a node-set, sorted by document order
+ * @param nodes2  a node-set, sorted by document order
+ * @returns the nodes in `nodes1` that precede the first node in `nodes2`
+ *         in document order, `nodes1` if `nodes2` is NULL or empty or
+ *         an empty node-set if `nodes1` doesn't contain `nodes2`
  */
-double
-xmlXPathCastStringToNumber(const xmlChar * val) {
-    return(xmlXPathStringEvalNumber(val));
+xmlNodeSet *
+xmlXPathLeadingSorted (xmlNodeSet *nodes1, xmlNodeSet *nodes2) {
+    if (xmlXPathNodeSetIsEmpty(nodes2))
+	return(nodes1);
+    return(xmlXPathNodeLeadingSorted(nodes1,
+				     xmlXPathNodeSetItem(nodes2, 1)));
 }
 
 /**
- * Converts a node to its number value
+ * Implements the EXSLT - Sets leading() function:
+ *    node-set set:leading (node-set, node-set)
+ * `nodes1` and `nodes2` are sorted by document order, then
+ * exslSetsLeadingSorted is called.
  *
- * @param ctxt  XPath parser context
+ * @param nodes1  a node-set
+ * @param nodes2  a node-set
+ * @returns the nodes in `nodes1` that precede the first node in `nodes2`
+ *         in document order, `nodes1` if `nodes2` is NULL or empty or
+ *         an empty node-set if `nodes1` doesn't contain `nodes2`
+ */
+xmlNodeSet *
+xmlXPathLeading (xmlNodeSet *nodes1, xmlNodeSet *nodes2) {
+    if (xmlXPathNodeSetIsEmpty(nodes2))
+	return(nodes1);
+    if (xmlXPathNodeSetIsEmpty(nodes1))
+	return(xmlXPathNodeSetCreate(NULL));
+    xmlXPathNodeSetSort(nodes1);
+    xmlXPathNodeSetSort(nodes2);
+    return(xmlXPathNodeLeadingSorted(nodes1,
+				     xmlXPathNodeSetItem(nodes2, 1)));
+}
+
+/**
+ * Implements the EXSLT - Sets trailing() function:
+ *    node-set set:trailing (node-set, node-set)
+ *
+ * @param nodes  a node-set, sorted by document order
  * @param node  a node
- * @returns the number value
+ * @returns the nodes in `nodes` that follow `node` in document order,
+ *         `nodes` if `node` is NULL or an empty node-set if `nodes`
+ *         doesn't contain `node`
  */
-static double
-xmlXPathNodeToNumberInternal(xmlXPathParserContextPtr ctxt, xmlNodePtr node) {
-    xmlChar *strval;
-    double ret;
+xmlNodeSet *
+xmlXPathNodeTrailingSorted (xmlNodeSet *nodes, xmlNode *node) {
+    int i, l;
+    xmlNodePtr cur;
+    xmlNodeSetPtr ret;
 
     if (node == NULL)
-	return(xmlXPathNAN);
-    strval = xmlXPathCastNodeToString(node);
-    if (strval == NULL) {
-        xmlXPathPErrMemory(ctxt);
-	return(xmlXPathNAN);
-    }
-    ret = xmlXPathCastStringToNumber(strval);
-    xmlFree(strval);
+	return(nodes);
+
+    ret = xmlXPathNodeSetCreate(NULL);
+    if (ret == NULL)
+        return(ret);
+    if (xmlXPathNodeSetIsEmpty(nodes) ||
+	(!xmlXPathNodeSetContains(nodes, node)))
+	return(ret);
 
+    l = xmlXPathNodeSetGetLength(nodes);
+    for (i = l - 1; i >= 0; i--) {
+	cur = xmlXPathNodeSetItem(nodes, i);
+	if (cur == node)
+	    break;
+	if (xmlXPathNodeSetAddUnique(ret, cur) < 0) {
+            xmlXPathFreeNodeSet(ret);
+	    return(NULL);
+        }
+    }
+    xmlXPathNodeSetSort(ret);	/* bug 413451 */
     return(ret);
 }
 
 /**
- * Converts a node to its number value
+ * Implements the EXSLT - Sets trailing() function:
+ *    node-set set:trailing (node-set, node-set)
+ * `nodes` is sorted by document order, then #xmlXPathNodeTrailingSorted
+ * is called.
  *
+ * @param nodes  a node-set
  * @param node  a node
- * @returns the number value
+ * @returns the nodes in `nodes` that follow `node` in document order,
+ *         `nodes` if `node` is NULL or an empty node-set if `nodes`
+ *         doesn't contain `node`
  */
-double
-xmlXPathCastNodeToNumber (xmlNode *node) {
-    return(xmlXPathNodeToNumberInternal(NULL, node));
+xmlNodeSet *
+xmlXPathNodeTrailing (xmlNodeSet *nodes, xmlNode *node) {
+    xmlXPathNodeSetSort(nodes);
+    return(xmlXPathNodeTrailingSorted(nodes, node));
 }
 
 /**
- * Converts a node-set to its number value
+ * Implements the EXSLT - Sets trailing() function:
+ *    node-set set:trailing (node-set, node-set)
  *
- * @param ns  a node-set
- * @returns the number value
+ * @param nodes1  a node-set, sorted by document order
+ * @param nodes2  a node-set, sorted by document order
+ * @returns the nodes in `nodes1` that follow the first node in `nodes2`
+ *         in document order, `nodes1` if `nodes2` is NULL or empty or
+ *         an empty node-set if `nodes1` doesn't contain `nodes2`
  */
-double
-xmlXPathCastNodeSetToNumber (xmlNodeSet *ns) {
-    xmlChar *str;
-    double ret;
-
-    if (ns == NULL)
-	return(xmlXPathNAN);
-    str = xmlXPathCastNodeSetToString(ns);
-    ret = xmlXPathCastStringToNumber(str);
-    xmlFree(str);
-    return(ret);
-}
+xmlNodeSet *
+xmlXPathTrailingSorted (xmlNodeSet *nodes1, xmlNodeSet *nodes2) {
+    if (xmlXPathNodeSetIsEmpty(nodes2))
+	return(nodes1);
+    return(xmlXPathNodeTrailingSorted(nodes1,
+				      xmlXPathNodeSetItem(nodes2, 0)));
+}
 
 /**
- * Converts an XPath object to its number value
+ * Implements the EXSLT - Sets trailing() function:
+ *    node-set set:trailing (node-set, node-set)
+ * `nodes1` and `nodes2` are sorted by document order, then
+ * #xmlXPathTrailingSorted is called.
  *
- * @param val  an XPath object
- * @returns the number value
+ * @param nodes1  a node-set
+ * @param nodes2  a node-set
+ * @returns the nodes in `nodes1` that follow the first node in `nodes2`
+ *         in document order, `nodes1` if `nodes2` is NULL or empty or
+ *         an empty node-set if `nodes1` doesn't contain `nodes2`
  */
-double
-xmlXPathCastToNumber(xmlXPathObject *val) {
-    return(xmlXPathCastToNumberInternal(NULL, val));
+xmlNodeSet *
+xmlXPathTrailing (xmlNodeSet *nodes1, xmlNodeSet *nodes2) {
+    if (xmlXPathNodeSetIsEmpty(nodes2))
+	return(nodes1);
+    if (xmlXPathNodeSetIsEmpty(nodes1))
+	return(xmlXPathNodeSetCreate(NULL));
+    xmlXPathNodeSetSort(nodes1);
+    xmlXPathNodeSetSort(nodes2);
+    return(xmlXPathNodeTrailingSorted(nodes1,
+				      xmlXPathNodeSetItem(nodes2, 0)));
 }
 
+/************************************************************************
+ *									*
+ *		Routines to handle extra functions			*
+ *									*
+ ************************************************************************/
+
 /**
- * Converts an existing object to its number() equivalent
+ * Register a new function. If `f` is NULL it unregisters the function
  *
- * @param val  an XPath object
- * @returns the new object, the old one is freed (or the operation
- *         is done directly on `val`)
+ * @param ctxt  the XPath context
+ * @param name  the function name
+ * @param f  the function implementation or NULL
+ * @returns 0 in case of success, -1 in case of error
  */
-xmlXPathObject *
-xmlXPathConvertNumber(xmlXPathObject *val) {
-    xmlXPathObjectPtr ret;
-
-    if (val == NULL)
-	return(xmlXPathNewFloat(0.0));
-    if (val->type == XPATH_NUMBER)
-	return(val);
-    ret = xmlXPathNewFloat(xmlXPathCastToNumber(val));
-    xmlXPathFreeObject(val);
-    return(ret);
+int
+xmlXPathRegisterFunc(xmlXPathContext *ctxt, const xmlChar *name,
+		     xmlXPathFunction f) {
+    return(xmlXPathRegisterFuncNS(ctxt, name, NULL, f));
 }
 
 /**
- * Converts a number to its boolean value
+ * Register a new function. If `f` is NULL it unregisters the function
  *
- * @param val  a number
- * @returns the boolean value
+ * @param ctxt  the XPath context
+ * @param name  the function name
+ * @param ns_uri  the function namespace URI
+ * @param f  the function implementation or NULL
+ * @returns 0 in case of success, -1 in case of error
  */
 int
-xmlXPathCastNumberToBoolean (double val) {
-     if (xmlXPathIsNaN(val) || (val == 0.0))
-	 return(0);
-     return(1);
+xmlXPathRegisterFuncNS(xmlXPathContext *ctxt, const xmlChar *name,
+		       const xmlChar *ns_uri, xmlXPathFunction f) {
+    int ret;
+    void *payload;
+
+    if (ctxt == NULL)
+	return(-1);
+    if (name == NULL)
+	return(-1);
+
+    if (ctxt->funcHash == NULL)
+	ctxt->funcHash = xmlHashCreate(0);
+    if (ctxt->funcHash == NULL) {
+        xmlXPathErrMemory(ctxt);
+	return(-1);
+    }
+    if (f == NULL)
+        return(xmlHashRemoveEntry2(ctxt->funcHash, name, ns_uri, NULL));
+    memcpy(&payload, &f, sizeof(f));
+    ret = xmlHashAddEntry2(ctxt->funcHash, name, ns_uri, payload);
+    if (ret < 0) {
+        xmlXPathErrMemory(ctxt);
+        return(-1);
+    }
+
+    return(0);
 }
 
 /**
- * Converts a string to its boolean value
+ * Registers an external mechanism to do function lookup.
  *
- * @param val  a string
- * @returns the boolean value
+ * @param ctxt  the XPath context
+ * @param f  the lookup function
+ * @param funcCtxt  the lookup data
  */
-int
-xmlXPathCastStringToBoolean (const xmlChar *val) {
-    if ((val == NULL) || (xmlStrlen(val) == 0))
-	return(0);
-    return(1);
+void
+xmlXPathRegisterFuncLookup (xmlXPathContext *ctxt,
+			    xmlXPathFuncLookupFunc f,
+			    void *funcCtxt) {
+    if (ctxt == NULL)
+	return;
+    ctxt->funcLookupFunc = f;
+    ctxt->funcLookupData = funcCtxt;
 }
 
 /**
- * Converts a node-set to its boolean value
+ * Search in the Function array of the context for the given
+ * function.
  *
- * @param ns  a node-set
- * @returns the boolean value
+ * @param ctxt  the XPath context
+ * @param name  the function name
+ * @returns the xmlXPathFunction or NULL if not found
  */
-int
-xmlXPathCastNodeSetToBoolean (xmlNodeSet *ns) {
-    if ((ns == NULL) || (ns->nodeNr == 0))
-	return(0);
-    return(1);
+xmlXPathFunction
+xmlXPathFunctionLookup(xmlXPathContext *ctxt, const xmlChar *name) {
+    return(xmlXPathFunctionLookupNS(ctxt, name, NULL));
 }
 
 /**
- * Converts an XPath object to its boolean value
+ * Search in the Function array of the context for the given
+ * function.
  *
- * @param val  an XPath object
- * @returns the boolean value
+ * @param ctxt  the XPath context
+ * @param name  the function name
+ * @param ns_uri  the function namespace URI
+ * @returns the xmlXPathFunction or NULL if not found
  */
-int
-xmlXPathCastToBoolean (xmlXPathObject *val) {
-    int ret = 0;
+xmlXPathFunction
+xmlXPathFunctionLookupNS(xmlXPathContext *ctxt, const xmlChar *name,
+			 const xmlChar *ns_uri) {
+    xmlXPathFunction ret;
+    void *payload;
 
-    if (val == NULL)
-	return(0);
-    switch (val->type) {
-    case XPATH_UNDEFINED:
-	ret = 0;
-	break;
-    case XPATH_NODESET:
-    case XPATH_XSLT_TREE:
-	ret = xmlXPathCastNodeSetToBoolean(val->nodesetval);
-	break;
-    case XPATH_STRING:
-	ret = xmlXPathCastStringToBoolean(val->stringval);
-	break;
-    case XPATH_NUMBER:
-	ret = xmlXPathCastNumberToBoolean(val->floatval);
-	break;
-    case XPATH_BOOLEAN:
-	ret = val->boolval;
-	break;
-    case XPATH_USERS:
-	/* TODO */
-	ret = 0;
-	break;
+    if (ctxt == NULL)
+	return(NULL);
+    if (name == NULL)
+	return(NULL);
+
+    if (ns_uri == NULL) {
+        int bucketIndex = xmlXPathSFComputeHash(name) % SF_HASH_SIZE;
+
+        while (xmlXPathSFHash[bucketIndex] != UCHAR_MAX) {
+            int funcIndex = xmlXPathSFHash[bucketIndex];
+
+            if (strcmp(xmlXPathStandardFunctions[funcIndex].name,
+                       (char *) name) == 0)
+                return(xmlXPathStandardFunctions[funcIndex].func);
+
+            bucketIndex += 1;
+            if (bucketIndex >= SF_HASH_SIZE)
+                bucketIndex = 0;
+        }
+    }
+
+    if (ctxt->funcLookupFunc != NULL) {
+	xmlXPathFuncLookupFunc f;
+
+	f = ctxt->funcLookupFunc;
+	ret = f(ctxt->funcLookupData, name, ns_uri);
+	if (ret != NULL)
+	    return(ret);
     }
+
+    if (ctxt->funcHash == NULL)
+	return(NULL);
+
+    payload = xmlHashLookup2(ctxt->funcHash, name, ns_uri);
+    memcpy(&ret, &payload, sizeof(payload));
+
     return(ret);
 }
 
-
 /**
- * Converts an existing object to its boolean() equivalent
+ * Cleanup the XPath context data associated to registered functions
  *
- * @param val  an XPath object
- * @returns the new object, the old one is freed (or the operation
- *         is done directly on `val`)
+ * @param ctxt  the XPath context
  */
-xmlXPathObject *
-xmlXPathConvertBoolean(xmlXPathObject *val) {
-    xmlXPathObjectPtr ret;
+void
+xmlXPathRegisteredFuncsCleanup(xmlXPathContext *ctxt) {
+    if (ctxt == NULL)
+	return;
 
-    if (val == NULL)
-	return(xmlXPathNewBoolean(0));
-    if (val->type == XPATH_BOOLEAN)
-	return(val);
-    ret = xmlXPathNewBoolean(xmlXPathCastToBoolean(val));
-    xmlXPathFreeObject(val);
-    return(ret);
+    xmlHashFree(ctxt->funcHash, NULL);
+    ctxt->funcHash = NULL;
 }
 
 /************************************************************************
  *									*
- *		Routines to handle XPath contexts			*
+ *			Routines to handle Variables			*
  *									*
  ************************************************************************/
 
 /**
- * Create a new xmlXPathContext
+ * Register a new variable value. If `value` is NULL it unregisters
+ * the variable
  *
- * @param doc  the XML document
- * @returns the xmlXPathContext just allocated. The caller will need to free it.
+ * @param ctxt  the XPath context
+ * @param name  the variable name
+ * @param value  the variable value or NULL
+ * @returns 0 in case of success, -1 in case of error
  */
-xmlXPathContext *
-xmlXPathNewContext(xmlDoc *doc) {
-    xmlXPathContextPtr ret;
+int
+xmlXPathRegisterVariable(xmlXPathContext *ctxt, const xmlChar *name,
+			 xmlXPathObject *value) {
+    return(xmlXPathRegisterVariableNS(ctxt, name, NULL, value));
+}
 
-    ret = (xmlXPathContextPtr) xmlMalloc(sizeof(xmlXPathContext));
-    if (ret == NULL)
+/**
+ * Register a new variable value. If `value` is NULL it unregisters
+ * the variable
+ *
+ * @param ctxt  the XPath context
+ * @param name  the variable name
+ * @param ns_uri  the variable namespace URI
+ * @param value  the variable value or NULL
+ * @returns 0 in case of success, -1 in case of error
+ */
+int
+xmlXPathRegisterVariableNS(xmlXPathContext *ctxt, const xmlChar *name,
+			   const xmlChar *ns_uri,
+			   xmlXPathObject *value) {
+    if (ctxt == NULL)
+	return(-1);
+    if (name == NULL)
+	return(-1);
+
+    xmlXPathFlushResultCache(ctxt);
+    if (ctxt->varHash == NULL)
+	ctxt->varHash = xmlHashCreate(0);
+    if (ctxt->varHash == NULL)
+	return(-1);
+    if (value == NULL)
+        return(xmlHashRemoveEntry2(ctxt->varHash, name, ns_uri,
+	                           xmlXPathFreeObjectEntry));
+    return(xmlHashUpdateEntry2(ctxt->varHash, name, ns_uri,
+			       (void *) value, xmlXPathFreeObjectEntry));
+}
+
+/**
+ * register an external mechanism to do variable lookup
+ *
+ * @param ctxt  the XPath context
+ * @param f  the lookup function
+ * @param data  the lookup data
+ */
+void
+xmlXPathRegisterVariableLookup(xmlXPathContext *ctxt,
+	 xmlXPathVariableLookupFunc f, void *data) {
+    if (ctxt == NULL)
+	return;
+    xmlXPathFlushResultCache(ctxt);
+    ctxt->varLookupFunc = f;
+    ctxt->varLookupData = data;
+}
+
+/**
+ * Search in the Variable array of the context for the given
+ * variable value.
+ *
+ * @param ctxt  the XPath context
+ * @param name  the variable name
+ * @returns a copy of the value or NULL if not found
+ */
+xmlXPathObject *
+xmlXPathVariableLookup(xmlXPathContext *ctxt, const xmlChar *name) {
+    if (ctxt == NULL)
 	return(NULL);
-    memset(ret, 0 , sizeof(xmlXPathContext));
-    ret->doc = doc;
-    ret->node = NULL;
 
-    ret->varHash = NULL;
+    if (ctxt->varLookupFunc != NULL) {
+	xmlXPathObjectPtr ret;
 
-    ret->nb_types = 0;
-    ret->max_types = 0;
-    ret->types = NULL;
+	ret = ((xmlXPathVariableLookupFunc)ctxt->varLookupFunc)
+	        (ctxt->varLookupData, name, NULL);
+	return(ret);
+    }
+    return(xmlXPathVariableLookupNS(ctxt, name, NULL));
+}
 
-    ret->nb_axis = 0;
-    ret->max_axis = 0;
-    ret->axis = NULL;
+/**
+ * Search in the Variable array of the context for the given
+ * variable value.
+ *
+ * @param ctxt  the XPath context
+ * @param name  the variable name
+ * @param ns_uri  the variable namespace URI
+ * @returns the a copy of the value or NULL if not found
+ */
+xmlXPathObject *
+xmlXPathVariableLookupNS(xmlXPathContext *ctxt, const xmlChar *name,
+			 const xmlChar *ns_uri) {
+    if (ctxt == NULL)
+	return(NULL);
 
-    ret->nsHash = NULL;
-    ret->user = NULL;
+    if (ctxt->varLookupFunc != NULL) {
+	xmlXPathObjectPtr ret;
 
-    ret->contextSize = -1;
-    ret->proximityPosition = -1;
+	ret = ((xmlXPathVariableLookupFunc)ctxt->varLookupFunc)
+	        (ctxt->varLookupData, name, ns_uri);
+	if (ret != NULL) return(ret);
+    }
 
-#ifdef XP_DEFAULT_CACHE_ON
-    if (xmlXPathContextSetCache(ret, 1, -1, 0) == -1) {
-	xmlXPathFreeContext(ret);
+    if (ctxt->varHash == NULL)
+	return(NULL);
+    if (name == NULL)
+	return(NULL);
+
+    return(xmlXPathObjectCopy(xmlHashLookup2(ctxt->varHash, name, ns_uri)));
+}
+
+/**
+ * Cleanup the XPath context data associated to registered variables
+ *
+ * @param ctxt  the XPath context
+ */
+void
+xmlXPathRegisteredVariablesCleanup(xmlXPathContext *ctxt) {
+    if (ctxt == NULL)
+	return;
+
+    xmlXPathFlushResultCache(ctxt);
+    xmlHashFree(ctxt->varHash, xmlXPathFreeObjectEntry);
+    ctxt->varHash = NULL;
+}
+
+/**
+ * Register a new namespace. If `ns_uri` is NULL it unregisters
+ * the namespace
+ *
+ * @param ctxt  the XPath context
+ * @param prefix  the namespace prefix cannot be NULL or empty string
+ * @param ns_uri  the namespace name
+ * @returns 0 in case of success, -1 in case of error
+ */
+int
+xmlXPathRegisterNs(xmlXPathContext *ctxt, const xmlChar *prefix,
+			   const xmlChar *ns_uri) {
+    xmlChar *copy;
+
+    if (ctxt == NULL)
+	return(-1);
+    if (prefix == NULL)
+	return(-1);
+    if (prefix[0] == 0)
+	return(-1);
+
+    xmlXPathFlushResultCache(ctxt);
+    if (ctxt->nsHash == NULL)
+	ctxt->nsHash = xmlHashCreate(10);
+    if (ctxt->nsHash == NULL) {
+        xmlXPathErrMemory(ctxt);
+	return(-1);
+    }
+    if (ns_uri == NULL)
+        return(xmlHashRemoveEntry(ctxt->nsHash, prefix,
+	                          xmlHashDefaultDeallocator));
+
+    copy = xmlStrdup(ns_uri);
+    if (copy == NULL) {
+        xmlXPathErrMemory(ctxt);
+        return(-1);
+    }
+    if (xmlHashUpdateEntry(ctxt->nsHash, prefix, copy,
+                           xmlHashDefaultDeallocator) < 0) {
+        xmlXPathErrMemory(ctxt);
+        xmlFree(copy);
+        return(-1);
+    }
+
+    return(0);
+}
+
+/**
+ * Search in the namespace declaration array of the context for the given
+ * namespace name associated to the given prefix
+ *
+ * @param ctxt  the XPath context
+ * @param prefix  the namespace prefix value
+ * @returns the value or NULL if not found
+ */
+const xmlChar *
+xmlXPathNsLookup(xmlXPathContext *ctxt, const xmlChar *prefix) {
+    if (ctxt == NULL)
+	return(NULL);
+    if (prefix == NULL)
+	return(NULL);
+
+    if (xmlStrEqual(prefix, (const xmlChar *) "xml"))
+	return(XML_XML_NAMESPACE);
+
+    if (ctxt->namespaces != NULL) {
+	int i;
+
+	for (i = 0;i < ctxt->nsNr;i++) {
+	    if ((ctxt->namespaces[i] != NULL) &&
+		(xmlStrEqual(ctxt->namespaces[i]->prefix, prefix)))
+		return(ctxt->namespaces[i]->href);
+	}
+    }
+
+    return((const xmlChar *) xmlHashLookup(ctxt->nsHash, prefix));
+}
+
+/**
+ * Cleanup the XPath context data associated to registered variables
+ *
+ * @param ctxt  the XPath context
+ */
+void
+xmlXPathRegisteredNsCleanup(xmlXPathContext *ctxt) {
+    if (ctxt == NULL)
+	return;
+
+    xmlXPathFlushResultCache(ctxt);
+    xmlHashFree(ctxt->nsHash, xmlHashDefaultDeallocator);
+    ctxt->nsHash = NULL;
+}
+
+/************************************************************************
+ *									*
+ *			Routines to handle Values			*
+ *									*
+ ************************************************************************/
+
+/* Allocations are terrible, one needs to optimize all this !!! */
+
+/**
+ * Create a new xmlXPathObject of type double and of value `val`
+ *
+ * @param val  the double value
+ * @returns the newly created object.
+ */
+xmlXPathObject *
+xmlXPathNewFloat(double val) {
+    xmlXPathObjectPtr ret;
+
+    ret = (xmlXPathObjectPtr) xmlMalloc(sizeof(xmlXPathObject));
+    if (ret == NULL)
+	return(NULL);
+    memset(ret, 0 , sizeof(xmlXPathObject));
+    ret->type = XPATH_NUMBER;
+    ret->floatval = val;
+    return(ret);
+}
+
+/**
+ * Create a new xmlXPathObject of type boolean and of value `val`
+ *
+ * @param val  the boolean value
+ * @returns the newly created object.
+ */
+xmlXPathObject *
+xmlXPathNewBoolean(int val) {
+    xmlXPathObjectPtr ret;
+
+    ret = (xmlXPathObjectPtr) xmlMalloc(sizeof(xmlXPathObject));
+    if (ret == NULL)
 	return(NULL);
+    memset(ret, 0 , sizeof(xmlXPathObject));
+    ret->type = XPATH_BOOLEAN;
+    ret->boolval = (val != 0);
+    return(ret);
+}
+
+/**
+ * Create a new xmlXPathObject of type string and of value `val`
+ *
+ * @param val  the xmlChar * value
+ * @returns the newly created object.
+ */
+xmlXPathObject *
+xmlXPathNewString(const xmlChar *val) {
+    xmlXPathObjectPtr ret;
+
+    ret = (xmlXPathObjectPtr) xmlMalloc(sizeof(xmlXPathObject));
+    if (ret == NULL)
+	return(NULL);
+    memset(ret, 0 , sizeof(xmlXPathObject));
+    ret->type = XPATH_STRING;
+    if (val == NULL)
+        val = BAD_CAST "";
+    ret->stringval = xmlStrdup(val);
+    if (ret->stringval == NULL) {
+        xmlFree(ret);
+        return(NULL);
+    }
+    return(ret);
+}
+
+/**
+ * Wraps the `val` string into an XPath object.
+ *
+ * Frees `val` in case of error.
+ *
+ * @param val  the xmlChar * value
+ * @returns the newly created object.
+ */
+xmlXPathObject *
+xmlXPathWrapString (xmlChar *val) {
+    xmlXPathObjectPtr ret;
+
+    ret = (xmlXPathObjectPtr) xmlMalloc(sizeof(xmlXPathObject));
+    if (ret == NULL) {
+        xmlFree(val);
+	return(NULL);
+    }
+    memset(ret, 0 , sizeof(xmlXPathObject));
+    ret->type = XPATH_STRING;
+    ret->stringval = val;
+    return(ret);
+}
+
+/**
+ * Create a new xmlXPathObject of type string and of value `val`
+ *
+ * @param val  the char * value
+ * @returns the newly created object.
+ */
+xmlXPathObject *
+xmlXPathNewCString(const char *val) {
+    return(xmlXPathNewString(BAD_CAST val));
+}
+
+/**
+ * Wraps a string into an XPath object.
+ *
+ * @param val  the char * value
+ * @returns the newly created object.
+ */
+xmlXPathObject *
+xmlXPathWrapCString (char * val) {
+    return(xmlXPathWrapString((xmlChar *)(val)));
+}
+
+/**
+ * Wraps the `val` data into an XPath object.
+ *
+ * @param val  the user data
+ * @returns the newly created object.
+ */
+xmlXPathObject *
+xmlXPathWrapExternal (void *val) {
+    xmlXPathObjectPtr ret;
+
+    ret = (xmlXPathObjectPtr) xmlMalloc(sizeof(xmlXPathObject));
+    if (ret == NULL)
+	return(NULL);
+    memset(ret, 0 , sizeof(xmlXPathObject));
+    ret->type = XPATH_USERS;
+    ret->user = val;
+    return(ret);
+}
+
+/**
+ * allocate a new copy of a given object
+ *
+ * @param val  the original object
+ * @returns the newly created object.
+ */
+xmlXPathObject *
+xmlXPathObjectCopy(xmlXPathObject *val) {
+    xmlXPathObjectPtr ret;
+
+    if (val == NULL)
+	return(NULL);
+
+    ret = (xmlXPathObjectPtr) xmlMalloc(sizeof(xmlXPathObject));
+    if (ret == NULL)
+	return(NULL);
+    memcpy(ret, val , sizeof(xmlXPathObject));
+    switch (val->type) {
+	case XPATH_BOOLEAN:
+	case XPATH_NUMBER:
+	    break;
+	case XPATH_STRING:
+	    ret->stringval = xmlStrdup(val->stringval);
+            if (ret->stringval == NULL) {
+                xmlFree(ret);
+                return(NULL);
+            }
+	    break;
+	case XPATH_XSLT_TREE:
+	case XPATH_NODESET:
+	    ret->nodesetval = xmlXPathNodeSetMerge(NULL, val->nodesetval);
+            if (ret->nodesetval == NULL) {
+                xmlFree(ret);
+                return(NULL);
+            }
+	    /* Do not deallocate the copied tree value */
+	    ret->boolval = 0;
+	    break;
+        case XPATH_USERS:
+	    ret->user = val->user;
+	    break;
+        default:
+            xmlFree(ret);
+            ret = NULL;
+	    break;
+    }
+    return(ret);
+}
+
+/**
+ * Free up an xmlXPathObject object.
+ *
+ * @param obj  the object to free
+ */
+void
+xmlXPathFreeObject(xmlXPathObject *obj) {
+    if (obj == NULL) return;
+    if ((obj->type == XPATH_NODESET) || (obj->type == XPATH_XSLT_TREE)) {
+        if (obj->nodesetval != NULL)
+            xmlXPathFreeNodeSet(obj->nodesetval);
+    } else if (obj->type == XPATH_STRING) {
+	if (obj->stringval != NULL)
+	    xmlFree(obj->stringval);
+    }
+    xmlFree(obj);
+}
+
+static void
+xmlXPathFreeObjectEntry(void *obj, const xmlChar *name ATTRIBUTE_UNUSED) {
+    xmlXPathFreeObject((xmlXPathObjectPtr) obj);
+}
+
+/**
+ * Depending on the state of the cache this frees the given
+ * XPath object or stores it in the cache.
+ *
+ * @param ctxt  XPath context
+ * @param obj  the xmlXPathObject to free or to cache
+ */
+static void
+xmlXPathReleaseObject(xmlXPathContextPtr ctxt, xmlXPathObjectPtr obj)
+{
+    if (obj == NULL)
+	return;
+    if ((ctxt == NULL) || (ctxt->cache == NULL)) {
+	 xmlXPathFreeObject(obj);
+    } else {
+	xmlXPathContextCachePtr cache =
+	    (xmlXPathContextCachePtr) ctxt->cache;
+
+	switch (obj->type) {
+	    case XPATH_NODESET:
+	    case XPATH_XSLT_TREE:
+		if (obj->nodesetval != NULL) {
+		    if ((obj->nodesetval->nodeMax <= 40) &&
+			(cache->numNodeset < cache->maxNodeset)) {
+                        obj->stringval = (void *) cache->nodesetObjs;
+                        cache->nodesetObjs = obj;
+                        cache->numNodeset += 1;
+			goto obj_cached;
+		    } else {
+			xmlXPathFreeNodeSet(obj->nodesetval);
+			obj->nodesetval = NULL;
+		    }
+		}
+		break;
+	    case XPATH_STRING:
+		if (obj->stringval != NULL)
+		    xmlFree(obj->stringval);
+                obj->stringval = NULL;
+		break;
+	    case XPATH_BOOLEAN:
+	    case XPATH_NUMBER:
+		break;
+	    default:
+		goto free_obj;
+	}
+
+	/*
+	* Fallback to adding to the misc-objects slot.
+	*/
+        if (cache->numMisc >= cache->maxMisc)
+	    goto free_obj;
+        obj->stringval = (void *) cache->miscObjs;
+        cache->miscObjs = obj;
+        cache->numMisc += 1;
+
+obj_cached:
+        obj->boolval = 0;
+	if (obj->nodesetval != NULL) {
+	    xmlNodeSetPtr tmpset = obj->nodesetval;
+
+	    /*
+	    * Due to those nasty ns-nodes, we need to traverse
+	    * the list and free the ns-nodes.
+	    */
+	    if (tmpset->nodeNr > 0) {
+		int i;
+		xmlNodePtr node;
+
+		for (i = 0; i < tmpset->nodeNr; i++) {
+		    node = tmpset->nodeTab[i];
+		    if ((node != NULL) &&
+			(node->type == XML_NAMESPACE_DECL))
+		    {
+			xmlXPathNodeSetFreeNs((xmlNsPtr) node);
+		    }
+		}
+	    }
+	    tmpset->nodeNr = 0;
+        }
+
+	return;
+
+free_obj:
+	/*
+	* Cache is full; free the object.
+	*/
+	if (obj->nodesetval != NULL)
+	    xmlXPathFreeNodeSet(obj->nodesetval);
+	xmlFree(obj);
+    }
+}
+
+
+/************************************************************************
+ *									*
+ *			Type Casting Routines				*
+ *									*
+ ************************************************************************/
+
+/**
+ * Converts a boolean to its string value.
+ *
+ * @param val  a boolean
+ * @returns a newly allocated string.
+ */
+xmlChar *
+xmlXPathCastBooleanToString (int val) {
+    xmlChar *ret;
+    if (val)
+	ret = xmlStrdup((const xmlChar *) "true");
+    else
+	ret = xmlStrdup((const xmlChar *) "false");
+    return(ret);
+}
+
+/**
+ * Converts a number to its string value.
+ *
+ * @param val  a number
+ * @returns a newly allocated string.
+ */
+xmlChar *
+xmlXPathCastNumberToString (double val) {
+    xmlChar *ret;
+    switch (xmlXPathIsInf(val)) {
+    case 1:
+	ret = xmlStrdup((const xmlChar *) "Infinity");
+	break;
+    case -1:
+	ret = xmlStrdup((const xmlChar *) "-Infinity");
+	break;
+    default:
+	if (xmlXPathIsNaN(val)) {
+	    ret = xmlStrdup((const xmlChar *) "NaN");
+	} else if (val == 0) {
+            /* Omit sign for negative zero. */
+	    ret = xmlStrdup((const xmlChar *) "0");
+	} else {
+	    /* could be improved */
+	    char buf[100];
+	    xmlXPathFormatNumber(val, buf, 99);
+	    buf[99] = 0;
+	    ret = xmlStrdup((const xmlChar *) buf);
+	}
+    }
+    return(ret);
+}
+
+/**
+ * Converts a node to its string value.
+ *
+ * @param node  a node
+ * @returns a newly allocated string.
+ */
+xmlChar *
+xmlXPathCastNodeToString (xmlNode *node) {
+    return(xmlNodeGetContent(node));
+}
+
+/**
+ * Converts a node-set to its string value.
+ *
+ * @param ns  a node-set
+ * @returns a newly allocated string.
+ */
+xmlChar *
+xmlXPathCastNodeSetToString (xmlNodeSet *ns) {
+    if ((ns == NULL) || (ns->nodeNr == 0) || (ns->nodeTab == NULL))
+	return(xmlStrdup((const xmlChar *) ""));
+
+    if (ns->nodeNr > 1)
+	xmlXPathNodeSetSort(ns);
+    return(xmlXPathCastNodeToString(ns->nodeTab[0]));
+}
+
+/**
+ * Converts an existing object to its string() equivalent
+ *
+ * @param val  an XPath object
+ * @returns the allocated string value of the object, NULL in case of error.
+ *         It's up to the caller to free the string memory with #xmlFree.
+ */
+xmlChar *
+xmlXPathCastToString(xmlXPathObject *val) {
+    xmlChar *ret = NULL;
+
+    if (val == NULL)
+	return(xmlStrdup((const xmlChar *) ""));
+    switch (val->type) {
+	case XPATH_UNDEFINED:
+	    ret = xmlStrdup((const xmlChar *) "");
+	    break;
+        case XPATH_NODESET:
+        case XPATH_XSLT_TREE:
+	    ret = xmlXPathCastNodeSetToString(val->nodesetval);
+	    break;
+	case XPATH_STRING:
+	    return(xmlStrdup(val->stringval));
+        case XPATH_BOOLEAN:
+	    ret = xmlXPathCastBooleanToString(val->boolval);
+	    break;
+	case XPATH_NUMBER: {
+	    ret = xmlXPathCastNumberToString(val->floatval);
+	    break;
+	}
+	case XPATH_USERS:
+	    /* TODO */
+	    ret = xmlStrdup((const xmlChar *) "");
+	    break;
+    }
+    return(ret);
+}
+
+/**
+ * Converts an existing object to its string() equivalent
+ *
+ * @param val  an XPath object
+ * @returns the new object, the old one is freed (or the operation
+ *         is done directly on `val`)
+ */
+xmlXPathObject *
+xmlXPathConvertString(xmlXPathObject *val) {
+    xmlChar *res = NULL;
+
+    if (val == NULL)
+	return(xmlXPathNewCString(""));
+
+    switch (val->type) {
+    case XPATH_UNDEFINED:
+	break;
+    case XPATH_NODESET:
+    case XPATH_XSLT_TREE:
+	res = xmlXPathCastNodeSetToString(val->nodesetval);
+	break;
+    case XPATH_STRING:
+	return(val);
+    case XPATH_BOOLEAN:
+	res = xmlXPathCastBooleanToString(val->boolval);
+	break;
+    case XPATH_NUMBER:
+	res = xmlXPathCastNumberToString(val->floatval);
+	break;
+    case XPATH_USERS:
+	/* TODO */
+	break;
+    }
+    xmlXPathFreeObject(val);
+    if (res == NULL)
+	return(xmlXPathNewCString(""));
+    return(xmlXPathWrapString(res));
+}
+
+/**
+ * Converts a boolean to its number value
+ *
+ * @param val  a boolean
+ * @returns the number value
+ */
+double
+xmlXPathCastBooleanToNumber(int val) {
+    if (val)
+	return(1.0);
+    return(0.0);
+}
+
+/**
+ * Converts a string to its number value
+ *
+ * @param val  a string
+ * @returns the number value
+ */
+double
+xmlXPathCastStringToNumber(const xmlChar * val) {
+    return(xmlXPathStringEvalNumber(val));
+}
+
+/**
+ * Converts a node to its number value
+ *
+ * @param ctxt  XPath parser context
+ * @param node  a node
+ * @returns the number value
+ */
+static double
+xmlXPathNodeToNumberInternal(xmlXPathParserContextPtr ctxt, xmlNodePtr node) {
+    xmlChar *strval;
+    double ret;
+
+    if (node == NULL)
+	return(xmlXPathNAN);
+    strval = xmlXPathCastNodeToString(node);
+    if (strval == NULL) {
+        xmlXPathPErrMemory(ctxt);
+	return(xmlXPathNAN);
+    }
+    ret = xmlXPathCastStringToNumber(strval);
+    xmlFree(strval);
+
+    return(ret);
+}
+
+/**
+ * Converts a node to its number value
+ *
+ * @param node  a node
+ * @returns the number value
+ */
+double
+xmlXPathCastNodeToNumber (xmlNode *node) {
+    return(xmlXPathNodeToNumberInternal(NULL, node));
+}
+
+/**
+ * Converts a node-set to its number value
+ *
+ * @param ns  a node-set
+ * @returns the number value
+ */
+double
+xmlXPathCastNodeSetToNumber (xmlNodeSet *ns) {
+    xmlChar *str;
+    double ret;
+
+    if (ns == NULL)
+	return(xmlXPathNAN);
+    str = xmlXPathCastNodeSetToString(ns);
+    ret = xmlXPathCastStringToNumber(str);
+    xmlFree(str);
+    return(ret);
+}
+
+/**
+ * Converts an XPath object to its number value
+ *
+ * @param val  an XPath object
+ * @returns the number value
+ */
+double
+xmlXPathCastToNumber(xmlXPathObject *val) {
+    return(xmlXPathCastToNumberInternal(NULL, val));
+}
+
+/**
+ * Converts an existing object to its number() equivalent
+ *
+ * @param val  an XPath object
+ * @returns the new object, the old one is freed (or the operation
+ *         is done directly on `val`)
+ */
+xmlXPathObject *
+xmlXPathConvertNumber(xmlXPathObject *val) {
+    xmlXPathObjectPtr ret;
+
+    if (val == NULL)
+	return(xmlXPathNewFloat(0.0));
+    if (val->type == XPATH_NUMBER)
+	return(val);
+    ret = xmlXPathNewFloat(xmlXPathCastToNumber(val));
+    xmlXPathFreeObject(val);
+    return(ret);
+}
+
+/**
+ * Converts a number to its boolean value
+ *
+ * @param val  a number
+ * @returns the boolean value
+ */
+int
+xmlXPathCastNumberToBoolean (double val) {
+     if (xmlXPathIsNaN(val) || (val == 0.0))
+	 return(0);
+     return(1);
+}
+
+/**
+ * Converts a string to its boolean value
+ *
+ * @param val  a string
+ * @returns the boolean value
+ */
+int
+xmlXPathCastStringToBoolean (const xmlChar *val) {
+    if ((val == NULL) || (xmlStrlen(val) == 0))
+	return(0);
+    return(1);
+}
+
+/**
+ * Converts a node-set to its boolean value
+ *
+ * @param ns  a node-set
+ * @returns the boolean value
+ */
+int
+xmlXPathCastNodeSetToBoolean (xmlNodeSet *ns) {
+    if ((ns == NULL) || (ns->nodeNr == 0))
+	return(0);
+    return(1);
+}
+
+/**
+ * Converts an XPath object to its boolean value
+ *
+ * @param val  an XPath object
+ * @returns the boolean value
+ */
+int
+xmlXPathCastToBoolean (xmlXPathObject *val) {
+    int ret = 0;
+
+    if (val == NULL)
+	return(0);
+    switch (val->type) {
+    case XPATH_UNDEFINED:
+	ret = 0;
+	break;
+    case XPATH_NODESET:
+    case XPATH_XSLT_TREE:
+	ret = xmlXPathCastNodeSetToBoolean(val->nodesetval);
+	break;
+    case XPATH_STRING:
+	ret = xmlXPathCastStringToBoolean(val->stringval);
+	break;
+    case XPATH_NUMBER:
+	ret = xmlXPathCastNumberToBoolean(val->floatval);
+	break;
+    case XPATH_BOOLEAN:
+	ret = val->boolval;
+	break;
+    case XPATH_USERS:
+	/* TODO */
+	ret = 0;
+	break;
+    }
+    return(ret);
+}
+
+
+/**
+ * Converts an existing object to its boolean() equivalent
+ *
+ * @param val  an XPath object
+ * @returns the new object, the old one is freed (or the operation
+ *         is done directly on `val`)
+ */
+xmlXPathObject *
+xmlXPathConvertBoolean(xmlXPathObject *val) {
+    xmlXPathObjectPtr ret;
+
+    if (val == NULL)
+	return(xmlXPathNewBoolean(0));
+    if (val->type == XPATH_BOOLEAN)
+	return(val);
+    ret = xmlXPathNewBoolean(xmlXPathCastToBoolean(val));
+    xmlXPathFreeObject(val);
+    return(ret);
+}
+
+/************************************************************************
+ *									*
+ *		Routines to handle XPath contexts			*
+ *									*
+ ************************************************************************/
+
+/**
+ * Create a new xmlXPathContext
+ *
+ * @param doc  the XML document
+ * @returns the xmlXPathContext just allocated. The caller will need to free it.
+ */
+xmlXPathContext *
+xmlXPathNewContext(xmlDoc *doc) {
+    xmlXPathContextPtr ret;
+
+    ret = (xmlXPathContextPtr) xmlMalloc(sizeof(xmlXPathContext));
+    if (ret == NULL)
+	return(NULL);
+    memset(ret, 0 , sizeof(xmlXPathContext));
+    ret->doc = doc;
+    ret->node = NULL;
+
+    ret->varHash = NULL;
+
+    ret->nb_types = 0;
+    ret->max_types = 0;
+    ret->types = NULL;
+
+    ret->nb_axis = 0;
+    ret->max_axis = 0;
+    ret->axis = NULL;
+
+    ret->nsHash = NULL;
+    ret->user = NULL;
+
+    ret->contextSize = -1;
+    ret->proximityPosition = -1;
+
+#ifdef XP_DEFAULT_CACHE_ON
+    if (xmlXPathContextSetCache(ret, 1, -1, 0) == -1) {
+	xmlXPathFreeContext(ret);
+	return(NULL);
+    }
+#endif
+
+    return(ret);
+}
+
+/**
+ * Free up an xmlXPathContext
+ *
+ * @param ctxt  the context to free
+ */
+void
+xmlXPathFreeContext(xmlXPathContext *ctxt) {
+    if (ctxt == NULL) return;
+
+    if (ctxt->cache != NULL)
+	xmlXPathFreeCache((xmlXPathContextCachePtr) ctxt->cache);
+    xmlXPathFreeResultCache(ctxt);
+    xmlXPathRegisteredNsCleanup(ctxt);
+    xmlXPathRegisteredFuncsCleanup(ctxt);
+    xmlXPathRegisteredVariablesCleanup(ctxt);
+    xmlResetError(&ctxt->lastError);
+    xmlFree(ctxt);
+}
+
+/**
+ * Register a callback function that will be called on errors and
+ * warnings. If handler is NULL, the error handler will be deactivated.
+ *
+ * @since 2.13.0
+ * @param ctxt  the XPath context
+ * @param handler  error handler
+ * @param data  user data which will be passed to the handler
+ */
+void
+xmlXPathSetErrorHandler(xmlXPathContext *ctxt,
+                        xmlStructuredErrorFunc handler, void *data) {
+    if (ctxt == NULL)
+        return;
+
+    ctxt->error = handler;
+    ctxt->userData = data;
+}
+
+/************************************************************************
+ *									*
+ *		Routines to handle XPath parser contexts		*
+ *									*
+ ************************************************************************/
+
+/**
+ * Create a new xmlXPathParserContext
+ *
+ * @param str  the XPath expression
+ * @param ctxt  the XPath context
+ * @returns the xmlXPathParserContext just allocated.
+ */
+xmlXPathParserContext *
+xmlXPathNewParserContext(const xmlChar *str, xmlXPathContext *ctxt) {
+    xmlXPathParserContextPtr ret;
+
+    ret = (xmlXPathParserContextPtr) xmlMalloc(sizeof(xmlXPathParserContext));
+    if (ret == NULL) {
+        xmlXPathErrMemory(ctxt);
+	return(NULL);
+    }
+    memset(ret, 0 , sizeof(xmlXPathParserContext));
+    ret->cur = ret->base = str;
+    ret->context = ctxt;
+
+    ret->comp = xmlXPathNewCompExpr();
+    if (ret->comp == NULL) {
+        xmlXPathErrMemory(ctxt);
+	xmlFree(ret->valueTab);
+	xmlFree(ret);
+	return(NULL);
+    }
+    if ((ctxt != NULL) && (ctxt->dict != NULL)) {
+        ret->comp->dict = ctxt->dict;
+	xmlDictReference(ret->comp->dict);
+    }
+
+    return(ret);
+}
+
+/**
+ * Create a new xmlXPathParserContext when processing a compiled expression
+ *
+ * @param comp  the XPath compiled expression
+ * @param ctxt  the XPath context
+ * @returns the xmlXPathParserContext just allocated.
+ */
+static xmlXPathParserContextPtr
+xmlXPathCompParserContext(xmlXPathCompExprPtr comp, xmlXPathContextPtr ctxt) {
+    xmlXPathParserContextPtr ret;
+
+    ret = (xmlXPathParserContextPtr) xmlMalloc(sizeof(xmlXPathParserContext));
+    if (ret == NULL) {
+        xmlXPathErrMemory(ctxt);
+	return(NULL);
+    }
+    memset(ret, 0 , sizeof(xmlXPathParserContext));
+
+    /* Allocate the value stack */
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+    ret->valueMax = 1;
+#else
+    ret->valueMax = 10;
+#endif
+    ret->valueTab = xmlMalloc(ret->valueMax * sizeof(xmlXPathObjectPtr));
+    if (ret->valueTab == NULL) {
+	xmlFree(ret);
+	xmlXPathErrMemory(ctxt);
+	return(NULL);
+    }
+    ret->valueNr = 0;
+    ret->value = NULL;
+
+    ret->context = ctxt;
+    ret->comp = comp;
+
+    return(ret);
+}
+
+/**
+ * Free up an xmlXPathParserContext
+ *
+ * @param ctxt  the context to free
+ */
+void
+xmlXPathFreeParserContext(xmlXPathParserContext *ctxt) {
+    int i;
+
+    if (ctxt == NULL)
+        return;
+
+    if (ctxt->valueTab != NULL) {
+        for (i = 0; i < ctxt->valueNr; i++) {
+            if (ctxt->context)
+                xmlXPathReleaseObject(ctxt->context, ctxt->valueTab[i]);
+            else
+                xmlXPathFreeObject(ctxt->valueTab[i]);
+        }
+        xmlFree(ctxt->valueTab);
+    }
+    if (ctxt->comp != NULL) {
+#ifdef XPATH_STREAMING
+	if (ctxt->comp->stream != NULL) {
+	    xmlFreePatternList(ctxt->comp->stream);
+	    ctxt->comp->stream = NULL;
+	}
+#endif
+	xmlXPathFreeCompExpr(ctxt->comp);
+    }
+    xmlFree(ctxt);
+}
+
+/************************************************************************
+ *									*
+ *		The implicit core function library			*
+ *									*
+ ************************************************************************/
+
+/**
+ * Function computing the beginning of the string value of the node,
+ * used to speed up comparisons
+ *
+ * @param node  a node pointer
+ * @returns an int usable as a hash
+ */
+static unsigned int
+xmlXPathNodeValHash(xmlNodePtr node) {
+    int len = 2;
+    const xmlChar * string = NULL;
+    xmlNodePtr tmp = NULL;
+    unsigned int ret = 0;
+
+    if (node == NULL)
+	return(0);
+
+    if (node->type == XML_DOCUMENT_NODE) {
+	tmp = xmlDocGetRootElement((xmlDocPtr) node);
+	if (tmp == NULL)
+	    node = node->children;
+	else
+	    node = tmp;
+
+	if (node == NULL)
+	    return(0);
+    }
+
+    switch (node->type) {
+	case XML_COMMENT_NODE:
+	case XML_PI_NODE:
+	case XML_CDATA_SECTION_NODE:
+	case XML_TEXT_NODE:
+	    string = node->content;
+	    if (string == NULL)
+		return(0);
+	    if (string[0] == 0)
+		return(0);
+	    return(string[0] + (string[1] << 8));
+	case XML_NAMESPACE_DECL:
+	    string = ((xmlNsPtr)node)->href;
+	    if (string == NULL)
+		return(0);
+	    if (string[0] == 0)
+		return(0);
+	    return(string[0] + (string[1] << 8));
+	case XML_ATTRIBUTE_NODE:
+	    tmp = ((xmlAttrPtr) node)->children;
+	    break;
+	case XML_ELEMENT_NODE:
+            if (XML_LAZY_DOC(node->doc))
+                xmlLazyMaterialize(node,
+                                   XML_LAZY_CONTENT | XML_LAZY_RECURSIVE);
+	    tmp = node->children;
+	    break;
+	default:
+	    return(0);
+    }
+    while (tmp != NULL) {
+	switch (tmp->type) {
+	    case XML_CDATA_SECTION_NODE:
+	    case XML_TEXT_NODE:
+		string = tmp->content;
+		break;
+	    default:
+                string = NULL;
+		break;
+	}
+	if ((string != NULL) && (string[0] != 0)) {
+	    if (len == 1) {
+		return(ret + (string[0] << 8));
+	    }
+	    if (string[1] == 0) {
+		len = 1;
+		ret = string[0];
+	    } else {
+		return(string[0] + (string[1] << 8));
+	    }
+	}
+	/*
+	 * Skip to next node
+	 */
+        if ((tmp->children != NULL) &&
+            (tmp->type != XML_DTD_NODE) &&
+            (tmp->type != XML_ENTITY_REF_NODE) &&
+            (tmp->children->type != XML_ENTITY_DECL)) {
+            tmp = tmp->children;
+            continue;
+	}
+	if (tmp == node)
+	    break;
+
+	if (tmp->next != NULL) {
+	    tmp = tmp->next;
+	    continue;
+	}
+
+	do {
+	    tmp = tmp->parent;
+	    if (tmp == NULL)
+		break;
+	    if (tmp == node) {
+		tmp = NULL;
+		break;
+	    }
+	    if (tmp->next != NULL) {
+		tmp = tmp->next;
+		break;
+	    }
+	} while (tmp != NULL);
+    }
+    return(ret);
+}
+
+/**
+ * Function computing the beginning of the string value of the node,
+ * used to speed up comparisons
+ *
+ * @param string  a string
+ * @returns an int usable as a hash
+ */
+static unsigned int
+xmlXPathStringHash(const xmlChar * string) {
+    if (string == NULL)
+	return(0);
+    if (string[0] == 0)
+	return(0);
+    return(string[0] + (string[1] << 8));
+}
+
+/**
+ * Implement the compare operation between a nodeset and a number
+ *     `ns` < `val`    (1, 1, ...
+ *     `ns` <= `val`   (1, 0, ...
+ *     `ns` > `val`    (0, 1, ...
+ *     `ns` >= `val`   (0, 0, ...
+ *
+ * If one object to be compared is a node-set and the other is a number,
+ * then the comparison will be true if and only if there is a node in the
+ * node-set such that the result of performing the comparison on the number
+ * to be compared and on the result of converting the string-value of that
+ * node to a number using the number function is true.
+ *
+ * @param ctxt  the XPath Parser context
+ * @param inf  less than (1) or greater than (0)
+ * @param strict  is the comparison strict
+ * @param arg  the node set
+ * @param f  the value
+ * @returns 0 or 1 depending on the results of the test.
+ */
+static int
+xmlXPathCompareNodeSetFloat(xmlXPathParserContextPtr ctxt, int inf, int strict,
+	                    xmlXPathObjectPtr arg, xmlXPathObjectPtr f) {
+    int i, ret = 0;
+    xmlNodeSetPtr ns;
+    xmlChar *str2;
+
+    if ((f == NULL) || (arg == NULL) ||
+	((arg->type != XPATH_NODESET) && (arg->type != XPATH_XSLT_TREE))) {
+	xmlXPathReleaseObject(ctxt->context, arg);
+	xmlXPathReleaseObject(ctxt->context, f);
+        return(0);
+    }
+    ns = arg->nodesetval;
+    if (ns != NULL) {
+	for (i = 0;i < ns->nodeNr;i++) {
+	     str2 = xmlXPathCastNodeToString(ns->nodeTab[i]);
+	     if (str2 != NULL) {
+		 xmlXPathValuePush(ctxt, xmlXPathCacheNewString(ctxt, str2));
+		 xmlFree(str2);
+		 xmlXPathNumberFunction(ctxt, 1);
+		 xmlXPathValuePush(ctxt, xmlXPathCacheObjectCopy(ctxt, f));
+		 ret = xmlXPathCompareValues(ctxt, inf, strict);
+		 if (ret)
+		     break;
+	     } else {
+                 xmlXPathPErrMemory(ctxt);
+             }
+	}
+    }
+    xmlXPathReleaseObject(ctxt->context, arg);
+    xmlXPathReleaseObject(ctxt->context, f);
+    return(ret);
+}
+
+/**
+ * Implement the compare operation between a nodeset and a string
+ *     `ns` < `val`    (1, 1, ...
+ *     `ns` <= `val`   (1, 0, ...
+ *     `ns` > `val`    (0, 1, ...
+ *     `ns` >= `val`   (0, 0, ...
+ *
+ * If one object to be compared is a node-set and the other is a string,
+ * then the comparison will be true if and only if there is a node in
+ * the node-set such that the result of performing the comparison on the
+ * string-value of the node and the other string is true.
+ *
+ * @param ctxt  the XPath Parser context
+ * @param inf  less than (1) or greater than (0)
+ * @param strict  is the comparison strict
+ * @param arg  the node set
+ * @param s  the value
+ * @returns 0 or 1 depending on the results of the test.
+ */
+static int
+xmlXPathCompareNodeSetString(xmlXPathParserContextPtr ctxt, int inf, int strict,
+	                    xmlXPathObjectPtr arg, xmlXPathObjectPtr s) {
+    int i, ret = 0;
+    xmlNodeSetPtr ns;
+    xmlChar *str2;
+
+    if ((s == NULL) || (arg == NULL) ||
+	((arg->type != XPATH_NODESET) && (arg->type != XPATH_XSLT_TREE))) {
+	xmlXPathReleaseObject(ctxt->context, arg);
+	xmlXPathReleaseObject(ctxt->context, s);
+        return(0);
+    }
+    ns = arg->nodesetval;
+    if (ns != NULL) {
+	for (i = 0;i < ns->nodeNr;i++) {
+	     str2 = xmlXPathCastNodeToString(ns->nodeTab[i]);
+	     if (str2 != NULL) {
+		 xmlXPathValuePush(ctxt,
+			   xmlXPathCacheNewString(ctxt, str2));
+		 xmlFree(str2);
+		 xmlXPathValuePush(ctxt, xmlXPathCacheObjectCopy(ctxt, s));
+		 ret = xmlXPathCompareValues(ctxt, inf, strict);
+		 if (ret)
+		     break;
+	     } else {
+                 xmlXPathPErrMemory(ctxt);
+             }
+	}
+    }
+    xmlXPathReleaseObject(ctxt->context, arg);
+    xmlXPathReleaseObject(ctxt->context, s);
+    return(ret);
+}
+
+/**
+ * Implement the compare operation on nodesets:
+ *
+ * If both objects to be compared are node-sets, then the comparison
+ * will be true if and only if there is a node in the first node-set
+ * and a node in the second node-set such that the result of performing
+ * the comparison on the string-values of the two nodes is true.
+ * ....
+ * When neither object to be compared is a node-set and the operator
+ * is <=, <, >= or >, then the objects are compared by converting both
+ * objects to numbers and comparing the numbers according to IEEE 754.
+ * ....
+ * The number function converts its argument to a number as follows:
+ *  - a string that consists of optional whitespace followed by an
+ *    optional minus sign followed by a Number followed by whitespace
+ *    is converted to the IEEE 754 number that is nearest (according
+ *    to the IEEE 754 round-to-nearest rule) to the mathematical value
+ *    represented by the string; any other string is converted to NaN
+ *
+ * Conclusion all nodes need to be converted first to their string value
+ * and then the comparison must be done when possible
+ *
+ * @param ctxt  XPath parser context
+ * @param inf  less than (1) or greater than (0)
+ * @param strict  is the comparison strict
+ * @param arg1  the first node set object
+ * @param arg2  the second node set object
+ */
+static int
+xmlXPathCompareNodeSets(xmlXPathParserContextPtr ctxt, int inf, int strict,
+	                xmlXPathObjectPtr arg1, xmlXPathObjectPtr arg2) {
+    int i, j, init = 0;
+    double val1;
+    double *values2;
+    int ret = 0;
+    xmlNodeSetPtr ns1;
+    xmlNodeSetPtr ns2;
+
+    if ((arg1 == NULL) ||
+	((arg1->type != XPATH_NODESET) && (arg1->type != XPATH_XSLT_TREE))) {
+	xmlXPathFreeObject(arg2);
+        return(0);
+    }
+    if ((arg2 == NULL) ||
+	((arg2->type != XPATH_NODESET) && (arg2->type != XPATH_XSLT_TREE))) {
+	xmlXPathFreeObject(arg1);
+	xmlXPathFreeObject(arg2);
+        return(0);
+    }
+
+    ns1 = arg1->nodesetval;
+    ns2 = arg2->nodesetval;
+
+    if ((ns1 == NULL) || (ns1->nodeNr <= 0)) {
+	xmlXPathFreeObject(arg1);
+	xmlXPathFreeObject(arg2);
+	return(0);
+    }
+    if ((ns2 == NULL) || (ns2->nodeNr <= 0)) {
+	xmlXPathFreeObject(arg1);
+	xmlXPathFreeObject(arg2);
+	return(0);
+    }
+
+    values2 = (double *) xmlMalloc(ns2->nodeNr * sizeof(double));
+    if (values2 == NULL) {
+        xmlXPathPErrMemory(ctxt);
+	xmlXPathFreeObject(arg1);
+	xmlXPathFreeObject(arg2);
+	return(0);
+    }
+    for (i = 0;i < ns1->nodeNr;i++) {
+	val1 = xmlXPathNodeToNumberInternal(ctxt, ns1->nodeTab[i]);
+	if (xmlXPathIsNaN(val1))
+	    continue;
+	for (j = 0;j < ns2->nodeNr;j++) {
+	    if (init == 0) {
+		values2[j] = xmlXPathNodeToNumberInternal(ctxt,
+                                                          ns2->nodeTab[j]);
+	    }
+	    if (xmlXPathIsNaN(values2[j]))
+		continue;
+	    if (inf && strict)
+		ret = (val1 < values2[j]);
+	    else if (inf && !strict)
+		ret = (val1 <= values2[j]);
+	    else if (!inf && strict)
+		ret = (val1 > values2[j]);
+	    else if (!inf && !strict)
+		ret = (val1 >= values2[j]);
+	    if (ret)
+		break;
+	}
+	if (ret)
+	    break;
+	init = 1;
+    }
+    xmlFree(values2);
+    xmlXPathFreeObject(arg1);
+    xmlXPathFreeObject(arg2);
+    return(ret);
+}
+
+/**
+ * Implement the compare operation between a nodeset and a value
+ *     `ns` < `val`    (1, 1, ...
+ *     `ns` <= `val`   (1, 0, ...
+ *     `ns` > `val`    (0, 1, ...
+ *     `ns` >= `val`   (0, 0, ...
+ *
+ * If one object to be compared is a node-set and the other is a boolean,
+ * then the comparison will be true if and only if the result of performing
+ * the comparison on the boolean and on the result of converting
+ * the node-set to a boolean using the boolean function is true.
+ *
+ * @param ctxt  the XPath Parser context
+ * @param inf  less than (1) or greater than (0)
+ * @param strict  is the comparison strict
+ * @param arg  the node set
+ * @param val  the value
+ * @returns 0 or 1 depending on the results of the test.
+ */
+static int
+xmlXPathCompareNodeSetValue(xmlXPathParserContextPtr ctxt, int inf, int strict,
+	                    xmlXPathObjectPtr arg, xmlXPathObjectPtr val) {
+    if ((val == NULL) || (arg == NULL) ||
+	((arg->type != XPATH_NODESET) && (arg->type != XPATH_XSLT_TREE)))
+        return(0);
+
+    switch(val->type) {
+        case XPATH_NUMBER:
+	    return(xmlXPathCompareNodeSetFloat(ctxt, inf, strict, arg, val));
+        case XPATH_NODESET:
+        case XPATH_XSLT_TREE:
+	    return(xmlXPathCompareNodeSets(ctxt, inf, strict, arg, val));
+        case XPATH_STRING:
+	    return(xmlXPathCompareNodeSetString(ctxt, inf, strict, arg, val));
+        case XPATH_BOOLEAN:
+	    xmlXPathValuePush(ctxt, arg);
+	    xmlXPathBooleanFunction(ctxt, 1);
+	    xmlXPathValuePush(ctxt, val);
+	    return(xmlXPathCompareValues(ctxt, inf, strict));
+	default:
+            xmlXPathReleaseObject(ctxt->context, arg);
+            xmlXPathReleaseObject(ctxt->context, val);
+            XP_ERROR0(XPATH_INVALID_TYPE);
+    }
+    return(0);
+}
+
+/**
+ * Implement the equal operation on XPath objects content: `arg1` == `arg2`
+ * If one object to be compared is a node-set and the other is a string,
+ * then the comparison will be true if and only if there is a node in
+ * the node-set such that the result of performing the comparison on the
+ * string-value of the node and the other string is true.
+ *
+ * @param ctxt  XPath parser context
+ * @param arg  the nodeset object argument
+ * @param str  the string to compare to.
+ * @param neq  flag to show whether for '=' (0) or '!=' (1)
+ * @returns 0 or 1 depending on the results of the test.
+ */
+static int
+xmlXPathEqualNodeSetString(xmlXPathParserContextPtr ctxt,
+                           xmlXPathObjectPtr arg, const xmlChar * str, int neq)
+{
+    int i;
+    xmlNodeSetPtr ns;
+    xmlChar *str2;
+    unsigned int hash;
+
+    if ((str == NULL) || (arg == NULL) ||
+        ((arg->type != XPATH_NODESET) && (arg->type != XPATH_XSLT_TREE)))
+        return (0);
+    ns = arg->nodesetval;
+    /*
+     * A NULL nodeset compared with a string is always false
+     * (since there is no node equal, and no node not equal)
+     */
+    if ((ns == NULL) || (ns->nodeNr <= 0) )
+        return (0);
+    hash = xmlXPathStringHash(str);
+    for (i = 0; i < ns->nodeNr; i++) {
+        if (xmlXPathNodeValHash(ns->nodeTab[i]) == hash) {
+            str2 = xmlNodeGetContent(ns->nodeTab[i]);
+            if (str2 == NULL) {
+                xmlXPathPErrMemory(ctxt);
+                return(0);
+            }
+            if (xmlStrEqual(str, str2)) {
+                xmlFree(str2);
+		if (neq)
+		    continue;
+                return (1);
+            } else if (neq) {
+		xmlFree(str2);
+		return (1);
+	    }
+            xmlFree(str2);
+        } else if (neq)
+	    return (1);
+    }
+    return (0);
+}
+
+/**
+ * Implement the equal operation on XPath objects content: `arg1` == `arg2`
+ * If one object to be compared is a node-set and the other is a number,
+ * then the comparison will be true if and only if there is a node in
+ * the node-set such that the result of performing the comparison on the
+ * number to be compared and on the result of converting the string-value
+ * of that node to a number using the number function is true.
+ *
+ * @param ctxt  XPath parser context
+ * @param arg  the nodeset object argument
+ * @param f  the float to compare to
+ * @param neq  flag to show whether to compare '=' (0) or '!=' (1)
+ * @returns 0 or 1 depending on the results of the test.
+ */
+static int
+xmlXPathEqualNodeSetFloat(xmlXPathParserContextPtr ctxt,
+    xmlXPathObjectPtr arg, double f, int neq) {
+  int i, ret=0;
+  xmlNodeSetPtr ns;
+  xmlChar *str2;
+  xmlXPathObjectPtr val;
+  double v;
+
+    if ((arg == NULL) ||
+	((arg->type != XPATH_NODESET) && (arg->type != XPATH_XSLT_TREE)))
+        return(0);
+
+    ns = arg->nodesetval;
+    if (ns != NULL) {
+	for (i=0;i<ns->nodeNr;i++) {
+	    str2 = xmlXPathCastNodeToString(ns->nodeTab[i]);
+	    if (str2 != NULL) {
+		xmlXPathValuePush(ctxt, xmlXPathCacheNewString(ctxt, str2));
+		xmlFree(str2);
+		xmlXPathNumberFunction(ctxt, 1);
+                CHECK_ERROR0;
+		val = xmlXPathValuePop(ctxt);
+		v = val->floatval;
+		xmlXPathReleaseObject(ctxt->context, val);
+		if (!xmlXPathIsNaN(v)) {
+		    if ((!neq) && (v==f)) {
+			ret = 1;
+			break;
+		    } else if ((neq) && (v!=f)) {
+			ret = 1;
+			break;
+		    }
+		} else {	/* NaN is unequal to any value */
+		    if (neq)
+			ret = 1;
+		}
+	    } else {
+                xmlXPathPErrMemory(ctxt);
+            }
+	}
+    }
+
+    return(ret);
+}
+
+
+/**
+ * Implement the equal / not equal operation on XPath nodesets:
+ * `arg1` == `arg2`  or  `arg1` != `arg2`
+ * If both objects to be compared are node-sets, then the comparison
+ * will be true if and only if there is a node in the first node-set and
+ * a node in the second node-set such that the result of performing the
+ * comparison on the string-values of the two nodes is true.
+ *
+ * (needless to say, this is a costly operation)
+ *
+ * @param ctxt  XPath parser context
+ * @param arg1  first nodeset object argument
+ * @param arg2  second nodeset object argument
+ * @param neq  flag to show whether to test '=' (0) or '!=' (1)
+ * @returns 0 or 1 depending on the results of the test.
+ */
+static int
+xmlXPathEqualNodeSets(xmlXPathParserContextPtr ctxt, xmlXPathObjectPtr arg1,
+                      xmlXPathObjectPtr arg2, int neq) {
+    int i, j;
+    unsigned int *hashs1;
+    unsigned int *hashs2;
+    xmlChar **values1;
+    xmlChar **values2;
+    int ret = 0;
+    xmlNodeSetPtr ns1;
+    xmlNodeSetPtr ns2;
+
+    if ((arg1 == NULL) ||
+	((arg1->type != XPATH_NODESET) && (arg1->type != XPATH_XSLT_TREE)))
+        return(0);
+    if ((arg2 == NULL) ||
+	((arg2->type != XPATH_NODESET) && (arg2->type != XPATH_XSLT_TREE)))
+        return(0);
+
+    ns1 = arg1->nodesetval;
+    ns2 = arg2->nodesetval;
+
+    if ((ns1 == NULL) || (ns1->nodeNr <= 0))
+	return(0);
+    if ((ns2 == NULL) || (ns2->nodeNr <= 0))
+	return(0);
+
+    /*
+     * for equal, check if there is a node pertaining to both sets
+     */
+    if (neq == 0)
+	for (i = 0;i < ns1->nodeNr;i++)
+	    for (j = 0;j < ns2->nodeNr;j++)
+		if (ns1->nodeTab[i] == ns2->nodeTab[j])
+		    return(1);
+
+    values1 = (xmlChar **) xmlMalloc(ns1->nodeNr * sizeof(xmlChar *));
+    if (values1 == NULL) {
+        xmlXPathPErrMemory(ctxt);
+	return(0);
+    }
+    hashs1 = (unsigned int *) xmlMalloc(ns1->nodeNr * sizeof(unsigned int));
+    if (hashs1 == NULL) {
+        xmlXPathPErrMemory(ctxt);
+	xmlFree(values1);
+	return(0);
+    }
+    memset(values1, 0, ns1->nodeNr * sizeof(xmlChar *));
+    values2 = (xmlChar **) xmlMalloc(ns2->nodeNr * sizeof(xmlChar *));
+    if (values2 == NULL) {
+        xmlXPathPErrMemory(ctxt);
+	xmlFree(hashs1);
+	xmlFree(values1);
+	return(0);
+    }
+    hashs2 = (unsigned int *) xmlMalloc(ns2->nodeNr * sizeof(unsigned int));
+    if (hashs2 == NULL) {
+        xmlXPathPErrMemory(ctxt);
+	xmlFree(hashs1);
+	xmlFree(values1);
+	xmlFree(values2);
+	return(0);
+    }
+    memset(values2, 0, ns2->nodeNr * sizeof(xmlChar *));
+    for (i = 0;i < ns1->nodeNr;i++) {
+	hashs1[i] = xmlXPathNodeValHash(ns1->nodeTab[i]);
+	for (j = 0;j < ns2->nodeNr;j++) {
+	    if (i == 0)
+		hashs2[j] = xmlXPathNodeValHash(ns2->nodeTab[j]);
+	    if (hashs1[i] != hashs2[j]) {
+		if (neq) {
+		    ret = 1;
+		    break;
+		}
+	    }
+	    else {
+		if (values1[i] == NULL) {
+		    values1[i] = xmlNodeGetContent(ns1->nodeTab[i]);
+                    if (values1[i] == NULL)
+                        xmlXPathPErrMemory(ctxt);
+                }
+		if (values2[j] == NULL) {
+		    values2[j] = xmlNodeGetContent(ns2->nodeTab[j]);
+                    if (values2[j] == NULL)
+                        xmlXPathPErrMemory(ctxt);
+                }
+		ret = xmlStrEqual(values1[i], values2[j]) ^ neq;
+		if (ret)
+		    break;
+	    }
+	}
+	if (ret)
+	    break;
+    }
+    for (i = 0;i < ns1->nodeNr;i++)
+	if (values1[i] != NULL)
+	    xmlFree(values1[i]);
+    for (j = 0;j < ns2->nodeNr;j++)
+	if (values2[j] != NULL)
+	    xmlFree(values2[j]);
+    xmlFree(values1);
+    xmlFree(values2);
+    xmlFree(hashs1);
+    xmlFree(hashs2);
+    return(ret);
+}
+
+static int
+xmlXPathEqualValuesCommon(xmlXPathParserContextPtr ctxt,
+  xmlXPathObjectPtr arg1, xmlXPathObjectPtr arg2) {
+    int ret = 0;
+    /*
+     *At this point we are assured neither arg1 nor arg2
+     *is a nodeset, so we can just pick the appropriate routine.
+     */
+    switch (arg1->type) {
+        case XPATH_UNDEFINED:
+	    break;
+        case XPATH_BOOLEAN:
+	    switch (arg2->type) {
+	        case XPATH_UNDEFINED:
+		    break;
+		case XPATH_BOOLEAN:
+		    ret = (arg1->boolval == arg2->boolval);
+		    break;
+		case XPATH_NUMBER:
+		    ret = (arg1->boolval ==
+			   xmlXPathCastNumberToBoolean(arg2->floatval));
+		    break;
+		case XPATH_STRING:
+		    if ((arg2->stringval == NULL) ||
+			(arg2->stringval[0] == 0)) ret = 0;
+		    else
+			ret = 1;
+		    ret = (arg1->boolval == ret);
+		    break;
+		case XPATH_USERS:
+		    /* TODO */
+		    break;
+		case XPATH_NODESET:
+		case XPATH_XSLT_TREE:
+		    break;
+	    }
+	    break;
+        case XPATH_NUMBER:
+	    switch (arg2->type) {
+	        case XPATH_UNDEFINED:
+		    break;
+		case XPATH_BOOLEAN:
+		    ret = (arg2->boolval==
+			   xmlXPathCastNumberToBoolean(arg1->floatval));
+		    break;
+		case XPATH_STRING:
+		    xmlXPathValuePush(ctxt, arg2);
+		    xmlXPathNumberFunction(ctxt, 1);
+		    arg2 = xmlXPathValuePop(ctxt);
+                    if (ctxt->error)
+                        break;
+                    /* Falls through. */
+		case XPATH_NUMBER:
+		    /* Hand check NaN and Infinity equalities */
+		    if (xmlXPathIsNaN(arg1->floatval) ||
+			    xmlXPathIsNaN(arg2->floatval)) {
+		        ret = 0;
+		    } else if (xmlXPathIsInf(arg1->floatval) == 1) {
+		        if (xmlXPathIsInf(arg2->floatval) == 1)
+			    ret = 1;
+			else
+			    ret = 0;
+		    } else if (xmlXPathIsInf(arg1->floatval) == -1) {
+			if (xmlXPathIsInf(arg2->floatval) == -1)
+			    ret = 1;
+			else
+			    ret = 0;
+		    } else if (xmlXPathIsInf(arg2->floatval) == 1) {
+			if (xmlXPathIsInf(arg1->floatval) == 1)
+			    ret = 1;
+			else
+			    ret = 0;
+		    } else if (xmlXPathIsInf(arg2->floatval) == -1) {
+			if (xmlXPathIsInf(arg1->floatval) == -1)
+			    ret = 1;
+			else
+			    ret = 0;
+		    } else {
+		        ret = (arg1->floatval == arg2->floatval);
+		    }
+		    break;
+		case XPATH_USERS:
+		    /* TODO */
+		    break;
+		case XPATH_NODESET:
+		case XPATH_XSLT_TREE:
+		    break;
+	    }
+	    break;
+        case XPATH_STRING:
+	    switch (arg2->type) {
+	        case XPATH_UNDEFINED:
+		    break;
+		case XPATH_BOOLEAN:
+		    if ((arg1->stringval == NULL) ||
+			(arg1->stringval[0] == 0)) ret = 0;
+		    else
+			ret = 1;
+		    ret = (arg2->boolval == ret);
+		    break;
+		case XPATH_STRING:
+		    ret = xmlStrEqual(arg1->stringval, arg2->stringval);
+		    break;
+		case XPATH_NUMBER:
+		    xmlXPathValuePush(ctxt, arg1);
+		    xmlXPathNumberFunction(ctxt, 1);
+		    arg1 = xmlXPathValuePop(ctxt);
+                    if (ctxt->error)
+                        break;
+		    /* Hand check NaN and Infinity equalities */
+		    if (xmlXPathIsNaN(arg1->floatval) ||
+			    xmlXPathIsNaN(arg2->floatval)) {
+		        ret = 0;
+		    } else if (xmlXPathIsInf(arg1->floatval) == 1) {
+			if (xmlXPathIsInf(arg2->floatval) == 1)
+			    ret = 1;
+			else
+			    ret = 0;
+		    } else if (xmlXPathIsInf(arg1->floatval) == -1) {
+			if (xmlXPathIsInf(arg2->floatval) == -1)
+			    ret = 1;
+			else
+			    ret = 0;
+		    } else if (xmlXPathIsInf(arg2->floatval) == 1) {
+			if (xmlXPathIsInf(arg1->floatval) == 1)
+			    ret = 1;
+			else
+			    ret = 0;
+		    } else if (xmlXPathIsInf(arg2->floatval) == -1) {
+			if (xmlXPathIsInf(arg1->floatval) == -1)
+			    ret = 1;
+			else
+			    ret = 0;
+		    } else {
+		        ret = (arg1->floatval == arg2->floatval);
+		    }
+		    break;
+		case XPATH_USERS:
+		    /* TODO */
+		    break;
+		case XPATH_NODESET:
+		case XPATH_XSLT_TREE:
+		    break;
+	    }
+	    break;
+        case XPATH_USERS:
+	    /* TODO */
+	    break;
+	case XPATH_NODESET:
+	case XPATH_XSLT_TREE:
+	    break;
     }
-#endif
-
+    xmlXPathReleaseObject(ctxt->context, arg1);
+    xmlXPathReleaseObject(ctxt->context, arg2);
     return(ret);
 }
 
 /**
- * Free up an xmlXPathContext
- *
- * @param ctxt  the context to free
- */
-void
-xmlXPathFreeContext(xmlXPathContext *ctxt) {
-    if (ctxt == NULL) return;
-
-    if (ctxt->cache != NULL)
-	xmlXPathFreeCache((xmlXPathContextCachePtr) ctxt->cache);
-    xmlXPathRegisteredNsCleanup(ctxt);
-    xmlXPathRegisteredFuncsCleanup(ctxt);
-    xmlXPathRegisteredVariablesCleanup(ctxt);
-    xmlResetError(&ctxt->lastError);
-    xmlFree(ctxt);
-}
-
-/**
- * Register a callback function that will be called on errors and
- * warnings. If handler is NULL, the error handler will be deactivated.
- *
- * @since 2.13.0
- * @param ctxt  the XPath context
- * @param handler  error handler
- * @param data  user data which will be passed to the handler
- */
-void
-xmlXPathSetErrorHandler(xmlXPathContext *ctxt,
-                        xmlStructuredErrorFunc handler, void *data) {
-    if (ctxt == NULL)
-        return;
-
-    ctxt->error = handler;
-    ctxt->userData = data;
-}
-
-/************************************************************************
- *									*
- *		Routines to handle XPath parser contexts		*
- *									*
- ************************************************************************/
-
-/**
- * Create a new xmlXPathParserContext
+ * Implement the equal operation on XPath objects content: `arg1` == `arg2`
  *
- * @param str  the XPath expression
- * @param ctxt  the XPath context
- * @returns the xmlXPathParserContext just allocated.
+ * @param ctxt  the XPath Parser context
+ * @returns 0 or 1 depending on the results of the test.
  */
-xmlXPathParserContext *
-xmlXPathNewParserContext(const xmlChar *str, xmlXPathContext *ctxt) {
-    xmlXPathParserContextPtr ret;
+int
+xmlXPathEqualValues(xmlXPathParserContext *ctxt) {
+    xmlXPathObjectPtr arg1, arg2, argtmp;
+    int ret = 0;
 
-    ret = (xmlXPathParserContextPtr) xmlMalloc(sizeof(xmlXPathParserContext));
-    if (ret == NULL) {
-        xmlXPathErrMemory(ctxt);
-	return(NULL);
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(0);
+    arg2 = xmlXPathValuePop(ctxt);
+    arg1 = xmlXPathValuePop(ctxt);
+    if ((arg1 == NULL) || (arg2 == NULL)) {
+	if (arg1 != NULL)
+	    xmlXPathReleaseObject(ctxt->context, arg1);
+	else
+	    xmlXPathReleaseObject(ctxt->context, arg2);
+	XP_ERROR0(XPATH_INVALID_OPERAND);
     }
-    memset(ret, 0 , sizeof(xmlXPathParserContext));
-    ret->cur = ret->base = str;
-    ret->context = ctxt;
 
-    ret->comp = xmlXPathNewCompExpr();
-    if (ret->comp == NULL) {
-        xmlXPathErrMemory(ctxt);
-	xmlFree(ret->valueTab);
-	xmlFree(ret);
-	return(NULL);
+    if (arg1 == arg2) {
+	xmlXPathFreeObject(arg1);
+        return(1);
     }
-    if ((ctxt != NULL) && (ctxt->dict != NULL)) {
-        ret->comp->dict = ctxt->dict;
-	xmlDictReference(ret->comp->dict);
+
+    /*
+     *If either argument is a nodeset, it's a 'special case'
+     */
+    if ((arg2->type == XPATH_NODESET) || (arg2->type == XPATH_XSLT_TREE) ||
+      (arg1->type == XPATH_NODESET) || (arg1->type == XPATH_XSLT_TREE)) {
+	/*
+	 *Hack it to assure arg1 is the nodeset
+	 */
+	if ((arg1->type != XPATH_NODESET) && (arg1->type != XPATH_XSLT_TREE)) {
+		argtmp = arg2;
+		arg2 = arg1;
+		arg1 = argtmp;
+	}
+	switch (arg2->type) {
+	    case XPATH_UNDEFINED:
+		break;
+	    case XPATH_NODESET:
+	    case XPATH_XSLT_TREE:
+		ret = xmlXPathEqualNodeSets(ctxt, arg1, arg2, 0);
+		break;
+	    case XPATH_BOOLEAN:
+		if ((arg1->nodesetval == NULL) ||
+		  (arg1->nodesetval->nodeNr == 0)) ret = 0;
+		else
+		    ret = 1;
+		ret = (ret == arg2->boolval);
+		break;
+	    case XPATH_NUMBER:
+		ret = xmlXPathEqualNodeSetFloat(ctxt, arg1, arg2->floatval, 0);
+		break;
+	    case XPATH_STRING:
+		ret = xmlXPathEqualNodeSetString(ctxt, arg1,
+                                                 arg2->stringval, 0);
+		break;
+	    case XPATH_USERS:
+		/* TODO */
+		break;
+	}
+	xmlXPathReleaseObject(ctxt->context, arg1);
+	xmlXPathReleaseObject(ctxt->context, arg2);
+	return(ret);
     }
 
-    return(ret);
+    return (xmlXPathEqualValuesCommon(ctxt, arg1, arg2));
 }
 
 /**
- * Create a new xmlXPathParserContext when processing a compiled expression
+ * Implement the equal operation on XPath objects content: `arg1` == `arg2`
  *
- * @param comp  the XPath compiled expression
- * @param ctxt  the XPath context
- * @returns the xmlXPathParserContext just allocated.
+ * @param ctxt  the XPath Parser context
+ * @returns 0 or 1 depending on the results of the test.
  */
-static xmlXPathParserContextPtr
-xmlXPathCompParserContext(xmlXPathCompExprPtr comp, xmlXPathContextPtr ctxt) {
-    xmlXPathParserContextPtr ret;
+int
+xmlXPathNotEqualValues(xmlXPathParserContext *ctxt) {
+    xmlXPathObjectPtr arg1, arg2, argtmp;
+    int ret = 0;
 
-    ret = (xmlXPathParserContextPtr) xmlMalloc(sizeof(xmlXPathParserContext));
-    if (ret == NULL) {
-        xmlXPathErrMemory(ctxt);
-	return(NULL);
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(0);
+    arg2 = xmlXPathValuePop(ctxt);
+    arg1 = xmlXPathValuePop(ctxt);
+    if ((arg1 == NULL) || (arg2 == NULL)) {
+	if (arg1 != NULL)
+	    xmlXPathReleaseObject(ctxt->context, arg1);
+	else
+	    xmlXPathReleaseObject(ctxt->context, arg2);
+	XP_ERROR0(XPATH_INVALID_OPERAND);
     }
-    memset(ret, 0 , sizeof(xmlXPathParserContext));
 
-    /* Allocate the value stack */
-#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
-    ret->valueMax = 1;
-#else
-    ret->valueMax = 10;
-#endif
-    ret->valueTab = xmlMalloc(ret->valueMax * sizeof(xmlXPathObjectPtr));
-    if (ret->valueTab == NULL) {
-	xmlFree(ret);
-	xmlXPathErrMemory(ctxt);
-	return(NULL);
+    if (arg1 == arg2) {
+	xmlXPathReleaseObject(ctxt->context, arg1);
+        return(0);
     }
-    ret->valueNr = 0;
-    ret->value = NULL;
-
-    ret->context = ctxt;
-    ret->comp = comp;
-
-    return(ret);
-}
-
-/**
- * Free up an xmlXPathParserContext
- *
- * @param ctxt  the context to free
- */
-void
-xmlXPathFreeParserContext(xmlXPathParserContext *ctxt) {
-    int i;
-
-    if (ctxt == NULL)
-        return;
 
-    if (ctxt->valueTab != NULL) {
-        for (i = 0; i < ctxt->valueNr; i++) {
-            if (ctxt->context)
-                xmlXPathReleaseObject(ctxt->context, ctxt->valueTab[i]);
-            else
-                xmlXPathFreeObject(ctxt->valueTab[i]);
-        }
-        xmlFree(ctxt->valueTab);
-    }
-    if (ctxt->comp != NULL) {
-#ifdef XPATH_STREAMING
-	if (ctxt->comp->stream != NULL) {
-	    xmlFreePatternList(ctxt->comp->stream);
-	    ctxt->comp->stream = NULL;
+    /*
+     *If either argument is a nodeset, it's a 'special case'
+     */
+    if ((arg2->type == XPATH_NODESET) || (arg2->type == XPATH_XSLT_TREE) ||
+      (arg1->type == XPATH_NODESET) || (arg1->type == XPATH_XSLT_TREE)) {
+	/*
+	 *Hack it to assure arg1 is the nodeset
+	 */
+	if ((arg1->type != XPATH_NODESET) && (arg1->type != XPATH_XSLT_TREE)) {
+		argtmp = arg2;
+		arg2 = arg1;
+		arg1 = argtmp;
+	}
+	switch (arg2->type) {
+	    case XPATH_UNDEFINED:
+		break;
+	    case XPATH_NODESET:
+	    case XPATH_XSLT_TREE:
+		ret = xmlXPathEqualNodeSets(ctxt, arg1, arg2, 1);
+		break;
+	    case XPATH_BOOLEAN:
+		if ((arg1->nodesetval == NULL) ||
+		  (arg1->nodesetval->nodeNr == 0)) ret = 0;
+		else
+		    ret = 1;
+		ret = (ret != arg2->boolval);
+		break;
+	    case XPATH_NUMBER:
+		ret = xmlXPathEqualNodeSetFloat(ctxt, arg1, arg2->floatval, 1);
+		break;
+	    case XPATH_STRING:
+		ret = xmlXPathEqualNodeSetString(ctxt, arg1,
+                                                 arg2->stringval, 1);
+		break;
+	    case XPATH_USERS:
+		/* TODO */
+		break;
 	}
-#endif
-	xmlXPathFreeCompExpr(ctxt->comp);
+	xmlXPathReleaseObject(ctxt->context, arg1);
+	xmlXPathReleaseObject(ctxt->context, arg2);
+	return(ret);
     }
-    xmlFree(ctxt);
-}
 
-/************************************************************************
- *									*
- *		The implicit core function library			*
- *									*
- ************************************************************************/
+    return (!xmlXPathEqualValuesCommon(ctxt, arg1, arg2));
+}
 
 /**
- * Function computing the beginning of the string value of the node,
- * used to speed up comparisons
+ * Implement the compare operation on XPath objects:
+ *     `arg1` < `arg2`    (1, 1, ...
+ *     `arg1` <= `arg2`   (1, 0, ...
+ *     `arg1` > `arg2`    (0, 1, ...
+ *     `arg1` >= `arg2`   (0, 0, ...
  *
- * @param node  a node pointer
- * @returns an int usable as a hash
+ * When neither object to be compared is a node-set and the operator is
+ * <=, <, >=, >, then the objects are compared by converted both objects
+ * to numbers and comparing the numbers according to IEEE 754. The <
+ * comparison will be true if and only if the first number is less than the
+ * second number. The <= comparison will be true if and only if the first
+ * number is less than or equal to the second number. The > comparison
+ * will be true if and only if the first number is greater than the second
+ * number. The >= comparison will be true if and only if the first number
+ * is greater than or equal to the second number.
+ *
+ * @param ctxt  the XPath Parser context
+ * @param inf  less than (1) or greater than (0)
+ * @param strict  is the comparison strict
+ * @returns 1 if the comparison succeeded, 0 if it failed
  */
-static unsigned int
-xmlXPathNodeValHash(xmlNodePtr node) {
-    int len = 2;
-    const xmlChar * string = NULL;
-    xmlNodePtr tmp = NULL;
-    unsigned int ret = 0;
-
-    if (node == NULL)
-	return(0);
+int
+xmlXPathCompareValues(xmlXPathParserContext *ctxt, int inf, int strict) {
+    int ret = 0, arg1i = 0, arg2i = 0;
+    xmlXPathObjectPtr arg1, arg2;
 
-    if (node->type == XML_DOCUMENT_NODE) {
-	tmp = xmlDocGetRootElement((xmlDocPtr) node);
-	if (tmp == NULL)
-	    node = node->children;
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(0);
+    arg2 = xmlXPathValuePop(ctxt);
+    arg1 = xmlXPathValuePop(ctxt);
+    if ((arg1 == NULL) || (arg2 == NULL)) {
+	if (arg1 != NULL)
+	    xmlXPathReleaseObject(ctxt->context, arg1);
 	else
-	    node = tmp;
+	    xmlXPathReleaseObject(ctxt->context, arg2);
+	XP_ERROR0(XPATH_INVALID_OPERAND);
+    }
 
-	if (node == NULL)
-	    return(0);
+    if ((arg2->type == XPATH_NODESET) || (arg2->type == XPATH_XSLT_TREE) ||
+      (arg1->type == XPATH_NODESET) || (arg1->type == XPATH_XSLT_TREE)) {
+	/*
+	 * If either argument is a XPATH_NODESET or XPATH_XSLT_TREE the two arguments
+	 * are not freed from within this routine; they will be freed from the
+	 * called routine, e.g. xmlXPathCompareNodeSets or xmlXPathCompareNodeSetValue
+	 */
+	if (((arg2->type == XPATH_NODESET) || (arg2->type == XPATH_XSLT_TREE)) &&
+	  ((arg1->type == XPATH_NODESET) || (arg1->type == XPATH_XSLT_TREE))){
+	    ret = xmlXPathCompareNodeSets(ctxt, inf, strict, arg1, arg2);
+	} else {
+	    if ((arg1->type == XPATH_NODESET) || (arg1->type == XPATH_XSLT_TREE)) {
+		ret = xmlXPathCompareNodeSetValue(ctxt, inf, strict,
+			                          arg1, arg2);
+	    } else {
+		ret = xmlXPathCompareNodeSetValue(ctxt, !inf, strict,
+			                          arg2, arg1);
+	    }
+	}
+	return(ret);
     }
 
-    switch (node->type) {
-	case XML_COMMENT_NODE:
-	case XML_PI_NODE:
-	case XML_CDATA_SECTION_NODE:
-	case XML_TEXT_NODE:
-	    string = node->content;
-	    if (string == NULL)
-		return(0);
-	    if (string[0] == 0)
-		return(0);
-	    return(string[0] + (string[1] << 8));
-	case XML_NAMESPACE_DECL:
-	    string = ((xmlNsPtr)node)->href;
-	    if (string == NULL)
-		return(0);
-	    if (string[0] == 0)
-		return(0);
-	    return(string[0] + (string[1] << 8));
-	case XML_ATTRIBUTE_NODE:
-	    tmp = ((xmlAttrPtr) node)->children;
-	    break;
-	case XML_ELEMENT_NODE:
-	    tmp = node->children;
-	    break;
-	default:
-	    return(0);
+    if (arg1->type != XPATH_NUMBER) {
+	xmlXPathValuePush(ctxt, arg1);
+	xmlXPathNumberFunction(ctxt, 1);
+	arg1 = xmlXPathValuePop(ctxt);
     }
-    while (tmp != NULL) {
-	switch (tmp->type) {
-	    case XML_CDATA_SECTION_NODE:
-	    case XML_TEXT_NODE:
-		string = tmp->content;
-		break;
-	    default:
-                string = NULL;
-		break;
-	}
-	if ((string != NULL) && (string[0] != 0)) {
-	    if (len == 1) {
-		return(ret + (string[0] << 8));
-	    }
-	    if (string[1] == 0) {
-		len = 1;
-		ret = string[0];
+    if (arg2->type != XPATH_NUMBER) {
+	xmlXPathValuePush(ctxt, arg2);
+	xmlXPathNumberFunction(ctxt, 1);
+	arg2 = xmlXPathValuePop(ctxt);
+    }
+    if (ctxt->error)
+        goto error;
+    /*
+     * Add tests for infinity and nan
+     * => feedback on 3.4 for Inf and NaN
+     */
+    /* Hand check NaN and Infinity comparisons */
+    if (xmlXPathIsNaN(arg1->floatval) || xmlXPathIsNaN(arg2->floatval)) {
+	ret=0;
+    } else {
+	arg1i=xmlXPathIsInf(arg1->floatval);
+	arg2i=xmlXPathIsInf(arg2->floatval);
+	if (inf && strict) {
+	    if ((arg1i == -1 && arg2i != -1) ||
+		(arg2i == 1 && arg1i != 1)) {
+		ret = 1;
+	    } else if (arg1i == 0 && arg2i == 0) {
+		ret = (arg1->floatval < arg2->floatval);
 	    } else {
-		return(string[0] + (string[1] << 8));
+		ret = 0;
 	    }
 	}
-	/*
-	 * Skip to next node
-	 */
-        if ((tmp->children != NULL) &&
-            (tmp->type != XML_DTD_NODE) &&
-            (tmp->type != XML_ENTITY_REF_NODE) &&
-            (tmp->children->type != XML_ENTITY_DECL)) {
-            tmp = tmp->children;
-            continue;
-	}
-	if (tmp == node)
-	    break;
-
-	if (tmp->next != NULL) {
-	    tmp = tmp->next;
-	    continue;
+	else if (inf && !strict) {
+	    if (arg1i == -1 || arg2i == 1) {
+		ret = 1;
+	    } else if (arg1i == 0 && arg2i == 0) {
+		ret = (arg1->floatval <= arg2->floatval);
+	    } else {
+		ret = 0;
+	    }
 	}
-
-	do {
-	    tmp = tmp->parent;
-	    if (tmp == NULL)
-		break;
-	    if (tmp == node) {
-		tmp = NULL;
-		break;
+	else if (!inf && strict) {
+	    if ((arg1i == 1 && arg2i != 1) ||
+		(arg2i == -1 && arg1i != -1)) {
+		ret = 1;
+	    } else if (arg1i == 0 && arg2i == 0) {
+		ret = (arg1->floatval > arg2->floatval);
+	    } else {
+		ret = 0;
 	    }
-	    if (tmp->next != NULL) {
-		tmp = tmp->next;
-		break;
+	}
+	else if (!inf && !strict) {
+	    if (arg1i == 1 || arg2i == -1) {
+		ret = 1;
+	    } else if (arg1i == 0 && arg2i == 0) {
+		ret = (arg1->floatval >= arg2->floatval);
+	    } else {
+		ret = 0;
 	    }
-	} while (tmp != NULL);
+	}
     }
+error:
+    xmlXPathReleaseObject(ctxt->context, arg1);
+    xmlXPathReleaseObject(ctxt->context, arg2);
     return(ret);
 }
 
 /**
- * Function computing the beginning of the string value of the node,
- * used to speed up comparisons
+ * Implement the unary - operation on an XPath object
+ * The numeric operators convert their operands to numbers as if
+ * by calling the number function.
  *
- * @param string  a string
- * @returns an int usable as a hash
+ * @param ctxt  the XPath Parser context
  */
-static unsigned int
-xmlXPathStringHash(const xmlChar * string) {
-    if (string == NULL)
-	return(0);
-    if (string[0] == 0)
-	return(0);
-    return(string[0] + (string[1] << 8));
+void
+xmlXPathValueFlipSign(xmlXPathParserContext *ctxt) {
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return;
+    CAST_TO_NUMBER;
+    CHECK_TYPE(XPATH_NUMBER);
+    ctxt->value->floatval = -ctxt->value->floatval;
+}
+
+/**
+ * Implement the add operation on XPath objects:
+ * The numeric operators convert their operands to numbers as if
+ * by calling the number function.
+ *
+ * @param ctxt  the XPath Parser context
+ */
+void
+xmlXPathAddValues(xmlXPathParserContext *ctxt) {
+    xmlXPathObjectPtr arg;
+    double val;
+
+    arg = xmlXPathValuePop(ctxt);
+    if (arg == NULL)
+	XP_ERROR(XPATH_INVALID_OPERAND);
+    val = xmlXPathCastToNumberInternal(ctxt, arg);
+    xmlXPathReleaseObject(ctxt->context, arg);
+    CAST_TO_NUMBER;
+    CHECK_TYPE(XPATH_NUMBER);
+    ctxt->value->floatval += val;
 }
 
 /**
- * Implement the compare operation between a nodeset and a number
- *     `ns` < `val`    (1, 1, ...
- *     `ns` <= `val`   (1, 0, ...
- *     `ns` > `val`    (0, 1, ...
- *     `ns` >= `val`   (0, 0, ...
- *
- * If one object to be compared is a node-set and the other is a number,
- * then the comparison will be true if and only if there is a node in the
- * node-set such that the result of performing the comparison on the number
- * to be compared and on the result of converting the string-value of that
- * node to a number using the number function is true.
+ * Implement the subtraction operation on XPath objects:
+ * The numeric operators convert their operands to numbers as if
+ * by calling the number function.
  *
  * @param ctxt  the XPath Parser context
- * @param inf  less than (1) or greater than (0)
- * @param strict  is the comparison strict
- * @param arg  the node set
- * @param f  the value
- * @returns 0 or 1 depending on the results of the test.
  */
-static int
-xmlXPathCompareNodeSetFloat(xmlXPathParserContextPtr ctxt, int inf, int strict,
-	                    xmlXPathObjectPtr arg, xmlXPathObjectPtr f) {
-    int i, ret = 0;
-    xmlNodeSetPtr ns;
-    xmlChar *str2;
+void
+xmlXPathSubValues(xmlXPathParserContext *ctxt) {
+    xmlXPathObjectPtr arg;
+    double val;
 
-    if ((f == NULL) || (arg == NULL) ||
-	((arg->type != XPATH_NODESET) && (arg->type != XPATH_XSLT_TREE))) {
-	xmlXPathReleaseObject(ctxt->context, arg);
-	xmlXPathReleaseObject(ctxt->context, f);
-        return(0);
-    }
-    ns = arg->nodesetval;
-    if (ns != NULL) {
-	for (i = 0;i < ns->nodeNr;i++) {
-	     str2 = xmlXPathCastNodeToString(ns->nodeTab[i]);
-	     if (str2 != NULL) {
-		 xmlXPathValuePush(ctxt, xmlXPathCacheNewString(ctxt, str2));
-		 xmlFree(str2);
-		 xmlXPathNumberFunction(ctxt, 1);
-		 xmlXPathValuePush(ctxt, xmlXPathCacheObjectCopy(ctxt, f));
-		 ret = xmlXPathCompareValues(ctxt, inf, strict);
-		 if (ret)
-		     break;
-	     } else {
-                 xmlXPathPErrMemory(ctxt);
-             }
-	}
-    }
+    arg = xmlXPathValuePop(ctxt);
+    if (arg == NULL)
+	XP_ERROR(XPATH_INVALID_OPERAND);
+    val = xmlXPathCastToNumberInternal(ctxt, arg);
     xmlXPathReleaseObject(ctxt->context, arg);
-    xmlXPathReleaseObject(ctxt->context, f);
-    return(ret);
+    CAST_TO_NUMBER;
+    CHECK_TYPE(XPATH_NUMBER);
+    ctxt->value->floatval -= val;
 }
 
 /**
- * Implement the compare operation between a nodeset and a string
- *     `ns` < `val`    (1, 1, ...
- *     `ns` <= `val`   (1, 0, ...
- *     `ns` > `val`    (0, 1, ...
- *     `ns` >= `val`   (0, 0, ...
- *
- * If one object to be compared is a node-set and the other is a string,
- * then the comparison will be true if and only if there is a node in
- * the node-set such that the result of performing the comparison on the
- * string-value of the node and the other string is true.
+ * Implement the multiply operation on XPath objects:
+ * The numeric operators convert their operands to numbers as if
+ * by calling the number function.
  *
  * @param ctxt  the XPath Parser context
- * @param inf  less than (1) or greater than (0)
- * @param strict  is the comparison strict
- * @param arg  the node set
- * @param s  the value
- * @returns 0 or 1 depending on the results of the test.
  */
-static int
-xmlXPathCompareNodeSetString(xmlXPathParserContextPtr ctxt, int inf, int strict,
-	                    xmlXPathObjectPtr arg, xmlXPathObjectPtr s) {
-    int i, ret = 0;
-    xmlNodeSetPtr ns;
-    xmlChar *str2;
+void
+xmlXPathMultValues(xmlXPathParserContext *ctxt) {
+    xmlXPathObjectPtr arg;
+    double val;
 
-    if ((s == NULL) || (arg == NULL) ||
-	((arg->type != XPATH_NODESET) && (arg->type != XPATH_XSLT_TREE))) {
-	xmlXPathReleaseObject(ctxt->context, arg);
-	xmlXPathReleaseObject(ctxt->context, s);
-        return(0);
-    }
-    ns = arg->nodesetval;
-    if (ns != NULL) {
-	for (i = 0;i < ns->nodeNr;i++) {
-	     str2 = xmlXPathCastNodeToString(ns->nodeTab[i]);
-	     if (str2 != NULL) {
-		 xmlXPathValuePush(ctxt,
-			   xmlXPathCacheNewString(ctxt, str2));
-		 xmlFree(str2);
-		 xmlXPathValuePush(ctxt, xmlXPathCacheObjectCopy(ctxt, s));
-		 ret = xmlXPathCompareValues(ctxt, inf, strict);
-		 if (ret)
-		     break;
-	     } else {
-                 xmlXPathPErrMemory(ctxt);
-             }
-	}
-    }
+    arg = xmlXPathValuePop(ctxt);
+    if (arg == NULL)
+	XP_ERROR(XPATH_INVALID_OPERAND);
+    val = xmlXPathCastToNumberInternal(ctxt, arg);
     xmlXPathReleaseObject(ctxt->context, arg);
-    xmlXPathReleaseObject(ctxt->context, s);
-    return(ret);
+    CAST_TO_NUMBER;
+    CHECK_TYPE(XPATH_NUMBER);
+    ctxt->value->floatval *= val;
 }
 
 /**
- * Implement the compare operation on nodesets:
- *
- * If both objects to be compared are node-sets, then the comparison
- * will be true if and only if there is a node in the first node-set
- * and a node in the second node-set such that the result of performing
- * the comparison on the string-values of the two nodes is true.
- * ....
- * When neither object to be compared is a node-set and the operator
- * is <=, <, >= or >, then the objects are compared by converting both
- * objects to numbers and comparing the numbers according to IEEE 754.
- * ....
- * The number function converts its argument to a number as follows:
- *  - a string that consists of optional whitespace followed by an
- *    optional minus sign followed by a Number followed by whitespace
- *    is converted to the IEEE 754 number that is nearest (according
- *    to the IEEE 754 round-to-nearest rule) to the mathematical value
- *    represented by the string; any other string is converted to NaN
- *
- * Conclusion all nodes need to be converted first to their string value
- * and then the comparison must be done when possible
+ * Implement the div operation on XPath objects `arg1` / `arg2`.
+ * The numeric operators convert their operands to numbers as if
+ * by calling the number function.
  *
- * @param ctxt  XPath parser context
- * @param inf  less than (1) or greater than (0)
- * @param strict  is the comparison strict
- * @param arg1  the first node set object
- * @param arg2  the second node set object
+ * @param ctxt  the XPath Parser context
  */
-static int
-xmlXPathCompareNodeSets(xmlXPathParserContextPtr ctxt, int inf, int strict,
-	                xmlXPathObjectPtr arg1, xmlXPathObjectPtr arg2) {
-    int i, j, init = 0;
-    double val1;
-    double *values2;
-    int ret = 0;
-    xmlNodeSetPtr ns1;
-    xmlNodeSetPtr ns2;
-
-    if ((arg1 == NULL) ||
-	((arg1->type != XPATH_NODESET) && (arg1->type != XPATH_XSLT_TREE))) {
-	xmlXPathFreeObject(arg2);
-        return(0);
-    }
-    if ((arg2 == NULL) ||
-	((arg2->type != XPATH_NODESET) && (arg2->type != XPATH_XSLT_TREE))) {
-	xmlXPathFreeObject(arg1);
-	xmlXPathFreeObject(arg2);
-        return(0);
-    }
+ATTRIBUTE_NO_SANITIZE("float-divide-by-zero")
+void
+xmlXPathDivValues(xmlXPathParserContext *ctxt) {
+    xmlXPathObjectPtr arg;
+    double val;
 
-    ns1 = arg1->nodesetval;
-    ns2 = arg2->nodesetval;
+    arg = xmlXPathValuePop(ctxt);
+    if (arg == NULL)
+	XP_ERROR(XPATH_INVALID_OPERAND);
+    val = xmlXPathCastToNumberInternal(ctxt, arg);
+    xmlXPathReleaseObject(ctxt->context, arg);
+    CAST_TO_NUMBER;
+    CHECK_TYPE(XPATH_NUMBER);
+    ctxt->value->floatval /= val;
+}
 
-    if ((ns1 == NULL) || (ns1->nodeNr <= 0)) {
-	xmlXPathFreeObject(arg1);
-	xmlXPathFreeObject(arg2);
-	return(0);
-    }
-    if ((ns2 == NULL) || (ns2->nodeNr <= 0)) {
-	xmlXPathFreeObject(arg1);
-	xmlXPathFreeObject(arg2);
-	return(0);
-    }
+/**
+ * Implement the mod operation on XPath objects: `arg1` / `arg2`
+ * The numeric operators convert their operands to numbers as if
+ * by calling the number function.
+ *
+ * @param ctxt  the XPath Parser context
+ */
+void
+xmlXPathModValues(xmlXPathParserContext *ctxt) {
+    xmlXPathObjectPtr arg;
+    double arg1, arg2;
 
-    values2 = (double *) xmlMalloc(ns2->nodeNr * sizeof(double));
-    if (values2 == NULL) {
-        xmlXPathPErrMemory(ctxt);
-	xmlXPathFreeObject(arg1);
-	xmlXPathFreeObject(arg2);
-	return(0);
-    }
-    for (i = 0;i < ns1->nodeNr;i++) {
-	val1 = xmlXPathNodeToNumberInternal(ctxt, ns1->nodeTab[i]);
-	if (xmlXPathIsNaN(val1))
-	    continue;
-	for (j = 0;j < ns2->nodeNr;j++) {
-	    if (init == 0) {
-		values2[j] = xmlXPathNodeToNumberInternal(ctxt,
-                                                          ns2->nodeTab[j]);
-	    }
-	    if (xmlXPathIsNaN(values2[j]))
-		continue;
-	    if (inf && strict)
-		ret = (val1 < values2[j]);
-	    else if (inf && !strict)
-		ret = (val1 <= values2[j]);
-	    else if (!inf && strict)
-		ret = (val1 > values2[j]);
-	    else if (!inf && !strict)
-		ret = (val1 >= values2[j]);
-	    if (ret)
-		break;
-	}
-	if (ret)
-	    break;
-	init = 1;
+    arg = xmlXPathValuePop(ctxt);
+    if (arg == NULL)
+	XP_ERROR(XPATH_INVALID_OPERAND);
+    arg2 = xmlXPathCastToNumberInternal(ctxt, arg);
+    xmlXPathReleaseObject(ctxt->context, arg);
+    CAST_TO_NUMBER;
+    CHECK_TYPE(XPATH_NUMBER);
+    arg1 = ctxt->value->floatval;
+    if (arg2 == 0)
+	ctxt->value->floatval = xmlXPathNAN;
+    else {
+	ctxt->value->floatval = fmod(arg1, arg2);
     }
-    xmlFree(values2);
-    xmlXPathFreeObject(arg1);
-    xmlXPathFreeObject(arg2);
-    return(ret);
 }
 
+/************************************************************************
+ *									*
+ *		The traversal functions					*
+ *									*
+ ************************************************************************/
+
+/*
+ * A traversal function enumerates nodes along an axis.
+ * Initially it must be called with NULL, and it indicates
+ * termination on the axis by returning NULL.
+ */
+typedef xmlNode *(*xmlXPathTraversalFunction)
+                    (xmlXPathParserContext *ctxt, xmlNode *cur);
+
+/*
+ * A traversal function enumerates nodes along an axis.
+ * Initially it must be called with NULL, and it indicates
+ * termination on the axis by returning NULL.
+ * The context node of the traversal is specified via `contextNode`.
+ */
+typedef xmlNode *(*xmlXPathTraversalFunctionExt)
+                    (xmlNode *cur, xmlNode *contextNode);
+
+/*
+ * Used for merging node sets in #xmlXPathCollectAndTest.
+ */
+typedef xmlNodeSet *(*xmlXPathNodeSetMergeFunction)
+		    (xmlNodeSet *, xmlNodeSet *);
+
+
 /**
- * Implement the compare operation between a nodeset and a value
- *     `ns` < `val`    (1, 1, ...
- *     `ns` <= `val`   (1, 0, ...
- *     `ns` > `val`    (0, 1, ...
- *     `ns` >= `val`   (0, 0, ...
- *
- * If one object to be compared is a node-set and the other is a boolean,
- * then the comparison will be true if and only if the result of performing
- * the comparison on the boolean and on the result of converting
- * the node-set to a boolean using the boolean function is true.
+ * Traversal function for the "self" direction
+ * The self axis contains just the context node itself
  *
  * @param ctxt  the XPath Parser context
- * @param inf  less than (1) or greater than (0)
- * @param strict  is the comparison strict
- * @param arg  the node set
- * @param val  the value
- * @returns 0 or 1 depending on the results of the test.
+ * @param cur  the current node in the traversal
+ * @returns the next element following that axis
  */
-static int
-xmlXPathCompareNodeSetValue(xmlXPathParserContextPtr ctxt, int inf, int strict,
-	                    xmlXPathObjectPtr arg, xmlXPathObjectPtr val) {
-    if ((val == NULL) || (arg == NULL) ||
-	((arg->type != XPATH_NODESET) && (arg->type != XPATH_XSLT_TREE)))
-        return(0);
-
-    switch(val->type) {
-        case XPATH_NUMBER:
-	    return(xmlXPathCompareNodeSetFloat(ctxt, inf, strict, arg, val));
-        case XPATH_NODESET:
-        case XPATH_XSLT_TREE:
-	    return(xmlXPathCompareNodeSets(ctxt, inf, strict, arg, val));
-        case XPATH_STRING:
-	    return(xmlXPathCompareNodeSetString(ctxt, inf, strict, arg, val));
-        case XPATH_BOOLEAN:
-	    xmlXPathValuePush(ctxt, arg);
-	    xmlXPathBooleanFunction(ctxt, 1);
-	    xmlXPathValuePush(ctxt, val);
-	    return(xmlXPathCompareValues(ctxt, inf, strict));
-	default:
-            xmlXPathReleaseObject(ctxt->context, arg);
-            xmlXPathReleaseObject(ctxt->context, val);
-            XP_ERROR0(XPATH_INVALID_TYPE);
-    }
-    return(0);
+xmlNode *
+xmlXPathNextSelf(xmlXPathParserContext *ctxt, xmlNode *cur) {
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
+    if (cur == NULL)
+        return(ctxt->context->node);
+    return(NULL);
 }
 
 /**
- * Implement the equal operation on XPath objects content: `arg1` == `arg2`
- * If one object to be compared is a node-set and the other is a string,
- * then the comparison will be true if and only if there is a node in
- * the node-set such that the result of performing the comparison on the
- * string-value of the node and the other string is true.
+ * Traversal function for the "child" direction
+ * The child axis contains the children of the context node in document order.
  *
- * @param ctxt  XPath parser context
- * @param arg  the nodeset object argument
- * @param str  the string to compare to.
- * @param neq  flag to show whether for '=' (0) or '!=' (1)
- * @returns 0 or 1 depending on the results of the test.
+ * @param ctxt  the XPath Parser context
+ * @param cur  the current node in the traversal
+ * @returns the next element following that axis
  */
-static int
-xmlXPathEqualNodeSetString(xmlXPathParserContextPtr ctxt,
-                           xmlXPathObjectPtr arg, const xmlChar * str, int neq)
-{
-    int i;
-    xmlNodeSetPtr ns;
-    xmlChar *str2;
-    unsigned int hash;
-
-    if ((str == NULL) || (arg == NULL) ||
-        ((arg->type != XPATH_NODESET) && (arg->type != XPATH_XSLT_TREE)))
-        return (0);
-    ns = arg->nodesetval;
-    /*
-     * A NULL nodeset compared with a string is always false
-     * (since there is no node equal, and no node not equal)
-     */
-    if ((ns == NULL) || (ns->nodeNr <= 0) )
-        return (0);
-    hash = xmlXPathStringHash(str);
-    for (i = 0; i < ns->nodeNr; i++) {
-        if (xmlXPathNodeValHash(ns->nodeTab[i]) == hash) {
-            str2 = xmlNodeGetContent(ns->nodeTab[i]);
-            if (str2 == NULL) {
-                xmlXPathPErrMemory(ctxt);
-                return(0);
-            }
-            if (xmlStrEqual(str, str2)) {
-                xmlFree(str2);
-		if (neq)
-		    continue;
-                return (1);
-            } else if (neq) {
-		xmlFree(str2);
-		return (1);
-	    }
-            xmlFree(str2);
-        } else if (neq)
-	    return (1);
+xmlNode *
+xmlXPathNextChild(xmlXPathParserContext *ctxt, xmlNode *cur) {
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
+    if (cur == NULL) {
+	if (ctxt->context->node == NULL) return(NULL);
+	switch (ctxt->context->node->type) {
+            case XML_ELEMENT_NODE:
+                if (XML_LAZY_DOC(ctxt->context->node->doc))
+                    xmlLazyMaterialize(ctxt->context->node, XML_LAZY_CONTENT);
+		return(ctxt->context->node->children);
+            case XML_TEXT_NODE:
+            case XML_CDATA_SECTION_NODE:
+            case XML_ENTITY_REF_NODE:
+            case XML_ENTITY_NODE:
+            case XML_PI_NODE:
+            case XML_COMMENT_NODE:
+            case XML_NOTATION_NODE:
+            case XML_DTD_NODE:
+		return(ctxt->context->node->children);
+            case XML_DOCUMENT_NODE:
+            case XML_DOCUMENT_TYPE_NODE:
+            case XML_DOCUMENT_FRAG_NODE:
+            case XML_HTML_DOCUMENT_NODE:
+		return(((xmlDocPtr) ctxt->context->node)->children);
+	    case XML_ELEMENT_DECL:
+	    case XML_ATTRIBUTE_DECL:
+	    case XML_ENTITY_DECL:
+            case XML_ATTRIBUTE_NODE:
+	    case XML_NAMESPACE_DECL:
+	    case XML_XINCLUDE_START:
+	    case XML_XINCLUDE_END:
+		return(NULL);
+	}
+	return(NULL);
     }
-    return (0);
+    if ((cur->type == XML_DOCUMENT_NODE) ||
+        (cur->type == XML_HTML_DOCUMENT_NODE))
+	return(NULL);
+    return(cur->next);
 }
 
 /**
- * Implement the equal operation on XPath objects content: `arg1` == `arg2`
- * If one object to be compared is a node-set and the other is a number,
- * then the comparison will be true if and only if there is a node in
- * the node-set such that the result of performing the comparison on the
- * number to be compared and on the result of converting the string-value
- * of that node to a number using the number function is true.
+ * Traversal function for the "child" direction and nodes of type element.
+ * The child axis contains the children of the context node in document order.
  *
- * @param ctxt  XPath parser context
- * @param arg  the nodeset object argument
- * @param f  the float to compare to
- * @param neq  flag to show whether to compare '=' (0) or '!=' (1)
- * @returns 0 or 1 depending on the results of the test.
+ * @param ctxt  the XPath Parser context
+ * @param cur  the current node in the traversal
+ * @returns the next element following that axis
+ */
+static xmlNodePtr
+xmlXPathNextChildElement(xmlXPathParserContextPtr ctxt, xmlNodePtr cur) {
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
+    if (cur == NULL) {
+	cur = ctxt->context->node;
+	if (cur == NULL) return(NULL);
+	/*
+	* Get the first element child.
+	*/
+	switch (cur->type) {
+            case XML_ELEMENT_NODE:
+	    case XML_DOCUMENT_FRAG_NODE:
+	    case XML_ENTITY_REF_NODE: /* URGENT TODO: entify-refs as well? */
+            case XML_ENTITY_NODE:
+		cur = cur->children;
+		if (cur != NULL) {
+		    if (cur->type == XML_ELEMENT_NODE)
+			return(cur);
+		    do {
+			cur = cur->next;
+		    } while ((cur != NULL) &&
+			(cur->type != XML_ELEMENT_NODE));
+		    return(cur);
+		}
+		return(NULL);
+            case XML_DOCUMENT_NODE:
+            case XML_HTML_DOCUMENT_NODE:
+		return(xmlDocGetRootElement((xmlDocPtr) cur));
+	    default:
+		return(NULL);
+	}
+	return(NULL);
+    }
+    /*
+    * Get the next sibling element node.
+    */
+    switch (cur->type) {
+	case XML_ELEMENT_NODE:
+	case XML_TEXT_NODE:
+	case XML_ENTITY_REF_NODE:
+	case XML_ENTITY_NODE:
+	case XML_CDATA_SECTION_NODE:
+	case XML_PI_NODE:
+	case XML_COMMENT_NODE:
+	case XML_XINCLUDE_END:
+	    break;
+	/* case XML_DTD_NODE: */ /* URGENT TODO: DTD-node as well? */
+	default:
+	    return(NULL);
+    }
+    if (cur->next != NULL) {
+	if (cur->next->type == XML_ELEMENT_NODE)
+	    return(cur->next);
+	cur = cur->next;
+	do {
+	    cur = cur->next;
+	} while ((cur != NULL) && (cur->type != XML_ELEMENT_NODE));
+	return(cur);
+    }
+    return(NULL);
+}
+
+/*
+ * Traversal function for the "descendant" direction. If `lazy` is
+ * set, deferred content of lazy documents isn't materialized, so
+ * only elements are guaranteed to be found.
  */
-static int
-xmlXPathEqualNodeSetFloat(xmlXPathParserContextPtr ctxt,
-    xmlXPathObjectPtr arg, double f, int neq) {
-  int i, ret=0;
-  xmlNodeSetPtr ns;
-  xmlChar *str2;
-  xmlXPathObjectPtr val;
-  double v;
+static xmlNodePtr
+xmlXPathNextDescendantInternal(xmlXPathParserContextPtr ctxt,
+                               xmlNodePtr cur, int lazy) {
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
+    if (cur == NULL) {
+	if (ctxt->context->node == NULL)
+	    return(NULL);
+	if ((ctxt->context->node->type == XML_ATTRIBUTE_NODE) ||
+	    (ctxt->context->node->type == XML_NAMESPACE_DECL))
+	    return(NULL);
 
-    if ((arg == NULL) ||
-	((arg->type != XPATH_NODESET) && (arg->type != XPATH_XSLT_TREE)))
-        return(0);
+        if (ctxt->context->node == (xmlNodePtr) ctxt->context->doc)
+	    return(ctxt->context->doc->children);
+        cur = ctxt->context->node;
+        if ((!lazy) && (XML_LAZY_DOC(cur->doc)))
+            xmlLazyMaterialize(cur, XML_LAZY_CONTENT);
+        return(cur->children);
+    }
 
-    ns = arg->nodesetval;
-    if (ns != NULL) {
-	for (i=0;i<ns->nodeNr;i++) {
-	    str2 = xmlXPathCastNodeToString(ns->nodeTab[i]);
-	    if (str2 != NULL) {
-		xmlXPathValuePush(ctxt, xmlXPathCacheNewString(ctxt, str2));
-		xmlFree(str2);
-		xmlXPathNumberFunction(ctxt, 1);
-                CHECK_ERROR0;
-		val = xmlXPathValuePop(ctxt);
-		v = val->floatval;
-		xmlXPathReleaseObject(ctxt->context, val);
-		if (!xmlXPathIsNaN(v)) {
-		    if ((!neq) && (v==f)) {
-			ret = 1;
-			break;
-		    } else if ((neq) && (v!=f)) {
-			ret = 1;
-			break;
-		    }
-		} else {	/* NaN is unequal to any value */
-		    if (neq)
-			ret = 1;
-		}
-	    } else {
-                xmlXPathPErrMemory(ctxt);
-            }
+    if (cur->type == XML_NAMESPACE_DECL)
+        return(NULL);
+    if ((!lazy) && (XML_LAZY_DOC(cur->doc)))
+        xmlLazyMaterialize(cur, XML_LAZY_CONTENT);
+    if (cur->children != NULL) {
+	/*
+	 * Do not descend on entities declarations
+	 */
+	if (cur->children->type != XML_ENTITY_DECL) {
+	    cur = cur->children;
+	    /*
+	     * Skip DTDs
+	     */
+	    if (cur->type != XML_DTD_NODE)
+		return(cur);
 	}
     }
 
-    return(ret);
-}
+    if (cur == ctxt->context->node) return(NULL);
 
+    while (cur->next != NULL) {
+	cur = cur->next;
+	if ((cur->type != XML_ENTITY_DECL) &&
+	    (cur->type != XML_DTD_NODE))
+	    return(cur);
+    }
+
+    do {
+        cur = cur->parent;
+	if (cur == NULL) break;
+	if (cur == ctxt->context->node) return(NULL);
+	if (cur->next != NULL) {
+	    cur = cur->next;
+	    return(cur);
+	}
+    } while (cur != NULL);
+    return(cur);
+}
 
 /**
- * Implement the equal / not equal operation on XPath nodesets:
- * `arg1` == `arg2`  or  `arg1` != `arg2`
- * If both objects to be compared are node-sets, then the comparison
- * will be true if and only if there is a node in the first node-set and
- * a node in the second node-set such that the result of performing the
- * comparison on the string-values of the two nodes is true.
+ * Traversal function for the "descendant" direction
+ * the descendant axis contains the descendants of the context node in document
+ * order; a descendant is a child or a child of a child and so on.
  *
- * (needless to say, this is a costly operation)
+ * @param ctxt  the XPath Parser context
+ * @param cur  the current node in the traversal
+ * @returns the next element following that axis
+ */
+xmlNode *
+xmlXPathNextDescendant(xmlXPathParserContext *ctxt, xmlNode *cur) {
+    return(xmlXPathNextDescendantInternal(ctxt, cur, 0));
+}
+
+/*
+ * Traversal function for the "descendant" direction which only
+ * needs to find elements.
+ */
+static xmlNodePtr
+xmlXPathNextDescendantElement(xmlXPathParserContextPtr ctxt,
+                              xmlNodePtr cur) {
+    return(xmlXPathNextDescendantInternal(ctxt, cur, 1));
+}
+
+/**
+ * Traversal function for the "descendant-or-self" direction
+ * the descendant-or-self axis contains the context node and the descendants
+ * of the context node in document order; thus the context node is the first
+ * node on the axis, and the first child of the context node is the second node
+ * on the axis
  *
- * @param ctxt  XPath parser context
- * @param arg1  first nodeset object argument
- * @param arg2  second nodeset object argument
- * @param neq  flag to show whether to test '=' (0) or '!=' (1)
- * @returns 0 or 1 depending on the results of the test.
+ * @param ctxt  the XPath Parser context
+ * @param cur  the current node in the traversal
+ * @returns the next element following that axis
  */
-static int
-xmlXPathEqualNodeSets(xmlXPathParserContextPtr ctxt, xmlXPathObjectPtr arg1,
-                      xmlXPathObjectPtr arg2, int neq) {
-    int i, j;
-    unsigned int *hashs1;
-    unsigned int *hashs2;
-    xmlChar **values1;
-    xmlChar **values2;
-    int ret = 0;
-    xmlNodeSetPtr ns1;
-    xmlNodeSetPtr ns2;
+xmlNode *
+xmlXPathNextDescendantOrSelf(xmlXPathParserContext *ctxt, xmlNode *cur) {
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
+    if (cur == NULL)
+        return(ctxt->context->node);
 
-    if ((arg1 == NULL) ||
-	((arg1->type != XPATH_NODESET) && (arg1->type != XPATH_XSLT_TREE)))
-        return(0);
-    if ((arg2 == NULL) ||
-	((arg2->type != XPATH_NODESET) && (arg2->type != XPATH_XSLT_TREE)))
-        return(0);
+    if (ctxt->context->node == NULL)
+        return(NULL);
+    if ((ctxt->context->node->type == XML_ATTRIBUTE_NODE) ||
+        (ctxt->context->node->type == XML_NAMESPACE_DECL))
+        return(NULL);
 
-    ns1 = arg1->nodesetval;
-    ns2 = arg2->nodesetval;
+    return(xmlXPathNextDescendant(ctxt, cur));
+}
 
-    if ((ns1 == NULL) || (ns1->nodeNr <= 0))
-	return(0);
-    if ((ns2 == NULL) || (ns2->nodeNr <= 0))
-	return(0);
+/*
+ * Traversal function for the "descendant-or-self" direction which
+ * only needs to find elements.
+ */
+static xmlNodePtr
+xmlXPathNextDescendantOrSelfElement(xmlXPathParserContextPtr ctxt,
+                                    xmlNodePtr cur) {
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
+    if (cur == NULL)
+        return(ctxt->context->node);
+
+    if (ctxt->context->node == NULL)
+        return(NULL);
+    if ((ctxt->context->node->type == XML_ATTRIBUTE_NODE) ||
+        (ctxt->context->node->type == XML_NAMESPACE_DECL))
+        return(NULL);
+
+    return(xmlXPathNextDescendantInternal(ctxt, cur, 1));
+}
 
+/**
+ * Traversal function for the "parent" direction
+ * The parent axis contains the parent of the context node, if there is one.
+ *
+ * @param ctxt  the XPath Parser context
+ * @param cur  the current node in the traversal
+ * @returns the next element following that axis
+ */
+xmlNode *
+xmlXPathNextParent(xmlXPathParserContext *ctxt, xmlNode *cur) {
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
     /*
-     * for equal, check if there is a node pertaining to both sets
+     * the parent of an attribute or namespace node is the element
+     * to which the attribute or namespace node is attached
+     * Namespace handling !!!
      */
-    if (neq == 0)
-	for (i = 0;i < ns1->nodeNr;i++)
-	    for (j = 0;j < ns2->nodeNr;j++)
-		if (ns1->nodeTab[i] == ns2->nodeTab[j])
-		    return(1);
-
-    values1 = (xmlChar **) xmlMalloc(ns1->nodeNr * sizeof(xmlChar *));
-    if (values1 == NULL) {
-        xmlXPathPErrMemory(ctxt);
-	return(0);
-    }
-    hashs1 = (unsigned int *) xmlMalloc(ns1->nodeNr * sizeof(unsigned int));
-    if (hashs1 == NULL) {
-        xmlXPathPErrMemory(ctxt);
-	xmlFree(values1);
-	return(0);
-    }
-    memset(values1, 0, ns1->nodeNr * sizeof(xmlChar *));
-    values2 = (xmlChar **) xmlMalloc(ns2->nodeNr * sizeof(xmlChar *));
-    if (values2 == NULL) {
-        xmlXPathPErrMemory(ctxt);
-	xmlFree(hashs1);
-	xmlFree(values1);
-	return(0);
-    }
-    hashs2 = (unsigned int *) xmlMalloc(ns2->nodeNr * sizeof(unsigned int));
-    if (hashs2 == NULL) {
-        xmlXPathPErrMemory(ctxt);
-	xmlFree(hashs1);
-	xmlFree(values1);
-	xmlFree(values2);
-	return(0);
-    }
-    memset(values2, 0, ns2->nodeNr * sizeof(xmlChar *));
-    for (i = 0;i < ns1->nodeNr;i++) {
-	hashs1[i] = xmlXPathNodeValHash(ns1->nodeTab[i]);
-	for (j = 0;j < ns2->nodeNr;j++) {
-	    if (i == 0)
-		hashs2[j] = xmlXPathNodeValHash(ns2->nodeTab[j]);
-	    if (hashs1[i] != hashs2[j]) {
-		if (neq) {
-		    ret = 1;
-		    break;
-		}
+    if (cur == NULL) {
+	if (ctxt->context->node == NULL) return(NULL);
+	switch (ctxt->context->node->type) {
+            case XML_ELEMENT_NODE:
+            case XML_TEXT_NODE:
+            case XML_CDATA_SECTION_NODE:
+            case XML_ENTITY_REF_NODE:
+            case XML_ENTITY_NODE:
+            case XML_PI_NODE:
+            case XML_COMMENT_NODE:
+            case XML_NOTATION_NODE:
+            case XML_DTD_NODE:
+	    case XML_ELEMENT_DECL:
+	    case XML_ATTRIBUTE_DECL:
+	    case XML_XINCLUDE_START:
+	    case XML_XINCLUDE_END:
+	    case XML_ENTITY_DECL:
+		if (ctxt->context->node->parent == NULL)
+		    return((xmlNodePtr) ctxt->context->doc);
+		if ((ctxt->context->node->parent->type == XML_ELEMENT_NODE) &&
+		    ((ctxt->context->node->parent->name[0] == ' ') ||
+		     (xmlStrEqual(ctxt->context->node->parent->name,
+				 BAD_CAST "fake node libxslt"))))
+		    return(NULL);
+		return(ctxt->context->node->parent);
+            case XML_ATTRIBUTE_NODE: {
+		xmlAttrPtr att = (xmlAttrPtr) ctxt->context->node;
+
+		return(att->parent);
 	    }
-	    else {
-		if (values1[i] == NULL) {
-		    values1[i] = xmlNodeGetContent(ns1->nodeTab[i]);
-                    if (values1[i] == NULL)
-                        xmlXPathPErrMemory(ctxt);
-                }
-		if (values2[j] == NULL) {
-		    values2[j] = xmlNodeGetContent(ns2->nodeTab[j]);
-                    if (values2[j] == NULL)
-                        xmlXPathPErrMemory(ctxt);
-                }
-		ret = xmlStrEqual(values1[i], values2[j]) ^ neq;
-		if (ret)
-		    break;
+            case XML_DOCUMENT_NODE:
+            case XML_DOCUMENT_TYPE_NODE:
+            case XML_DOCUMENT_FRAG_NODE:
+            case XML_HTML_DOCUMENT_NODE:
+                return(NULL);
+	    case XML_NAMESPACE_DECL: {
+		xmlNsPtr ns = (xmlNsPtr) ctxt->context->node;
+
+		if ((ns->next != NULL) &&
+		    (ns->next->type != XML_NAMESPACE_DECL))
+		    return((xmlNodePtr) ns->next);
+                return(NULL);
 	    }
 	}
-	if (ret)
-	    break;
     }
-    for (i = 0;i < ns1->nodeNr;i++)
-	if (values1[i] != NULL)
-	    xmlFree(values1[i]);
-    for (j = 0;j < ns2->nodeNr;j++)
-	if (values2[j] != NULL)
-	    xmlFree(values2[j]);
-    xmlFree(values1);
-    xmlFree(values2);
-    xmlFree(hashs1);
-    xmlFree(hashs2);
-    return(ret);
+    return(NULL);
 }
 
-static int
-xmlXPathEqualValuesCommon(xmlXPathParserContextPtr ctxt,
-  xmlXPathObjectPtr arg1, xmlXPathObjectPtr arg2) {
-    int ret = 0;
+/**
+ * Traversal function for the "ancestor" direction
+ * the ancestor axis contains the ancestors of the context node; the ancestors
+ * of the context node consist of the parent of context node and the parent's
+ * parent and so on; the nodes are ordered in reverse document order; thus the
+ * parent is the first node on the axis, and the parent's parent is the second
+ * node on the axis
+ *
+ * @param ctxt  the XPath Parser context
+ * @param cur  the current node in the traversal
+ * @returns the next element following that axis
+ */
+xmlNode *
+xmlXPathNextAncestor(xmlXPathParserContext *ctxt, xmlNode *cur) {
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
     /*
-     *At this point we are assured neither arg1 nor arg2
-     *is a nodeset, so we can just pick the appropriate routine.
+     * the parent of an attribute or namespace node is the element
+     * to which the attribute or namespace node is attached
+     * !!!!!!!!!!!!!
      */
-    switch (arg1->type) {
-        case XPATH_UNDEFINED:
-	    break;
-        case XPATH_BOOLEAN:
-	    switch (arg2->type) {
-	        case XPATH_UNDEFINED:
-		    break;
-		case XPATH_BOOLEAN:
-		    ret = (arg1->boolval == arg2->boolval);
-		    break;
-		case XPATH_NUMBER:
-		    ret = (arg1->boolval ==
-			   xmlXPathCastNumberToBoolean(arg2->floatval));
-		    break;
-		case XPATH_STRING:
-		    if ((arg2->stringval == NULL) ||
-			(arg2->stringval[0] == 0)) ret = 0;
-		    else
-			ret = 1;
-		    ret = (arg1->boolval == ret);
-		    break;
-		case XPATH_USERS:
-		    /* TODO */
-		    break;
-		case XPATH_NODESET:
-		case XPATH_XSLT_TREE:
-		    break;
-	    }
-	    break;
-        case XPATH_NUMBER:
-	    switch (arg2->type) {
-	        case XPATH_UNDEFINED:
-		    break;
-		case XPATH_BOOLEAN:
-		    ret = (arg2->boolval==
-			   xmlXPathCastNumberToBoolean(arg1->floatval));
-		    break;
-		case XPATH_STRING:
-		    xmlXPathValuePush(ctxt, arg2);
-		    xmlXPathNumberFunction(ctxt, 1);
-		    arg2 = xmlXPathValuePop(ctxt);
-                    if (ctxt->error)
-                        break;
-                    /* Falls through. */
-		case XPATH_NUMBER:
-		    /* Hand check NaN and Infinity equalities */
-		    if (xmlXPathIsNaN(arg1->floatval) ||
-			    xmlXPathIsNaN(arg2->floatval)) {
-		        ret = 0;
-		    } else if (xmlXPathIsInf(arg1->floatval) == 1) {
-		        if (xmlXPathIsInf(arg2->floatval) == 1)
-			    ret = 1;
-			else
-			    ret = 0;
-		    } else if (xmlXPathIsInf(arg1->floatval) == -1) {
-			if (xmlXPathIsInf(arg2->floatval) == -1)
-			    ret = 1;
-			else
-			    ret = 0;
-		    } else if (xmlXPathIsInf(arg2->floatval) == 1) {
-			if (xmlXPathIsInf(arg1->floatval) == 1)
-			    ret = 1;
-			else
-			    ret = 0;
-		    } else if (xmlXPathIsInf(arg2->floatval) == -1) {
-			if (xmlXPathIsInf(arg1->floatval) == -1)
-			    ret = 1;
-			else
-			    ret = 0;
-		    } else {
-		        ret = (arg1->floatval == arg2->floatval);
-		    }
-		    break;
-		case XPATH_USERS:
-		    /* TODO */
-		    break;
-		case XPATH_NODESET:
-		case XPATH_XSLT_TREE:
-		    break;
-	    }
-	    break;
-        case XPATH_STRING:
-	    switch (arg2->type) {
-	        case XPATH_UNDEFINED:
-		    break;
-		case XPATH_BOOLEAN:
-		    if ((arg1->stringval == NULL) ||
-			(arg1->stringval[0] == 0)) ret = 0;
-		    else
-			ret = 1;
-		    ret = (arg2->boolval == ret);
-		    break;
-		case XPATH_STRING:
-		    ret = xmlStrEqual(arg1->stringval, arg2->stringval);
-		    break;
-		case XPATH_NUMBER:
-		    xmlXPathValuePush(ctxt, arg1);
-		    xmlXPathNumberFunction(ctxt, 1);
-		    arg1 = xmlXPathValuePop(ctxt);
-                    if (ctxt->error)
-                        break;
-		    /* Hand check NaN and Infinity equalities */
-		    if (xmlXPathIsNaN(arg1->floatval) ||
-			    xmlXPathIsNaN(arg2->floatval)) {
-		        ret = 0;
-		    } else if (xmlXPathIsInf(arg1->floatval) == 1) {
-			if (xmlXPathIsInf(arg2->floatval) == 1)
-			    ret = 1;
-			else
-			    ret = 0;
-		    } else if (xmlXPathIsInf(arg1->floatval) == -1) {
-			if (xmlXPathIsInf(arg2->floatval) == -1)
-			    ret = 1;
-			else
-			    ret = 0;
-		    } else if (xmlXPathIsInf(arg2->floatval) == 1) {
-			if (xmlXPathIsInf(arg1->floatval) == 1)
-			    ret = 1;
-			else
-			    ret = 0;
-		    } else if (xmlXPathIsInf(arg2->floatval) == -1) {
-			if (xmlXPathIsInf(arg1->floatval) == -1)
-			    ret = 1;
-			else
-			    ret = 0;
-		    } else {
-		        ret = (arg1->floatval == arg2->floatval);
-		    }
-		    break;
-		case XPATH_USERS:
-		    /* TODO */
-		    break;
-		case XPATH_NODESET:
-		case XPATH_XSLT_TREE:
-		    break;
+    if (cur == NULL) {
+	if (ctxt->context->node == NULL) return(NULL);
+	switch (ctxt->context->node->type) {
+            case XML_ELEMENT_NODE:
+            case XML_TEXT_NODE:
+            case XML_CDATA_SECTION_NODE:
+            case XML_ENTITY_REF_NODE:
+            case XML_ENTITY_NODE:
+            case XML_PI_NODE:
+            case XML_COMMENT_NODE:
+	    case XML_DTD_NODE:
+	    case XML_ELEMENT_DECL:
+	    case XML_ATTRIBUTE_DECL:
+	    case XML_ENTITY_DECL:
+            case XML_NOTATION_NODE:
+	    case XML_XINCLUDE_START:
+	    case XML_XINCLUDE_END:
+		if (ctxt->context->node->parent == NULL)
+		    return((xmlNodePtr) ctxt->context->doc);
+		if ((ctxt->context->node->parent->type == XML_ELEMENT_NODE) &&
+		    ((ctxt->context->node->parent->name[0] == ' ') ||
+		     (xmlStrEqual(ctxt->context->node->parent->name,
+				 BAD_CAST "fake node libxslt"))))
+		    return(NULL);
+		return(ctxt->context->node->parent);
+            case XML_ATTRIBUTE_NODE: {
+		xmlAttrPtr tmp = (xmlAttrPtr) ctxt->context->node;
+
+		return(tmp->parent);
 	    }
-	    break;
-        case XPATH_USERS:
-	    /* TODO */
-	    break;
-	case XPATH_NODESET:
-	case XPATH_XSLT_TREE:
-	    break;
+            case XML_DOCUMENT_NODE:
+            case XML_DOCUMENT_TYPE_NODE:
+            case XML_DOCUMENT_FRAG_NODE:
+            case XML_HTML_DOCUMENT_NODE:
+                return(NULL);
+	    case XML_NAMESPACE_DECL: {
+		xmlNsPtr ns = (xmlNsPtr) ctxt->context->node;
+
+		if ((ns->next != NULL) &&
+		    (ns->next->type != XML_NAMESPACE_DECL))
+		    return((xmlNodePtr) ns->next);
+		/* Bad, how did that namespace end up here ? */
+                return(NULL);
+	    }
+	}
+	return(NULL);
     }
-    xmlXPathReleaseObject(ctxt->context, arg1);
-    xmlXPathReleaseObject(ctxt->context, arg2);
-    return(ret);
+    if (cur == ctxt->context->doc->children)
+	return((xmlNodePtr) ctxt->context->doc);
+    if (cur == (xmlNodePtr) ctxt->context->doc)
+	return(NULL);
+    switch (cur->type) {
+	case XML_ELEMENT_NODE:
+	case XML_TEXT_NODE:
+	case XML_CDATA_SECTION_NODE:
+	case XML_ENTITY_REF_NODE:
+	case XML_ENTITY_NODE:
+	case XML_PI_NODE:
+	case XML_COMMENT_NODE:
+	case XML_NOTATION_NODE:
+	case XML_DTD_NODE:
+        case XML_ELEMENT_DECL:
+        case XML_ATTRIBUTE_DECL:
+        case XML_ENTITY_DECL:
+	case XML_XINCLUDE_START:
+	case XML_XINCLUDE_END:
+	    if (cur->parent == NULL)
+		return(NULL);
+	    if ((cur->parent->type == XML_ELEMENT_NODE) &&
+		((cur->parent->name[0] == ' ') ||
+		 (xmlStrEqual(cur->parent->name,
+			      BAD_CAST "fake node libxslt"))))
+		return(NULL);
+	    return(cur->parent);
+	case XML_ATTRIBUTE_NODE: {
+	    xmlAttrPtr att = (xmlAttrPtr) cur;
+
+	    return(att->parent);
+	}
+	case XML_NAMESPACE_DECL: {
+	    xmlNsPtr ns = (xmlNsPtr) cur;
+
+	    if ((ns->next != NULL) &&
+	        (ns->next->type != XML_NAMESPACE_DECL))
+	        return((xmlNodePtr) ns->next);
+	    /* Bad, how did that namespace end up here ? */
+            return(NULL);
+	}
+	case XML_DOCUMENT_NODE:
+	case XML_DOCUMENT_TYPE_NODE:
+	case XML_DOCUMENT_FRAG_NODE:
+	case XML_HTML_DOCUMENT_NODE:
+	    return(NULL);
+    }
+    return(NULL);
 }
 
 /**
- * Implement the equal operation on XPath objects content: `arg1` == `arg2`
+ * Traversal function for the "ancestor-or-self" direction
+ * he ancestor-or-self axis contains the context node and ancestors of
+ * the context node in reverse document order; thus the context node is
+ * the first node on the axis, and the context node's parent the second;
+ * parent here is defined the same as with the parent axis.
  *
  * @param ctxt  the XPath Parser context
- * @returns 0 or 1 depending on the results of the test.
+ * @param cur  the current node in the traversal
+ * @returns the next element following that axis
  */
-int
-xmlXPathEqualValues(xmlXPathParserContext *ctxt) {
-    xmlXPathObjectPtr arg1, arg2, argtmp;
-    int ret = 0;
+xmlNode *
+xmlXPathNextAncestorOrSelf(xmlXPathParserContext *ctxt, xmlNode *cur) {
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
+    if (cur == NULL)
+        return(ctxt->context->node);
+    return(xmlXPathNextAncestor(ctxt, cur));
+}
 
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(0);
-    arg2 = xmlXPathValuePop(ctxt);
-    arg1 = xmlXPathValuePop(ctxt);
-    if ((arg1 == NULL) || (arg2 == NULL)) {
-	if (arg1 != NULL)
-	    xmlXPathReleaseObject(ctxt->context, arg1);
-	else
-	    xmlXPathReleaseObject(ctxt->context, arg2);
-	XP_ERROR0(XPATH_INVALID_OPERAND);
+/**
+ * Traversal function for the "following-sibling" direction
+ * The following-sibling axis contains the following siblings of the context
+ * node in document order.
+ *
+ * @param ctxt  the XPath Parser context
+ * @param cur  the current node in the traversal
+ * @returns the next element following that axis
+ */
+xmlNode *
+xmlXPathNextFollowingSibling(xmlXPathParserContext *ctxt, xmlNode *cur) {
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
+    if ((ctxt->context->node->type == XML_ATTRIBUTE_NODE) ||
+	(ctxt->context->node->type == XML_NAMESPACE_DECL))
+	return(NULL);
+    if (cur == (xmlNodePtr) ctxt->context->doc)
+        return(NULL);
+    if (cur == NULL) {
+        if (XML_LAZY_DOC(ctxt->context->node->doc))
+            xmlLazyMaterialize(ctxt->context->node->parent,
+                               XML_LAZY_CONTENT);
+        return(ctxt->context->node->next);
     }
+    return(cur->next);
+}
 
-    if (arg1 == arg2) {
-	xmlXPathFreeObject(arg1);
-        return(1);
+/**
+ * Traversal function for the "preceding-sibling" direction
+ * The preceding-sibling axis contains the preceding siblings of the context
+ * node in reverse document order; the first preceding sibling is first on the
+ * axis; the sibling preceding that node is the second on the axis and so on.
+ *
+ * @param ctxt  the XPath Parser context
+ * @param cur  the current node in the traversal
+ * @returns the next element following that axis
+ */
+xmlNode *
+xmlXPathNextPrecedingSibling(xmlXPathParserContext *ctxt, xmlNode *cur) {
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
+    if ((ctxt->context->node->type == XML_ATTRIBUTE_NODE) ||
+	(ctxt->context->node->type == XML_NAMESPACE_DECL))
+	return(NULL);
+    if (cur == (xmlNodePtr) ctxt->context->doc)
+        return(NULL);
+    if (cur == NULL) {
+        if (XML_LAZY_DOC(ctxt->context->node->doc))
+            xmlLazyMaterialize(ctxt->context->node->parent,
+                               XML_LAZY_CONTENT);
+        return(ctxt->context->node->prev);
     }
-
-    /*
-     *If either argument is a nodeset, it's a 'special case'
-     */
-    if ((arg2->type == XPATH_NODESET) || (arg2->type == XPATH_XSLT_TREE) ||
-      (arg1->type == XPATH_NODESET) || (arg1->type == XPATH_XSLT_TREE)) {
-	/*
-	 *Hack it to assure arg1 is the nodeset
-	 */
-	if ((arg1->type != XPATH_NODESET) && (arg1->type != XPATH_XSLT_TREE)) {
-		argtmp = arg2;
-		arg2 = arg1;
-		arg1 = argtmp;
-	}
-	switch (arg2->type) {
-	    case XPATH_UNDEFINED:
-		break;
-	    case XPATH_NODESET:
-	    case XPATH_XSLT_TREE:
-		ret = xmlXPathEqualNodeSets(ctxt, arg1, arg2, 0);
-		break;
-	    case XPATH_BOOLEAN:
-		if ((arg1->nodesetval == NULL) ||
-		  (arg1->nodesetval->nodeNr == 0)) ret = 0;
-		else
-		    ret = 1;
-		ret = (ret == arg2->boolval);
-		break;
-	    case XPATH_NUMBER:
-		ret = xmlXPathEqualNodeSetFloat(ctxt, arg1, arg2->floatval, 0);
-		break;
-	    case XPATH_STRING:
-		ret = xmlXPathEqualNodeSetString(ctxt, arg1,
-                                                 arg2->stringval, 0);
-		break;
-	    case XPATH_USERS:
-		/* TODO */
-		break;
-	}
-	xmlXPathReleaseObject(ctxt->context, arg1);
-	xmlXPathReleaseObject(ctxt->context, arg2);
-	return(ret);
+    if ((cur->prev != NULL) && (cur->prev->type == XML_DTD_NODE)) {
+	cur = cur->prev;
+	if (cur == NULL)
+	    return(ctxt->context->node->prev);
     }
+    return(cur->prev);
+}
 
-    return (xmlXPathEqualValuesCommon(ctxt, arg1, arg2));
+/*
+ * The following and preceding axes can visit the whole document.
+ */
+static void
+xmlXPathMaterializeDoc(xmlNodePtr node) {
+    if (node->type == XML_NAMESPACE_DECL) {
+        node = (xmlNodePtr) ((xmlNsPtr) node)->next;
+        if ((node == NULL) || (node->type == XML_NAMESPACE_DECL))
+            return;
+    }
+    if (XML_LAZY_DOC(node->doc))
+        xmlLazyMaterialize((xmlNodePtr) node->doc,
+                           XML_LAZY_CONTENT | XML_LAZY_RECURSIVE);
 }
 
 /**
- * Implement the equal operation on XPath objects content: `arg1` == `arg2`
+ * Traversal function for the "following" direction
+ * The following axis contains all nodes in the same document as the context
+ * node that are after the context node in document order, excluding any
+ * descendants and excluding attribute nodes and namespace nodes; the nodes
+ * are ordered in document order
  *
  * @param ctxt  the XPath Parser context
- * @returns 0 or 1 depending on the results of the test.
+ * @param cur  the current node in the traversal
+ * @returns the next element following that axis
  */
-int
-xmlXPathNotEqualValues(xmlXPathParserContext *ctxt) {
-    xmlXPathObjectPtr arg1, arg2, argtmp;
-    int ret = 0;
+xmlNode *
+xmlXPathNextFollowing(xmlXPathParserContext *ctxt, xmlNode *cur) {
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
+    if ((cur == NULL) && (ctxt->context->node != NULL))
+        xmlXPathMaterializeDoc(ctxt->context->node);
+    if ((cur != NULL) && (cur->type  != XML_ATTRIBUTE_NODE) &&
+        (cur->type != XML_NAMESPACE_DECL) && (cur->children != NULL))
+        return(cur->children);
 
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(0);
-    arg2 = xmlXPathValuePop(ctxt);
-    arg1 = xmlXPathValuePop(ctxt);
-    if ((arg1 == NULL) || (arg2 == NULL)) {
-	if (arg1 != NULL)
-	    xmlXPathReleaseObject(ctxt->context, arg1);
-	else
-	    xmlXPathReleaseObject(ctxt->context, arg2);
-	XP_ERROR0(XPATH_INVALID_OPERAND);
+    if (cur == NULL) {
+        cur = ctxt->context->node;
+        if (cur->type == XML_ATTRIBUTE_NODE) {
+            cur = cur->parent;
+        } else if (cur->type == XML_NAMESPACE_DECL) {
+            xmlNsPtr ns = (xmlNsPtr) cur;
+
+            if ((ns->next == NULL) ||
+                (ns->next->type == XML_NAMESPACE_DECL))
+                return (NULL);
+            cur = (xmlNodePtr) ns->next;
+        }
+    }
+    if (cur == NULL) return(NULL) ; /* ERROR */
+    if (cur->next != NULL) return(cur->next) ;
+    do {
+        cur = cur->parent;
+        if (cur == NULL) break;
+        if (cur == (xmlNodePtr) ctxt->context->doc) return(NULL);
+        if (cur->next != NULL) return(cur->next);
+    } while (cur != NULL);
+    return(cur);
+}
+
+/*
+ * @param ancestor  the ancestor node
+ * @param node  the current node
+ *
+ * Check that `ancestor` is a `node`'s ancestor
+ *
+ * @returns 1 if `ancestor` is a `node`'s ancestor, 0 otherwise.
+ */
+static int
+xmlXPathIsAncestor(xmlNodePtr ancestor, xmlNodePtr node) {
+    if ((ancestor == NULL) || (node == NULL)) return(0);
+    if (node->type == XML_NAMESPACE_DECL)
+        return(0);
+    if (ancestor->type == XML_NAMESPACE_DECL)
+        return(0);
+    /* nodes need to be in the same document */
+    if (ancestor->doc != node->doc) return(0);
+    /* avoid searching if ancestor or node is the root node */
+    if (ancestor == (xmlNodePtr) node->doc) return(1);
+    if (node == (xmlNodePtr) ancestor->doc) return(0);
+    while (node->parent != NULL) {
+        if (node->parent == ancestor)
+            return(1);
+	node = node->parent;
     }
+    return(0);
+}
 
-    if (arg1 == arg2) {
-	xmlXPathReleaseObject(ctxt->context, arg1);
-        return(0);
-    }
+/**
+ * Traversal function for the "preceding" direction
+ * the preceding axis contains all nodes in the same document as the context
+ * node that are before the context node in document order, excluding any
+ * ancestors and excluding attribute nodes and namespace nodes; the nodes are
+ * ordered in reverse document order
+ *
+ * @param ctxt  the XPath Parser context
+ * @param cur  the current node in the traversal
+ * @returns the next element following that axis
+ */
+xmlNode *
+xmlXPathNextPreceding(xmlXPathParserContext *ctxt, xmlNode *cur)
+{
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
+    if (cur == NULL) {
+        cur = ctxt->context->node;
+        xmlXPathMaterializeDoc(cur);
+        if (cur->type == XML_ATTRIBUTE_NODE) {
+            cur = cur->parent;
+        } else if (cur->type == XML_NAMESPACE_DECL) {
+            xmlNsPtr ns = (xmlNsPtr) cur;
 
-    /*
-     *If either argument is a nodeset, it's a 'special case'
-     */
-    if ((arg2->type == XPATH_NODESET) || (arg2->type == XPATH_XSLT_TREE) ||
-      (arg1->type == XPATH_NODESET) || (arg1->type == XPATH_XSLT_TREE)) {
-	/*
-	 *Hack it to assure arg1 is the nodeset
-	 */
-	if ((arg1->type != XPATH_NODESET) && (arg1->type != XPATH_XSLT_TREE)) {
-		argtmp = arg2;
-		arg2 = arg1;
-		arg1 = argtmp;
-	}
-	switch (arg2->type) {
-	    case XPATH_UNDEFINED:
-		break;
-	    case XPATH_NODESET:
-	    case XPATH_XSLT_TREE:
-		ret = xmlXPathEqualNodeSets(ctxt, arg1, arg2, 1);
-		break;
-	    case XPATH_BOOLEAN:
-		if ((arg1->nodesetval == NULL) ||
-		  (arg1->nodesetval->nodeNr == 0)) ret = 0;
-		else
-		    ret = 1;
-		ret = (ret != arg2->boolval);
-		break;
-	    case XPATH_NUMBER:
-		ret = xmlXPathEqualNodeSetFloat(ctxt, arg1, arg2->floatval, 1);
-		break;
-	    case XPATH_STRING:
-		ret = xmlXPathEqualNodeSetString(ctxt, arg1,
-                                                 arg2->stringval, 1);
-		break;
-	    case XPATH_USERS:
-		/* TODO */
-		break;
-	}
-	xmlXPathReleaseObject(ctxt->context, arg1);
-	xmlXPathReleaseObject(ctxt->context, arg2);
-	return(ret);
+            if ((ns->next == NULL) ||
+                (ns->next->type == XML_NAMESPACE_DECL))
+                return (NULL);
+            cur = (xmlNodePtr) ns->next;
+        }
     }
+    if ((cur == NULL) || (cur->type == XML_NAMESPACE_DECL))
+	return (NULL);
+    if ((cur->prev != NULL) && (cur->prev->type == XML_DTD_NODE))
+	cur = cur->prev;
+    do {
+        if (cur->prev != NULL) {
+            for (cur = cur->prev; cur->last != NULL; cur = cur->last) ;
+            return (cur);
+        }
 
-    return (!xmlXPathEqualValuesCommon(ctxt, arg1, arg2));
+        cur = cur->parent;
+        if (cur == NULL)
+            return (NULL);
+        if (cur == ctxt->context->doc->children)
+            return (NULL);
+    } while (xmlXPathIsAncestor(cur, ctxt->context->node));
+    return (cur);
 }
 
 /**
- * Implement the compare operation on XPath objects:
- *     `arg1` < `arg2`    (1, 1, ...
- *     `arg1` <= `arg2`   (1, 0, ...
- *     `arg1` > `arg2`    (0, 1, ...
- *     `arg1` >= `arg2`   (0, 0, ...
- *
- * When neither object to be compared is a node-set and the operator is
- * <=, <, >=, >, then the objects are compared by converted both objects
- * to numbers and comparing the numbers according to IEEE 754. The <
- * comparison will be true if and only if the first number is less than the
- * second number. The <= comparison will be true if and only if the first
- * number is less than or equal to the second number. The > comparison
- * will be true if and only if the first number is greater than the second
- * number. The >= comparison will be true if and only if the first number
- * is greater than or equal to the second number.
+ * Traversal function for the "preceding" direction
+ * the preceding axis contains all nodes in the same document as the context
+ * node that are before the context node in document order, excluding any
+ * ancestors and excluding attribute nodes and namespace nodes; the nodes are
+ * ordered in reverse document order
+ * This is a faster implementation but internal only since it requires a
+ * state kept in the parser context: ctxt->ancestor.
  *
  * @param ctxt  the XPath Parser context
- * @param inf  less than (1) or greater than (0)
- * @param strict  is the comparison strict
- * @returns 1 if the comparison succeeded, 0 if it failed
+ * @param cur  the current node in the traversal
+ * @returns the next element following that axis
  */
-int
-xmlXPathCompareValues(xmlXPathParserContext *ctxt, int inf, int strict) {
-    int ret = 0, arg1i = 0, arg2i = 0;
-    xmlXPathObjectPtr arg1, arg2;
+static xmlNodePtr
+xmlXPathNextPrecedingInternal(xmlXPathParserContextPtr ctxt,
+                              xmlNodePtr cur)
+{
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
+    if (cur == NULL) {
+        cur = ctxt->context->node;
+        if (cur == NULL)
+            return (NULL);
+        xmlXPathMaterializeDoc(cur);
+        if (cur->type == XML_ATTRIBUTE_NODE) {
+            cur = cur->parent;
+        } else if (cur->type == XML_NAMESPACE_DECL) {
+            xmlNsPtr ns = (xmlNsPtr) cur;
 
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(0);
-    arg2 = xmlXPathValuePop(ctxt);
-    arg1 = xmlXPathValuePop(ctxt);
-    if ((arg1 == NULL) || (arg2 == NULL)) {
-	if (arg1 != NULL)
-	    xmlXPathReleaseObject(ctxt->context, arg1);
-	else
-	    xmlXPathReleaseObject(ctxt->context, arg2);
-	XP_ERROR0(XPATH_INVALID_OPERAND);
+            if ((ns->next == NULL) ||
+                (ns->next->type == XML_NAMESPACE_DECL))
+                return (NULL);
+            cur = (xmlNodePtr) ns->next;
+        }
+        ctxt->ancestor = cur->parent;
     }
-
-    if ((arg2->type == XPATH_NODESET) || (arg2->type == XPATH_XSLT_TREE) ||
-      (arg1->type == XPATH_NODESET) || (arg1->type == XPATH_XSLT_TREE)) {
-	/*
-	 * If either argument is a XPATH_NODESET or XPATH_XSLT_TREE the two arguments
-	 * are not freed from within this routine; they will be freed from the
-	 * called routine, e.g. xmlXPathCompareNodeSets or xmlXPathCompareNodeSetValue
-	 */
-	if (((arg2->type == XPATH_NODESET) || (arg2->type == XPATH_XSLT_TREE)) &&
-	  ((arg1->type == XPATH_NODESET) || (arg1->type == XPATH_XSLT_TREE))){
-	    ret = xmlXPathCompareNodeSets(ctxt, inf, strict, arg1, arg2);
-	} else {
-	    if ((arg1->type == XPATH_NODESET) || (arg1->type == XPATH_XSLT_TREE)) {
-		ret = xmlXPathCompareNodeSetValue(ctxt, inf, strict,
-			                          arg1, arg2);
-	    } else {
-		ret = xmlXPathCompareNodeSetValue(ctxt, !inf, strict,
-			                          arg2, arg1);
-	    }
-	}
-	return(ret);
+    if (cur->type == XML_NAMESPACE_DECL)
+        return(NULL);
+    if ((cur->prev != NULL) && (cur->prev->type == XML_DTD_NODE))
+	cur = cur->prev;
+    while (cur->prev == NULL) {
+        cur = cur->parent;
+        if (cur == NULL)
+            return (NULL);
+        if (cur == ctxt->context->doc->children)
+            return (NULL);
+        if (cur != ctxt->ancestor)
+            return (cur);
+        ctxt->ancestor = cur->parent;
     }
+    cur = cur->prev;
+    while (cur->last != NULL)
+        cur = cur->last;
+    return (cur);
+}
 
-    if (arg1->type != XPATH_NUMBER) {
-	xmlXPathValuePush(ctxt, arg1);
-	xmlXPathNumberFunction(ctxt, 1);
-	arg1 = xmlXPathValuePop(ctxt);
-    }
-    if (arg2->type != XPATH_NUMBER) {
-	xmlXPathValuePush(ctxt, arg2);
-	xmlXPathNumberFunction(ctxt, 1);
-	arg2 = xmlXPathValuePop(ctxt);
-    }
-    if (ctxt->error)
-        goto error;
-    /*
-     * Add tests for infinity and nan
-     * => feedback on 3.4 for Inf and NaN
-     */
-    /* Hand check NaN and Infinity comparisons */
-    if (xmlXPathIsNaN(arg1->floatval) || xmlXPathIsNaN(arg2->floatval)) {
-	ret=0;
-    } else {
-	arg1i=xmlXPathIsInf(arg1->floatval);
-	arg2i=xmlXPathIsInf(arg2->floatval);
-	if (inf && strict) {
-	    if ((arg1i == -1 && arg2i != -1) ||
-		(arg2i == 1 && arg1i != 1)) {
-		ret = 1;
-	    } else if (arg1i == 0 && arg2i == 0) {
-		ret = (arg1->floatval < arg2->floatval);
-	    } else {
-		ret = 0;
-	    }
-	}
-	else if (inf && !strict) {
-	    if (arg1i == -1 || arg2i == 1) {
-		ret = 1;
-	    } else if (arg1i == 0 && arg2i == 0) {
-		ret = (arg1->floatval <= arg2->floatval);
-	    } else {
-		ret = 0;
-	    }
-	}
-	else if (!inf && strict) {
-	    if ((arg1i == 1 && arg2i != 1) ||
-		(arg2i == -1 && arg1i != -1)) {
-		ret = 1;
-	    } else if (arg1i == 0 && arg2i == 0) {
-		ret = (arg1->floatval > arg2->floatval);
-	    } else {
-		ret = 0;
-	    }
-	}
-	else if (!inf && !strict) {
-	    if (arg1i == 1 || arg2i == -1) {
-		ret = 1;
-	    } else if (arg1i == 0 && arg2i == 0) {
-		ret = (arg1->floatval >= arg2->floatval);
-	    } else {
-		ret = 0;
-	    }
-	}
+/**
+ * Traversal function for the "namespace" direction
+ * the namespace axis contains the namespace nodes of the context node;
+ * the order of nodes on this axis is implementation-defined; the axis will
+ * be empty unless the context node is an element
+ *
+ * We keep the XML namespace node at the end of the list.
+ *
+ * @param ctxt  the XPath Parser context
+ * @param cur  the current attribute in the traversal
+ * @returns the next element following that axis
+ */
+xmlNode *
+xmlXPathNextNamespace(xmlXPathParserContext *ctxt, xmlNode *cur) {
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
+    if (ctxt->context->node->type != XML_ELEMENT_NODE) return(NULL);
+    if (cur == NULL) {
+        if (ctxt->context->tmpNsList != NULL)
+	    xmlFree(ctxt->context->tmpNsList);
+	ctxt->context->tmpNsNr = 0;
+        if (xmlGetNsListSafe(ctxt->context->doc, ctxt->context->node,
+                             &ctxt->context->tmpNsList) < 0) {
+            xmlXPathPErrMemory(ctxt);
+            return(NULL);
+        }
+        if (ctxt->context->tmpNsList != NULL) {
+            while (ctxt->context->tmpNsList[ctxt->context->tmpNsNr] != NULL) {
+                ctxt->context->tmpNsNr++;
+            }
+        }
+	return((xmlNodePtr) xmlXPathXMLNamespace);
+    }
+    if (ctxt->context->tmpNsNr > 0) {
+	return (xmlNodePtr)ctxt->context->tmpNsList[--ctxt->context->tmpNsNr];
+    } else {
+	if (ctxt->context->tmpNsList != NULL)
+	    xmlFree(ctxt->context->tmpNsList);
+	ctxt->context->tmpNsList = NULL;
+	return(NULL);
     }
-error:
-    xmlXPathReleaseObject(ctxt->context, arg1);
-    xmlXPathReleaseObject(ctxt->context, arg2);
-    return(ret);
 }
 
 /**
- * Implement the unary - operation on an XPath object
- * The numeric operators convert their operands to numbers as if
- * by calling the number function.
+ * Traversal function for the "attribute" direction
+ * TODO: support DTD inherited default attributes
  *
  * @param ctxt  the XPath Parser context
+ * @param cur  the current attribute in the traversal
+ * @returns the next element following that axis
  */
-void
-xmlXPathValueFlipSign(xmlXPathParserContext *ctxt) {
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return;
-    CAST_TO_NUMBER;
-    CHECK_TYPE(XPATH_NUMBER);
-    ctxt->value->floatval = -ctxt->value->floatval;
+xmlNode *
+xmlXPathNextAttribute(xmlXPathParserContext *ctxt, xmlNode *cur) {
+    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
+    if (ctxt->context->node == NULL)
+	return(NULL);
+    if (ctxt->context->node->type != XML_ELEMENT_NODE)
+	return(NULL);
+    if (cur == NULL) {
+        if (ctxt->context->node == (xmlNodePtr) ctxt->context->doc)
+	    return(NULL);
+        if (XML_LAZY_DOC(ctxt->context->node->doc))
+            xmlLazyMaterialize(ctxt->context->node, XML_LAZY_ATTRS);
+        return((xmlNodePtr)ctxt->context->node->properties);
+    }
+    return((xmlNodePtr)cur->next);
 }
 
+/************************************************************************
+ *									*
+ *		NodeTest Functions					*
+ *									*
+ ************************************************************************/
+
+#define IS_FUNCTION			200
+
+
+/************************************************************************
+ *									*
+ *		Implicit tree core function library			*
+ *									*
+ ************************************************************************/
+
 /**
- * Implement the add operation on XPath objects:
- * The numeric operators convert their operands to numbers as if
- * by calling the number function.
+ * Initialize the context to the root of the document
  *
  * @param ctxt  the XPath Parser context
  */
 void
-xmlXPathAddValues(xmlXPathParserContext *ctxt) {
-    xmlXPathObjectPtr arg;
-    double val;
-
-    arg = xmlXPathValuePop(ctxt);
-    if (arg == NULL)
-	XP_ERROR(XPATH_INVALID_OPERAND);
-    val = xmlXPathCastToNumberInternal(ctxt, arg);
-    xmlXPathReleaseObject(ctxt->context, arg);
-    CAST_TO_NUMBER;
-    CHECK_TYPE(XPATH_NUMBER);
-    ctxt->value->floatval += val;
+xmlXPathRoot(xmlXPathParserContext *ctxt) {
+    if ((ctxt == NULL) || (ctxt->context == NULL))
+	return;
+    xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt,
+                                            (xmlNodePtr) ctxt->context->doc));
 }
 
+/************************************************************************
+ *									*
+ *		The explicit core function library			*
+ *http://www.w3.org/Style/XSL/Group/1999/07/xpath-19990705.html#corelib	*
+ *									*
+ ************************************************************************/
+
+
 /**
- * Implement the subtraction operation on XPath objects:
- * The numeric operators convert their operands to numbers as if
- * by calling the number function.
+ * Implement the last() XPath function
+ *    number last()
+ * The last function returns the number of nodes in the context node list.
  *
  * @param ctxt  the XPath Parser context
+ * @param nargs  the number of arguments
  */
 void
-xmlXPathSubValues(xmlXPathParserContext *ctxt) {
-    xmlXPathObjectPtr arg;
-    double val;
-
-    arg = xmlXPathValuePop(ctxt);
-    if (arg == NULL)
-	XP_ERROR(XPATH_INVALID_OPERAND);
-    val = xmlXPathCastToNumberInternal(ctxt, arg);
-    xmlXPathReleaseObject(ctxt->context, arg);
-    CAST_TO_NUMBER;
-    CHECK_TYPE(XPATH_NUMBER);
-    ctxt->value->floatval -= val;
+xmlXPathLastFunction(xmlXPathParserContext *ctxt, int nargs) {
+    CHECK_ARITY(0);
+    if (ctxt->context->contextSize >= 0) {
+	xmlXPathValuePush(ctxt,
+	    xmlXPathCacheNewFloat(ctxt, (double) ctxt->context->contextSize));
+    } else {
+	XP_ERROR(XPATH_INVALID_CTXT_SIZE);
+    }
 }
 
 /**
- * Implement the multiply operation on XPath objects:
- * The numeric operators convert their operands to numbers as if
- * by calling the number function.
+ * Implement the position() XPath function
+ *    number position()
+ * The position function returns the position of the context node in the
+ * context node list. The first position is 1, and so the last position
+ * will be equal to last().
  *
  * @param ctxt  the XPath Parser context
+ * @param nargs  the number of arguments
  */
 void
-xmlXPathMultValues(xmlXPathParserContext *ctxt) {
-    xmlXPathObjectPtr arg;
-    double val;
-
-    arg = xmlXPathValuePop(ctxt);
-    if (arg == NULL)
-	XP_ERROR(XPATH_INVALID_OPERAND);
-    val = xmlXPathCastToNumberInternal(ctxt, arg);
-    xmlXPathReleaseObject(ctxt->context, arg);
-    CAST_TO_NUMBER;
-    CHECK_TYPE(XPATH_NUMBER);
-    ctxt->value->floatval *= val;
+xmlXPathPositionFunction(xmlXPathParserContext *ctxt, int nargs) {
+    CHECK_ARITY(0);
+    if (ctxt->context->proximityPosition >= 0) {
+	xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt,
+            (double) ctxt->context->proximityPosition));
+    } else {
+	XP_ERROR(XPATH_INVALID_CTXT_POSITION);
+    }
 }
 
 /**
- * Implement the div operation on XPath objects `arg1` / `arg2`.
- * The numeric operators convert their operands to numbers as if
- * by calling the number function.
+ * Implement the count() XPath function
+ *    number count(node-set)
  *
  * @param ctxt  the XPath Parser context
+ * @param nargs  the number of arguments
  */
-ATTRIBUTE_NO_SANITIZE("float-divide-by-zero")
 void
-xmlXPathDivValues(xmlXPathParserContext *ctxt) {
-    xmlXPathObjectPtr arg;
-    double val;
+xmlXPathCountFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlXPathObjectPtr cur;
 
-    arg = xmlXPathValuePop(ctxt);
-    if (arg == NULL)
-	XP_ERROR(XPATH_INVALID_OPERAND);
-    val = xmlXPathCastToNumberInternal(ctxt, arg);
-    xmlXPathReleaseObject(ctxt->context, arg);
-    CAST_TO_NUMBER;
-    CHECK_TYPE(XPATH_NUMBER);
-    ctxt->value->floatval /= val;
+    CHECK_ARITY(1);
+    if ((ctxt->value == NULL) ||
+	((ctxt->value->type != XPATH_NODESET) &&
+	 (ctxt->value->type != XPATH_XSLT_TREE)))
+	XP_ERROR(XPATH_INVALID_TYPE);
+    cur = xmlXPathValuePop(ctxt);
+
+    if ((cur == NULL) || (cur->nodesetval == NULL))
+	xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt, 0.0));
+    else
+	xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt,
+	    (double) cur->nodesetval->nodeNr));
+    xmlXPathReleaseObject(ctxt->context, cur);
+}
+
+/**
+ * Selects elements by their unique ID.
+ *
+ * @param doc  the document
+ * @param ids  a whitespace separated list of IDs
+ * @returns a node-set of selected elements.
+ */
+static xmlNodeSetPtr
+xmlXPathGetElementsByIds (xmlDocPtr doc, const xmlChar *ids) {
+    xmlNodeSetPtr ret;
+    const xmlChar *cur = ids;
+    xmlChar *ID;
+    xmlAttrPtr attr;
+    xmlNodePtr elem = NULL;
+
+    if (ids == NULL) return(NULL);
+
+    ret = xmlXPathNodeSetCreate(NULL);
+    if (ret == NULL)
+        return(ret);
+
+    while (IS_BLANK_CH(*cur)) cur++;
+    while (*cur != 0) {
+	while ((!IS_BLANK_CH(*cur)) && (*cur != 0))
+	    cur++;
+
+        ID = xmlStrndup(ids, cur - ids);
+	if (ID == NULL) {
+            xmlXPathFreeNodeSet(ret);
+            return(NULL);
+        }
+        /*
+         * We used to check the fact that the value passed
+         * was an NCName, but this generated much troubles for
+         * me and Aleksey Sanin, people blatantly violated that
+         * constraint, like Visa3D spec.
+         * if (xmlValidateNCName(ID, 1) == 0)
+         */
+        attr = xmlGetID(doc, ID);
+        xmlFree(ID);
+        if (attr != NULL) {
+            if (attr->type == XML_ATTRIBUTE_NODE)
+                elem = attr->parent;
+            else if (attr->type == XML_ELEMENT_NODE)
+                elem = (xmlNodePtr) attr;
+            else
+                elem = NULL;
+            if (elem != NULL) {
+                if (xmlXPathNodeSetAdd(ret, elem) < 0) {
+                    xmlXPathFreeNodeSet(ret);
+                    return(NULL);
+                }
+            }
+        }
+
+	while (IS_BLANK_CH(*cur)) cur++;
+	ids = cur;
+    }
+    return(ret);
 }
 
 /**
- * Implement the mod operation on XPath objects: `arg1` / `arg2`
- * The numeric operators convert their operands to numbers as if
- * by calling the number function.
+ * Implement the id() XPath function
+ *    node-set id(object)
+ * The id function selects elements by their unique ID
+ * (see [5.2.1 Unique IDs]). When the argument to id is of type node-set,
+ * then the result is the union of the result of applying id to the
+ * string value of each of the nodes in the argument node-set. When the
+ * argument to id is of any other type, the argument is converted to a
+ * string as if by a call to the string function; the string is split
+ * into a whitespace-separated list of tokens (whitespace is any sequence
+ * of characters matching the production S); the result is a node-set
+ * containing the elements in the same document as the context node that
+ * have a unique ID equal to any of the tokens in the list.
  *
  * @param ctxt  the XPath Parser context
+ * @param nargs  the number of arguments
  */
 void
-xmlXPathModValues(xmlXPathParserContext *ctxt) {
-    xmlXPathObjectPtr arg;
-    double arg1, arg2;
-
-    arg = xmlXPathValuePop(ctxt);
-    if (arg == NULL)
-	XP_ERROR(XPATH_INVALID_OPERAND);
-    arg2 = xmlXPathCastToNumberInternal(ctxt, arg);
-    xmlXPathReleaseObject(ctxt->context, arg);
-    CAST_TO_NUMBER;
-    CHECK_TYPE(XPATH_NUMBER);
-    arg1 = ctxt->value->floatval;
-    if (arg2 == 0)
-	ctxt->value->floatval = xmlXPathNAN;
-    else {
-	ctxt->value->floatval = fmod(arg1, arg2);
-    }
-}
-
-/************************************************************************
- *									*
- *		The traversal functions					*
- *									*
- ************************************************************************/
-
-/*
- * A traversal function enumerates nodes along an axis.
- * Initially it must be called with NULL, and it indicates
- * termination on the axis by returning NULL.
- */
-typedef xmlNode *(*xmlXPathTraversalFunction)
-                    (xmlXPathParserContext *ctxt, xmlNode *cur);
-
-/*
- * A traversal function enumerates nodes along an axis.
- * Initially it must be called with NULL, and it indicates
- * termination on the axis by returning NULL.
- * The context node of the traversal is specified via `contextNode`.
- */
-typedef xmlNode *(*xmlXPathTraversalFunctionExt)
-                    (xmlNode *cur, xmlNode *contextNode);
-
-/*
- * Used for merging node sets in #xmlXPathCollectAndTest.
- */
-typedef xmlNodeSet *(*xmlXPathNodeSetMergeFunction)
-		    (xmlNodeSet *, xmlNodeSet *);
+xmlXPathIdFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlChar *tokens;
+    xmlNodeSetPtr ret;
+    xmlXPathObjectPtr obj;
 
+    CHECK_ARITY(1);
+    obj = xmlXPathValuePop(ctxt);
+    if (obj == NULL) XP_ERROR(XPATH_INVALID_OPERAND);
+    if ((obj->type == XPATH_NODESET) || (obj->type == XPATH_XSLT_TREE)) {
+	xmlNodeSetPtr ns;
+	int i;
 
-/**
- * Traversal function for the "self" direction
- * The self axis contains just the context node itself
- *
- * @param ctxt  the XPath Parser context
- * @param cur  the current node in the traversal
- * @returns the next element following that axis
- */
-xmlNode *
-xmlXPathNextSelf(xmlXPathParserContext *ctxt, xmlNode *cur) {
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
-    if (cur == NULL)
-        return(ctxt->context->node);
-    return(NULL);
-}
+	ret = xmlXPathNodeSetCreate(NULL);
+        if (ret == NULL)
+            xmlXPathPErrMemory(ctxt);
 
-/**
- * Traversal function for the "child" direction
- * The child axis contains the children of the context node in document order.
- *
- * @param ctxt  the XPath Parser context
- * @param cur  the current node in the traversal
- * @returns the next element following that axis
- */
-xmlNode *
-xmlXPathNextChild(xmlXPathParserContext *ctxt, xmlNode *cur) {
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
-    if (cur == NULL) {
-	if (ctxt->context->node == NULL) return(NULL);
-	switch (ctxt->context->node->type) {
-            case XML_ELEMENT_NODE:
-            case XML_TEXT_NODE:
-            case XML_CDATA_SECTION_NODE:
-            case XML_ENTITY_REF_NODE:
-            case XML_ENTITY_NODE:
-            case XML_PI_NODE:
-            case XML_COMMENT_NODE:
-            case XML_NOTATION_NODE:
-            case XML_DTD_NODE:
-		return(ctxt->context->node->children);
-            case XML_DOCUMENT_NODE:
-            case XML_DOCUMENT_TYPE_NODE:
-            case XML_DOCUMENT_FRAG_NODE:
-            case XML_HTML_DOCUMENT_NODE:
-		return(((xmlDocPtr) ctxt->context->node)->children);
-	    case XML_ELEMENT_DECL:
-	    case XML_ATTRIBUTE_DECL:
-	    case XML_ENTITY_DECL:
-            case XML_ATTRIBUTE_NODE:
-	    case XML_NAMESPACE_DECL:
-	    case XML_XINCLUDE_START:
-	    case XML_XINCLUDE_END:
-		return(NULL);
+	if (obj->nodesetval != NULL) {
+	    for (i = 0; i < obj->nodesetval->nodeNr; i++) {
+		tokens =
+		    xmlXPathCastNodeToString(obj->nodesetval->nodeTab[i]);
+                if (tokens == NULL)
+                    xmlXPathPErrMemory(ctxt);
+		ns = xmlXPathGetElementsByIds(ctxt->context->doc, tokens);
+                if (ns == NULL)
+                    xmlXPathPErrMemory(ctxt);
+		ret = xmlXPathNodeSetMerge(ret, ns);
+                if (ret == NULL)
+                    xmlXPathPErrMemory(ctxt);
+		xmlXPathFreeNodeSet(ns);
+		if (tokens != NULL)
+		    xmlFree(tokens);
+	    }
 	}
-	return(NULL);
+	xmlXPathReleaseObject(ctxt->context, obj);
+	xmlXPathValuePush(ctxt, xmlXPathCacheWrapNodeSet(ctxt, ret));
+	return;
     }
-    if ((cur->type == XML_DOCUMENT_NODE) ||
-        (cur->type == XML_HTML_DOCUMENT_NODE))
-	return(NULL);
-    return(cur->next);
+    tokens = xmlXPathCastToString(obj);
+    if (tokens == NULL)
+        xmlXPathPErrMemory(ctxt);
+    xmlXPathReleaseObject(ctxt->context, obj);
+    ret = xmlXPathGetElementsByIds(ctxt->context->doc, tokens);
+    if (ret == NULL)
+        xmlXPathPErrMemory(ctxt);
+    xmlFree(tokens);
+    xmlXPathValuePush(ctxt, xmlXPathCacheWrapNodeSet(ctxt, ret));
 }
 
 /**
- * Traversal function for the "child" direction and nodes of type element.
- * The child axis contains the children of the context node in document order.
+ * Implement the local-name() XPath function
+ *    string local-name(node-set?)
+ * The local-name function returns a string containing the local part
+ * of the name of the node in the argument node-set that is first in
+ * document order. If the node-set is empty or the first node has no
+ * name, an empty string is returned. If the argument is omitted it
+ * defaults to the context node.
  *
  * @param ctxt  the XPath Parser context
- * @param cur  the current node in the traversal
- * @returns the next element following that axis
+ * @param nargs  the number of arguments
  */
-static xmlNodePtr
-xmlXPathNextChildElement(xmlXPathParserContextPtr ctxt, xmlNodePtr cur) {
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
-    if (cur == NULL) {
-	cur = ctxt->context->node;
-	if (cur == NULL) return(NULL);
-	/*
-	* Get the first element child.
-	*/
-	switch (cur->type) {
-            case XML_ELEMENT_NODE:
-	    case XML_DOCUMENT_FRAG_NODE:
-	    case XML_ENTITY_REF_NODE: /* URGENT TODO: entify-refs as well? */
-            case XML_ENTITY_NODE:
-		cur = cur->children;
-		if (cur != NULL) {
-		    if (cur->type == XML_ELEMENT_NODE)
-			return(cur);
-		    do {
-			cur = cur->next;
-		    } while ((cur != NULL) &&
-			(cur->type != XML_ELEMENT_NODE));
-		    return(cur);
-		}
-		return(NULL);
-            case XML_DOCUMENT_NODE:
-            case XML_HTML_DOCUMENT_NODE:
-		return(xmlDocGetRootElement((xmlDocPtr) cur));
-	    default:
-		return(NULL);
-	}
-	return(NULL);
+void
+xmlXPathLocalNameFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlXPathObjectPtr cur;
+
+    if (ctxt == NULL) return;
+
+    if (nargs == 0) {
+	xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt, ctxt->context->node));
+	nargs = 1;
     }
-    /*
-    * Get the next sibling element node.
-    */
-    switch (cur->type) {
+
+    CHECK_ARITY(1);
+    if ((ctxt->value == NULL) ||
+	((ctxt->value->type != XPATH_NODESET) &&
+	 (ctxt->value->type != XPATH_XSLT_TREE)))
+	XP_ERROR(XPATH_INVALID_TYPE);
+    cur = xmlXPathValuePop(ctxt);
+
+    if ((cur->nodesetval == NULL) || (cur->nodesetval->nodeNr == 0)) {
+	xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
+    } else {
+	int i = 0; /* Should be first in document order !!!!! */
+	switch (cur->nodesetval->nodeTab[i]->type) {
 	case XML_ELEMENT_NODE:
-	case XML_TEXT_NODE:
-	case XML_ENTITY_REF_NODE:
-	case XML_ENTITY_NODE:
-	case XML_CDATA_SECTION_NODE:
+	case XML_ATTRIBUTE_NODE:
 	case XML_PI_NODE:
-	case XML_COMMENT_NODE:
-	case XML_XINCLUDE_END:
-	    break;
-	/* case XML_DTD_NODE: */ /* URGENT TODO: DTD-node as well? */
-	default:
-	    return(NULL);
-    }
-    if (cur->next != NULL) {
-	if (cur->next->type == XML_ELEMENT_NODE)
-	    return(cur->next);
-	cur = cur->next;
-	do {
-	    cur = cur->next;
-	} while ((cur != NULL) && (cur->type != XML_ELEMENT_NODE));
-	return(cur);
+	    if (cur->nodesetval->nodeTab[i]->name[0] == ' ')
+		xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
+	    else
+		xmlXPathValuePush(ctxt, xmlXPathCacheNewString(ctxt,
+			cur->nodesetval->nodeTab[i]->name));
+	    break;
+	case XML_NAMESPACE_DECL:
+	    xmlXPathValuePush(ctxt, xmlXPathCacheNewString(ctxt,
+			((xmlNsPtr)cur->nodesetval->nodeTab[i])->prefix));
+	    break;
+	default:
+	    xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
+	}
     }
-    return(NULL);
+    xmlXPathReleaseObject(ctxt->context, cur);
 }
 
 /**
- * Traversal function for the "descendant" direction
- * the descendant axis contains the descendants of the context node in document
- * order; a descendant is a child or a child of a child and so on.
+ * Implement the namespace-uri() XPath function
+ *    string namespace-uri(node-set?)
+ * The namespace-uri function returns a string containing the
+ * namespace URI of the expanded name of the node in the argument
+ * node-set that is first in document order. If the node-set is empty,
+ * the first node has no name, or the expanded name has no namespace
+ * URI, an empty string is returned. If the argument is omitted it
+ * defaults to the context node.
  *
  * @param ctxt  the XPath Parser context
- * @param cur  the current node in the traversal
- * @returns the next element following that axis
+ * @param nargs  the number of arguments
  */
-xmlNode *
-xmlXPathNextDescendant(xmlXPathParserContext *ctxt, xmlNode *cur) {
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
-    if (cur == NULL) {
-	if (ctxt->context->node == NULL)
-	    return(NULL);
-	if ((ctxt->context->node->type == XML_ATTRIBUTE_NODE) ||
-	    (ctxt->context->node->type == XML_NAMESPACE_DECL))
-	    return(NULL);
-
-        if (ctxt->context->node == (xmlNodePtr) ctxt->context->doc)
-	    return(ctxt->context->doc->children);
-        return(ctxt->context->node->children);
-    }
-
-    if (cur->type == XML_NAMESPACE_DECL)
-        return(NULL);
-    if (cur->children != NULL) {
-	/*
-	 * Do not descend on entities declarations
-	 */
-	if (cur->children->type != XML_ENTITY_DECL) {
-	    cur = cur->children;
-	    /*
-	     * Skip DTDs
-	     */
-	    if (cur->type != XML_DTD_NODE)
-		return(cur);
-	}
-    }
+void
+xmlXPathNamespaceURIFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlXPathObjectPtr cur;
 
-    if (cur == ctxt->context->node) return(NULL);
+    if (ctxt == NULL) return;
 
-    while (cur->next != NULL) {
-	cur = cur->next;
-	if ((cur->type != XML_ENTITY_DECL) &&
-	    (cur->type != XML_DTD_NODE))
-	    return(cur);
+    if (nargs == 0) {
+	xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt, ctxt->context->node));
+	nargs = 1;
     }
+    CHECK_ARITY(1);
+    if ((ctxt->value == NULL) ||
+	((ctxt->value->type != XPATH_NODESET) &&
+	 (ctxt->value->type != XPATH_XSLT_TREE)))
+	XP_ERROR(XPATH_INVALID_TYPE);
+    cur = xmlXPathValuePop(ctxt);
 
-    do {
-        cur = cur->parent;
-	if (cur == NULL) break;
-	if (cur == ctxt->context->node) return(NULL);
-	if (cur->next != NULL) {
-	    cur = cur->next;
-	    return(cur);
+    if ((cur->nodesetval == NULL) || (cur->nodesetval->nodeNr == 0)) {
+	xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
+    } else {
+	int i = 0; /* Should be first in document order !!!!! */
+	switch (cur->nodesetval->nodeTab[i]->type) {
+	case XML_ELEMENT_NODE:
+	case XML_ATTRIBUTE_NODE:
+	    if (cur->nodesetval->nodeTab[i]->ns == NULL)
+		xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
+	    else
+		xmlXPathValuePush(ctxt, xmlXPathCacheNewString(ctxt,
+			  cur->nodesetval->nodeTab[i]->ns->href));
+	    break;
+	default:
+	    xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
 	}
-    } while (cur != NULL);
-    return(cur);
+    }
+    xmlXPathReleaseObject(ctxt->context, cur);
 }
 
 /**
- * Traversal function for the "descendant-or-self" direction
- * the descendant-or-self axis contains the context node and the descendants
- * of the context node in document order; thus the context node is the first
- * node on the axis, and the first child of the context node is the second node
- * on the axis
+ * Implement the name() XPath function
+ *    string name(node-set?)
+ * The name function returns a string containing a QName representing
+ * the name of the node in the argument node-set that is first in document
+ * order. The QName must represent the name with respect to the namespace
+ * declarations in effect on the node whose name is being represented.
+ * Typically, this will be the form in which the name occurred in the XML
+ * source. This need not be the case if there are namespace declarations
+ * in effect on the node that associate multiple prefixes with the same
+ * namespace. However, an implementation may include information about
+ * the original prefix in its representation of nodes; in this case, an
+ * implementation can ensure that the returned string is always the same
+ * as the QName used in the XML source. If the argument it omitted it
+ * defaults to the context node.
+ * Libxml keep the original prefix so the "real qualified name" used is
+ * returned.
  *
  * @param ctxt  the XPath Parser context
- * @param cur  the current node in the traversal
- * @returns the next element following that axis
+ * @param nargs  the number of arguments
  */
-xmlNode *
-xmlXPathNextDescendantOrSelf(xmlXPathParserContext *ctxt, xmlNode *cur) {
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
-    if (cur == NULL)
-        return(ctxt->context->node);
+static void
+xmlXPathNameFunction(xmlXPathParserContextPtr ctxt, int nargs)
+{
+    xmlXPathObjectPtr cur;
 
-    if (ctxt->context->node == NULL)
-        return(NULL);
-    if ((ctxt->context->node->type == XML_ATTRIBUTE_NODE) ||
-        (ctxt->context->node->type == XML_NAMESPACE_DECL))
-        return(NULL);
+    if (nargs == 0) {
+	xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt, ctxt->context->node));
+        nargs = 1;
+    }
 
-    return(xmlXPathNextDescendant(ctxt, cur));
+    CHECK_ARITY(1);
+    if ((ctxt->value == NULL) ||
+        ((ctxt->value->type != XPATH_NODESET) &&
+         (ctxt->value->type != XPATH_XSLT_TREE)))
+        XP_ERROR(XPATH_INVALID_TYPE);
+    cur = xmlXPathValuePop(ctxt);
+
+    if ((cur->nodesetval == NULL) || (cur->nodesetval->nodeNr == 0)) {
+        xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
+    } else {
+        int i = 0;              /* Should be first in document order !!!!! */
+
+        switch (cur->nodesetval->nodeTab[i]->type) {
+            case XML_ELEMENT_NODE:
+            case XML_ATTRIBUTE_NODE:
+		if (cur->nodesetval->nodeTab[i]->name[0] == ' ')
+		    xmlXPathValuePush(ctxt,
+			xmlXPathCacheNewCString(ctxt, ""));
+		else if ((cur->nodesetval->nodeTab[i]->ns == NULL) ||
+                         (cur->nodesetval->nodeTab[i]->ns->prefix == NULL)) {
+		    xmlXPathValuePush(ctxt, xmlXPathCacheNewString(ctxt,
+			    cur->nodesetval->nodeTab[i]->name));
+		} else {
+		    xmlChar *fullname;
+
+		    fullname = xmlBuildQName(cur->nodesetval->nodeTab[i]->name,
+				     cur->nodesetval->nodeTab[i]->ns->prefix,
+				     NULL, 0);
+		    if (fullname == cur->nodesetval->nodeTab[i]->name)
+			fullname = xmlStrdup(cur->nodesetval->nodeTab[i]->name);
+		    if (fullname == NULL)
+                        xmlXPathPErrMemory(ctxt);
+		    xmlXPathValuePush(ctxt, xmlXPathCacheWrapString(ctxt, fullname));
+                }
+                break;
+            default:
+		xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt,
+		    cur->nodesetval->nodeTab[i]));
+                xmlXPathLocalNameFunction(ctxt, 1);
+        }
+    }
+    xmlXPathReleaseObject(ctxt->context, cur);
 }
 
+
 /**
- * Traversal function for the "parent" direction
- * The parent axis contains the parent of the context node, if there is one.
+ * Implement the string() XPath function
+ *    string string(object?)
+ * The string function converts an object to a string as follows:
+ *    - A node-set is converted to a string by returning the value of
+ *      the node in the node-set that is first in document order.
+ *      If the node-set is empty, an empty string is returned.
+ *    - A number is converted to a string as follows
+ *      + NaN is converted to the string NaN
+ *      + positive zero is converted to the string 0
+ *      + negative zero is converted to the string 0
+ *      + positive infinity is converted to the string Infinity
+ *      + negative infinity is converted to the string -Infinity
+ *      + if the number is an integer, the number is represented in
+ *        decimal form as a Number with no decimal point and no leading
+ *        zeros, preceded by a minus sign (-) if the number is negative
+ *      + otherwise, the number is represented in decimal form as a
+ *        Number including a decimal point with at least one digit
+ *        before the decimal point and at least one digit after the
+ *        decimal point, preceded by a minus sign (-) if the number
+ *        is negative; there must be no leading zeros before the decimal
+ *        point apart possibly from the one required digit immediately
+ *        before the decimal point; beyond the one required digit
+ *        after the decimal point there must be as many, but only as
+ *        many, more digits as are needed to uniquely distinguish the
+ *        number from all other IEEE 754 numeric values.
+ *    - The boolean false value is converted to the string false.
+ *      The boolean true value is converted to the string true.
+ *
+ * If the argument is omitted, it defaults to a node-set with the
+ * context node as its only member.
  *
  * @param ctxt  the XPath Parser context
- * @param cur  the current node in the traversal
- * @returns the next element following that axis
+ * @param nargs  the number of arguments
  */
-xmlNode *
-xmlXPathNextParent(xmlXPathParserContext *ctxt, xmlNode *cur) {
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
-    /*
-     * the parent of an attribute or namespace node is the element
-     * to which the attribute or namespace node is attached
-     * Namespace handling !!!
-     */
-    if (cur == NULL) {
-	if (ctxt->context->node == NULL) return(NULL);
-	switch (ctxt->context->node->type) {
-            case XML_ELEMENT_NODE:
-            case XML_TEXT_NODE:
-            case XML_CDATA_SECTION_NODE:
-            case XML_ENTITY_REF_NODE:
-            case XML_ENTITY_NODE:
-            case XML_PI_NODE:
-            case XML_COMMENT_NODE:
-            case XML_NOTATION_NODE:
-            case XML_DTD_NODE:
-	    case XML_ELEMENT_DECL:
-	    case XML_ATTRIBUTE_DECL:
-	    case XML_XINCLUDE_START:
-	    case XML_XINCLUDE_END:
-	    case XML_ENTITY_DECL:
-		if (ctxt->context->node->parent == NULL)
-		    return((xmlNodePtr) ctxt->context->doc);
-		if ((ctxt->context->node->parent->type == XML_ELEMENT_NODE) &&
-		    ((ctxt->context->node->parent->name[0] == ' ') ||
-		     (xmlStrEqual(ctxt->context->node->parent->name,
-				 BAD_CAST "fake node libxslt"))))
-		    return(NULL);
-		return(ctxt->context->node->parent);
-            case XML_ATTRIBUTE_NODE: {
-		xmlAttrPtr att = (xmlAttrPtr) ctxt->context->node;
+void
+xmlXPathStringFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlXPathObjectPtr cur;
+    xmlChar *stringval;
 
-		return(att->parent);
-	    }
-            case XML_DOCUMENT_NODE:
-            case XML_DOCUMENT_TYPE_NODE:
-            case XML_DOCUMENT_FRAG_NODE:
-            case XML_HTML_DOCUMENT_NODE:
-                return(NULL);
-	    case XML_NAMESPACE_DECL: {
-		xmlNsPtr ns = (xmlNsPtr) ctxt->context->node;
+    if (ctxt == NULL) return;
+    if (nargs == 0) {
+        stringval = xmlXPathCastNodeToString(ctxt->context->node);
+        if (stringval == NULL)
+            xmlXPathPErrMemory(ctxt);
+        xmlXPathValuePush(ctxt, xmlXPathCacheWrapString(ctxt, stringval));
+	return;
+    }
 
-		if ((ns->next != NULL) &&
-		    (ns->next->type != XML_NAMESPACE_DECL))
-		    return((xmlNodePtr) ns->next);
-                return(NULL);
-	    }
-	}
+    CHECK_ARITY(1);
+    cur = xmlXPathValuePop(ctxt);
+    if (cur == NULL) XP_ERROR(XPATH_INVALID_OPERAND);
+    if (cur->type != XPATH_STRING) {
+        stringval = xmlXPathCastToString(cur);
+        if (stringval == NULL)
+            xmlXPathPErrMemory(ctxt);
+        xmlXPathReleaseObject(ctxt->context, cur);
+        cur = xmlXPathCacheWrapString(ctxt, stringval);
     }
-    return(NULL);
+    xmlXPathValuePush(ctxt, cur);
 }
 
 /**
- * Traversal function for the "ancestor" direction
- * the ancestor axis contains the ancestors of the context node; the ancestors
- * of the context node consist of the parent of context node and the parent's
- * parent and so on; the nodes are ordered in reverse document order; thus the
- * parent is the first node on the axis, and the parent's parent is the second
- * node on the axis
+ * Implement the string-length() XPath function
+ *    number string-length(string?)
+ * The string-length returns the number of characters in the string
+ * (see [3.6 Strings]). If the argument is omitted, it defaults to
+ * the context node converted to a string, in other words the value
+ * of the context node.
  *
  * @param ctxt  the XPath Parser context
- * @param cur  the current node in the traversal
- * @returns the next element following that axis
+ * @param nargs  the number of arguments
  */
-xmlNode *
-xmlXPathNextAncestor(xmlXPathParserContext *ctxt, xmlNode *cur) {
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
-    /*
-     * the parent of an attribute or namespace node is the element
-     * to which the attribute or namespace node is attached
-     * !!!!!!!!!!!!!
-     */
-    if (cur == NULL) {
-	if (ctxt->context->node == NULL) return(NULL);
-	switch (ctxt->context->node->type) {
-            case XML_ELEMENT_NODE:
-            case XML_TEXT_NODE:
-            case XML_CDATA_SECTION_NODE:
-            case XML_ENTITY_REF_NODE:
-            case XML_ENTITY_NODE:
-            case XML_PI_NODE:
-            case XML_COMMENT_NODE:
-	    case XML_DTD_NODE:
-	    case XML_ELEMENT_DECL:
-	    case XML_ATTRIBUTE_DECL:
-	    case XML_ENTITY_DECL:
-            case XML_NOTATION_NODE:
-	    case XML_XINCLUDE_START:
-	    case XML_XINCLUDE_END:
-		if (ctxt->context->node->parent == NULL)
-		    return((xmlNodePtr) ctxt->context->doc);
-		if ((ctxt->context->node->parent->type == XML_ELEMENT_NODE) &&
-		    ((ctxt->context->node->parent->name[0] == ' ') ||
-		     (xmlStrEqual(ctxt->context->node->parent->name,
-				 BAD_CAST "fake node libxslt"))))
-		    return(NULL);
-		return(ctxt->context->node->parent);
-            case XML_ATTRIBUTE_NODE: {
-		xmlAttrPtr tmp = (xmlAttrPtr) ctxt->context->node;
-
-		return(tmp->parent);
-	    }
-            case XML_DOCUMENT_NODE:
-            case XML_DOCUMENT_TYPE_NODE:
-            case XML_DOCUMENT_FRAG_NODE:
-            case XML_HTML_DOCUMENT_NODE:
-                return(NULL);
-	    case XML_NAMESPACE_DECL: {
-		xmlNsPtr ns = (xmlNsPtr) ctxt->context->node;
-
-		if ((ns->next != NULL) &&
-		    (ns->next->type != XML_NAMESPACE_DECL))
-		    return((xmlNodePtr) ns->next);
-		/* Bad, how did that namespace end up here ? */
-                return(NULL);
-	    }
-	}
-	return(NULL);
-    }
-    if (cur == ctxt->context->doc->children)
-	return((xmlNodePtr) ctxt->context->doc);
-    if (cur == (xmlNodePtr) ctxt->context->doc)
-	return(NULL);
-    switch (cur->type) {
-	case XML_ELEMENT_NODE:
-	case XML_TEXT_NODE:
-	case XML_CDATA_SECTION_NODE:
-	case XML_ENTITY_REF_NODE:
-	case XML_ENTITY_NODE:
-	case XML_PI_NODE:
-	case XML_COMMENT_NODE:
-	case XML_NOTATION_NODE:
-	case XML_DTD_NODE:
-        case XML_ELEMENT_DECL:
-        case XML_ATTRIBUTE_DECL:
-        case XML_ENTITY_DECL:
-	case XML_XINCLUDE_START:
-	case XML_XINCLUDE_END:
-	    if (cur->parent == NULL)
-		return(NULL);
-	    if ((cur->parent->type == XML_ELEMENT_NODE) &&
-		((cur->parent->name[0] == ' ') ||
-		 (xmlStrEqual(cur->parent->name,
-			      BAD_CAST "fake node libxslt"))))
-		return(NULL);
-	    return(cur->parent);
-	case XML_ATTRIBUTE_NODE: {
-	    xmlAttrPtr att = (xmlAttrPtr) cur;
+void
+xmlXPathStringLengthFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlXPathObjectPtr cur;
 
-	    return(att->parent);
-	}
-	case XML_NAMESPACE_DECL: {
-	    xmlNsPtr ns = (xmlNsPtr) cur;
+    if (nargs == 0) {
+        if ((ctxt == NULL) || (ctxt->context == NULL))
+	    return;
+	if (ctxt->context->node == NULL) {
+	    xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt, 0));
+	} else {
+	    xmlChar *content;
 
-	    if ((ns->next != NULL) &&
-	        (ns->next->type != XML_NAMESPACE_DECL))
-	        return((xmlNodePtr) ns->next);
-	    /* Bad, how did that namespace end up here ? */
-            return(NULL);
+	    content = xmlXPathCastNodeToString(ctxt->context->node);
+            if (content == NULL)
+                xmlXPathPErrMemory(ctxt);
+	    xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt,
+		xmlUTF8Strlen(content)));
+	    xmlFree(content);
 	}
-	case XML_DOCUMENT_NODE:
-	case XML_DOCUMENT_TYPE_NODE:
-	case XML_DOCUMENT_FRAG_NODE:
-	case XML_HTML_DOCUMENT_NODE:
-	    return(NULL);
+	return;
     }
-    return(NULL);
+    CHECK_ARITY(1);
+    CAST_TO_STRING;
+    CHECK_TYPE(XPATH_STRING);
+    cur = xmlXPathValuePop(ctxt);
+    xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt,
+	xmlUTF8Strlen(cur->stringval)));
+    xmlXPathReleaseObject(ctxt->context, cur);
 }
 
 /**
- * Traversal function for the "ancestor-or-self" direction
- * he ancestor-or-self axis contains the context node and ancestors of
- * the context node in reverse document order; thus the context node is
- * the first node on the axis, and the context node's parent the second;
- * parent here is defined the same as with the parent axis.
+ * Implement the concat() XPath function
+ *    string concat(string, string, string*)
+ * The concat function returns the concatenation of its arguments.
  *
  * @param ctxt  the XPath Parser context
- * @param cur  the current node in the traversal
- * @returns the next element following that axis
+ * @param nargs  the number of arguments
  */
-xmlNode *
-xmlXPathNextAncestorOrSelf(xmlXPathParserContext *ctxt, xmlNode *cur) {
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
-    if (cur == NULL)
-        return(ctxt->context->node);
-    return(xmlXPathNextAncestor(ctxt, cur));
+void
+xmlXPathConcatFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlXPathObjectPtr cur, newobj;
+    xmlChar *tmp;
+
+    if (ctxt == NULL) return;
+    if (nargs < 2) {
+	CHECK_ARITY(2);
+    }
+
+    CAST_TO_STRING;
+    cur = xmlXPathValuePop(ctxt);
+    if ((cur == NULL) || (cur->type != XPATH_STRING)) {
+	xmlXPathReleaseObject(ctxt->context, cur);
+	return;
+    }
+    nargs--;
+
+    while (nargs > 0) {
+	CAST_TO_STRING;
+	newobj = xmlXPathValuePop(ctxt);
+	if ((newobj == NULL) || (newobj->type != XPATH_STRING)) {
+	    xmlXPathReleaseObject(ctxt->context, newobj);
+	    xmlXPathReleaseObject(ctxt->context, cur);
+	    XP_ERROR(XPATH_INVALID_TYPE);
+	}
+	tmp = xmlStrcat(newobj->stringval, cur->stringval);
+        if (tmp == NULL)
+            xmlXPathPErrMemory(ctxt);
+	newobj->stringval = cur->stringval;
+	cur->stringval = tmp;
+	xmlXPathReleaseObject(ctxt->context, newobj);
+	nargs--;
+    }
+    xmlXPathValuePush(ctxt, cur);
 }
 
 /**
- * Traversal function for the "following-sibling" direction
- * The following-sibling axis contains the following siblings of the context
- * node in document order.
+ * Implement the contains() XPath function
+ *    boolean contains(string, string)
+ * The contains function returns true if the first argument string
+ * contains the second argument string, and otherwise returns false.
  *
  * @param ctxt  the XPath Parser context
- * @param cur  the current node in the traversal
- * @returns the next element following that axis
+ * @param nargs  the number of arguments
  */
-xmlNode *
-xmlXPathNextFollowingSibling(xmlXPathParserContext *ctxt, xmlNode *cur) {
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
-    if ((ctxt->context->node->type == XML_ATTRIBUTE_NODE) ||
-	(ctxt->context->node->type == XML_NAMESPACE_DECL))
-	return(NULL);
-    if (cur == (xmlNodePtr) ctxt->context->doc)
-        return(NULL);
-    if (cur == NULL)
-        return(ctxt->context->node->next);
-    return(cur->next);
+void
+xmlXPathContainsFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlXPathObjectPtr hay, needle;
+
+    CHECK_ARITY(2);
+    CAST_TO_STRING;
+    CHECK_TYPE(XPATH_STRING);
+    needle = xmlXPathValuePop(ctxt);
+    CAST_TO_STRING;
+    hay = xmlXPathValuePop(ctxt);
+
+    if ((hay == NULL) || (hay->type != XPATH_STRING)) {
+	xmlXPathReleaseObject(ctxt->context, hay);
+	xmlXPathReleaseObject(ctxt->context, needle);
+	XP_ERROR(XPATH_INVALID_TYPE);
+    }
+    if (xmlStrstr(hay->stringval, needle->stringval))
+	xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, 1));
+    else
+	xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, 0));
+    xmlXPathReleaseObject(ctxt->context, hay);
+    xmlXPathReleaseObject(ctxt->context, needle);
 }
 
 /**
- * Traversal function for the "preceding-sibling" direction
- * The preceding-sibling axis contains the preceding siblings of the context
- * node in reverse document order; the first preceding sibling is first on the
- * axis; the sibling preceding that node is the second on the axis and so on.
+ * Implement the starts-with() XPath function
+ *    boolean starts-with(string, string)
+ * The starts-with function returns true if the first argument string
+ * starts with the second argument string, and otherwise returns false.
  *
  * @param ctxt  the XPath Parser context
- * @param cur  the current node in the traversal
- * @returns the next element following that axis
+ * @param nargs  the number of arguments
  */
-xmlNode *
-xmlXPathNextPrecedingSibling(xmlXPathParserContext *ctxt, xmlNode *cur) {
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
-    if ((ctxt->context->node->type == XML_ATTRIBUTE_NODE) ||
-	(ctxt->context->node->type == XML_NAMESPACE_DECL))
-	return(NULL);
-    if (cur == (xmlNodePtr) ctxt->context->doc)
-        return(NULL);
-    if (cur == NULL)
-        return(ctxt->context->node->prev);
-    if ((cur->prev != NULL) && (cur->prev->type == XML_DTD_NODE)) {
-	cur = cur->prev;
-	if (cur == NULL)
-	    return(ctxt->context->node->prev);
+void
+xmlXPathStartsWithFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlXPathObjectPtr hay, needle;
+    int n;
+
+    CHECK_ARITY(2);
+    CAST_TO_STRING;
+    CHECK_TYPE(XPATH_STRING);
+    needle = xmlXPathValuePop(ctxt);
+    CAST_TO_STRING;
+    hay = xmlXPathValuePop(ctxt);
+
+    if ((hay == NULL) || (hay->type != XPATH_STRING)) {
+	xmlXPathReleaseObject(ctxt->context, hay);
+	xmlXPathReleaseObject(ctxt->context, needle);
+	XP_ERROR(XPATH_INVALID_TYPE);
     }
-    return(cur->prev);
+    n = xmlStrlen(needle->stringval);
+    if (xmlStrncmp(hay->stringval, needle->stringval, n))
+        xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, 0));
+    else
+        xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, 1));
+    xmlXPathReleaseObject(ctxt->context, hay);
+    xmlXPathReleaseObject(ctxt->context, needle);
 }
 
 /**
- * Traversal function for the "following" direction
- * The following axis contains all nodes in the same document as the context
- * node that are after the context node in document order, excluding any
- * descendants and excluding attribute nodes and namespace nodes; the nodes
- * are ordered in document order
+ * Implement the substring() XPath function
+ *    string substring(string, number, number?)
+ * The substring function returns the substring of the first argument
+ * starting at the position specified in the second argument with
+ * length specified in the third argument. For example,
+ * substring("12345",2,3) returns "234". If the third argument is not
+ * specified, it returns the substring starting at the position specified
+ * in the second argument and continuing to the end of the string. For
+ * example, substring("12345",2) returns "2345".  More precisely, each
+ * character in the string (see [3.6 Strings]) is considered to have a
+ * numeric position: the position of the first character is 1, the position
+ * of the second character is 2 and so on. The returned substring contains
+ * those characters for which the position of the character is greater than
+ * or equal to the second argument and, if the third argument is specified,
+ * less than the sum of the second and third arguments; the comparisons
+ * and addition used for the above follow the standard IEEE 754 rules. Thus:
+ *  - substring("12345", 1.5, 2.6) returns "234"
+ *  - substring("12345", 0, 3) returns "12"
+ *  - substring("12345", 0 div 0, 3) returns ""
+ *  - substring("12345", 1, 0 div 0) returns ""
+ *  - substring("12345", -42, 1 div 0) returns "12345"
+ *  - substring("12345", -1 div 0, 1 div 0) returns ""
  *
  * @param ctxt  the XPath Parser context
- * @param cur  the current node in the traversal
- * @returns the next element following that axis
+ * @param nargs  the number of arguments
  */
-xmlNode *
-xmlXPathNextFollowing(xmlXPathParserContext *ctxt, xmlNode *cur) {
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
-    if ((cur != NULL) && (cur->type  != XML_ATTRIBUTE_NODE) &&
-        (cur->type != XML_NAMESPACE_DECL) && (cur->children != NULL))
-        return(cur->children);
+void
+xmlXPathSubstringFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlXPathObjectPtr str, start, len;
+    double le=0, in;
+    int i = 1, j = INT_MAX;
 
-    if (cur == NULL) {
-        cur = ctxt->context->node;
-        if (cur->type == XML_ATTRIBUTE_NODE) {
-            cur = cur->parent;
-        } else if (cur->type == XML_NAMESPACE_DECL) {
-            xmlNsPtr ns = (xmlNsPtr) cur;
+    if (nargs < 2) {
+	CHECK_ARITY(2);
+    }
+    if (nargs > 3) {
+	CHECK_ARITY(3);
+    }
+    /*
+     * take care of possible last (position) argument
+    */
+    if (nargs == 3) {
+	CAST_TO_NUMBER;
+	CHECK_TYPE(XPATH_NUMBER);
+	len = xmlXPathValuePop(ctxt);
+	le = len->floatval;
+	xmlXPathReleaseObject(ctxt->context, len);
+    }
 
-            if ((ns->next == NULL) ||
-                (ns->next->type == XML_NAMESPACE_DECL))
-                return (NULL);
-            cur = (xmlNodePtr) ns->next;
+    CAST_TO_NUMBER;
+    CHECK_TYPE(XPATH_NUMBER);
+    start = xmlXPathValuePop(ctxt);
+    in = start->floatval;
+    xmlXPathReleaseObject(ctxt->context, start);
+    CAST_TO_STRING;
+    CHECK_TYPE(XPATH_STRING);
+    str = xmlXPathValuePop(ctxt);
+
+    if (!(in < INT_MAX)) { /* Logical NOT to handle NaNs */
+        i = INT_MAX;
+    } else if (in >= 1.0) {
+        i = (int)in;
+        if (in - floor(in) >= 0.5)
+            i += 1;
+    }
+
+    if (nargs == 3) {
+        double rin, rle, end;
+
+        rin = floor(in);
+        if (in - rin >= 0.5)
+            rin += 1.0;
+
+        rle = floor(le);
+        if (le - rle >= 0.5)
+            rle += 1.0;
+
+        end = rin + rle;
+        if (!(end >= 1.0)) { /* Logical NOT to handle NaNs */
+            j = 1;
+        } else if (end < INT_MAX) {
+            j = (int)end;
         }
     }
-    if (cur == NULL) return(NULL) ; /* ERROR */
-    if (cur->next != NULL) return(cur->next) ;
-    do {
-        cur = cur->parent;
-        if (cur == NULL) break;
-        if (cur == (xmlNodePtr) ctxt->context->doc) return(NULL);
-        if (cur->next != NULL) return(cur->next);
-    } while (cur != NULL);
-    return(cur);
+
+    i -= 1;
+    j -= 1;
+
+    if ((i < j) && (i < xmlUTF8Strlen(str->stringval))) {
+        xmlChar *ret = xmlUTF8Strsub(str->stringval, i, j - i);
+        if (ret == NULL)
+            xmlXPathPErrMemory(ctxt);
+	xmlXPathValuePush(ctxt, xmlXPathCacheNewString(ctxt, ret));
+	xmlFree(ret);
+    } else {
+	xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
+    }
+
+    xmlXPathReleaseObject(ctxt->context, str);
 }
 
-/*
- * @param ancestor  the ancestor node
- * @param node  the current node
- *
- * Check that `ancestor` is a `node`'s ancestor
+/**
+ * Implement the substring-before() XPath function
+ *    string substring-before(string, string)
+ * The substring-before function returns the substring of the first
+ * argument string that precedes the first occurrence of the second
+ * argument string in the first argument string, or the empty string
+ * if the first argument string does not contain the second argument
+ * string. For example, substring-before("1999/04/01","/") returns 1999.
  *
- * @returns 1 if `ancestor` is a `node`'s ancestor, 0 otherwise.
+ * @param ctxt  the XPath Parser context
+ * @param nargs  the number of arguments
  */
-static int
-xmlXPathIsAncestor(xmlNodePtr ancestor, xmlNodePtr node) {
-    if ((ancestor == NULL) || (node == NULL)) return(0);
-    if (node->type == XML_NAMESPACE_DECL)
-        return(0);
-    if (ancestor->type == XML_NAMESPACE_DECL)
-        return(0);
-    /* nodes need to be in the same document */
-    if (ancestor->doc != node->doc) return(0);
-    /* avoid searching if ancestor or node is the root node */
-    if (ancestor == (xmlNodePtr) node->doc) return(1);
-    if (node == (xmlNodePtr) ancestor->doc) return(0);
-    while (node->parent != NULL) {
-        if (node->parent == ancestor)
-            return(1);
-	node = node->parent;
+void
+xmlXPathSubstringBeforeFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlXPathObjectPtr str = NULL;
+    xmlXPathObjectPtr find = NULL;
+    const xmlChar *point;
+    xmlChar *result;
+
+    CHECK_ARITY(2);
+    CAST_TO_STRING;
+    find = xmlXPathValuePop(ctxt);
+    CAST_TO_STRING;
+    str = xmlXPathValuePop(ctxt);
+    if (ctxt->error != 0)
+        goto error;
+
+    point = xmlStrstr(str->stringval, find->stringval);
+    if (point == NULL) {
+        result = xmlStrdup(BAD_CAST "");
+    } else {
+        result = xmlStrndup(str->stringval, point - str->stringval);
     }
-    return(0);
+    if (result == NULL) {
+        xmlXPathPErrMemory(ctxt);
+        goto error;
+    }
+    xmlXPathValuePush(ctxt, xmlXPathCacheWrapString(ctxt, result));
+
+error:
+    xmlXPathReleaseObject(ctxt->context, str);
+    xmlXPathReleaseObject(ctxt->context, find);
 }
 
 /**
- * Traversal function for the "preceding" direction
- * the preceding axis contains all nodes in the same document as the context
- * node that are before the context node in document order, excluding any
- * ancestors and excluding attribute nodes and namespace nodes; the nodes are
- * ordered in reverse document order
+ * Implement the substring-after() XPath function
+ *    string substring-after(string, string)
+ * The substring-after function returns the substring of the first
+ * argument string that follows the first occurrence of the second
+ * argument string in the first argument string, or the empty string
+ * if the first argument string does not contain the second argument
+ * string. For example, substring-after("1999/04/01","/") returns 04/01,
+ * and substring-after("1999/04/01","19") returns 99/04/01.
  *
  * @param ctxt  the XPath Parser context
- * @param cur  the current node in the traversal
- * @returns the next element following that axis
+ * @param nargs  the number of arguments
  */
-xmlNode *
-xmlXPathNextPreceding(xmlXPathParserContext *ctxt, xmlNode *cur)
-{
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
-    if (cur == NULL) {
-        cur = ctxt->context->node;
-        if (cur->type == XML_ATTRIBUTE_NODE) {
-            cur = cur->parent;
-        } else if (cur->type == XML_NAMESPACE_DECL) {
-            xmlNsPtr ns = (xmlNsPtr) cur;
+void
+xmlXPathSubstringAfterFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlXPathObjectPtr str = NULL;
+    xmlXPathObjectPtr find = NULL;
+    const xmlChar *point;
+    xmlChar *result;
 
-            if ((ns->next == NULL) ||
-                (ns->next->type == XML_NAMESPACE_DECL))
-                return (NULL);
-            cur = (xmlNodePtr) ns->next;
-        }
+    CHECK_ARITY(2);
+    CAST_TO_STRING;
+    find = xmlXPathValuePop(ctxt);
+    CAST_TO_STRING;
+    str = xmlXPathValuePop(ctxt);
+    if (ctxt->error != 0)
+        goto error;
+
+    point = xmlStrstr(str->stringval, find->stringval);
+    if (point == NULL) {
+        result = xmlStrdup(BAD_CAST "");
+    } else {
+        result = xmlStrdup(point + xmlStrlen(find->stringval));
     }
-    if ((cur == NULL) || (cur->type == XML_NAMESPACE_DECL))
-	return (NULL);
-    if ((cur->prev != NULL) && (cur->prev->type == XML_DTD_NODE))
-	cur = cur->prev;
-    do {
-        if (cur->prev != NULL) {
-            for (cur = cur->prev; cur->last != NULL; cur = cur->last) ;
-            return (cur);
-        }
+    if (result == NULL) {
+        xmlXPathPErrMemory(ctxt);
+        goto error;
+    }
+    xmlXPathValuePush(ctxt, xmlXPathCacheWrapString(ctxt, result));
 
-        cur = cur->parent;
-        if (cur == NULL)
-            return (NULL);
-        if (cur == ctxt->context->doc->children)
-            return (NULL);
-    } while (xmlXPathIsAncestor(cur, ctxt->context->node));
-    return (cur);
+error:
+    xmlXPathReleaseObject(ctxt->context, str);
+    xmlXPathReleaseObject(ctxt->context, find);
 }
 
 /**
- * Traversal function for the "preceding" direction
- * the preceding axis contains all nodes in the same document as the context
- * node that are before the context node in document order, excluding any
- * ancestors and excluding attribute nodes and namespace nodes; the nodes are
- * ordered in reverse document order
- * This is a faster implementation but internal only since it requires a
- * state kept in the parser context: ctxt->ancestor.
+ * Implement the normalize-space() XPath function
+ *    string normalize-space(string?)
+ * The normalize-space function returns the argument string with white
+ * space normalized by stripping leading and trailing whitespace
+ * and replacing sequences of whitespace characters by a single
+ * space. Whitespace characters are the same allowed by the S production
+ * in XML. If the argument is omitted, it defaults to the context
+ * node converted to a string, in other words the value of the context node.
  *
  * @param ctxt  the XPath Parser context
- * @param cur  the current node in the traversal
- * @returns the next element following that axis
+ * @param nargs  the number of arguments
  */
-static xmlNodePtr
-xmlXPathNextPrecedingInternal(xmlXPathParserContextPtr ctxt,
-                              xmlNodePtr cur)
-{
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
-    if (cur == NULL) {
-        cur = ctxt->context->node;
-        if (cur == NULL)
-            return (NULL);
-        if (cur->type == XML_ATTRIBUTE_NODE) {
-            cur = cur->parent;
-        } else if (cur->type == XML_NAMESPACE_DECL) {
-            xmlNsPtr ns = (xmlNsPtr) cur;
+void
+xmlXPathNormalizeFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlChar *source, *target;
+    int blank;
 
-            if ((ns->next == NULL) ||
-                (ns->next->type == XML_NAMESPACE_DECL))
-                return (NULL);
-            cur = (xmlNodePtr) ns->next;
-        }
-        ctxt->ancestor = cur->parent;
+    if (ctxt == NULL) return;
+    if (nargs == 0) {
+        /* Use current context node */
+        source = xmlXPathCastNodeToString(ctxt->context->node);
+        if (source == NULL)
+            xmlXPathPErrMemory(ctxt);
+        xmlXPathValuePush(ctxt, xmlXPathCacheWrapString(ctxt, source));
+        nargs = 1;
     }
-    if (cur->type == XML_NAMESPACE_DECL)
-        return(NULL);
-    if ((cur->prev != NULL) && (cur->prev->type == XML_DTD_NODE))
-	cur = cur->prev;
-    while (cur->prev == NULL) {
-        cur = cur->parent;
-        if (cur == NULL)
-            return (NULL);
-        if (cur == ctxt->context->doc->children)
-            return (NULL);
-        if (cur != ctxt->ancestor)
-            return (cur);
-        ctxt->ancestor = cur->parent;
+
+    CHECK_ARITY(1);
+    CAST_TO_STRING;
+    CHECK_TYPE(XPATH_STRING);
+    source = ctxt->value->stringval;
+    if (source == NULL)
+        return;
+    target = source;
+
+    /* Skip leading whitespaces */
+    while (IS_BLANK_CH(*source))
+        source++;
+
+    /* Collapse intermediate whitespaces, and skip trailing whitespaces */
+    blank = 0;
+    while (*source) {
+        if (IS_BLANK_CH(*source)) {
+	    blank = 1;
+        } else {
+            if (blank) {
+                *target++ = 0x20;
+                blank = 0;
+            }
+            *target++ = *source;
+        }
+        source++;
     }
-    cur = cur->prev;
-    while (cur->last != NULL)
-        cur = cur->last;
-    return (cur);
+    *target = 0;
 }
 
 /**
- * Traversal function for the "namespace" direction
- * the namespace axis contains the namespace nodes of the context node;
- * the order of nodes on this axis is implementation-defined; the axis will
- * be empty unless the context node is an element
- *
- * We keep the XML namespace node at the end of the list.
+ * Implement the translate() XPath function
+ *    string translate(string, string, string)
+ * The translate function returns the first argument string with
+ * occurrences of characters in the second argument string replaced
+ * by the character at the corresponding position in the third argument
+ * string. For example, translate("bar","abc","ABC") returns the string
+ * BAr. If there is a character in the second argument string with no
+ * character at a corresponding position in the third argument string
+ * (because the second argument string is longer than the third argument
+ * string), then occurrences of that character in the first argument
+ * string are removed. For example,
+ * translate("--aaa--","abc-","ABC") returns "AAA".
+ * If a character occurs more than once in second
+ * argument string, then the first occurrence determines the replacement
+ * character. If the third argument string is longer than the second
+ * argument string, then excess characters are ignored.
  *
  * @param ctxt  the XPath Parser context
- * @param cur  the current attribute in the traversal
- * @returns the next element following that axis
+ * @param nargs  the number of arguments
  */
-xmlNode *
-xmlXPathNextNamespace(xmlXPathParserContext *ctxt, xmlNode *cur) {
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
-    if (ctxt->context->node->type != XML_ELEMENT_NODE) return(NULL);
-    if (cur == NULL) {
-        if (ctxt->context->tmpNsList != NULL)
-	    xmlFree(ctxt->context->tmpNsList);
-	ctxt->context->tmpNsNr = 0;
-        if (xmlGetNsListSafe(ctxt->context->doc, ctxt->context->node,
-                             &ctxt->context->tmpNsList) < 0) {
-            xmlXPathPErrMemory(ctxt);
-            return(NULL);
+void
+xmlXPathTranslateFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlXPathObjectPtr str = NULL;
+    xmlXPathObjectPtr from = NULL;
+    xmlXPathObjectPtr to = NULL;
+    xmlBufPtr target;
+    int offset, max;
+    int ch;
+    const xmlChar *point;
+    xmlChar *cptr, *content;
+
+    CHECK_ARITY(3);
+
+    CAST_TO_STRING;
+    to = xmlXPathValuePop(ctxt);
+    CAST_TO_STRING;
+    from = xmlXPathValuePop(ctxt);
+    CAST_TO_STRING;
+    str = xmlXPathValuePop(ctxt);
+    if (ctxt->error != 0)
+        goto error;
+
+    /*
+     * Account for quadratic runtime
+     */
+    if (ctxt->context->opLimit != 0) {
+        unsigned long f1 = xmlStrlen(from->stringval);
+        unsigned long f2 = xmlStrlen(str->stringval);
+
+        if ((f1 > 0) && (f2 > 0)) {
+            unsigned long p;
+
+            f1 = f1 / 10 + 1;
+            f2 = f2 / 10 + 1;
+            p = f1 > ULONG_MAX / f2 ? ULONG_MAX : f1 * f2;
+            if (xmlXPathCheckOpLimit(ctxt, p) < 0)
+                goto error;
         }
-        if (ctxt->context->tmpNsList != NULL) {
-            while (ctxt->context->tmpNsList[ctxt->context->tmpNsNr] != NULL) {
-                ctxt->context->tmpNsNr++;
+    }
+
+    target = xmlBufCreate(50);
+    if (target == NULL) {
+        xmlXPathPErrMemory(ctxt);
+        goto error;
+    }
+
+    max = xmlUTF8Strlen(to->stringval);
+    for (cptr = str->stringval; (ch=*cptr); ) {
+        offset = xmlUTF8Strloc(from->stringval, cptr);
+        if (offset >= 0) {
+            if (offset < max) {
+                point = xmlUTF8Strpos(to->stringval, offset);
+                if (point)
+                    xmlBufAdd(target, point, xmlUTF8Strsize(point, 1));
+            }
+        } else
+            xmlBufAdd(target, cptr, xmlUTF8Strsize(cptr, 1));
+
+        /* Step to next character in input */
+        cptr++;
+        if ( ch & 0x80 ) {
+            /* if not simple ascii, verify proper format */
+            if ( (ch & 0xc0) != 0xc0 ) {
+                xmlXPathErr(ctxt, XPATH_INVALID_CHAR_ERROR);
+                break;
             }
+            /* then skip over remaining bytes for this char */
+            while ( (ch <<= 1) & 0x80 )
+                if ( (*cptr++ & 0xc0) != 0x80 ) {
+                    xmlXPathErr(ctxt, XPATH_INVALID_CHAR_ERROR);
+                    break;
+                }
+            if (ch & 0x80) /* must have had error encountered */
+                break;
         }
-	return((xmlNodePtr) xmlXPathXMLNamespace);
-    }
-    if (ctxt->context->tmpNsNr > 0) {
-	return (xmlNodePtr)ctxt->context->tmpNsList[--ctxt->context->tmpNsNr];
-    } else {
-	if (ctxt->context->tmpNsList != NULL)
-	    xmlFree(ctxt->context->tmpNsList);
-	ctxt->context->tmpNsList = NULL;
-	return(NULL);
     }
+
+    content = xmlBufDetach(target);
+    if (content == NULL)
+        xmlXPathPErrMemory(ctxt);
+    else
+        xmlXPathValuePush(ctxt, xmlXPathCacheWrapString(ctxt, content));
+    xmlBufFree(target);
+error:
+    xmlXPathReleaseObject(ctxt->context, str);
+    xmlXPathReleaseObject(ctxt->context, from);
+    xmlXPathReleaseObject(ctxt->context, to);
 }
 
 /**
- * Traversal function for the "attribute" direction
- * TODO: support DTD inherited default attributes
+ * Implement the boolean() XPath function
+ *    boolean boolean(object)
+ * The boolean function converts its argument to a boolean as follows:
+ *    - a number is true if and only if it is neither positive or
+ *      negative zero nor NaN
+ *    - a node-set is true if and only if it is non-empty
+ *    - a string is true if and only if its length is non-zero
  *
  * @param ctxt  the XPath Parser context
- * @param cur  the current attribute in the traversal
- * @returns the next element following that axis
+ * @param nargs  the number of arguments
  */
-xmlNode *
-xmlXPathNextAttribute(xmlXPathParserContext *ctxt, xmlNode *cur) {
-    if ((ctxt == NULL) || (ctxt->context == NULL)) return(NULL);
-    if (ctxt->context->node == NULL)
-	return(NULL);
-    if (ctxt->context->node->type != XML_ELEMENT_NODE)
-	return(NULL);
-    if (cur == NULL) {
-        if (ctxt->context->node == (xmlNodePtr) ctxt->context->doc)
-	    return(NULL);
-        return((xmlNodePtr)ctxt->context->node->properties);
-    }
-    return((xmlNodePtr)cur->next);
-}
-
-/************************************************************************
- *									*
- *		NodeTest Functions					*
- *									*
- ************************************************************************/
-
-#define IS_FUNCTION			200
+void
+xmlXPathBooleanFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlXPathObjectPtr cur;
 
+    CHECK_ARITY(1);
+    cur = xmlXPathValuePop(ctxt);
+    if (cur == NULL) XP_ERROR(XPATH_INVALID_OPERAND);
+    if (cur->type != XPATH_BOOLEAN) {
+        int boolval = xmlXPathCastToBoolean(cur);
 
-/************************************************************************
- *									*
- *		Implicit tree core function library			*
- *									*
- ************************************************************************/
+        xmlXPathReleaseObject(ctxt->context, cur);
+        cur = xmlXPathCacheNewBoolean(ctxt, boolval);
+    }
+    xmlXPathValuePush(ctxt, cur);
+}
 
 /**
- * Initialize the context to the root of the document
+ * Implement the not() XPath function
+ *    boolean not(boolean)
+ * The not function returns true if its argument is false,
+ * and false otherwise.
  *
  * @param ctxt  the XPath Parser context
+ * @param nargs  the number of arguments
  */
 void
-xmlXPathRoot(xmlXPathParserContext *ctxt) {
-    if ((ctxt == NULL) || (ctxt->context == NULL))
-	return;
-    xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt,
-                                            (xmlNodePtr) ctxt->context->doc));
+xmlXPathNotFunction(xmlXPathParserContext *ctxt, int nargs) {
+    CHECK_ARITY(1);
+    CAST_TO_BOOLEAN;
+    CHECK_TYPE(XPATH_BOOLEAN);
+    ctxt->value->boolval = ! ctxt->value->boolval;
 }
 
-/************************************************************************
- *									*
- *		The explicit core function library			*
- *http://www.w3.org/Style/XSL/Group/1999/07/xpath-19990705.html#corelib	*
- *									*
- ************************************************************************/
-
-
 /**
- * Implement the last() XPath function
- *    number last()
- * The last function returns the number of nodes in the context node list.
+ * Implement the true() XPath function
+ *    boolean true()
  *
  * @param ctxt  the XPath Parser context
  * @param nargs  the number of arguments
  */
 void
-xmlXPathLastFunction(xmlXPathParserContext *ctxt, int nargs) {
+xmlXPathTrueFunction(xmlXPathParserContext *ctxt, int nargs) {
     CHECK_ARITY(0);
-    if (ctxt->context->contextSize >= 0) {
-	xmlXPathValuePush(ctxt,
-	    xmlXPathCacheNewFloat(ctxt, (double) ctxt->context->contextSize));
-    } else {
-	XP_ERROR(XPATH_INVALID_CTXT_SIZE);
-    }
+    xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, 1));
 }
 
 /**
- * Implement the position() XPath function
- *    number position()
- * The position function returns the position of the context node in the
- * context node list. The first position is 1, and so the last position
- * will be equal to last().
+ * Implement the false() XPath function
+ *    boolean false()
  *
  * @param ctxt  the XPath Parser context
  * @param nargs  the number of arguments
  */
 void
-xmlXPathPositionFunction(xmlXPathParserContext *ctxt, int nargs) {
+xmlXPathFalseFunction(xmlXPathParserContext *ctxt, int nargs) {
     CHECK_ARITY(0);
-    if (ctxt->context->proximityPosition >= 0) {
-	xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt,
-            (double) ctxt->context->proximityPosition));
-    } else {
-	XP_ERROR(XPATH_INVALID_CTXT_POSITION);
-    }
+    xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, 0));
 }
 
 /**
- * Implement the count() XPath function
- *    number count(node-set)
+ * Implement the lang() XPath function
+ *    boolean lang(string)
+ * The lang function returns true or false depending on whether the
+ * language of the context node as specified by xml:lang attributes
+ * is the same as or is a sublanguage of the language specified by
+ * the argument string. The language of the context node is determined
+ * by the value of the xml:lang attribute on the context node, or, if
+ * the context node has no xml:lang attribute, by the value of the
+ * xml:lang attribute on the nearest ancestor of the context node that
+ * has an xml:lang attribute. If there is no such attribute, then
+ * lang returns false. If there is such an attribute, then lang returns
+ * true if the attribute value is equal to the argument ignoring case,
+ * or if there is some suffix starting with - such that the attribute
+ * value is equal to the argument ignoring that suffix of the attribute
+ * value and ignoring case.
  *
  * @param ctxt  the XPath Parser context
  * @param nargs  the number of arguments
  */
 void
-xmlXPathCountFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlXPathObjectPtr cur;
+xmlXPathLangFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlXPathObjectPtr val;
+    xmlNodePtr cur;
+    xmlChar *theLang;
+    const xmlChar *lang;
+    int ret = 0;
+    int i;
 
     CHECK_ARITY(1);
-    if ((ctxt->value == NULL) ||
-	((ctxt->value->type != XPATH_NODESET) &&
-	 (ctxt->value->type != XPATH_XSLT_TREE)))
-	XP_ERROR(XPATH_INVALID_TYPE);
-    cur = xmlXPathValuePop(ctxt);
-
-    if ((cur == NULL) || (cur->nodesetval == NULL))
-	xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt, 0.0));
-    else
-	xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt,
-	    (double) cur->nodesetval->nodeNr));
-    xmlXPathReleaseObject(ctxt->context, cur);
-}
-
-/**
- * Selects elements by their unique ID.
- *
- * @param doc  the document
- * @param ids  a whitespace separated list of IDs
- * @returns a node-set of selected elements.
- */
-static xmlNodeSetPtr
-xmlXPathGetElementsByIds (xmlDocPtr doc, const xmlChar *ids) {
-    xmlNodeSetPtr ret;
-    const xmlChar *cur = ids;
-    xmlChar *ID;
-    xmlAttrPtr attr;
-    xmlNodePtr elem = NULL;
-
-    if (ids == NULL) return(NULL);
-
-    ret = xmlXPathNodeSetCreate(NULL);
-    if (ret == NULL)
-        return(ret);
-
-    while (IS_BLANK_CH(*cur)) cur++;
-    while (*cur != 0) {
-	while ((!IS_BLANK_CH(*cur)) && (*cur != 0))
-	    cur++;
-
-        ID = xmlStrndup(ids, cur - ids);
-	if (ID == NULL) {
-            xmlXPathFreeNodeSet(ret);
-            return(NULL);
-        }
-        /*
-         * We used to check the fact that the value passed
-         * was an NCName, but this generated much troubles for
-         * me and Aleksey Sanin, people blatantly violated that
-         * constraint, like Visa3D spec.
-         * if (xmlValidateNCName(ID, 1) == 0)
-         */
-        attr = xmlGetID(doc, ID);
-        xmlFree(ID);
-        if (attr != NULL) {
-            if (attr->type == XML_ATTRIBUTE_NODE)
-                elem = attr->parent;
-            else if (attr->type == XML_ELEMENT_NODE)
-                elem = (xmlNodePtr) attr;
-            else
-                elem = NULL;
-            if (elem != NULL) {
-                if (xmlXPathNodeSetAdd(ret, elem) < 0) {
-                    xmlXPathFreeNodeSet(ret);
-                    return(NULL);
-                }
-            }
-        }
-
-	while (IS_BLANK_CH(*cur)) cur++;
-	ids = cur;
+    CAST_TO_STRING;
+    CHECK_TYPE(XPATH_STRING);
+    val = xmlXPathValuePop(ctxt);
+    lang = val->stringval;
+    cur = ctxt->context->node;
+    while (cur != NULL) {
+        if (xmlNodeGetAttrValue(cur, BAD_CAST "lang", XML_XML_NAMESPACE,
+                                &theLang) < 0)
+            xmlXPathPErrMemory(ctxt);
+        if (theLang != NULL)
+            break;
+        cur = cur->parent;
+    }
+    if ((theLang != NULL) && (lang != NULL)) {
+        for (i = 0;lang[i] != 0;i++)
+            if (toupper(lang[i]) != toupper(theLang[i]))
+                goto not_equal;
+        if ((theLang[i] == 0) || (theLang[i] == '-'))
+            ret = 1;
     }
-    return(ret);
+not_equal:
+    if (theLang != NULL)
+	xmlFree((void *)theLang);
+
+    xmlXPathReleaseObject(ctxt->context, val);
+    xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, ret));
 }
 
 /**
- * Implement the id() XPath function
- *    node-set id(object)
- * The id function selects elements by their unique ID
- * (see [5.2.1 Unique IDs]). When the argument to id is of type node-set,
- * then the result is the union of the result of applying id to the
- * string value of each of the nodes in the argument node-set. When the
- * argument to id is of any other type, the argument is converted to a
- * string as if by a call to the string function; the string is split
- * into a whitespace-separated list of tokens (whitespace is any sequence
- * of characters matching the production S); the result is a node-set
- * containing the elements in the same document as the context node that
- * have a unique ID equal to any of the tokens in the list.
+ * Implement the number() XPath function
+ *    number number(object?)
  *
  * @param ctxt  the XPath Parser context
  * @param nargs  the number of arguments
  */
 void
-xmlXPathIdFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlChar *tokens;
-    xmlNodeSetPtr ret;
-    xmlXPathObjectPtr obj;
-
-    CHECK_ARITY(1);
-    obj = xmlXPathValuePop(ctxt);
-    if (obj == NULL) XP_ERROR(XPATH_INVALID_OPERAND);
-    if ((obj->type == XPATH_NODESET) || (obj->type == XPATH_XSLT_TREE)) {
-	xmlNodeSetPtr ns;
-	int i;
+xmlXPathNumberFunction(xmlXPathParserContext *ctxt, int nargs) {
+    xmlXPathObjectPtr cur;
+    double res;
 
-	ret = xmlXPathNodeSetCreate(NULL);
-        if (ret == NULL)
-            xmlXPathPErrMemory(ctxt);
+    if (ctxt == NULL) return;
+    if (nargs == 0) {
+	if (ctxt->context->node == NULL) {
+	    xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt, 0.0));
+	} else {
+	    xmlChar* content = xmlNodeGetContent(ctxt->context->node);
+            if (content == NULL)
+                xmlXPathPErrMemory(ctxt);
 
-	if (obj->nodesetval != NULL) {
-	    for (i = 0; i < obj->nodesetval->nodeNr; i++) {
-		tokens =
-		    xmlXPathCastNodeToString(obj->nodesetval->nodeTab[i]);
-                if (tokens == NULL)
-                    xmlXPathPErrMemory(ctxt);
-		ns = xmlXPathGetElementsByIds(ctxt->context->doc, tokens);
-                if (ns == NULL)
-                    xmlXPathPErrMemory(ctxt);
-		ret = xmlXPathNodeSetMerge(ret, ns);
-                if (ret == NULL)
-                    xmlXPathPErrMemory(ctxt);
-		xmlXPathFreeNodeSet(ns);
-		if (tokens != NULL)
-		    xmlFree(tokens);
-	    }
+	    res = xmlXPathStringEvalNumber(content);
+	    xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt, res));
+	    xmlFree(content);
 	}
-	xmlXPathReleaseObject(ctxt->context, obj);
-	xmlXPathValuePush(ctxt, xmlXPathCacheWrapNodeSet(ctxt, ret));
 	return;
     }
-    tokens = xmlXPathCastToString(obj);
-    if (tokens == NULL)
-        xmlXPathPErrMemory(ctxt);
-    xmlXPathReleaseObject(ctxt->context, obj);
-    ret = xmlXPathGetElementsByIds(ctxt->context->doc, tokens);
-    if (ret == NULL)
-        xmlXPathPErrMemory(ctxt);
-    xmlFree(tokens);
-    xmlXPathValuePush(ctxt, xmlXPathCacheWrapNodeSet(ctxt, ret));
+
+    CHECK_ARITY(1);
+    cur = xmlXPathValuePop(ctxt);
+    if (cur->type != XPATH_NUMBER) {
+        double floatval;
+
+        floatval = xmlXPathCastToNumberInternal(ctxt, cur);
+        xmlXPathReleaseObject(ctxt->context, cur);
+        cur = xmlXPathCacheNewFloat(ctxt, floatval);
+    }
+    xmlXPathValuePush(ctxt, cur);
 }
 
 /**
- * Implement the local-name() XPath function
- *    string local-name(node-set?)
- * The local-name function returns a string containing the local part
- * of the name of the node in the argument node-set that is first in
- * document order. If the node-set is empty or the first node has no
- * name, an empty string is returned. If the argument is omitted it
- * defaults to the context node.
+ * Implement the sum() XPath function
+ *    number sum(node-set)
+ * The sum function returns the sum of the values of the nodes in
+ * the argument node-set.
  *
  * @param ctxt  the XPath Parser context
  * @param nargs  the number of arguments
  */
 void
-xmlXPathLocalNameFunction(xmlXPathParserContext *ctxt, int nargs) {
+xmlXPathSumFunction(xmlXPathParserContext *ctxt, int nargs) {
     xmlXPathObjectPtr cur;
-
-    if (ctxt == NULL) return;
-
-    if (nargs == 0) {
-	xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt, ctxt->context->node));
-	nargs = 1;
-    }
+    int i;
+    double res = 0.0;
 
     CHECK_ARITY(1);
     if ((ctxt->value == NULL) ||
@@ -7090,4617 +9840,6639 @@ xmlXPathLocalNameFunction(xmlXPathParserContext *ctxt, int nargs) {
 	XP_ERROR(XPATH_INVALID_TYPE);
     cur = xmlXPathValuePop(ctxt);
 
-    if ((cur->nodesetval == NULL) || (cur->nodesetval->nodeNr == 0)) {
-	xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
-    } else {
-	int i = 0; /* Should be first in document order !!!!! */
-	switch (cur->nodesetval->nodeTab[i]->type) {
-	case XML_ELEMENT_NODE:
-	case XML_ATTRIBUTE_NODE:
-	case XML_PI_NODE:
-	    if (cur->nodesetval->nodeTab[i]->name[0] == ' ')
-		xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
-	    else
-		xmlXPathValuePush(ctxt, xmlXPathCacheNewString(ctxt,
-			cur->nodesetval->nodeTab[i]->name));
-	    break;
-	case XML_NAMESPACE_DECL:
-	    xmlXPathValuePush(ctxt, xmlXPathCacheNewString(ctxt,
-			((xmlNsPtr)cur->nodesetval->nodeTab[i])->prefix));
-	    break;
-	default:
-	    xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
+    if ((cur->nodesetval != NULL) && (cur->nodesetval->nodeNr != 0)) {
+	for (i = 0; i < cur->nodesetval->nodeNr; i++) {
+	    res += xmlXPathNodeToNumberInternal(ctxt,
+                                                cur->nodesetval->nodeTab[i]);
 	}
     }
+    xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt, res));
     xmlXPathReleaseObject(ctxt->context, cur);
 }
 
 /**
- * Implement the namespace-uri() XPath function
- *    string namespace-uri(node-set?)
- * The namespace-uri function returns a string containing the
- * namespace URI of the expanded name of the node in the argument
- * node-set that is first in document order. If the node-set is empty,
- * the first node has no name, or the expanded name has no namespace
- * URI, an empty string is returned. If the argument is omitted it
- * defaults to the context node.
+ * Implement the floor() XPath function
+ *    number floor(number)
+ * The floor function returns the largest (closest to positive infinity)
+ * number that is not greater than the argument and that is an integer.
  *
  * @param ctxt  the XPath Parser context
  * @param nargs  the number of arguments
  */
 void
-xmlXPathNamespaceURIFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlXPathObjectPtr cur;
+xmlXPathFloorFunction(xmlXPathParserContext *ctxt, int nargs) {
+    CHECK_ARITY(1);
+    CAST_TO_NUMBER;
+    CHECK_TYPE(XPATH_NUMBER);
 
-    if (ctxt == NULL) return;
+    ctxt->value->floatval = floor(ctxt->value->floatval);
+}
 
-    if (nargs == 0) {
-	xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt, ctxt->context->node));
-	nargs = 1;
-    }
+/**
+ * Implement the ceiling() XPath function
+ *    number ceiling(number)
+ * The ceiling function returns the smallest (closest to negative infinity)
+ * number that is not less than the argument and that is an integer.
+ *
+ * @param ctxt  the XPath Parser context
+ * @param nargs  the number of arguments
+ */
+void
+xmlXPathCeilingFunction(xmlXPathParserContext *ctxt, int nargs) {
     CHECK_ARITY(1);
-    if ((ctxt->value == NULL) ||
-	((ctxt->value->type != XPATH_NODESET) &&
-	 (ctxt->value->type != XPATH_XSLT_TREE)))
-	XP_ERROR(XPATH_INVALID_TYPE);
-    cur = xmlXPathValuePop(ctxt);
+    CAST_TO_NUMBER;
+    CHECK_TYPE(XPATH_NUMBER);
 
-    if ((cur->nodesetval == NULL) || (cur->nodesetval->nodeNr == 0)) {
-	xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
-    } else {
-	int i = 0; /* Should be first in document order !!!!! */
-	switch (cur->nodesetval->nodeTab[i]->type) {
-	case XML_ELEMENT_NODE:
-	case XML_ATTRIBUTE_NODE:
-	    if (cur->nodesetval->nodeTab[i]->ns == NULL)
-		xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
-	    else
-		xmlXPathValuePush(ctxt, xmlXPathCacheNewString(ctxt,
-			  cur->nodesetval->nodeTab[i]->ns->href));
-	    break;
-	default:
-	    xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
-	}
+#ifdef _AIX
+    /* Work around buggy ceil() function on AIX */
+    ctxt->value->floatval = copysign(ceil(ctxt->value->floatval), ctxt->value->floatval);
+#else
+    ctxt->value->floatval = ceil(ctxt->value->floatval);
+#endif
+}
+
+/**
+ * Implement the round() XPath function
+ *    number round(number)
+ * The round function returns the number that is closest to the
+ * argument and that is an integer. If there are two such numbers,
+ * then the one that is closest to positive infinity is returned.
+ *
+ * @param ctxt  the XPath Parser context
+ * @param nargs  the number of arguments
+ */
+void
+xmlXPathRoundFunction(xmlXPathParserContext *ctxt, int nargs) {
+    double f;
+
+    CHECK_ARITY(1);
+    CAST_TO_NUMBER;
+    CHECK_TYPE(XPATH_NUMBER);
+
+    f = ctxt->value->floatval;
+
+    if ((f >= -0.5) && (f < 0.5)) {
+        /* Handles negative zero. */
+        ctxt->value->floatval *= 0.0;
+    }
+    else {
+        double rounded = floor(f);
+        if (f - rounded >= 0.5)
+            rounded += 1.0;
+        ctxt->value->floatval = rounded;
+    }
+}
+
+/************************************************************************
+ *									*
+ *			The Parser					*
+ *									*
+ ************************************************************************/
+
+/*
+ * a few forward declarations since we use a recursive call based
+ * implementation.
+ */
+static void xmlXPathCompileExpr(xmlXPathParserContextPtr ctxt, int sort);
+static void xmlXPathCompPredicate(xmlXPathParserContextPtr ctxt, int filter);
+static void xmlXPathCompLocationPath(xmlXPathParserContextPtr ctxt);
+static void xmlXPathCompRelativeLocationPath(xmlXPathParserContextPtr ctxt);
+
+/**
+ * Parse an XML non-colonized name.
+ *
+ * @param ctxt  the XPath Parser context
+ * @returns the nc name or NULL
+ */
+
+xmlChar *
+xmlXPathParseNCName(xmlXPathParserContext *ctxt) {
+    const xmlChar *end;
+    xmlChar *ret;
+
+    if ((ctxt == NULL) || (ctxt->cur == NULL)) return(NULL);
+
+    end = xmlScanName(ctxt->cur, XML_MAX_NAME_LENGTH, XML_SCAN_NC);
+    if (end == NULL) {
+        XP_ERRORNULL(XPATH_EXPR_ERROR);
     }
-    xmlXPathReleaseObject(ctxt->context, cur);
+    if (end == ctxt->cur)
+        return(NULL);
+
+    ret = xmlStrndup(ctxt->cur, end - ctxt->cur);
+    if (ret == NULL)
+        xmlXPathPErrMemory(ctxt);
+    ctxt->cur = end;
+    return(ret);
 }
 
+
 /**
- * Implement the name() XPath function
- *    string name(node-set?)
- * The name function returns a string containing a QName representing
- * the name of the node in the argument node-set that is first in document
- * order. The QName must represent the name with respect to the namespace
- * declarations in effect on the node whose name is being represented.
- * Typically, this will be the form in which the name occurred in the XML
- * source. This need not be the case if there are namespace declarations
- * in effect on the node that associate multiple prefixes with the same
- * namespace. However, an implementation may include information about
- * the original prefix in its representation of nodes; in this case, an
- * implementation can ensure that the returned string is always the same
- * as the QName used in the XML source. If the argument it omitted it
- * defaults to the context node.
- * Libxml keep the original prefix so the "real qualified name" used is
- * returned.
+ * Parse an XML qualified name
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
+ * @param prefix  a xmlChar **
+ * @returns the function returns the local part, and prefix is updated
+ *   to get the Prefix if any.
  */
-static void
-xmlXPathNameFunction(xmlXPathParserContextPtr ctxt, int nargs)
-{
-    xmlXPathObjectPtr cur;
 
-    if (nargs == 0) {
-	xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt, ctxt->context->node));
-        nargs = 1;
+static xmlChar *
+xmlXPathParseQName(xmlXPathParserContextPtr ctxt, xmlChar **prefix) {
+    xmlChar *ret = NULL;
+
+    *prefix = NULL;
+    ret = xmlXPathParseNCName(ctxt);
+    if (ret && CUR == ':') {
+        *prefix = ret;
+	NEXT;
+	ret = xmlXPathParseNCName(ctxt);
     }
+    return(ret);
+}
 
-    CHECK_ARITY(1);
-    if ((ctxt->value == NULL) ||
-        ((ctxt->value->type != XPATH_NODESET) &&
-         (ctxt->value->type != XPATH_XSLT_TREE)))
-        XP_ERROR(XPATH_INVALID_TYPE);
-    cur = xmlXPathValuePop(ctxt);
+/**
+ * parse an XML name
+ *
+ * @param ctxt  the XPath Parser context
+ * @returns the name or NULL
+ */
 
-    if ((cur->nodesetval == NULL) || (cur->nodesetval->nodeNr == 0)) {
-        xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
-    } else {
-        int i = 0;              /* Should be first in document order !!!!! */
+xmlChar *
+xmlXPathParseName(xmlXPathParserContext *ctxt) {
+    const xmlChar *end;
+    xmlChar *ret;
 
-        switch (cur->nodesetval->nodeTab[i]->type) {
-            case XML_ELEMENT_NODE:
-            case XML_ATTRIBUTE_NODE:
-		if (cur->nodesetval->nodeTab[i]->name[0] == ' ')
-		    xmlXPathValuePush(ctxt,
-			xmlXPathCacheNewCString(ctxt, ""));
-		else if ((cur->nodesetval->nodeTab[i]->ns == NULL) ||
-                         (cur->nodesetval->nodeTab[i]->ns->prefix == NULL)) {
-		    xmlXPathValuePush(ctxt, xmlXPathCacheNewString(ctxt,
-			    cur->nodesetval->nodeTab[i]->name));
-		} else {
-		    xmlChar *fullname;
+    if ((ctxt == NULL) || (ctxt->cur == NULL)) return(NULL);
 
-		    fullname = xmlBuildQName(cur->nodesetval->nodeTab[i]->name,
-				     cur->nodesetval->nodeTab[i]->ns->prefix,
-				     NULL, 0);
-		    if (fullname == cur->nodesetval->nodeTab[i]->name)
-			fullname = xmlStrdup(cur->nodesetval->nodeTab[i]->name);
-		    if (fullname == NULL)
-                        xmlXPathPErrMemory(ctxt);
-		    xmlXPathValuePush(ctxt, xmlXPathCacheWrapString(ctxt, fullname));
-                }
-                break;
-            default:
-		xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt,
-		    cur->nodesetval->nodeTab[i]));
-                xmlXPathLocalNameFunction(ctxt, 1);
-        }
+    end = xmlScanName(ctxt->cur, XML_MAX_NAME_LENGTH, 0);
+    if (end == NULL) {
+        XP_ERRORNULL(XPATH_EXPR_ERROR);
     }
-    xmlXPathReleaseObject(ctxt->context, cur);
+    if (end == ctxt->cur)
+        return(NULL);
+
+    ret = xmlStrndup(ctxt->cur, end - ctxt->cur);
+    if (ret == NULL)
+        xmlXPathPErrMemory(ctxt);
+    ctxt->cur = end;
+    return(ret);
 }
 
+#define MAX_FRAC 20
 
 /**
- * Implement the string() XPath function
- *    string string(object?)
- * The string function converts an object to a string as follows:
- *    - A node-set is converted to a string by returning the value of
- *      the node in the node-set that is first in document order.
- *      If the node-set is empty, an empty string is returned.
- *    - A number is converted to a string as follows
- *      + NaN is converted to the string NaN
- *      + positive zero is converted to the string 0
- *      + negative zero is converted to the string 0
- *      + positive infinity is converted to the string Infinity
- *      + negative infinity is converted to the string -Infinity
- *      + if the number is an integer, the number is represented in
- *        decimal form as a Number with no decimal point and no leading
- *        zeros, preceded by a minus sign (-) if the number is negative
- *      + otherwise, the number is represented in decimal form as a
- *        Number including a decimal point with at least one digit
- *        before the decimal point and at least one digit after the
- *        decimal point, preceded by a minus sign (-) if the number
- *        is negative; there must be no leading zeros before the decimal
- *        point apart possibly from the one required digit immediately
- *        before the decimal point; beyond the one required digit
- *        after the decimal point there must be as many, but only as
- *        many, more digits as are needed to uniquely distinguish the
- *        number from all other IEEE 754 numeric values.
- *    - The boolean false value is converted to the string false.
- *      The boolean true value is converted to the string true.
+ *  [30a]  Float  ::= Number ('e' Digits?)?
  *
- * If the argument is omitted, it defaults to a node-set with the
- * context node as its only member.
+ *  [30]   Number ::=   Digits ('.' Digits?)?
+ *                    | '.' Digits
+ *  [31]   Digits ::=   [0-9]+
  *
- * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
+ * Compile a Number in the string
+ * In complement of the Number expression, this function also handles
+ * negative values : '-' Number.
+ *
+ * @param str  A string to scan
+ * @returns the double value.
  */
-void
-xmlXPathStringFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlXPathObjectPtr cur;
-    xmlChar *stringval;
+double
+xmlXPathStringEvalNumber(const xmlChar *str) {
+    const xmlChar *cur = str;
+    double ret;
+    int ok = 0;
+    int isneg = 0;
+    int exponent = 0;
+    int is_exponent_negative = 0;
+#ifdef __GNUC__
+    unsigned long tmp = 0;
+    double temp;
+#endif
+    if (cur == NULL) return(0);
+    while (IS_BLANK_CH(*cur)) cur++;
+    if (*cur == '-') {
+	isneg = 1;
+	cur++;
+    }
+    if ((*cur != '.') && ((*cur < '0') || (*cur > '9'))) {
+        return(xmlXPathNAN);
+    }
 
-    if (ctxt == NULL) return;
-    if (nargs == 0) {
-        stringval = xmlXPathCastNodeToString(ctxt->context->node);
-        if (stringval == NULL)
-            xmlXPathPErrMemory(ctxt);
-        xmlXPathValuePush(ctxt, xmlXPathCacheWrapString(ctxt, stringval));
-	return;
+#ifdef __GNUC__
+    /*
+     * tmp/temp is a workaround against a gcc compiler bug
+     * http://veillard.com/gcc.bug
+     */
+    ret = 0;
+    while ((*cur >= '0') && (*cur <= '9')) {
+	ret = ret * 10;
+	tmp = (*cur - '0');
+	ok = 1;
+	cur++;
+	temp = (double) tmp;
+	ret = ret + temp;
+    }
+#else
+    ret = 0;
+    while ((*cur >= '0') && (*cur <= '9')) {
+	ret = ret * 10 + (*cur - '0');
+	ok = 1;
+	cur++;
     }
+#endif
 
-    CHECK_ARITY(1);
-    cur = xmlXPathValuePop(ctxt);
-    if (cur == NULL) XP_ERROR(XPATH_INVALID_OPERAND);
-    if (cur->type != XPATH_STRING) {
-        stringval = xmlXPathCastToString(cur);
-        if (stringval == NULL)
-            xmlXPathPErrMemory(ctxt);
-        xmlXPathReleaseObject(ctxt->context, cur);
-        cur = xmlXPathCacheWrapString(ctxt, stringval);
+    if (*cur == '.') {
+	int v, frac = 0, max;
+	double fraction = 0;
+
+        cur++;
+	if (((*cur < '0') || (*cur > '9')) && (!ok)) {
+	    return(xmlXPathNAN);
+	}
+        while (*cur == '0') {
+	    frac = frac + 1;
+	    cur++;
+        }
+        max = frac + MAX_FRAC;
+	while (((*cur >= '0') && (*cur <= '9')) && (frac < max)) {
+	    v = (*cur - '0');
+	    fraction = fraction * 10 + v;
+	    frac = frac + 1;
+	    cur++;
+	}
+	fraction /= pow(10.0, frac);
+	ret = ret + fraction;
+	while ((*cur >= '0') && (*cur <= '9'))
+	    cur++;
+    }
+    if ((*cur == 'e') || (*cur == 'E')) {
+      cur++;
+      if (*cur == '-') {
+	is_exponent_negative = 1;
+	cur++;
+      } else if (*cur == '+') {
+        cur++;
+      }
+      while ((*cur >= '0') && (*cur <= '9')) {
+        if (exponent < 1000000)
+	  exponent = exponent * 10 + (*cur - '0');
+	cur++;
+      }
     }
-    xmlXPathValuePush(ctxt, cur);
+    while (IS_BLANK_CH(*cur)) cur++;
+    if (*cur != 0) return(xmlXPathNAN);
+    if (isneg) ret = -ret;
+    if (is_exponent_negative) exponent = -exponent;
+    ret *= pow(10.0, (double)exponent);
+    return(ret);
 }
 
 /**
- * Implement the string-length() XPath function
- *    number string-length(string?)
- * The string-length returns the number of characters in the string
- * (see [3.6 Strings]). If the argument is omitted, it defaults to
- * the context node converted to a string, in other words the value
- * of the context node.
+ *  [30]   Number ::=   Digits ('.' Digits?)?
+ *                    | '.' Digits
+ *  [31]   Digits ::=   [0-9]+
+ *
+ * Compile a Number, then push it on the stack
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
  */
-void
-xmlXPathStringLengthFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlXPathObjectPtr cur;
+static void
+xmlXPathCompNumber(xmlXPathParserContextPtr ctxt)
+{
+    double ret = 0.0;
+    int ok = 0;
+    int exponent = 0;
+    int is_exponent_negative = 0;
+    xmlXPathObjectPtr num;
+#ifdef __GNUC__
+    unsigned long tmp = 0;
+    double temp;
+#endif
 
-    if (nargs == 0) {
-        if ((ctxt == NULL) || (ctxt->context == NULL))
-	    return;
-	if (ctxt->context->node == NULL) {
-	    xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt, 0));
-	} else {
-	    xmlChar *content;
+    CHECK_ERROR;
+    if ((CUR != '.') && ((CUR < '0') || (CUR > '9'))) {
+        XP_ERROR(XPATH_NUMBER_ERROR);
+    }
+#ifdef __GNUC__
+    /*
+     * tmp/temp is a workaround against a gcc compiler bug
+     * http://veillard.com/gcc.bug
+     */
+    ret = 0;
+    while ((CUR >= '0') && (CUR <= '9')) {
+	ret = ret * 10;
+	tmp = (CUR - '0');
+        ok = 1;
+        NEXT;
+	temp = (double) tmp;
+	ret = ret + temp;
+    }
+#else
+    ret = 0;
+    while ((CUR >= '0') && (CUR <= '9')) {
+	ret = ret * 10 + (CUR - '0');
+	ok = 1;
+	NEXT;
+    }
+#endif
+    if (CUR == '.') {
+	int v, frac = 0, max;
+	double fraction = 0;
 
-	    content = xmlXPathCastNodeToString(ctxt->context->node);
-            if (content == NULL)
-                xmlXPathPErrMemory(ctxt);
-	    xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt,
-		xmlUTF8Strlen(content)));
-	    xmlFree(content);
+        NEXT;
+        if (((CUR < '0') || (CUR > '9')) && (!ok)) {
+            XP_ERROR(XPATH_NUMBER_ERROR);
+        }
+        while (CUR == '0') {
+            frac = frac + 1;
+            NEXT;
+        }
+        max = frac + MAX_FRAC;
+        while ((CUR >= '0') && (CUR <= '9') && (frac < max)) {
+	    v = (CUR - '0');
+	    fraction = fraction * 10 + v;
+	    frac = frac + 1;
+            NEXT;
+        }
+        fraction /= pow(10.0, frac);
+        ret = ret + fraction;
+        while ((CUR >= '0') && (CUR <= '9'))
+            NEXT;
+    }
+    if ((CUR == 'e') || (CUR == 'E')) {
+        NEXT;
+        if (CUR == '-') {
+            is_exponent_negative = 1;
+            NEXT;
+        } else if (CUR == '+') {
+	    NEXT;
 	}
-	return;
+        while ((CUR >= '0') && (CUR <= '9')) {
+            if (exponent < 1000000)
+                exponent = exponent * 10 + (CUR - '0');
+            NEXT;
+        }
+        if (is_exponent_negative)
+            exponent = -exponent;
+        ret *= pow(10.0, (double) exponent);
+    }
+    num = xmlXPathCacheNewFloat(ctxt, ret);
+    if (num == NULL) {
+	ctxt->error = XPATH_MEMORY_ERROR;
+    } else if (PUSH_LONG_EXPR(XPATH_OP_VALUE, XPATH_NUMBER, 0, 0, num,
+                              NULL) == -1) {
+        xmlXPathReleaseObject(ctxt->context, num);
     }
-    CHECK_ARITY(1);
-    CAST_TO_STRING;
-    CHECK_TYPE(XPATH_STRING);
-    cur = xmlXPathValuePop(ctxt);
-    xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt,
-	xmlUTF8Strlen(cur->stringval)));
-    xmlXPathReleaseObject(ctxt->context, cur);
 }
 
 /**
- * Implement the concat() XPath function
- *    string concat(string, string, string*)
- * The concat function returns the concatenation of its arguments.
+ * Parse a Literal
+ *
+ *  [29]   Literal ::=   '"' [^"]* '"'
+ *                    | "'" [^']* "'"
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
+ * @returns the value found or NULL in case of error
  */
-void
-xmlXPathConcatFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlXPathObjectPtr cur, newobj;
-    xmlChar *tmp;
+static xmlChar *
+xmlXPathParseLiteral(xmlXPathParserContextPtr ctxt) {
+    const xmlChar *q;
+    xmlChar *ret = NULL;
+    int quote;
 
-    if (ctxt == NULL) return;
-    if (nargs < 2) {
-	CHECK_ARITY(2);
+    if (CUR == '"') {
+        quote = '"';
+    } else if (CUR == '\'') {
+        quote = '\'';
+    } else {
+	XP_ERRORNULL(XPATH_START_LITERAL_ERROR);
     }
 
-    CAST_TO_STRING;
-    cur = xmlXPathValuePop(ctxt);
-    if ((cur == NULL) || (cur->type != XPATH_STRING)) {
-	xmlXPathReleaseObject(ctxt->context, cur);
-	return;
-    }
-    nargs--;
+    NEXT;
+    q = CUR_PTR;
+    while (CUR != quote) {
+        int ch;
+        int len = 4;
 
-    while (nargs > 0) {
-	CAST_TO_STRING;
-	newobj = xmlXPathValuePop(ctxt);
-	if ((newobj == NULL) || (newobj->type != XPATH_STRING)) {
-	    xmlXPathReleaseObject(ctxt->context, newobj);
-	    xmlXPathReleaseObject(ctxt->context, cur);
-	    XP_ERROR(XPATH_INVALID_TYPE);
-	}
-	tmp = xmlStrcat(newobj->stringval, cur->stringval);
-        if (tmp == NULL)
-            xmlXPathPErrMemory(ctxt);
-	newobj->stringval = cur->stringval;
-	cur->stringval = tmp;
-	xmlXPathReleaseObject(ctxt->context, newobj);
-	nargs--;
+        if (CUR == 0)
+            XP_ERRORNULL(XPATH_UNFINISHED_LITERAL_ERROR);
+        ch = xmlGetUTF8Char(CUR_PTR, &len);
+        if ((ch < 0) || (IS_CHAR(ch) == 0))
+            XP_ERRORNULL(XPATH_INVALID_CHAR_ERROR);
+        CUR_PTR += len;
     }
-    xmlXPathValuePush(ctxt, cur);
+    ret = xmlStrndup(q, CUR_PTR - q);
+    if (ret == NULL)
+        xmlXPathPErrMemory(ctxt);
+    NEXT;
+    return(ret);
 }
 
 /**
- * Implement the contains() XPath function
- *    boolean contains(string, string)
- * The contains function returns true if the first argument string
- * contains the second argument string, and otherwise returns false.
+ * Parse a Literal and push it on the stack.
+ *
+ *  [29]   Literal ::=   '"' [^"]* '"'
+ *                    | "'" [^']* "'"
+ *
+ * TODO: Memory allocation could be improved.
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
  */
-void
-xmlXPathContainsFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlXPathObjectPtr hay, needle;
+static void
+xmlXPathCompLiteral(xmlXPathParserContextPtr ctxt) {
+    xmlChar *ret = NULL;
+    xmlXPathObjectPtr lit;
 
-    CHECK_ARITY(2);
-    CAST_TO_STRING;
-    CHECK_TYPE(XPATH_STRING);
-    needle = xmlXPathValuePop(ctxt);
-    CAST_TO_STRING;
-    hay = xmlXPathValuePop(ctxt);
+    ret = xmlXPathParseLiteral(ctxt);
+    if (ret == NULL)
+        return;
+    lit = xmlXPathCacheNewString(ctxt, ret);
+    if (lit == NULL) {
+        ctxt->error = XPATH_MEMORY_ERROR;
+    } else if (PUSH_LONG_EXPR(XPATH_OP_VALUE, XPATH_STRING, 0, 0, lit,
+                              NULL) == -1) {
+        xmlXPathReleaseObject(ctxt->context, lit);
+    }
+    xmlFree(ret);
+}
 
-    if ((hay == NULL) || (hay->type != XPATH_STRING)) {
-	xmlXPathReleaseObject(ctxt->context, hay);
-	xmlXPathReleaseObject(ctxt->context, needle);
-	XP_ERROR(XPATH_INVALID_TYPE);
+/**
+ * Parse a VariableReference, evaluate it and push it on the stack.
+ *
+ * The variable bindings consist of a mapping from variable names
+ * to variable values. The value of a variable is an object, which can be
+ * of any of the types that are possible for the value of an expression,
+ * and may also be of additional types not specified here.
+ *
+ * Early evaluation is possible since:
+ * The variable bindings [...] used to evaluate a subexpression are
+ * always the same as those used to evaluate the containing expression.
+ *
+ *  [36]   VariableReference ::=   '$' QName
+ * @param ctxt  the XPath Parser context
+ */
+static void
+xmlXPathCompVariableReference(xmlXPathParserContextPtr ctxt) {
+    xmlChar *name;
+    xmlChar *prefix;
+
+    SKIP_BLANKS;
+    if (CUR != '$') {
+	XP_ERROR(XPATH_VARIABLE_REF_ERROR);
+    }
+    NEXT;
+    name = xmlXPathParseQName(ctxt, &prefix);
+    if (name == NULL) {
+        xmlFree(prefix);
+	XP_ERROR(XPATH_VARIABLE_REF_ERROR);
+    }
+    ctxt->comp->last = -1;
+    if (PUSH_LONG_EXPR(XPATH_OP_VARIABLE, 0, 0, 0, name, prefix) == -1) {
+        xmlFree(prefix);
+        xmlFree(name);
+    }
+    SKIP_BLANKS;
+    if ((ctxt->context != NULL) && (ctxt->context->flags & XML_XPATH_NOVAR)) {
+	XP_ERROR(XPATH_FORBID_VARIABLE_ERROR);
     }
-    if (xmlStrstr(hay->stringval, needle->stringval))
-	xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, 1));
-    else
-	xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, 0));
-    xmlXPathReleaseObject(ctxt->context, hay);
-    xmlXPathReleaseObject(ctxt->context, needle);
 }
 
 /**
- * Implement the starts-with() XPath function
- *    boolean starts-with(string, string)
- * The starts-with function returns true if the first argument string
- * starts with the second argument string, and otherwise returns false.
+ * Is the name given a NodeType one.
  *
- * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
+ *  [38]   NodeType ::=   'comment'
+ *                    | 'text'
+ *                    | 'processing-instruction'
+ *                    | 'node'
+ *
+ * @param name  a name string
+ * @returns 1 if true 0 otherwise
  */
-void
-xmlXPathStartsWithFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlXPathObjectPtr hay, needle;
-    int n;
-
-    CHECK_ARITY(2);
-    CAST_TO_STRING;
-    CHECK_TYPE(XPATH_STRING);
-    needle = xmlXPathValuePop(ctxt);
-    CAST_TO_STRING;
-    hay = xmlXPathValuePop(ctxt);
+int
+xmlXPathIsNodeType(const xmlChar *name) {
+    if (name == NULL)
+	return(0);
 
-    if ((hay == NULL) || (hay->type != XPATH_STRING)) {
-	xmlXPathReleaseObject(ctxt->context, hay);
-	xmlXPathReleaseObject(ctxt->context, needle);
-	XP_ERROR(XPATH_INVALID_TYPE);
-    }
-    n = xmlStrlen(needle->stringval);
-    if (xmlStrncmp(hay->stringval, needle->stringval, n))
-        xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, 0));
-    else
-        xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, 1));
-    xmlXPathReleaseObject(ctxt->context, hay);
-    xmlXPathReleaseObject(ctxt->context, needle);
+    if (xmlStrEqual(name, BAD_CAST "node"))
+	return(1);
+    if (xmlStrEqual(name, BAD_CAST "text"))
+	return(1);
+    if (xmlStrEqual(name, BAD_CAST "comment"))
+	return(1);
+    if (xmlStrEqual(name, BAD_CAST "processing-instruction"))
+	return(1);
+    return(0);
 }
 
 /**
- * Implement the substring() XPath function
- *    string substring(string, number, number?)
- * The substring function returns the substring of the first argument
- * starting at the position specified in the second argument with
- * length specified in the third argument. For example,
- * substring("12345",2,3) returns "234". If the third argument is not
- * specified, it returns the substring starting at the position specified
- * in the second argument and continuing to the end of the string. For
- * example, substring("12345",2) returns "2345".  More precisely, each
- * character in the string (see [3.6 Strings]) is considered to have a
- * numeric position: the position of the first character is 1, the position
- * of the second character is 2 and so on. The returned substring contains
- * those characters for which the position of the character is greater than
- * or equal to the second argument and, if the third argument is specified,
- * less than the sum of the second and third arguments; the comparisons
- * and addition used for the above follow the standard IEEE 754 rules. Thus:
- *  - substring("12345", 1.5, 2.6) returns "234"
- *  - substring("12345", 0, 3) returns "12"
- *  - substring("12345", 0 div 0, 3) returns ""
- *  - substring("12345", 1, 0 div 0) returns ""
- *  - substring("12345", -42, 1 div 0) returns "12345"
- *  - substring("12345", -1 div 0, 1 div 0) returns ""
+ *  [16]   FunctionCall ::=   FunctionName '(' ( Argument ( ',' Argument)*)? ')'
+ *  [17]   Argument ::=   Expr
+ *
+ * Compile a function call, the evaluation of all arguments are
+ * pushed on the stack
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
  */
-void
-xmlXPathSubstringFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlXPathObjectPtr str, start, len;
-    double le=0, in;
-    int i = 1, j = INT_MAX;
+static void
+xmlXPathCompFunctionCall(xmlXPathParserContextPtr ctxt) {
+    xmlChar *name;
+    xmlChar *prefix;
+    int nbargs = 0;
+    int sort = 1;
 
-    if (nargs < 2) {
-	CHECK_ARITY(2);
+    name = xmlXPathParseQName(ctxt, &prefix);
+    if (name == NULL) {
+	xmlFree(prefix);
+	XP_ERROR(XPATH_EXPR_ERROR);
     }
-    if (nargs > 3) {
-	CHECK_ARITY(3);
+    SKIP_BLANKS;
+
+    if (CUR != '(') {
+	xmlFree(name);
+	xmlFree(prefix);
+	XP_ERROR(XPATH_EXPR_ERROR);
     }
+    NEXT;
+    SKIP_BLANKS;
+
     /*
-     * take care of possible last (position) argument
+    * Optimization for count(): we don't need the node-set to be sorted.
     */
-    if (nargs == 3) {
-	CAST_TO_NUMBER;
-	CHECK_TYPE(XPATH_NUMBER);
-	len = xmlXPathValuePop(ctxt);
-	le = len->floatval;
-	xmlXPathReleaseObject(ctxt->context, len);
+    if ((prefix == NULL) && (name[0] == 'c') &&
+	xmlStrEqual(name, BAD_CAST "count"))
+    {
+	sort = 0;
     }
-
-    CAST_TO_NUMBER;
-    CHECK_TYPE(XPATH_NUMBER);
-    start = xmlXPathValuePop(ctxt);
-    in = start->floatval;
-    xmlXPathReleaseObject(ctxt->context, start);
-    CAST_TO_STRING;
-    CHECK_TYPE(XPATH_STRING);
-    str = xmlXPathValuePop(ctxt);
-
-    if (!(in < INT_MAX)) { /* Logical NOT to handle NaNs */
-        i = INT_MAX;
-    } else if (in >= 1.0) {
-        i = (int)in;
-        if (in - floor(in) >= 0.5)
-            i += 1;
+    ctxt->comp->last = -1;
+    if (CUR != ')') {
+	while (CUR != 0) {
+	    int op1 = ctxt->comp->last;
+	    ctxt->comp->last = -1;
+	    xmlXPathCompileExpr(ctxt, sort);
+	    if (ctxt->error != XPATH_EXPRESSION_OK) {
+		xmlFree(name);
+		xmlFree(prefix);
+		return;
+	    }
+	    PUSH_BINARY_EXPR(XPATH_OP_ARG, op1, ctxt->comp->last, 0, 0);
+	    nbargs++;
+	    if (CUR == ')') break;
+	    if (CUR != ',') {
+		xmlFree(name);
+		xmlFree(prefix);
+		XP_ERROR(XPATH_EXPR_ERROR);
+	    }
+	    NEXT;
+	    SKIP_BLANKS;
+	}
     }
+    if (PUSH_LONG_EXPR(XPATH_OP_FUNCTION, nbargs, 0, 0, name, prefix) == -1) {
+        xmlFree(prefix);
+        xmlFree(name);
+    }
+    NEXT;
+    SKIP_BLANKS;
+}
 
-    if (nargs == 3) {
-        double rin, rle, end;
-
-        rin = floor(in);
-        if (in - rin >= 0.5)
-            rin += 1.0;
-
-        rle = floor(le);
-        if (le - rle >= 0.5)
-            rle += 1.0;
-
-        end = rin + rle;
-        if (!(end >= 1.0)) { /* Logical NOT to handle NaNs */
-            j = 1;
-        } else if (end < INT_MAX) {
-            j = (int)end;
-        }
+/**
+ *  [15]   PrimaryExpr ::=   VariableReference
+ *                | '(' Expr ')'
+ *                | Literal
+ *                | Number
+ *                | FunctionCall
+ *
+ * Compile a primary expression.
+ *
+ * @param ctxt  the XPath Parser context
+ */
+static void
+xmlXPathCompPrimaryExpr(xmlXPathParserContextPtr ctxt) {
+    SKIP_BLANKS;
+    if (CUR == '$') xmlXPathCompVariableReference(ctxt);
+    else if (CUR == '(') {
+	NEXT;
+	SKIP_BLANKS;
+	xmlXPathCompileExpr(ctxt, 1);
+	CHECK_ERROR;
+	if (CUR != ')') {
+	    XP_ERROR(XPATH_EXPR_ERROR);
+	}
+	NEXT;
+	SKIP_BLANKS;
+    } else if (IS_ASCII_DIGIT(CUR) || (CUR == '.' && IS_ASCII_DIGIT(NXT(1)))) {
+	xmlXPathCompNumber(ctxt);
+    } else if ((CUR == '\'') || (CUR == '"')) {
+	xmlXPathCompLiteral(ctxt);
+    } else {
+	xmlXPathCompFunctionCall(ctxt);
     }
+    SKIP_BLANKS;
+}
 
-    i -= 1;
-    j -= 1;
+/**
+ *  [20]   FilterExpr ::=   PrimaryExpr
+ *               | FilterExpr Predicate
+ *
+ * Compile a filter expression.
+ * Square brackets are used to filter expressions in the same way that
+ * they are used in location paths. It is an error if the expression to
+ * be filtered does not evaluate to a node-set. The context node list
+ * used for evaluating the expression in square brackets is the node-set
+ * to be filtered listed in document order.
+ *
+ * @param ctxt  the XPath Parser context
+ */
+
+static void
+xmlXPathCompFilterExpr(xmlXPathParserContextPtr ctxt) {
+    xmlXPathCompPrimaryExpr(ctxt);
+    CHECK_ERROR;
+    SKIP_BLANKS;
 
-    if ((i < j) && (i < xmlUTF8Strlen(str->stringval))) {
-        xmlChar *ret = xmlUTF8Strsub(str->stringval, i, j - i);
-        if (ret == NULL)
-            xmlXPathPErrMemory(ctxt);
-	xmlXPathValuePush(ctxt, xmlXPathCacheNewString(ctxt, ret));
-	xmlFree(ret);
-    } else {
-	xmlXPathValuePush(ctxt, xmlXPathCacheNewCString(ctxt, ""));
+    while (CUR == '[') {
+	xmlXPathCompPredicate(ctxt, 1);
+	SKIP_BLANKS;
     }
 
-    xmlXPathReleaseObject(ctxt->context, str);
+
 }
 
 /**
- * Implement the substring-before() XPath function
- *    string substring-before(string, string)
- * The substring-before function returns the substring of the first
- * argument string that precedes the first occurrence of the second
- * argument string in the first argument string, or the empty string
- * if the first argument string does not contain the second argument
- * string. For example, substring-before("1999/04/01","/") returns 1999.
+ * Trickery: parse an XML name but without consuming the input flow
+ * Needed to avoid insanity in the parser state.
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
+ * @returns the Name parsed or NULL
  */
-void
-xmlXPathSubstringBeforeFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlXPathObjectPtr str = NULL;
-    xmlXPathObjectPtr find = NULL;
-    const xmlChar *point;
-    xmlChar *result;
 
-    CHECK_ARITY(2);
-    CAST_TO_STRING;
-    find = xmlXPathValuePop(ctxt);
-    CAST_TO_STRING;
-    str = xmlXPathValuePop(ctxt);
-    if (ctxt->error != 0)
-        goto error;
+static xmlChar *
+xmlXPathScanName(xmlXPathParserContextPtr ctxt) {
+    const xmlChar *end;
+    xmlChar *ret;
 
-    point = xmlStrstr(str->stringval, find->stringval);
-    if (point == NULL) {
-        result = xmlStrdup(BAD_CAST "");
-    } else {
-        result = xmlStrndup(str->stringval, point - str->stringval);
-    }
-    if (result == NULL) {
-        xmlXPathPErrMemory(ctxt);
-        goto error;
+    end = xmlScanName(ctxt->cur, XML_MAX_NAME_LENGTH, 0);
+    if (end == NULL) {
+        XP_ERRORNULL(XPATH_EXPR_ERROR);
     }
-    xmlXPathValuePush(ctxt, xmlXPathCacheWrapString(ctxt, result));
+    if (end == ctxt->cur)
+        return(NULL);
 
-error:
-    xmlXPathReleaseObject(ctxt->context, str);
-    xmlXPathReleaseObject(ctxt->context, find);
+    ret = xmlStrndup(ctxt->cur, end - ctxt->cur);
+    if (ret == NULL)
+        xmlXPathPErrMemory(ctxt);
+    return(ret);
 }
 
 /**
- * Implement the substring-after() XPath function
- *    string substring-after(string, string)
- * The substring-after function returns the substring of the first
- * argument string that follows the first occurrence of the second
- * argument string in the first argument string, or the empty string
- * if the first argument string does not contain the second argument
- * string. For example, substring-after("1999/04/01","/") returns 04/01,
- * and substring-after("1999/04/01","19") returns 99/04/01.
+ *  [19]   PathExpr ::=   LocationPath
+ *               | FilterExpr
+ *               | FilterExpr '/' RelativeLocationPath
+ *               | FilterExpr '//' RelativeLocationPath
+ *
+ * Compile a path expression.
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
  */
-void
-xmlXPathSubstringAfterFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlXPathObjectPtr str = NULL;
-    xmlXPathObjectPtr find = NULL;
-    const xmlChar *point;
-    xmlChar *result;
 
-    CHECK_ARITY(2);
-    CAST_TO_STRING;
-    find = xmlXPathValuePop(ctxt);
-    CAST_TO_STRING;
-    str = xmlXPathValuePop(ctxt);
-    if (ctxt->error != 0)
-        goto error;
+static void
+xmlXPathCompPathExpr(xmlXPathParserContextPtr ctxt) {
+    int lc = 1;           /* Should we branch to LocationPath ?         */
+    xmlChar *name = NULL; /* we may have to preparse a name to find out */
 
-    point = xmlStrstr(str->stringval, find->stringval);
-    if (point == NULL) {
-        result = xmlStrdup(BAD_CAST "");
+    SKIP_BLANKS;
+    if ((CUR == '$') || (CUR == '(') ||
+	(IS_ASCII_DIGIT(CUR)) ||
+        (CUR == '\'') || (CUR == '"') ||
+	(CUR == '.' && IS_ASCII_DIGIT(NXT(1)))) {
+	lc = 0;
+    } else if (CUR == '*') {
+	/* relative or absolute location path */
+	lc = 1;
+    } else if (CUR == '/') {
+	/* relative or absolute location path */
+	lc = 1;
+    } else if (CUR == '@') {
+	/* relative abbreviated attribute location path */
+	lc = 1;
+    } else if (CUR == '.') {
+	/* relative abbreviated attribute location path */
+	lc = 1;
     } else {
-        result = xmlStrdup(point + xmlStrlen(find->stringval));
-    }
-    if (result == NULL) {
-        xmlXPathPErrMemory(ctxt);
-        goto error;
+	/*
+	 * Problem is finding if we have a name here whether it's:
+	 *   - a nodetype
+	 *   - a function call in which case it's followed by '('
+	 *   - an axis in which case it's followed by ':'
+	 *   - a element name
+	 * We do an a priori analysis here rather than having to
+	 * maintain parsed token content through the recursive function
+	 * calls. This looks uglier but makes the code easier to
+	 * read/write/debug.
+	 */
+	SKIP_BLANKS;
+	name = xmlXPathScanName(ctxt);
+	if ((name != NULL) && (xmlStrstr(name, (xmlChar *) "::") != NULL)) {
+	    lc = 1;
+	    xmlFree(name);
+	} else if (name != NULL) {
+	    int len =xmlStrlen(name);
+
+
+	    while (NXT(len) != 0) {
+		if (NXT(len) == '/') {
+		    /* element name */
+		    lc = 1;
+		    break;
+		} else if (IS_BLANK_CH(NXT(len))) {
+		    /* ignore blanks */
+		    ;
+		} else if (NXT(len) == ':') {
+		    lc = 1;
+		    break;
+		} else if ((NXT(len) == '(')) {
+		    /* Node Type or Function */
+		    if (xmlXPathIsNodeType(name)) {
+			lc = 1;
+		    } else {
+			lc = 0;
+		    }
+                    break;
+		} else if ((NXT(len) == '[')) {
+		    /* element name */
+		    lc = 1;
+		    break;
+		} else if ((NXT(len) == '<') || (NXT(len) == '>') ||
+			   (NXT(len) == '=')) {
+		    lc = 1;
+		    break;
+		} else {
+		    lc = 1;
+		    break;
+		}
+		len++;
+	    }
+	    if (NXT(len) == 0) {
+		/* element name */
+		lc = 1;
+	    }
+	    xmlFree(name);
+	} else {
+	    /* make sure all cases are covered explicitly */
+	    XP_ERROR(XPATH_EXPR_ERROR);
+	}
     }
-    xmlXPathValuePush(ctxt, xmlXPathCacheWrapString(ctxt, result));
 
-error:
-    xmlXPathReleaseObject(ctxt->context, str);
-    xmlXPathReleaseObject(ctxt->context, find);
+    if (lc) {
+	if (CUR == '/') {
+	    PUSH_LEAVE_EXPR(XPATH_OP_ROOT, 0, 0);
+	} else {
+	    PUSH_LEAVE_EXPR(XPATH_OP_NODE, 0, 0);
+	}
+	xmlXPathCompLocationPath(ctxt);
+    } else {
+	xmlXPathCompFilterExpr(ctxt);
+	CHECK_ERROR;
+	if ((CUR == '/') && (NXT(1) == '/')) {
+	    SKIP(2);
+	    SKIP_BLANKS;
+
+	    PUSH_LONG_EXPR(XPATH_OP_COLLECT, AXIS_DESCENDANT_OR_SELF,
+		    NODE_TEST_TYPE, NODE_TYPE_NODE, NULL, NULL);
+
+	    xmlXPathCompRelativeLocationPath(ctxt);
+	} else if (CUR == '/') {
+	    xmlXPathCompRelativeLocationPath(ctxt);
+	}
+    }
+    SKIP_BLANKS;
 }
 
 /**
- * Implement the normalize-space() XPath function
- *    string normalize-space(string?)
- * The normalize-space function returns the argument string with white
- * space normalized by stripping leading and trailing whitespace
- * and replacing sequences of whitespace characters by a single
- * space. Whitespace characters are the same allowed by the S production
- * in XML. If the argument is omitted, it defaults to the context
- * node converted to a string, in other words the value of the context node.
+ *  [18]   UnionExpr ::=   PathExpr
+ *               | UnionExpr '|' PathExpr
+ *
+ * Compile an union expression.
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
  */
-void
-xmlXPathNormalizeFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlChar *source, *target;
-    int blank;
 
-    if (ctxt == NULL) return;
-    if (nargs == 0) {
-        /* Use current context node */
-        source = xmlXPathCastNodeToString(ctxt->context->node);
-        if (source == NULL)
-            xmlXPathPErrMemory(ctxt);
-        xmlXPathValuePush(ctxt, xmlXPathCacheWrapString(ctxt, source));
-        nargs = 1;
-    }
+static void
+xmlXPathCompUnionExpr(xmlXPathParserContextPtr ctxt) {
+    xmlXPathCompPathExpr(ctxt);
+    CHECK_ERROR;
+    SKIP_BLANKS;
+    while (CUR == '|') {
+	int op1 = ctxt->comp->last;
+	PUSH_LEAVE_EXPR(XPATH_OP_NODE, 0, 0);
 
-    CHECK_ARITY(1);
-    CAST_TO_STRING;
-    CHECK_TYPE(XPATH_STRING);
-    source = ctxt->value->stringval;
-    if (source == NULL)
-        return;
-    target = source;
+	NEXT;
+	SKIP_BLANKS;
+	xmlXPathCompPathExpr(ctxt);
 
-    /* Skip leading whitespaces */
-    while (IS_BLANK_CH(*source))
-        source++;
+	PUSH_BINARY_EXPR(XPATH_OP_UNION, op1, ctxt->comp->last, 0, 0);
 
-    /* Collapse intermediate whitespaces, and skip trailing whitespaces */
-    blank = 0;
-    while (*source) {
-        if (IS_BLANK_CH(*source)) {
-	    blank = 1;
-        } else {
-            if (blank) {
-                *target++ = 0x20;
-                blank = 0;
-            }
-            *target++ = *source;
-        }
-        source++;
+	SKIP_BLANKS;
     }
-    *target = 0;
 }
 
 /**
- * Implement the translate() XPath function
- *    string translate(string, string, string)
- * The translate function returns the first argument string with
- * occurrences of characters in the second argument string replaced
- * by the character at the corresponding position in the third argument
- * string. For example, translate("bar","abc","ABC") returns the string
- * BAr. If there is a character in the second argument string with no
- * character at a corresponding position in the third argument string
- * (because the second argument string is longer than the third argument
- * string), then occurrences of that character in the first argument
- * string are removed. For example,
- * translate("--aaa--","abc-","ABC") returns "AAA".
- * If a character occurs more than once in second
- * argument string, then the first occurrence determines the replacement
- * character. If the third argument string is longer than the second
- * argument string, then excess characters are ignored.
+ *  [27]   UnaryExpr ::=   UnionExpr
+ *                   | '-' UnaryExpr
+ *
+ * Compile an unary expression.
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
  */
-void
-xmlXPathTranslateFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlXPathObjectPtr str = NULL;
-    xmlXPathObjectPtr from = NULL;
-    xmlXPathObjectPtr to = NULL;
-    xmlBufPtr target;
-    int offset, max;
-    int ch;
-    const xmlChar *point;
-    xmlChar *cptr, *content;
-
-    CHECK_ARITY(3);
-
-    CAST_TO_STRING;
-    to = xmlXPathValuePop(ctxt);
-    CAST_TO_STRING;
-    from = xmlXPathValuePop(ctxt);
-    CAST_TO_STRING;
-    str = xmlXPathValuePop(ctxt);
-    if (ctxt->error != 0)
-        goto error;
-
-    /*
-     * Account for quadratic runtime
-     */
-    if (ctxt->context->opLimit != 0) {
-        unsigned long f1 = xmlStrlen(from->stringval);
-        unsigned long f2 = xmlStrlen(str->stringval);
 
-        if ((f1 > 0) && (f2 > 0)) {
-            unsigned long p;
+static void
+xmlXPathCompUnaryExpr(xmlXPathParserContextPtr ctxt) {
+    int minus = 0;
+    int found = 0;
 
-            f1 = f1 / 10 + 1;
-            f2 = f2 / 10 + 1;
-            p = f1 > ULONG_MAX / f2 ? ULONG_MAX : f1 * f2;
-            if (xmlXPathCheckOpLimit(ctxt, p) < 0)
-                goto error;
-        }
+    SKIP_BLANKS;
+    while (CUR == '-') {
+        minus = 1 - minus;
+	found = 1;
+	NEXT;
+	SKIP_BLANKS;
     }
 
-    target = xmlBufCreate(50);
-    if (target == NULL) {
-        xmlXPathPErrMemory(ctxt);
-        goto error;
+    xmlXPathCompUnionExpr(ctxt);
+    CHECK_ERROR;
+    if (found) {
+	if (minus)
+	    PUSH_UNARY_EXPR(XPATH_OP_PLUS, ctxt->comp->last, 2, 0);
+	else
+	    PUSH_UNARY_EXPR(XPATH_OP_PLUS, ctxt->comp->last, 3, 0);
     }
+}
 
-    max = xmlUTF8Strlen(to->stringval);
-    for (cptr = str->stringval; (ch=*cptr); ) {
-        offset = xmlUTF8Strloc(from->stringval, cptr);
-        if (offset >= 0) {
-            if (offset < max) {
-                point = xmlUTF8Strpos(to->stringval, offset);
-                if (point)
-                    xmlBufAdd(target, point, xmlUTF8Strsize(point, 1));
-            }
-        } else
-            xmlBufAdd(target, cptr, xmlUTF8Strsize(cptr, 1));
+/**
+ *  [26]   MultiplicativeExpr ::=   UnaryExpr
+ *                   | MultiplicativeExpr MultiplyOperator UnaryExpr
+ *                   | MultiplicativeExpr 'div' UnaryExpr
+ *                   | MultiplicativeExpr 'mod' UnaryExpr
+ *  [34]   MultiplyOperator ::=   '*'
+ *
+ * Compile an Additive expression.
+ *
+ * @param ctxt  the XPath Parser context
+ */
 
-        /* Step to next character in input */
-        cptr++;
-        if ( ch & 0x80 ) {
-            /* if not simple ascii, verify proper format */
-            if ( (ch & 0xc0) != 0xc0 ) {
-                xmlXPathErr(ctxt, XPATH_INVALID_CHAR_ERROR);
-                break;
-            }
-            /* then skip over remaining bytes for this char */
-            while ( (ch <<= 1) & 0x80 )
-                if ( (*cptr++ & 0xc0) != 0x80 ) {
-                    xmlXPathErr(ctxt, XPATH_INVALID_CHAR_ERROR);
-                    break;
-                }
-            if (ch & 0x80) /* must have had error encountered */
-                break;
-        }
-    }
+static void
+xmlXPathCompMultiplicativeExpr(xmlXPathParserContextPtr ctxt) {
+    xmlXPathCompUnaryExpr(ctxt);
+    CHECK_ERROR;
+    SKIP_BLANKS;
+    while ((CUR == '*') ||
+           ((CUR == 'd') && (NXT(1) == 'i') && (NXT(2) == 'v')) ||
+           ((CUR == 'm') && (NXT(1) == 'o') && (NXT(2) == 'd'))) {
+	int op = -1;
+	int op1 = ctxt->comp->last;
 
-    content = xmlBufDetach(target);
-    if (content == NULL)
-        xmlXPathPErrMemory(ctxt);
-    else
-        xmlXPathValuePush(ctxt, xmlXPathCacheWrapString(ctxt, content));
-    xmlBufFree(target);
-error:
-    xmlXPathReleaseObject(ctxt->context, str);
-    xmlXPathReleaseObject(ctxt->context, from);
-    xmlXPathReleaseObject(ctxt->context, to);
+        if (CUR == '*') {
+	    op = 0;
+	    NEXT;
+	} else if (CUR == 'd') {
+	    op = 1;
+	    SKIP(3);
+	} else if (CUR == 'm') {
+	    op = 2;
+	    SKIP(3);
+	}
+	SKIP_BLANKS;
+        xmlXPathCompUnaryExpr(ctxt);
+	CHECK_ERROR;
+	PUSH_BINARY_EXPR(XPATH_OP_MULT, op1, ctxt->comp->last, op, 0);
+	SKIP_BLANKS;
+    }
 }
 
 /**
- * Implement the boolean() XPath function
- *    boolean boolean(object)
- * The boolean function converts its argument to a boolean as follows:
- *    - a number is true if and only if it is neither positive or
- *      negative zero nor NaN
- *    - a node-set is true if and only if it is non-empty
- *    - a string is true if and only if its length is non-zero
+ *  [25]   AdditiveExpr ::=   MultiplicativeExpr
+ *                   | AdditiveExpr '+' MultiplicativeExpr
+ *                   | AdditiveExpr '-' MultiplicativeExpr
+ *
+ * Compile an Additive expression.
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
  */
-void
-xmlXPathBooleanFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlXPathObjectPtr cur;
 
-    CHECK_ARITY(1);
-    cur = xmlXPathValuePop(ctxt);
-    if (cur == NULL) XP_ERROR(XPATH_INVALID_OPERAND);
-    if (cur->type != XPATH_BOOLEAN) {
-        int boolval = xmlXPathCastToBoolean(cur);
+static void
+xmlXPathCompAdditiveExpr(xmlXPathParserContextPtr ctxt) {
 
-        xmlXPathReleaseObject(ctxt->context, cur);
-        cur = xmlXPathCacheNewBoolean(ctxt, boolval);
+    xmlXPathCompMultiplicativeExpr(ctxt);
+    CHECK_ERROR;
+    SKIP_BLANKS;
+    while ((CUR == '+') || (CUR == '-')) {
+	int plus;
+	int op1 = ctxt->comp->last;
+
+        if (CUR == '+') plus = 1;
+	else plus = 0;
+	NEXT;
+	SKIP_BLANKS;
+        xmlXPathCompMultiplicativeExpr(ctxt);
+	CHECK_ERROR;
+	PUSH_BINARY_EXPR(XPATH_OP_PLUS, op1, ctxt->comp->last, plus, 0);
+	SKIP_BLANKS;
     }
-    xmlXPathValuePush(ctxt, cur);
 }
 
 /**
- * Implement the not() XPath function
- *    boolean not(boolean)
- * The not function returns true if its argument is false,
- * and false otherwise.
+ *  [24]   RelationalExpr ::=   AdditiveExpr
+ *                 | RelationalExpr '<' AdditiveExpr
+ *                 | RelationalExpr '>' AdditiveExpr
+ *                 | RelationalExpr '<=' AdditiveExpr
+ *                 | RelationalExpr '>=' AdditiveExpr
+ *
+ *  A <= B > C is allowed ? Answer from James, yes with
+ *  (AdditiveExpr <= AdditiveExpr) > AdditiveExpr
+ *  which is basically what got implemented.
+ *
+ * Compile a Relational expression, then push the result
+ * on the stack
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
  */
-void
-xmlXPathNotFunction(xmlXPathParserContext *ctxt, int nargs) {
-    CHECK_ARITY(1);
-    CAST_TO_BOOLEAN;
-    CHECK_TYPE(XPATH_BOOLEAN);
-    ctxt->value->boolval = ! ctxt->value->boolval;
+
+static void
+xmlXPathCompRelationalExpr(xmlXPathParserContextPtr ctxt) {
+    xmlXPathCompAdditiveExpr(ctxt);
+    CHECK_ERROR;
+    SKIP_BLANKS;
+    while ((CUR == '<') || (CUR == '>')) {
+	int inf, strict;
+	int op1 = ctxt->comp->last;
+
+        if (CUR == '<') inf = 1;
+	else inf = 0;
+	if (NXT(1) == '=') strict = 0;
+	else strict = 1;
+	NEXT;
+	if (!strict) NEXT;
+	SKIP_BLANKS;
+        xmlXPathCompAdditiveExpr(ctxt);
+	CHECK_ERROR;
+	PUSH_BINARY_EXPR(XPATH_OP_CMP, op1, ctxt->comp->last, inf, strict);
+	SKIP_BLANKS;
+    }
 }
 
 /**
- * Implement the true() XPath function
- *    boolean true()
+ *  [23]   EqualityExpr ::=   RelationalExpr
+ *                 | EqualityExpr '=' RelationalExpr
+ *                 | EqualityExpr '!=' RelationalExpr
  *
- * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
- */
-void
-xmlXPathTrueFunction(xmlXPathParserContext *ctxt, int nargs) {
-    CHECK_ARITY(0);
-    xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, 1));
-}
-
-/**
- * Implement the false() XPath function
- *    boolean false()
+ *  A != B != C is allowed ? Answer from James, yes with
+ *  (RelationalExpr = RelationalExpr) = RelationalExpr
+ *  (RelationalExpr != RelationalExpr) != RelationalExpr
+ *  which is basically what got implemented.
+ *
+ * Compile an Equality expression.
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
  */
-void
-xmlXPathFalseFunction(xmlXPathParserContext *ctxt, int nargs) {
-    CHECK_ARITY(0);
-    xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, 0));
+static void
+xmlXPathCompEqualityExpr(xmlXPathParserContextPtr ctxt) {
+    xmlXPathCompRelationalExpr(ctxt);
+    CHECK_ERROR;
+    SKIP_BLANKS;
+    while ((CUR == '=') || ((CUR == '!') && (NXT(1) == '='))) {
+	int eq;
+	int op1 = ctxt->comp->last;
+
+        if (CUR == '=') eq = 1;
+	else eq = 0;
+	NEXT;
+	if (!eq) NEXT;
+	SKIP_BLANKS;
+        xmlXPathCompRelationalExpr(ctxt);
+	CHECK_ERROR;
+	PUSH_BINARY_EXPR(XPATH_OP_EQUAL, op1, ctxt->comp->last, eq, 0);
+	SKIP_BLANKS;
+    }
 }
 
 /**
- * Implement the lang() XPath function
- *    boolean lang(string)
- * The lang function returns true or false depending on whether the
- * language of the context node as specified by xml:lang attributes
- * is the same as or is a sublanguage of the language specified by
- * the argument string. The language of the context node is determined
- * by the value of the xml:lang attribute on the context node, or, if
- * the context node has no xml:lang attribute, by the value of the
- * xml:lang attribute on the nearest ancestor of the context node that
- * has an xml:lang attribute. If there is no such attribute, then
- * lang returns false. If there is such an attribute, then lang returns
- * true if the attribute value is equal to the argument ignoring case,
- * or if there is some suffix starting with - such that the attribute
- * value is equal to the argument ignoring that suffix of the attribute
- * value and ignoring case.
+ *  [22]   AndExpr ::=   EqualityExpr
+ *                 | AndExpr 'and' EqualityExpr
+ *
+ * Compile an AND expression.
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
  */
-void
-xmlXPathLangFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlXPathObjectPtr val;
-    xmlNodePtr cur;
-    xmlChar *theLang;
-    const xmlChar *lang;
-    int ret = 0;
-    int i;
-
-    CHECK_ARITY(1);
-    CAST_TO_STRING;
-    CHECK_TYPE(XPATH_STRING);
-    val = xmlXPathValuePop(ctxt);
-    lang = val->stringval;
-    cur = ctxt->context->node;
-    while (cur != NULL) {
-        if (xmlNodeGetAttrValue(cur, BAD_CAST "lang", XML_XML_NAMESPACE,
-                                &theLang) < 0)
-            xmlXPathPErrMemory(ctxt);
-        if (theLang != NULL)
-            break;
-        cur = cur->parent;
-    }
-    if ((theLang != NULL) && (lang != NULL)) {
-        for (i = 0;lang[i] != 0;i++)
-            if (toupper(lang[i]) != toupper(theLang[i]))
-                goto not_equal;
-        if ((theLang[i] == 0) || (theLang[i] == '-'))
-            ret = 1;
+static void
+xmlXPathCompAndExpr(xmlXPathParserContextPtr ctxt) {
+    xmlXPathCompEqualityExpr(ctxt);
+    CHECK_ERROR;
+    SKIP_BLANKS;
+    while ((CUR == 'a') && (NXT(1) == 'n') && (NXT(2) == 'd')) {
+	int op1 = ctxt->comp->last;
+        SKIP(3);
+	SKIP_BLANKS;
+        xmlXPathCompEqualityExpr(ctxt);
+	CHECK_ERROR;
+	PUSH_BINARY_EXPR(XPATH_OP_AND, op1, ctxt->comp->last, 0, 0);
+	SKIP_BLANKS;
     }
-not_equal:
-    if (theLang != NULL)
-	xmlFree((void *)theLang);
-
-    xmlXPathReleaseObject(ctxt->context, val);
-    xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, ret));
 }
 
 /**
- * Implement the number() XPath function
- *    number number(object?)
+ *  [14]   Expr ::=   OrExpr
+ *  [21]   OrExpr ::=   AndExpr
+ *                 | OrExpr 'or' AndExpr
+ *
+ * Parse and compile an expression
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
+ * @param sort  whether to sort the resulting node set
  */
-void
-xmlXPathNumberFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlXPathObjectPtr cur;
-    double res;
-
-    if (ctxt == NULL) return;
-    if (nargs == 0) {
-	if (ctxt->context->node == NULL) {
-	    xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt, 0.0));
-	} else {
-	    xmlChar* content = xmlNodeGetContent(ctxt->context->node);
-            if (content == NULL)
-                xmlXPathPErrMemory(ctxt);
+static void
+xmlXPathCompileExpr(xmlXPathParserContextPtr ctxt, int sort) {
+    xmlXPathContextPtr xpctxt = ctxt->context;
 
-	    res = xmlXPathStringEvalNumber(content);
-	    xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt, res));
-	    xmlFree(content);
-	}
-	return;
+    if (xpctxt != NULL) {
+        if (xpctxt->depth >= XPATH_MAX_RECURSION_DEPTH)
+            XP_ERROR(XPATH_RECURSION_LIMIT_EXCEEDED);
+        /*
+         * Parsing a single '(' pushes about 10 functions on the call stack
+         * before recursing!
+         */
+        xpctxt->depth += 10;
     }
 
-    CHECK_ARITY(1);
-    cur = xmlXPathValuePop(ctxt);
-    if (cur->type != XPATH_NUMBER) {
-        double floatval;
-
-        floatval = xmlXPathCastToNumberInternal(ctxt, cur);
-        xmlXPathReleaseObject(ctxt->context, cur);
-        cur = xmlXPathCacheNewFloat(ctxt, floatval);
+    xmlXPathCompAndExpr(ctxt);
+    CHECK_ERROR;
+    SKIP_BLANKS;
+    while ((CUR == 'o') && (NXT(1) == 'r')) {
+	int op1 = ctxt->comp->last;
+        SKIP(2);
+	SKIP_BLANKS;
+        xmlXPathCompAndExpr(ctxt);
+	CHECK_ERROR;
+	PUSH_BINARY_EXPR(XPATH_OP_OR, op1, ctxt->comp->last, 0, 0);
+	SKIP_BLANKS;
     }
-    xmlXPathValuePush(ctxt, cur);
+    if ((sort) && (ctxt->comp->steps[ctxt->comp->last].op != XPATH_OP_VALUE)) {
+	/* more ops could be optimized too */
+	/*
+	* This is the main place to eliminate sorting for
+	* operations which don't require a sorted node-set.
+	* E.g. count().
+	*/
+	PUSH_UNARY_EXPR(XPATH_OP_SORT, ctxt->comp->last , 0, 0);
+    }
+
+    if (xpctxt != NULL)
+        xpctxt->depth -= 10;
 }
 
 /**
- * Implement the sum() XPath function
- *    number sum(node-set)
- * The sum function returns the sum of the values of the nodes in
- * the argument node-set.
+ *  [8]   Predicate ::=   '[' PredicateExpr ']'
+ *  [9]   PredicateExpr ::=   Expr
+ *
+ * Compile a predicate expression
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
+ * @param filter  act as a filter
  */
-void
-xmlXPathSumFunction(xmlXPathParserContext *ctxt, int nargs) {
-    xmlXPathObjectPtr cur;
-    int i;
-    double res = 0.0;
-
-    CHECK_ARITY(1);
-    if ((ctxt->value == NULL) ||
-	((ctxt->value->type != XPATH_NODESET) &&
-	 (ctxt->value->type != XPATH_XSLT_TREE)))
-	XP_ERROR(XPATH_INVALID_TYPE);
-    cur = xmlXPathValuePop(ctxt);
+static void
+xmlXPathCompPredicate(xmlXPathParserContextPtr ctxt, int filter) {
+    int op1 = ctxt->comp->last;
 
-    if ((cur->nodesetval != NULL) && (cur->nodesetval->nodeNr != 0)) {
-	for (i = 0; i < cur->nodesetval->nodeNr; i++) {
-	    res += xmlXPathNodeToNumberInternal(ctxt,
-                                                cur->nodesetval->nodeTab[i]);
-	}
+    SKIP_BLANKS;
+    if (CUR != '[') {
+	XP_ERROR(XPATH_INVALID_PREDICATE_ERROR);
     }
-    xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt, res));
-    xmlXPathReleaseObject(ctxt->context, cur);
-}
+    NEXT;
+    SKIP_BLANKS;
 
-/**
- * Implement the floor() XPath function
- *    number floor(number)
- * The floor function returns the largest (closest to positive infinity)
- * number that is not greater than the argument and that is an integer.
- *
- * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
- */
-void
-xmlXPathFloorFunction(xmlXPathParserContext *ctxt, int nargs) {
-    CHECK_ARITY(1);
-    CAST_TO_NUMBER;
-    CHECK_TYPE(XPATH_NUMBER);
+    ctxt->comp->last = -1;
+    /*
+    * This call to xmlXPathCompileExpr() will deactivate sorting
+    * of the predicate result.
+    * TODO: Sorting is still activated for filters, since I'm not
+    *  sure if needed. Normally sorting should not be needed, since
+    *  a filter can only diminish the number of items in a sequence,
+    *  but won't change its order; so if the initial sequence is sorted,
+    *  subsequent sorting is not needed.
+    */
+    if (! filter)
+	xmlXPathCompileExpr(ctxt, 0);
+    else
+	xmlXPathCompileExpr(ctxt, 1);
+    CHECK_ERROR;
 
-    ctxt->value->floatval = floor(ctxt->value->floatval);
-}
+    if (CUR != ']') {
+	XP_ERROR(XPATH_INVALID_PREDICATE_ERROR);
+    }
 
-/**
- * Implement the ceiling() XPath function
- *    number ceiling(number)
- * The ceiling function returns the smallest (closest to negative infinity)
- * number that is not less than the argument and that is an integer.
- *
- * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
- */
-void
-xmlXPathCeilingFunction(xmlXPathParserContext *ctxt, int nargs) {
-    CHECK_ARITY(1);
-    CAST_TO_NUMBER;
-    CHECK_TYPE(XPATH_NUMBER);
+    if (filter)
+	PUSH_BINARY_EXPR(XPATH_OP_FILTER, op1, ctxt->comp->last, 0, 0);
+    else
+	PUSH_BINARY_EXPR(XPATH_OP_PREDICATE, op1, ctxt->comp->last, 0, 0);
 
-#ifdef _AIX
-    /* Work around buggy ceil() function on AIX */
-    ctxt->value->floatval = copysign(ceil(ctxt->value->floatval), ctxt->value->floatval);
-#else
-    ctxt->value->floatval = ceil(ctxt->value->floatval);
-#endif
+    NEXT;
+    SKIP_BLANKS;
 }
 
 /**
- * Implement the round() XPath function
- *    number round(number)
- * The round function returns the number that is closest to the
- * argument and that is an integer. If there are two such numbers,
- * then the one that is closest to positive infinity is returned.
+ * ```
+ * [7] NodeTest ::=   NameTest
+ *		    | NodeType '(' ')'
+ *		    | 'processing-instruction' '(' Literal ')'
+ *
+ * [37] NameTest ::=  '*'
+ *		    | NCName ':' '*'
+ *		    | QName
+ * [38] NodeType ::= 'comment'
+ *		   | 'text'
+ *		   | 'processing-instruction'
+ *		   | 'node'
+ * ```
  *
  * @param ctxt  the XPath Parser context
- * @param nargs  the number of arguments
+ * @param test  pointer to a xmlXPathTestVal
+ * @param type  pointer to a xmlXPathTypeVal
+ * @param prefix  placeholder for a possible name prefix
+ * @param name  current name token (optional)
+ * @returns the name found and updates `test`, `type` and `prefix` appropriately
  */
-void
-xmlXPathRoundFunction(xmlXPathParserContext *ctxt, int nargs) {
-    double f;
-
-    CHECK_ARITY(1);
-    CAST_TO_NUMBER;
-    CHECK_TYPE(XPATH_NUMBER);
+static xmlChar *
+xmlXPathCompNodeTest(xmlXPathParserContextPtr ctxt, xmlXPathTestVal *test,
+	             xmlXPathTypeVal *type, xmlChar **prefix,
+		     xmlChar *name) {
+    int blanks;
 
-    f = ctxt->value->floatval;
+    if ((test == NULL) || (type == NULL) || (prefix == NULL)) {
+	return(NULL);
+    }
+    *type = (xmlXPathTypeVal) 0;
+    *test = (xmlXPathTestVal) 0;
+    *prefix = NULL;
+    SKIP_BLANKS;
 
-    if ((f >= -0.5) && (f < 0.5)) {
-        /* Handles negative zero. */
-        ctxt->value->floatval *= 0.0;
+    if ((name == NULL) && (CUR == '*')) {
+	/*
+	 * All elements
+	 */
+	NEXT;
+	*test = NODE_TEST_ALL;
+	return(NULL);
     }
-    else {
-        double rounded = floor(f);
-        if (f - rounded >= 0.5)
-            rounded += 1.0;
-        ctxt->value->floatval = rounded;
+
+    if (name == NULL)
+	name = xmlXPathParseNCName(ctxt);
+    if (name == NULL) {
+	XP_ERRORNULL(XPATH_EXPR_ERROR);
     }
-}
 
-/************************************************************************
- *									*
- *			The Parser					*
- *									*
- ************************************************************************/
+    blanks = IS_BLANK_CH(CUR);
+    SKIP_BLANKS;
+    if (CUR == '(') {
+	NEXT;
+	/*
+	 * NodeType or PI search
+	 */
+	if (xmlStrEqual(name, BAD_CAST "comment"))
+	    *type = NODE_TYPE_COMMENT;
+	else if (xmlStrEqual(name, BAD_CAST "node"))
+	    *type = NODE_TYPE_NODE;
+	else if (xmlStrEqual(name, BAD_CAST "processing-instruction"))
+	    *type = NODE_TYPE_PI;
+	else if (xmlStrEqual(name, BAD_CAST "text"))
+	    *type = NODE_TYPE_TEXT;
+	else {
+	    if (name != NULL)
+		xmlFree(name);
+	    XP_ERRORNULL(XPATH_EXPR_ERROR);
+	}
 
-/*
- * a few forward declarations since we use a recursive call based
- * implementation.
- */
-static void xmlXPathCompileExpr(xmlXPathParserContextPtr ctxt, int sort);
-static void xmlXPathCompPredicate(xmlXPathParserContextPtr ctxt, int filter);
-static void xmlXPathCompLocationPath(xmlXPathParserContextPtr ctxt);
-static void xmlXPathCompRelativeLocationPath(xmlXPathParserContextPtr ctxt);
+	*test = NODE_TEST_TYPE;
 
-/**
- * Parse an XML non-colonized name.
- *
- * @param ctxt  the XPath Parser context
- * @returns the nc name or NULL
- */
+	SKIP_BLANKS;
+	if (*type == NODE_TYPE_PI) {
+	    /*
+	     * Specific case: search a PI by name.
+	     */
+	    if (name != NULL)
+		xmlFree(name);
+	    name = NULL;
+	    if (CUR != ')') {
+		name = xmlXPathParseLiteral(ctxt);
+		*test = NODE_TEST_PI;
+		SKIP_BLANKS;
+	    }
+	}
+	if (CUR != ')') {
+	    if (name != NULL)
+		xmlFree(name);
+	    XP_ERRORNULL(XPATH_UNCLOSED_ERROR);
+	}
+	NEXT;
+	return(name);
+    }
+    *test = NODE_TEST_NAME;
+    if ((!blanks) && (CUR == ':')) {
+	NEXT;
 
-xmlChar *
-xmlXPathParseNCName(xmlXPathParserContext *ctxt) {
-    const xmlChar *end;
-    xmlChar *ret;
+	/*
+	 * Since currently the parser context don't have a
+	 * namespace list associated:
+	 * The namespace name for this prefix can be computed
+	 * only at evaluation time. The compilation is done
+	 * outside of any context.
+	 */
+	*prefix = name;
 
-    if ((ctxt == NULL) || (ctxt->cur == NULL)) return(NULL);
+	if (CUR == '*') {
+	    /*
+	     * All elements
+	     */
+	    NEXT;
+	    *test = NODE_TEST_ALL;
+	    return(NULL);
+	}
 
-    end = xmlScanName(ctxt->cur, XML_MAX_NAME_LENGTH, XML_SCAN_NC);
-    if (end == NULL) {
-        XP_ERRORNULL(XPATH_EXPR_ERROR);
+	name = xmlXPathParseNCName(ctxt);
+	if (name == NULL) {
+	    XP_ERRORNULL(XPATH_EXPR_ERROR);
+	}
     }
-    if (end == ctxt->cur)
-        return(NULL);
+    return(name);
+}
 
-    ret = xmlStrndup(ctxt->cur, end - ctxt->cur);
-    if (ret == NULL)
-        xmlXPathPErrMemory(ctxt);
-    ctxt->cur = end;
+/**
+ * [6] AxisName ::=   'ancestor'
+ *                  | 'ancestor-or-self'
+ *                  | 'attribute'
+ *                  | 'child'
+ *                  | 'descendant'
+ *                  | 'descendant-or-self'
+ *                  | 'following'
+ *                  | 'following-sibling'
+ *                  | 'namespace'
+ *                  | 'parent'
+ *                  | 'preceding'
+ *                  | 'preceding-sibling'
+ *                  | 'self'
+ *
+ * @param name  a preparsed name token
+ * @returns the axis or 0
+ */
+static xmlXPathAxisVal
+xmlXPathIsAxisName(const xmlChar *name) {
+    xmlXPathAxisVal ret = (xmlXPathAxisVal) 0;
+    switch (name[0]) {
+	case 'a':
+	    if (xmlStrEqual(name, BAD_CAST "ancestor"))
+		ret = AXIS_ANCESTOR;
+	    if (xmlStrEqual(name, BAD_CAST "ancestor-or-self"))
+		ret = AXIS_ANCESTOR_OR_SELF;
+	    if (xmlStrEqual(name, BAD_CAST "attribute"))
+		ret = AXIS_ATTRIBUTE;
+	    break;
+	case 'c':
+	    if (xmlStrEqual(name, BAD_CAST "child"))
+		ret = AXIS_CHILD;
+	    break;
+	case 'd':
+	    if (xmlStrEqual(name, BAD_CAST "descendant"))
+		ret = AXIS_DESCENDANT;
+	    if (xmlStrEqual(name, BAD_CAST "descendant-or-self"))
+		ret = AXIS_DESCENDANT_OR_SELF;
+	    break;
+	case 'f':
+	    if (xmlStrEqual(name, BAD_CAST "following"))
+		ret = AXIS_FOLLOWING;
+	    if (xmlStrEqual(name, BAD_CAST "following-sibling"))
+		ret = AXIS_FOLLOWING_SIBLING;
+	    break;
+	case 'n':
+	    if (xmlStrEqual(name, BAD_CAST "namespace"))
+		ret = AXIS_NAMESPACE;
+	    break;
+	case 'p':
+	    if (xmlStrEqual(name, BAD_CAST "parent"))
+		ret = AXIS_PARENT;
+	    if (xmlStrEqual(name, BAD_CAST "preceding"))
+		ret = AXIS_PRECEDING;
+	    if (xmlStrEqual(name, BAD_CAST "preceding-sibling"))
+		ret = AXIS_PRECEDING_SIBLING;
+	    break;
+	case 's':
+	    if (xmlStrEqual(name, BAD_CAST "self"))
+		ret = AXIS_SELF;
+	    break;
+    }
     return(ret);
 }
 
-
 /**
- * Parse an XML qualified name
+ * [4] Step ::=   AxisSpecifier NodeTest Predicate*
+ *                  | AbbreviatedStep
+ *
+ * [12] AbbreviatedStep ::=   '.' | '..'
+ *
+ * [5] AxisSpecifier ::= AxisName '::'
+ *                  | AbbreviatedAxisSpecifier
+ *
+ * [13] AbbreviatedAxisSpecifier ::= '@'?
+ *
+ * Modified for XPtr range support as:
+ *
+ *  [4xptr] Step ::= AxisSpecifier NodeTest Predicate*
+ *                     | AbbreviatedStep
+ *                     | 'range-to' '(' Expr ')' Predicate*
+ *
+ * Compile one step in a Location Path
  *
  * @param ctxt  the XPath Parser context
- * @param prefix  a xmlChar **
- * @returns the function returns the local part, and prefix is updated
- *   to get the Prefix if any.
  */
+static void
+xmlXPathCompStep(xmlXPathParserContextPtr ctxt) {
+    SKIP_BLANKS;
+    if ((CUR == '.') && (NXT(1) == '.')) {
+	SKIP(2);
+	SKIP_BLANKS;
+	PUSH_LONG_EXPR(XPATH_OP_COLLECT, AXIS_PARENT,
+		    NODE_TEST_TYPE, NODE_TYPE_NODE, NULL, NULL);
+    } else if (CUR == '.') {
+	NEXT;
+	SKIP_BLANKS;
+    } else {
+	xmlChar *name = NULL;
+	xmlChar *prefix = NULL;
+	xmlXPathTestVal test = (xmlXPathTestVal) 0;
+	xmlXPathAxisVal axis = (xmlXPathAxisVal) 0;
+	xmlXPathTypeVal type = (xmlXPathTypeVal) 0;
+	int op1;
 
-static xmlChar *
-xmlXPathParseQName(xmlXPathParserContextPtr ctxt, xmlChar **prefix) {
-    xmlChar *ret = NULL;
+	if (CUR == '*') {
+	    axis = AXIS_CHILD;
+	} else {
+	    if (name == NULL)
+		name = xmlXPathParseNCName(ctxt);
+	    if (name != NULL) {
+		axis = xmlXPathIsAxisName(name);
+		if (axis != 0) {
+		    SKIP_BLANKS;
+		    if ((CUR == ':') && (NXT(1) == ':')) {
+			SKIP(2);
+			xmlFree(name);
+			name = NULL;
+		    } else {
+			/* an element name can conflict with an axis one :-\ */
+			axis = AXIS_CHILD;
+		    }
+		} else {
+		    axis = AXIS_CHILD;
+		}
+	    } else if (CUR == '@') {
+		NEXT;
+		axis = AXIS_ATTRIBUTE;
+	    } else {
+		axis = AXIS_CHILD;
+	    }
+	}
 
-    *prefix = NULL;
-    ret = xmlXPathParseNCName(ctxt);
-    if (ret && CUR == ':') {
-        *prefix = ret;
-	NEXT;
-	ret = xmlXPathParseNCName(ctxt);
-    }
-    return(ret);
-}
+        if (ctxt->error != XPATH_EXPRESSION_OK) {
+            xmlFree(name);
+            return;
+        }
 
-/**
- * parse an XML name
- *
- * @param ctxt  the XPath Parser context
- * @returns the name or NULL
- */
+	name = xmlXPathCompNodeTest(ctxt, &test, &type, &prefix, name);
+	if (test == 0)
+	    return;
 
-xmlChar *
-xmlXPathParseName(xmlXPathParserContext *ctxt) {
-    const xmlChar *end;
-    xmlChar *ret;
+        if ((prefix != NULL) && (ctxt->context != NULL) &&
+	    (ctxt->context->flags & XML_XPATH_CHECKNS)) {
+	    if (xmlXPathNsLookup(ctxt->context, prefix) == NULL) {
+		xmlXPathErrFmt(ctxt, XPATH_UNDEF_PREFIX_ERROR,
+                               "Undefined namespace prefix: %s\n", prefix);
+	    }
+	}
 
-    if ((ctxt == NULL) || (ctxt->cur == NULL)) return(NULL);
+	op1 = ctxt->comp->last;
+	ctxt->comp->last = -1;
 
-    end = xmlScanName(ctxt->cur, XML_MAX_NAME_LENGTH, 0);
-    if (end == NULL) {
-        XP_ERRORNULL(XPATH_EXPR_ERROR);
-    }
-    if (end == ctxt->cur)
-        return(NULL);
+	SKIP_BLANKS;
+	while (CUR == '[') {
+	    xmlXPathCompPredicate(ctxt, 0);
+	}
 
-    ret = xmlStrndup(ctxt->cur, end - ctxt->cur);
-    if (ret == NULL)
-        xmlXPathPErrMemory(ctxt);
-    ctxt->cur = end;
-    return(ret);
+        if (PUSH_FULL_EXPR(XPATH_OP_COLLECT, op1, ctxt->comp->last, axis,
+                           test, type, (void *)prefix, (void *)name) == -1) {
+            xmlFree(prefix);
+            xmlFree(name);
+        }
+    }
 }
 
-#define MAX_FRAC 20
-
 /**
- *  [30a]  Float  ::= Number ('e' Digits?)?
- *
- *  [30]   Number ::=   Digits ('.' Digits?)?
- *                    | '.' Digits
- *  [31]   Digits ::=   [0-9]+
+ *  [3]   RelativeLocationPath ::=   Step
+ *                     | RelativeLocationPath '/' Step
+ *                     | AbbreviatedRelativeLocationPath
+ *  [11]  AbbreviatedRelativeLocationPath ::=   RelativeLocationPath '//' Step
  *
- * Compile a Number in the string
- * In complement of the Number expression, this function also handles
- * negative values : '-' Number.
+ * Compile a relative location path.
  *
- * @param str  A string to scan
- * @returns the double value.
+ * @param ctxt  the XPath Parser context
  */
-double
-xmlXPathStringEvalNumber(const xmlChar *str) {
-    const xmlChar *cur = str;
-    double ret;
-    int ok = 0;
-    int isneg = 0;
-    int exponent = 0;
-    int is_exponent_negative = 0;
-#ifdef __GNUC__
-    unsigned long tmp = 0;
-    double temp;
-#endif
-    if (cur == NULL) return(0);
-    while (IS_BLANK_CH(*cur)) cur++;
-    if (*cur == '-') {
-	isneg = 1;
-	cur++;
-    }
-    if ((*cur != '.') && ((*cur < '0') || (*cur > '9'))) {
-        return(xmlXPathNAN);
-    }
-
-#ifdef __GNUC__
-    /*
-     * tmp/temp is a workaround against a gcc compiler bug
-     * http://veillard.com/gcc.bug
-     */
-    ret = 0;
-    while ((*cur >= '0') && (*cur <= '9')) {
-	ret = ret * 10;
-	tmp = (*cur - '0');
-	ok = 1;
-	cur++;
-	temp = (double) tmp;
-	ret = ret + temp;
-    }
-#else
-    ret = 0;
-    while ((*cur >= '0') && (*cur <= '9')) {
-	ret = ret * 10 + (*cur - '0');
-	ok = 1;
-	cur++;
-    }
-#endif
-
-    if (*cur == '.') {
-	int v, frac = 0, max;
-	double fraction = 0;
-
-        cur++;
-	if (((*cur < '0') || (*cur > '9')) && (!ok)) {
-	    return(xmlXPathNAN);
-	}
-        while (*cur == '0') {
-	    frac = frac + 1;
-	    cur++;
-        }
-        max = frac + MAX_FRAC;
-	while (((*cur >= '0') && (*cur <= '9')) && (frac < max)) {
-	    v = (*cur - '0');
-	    fraction = fraction * 10 + v;
-	    frac = frac + 1;
-	    cur++;
-	}
-	fraction /= pow(10.0, frac);
-	ret = ret + fraction;
-	while ((*cur >= '0') && (*cur <= '9'))
-	    cur++;
+static void
+xmlXPathCompRelativeLocationPath
+(xmlXPathParserContextPtr ctxt) {
+    SKIP_BLANKS;
+    if ((CUR == '/') && (NXT(1) == '/')) {
+	SKIP(2);
+	SKIP_BLANKS;
+	PUSH_LONG_EXPR(XPATH_OP_COLLECT, AXIS_DESCENDANT_OR_SELF,
+		         NODE_TEST_TYPE, NODE_TYPE_NODE, NULL, NULL);
+    } else if (CUR == '/') {
+	    NEXT;
+	SKIP_BLANKS;
     }
-    if ((*cur == 'e') || (*cur == 'E')) {
-      cur++;
-      if (*cur == '-') {
-	is_exponent_negative = 1;
-	cur++;
-      } else if (*cur == '+') {
-        cur++;
-      }
-      while ((*cur >= '0') && (*cur <= '9')) {
-        if (exponent < 1000000)
-	  exponent = exponent * 10 + (*cur - '0');
-	cur++;
-      }
+    xmlXPathCompStep(ctxt);
+    CHECK_ERROR;
+    SKIP_BLANKS;
+    while (CUR == '/') {
+	if ((CUR == '/') && (NXT(1) == '/')) {
+	    SKIP(2);
+	    SKIP_BLANKS;
+	    PUSH_LONG_EXPR(XPATH_OP_COLLECT, AXIS_DESCENDANT_OR_SELF,
+			     NODE_TEST_TYPE, NODE_TYPE_NODE, NULL, NULL);
+	    xmlXPathCompStep(ctxt);
+	} else if (CUR == '/') {
+	    NEXT;
+	    SKIP_BLANKS;
+	    xmlXPathCompStep(ctxt);
+	}
+	SKIP_BLANKS;
     }
-    while (IS_BLANK_CH(*cur)) cur++;
-    if (*cur != 0) return(xmlXPathNAN);
-    if (isneg) ret = -ret;
-    if (is_exponent_negative) exponent = -exponent;
-    ret *= pow(10.0, (double)exponent);
-    return(ret);
 }
 
 /**
- *  [30]   Number ::=   Digits ('.' Digits?)?
- *                    | '.' Digits
- *  [31]   Digits ::=   [0-9]+
+ *  [1]   LocationPath ::=   RelativeLocationPath
+ *                     | AbsoluteLocationPath
+ *  [2]   AbsoluteLocationPath ::=   '/' RelativeLocationPath?
+ *                     | AbbreviatedAbsoluteLocationPath
+ *  [10]   AbbreviatedAbsoluteLocationPath ::=
+ *                           '//' RelativeLocationPath
  *
- * Compile a Number, then push it on the stack
+ * Compile a location path
  *
  * @param ctxt  the XPath Parser context
  */
 static void
-xmlXPathCompNumber(xmlXPathParserContextPtr ctxt)
-{
-    double ret = 0.0;
-    int ok = 0;
-    int exponent = 0;
-    int is_exponent_negative = 0;
-    xmlXPathObjectPtr num;
-#ifdef __GNUC__
-    unsigned long tmp = 0;
-    double temp;
-#endif
-
-    CHECK_ERROR;
-    if ((CUR != '.') && ((CUR < '0') || (CUR > '9'))) {
-        XP_ERROR(XPATH_NUMBER_ERROR);
-    }
-#ifdef __GNUC__
-    /*
-     * tmp/temp is a workaround against a gcc compiler bug
-     * http://veillard.com/gcc.bug
-     */
-    ret = 0;
-    while ((CUR >= '0') && (CUR <= '9')) {
-	ret = ret * 10;
-	tmp = (CUR - '0');
-        ok = 1;
-        NEXT;
-	temp = (double) tmp;
-	ret = ret + temp;
-    }
-#else
-    ret = 0;
-    while ((CUR >= '0') && (CUR <= '9')) {
-	ret = ret * 10 + (CUR - '0');
-	ok = 1;
-	NEXT;
-    }
-#endif
-    if (CUR == '.') {
-	int v, frac = 0, max;
-	double fraction = 0;
-
-        NEXT;
-        if (((CUR < '0') || (CUR > '9')) && (!ok)) {
-            XP_ERROR(XPATH_NUMBER_ERROR);
-        }
-        while (CUR == '0') {
-            frac = frac + 1;
-            NEXT;
-        }
-        max = frac + MAX_FRAC;
-        while ((CUR >= '0') && (CUR <= '9') && (frac < max)) {
-	    v = (CUR - '0');
-	    fraction = fraction * 10 + v;
-	    frac = frac + 1;
-            NEXT;
-        }
-        fraction /= pow(10.0, frac);
-        ret = ret + fraction;
-        while ((CUR >= '0') && (CUR <= '9'))
-            NEXT;
-    }
-    if ((CUR == 'e') || (CUR == 'E')) {
-        NEXT;
-        if (CUR == '-') {
-            is_exponent_negative = 1;
-            NEXT;
-        } else if (CUR == '+') {
-	    NEXT;
+xmlXPathCompLocationPath(xmlXPathParserContextPtr ctxt) {
+    SKIP_BLANKS;
+    if (CUR != '/') {
+        xmlXPathCompRelativeLocationPath(ctxt);
+    } else {
+	while (CUR == '/') {
+	    if ((CUR == '/') && (NXT(1) == '/')) {
+		SKIP(2);
+		SKIP_BLANKS;
+		PUSH_LONG_EXPR(XPATH_OP_COLLECT, AXIS_DESCENDANT_OR_SELF,
+			     NODE_TEST_TYPE, NODE_TYPE_NODE, NULL, NULL);
+		xmlXPathCompRelativeLocationPath(ctxt);
+	    } else if (CUR == '/') {
+		NEXT;
+		SKIP_BLANKS;
+		if ((CUR != 0) &&
+		    ((IS_ASCII_LETTER(CUR)) || (CUR >= 0x80) ||
+                     (CUR == '_') || (CUR == '.') ||
+		     (CUR == '@') || (CUR == '*')))
+		    xmlXPathCompRelativeLocationPath(ctxt);
+	    }
+	    CHECK_ERROR;
 	}
-        while ((CUR >= '0') && (CUR <= '9')) {
-            if (exponent < 1000000)
-                exponent = exponent * 10 + (CUR - '0');
-            NEXT;
-        }
-        if (is_exponent_negative)
-            exponent = -exponent;
-        ret *= pow(10.0, (double) exponent);
-    }
-    num = xmlXPathCacheNewFloat(ctxt, ret);
-    if (num == NULL) {
-	ctxt->error = XPATH_MEMORY_ERROR;
-    } else if (PUSH_LONG_EXPR(XPATH_OP_VALUE, XPATH_NUMBER, 0, 0, num,
-                              NULL) == -1) {
-        xmlXPathReleaseObject(ctxt->context, num);
     }
 }
 
+/************************************************************************
+ *									*
+ *		XPath precompiled expression evaluation			*
+ *									*
+ ************************************************************************/
+
+static int
+xmlXPathCompOpEval(xmlXPathParserContextPtr ctxt, xmlXPathStepOpPtr op);
+
 /**
- * Parse a Literal
- *
- *  [29]   Literal ::=   '"' [^"]* '"'
- *                    | "'" [^']* "'"
+ * Filter a node set, keeping only nodes for which the predicate expression
+ * matches. Afterwards, keep only nodes between minPos and maxPos in the
+ * filtered result.
  *
  * @param ctxt  the XPath Parser context
- * @returns the value found or NULL in case of error
+ * @param set  the node set to filter
+ * @param filterOpIndex  the index of the predicate/filter op
+ * @param minPos  minimum position in the filtered set (1-based)
+ * @param maxPos  maximum position in the filtered set (1-based)
+ * @param hasNsNodes  true if the node set may contain namespace nodes
  */
-static xmlChar *
-xmlXPathParseLiteral(xmlXPathParserContextPtr ctxt) {
-    const xmlChar *q;
-    xmlChar *ret = NULL;
-    int quote;
+static void
+xmlXPathNodeSetFilter(xmlXPathParserContextPtr ctxt,
+		      xmlNodeSetPtr set,
+		      int filterOpIndex,
+                      int minPos, int maxPos,
+		      int hasNsNodes)
+{
+    xmlXPathContextPtr xpctxt;
+    xmlNodePtr oldnode;
+    xmlDocPtr olddoc;
+    xmlXPathStepOpPtr filterOp;
+    int oldcs, oldpp;
+    int i, j, pos;
 
-    if (CUR == '"') {
-        quote = '"';
-    } else if (CUR == '\'') {
-        quote = '\'';
-    } else {
-	XP_ERRORNULL(XPATH_START_LITERAL_ERROR);
+    if ((set == NULL) || (set->nodeNr == 0))
+        return;
+
+    /*
+    * Check if the node set contains a sufficient number of nodes for
+    * the requested range.
+    */
+    if (set->nodeNr < minPos) {
+        xmlXPathNodeSetClear(set, hasNsNodes);
+        return;
     }
 
-    NEXT;
-    q = CUR_PTR;
-    while (CUR != quote) {
-        int ch;
-        int len = 4;
+    xpctxt = ctxt->context;
+    oldnode = xpctxt->node;
+    olddoc = xpctxt->doc;
+    oldcs = xpctxt->contextSize;
+    oldpp = xpctxt->proximityPosition;
+    filterOp = &ctxt->comp->steps[filterOpIndex];
 
-        if (CUR == 0)
-            XP_ERRORNULL(XPATH_UNFINISHED_LITERAL_ERROR);
-        ch = xmlGetUTF8Char(CUR_PTR, &len);
-        if ((ch < 0) || (IS_CHAR(ch) == 0))
-            XP_ERRORNULL(XPATH_INVALID_CHAR_ERROR);
-        CUR_PTR += len;
+    xpctxt->contextSize = set->nodeNr;
+
+    for (i = 0, j = 0, pos = 1; i < set->nodeNr; i++) {
+        xmlNodePtr node = set->nodeTab[i];
+        int res;
+
+        xpctxt->node = node;
+        xpctxt->proximityPosition = i + 1;
+
+        /*
+        * Also set the xpath document in case things like
+        * key() are evaluated in the predicate.
+        *
+        * TODO: Get real doc for namespace nodes.
+        */
+        if ((node->type != XML_NAMESPACE_DECL) &&
+            (node->doc != NULL))
+            xpctxt->doc = node->doc;
+
+        res = xmlXPathCompOpEvalToBoolean(ctxt, filterOp, 1);
+
+        if (ctxt->error != XPATH_EXPRESSION_OK)
+            break;
+        if (res < 0) {
+            /* Shouldn't happen */
+            xmlXPathErr(ctxt, XPATH_EXPR_ERROR);
+            break;
+        }
+
+        if ((res != 0) && ((pos >= minPos) && (pos <= maxPos))) {
+            if (i != j) {
+                set->nodeTab[j] = node;
+                set->nodeTab[i] = NULL;
+            }
+
+            j += 1;
+        } else {
+            /* Remove the entry from the initial node set. */
+            set->nodeTab[i] = NULL;
+            if (node->type == XML_NAMESPACE_DECL)
+                xmlXPathNodeSetFreeNs((xmlNsPtr) node);
+        }
+
+        if (res != 0) {
+            if (pos == maxPos) {
+                i += 1;
+                break;
+            }
+
+            pos += 1;
+        }
+    }
+
+    /* Free remaining nodes. */
+    if (hasNsNodes) {
+        for (; i < set->nodeNr; i++) {
+            xmlNodePtr node = set->nodeTab[i];
+            if ((node != NULL) && (node->type == XML_NAMESPACE_DECL))
+                xmlXPathNodeSetFreeNs((xmlNsPtr) node);
+        }
     }
-    ret = xmlStrndup(q, CUR_PTR - q);
-    if (ret == NULL)
-        xmlXPathPErrMemory(ctxt);
-    NEXT;
-    return(ret);
-}
 
-/**
- * Parse a Literal and push it on the stack.
- *
- *  [29]   Literal ::=   '"' [^"]* '"'
- *                    | "'" [^']* "'"
- *
- * TODO: Memory allocation could be improved.
- *
- * @param ctxt  the XPath Parser context
- */
-static void
-xmlXPathCompLiteral(xmlXPathParserContextPtr ctxt) {
-    xmlChar *ret = NULL;
-    xmlXPathObjectPtr lit;
+    set->nodeNr = j;
 
-    ret = xmlXPathParseLiteral(ctxt);
-    if (ret == NULL)
-        return;
-    lit = xmlXPathCacheNewString(ctxt, ret);
-    if (lit == NULL) {
-        ctxt->error = XPATH_MEMORY_ERROR;
-    } else if (PUSH_LONG_EXPR(XPATH_OP_VALUE, XPATH_STRING, 0, 0, lit,
-                              NULL) == -1) {
-        xmlXPathReleaseObject(ctxt->context, lit);
+    /* If too many elements were removed, shrink table to preserve memory. */
+    if ((set->nodeMax > XML_NODESET_DEFAULT) &&
+        (set->nodeNr < set->nodeMax / 2)) {
+        xmlNodePtr *tmp;
+        int nodeMax = set->nodeNr;
+
+        if (nodeMax < XML_NODESET_DEFAULT)
+            nodeMax = XML_NODESET_DEFAULT;
+        tmp = (xmlNodePtr *) xmlRealloc(set->nodeTab,
+                nodeMax * sizeof(xmlNodePtr));
+        if (tmp == NULL) {
+            xmlXPathPErrMemory(ctxt);
+        } else {
+            set->nodeTab = tmp;
+            set->nodeMax = nodeMax;
+        }
     }
-    xmlFree(ret);
+
+    xpctxt->node = oldnode;
+    xpctxt->doc = olddoc;
+    xpctxt->contextSize = oldcs;
+    xpctxt->proximityPosition = oldpp;
 }
 
 /**
- * Parse a VariableReference, evaluate it and push it on the stack.
- *
- * The variable bindings consist of a mapping from variable names
- * to variable values. The value of a variable is an object, which can be
- * of any of the types that are possible for the value of an expression,
- * and may also be of additional types not specified here.
- *
- * Early evaluation is possible since:
- * The variable bindings [...] used to evaluate a subexpression are
- * always the same as those used to evaluate the containing expression.
+ * Filter a node set, keeping only nodes for which the sequence of predicate
+ * expressions matches. Afterwards, keep only nodes between minPos and maxPos
+ * in the filtered result.
  *
- *  [36]   VariableReference ::=   '$' QName
  * @param ctxt  the XPath Parser context
+ * @param op  the predicate op
+ * @param set  the node set to filter
+ * @param minPos  minimum position in the filtered set (1-based)
+ * @param maxPos  maximum position in the filtered set (1-based)
+ * @param hasNsNodes  true if the node set may contain namespace nodes
  */
 static void
-xmlXPathCompVariableReference(xmlXPathParserContextPtr ctxt) {
-    xmlChar *name;
-    xmlChar *prefix;
-
-    SKIP_BLANKS;
-    if (CUR != '$') {
-	XP_ERROR(XPATH_VARIABLE_REF_ERROR);
-    }
-    NEXT;
-    name = xmlXPathParseQName(ctxt, &prefix);
-    if (name == NULL) {
-        xmlFree(prefix);
-	XP_ERROR(XPATH_VARIABLE_REF_ERROR);
-    }
-    ctxt->comp->last = -1;
-    if (PUSH_LONG_EXPR(XPATH_OP_VARIABLE, 0, 0, 0, name, prefix) == -1) {
-        xmlFree(prefix);
-        xmlFree(name);
-    }
-    SKIP_BLANKS;
-    if ((ctxt->context != NULL) && (ctxt->context->flags & XML_XPATH_NOVAR)) {
-	XP_ERROR(XPATH_FORBID_VARIABLE_ERROR);
+xmlXPathCompOpEvalPredicate(xmlXPathParserContextPtr ctxt,
+			    xmlXPathStepOpPtr op,
+			    xmlNodeSetPtr set,
+                            int minPos, int maxPos,
+			    int hasNsNodes)
+{
+    if (op->ch1 != -1) {
+	xmlXPathCompExprPtr comp = ctxt->comp;
+	/*
+	* Process inner predicates first.
+	*/
+	if (comp->steps[op->ch1].op != XPATH_OP_PREDICATE) {
+            XP_ERROR(XPATH_INVALID_OPERAND);
+	}
+        if (ctxt->context->depth >= XPATH_MAX_RECURSION_DEPTH)
+            XP_ERROR(XPATH_RECURSION_LIMIT_EXCEEDED);
+        ctxt->context->depth += 1;
+	xmlXPathCompOpEvalPredicate(ctxt, &comp->steps[op->ch1], set,
+                                    1, set->nodeNr, hasNsNodes);
+        ctxt->context->depth -= 1;
+	CHECK_ERROR;
     }
+
+    if (op->ch2 != -1)
+        xmlXPathNodeSetFilter(ctxt, set, op->ch2, minPos, maxPos, hasNsNodes);
 }
 
-/**
- * Is the name given a NodeType one.
- *
- *  [38]   NodeType ::=   'comment'
- *                    | 'text'
- *                    | 'processing-instruction'
- *                    | 'node'
- *
- * @param name  a name string
- * @returns 1 if true 0 otherwise
- */
-int
-xmlXPathIsNodeType(const xmlChar *name) {
-    if (name == NULL)
+static int
+xmlXPathIsPositionalPredicate(xmlXPathParserContextPtr ctxt,
+			    xmlXPathStepOpPtr op,
+			    int *maxPos)
+{
+
+    xmlXPathStepOpPtr exprOp;
+
+    /*
+    * BIG NOTE: This is not intended for XPATH_OP_FILTER yet!
+    */
+
+    /*
+    * If not -1, then ch1 will point to:
+    * 1) For predicates (XPATH_OP_PREDICATE):
+    *    - an inner predicate operator
+    * 2) For filters (XPATH_OP_FILTER):
+    *    - an inner filter operator OR
+    *    - an expression selecting the node set.
+    *      E.g. "key('a', 'b')" or "(//foo | //bar)".
+    */
+    if ((op->op != XPATH_OP_PREDICATE) && (op->op != XPATH_OP_FILTER))
 	return(0);
 
-    if (xmlStrEqual(name, BAD_CAST "node"))
-	return(1);
-    if (xmlStrEqual(name, BAD_CAST "text"))
-	return(1);
-    if (xmlStrEqual(name, BAD_CAST "comment"))
-	return(1);
-    if (xmlStrEqual(name, BAD_CAST "processing-instruction"))
-	return(1);
+    if (op->ch2 != -1) {
+	exprOp = &ctxt->comp->steps[op->ch2];
+    } else
+	return(0);
+
+    if ((exprOp != NULL) &&
+	(exprOp->op == XPATH_OP_VALUE) &&
+	(exprOp->value4 != NULL) &&
+	(((xmlXPathObjectPtr) exprOp->value4)->type == XPATH_NUMBER))
+    {
+        double floatval = ((xmlXPathObjectPtr) exprOp->value4)->floatval;
+
+	/*
+	* We have a "[n]" predicate here.
+	* TODO: Unfortunately this simplistic test here is not
+	* able to detect a position() predicate in compound
+	* expressions like "[@attr = 'a" and position() = 1],
+	* and even not the usage of position() in
+	* "[position() = 1]"; thus - obviously - a position-range,
+	* like it "[position() < 5]", is also not detected.
+	* Maybe we could rewrite the AST to ease the optimization.
+	*/
+
+        if ((floatval > INT_MIN) && (floatval < INT_MAX)) {
+	    *maxPos = (int) floatval;
+            if (floatval == (double) *maxPos)
+                return(1);
+        }
+    }
     return(0);
 }
 
 /**
- *  [16]   FunctionCall ::=   FunctionName '(' ( Argument ( ',' Argument)*)? ')'
- *  [17]   Argument ::=   Expr
- *
- * Compile a function call, the evaluation of all arguments are
- * pushed on the stack
+ * Check whether a predicate compares an attribute of the context node
+ * with a string, like "[@name = 'value']" or "[@name = $var]", and
+ * has no inner predicates.
  *
- * @param ctxt  the XPath Parser context
+ * @param ctxt  the XPath parser context
+ * @param op  the predicate op
+ * @param valueOp  set to the op of the other operand
+ * @returns the op selecting the attribute or NULL.
  */
-static void
-xmlXPathCompFunctionCall(xmlXPathParserContextPtr ctxt) {
-    xmlChar *name;
-    xmlChar *prefix;
-    int nbargs = 0;
-    int sort = 1;
+static xmlXPathStepOpPtr
+xmlXPathAttrIndexPredicate(xmlXPathParserContextPtr ctxt,
+                           xmlXPathStepOpPtr op, xmlXPathStepOpPtr *valueOp) {
+    xmlXPathCompExprPtr comp = ctxt->comp;
+    xmlXPathStepOpPtr exprOp, attrOp, otherOp;
+    int i;
+
+    if ((op->op != XPATH_OP_PREDICATE) || (op->ch1 != -1) ||
+        (op->ch2 == -1))
+        return(NULL);
+    exprOp = &comp->steps[op->ch2];
+    if ((exprOp->op != XPATH_OP_EQUAL) || (exprOp->value == 0))
+        return(NULL);
+
+    for (i = 0; i < 2; i++) {
+        attrOp = &comp->steps[i == 0 ? exprOp->ch1 : exprOp->ch2];
+        otherOp = &comp->steps[i == 0 ? exprOp->ch2 : exprOp->ch1];
+
+        if ((attrOp->op != XPATH_OP_COLLECT) ||
+            (attrOp->value != AXIS_ATTRIBUTE) ||
+            (attrOp->value2 != NODE_TEST_NAME) ||
+            (attrOp->ch2 != -1) || (attrOp->ch1 == -1) ||
+            (comp->steps[attrOp->ch1].op != XPATH_OP_NODE))
+            continue;
+
+        if (((otherOp->op == XPATH_OP_VALUE) &&
+             (otherOp->value4 != NULL) &&
+             (((xmlXPathObjectPtr) otherOp->value4)->type == XPATH_STRING)) ||
+            (otherOp->op == XPATH_OP_VARIABLE)) {
+            *valueOp = otherOp;
+            return(attrOp);
+        }
+    }
+
+    return(NULL);
+}
+
+static int
+xmlXPathNodeCollectAndTest(xmlXPathParserContextPtr ctxt,
+                           xmlXPathStepOpPtr op,
+			   xmlNodePtr * first, xmlNodePtr * last,
+			   int toBool)
+{
+
+#define XP_TEST_HIT \
+    if (hasAxisRange != 0) { \
+	if (++pos == maxPos) { \
+	    if (addNode(seq, cur) < 0) \
+	        xmlXPathPErrMemory(ctxt); \
+	    goto axis_range_end; } \
+    } else { \
+	if (addNode(seq, cur) < 0) \
+	    xmlXPathPErrMemory(ctxt); \
+	if (breakOnFirstHit) goto first_hit; }
+
+#define XP_TEST_HIT_NS \
+    if (hasAxisRange != 0) { \
+	if (++pos == maxPos) { \
+	    hasNsNodes = 1; \
+	    if (xmlXPathNodeSetAddNs(seq, xpctxt->node, (xmlNsPtr) cur) < 0) \
+	        xmlXPathPErrMemory(ctxt); \
+	goto axis_range_end; } \
+    } else { \
+	hasNsNodes = 1; \
+	if (xmlXPathNodeSetAddNs(seq, xpctxt->node, (xmlNsPtr) cur) < 0) \
+	    xmlXPathPErrMemory(ctxt); \
+	if (breakOnFirstHit) goto first_hit; }
+
+    xmlXPathAxisVal axis = (xmlXPathAxisVal) op->value;
+    xmlXPathTestVal test = (xmlXPathTestVal) op->value2;
+    xmlXPathTypeVal type = (xmlXPathTypeVal) op->value3;
+    const xmlChar *prefix = op->value4;
+    const xmlChar *name = op->value5;
+    const xmlChar *URI = NULL;
 
-    name = xmlXPathParseQName(ctxt, &prefix);
-    if (name == NULL) {
-	xmlFree(prefix);
-	XP_ERROR(XPATH_EXPR_ERROR);
-    }
-    SKIP_BLANKS;
+    int total = 0, hasNsNodes = 0;
+    /* The popped object holding the context nodes */
+    xmlXPathObjectPtr obj;
+    /* The set of context nodes for the node tests */
+    xmlNodeSetPtr contextSeq;
+    int contextIdx, contextNr;
+    xmlNodePtr contextNode;
+    /* The final resulting node set wrt to all context nodes */
+    xmlNodeSetPtr outSeq;
+    /*
+    * The temporary resulting node set wrt 1 context node.
+    * Used to feed predicate evaluation.
+    */
+    xmlNodeSetPtr seq;
+    xmlNodePtr cur;
+    /* First predicate operator */
+    xmlXPathStepOpPtr predOp;
+    int maxPos; /* The requested position() (when a "[n]" predicate) */
+    int hasPredicateRange, hasAxisRange, pos;
+    int breakOnFirstHit;
+    /* Element name index for descendant axes */
+    int useNameIndex = 0;
+    xmlDocPtr indexDoc = NULL;
+    xmlXPathDocDataPtr nameIndex = NULL;
+    xmlXPathNameList *nameList = NULL;
+    int nameIdx = 0, nameEnd = 0;
+    /* Attribute value index for "[@name = 'value']" predicates */
+    const xmlChar *attrName = NULL, *attrURI = NULL, *attrValue = NULL;
+    xmlXPathObjectPtr attrValueObj = NULL;
+    xmlDocPtr attrDoc = NULL;
+    xmlXPathDocDataPtr attrIndex = NULL;
+    xmlXPathNameList *attrList = NULL;
 
-    if (CUR != '(') {
-	xmlFree(name);
-	xmlFree(prefix);
-	XP_ERROR(XPATH_EXPR_ERROR);
-    }
-    NEXT;
-    SKIP_BLANKS;
+    xmlXPathTraversalFunction next = NULL;
+    int (*addNode) (xmlNodeSetPtr, xmlNodePtr);
+    xmlXPathNodeSetMergeFunction mergeAndClear;
+    xmlNodePtr oldContextNode;
+    /* Last context node which wasn't pruned */
+    xmlNodePtr outerNode = NULL;
+    xmlXPathContextPtr xpctxt = ctxt->context;
 
+
+    CHECK_TYPE0(XPATH_NODESET);
+    obj = xmlXPathValuePop(ctxt);
     /*
-    * Optimization for count(): we don't need the node-set to be sorted.
+    * Setup namespaces.
     */
-    if ((prefix == NULL) && (name[0] == 'c') &&
-	xmlStrEqual(name, BAD_CAST "count"))
-    {
-	sort = 0;
-    }
-    ctxt->comp->last = -1;
-    if (CUR != ')') {
-	while (CUR != 0) {
-	    int op1 = ctxt->comp->last;
-	    ctxt->comp->last = -1;
-	    xmlXPathCompileExpr(ctxt, sort);
-	    if (ctxt->error != XPATH_EXPRESSION_OK) {
-		xmlFree(name);
-		xmlFree(prefix);
-		return;
-	    }
-	    PUSH_BINARY_EXPR(XPATH_OP_ARG, op1, ctxt->comp->last, 0, 0);
-	    nbargs++;
-	    if (CUR == ')') break;
-	    if (CUR != ',') {
-		xmlFree(name);
-		xmlFree(prefix);
-		XP_ERROR(XPATH_EXPR_ERROR);
-	    }
-	    NEXT;
-	    SKIP_BLANKS;
+    if (prefix != NULL) {
+        URI = xmlXPathNsLookup(xpctxt, prefix);
+        if (URI == NULL) {
+	    xmlXPathReleaseObject(xpctxt, obj);
+            xmlXPathErrFmt(ctxt, XPATH_UNDEF_PREFIX_ERROR,
+                           "Undefined namespace prefix: %s\n", prefix);
+            return 0;
 	}
     }
-    if (PUSH_LONG_EXPR(XPATH_OP_FUNCTION, nbargs, 0, 0, name, prefix) == -1) {
-        xmlFree(prefix);
-        xmlFree(name);
+    /*
+    * Setup axis.
+    *
+    * If the planner found that the nodes selected from different
+    * context nodes can't overlap, avoid searching for duplicates
+    * during the merge. See xmlXPathPlanExpression.
+    */
+    mergeAndClear = xmlXPathNodeSetMergeAndClear;
+    switch (axis) {
+        case AXIS_ANCESTOR:
+            first = NULL;
+            next = xmlXPathNextAncestor;
+            break;
+        case AXIS_ANCESTOR_OR_SELF:
+            first = NULL;
+            next = xmlXPathNextAncestorOrSelf;
+            break;
+        case AXIS_ATTRIBUTE:
+            first = NULL;
+	    last = NULL;
+            next = xmlXPathNextAttribute;
+	    mergeAndClear = xmlXPathNodeSetMergeAndClearNoDupls;
+            break;
+        case AXIS_CHILD:
+	    last = NULL;
+	    if (((test == NODE_TEST_NAME) || (test == NODE_TEST_ALL)) &&
+		(type == NODE_TYPE_NODE))
+	    {
+		/*
+		* Optimization if an element node type is 'element'.
+		*/
+		next = xmlXPathNextChildElement;
+	    } else
+		next = xmlXPathNextChild;
+	    mergeAndClear = xmlXPathNodeSetMergeAndClearNoDupls;
+            break;
+        case AXIS_DESCENDANT:
+	    last = NULL;
+	    if (((test == NODE_TEST_NAME) || (test == NODE_TEST_ALL)) &&
+		(type == NODE_TYPE_NODE))
+		next = xmlXPathNextDescendantElement;
+	    else
+		next = xmlXPathNextDescendant;
+            break;
+        case AXIS_DESCENDANT_OR_SELF:
+	    last = NULL;
+	    if (((test == NODE_TEST_NAME) || (test == NODE_TEST_ALL)) &&
+		(type == NODE_TYPE_NODE))
+		next = xmlXPathNextDescendantOrSelfElement;
+	    else
+		next = xmlXPathNextDescendantOrSelf;
+            break;
+        case AXIS_FOLLOWING:
+	    last = NULL;
+            next = xmlXPathNextFollowing;
+            break;
+        case AXIS_FOLLOWING_SIBLING:
+	    last = NULL;
+            next = xmlXPathNextFollowingSibling;
+            break;
+        case AXIS_NAMESPACE:
+            first = NULL;
+	    last = NULL;
+            next = (xmlXPathTraversalFunction) xmlXPathNextNamespace;
+	    mergeAndClear = xmlXPathNodeSetMergeAndClearNoDupls;
+            break;
+        case AXIS_PARENT:
+            first = NULL;
+            next = xmlXPathNextParent;
+            break;
+        case AXIS_PRECEDING:
+            first = NULL;
+            next = xmlXPathNextPrecedingInternal;
+            break;
+        case AXIS_PRECEDING_SIBLING:
+            first = NULL;
+            next = xmlXPathNextPrecedingSibling;
+            break;
+        case AXIS_SELF:
+            first = NULL;
+	    last = NULL;
+            next = xmlXPathNextSelf;
+	    mergeAndClear = xmlXPathNodeSetMergeAndClearNoDupls;
+            break;
     }
-    NEXT;
-    SKIP_BLANKS;
-}
 
-/**
- *  [15]   PrimaryExpr ::=   VariableReference
- *                | '(' Expr ')'
- *                | Literal
- *                | Number
- *                | FunctionCall
- *
- * Compile a primary expression.
- *
- * @param ctxt  the XPath Parser context
- */
-static void
-xmlXPathCompPrimaryExpr(xmlXPathParserContextPtr ctxt) {
-    SKIP_BLANKS;
-    if (CUR == '$') xmlXPathCompVariableReference(ctxt);
-    else if (CUR == '(') {
-	NEXT;
-	SKIP_BLANKS;
-	xmlXPathCompileExpr(ctxt, 1);
-	CHECK_ERROR;
-	if (CUR != ')') {
-	    XP_ERROR(XPATH_EXPR_ERROR);
+    if (next == NULL) {
+	xmlXPathReleaseObject(xpctxt, obj);
+        return(0);
+    }
+    if (op->flags & XP_STEP_NO_DUPS)
+        mergeAndClear = xmlXPathNodeSetMergeAndClearNoDupls;
+    contextSeq = obj->nodesetval;
+    if ((contextSeq == NULL) || (contextSeq->nodeNr <= 0)) {
+        xmlXPathValuePush(ctxt, obj);
+        return(0);
+    }
+    /*
+    * Predicate optimization ---------------------------------------------
+    * If this step has a last predicate, which contains a position(),
+    * then we'll optimize (although not exactly "position()", but only
+    * the  short-hand form, i.e., "[n]".
+    *
+    * Example - expression "/foo[parent::bar][1]":
+    *
+    * COLLECT 'child' 'name' 'node' foo    -- op (we are here)
+    *   ROOT                               -- op->ch1
+    *   PREDICATE                          -- op->ch2 (predOp)
+    *     PREDICATE                          -- predOp->ch1 = [parent::bar]
+    *       SORT
+    *         COLLECT  'parent' 'name' 'node' bar
+    *           NODE
+    *     ELEM Object is a number : 1        -- predOp->ch2 = [1]
+    *
+    */
+    maxPos = 0;
+    predOp = NULL;
+    hasPredicateRange = 0;
+    hasAxisRange = 0;
+    if (op->ch2 != -1) {
+	/*
+	* There's at least one predicate. 16 == XPATH_OP_PREDICATE
+	*/
+	predOp = &ctxt->comp->steps[op->ch2];
+	if (xmlXPathIsPositionalPredicate(ctxt, predOp, &maxPos)) {
+	    if (predOp->ch1 != -1) {
+		/*
+		* Use the next inner predicate operator.
+		*/
+		predOp = &ctxt->comp->steps[predOp->ch1];
+		hasPredicateRange = 1;
+	    } else {
+		/*
+		* There's no other predicate than the [n] predicate.
+		*/
+		predOp = NULL;
+		hasAxisRange = 1;
+	    }
 	}
-	NEXT;
-	SKIP_BLANKS;
-    } else if (IS_ASCII_DIGIT(CUR) || (CUR == '.' && IS_ASCII_DIGIT(NXT(1)))) {
-	xmlXPathCompNumber(ctxt);
-    } else if ((CUR == '\'') || (CUR == '"')) {
-	xmlXPathCompLiteral(ctxt);
-    } else {
-	xmlXPathCompFunctionCall(ctxt);
     }
-    SKIP_BLANKS;
-}
+    breakOnFirstHit = ((toBool) && (predOp == NULL)) ? 1 : 0;
+    /*
+    * Axis traversal -----------------------------------------------------
+    */
+    /*
+     * 2.3 Node Tests
+     *  - For the attribute axis, the principal node type is attribute.
+     *  - For the namespace axis, the principal node type is namespace.
+     *  - For other axes, the principal node type is element.
+     *
+     * A node test * is true for any node of the
+     * principal node type. For example, child::* will
+     * select all element children of the context node
+     */
+    oldContextNode = xpctxt->node;
+    addNode = xmlXPathNodeSetAddUnique;
+    outSeq = NULL;
+    seq = NULL;
+    contextNode = NULL;
+    contextIdx = 0;
 
-/**
- *  [20]   FilterExpr ::=   PrimaryExpr
- *               | FilterExpr Predicate
- *
- * Compile a filter expression.
- * Square brackets are used to filter expressions in the same way that
- * they are used in location paths. It is an error if the expression to
- * be filtered does not evaluate to a node-set. The context node list
- * used for evaluating the expression in square brackets is the node-set
- * to be filtered listed in document order.
- *
- * @param ctxt  the XPath Parser context
- */
+    if ((xpctxt->flags & XML_XPATH_NAME_INDEX) &&
+        (test == NODE_TEST_NAME) &&
+        ((axis == AXIS_DESCENDANT) || (axis == AXIS_DESCENDANT_OR_SELF)))
+        useNameIndex = 1;
 
-static void
-xmlXPathCompFilterExpr(xmlXPathParserContextPtr ctxt) {
-    xmlXPathCompPrimaryExpr(ctxt);
-    CHECK_ERROR;
-    SKIP_BLANKS;
+    /*
+     * Look up elements selected by a "[@name = 'value']" predicate
+     * which is the only predicate besides an optional "[n]" in the
+     * attribute value index.
+     */
+    if ((xpctxt->flags & XML_XPATH_ATTR_INDEX) &&
+        (predOp != NULL) && (predOp->ch1 == -1) &&
+        ((test == NODE_TEST_NAME) || (test == NODE_TEST_ALL)) &&
+        ((axis == AXIS_CHILD) || (axis == AXIS_DESCENDANT) ||
+         (axis == AXIS_DESCENDANT_OR_SELF))) {
+        xmlXPathStepOpPtr attrOp, valueOp;
+
+        attrOp = xmlXPathAttrIndexPredicate(ctxt, predOp, &valueOp);
+        if (attrOp != NULL) {
+            attrName = attrOp->value5;
+            if (attrOp->value4 != NULL)
+                attrURI = xmlXPathNsLookup(xpctxt, attrOp->value4);
+
+            if ((attrOp->value4 != NULL) && (attrURI == NULL)) {
+                /* Report the error when evaluating the predicate */
+            } else if (valueOp->op == XPATH_OP_VALUE) {
+                attrValue = ((xmlXPathObjectPtr) valueOp->value4)->stringval;
+            } else {
+                xmlXPathCompOpEval(ctxt, valueOp);
+                if (ctxt->error != XPATH_EXPRESSION_OK) {
+                    total = 0;
+                    goto error;
+                }
+                attrValueObj = xmlXPathValuePop(ctxt);
+                if ((attrValueObj != NULL) &&
+                    (attrValueObj->type == XPATH_STRING))
+                    attrValue = attrValueObj->stringval;
+            }
+        }
+    }
 
-    while (CUR == '[') {
-	xmlXPathCompPredicate(ctxt, 1);
-	SKIP_BLANKS;
+    /*
+     * Without predicates, the union of the following or preceding axes
+     * of all context nodes is the axis of a single context node.
+     */
+    contextNr = contextSeq->nodeNr;
+    if (((axis == AXIS_FOLLOWING) || (axis == AXIS_PRECEDING)) &&
+        (op->ch2 == -1) && (contextNr > 1)) {
+        int i = xmlXPathAxisContextIndex(contextSeq,
+                                         axis == AXIS_FOLLOWING);
+
+        if (i >= 0) {
+            contextIdx = i;
+            contextNr = i + 1;
+        }
     }
 
+    while (((contextIdx < contextNr) || (contextNode != NULL)) &&
+           (ctxt->error == XPATH_EXPRESSION_OK)) {
+	xpctxt->node = contextSeq->nodeTab[contextIdx++];
 
-}
+	/*
+	* The context nodes are in document order. Skip nodes in the
+	* subtree of the last outer node, their descendants were already
+	* selected.
+	*/
+	if ((op->flags & XP_STEP_PRUNE) &&
+	    (xpctxt->node->type != XML_ATTRIBUTE_NODE) &&
+	    (xpctxt->node->type != XML_NAMESPACE_DECL)) {
+	    if ((outerNode != NULL) &&
+		(xmlXPathIsAncestor(outerNode, xpctxt->node)))
+		continue;
+	    outerNode = xpctxt->node;
+	}
 
-/**
- * Trickery: parse an XML name but without consuming the input flow
- * Needed to avoid insanity in the parser state.
- *
- * @param ctxt  the XPath Parser context
- * @returns the Name parsed or NULL
- */
+	if (seq == NULL) {
+	    seq = xmlXPathNodeSetCreate(NULL);
+	    if (seq == NULL) {
+                xmlXPathPErrMemory(ctxt);
+		total = 0;
+		goto error;
+	    }
+	}
+	/*
+	* Look up the range of matching descendants in the name index.
+	*/
+        nameList = NULL;
+        nameIdx = -1;
+        if ((useNameIndex) &&
+            (xpctxt->node->type != XML_NAMESPACE_DECL) &&
+            (xpctxt->node->doc != NULL)) {
+            if (xpctxt->node->doc != indexDoc) {
+                if (nameIndex != NULL)
+                    xmlXPathReleaseDocData(indexDoc, nameIndex);
+                indexDoc = xpctxt->node->doc;
+                nameIndex = xmlXPathGetNameIndex(indexDoc);
+            }
+            if ((nameIndex != NULL) &&
+                (xmlXPathNameIndexRange(nameIndex, xpctxt->node, name, URI,
+                                        axis == AXIS_DESCENDANT_OR_SELF,
+                                        &nameList, &nameIdx,
+                                        &nameEnd) < 0))
+                nameIdx = -1;
+        }
+	/*
+	* Collect the elements with a matching attribute from the index.
+	*/
+        if ((attrValue != NULL) &&
+            (xpctxt->node->type != XML_NAMESPACE_DECL) &&
+            (xpctxt->node->doc != NULL)) {
+            int i, start, end;
+
+            if (xpctxt->node->doc != attrDoc) {
+                xmlHashTablePtr values;
+
+                if (attrIndex != NULL)
+                    xmlXPathReleaseDocData(attrDoc, attrIndex);
+                attrDoc = xpctxt->node->doc;
+                attrIndex = xmlXPathGetAttrIndex(attrDoc, attrName, attrURI,
+                                                 &values);
+                attrList = (attrIndex != NULL) ?
+                           xmlHashLookup(values, attrValue) : NULL;
+            }
+            if ((attrIndex != NULL) &&
+                (xmlXPathIndexListRange(attrIndex, xpctxt->node,
+                                        axis == AXIS_DESCENDANT_OR_SELF,
+                                        attrList, &start, &end) == 0)) {
+                pos = 0;
+                for (i = start; i < end; i++) {
+                    if (OP_LIMIT_EXCEEDED(ctxt, 1))
+                        goto error;
+                    cur = (xmlNodePtr) attrList->entries[i].node;
+                    total++;
+
+                    if ((axis == AXIS_CHILD) && (cur->parent != xpctxt->node))
+                        continue;
+                    if ((test == NODE_TEST_NAME) &&
+                        (!xmlStrEqual(name, cur->name)))
+                        continue;
+                    if (prefix == NULL) {
+                        if ((test == NODE_TEST_NAME) && (cur->ns != NULL))
+                            continue;
+                    } else if ((cur->ns == NULL) ||
+                               (!xmlStrEqual(URI, cur->ns->href))) {
+                        continue;
+                    }
 
-static xmlChar *
-xmlXPathScanName(xmlXPathParserContextPtr ctxt) {
-    const xmlChar *end;
-    xmlChar *ret;
+                    if ((hasPredicateRange) && (++pos != maxPos))
+                        continue;
+                    if (addNode(seq, cur) < 0)
+                        xmlXPathPErrMemory(ctxt);
+                    if ((hasPredicateRange) || (toBool))
+                        break;
+                }
+                goto attr_index_end;
+            }
+        }
+	/*
+	* Traverse the axis and test the nodes.
+	*/
+	pos = 0;
+	cur = NULL;
+	hasNsNodes = 0;
+        do {
+            if (OP_LIMIT_EXCEEDED(ctxt, 1))
+                goto error;
 
-    end = xmlScanName(ctxt->cur, XML_MAX_NAME_LENGTH, 0);
-    if (end == NULL) {
-        XP_ERRORNULL(XPATH_EXPR_ERROR);
-    }
-    if (end == ctxt->cur)
-        return(NULL);
+            if (nameIdx < 0)
+                cur = next(ctxt, cur);
+            else if ((nameList != NULL) && (nameIdx < nameEnd))
+                cur = (xmlNodePtr) nameList->entries[nameIdx++].node;
+            else
+                cur = NULL;
+            if (cur == NULL)
+                break;
+
+	    /*
+	    * QUESTION TODO: What does the "first" and "last" stuff do?
+	    */
+            if ((first != NULL) && (*first != NULL)) {
+		if (*first == cur)
+		    break;
+		if (((total % 256) == 0) &&
+#ifdef XP_OPTIMIZED_NON_ELEM_COMPARISON
+		    (xmlXPathCmpNodesExt(*first, cur) >= 0))
+#else
+		    (xmlXPathCmpNodes(*first, cur) >= 0))
+#endif
+		{
+		    break;
+		}
+	    }
+	    if ((last != NULL) && (*last != NULL)) {
+		if (*last == cur)
+		    break;
+		if (((total % 256) == 0) &&
+#ifdef XP_OPTIMIZED_NON_ELEM_COMPARISON
+		    (xmlXPathCmpNodesExt(cur, *last) >= 0))
+#else
+		    (xmlXPathCmpNodes(cur, *last) >= 0))
+#endif
+		{
+		    break;
+		}
+	    }
+
+            total++;
+
+	    switch (test) {
+                case NODE_TEST_NONE:
+		    total = 0;
+		    goto error;
+                case NODE_TEST_TYPE:
+		    if (type == NODE_TYPE_NODE) {
+			switch (cur->type) {
+			    case XML_DOCUMENT_NODE:
+			    case XML_HTML_DOCUMENT_NODE:
+			    case XML_ELEMENT_NODE:
+			    case XML_ATTRIBUTE_NODE:
+			    case XML_PI_NODE:
+			    case XML_COMMENT_NODE:
+			    case XML_CDATA_SECTION_NODE:
+			    case XML_TEXT_NODE:
+				XP_TEST_HIT
+				break;
+			    case XML_NAMESPACE_DECL: {
+				if (axis == AXIS_NAMESPACE) {
+				    XP_TEST_HIT_NS
+				} else {
+	                            hasNsNodes = 1;
+				    XP_TEST_HIT
+				}
+				break;
+                            }
+			    default:
+				break;
+			}
+		    } else if (cur->type == (xmlElementType) type) {
+			if (cur->type == XML_NAMESPACE_DECL)
+			    XP_TEST_HIT_NS
+			else
+			    XP_TEST_HIT
+		    } else if ((type == NODE_TYPE_TEXT) &&
+			 (cur->type == XML_CDATA_SECTION_NODE))
+		    {
+			XP_TEST_HIT
+		    }
+		    break;
+                case NODE_TEST_PI:
+                    if ((cur->type == XML_PI_NODE) &&
+                        ((name == NULL) || xmlStrEqual(name, cur->name)))
+		    {
+			XP_TEST_HIT
+                    }
+                    break;
+                case NODE_TEST_ALL:
+                    if (axis == AXIS_ATTRIBUTE) {
+                        if (cur->type == XML_ATTRIBUTE_NODE)
+			{
+                            if (prefix == NULL)
+			    {
+				XP_TEST_HIT
+                            } else if ((cur->ns != NULL) &&
+				(xmlStrEqual(URI, cur->ns->href)))
+			    {
+				XP_TEST_HIT
+                            }
+                        }
+                    } else if (axis == AXIS_NAMESPACE) {
+                        if (cur->type == XML_NAMESPACE_DECL)
+			{
+			    XP_TEST_HIT_NS
+                        }
+                    } else {
+                        if (cur->type == XML_ELEMENT_NODE) {
+                            if (prefix == NULL)
+			    {
+				XP_TEST_HIT
+
+                            } else if ((cur->ns != NULL) &&
+				(xmlStrEqual(URI, cur->ns->href)))
+			    {
+				XP_TEST_HIT
+                            }
+                        }
+                    }
+                    break;
+                case NODE_TEST_NS:{
+                        /* TODO */
+                        break;
+                    }
+                case NODE_TEST_NAME:
+                    if (axis == AXIS_ATTRIBUTE) {
+                        if (cur->type != XML_ATTRIBUTE_NODE)
+			    break;
+		    } else if (axis == AXIS_NAMESPACE) {
+                        if (cur->type != XML_NAMESPACE_DECL)
+			    break;
+		    } else {
+		        if (cur->type != XML_ELEMENT_NODE)
+			    break;
+		    }
+                    switch (cur->type) {
+                        case XML_ELEMENT_NODE:
+                            if (xmlStrEqual(name, cur->name)) {
+                                if (prefix == NULL) {
+                                    if (cur->ns == NULL)
+				    {
+					XP_TEST_HIT
+                                    }
+                                } else {
+                                    if ((cur->ns != NULL) &&
+                                        (xmlStrEqual(URI, cur->ns->href)))
+				    {
+					XP_TEST_HIT
+                                    }
+                                }
+                            }
+                            break;
+                        case XML_ATTRIBUTE_NODE:{
+                                xmlAttrPtr attr = (xmlAttrPtr) cur;
+
+                                if (xmlStrEqual(name, attr->name)) {
+                                    if (prefix == NULL) {
+                                        if ((attr->ns == NULL) ||
+                                            (attr->ns->prefix == NULL))
+					{
+					    XP_TEST_HIT
+                                        }
+                                    } else {
+                                        if ((attr->ns != NULL) &&
+                                            (xmlStrEqual(URI,
+					      attr->ns->href)))
+					{
+					    XP_TEST_HIT
+                                        }
+                                    }
+                                }
+                                break;
+                            }
+                        case XML_NAMESPACE_DECL:
+                            if (cur->type == XML_NAMESPACE_DECL) {
+                                xmlNsPtr ns = (xmlNsPtr) cur;
 
-    ret = xmlStrndup(ctxt->cur, end - ctxt->cur);
-    if (ret == NULL)
-        xmlXPathPErrMemory(ctxt);
-    return(ret);
-}
+                                if ((ns->prefix != NULL) && (name != NULL)
+                                    && (xmlStrEqual(ns->prefix, name)))
+				{
+				    XP_TEST_HIT_NS
+                                }
+                            }
+                            break;
+                        default:
+                            break;
+                    }
+                    break;
+	    } /* switch(test) */
+        } while ((cur != NULL) && (ctxt->error == XPATH_EXPRESSION_OK));
 
-/**
- *  [19]   PathExpr ::=   LocationPath
- *               | FilterExpr
- *               | FilterExpr '/' RelativeLocationPath
- *               | FilterExpr '//' RelativeLocationPath
- *
- * Compile a path expression.
- *
- * @param ctxt  the XPath Parser context
- */
+	goto apply_predicates;
 
-static void
-xmlXPathCompPathExpr(xmlXPathParserContextPtr ctxt) {
-    int lc = 1;           /* Should we branch to LocationPath ?         */
-    xmlChar *name = NULL; /* we may have to preparse a name to find out */
+axis_range_end: /* ----------------------------------------------------- */
+	/*
+	* We have a "/foo[n]", and position() = n was reached.
+	* Note that we can have as well "/foo/::parent::foo[1]", so
+	* a duplicate-aware merge is still needed.
+	* Merge with the result.
+	*/
+	if (outSeq == NULL) {
+	    outSeq = seq;
+	    seq = NULL;
+	} else {
+	    outSeq = mergeAndClear(outSeq, seq);
+            if (outSeq == NULL)
+                xmlXPathPErrMemory(ctxt);
+        }
+	/*
+	* Break if only a true/false result was requested.
+	*/
+	if (toBool)
+	    break;
+	continue;
 
-    SKIP_BLANKS;
-    if ((CUR == '$') || (CUR == '(') ||
-	(IS_ASCII_DIGIT(CUR)) ||
-        (CUR == '\'') || (CUR == '"') ||
-	(CUR == '.' && IS_ASCII_DIGIT(NXT(1)))) {
-	lc = 0;
-    } else if (CUR == '*') {
-	/* relative or absolute location path */
-	lc = 1;
-    } else if (CUR == '/') {
-	/* relative or absolute location path */
-	lc = 1;
-    } else if (CUR == '@') {
-	/* relative abbreviated attribute location path */
-	lc = 1;
-    } else if (CUR == '.') {
-	/* relative abbreviated attribute location path */
-	lc = 1;
-    } else {
+first_hit: /* ---------------------------------------------------------- */
 	/*
-	 * Problem is finding if we have a name here whether it's:
-	 *   - a nodetype
-	 *   - a function call in which case it's followed by '('
-	 *   - an axis in which case it's followed by ':'
-	 *   - a element name
-	 * We do an a priori analysis here rather than having to
-	 * maintain parsed token content through the recursive function
-	 * calls. This looks uglier but makes the code easier to
-	 * read/write/debug.
-	 */
-	SKIP_BLANKS;
-	name = xmlXPathScanName(ctxt);
-	if ((name != NULL) && (xmlStrstr(name, (xmlChar *) "::") != NULL)) {
-	    lc = 1;
-	    xmlFree(name);
-	} else if (name != NULL) {
-	    int len =xmlStrlen(name);
+	* Break if only a true/false result was requested and
+	* no predicates existed and a node test succeeded.
+	*/
+	if (outSeq == NULL) {
+	    outSeq = seq;
+	    seq = NULL;
+	} else {
+	    outSeq = mergeAndClear(outSeq, seq);
+            if (outSeq == NULL)
+                xmlXPathPErrMemory(ctxt);
+        }
+	break;
 
+apply_predicates: /* --------------------------------------------------- */
+        if (ctxt->error != XPATH_EXPRESSION_OK)
+	    goto error;
 
-	    while (NXT(len) != 0) {
-		if (NXT(len) == '/') {
-		    /* element name */
-		    lc = 1;
-		    break;
-		} else if (IS_BLANK_CH(NXT(len))) {
-		    /* ignore blanks */
-		    ;
-		} else if (NXT(len) == ':') {
-		    lc = 1;
-		    break;
-		} else if ((NXT(len) == '(')) {
-		    /* Node Type or Function */
-		    if (xmlXPathIsNodeType(name)) {
-			lc = 1;
-		    } else {
-			lc = 0;
-		    }
-                    break;
-		} else if ((NXT(len) == '[')) {
-		    /* element name */
-		    lc = 1;
-		    break;
-		} else if ((NXT(len) == '<') || (NXT(len) == '>') ||
-			   (NXT(len) == '=')) {
-		    lc = 1;
-		    break;
-		} else {
-		    lc = 1;
-		    break;
-		}
-		len++;
+        /*
+	* Apply predicates.
+	*/
+        if ((predOp != NULL) && (seq->nodeNr > 0)) {
+	    /*
+	    * E.g. when we have a "/foo[some expression][n]".
+	    */
+	    /*
+	    * QUESTION TODO: The old predicate evaluation took into
+	    *  account location-sets.
+	    *  (E.g. ctxt->value->type == XPATH_LOCATIONSET)
+	    *  Do we expect such a set here?
+	    *  All what I learned now from the evaluation semantics
+	    *  does not indicate that a location-set will be processed
+	    *  here, so this looks OK.
+	    */
+	    /*
+	    * Iterate over all predicates, starting with the outermost
+	    * predicate.
+	    * TODO: Problem: we cannot execute the inner predicates first
+	    *  since we cannot go back *up* the operator tree!
+	    *  Options we have:
+	    *  1) Use of recursive functions (like is it currently done
+	    *     via xmlXPathCompOpEval())
+	    *  2) Add a predicate evaluation information stack to the
+	    *     context struct
+	    *  3) Change the way the operators are linked; we need a
+	    *     "parent" field on xmlXPathStepOp
+	    *
+	    * For the moment, I'll try to solve this with a recursive
+	    * function: xmlXPathCompOpEvalPredicate().
+	    */
+	    if (hasPredicateRange != 0)
+		xmlXPathCompOpEvalPredicate(ctxt, predOp, seq, maxPos, maxPos,
+					    hasNsNodes);
+	    else
+		xmlXPathCompOpEvalPredicate(ctxt, predOp, seq, 1, seq->nodeNr,
+					    hasNsNodes);
+
+	    if (ctxt->error != XPATH_EXPRESSION_OK) {
+		total = 0;
+		goto error;
 	    }
-	    if (NXT(len) == 0) {
-		/* element name */
-		lc = 1;
+        }
+
+attr_index_end: /* ---------------------------------------------------- */
+        if (seq->nodeNr > 0) {
+	    /*
+	    * Add to result set.
+	    */
+	    if (outSeq == NULL) {
+		outSeq = seq;
+		seq = NULL;
+	    } else {
+		outSeq = mergeAndClear(outSeq, seq);
+                if (outSeq == NULL)
+                    xmlXPathPErrMemory(ctxt);
 	    }
-	    xmlFree(name);
-	} else {
-	    /* make sure all cases are covered explicitly */
-	    XP_ERROR(XPATH_EXPR_ERROR);
-	}
-    }
 
-    if (lc) {
-	if (CUR == '/') {
-	    PUSH_LEAVE_EXPR(XPATH_OP_ROOT, 0, 0);
-	} else {
-	    PUSH_LEAVE_EXPR(XPATH_OP_NODE, 0, 0);
+            if (toBool)
+                break;
 	}
-	xmlXPathCompLocationPath(ctxt);
-    } else {
-	xmlXPathCompFilterExpr(ctxt);
-	CHECK_ERROR;
-	if ((CUR == '/') && (NXT(1) == '/')) {
-	    SKIP(2);
-	    SKIP_BLANKS;
+    }
 
-	    PUSH_LONG_EXPR(XPATH_OP_COLLECT, AXIS_DESCENDANT_OR_SELF,
-		    NODE_TEST_TYPE, NODE_TYPE_NODE, NULL, NULL);
+error:
+    if (nameIndex != NULL)
+        xmlXPathReleaseDocData(indexDoc, nameIndex);
+    if (attrIndex != NULL)
+        xmlXPathReleaseDocData(attrDoc, attrIndex);
+    if (attrValueObj != NULL)
+        xmlXPathReleaseObject(xpctxt, attrValueObj);
+    if ((obj->boolval) && (obj->user != NULL)) {
+	/*
+	* QUESTION TODO: What does this do and why?
+	* TODO: Do we have to do this also for the "error"
+	* cleanup further down?
+	*/
+	ctxt->value->boolval = 1;
+	ctxt->value->user = obj->user;
+	obj->user = NULL;
+	obj->boolval = 0;
+    }
+    xmlXPathReleaseObject(xpctxt, obj);
 
-	    xmlXPathCompRelativeLocationPath(ctxt);
-	} else if (CUR == '/') {
-	    xmlXPathCompRelativeLocationPath(ctxt);
-	}
+    /*
+    * Ensure we return at least an empty set.
+    */
+    if (outSeq == NULL) {
+	if ((seq != NULL) && (seq->nodeNr == 0)) {
+	    outSeq = seq;
+        } else {
+	    outSeq = xmlXPathNodeSetCreate(NULL);
+            if (outSeq == NULL)
+                xmlXPathPErrMemory(ctxt);
+        }
+    }
+    if ((seq != NULL) && (seq != outSeq)) {
+	 xmlXPathFreeNodeSet(seq);
     }
-    SKIP_BLANKS;
+    /*
+    * Hand over the result. Better to push the set also in
+    * case of errors.
+    */
+    xmlXPathValuePush(ctxt, xmlXPathCacheWrapNodeSet(ctxt, outSeq));
+    /*
+    * Reset the context node.
+    */
+    xpctxt->node = oldContextNode;
+    /*
+    * When traversing the namespace axis in "toBool" mode, it's
+    * possible that tmpNsList wasn't freed.
+    */
+    if (xpctxt->tmpNsList != NULL) {
+        xmlFree(xpctxt->tmpNsList);
+        xpctxt->tmpNsList = NULL;
+    }
+
+    return(total);
 }
 
-/**
- *  [18]   UnionExpr ::=   PathExpr
- *               | UnionExpr '|' PathExpr
- *
- * Compile an union expression.
- *
- * @param ctxt  the XPath Parser context
- */
+/************************************************************************
+ *									*
+ *		Lazy evaluation of location paths			*
+ *									*
+ ************************************************************************/
 
-static void
-xmlXPathCompUnionExpr(xmlXPathParserContextPtr ctxt) {
-    xmlXPathCompPathExpr(ctxt);
-    CHECK_ERROR;
-    SKIP_BLANKS;
-    while (CUR == '|') {
-	int op1 = ctxt->comp->last;
-	PUSH_LEAVE_EXPR(XPATH_OP_NODE, 0, 0);
+/*
+ * Location paths are normally evaluated step by step, building the
+ * complete node set of every step. If only the existence, the number
+ * or the first node of the result is needed, simple paths are
+ * evaluated with nested loops instead: every node passing a step is
+ * immediately fed into the next step, so evaluation can stop as soon
+ * as the answer is known and no intermediate node sets are built.
+ *
+ * This works for chains of steps starting at the root or the context
+ * node whose predicates don't depend on the context size.
+ */
 
-	NEXT;
-	SKIP_BLANKS;
-	xmlXPathCompPathExpr(ctxt);
+#define XPATH_LAZY_MAX_STEPS 8
+#define XPATH_LAZY_MAX_PREDS 2
 
-	PUSH_BINARY_EXPR(XPATH_OP_UNION, op1, ctxt->comp->last, 0, 0);
+/* stop at the first result */
+#define XPATH_LAZY_ANY      0
+/* stop at the first result in document order */
+#define XPATH_LAZY_FIRST    1
+/* count all results */
+#define XPATH_LAZY_COUNT    2
 
-	SKIP_BLANKS;
-    }
-}
+typedef struct {
+    xmlXPathStepOpPtr op;
+    xmlXPathTraversalFunction next;
+    const xmlChar *URI;
+    int nbPreds;
+    /* innermost predicate first */
+    xmlXPathStepOpPtr preds[XPATH_LAZY_MAX_PREDS];
+    /* the position for constant [n] predicates, 0 otherwise */
+    int maxPos[XPATH_LAZY_MAX_PREDS];
+} xmlXPathLazyStep;
+
+typedef struct {
+    int nbSteps;
+    xmlXPathLazyStep steps[XPATH_LAZY_MAX_STEPS];
+    xmlNodePtr start;
+    /* results are found in document order */
+    int ordered;
+    /* results can't contain duplicates */
+    int distinct;
+
+    int mode;
+    xmlNodePtr result;
+    double count;
+} xmlXPathLazyPath;
 
-/**
- *  [27]   UnaryExpr ::=   UnionExpr
- *                   | '-' UnaryExpr
- *
- * Compile an unary expression.
- *
- * @param ctxt  the XPath Parser context
+/*
+ * Check whether a predicate can be evaluated without knowing the
+ * context size, that is whether it doesn't call last() or functions
+ * which aren't part of the core library.
  */
+static int
+xmlXPathLazyCheckPredicate(xmlXPathParserContextPtr ctxt,
+                           xmlXPathStepOpPtr op, int depth) {
+    xmlXPathCompExprPtr comp = ctxt->comp;
 
-static void
-xmlXPathCompUnaryExpr(xmlXPathParserContextPtr ctxt) {
-    int minus = 0;
-    int found = 0;
-
-    SKIP_BLANKS;
-    while (CUR == '-') {
-        minus = 1 - minus;
-	found = 1;
-	NEXT;
-	SKIP_BLANKS;
-    }
+    if (depth > 50)
+        return(0);
 
-    xmlXPathCompUnionExpr(ctxt);
-    CHECK_ERROR;
-    if (found) {
-	if (minus)
-	    PUSH_UNARY_EXPR(XPATH_OP_PLUS, ctxt->comp->last, 2, 0);
-	else
-	    PUSH_UNARY_EXPR(XPATH_OP_PLUS, ctxt->comp->last, 3, 0);
+    if (op->op == XPATH_OP_FUNCTION) {
+        xmlXPathFunction func = op->cache;
+        size_t i;
+
+        if ((op->value5 != NULL) ||
+            (xmlStrEqual(op->value4, BAD_CAST "last")))
+            return(0);
+        if (func == NULL)
+            func = xmlXPathFunctionLookup(ctxt->context, op->value4);
+        for (i = 0; i < NUM_STANDARD_FUNCTIONS; i++) {
+            if (xmlXPathStandardFunctions[i].func == func)
+                break;
+        }
+        if (i >= NUM_STANDARD_FUNCTIONS)
+            return(0);
     }
-}
 
-/**
- *  [26]   MultiplicativeExpr ::=   UnaryExpr
- *                   | MultiplicativeExpr MultiplyOperator UnaryExpr
- *                   | MultiplicativeExpr 'div' UnaryExpr
- *                   | MultiplicativeExpr 'mod' UnaryExpr
- *  [34]   MultiplyOperator ::=   '*'
- *
- * Compile an Additive expression.
- *
- * @param ctxt  the XPath Parser context
- */
+    /* ch1 of values and variables isn't an operand */
+    if ((op->op == XPATH_OP_VALUE) || (op->op == XPATH_OP_VARIABLE))
+        return(1);
 
-static void
-xmlXPathCompMultiplicativeExpr(xmlXPathParserContextPtr ctxt) {
-    xmlXPathCompUnaryExpr(ctxt);
-    CHECK_ERROR;
-    SKIP_BLANKS;
-    while ((CUR == '*') ||
-           ((CUR == 'd') && (NXT(1) == 'i') && (NXT(2) == 'v')) ||
-           ((CUR == 'm') && (NXT(1) == 'o') && (NXT(2) == 'd'))) {
-	int op = -1;
-	int op1 = ctxt->comp->last;
+    if ((op->ch1 != -1) &&
+        (!xmlXPathLazyCheckPredicate(ctxt, &comp->steps[op->ch1],
+                                     depth + 1)))
+        return(0);
+    if ((op->ch2 != -1) &&
+        (!xmlXPathLazyCheckPredicate(ctxt, &comp->steps[op->ch2],
+                                     depth + 1)))
+        return(0);
 
-        if (CUR == '*') {
-	    op = 0;
-	    NEXT;
-	} else if (CUR == 'd') {
-	    op = 1;
-	    SKIP(3);
-	} else if (CUR == 'm') {
-	    op = 2;
-	    SKIP(3);
-	}
-	SKIP_BLANKS;
-        xmlXPathCompUnaryExpr(ctxt);
-	CHECK_ERROR;
-	PUSH_BINARY_EXPR(XPATH_OP_MULT, op1, ctxt->comp->last, op, 0);
-	SKIP_BLANKS;
-    }
+    return(1);
 }
 
-/**
- *  [25]   AdditiveExpr ::=   MultiplicativeExpr
- *                   | AdditiveExpr '+' MultiplicativeExpr
- *                   | AdditiveExpr '-' MultiplicativeExpr
- *
- * Compile an Additive expression.
+/*
+ * Analyze a location path for lazy evaluation.
  *
- * @param ctxt  the XPath Parser context
+ * Returns 1 if the path can be evaluated lazily, 0 otherwise.
  */
+static int
+xmlXPathLazyInit(xmlXPathParserContextPtr ctxt, xmlXPathStepOpPtr op,
+                 xmlXPathLazyPath *path) {
+    xmlXPathCompExprPtr comp = ctxt->comp;
+    xmlXPathContextPtr xpctxt = ctxt->context;
+    xmlXPathStepOpPtr ops[XPATH_LAZY_MAX_STEPS];
+    int i, n = 0;
 
-static void
-xmlXPathCompAdditiveExpr(xmlXPathParserContextPtr ctxt) {
-
-    xmlXPathCompMultiplicativeExpr(ctxt);
-    CHECK_ERROR;
-    SKIP_BLANKS;
-    while ((CUR == '+') || (CUR == '-')) {
-	int plus;
-	int op1 = ctxt->comp->last;
+    while ((op->op == XPATH_OP_SORT) && (op->ch1 != -1))
+        op = &comp->steps[op->ch1];
 
-        if (CUR == '+') plus = 1;
-	else plus = 0;
-	NEXT;
-	SKIP_BLANKS;
-        xmlXPathCompMultiplicativeExpr(ctxt);
-	CHECK_ERROR;
-	PUSH_BINARY_EXPR(XPATH_OP_PLUS, op1, ctxt->comp->last, plus, 0);
-	SKIP_BLANKS;
+    while (op->op == XPATH_OP_COLLECT) {
+        if ((n >= XPATH_LAZY_MAX_STEPS) || (op->ch1 == -1))
+            return(0);
+        ops[n++] = op;
+        op = &comp->steps[op->ch1];
     }
-}
+    if ((n == 0) || (op->ch1 != -1) || (op->ch2 != -1))
+        return(0);
 
-/**
- *  [24]   RelationalExpr ::=   AdditiveExpr
- *                 | RelationalExpr '<' AdditiveExpr
- *                 | RelationalExpr '>' AdditiveExpr
- *                 | RelationalExpr '<=' AdditiveExpr
- *                 | RelationalExpr '>=' AdditiveExpr
- *
- *  A <= B > C is allowed ? Answer from James, yes with
- *  (AdditiveExpr <= AdditiveExpr) > AdditiveExpr
- *  which is basically what got implemented.
- *
- * Compile a Relational expression, then push the result
- * on the stack
- *
- * @param ctxt  the XPath Parser context
- */
+    if (op->op == XPATH_OP_ROOT)
+        path->start = (xmlNodePtr) xpctxt->doc;
+    else if (op->op == XPATH_OP_NODE)
+        path->start = xpctxt->node;
+    else
+        return(0);
+    if ((path->start == NULL) ||
+        (path->start->type == XML_NAMESPACE_DECL))
+        return(0);
 
-static void
-xmlXPathCompRelationalExpr(xmlXPathParserContextPtr ctxt) {
-    xmlXPathCompAdditiveExpr(ctxt);
-    CHECK_ERROR;
-    SKIP_BLANKS;
-    while ((CUR == '<') || (CUR == '>')) {
-	int inf, strict;
-	int op1 = ctxt->comp->last;
+    path->nbSteps = n;
+    path->ordered = 1;
+    path->distinct = 1;
+
+    for (i = 0; i < n; i++) {
+        xmlXPathLazyStep *step = &path->steps[i];
+        xmlXPathAxisVal axis;
+        xmlXPathTestVal test;
+        xmlXPathStepOpPtr pred;
+        int elemOnly;
+
+        /* The chain is stored from the last step */
+        op = ops[n - 1 - i];
+        step->op = op;
+        axis = (xmlXPathAxisVal) op->value;
+        test = (xmlXPathTestVal) op->value2;
+        elemOnly = (((test == NODE_TEST_NAME) || (test == NODE_TEST_ALL)) &&
+                    (op->value3 == NODE_TYPE_NODE));
+
+        if ((test != NODE_TEST_TYPE) && (test != NODE_TEST_PI) &&
+            (test != NODE_TEST_ALL) && (test != NODE_TEST_NAME))
+            return(0);
+
+        switch (axis) {
+            case AXIS_ANCESTOR:
+                step->next = xmlXPathNextAncestor;
+                break;
+            case AXIS_ANCESTOR_OR_SELF:
+                step->next = xmlXPathNextAncestorOrSelf;
+                break;
+            case AXIS_ATTRIBUTE:
+                step->next = xmlXPathNextAttribute;
+                break;
+            case AXIS_CHILD:
+                step->next = elemOnly ? xmlXPathNextChildElement :
+                                        xmlXPathNextChild;
+                break;
+            case AXIS_DESCENDANT:
+                step->next = elemOnly ? xmlXPathNextDescendantElement :
+                                        xmlXPathNextDescendant;
+                break;
+            case AXIS_DESCENDANT_OR_SELF:
+                step->next = elemOnly ?
+                             xmlXPathNextDescendantOrSelfElement :
+                             xmlXPathNextDescendantOrSelf;
+                break;
+            case AXIS_FOLLOWING:
+                step->next = xmlXPathNextFollowing;
+                break;
+            case AXIS_FOLLOWING_SIBLING:
+                step->next = xmlXPathNextFollowingSibling;
+                break;
+            case AXIS_PARENT:
+                step->next = xmlXPathNextParent;
+                break;
+            case AXIS_PRECEDING_SIBLING:
+                step->next = xmlXPathNextPrecedingSibling;
+                break;
+            case AXIS_SELF:
+                step->next = xmlXPathNextSelf;
+                break;
+            default:
+                /*
+                 * The namespace axis creates temporary nodes and the
+                 * preceding axis keeps state in the parser context.
+                 */
+                return(0);
+        }
 
-        if (CUR == '<') inf = 1;
-	else inf = 0;
-	if (NXT(1) == '=') strict = 0;
-	else strict = 1;
-	NEXT;
-	if (!strict) NEXT;
-	SKIP_BLANKS;
-        xmlXPathCompAdditiveExpr(ctxt);
-	CHECK_ERROR;
-	PUSH_BINARY_EXPR(XPATH_OP_CMP, op1, ctxt->comp->last, inf, strict);
-	SKIP_BLANKS;
-    }
-}
+        /*
+         * Nested loops produce results in document order if all
+         * steps but the last one select children or attributes and
+         * the last one is a forward axis which doesn't leave the
+         * subtree. A single step is in document order for all
+         * forward axes.
+         */
+        switch (axis) {
+            case AXIS_CHILD:
+            case AXIS_ATTRIBUTE:
+            case AXIS_SELF:
+                break;
+            case AXIS_DESCENDANT:
+            case AXIS_DESCENDANT_OR_SELF:
+                if (i < n - 1)
+                    path->ordered = 0;
+                break;
+            case AXIS_FOLLOWING:
+            case AXIS_FOLLOWING_SIBLING:
+                if (n > 1)
+                    path->ordered = 0;
+                break;
+            default:
+                path->ordered = 0;
+                break;
+        }
 
-/**
- *  [23]   EqualityExpr ::=   RelationalExpr
- *                 | EqualityExpr '=' RelationalExpr
- *                 | EqualityExpr '!=' RelationalExpr
- *
- *  A != B != C is allowed ? Answer from James, yes with
- *  (RelationalExpr = RelationalExpr) = RelationalExpr
- *  (RelationalExpr != RelationalExpr) != RelationalExpr
- *  which is basically what got implemented.
- *
- * Compile an Equality expression.
- *
- * @param ctxt  the XPath Parser context
- */
-static void
-xmlXPathCompEqualityExpr(xmlXPathParserContextPtr ctxt) {
-    xmlXPathCompRelationalExpr(ctxt);
-    CHECK_ERROR;
-    SKIP_BLANKS;
-    while ((CUR == '=') || ((CUR == '!') && (NXT(1) == '='))) {
-	int eq;
-	int op1 = ctxt->comp->last;
+        /*
+         * Distinct nodes have distinct children, attributes and
+         * selves, so only the first step may use other axes.
+         */
+        if ((i > 0) && (axis != AXIS_CHILD) && (axis != AXIS_ATTRIBUTE) &&
+            (axis != AXIS_SELF))
+            path->distinct = 0;
+
+        step->URI = NULL;
+        if (op->value4 != NULL) {
+            step->URI = xmlXPathNsLookup(xpctxt, op->value4);
+            if (step->URI == NULL)
+                return(0);
+        }
 
-        if (CUR == '=') eq = 1;
-	else eq = 0;
-	NEXT;
-	if (!eq) NEXT;
-	SKIP_BLANKS;
-        xmlXPathCompRelationalExpr(ctxt);
-	CHECK_ERROR;
-	PUSH_BINARY_EXPR(XPATH_OP_EQUAL, op1, ctxt->comp->last, eq, 0);
-	SKIP_BLANKS;
+        step->nbPreds = 0;
+        pred = (op->ch2 != -1) ? &comp->steps[op->ch2] : NULL;
+        while (pred != NULL) {
+            xmlXPathStepOpPtr valueOp;
+            int j;
+
+            if ((step->nbPreds >= XPATH_LAZY_MAX_PREDS) ||
+                (pred->op != XPATH_OP_PREDICATE) || (pred->ch2 == -1) ||
+                (!xmlXPathLazyCheckPredicate(ctxt, &comp->steps[pred->ch2],
+                                             0)))
+                return(0);
+            /* Prefer the attribute value index */
+            if ((xpctxt->flags & XML_XPATH_ATTR_INDEX) &&
+                (xmlXPathAttrIndexPredicate(ctxt, pred, &valueOp) != NULL))
+                return(0);
+
+            /* Insert at the front */
+            for (j = step->nbPreds; j > 0; j--) {
+                step->preds[j] = step->preds[j-1];
+                step->maxPos[j] = step->maxPos[j-1];
+            }
+            step->preds[0] = &comp->steps[pred->ch2];
+            step->maxPos[0] = 0;
+            if (!xmlXPathIsPositionalPredicate(ctxt, pred, &step->maxPos[0]))
+                step->maxPos[0] = 0;
+            step->nbPreds += 1;
+
+            pred = (pred->ch1 != -1) ? &comp->steps[pred->ch1] : NULL;
+        }
     }
+
+    return(1);
 }
 
-/**
- *  [22]   AndExpr ::=   EqualityExpr
- *                 | AndExpr 'and' EqualityExpr
- *
- * Compile an AND expression.
- *
- * @param ctxt  the XPath Parser context
+/*
+ * Test a node against the node test of a step.
  */
-static void
-xmlXPathCompAndExpr(xmlXPathParserContextPtr ctxt) {
-    xmlXPathCompEqualityExpr(ctxt);
-    CHECK_ERROR;
-    SKIP_BLANKS;
-    while ((CUR == 'a') && (NXT(1) == 'n') && (NXT(2) == 'd')) {
-	int op1 = ctxt->comp->last;
-        SKIP(3);
-	SKIP_BLANKS;
-        xmlXPathCompEqualityExpr(ctxt);
-	CHECK_ERROR;
-	PUSH_BINARY_EXPR(XPATH_OP_AND, op1, ctxt->comp->last, 0, 0);
-	SKIP_BLANKS;
+static int
+xmlXPathLazyTest(xmlXPathStepOpPtr op, const xmlChar *URI, xmlNodePtr cur) {
+    xmlXPathAxisVal axis = (xmlXPathAxisVal) op->value;
+    xmlXPathTestVal test = (xmlXPathTestVal) op->value2;
+    xmlXPathTypeVal type = (xmlXPathTypeVal) op->value3;
+    const xmlChar *prefix = op->value4;
+    const xmlChar *name = op->value5;
+    xmlNsPtr ns;
+
+    switch (test) {
+        case NODE_TEST_TYPE:
+            if (type == NODE_TYPE_NODE) {
+                switch (cur->type) {
+                    case XML_DOCUMENT_NODE:
+                    case XML_HTML_DOCUMENT_NODE:
+                    case XML_ELEMENT_NODE:
+                    case XML_ATTRIBUTE_NODE:
+                    case XML_PI_NODE:
+                    case XML_COMMENT_NODE:
+                    case XML_CDATA_SECTION_NODE:
+                    case XML_TEXT_NODE:
+                        return(1);
+                    default:
+                        return(0);
+                }
+            }
+            if (cur->type == (xmlElementType) type)
+                return(1);
+            return((type == NODE_TYPE_TEXT) &&
+                   (cur->type == XML_CDATA_SECTION_NODE));
+
+        case NODE_TEST_PI:
+            return((cur->type == XML_PI_NODE) &&
+                   ((name == NULL) || (xmlStrEqual(name, cur->name))));
+
+        case NODE_TEST_ALL:
+            if (cur->type != ((axis == AXIS_ATTRIBUTE) ?
+                              XML_ATTRIBUTE_NODE : XML_ELEMENT_NODE))
+                return(0);
+            return((prefix == NULL) ||
+                   ((cur->ns != NULL) && (xmlStrEqual(URI, cur->ns->href))));
+
+        case NODE_TEST_NAME:
+            if (cur->type != ((axis == AXIS_ATTRIBUTE) ?
+                              XML_ATTRIBUTE_NODE : XML_ELEMENT_NODE))
+                return(0);
+            if (!xmlStrEqual(name, cur->name))
+                return(0);
+            ns = cur->ns;
+            if (prefix == NULL) {
+                /* Attributes in the default namespace can't exist */
+                return((ns == NULL) ||
+                       ((cur->type == XML_ATTRIBUTE_NODE) &&
+                        (ns->prefix == NULL)));
+            }
+            return((ns != NULL) && (xmlStrEqual(URI, ns->href)));
+
+        default:
+            return(0);
     }
 }
 
-/**
- *  [14]   Expr ::=   OrExpr
- *  [21]   OrExpr ::=   AndExpr
- *                 | OrExpr 'or' AndExpr
- *
- * Parse and compile an expression
+/*
+ * Evaluate step `idx` of a lazy path for a context node and feed the
+ * selected nodes into the next step.
  *
- * @param ctxt  the XPath Parser context
- * @param sort  whether to sort the resulting node set
+ * Returns 1 if evaluation should stop, 0 to continue, -1 in case of
+ * error.
  */
-static void
-xmlXPathCompileExpr(xmlXPathParserContextPtr ctxt, int sort) {
+static int
+xmlXPathLazyVisit(xmlXPathParserContextPtr ctxt, xmlXPathLazyPath *path,
+                  int idx, xmlNodePtr node) {
+    xmlXPathLazyStep *step = &path->steps[idx];
     xmlXPathContextPtr xpctxt = ctxt->context;
+    int pos[XPATH_LAZY_MAX_PREDS];
+    xmlNodePtr cur = NULL;
+    int i, res;
+
+    for (i = 0; i < step->nbPreds; i++)
+        pos[i] = 0;
+
+    while (1) {
+        xpctxt->node = node;
+        cur = step->next(ctxt, cur);
+        if (cur == NULL)
+            break;
+        if (OP_LIMIT_EXCEEDED(ctxt, 1))
+            return(-1);
+
+        if (!xmlXPathLazyTest(step->op, step->URI, cur))
+            continue;
 
-    if (xpctxt != NULL) {
-        if (xpctxt->depth >= XPATH_MAX_RECURSION_DEPTH)
-            XP_ERROR(XPATH_RECURSION_LIMIT_EXCEEDED);
         /*
-         * Parsing a single '(' pushes about 10 functions on the call stack
-         * before recursing!
+         * Proximity positions only count the nodes which passed the
+         * preceding predicates, in axis order.
          */
-        xpctxt->depth += 10;
-    }
+        for (i = 0; i < step->nbPreds; i++) {
+            pos[i] += 1;
+            xpctxt->node = cur;
+            xpctxt->contextSize = -1;
+            xpctxt->proximityPosition = pos[i];
+            res = xmlXPathCompOpEvalToBoolean(ctxt, step->preds[i], 1);
+            if (ctxt->error != XPATH_EXPRESSION_OK)
+                return(-1);
+            if (!res)
+                break;
+        }
+        if (i < step->nbPreds) {
+            /* No later node can pass a [n] predicate */
+            if ((step->maxPos[i] > 0) && (pos[i] >= step->maxPos[i]))
+                break;
+            continue;
+        }
 
-    xmlXPathCompAndExpr(ctxt);
-    CHECK_ERROR;
-    SKIP_BLANKS;
-    while ((CUR == 'o') && (NXT(1) == 'r')) {
-	int op1 = ctxt->comp->last;
-        SKIP(2);
-	SKIP_BLANKS;
-        xmlXPathCompAndExpr(ctxt);
-	CHECK_ERROR;
-	PUSH_BINARY_EXPR(XPATH_OP_OR, op1, ctxt->comp->last, 0, 0);
-	SKIP_BLANKS;
-    }
-    if ((sort) && (ctxt->comp->steps[ctxt->comp->last].op != XPATH_OP_VALUE)) {
-	/* more ops could be optimized too */
-	/*
-	* This is the main place to eliminate sorting for
-	* operations which don't require a sorted node-set.
-	* E.g. count().
-	*/
-	PUSH_UNARY_EXPR(XPATH_OP_SORT, ctxt->comp->last , 0, 0);
+        if (idx < path->nbSteps - 1) {
+            res = xmlXPathLazyVisit(ctxt, path, idx + 1, cur);
+            if (res != 0)
+                return(res);
+        } else if (path->mode == XPATH_LAZY_COUNT) {
+            path->count += 1;
+        } else {
+            path->result = cur;
+            return(1);
+        }
+
+        for (i = 0; i < step->nbPreds; i++) {
+            if ((step->maxPos[i] > 0) && (pos[i] >= step->maxPos[i]))
+                return(0);
+        }
     }
 
-    if (xpctxt != NULL)
-        xpctxt->depth -= 10;
+    return(0);
 }
 
-/**
- *  [8]   Predicate ::=   '[' PredicateExpr ']'
- *  [9]   PredicateExpr ::=   Expr
- *
- * Compile a predicate expression
+/*
+ * Try to evaluate a location path lazily. In XPATH_LAZY_ANY and
+ * XPATH_LAZY_FIRST mode, `path->result` is set to a selected node or
+ * NULL. In XPATH_LAZY_COUNT mode, `path->count` is set to the number
+ * of selected nodes.
  *
- * @param ctxt  the XPath Parser context
- * @param filter  act as a filter
+ * Returns 1 if the path was evaluated, 0 if it isn't supported and
+ * -1 in case of error.
  */
-static void
-xmlXPathCompPredicate(xmlXPathParserContextPtr ctxt, int filter) {
-    int op1 = ctxt->comp->last;
+static int
+xmlXPathLazyEval(xmlXPathParserContextPtr ctxt, xmlXPathStepOpPtr op,
+                 int mode, xmlXPathLazyPath *path) {
+    xmlXPathContextPtr xpctxt = ctxt->context;
+    xmlNodePtr oldNode;
+    int oldSize, oldPos, res;
 
-    SKIP_BLANKS;
-    if (CUR != '[') {
-	XP_ERROR(XPATH_INVALID_PREDICATE_ERROR);
+    if ((xpctxt->depth >= XPATH_MAX_RECURSION_DEPTH) ||
+        (!xmlXPathLazyInit(ctxt, op, path)))
+        return(0);
+    if ((mode == XPATH_LAZY_FIRST) && (!path->ordered))
+        return(0);
+    if (mode == XPATH_LAZY_COUNT) {
+        /* The name index is faster for counting */
+        if ((!path->distinct) || (xpctxt->flags & XML_XPATH_NAME_INDEX))
+            return(0);
     }
-    NEXT;
-    SKIP_BLANKS;
 
-    ctxt->comp->last = -1;
-    /*
-    * This call to xmlXPathCompileExpr() will deactivate sorting
-    * of the predicate result.
-    * TODO: Sorting is still activated for filters, since I'm not
-    *  sure if needed. Normally sorting should not be needed, since
-    *  a filter can only diminish the number of items in a sequence,
-    *  but won't change its order; so if the initial sequence is sorted,
-    *  subsequent sorting is not needed.
-    */
-    if (! filter)
-	xmlXPathCompileExpr(ctxt, 0);
-    else
-	xmlXPathCompileExpr(ctxt, 1);
-    CHECK_ERROR;
+    path->mode = mode;
+    path->result = NULL;
+    path->count = 0;
 
-    if (CUR != ']') {
-	XP_ERROR(XPATH_INVALID_PREDICATE_ERROR);
-    }
+    oldNode = xpctxt->node;
+    oldSize = xpctxt->contextSize;
+    oldPos = xpctxt->proximityPosition;
 
-    if (filter)
-	PUSH_BINARY_EXPR(XPATH_OP_FILTER, op1, ctxt->comp->last, 0, 0);
-    else
-	PUSH_BINARY_EXPR(XPATH_OP_PREDICATE, op1, ctxt->comp->last, 0, 0);
+    xpctxt->depth += 1;
+    res = xmlXPathLazyVisit(ctxt, path, 0, path->start);
+    xpctxt->depth -= 1;
 
-    NEXT;
-    SKIP_BLANKS;
+    xpctxt->node = oldNode;
+    xpctxt->contextSize = oldSize;
+    xpctxt->proximityPosition = oldPos;
+
+    return((res < 0) ? -1 : 1);
 }
 
-/**
- * ```
- * [7] NodeTest ::=   NameTest
- *		    | NodeType '(' ')'
- *		    | 'processing-instruction' '(' Literal ')'
- *
- * [37] NameTest ::=  '*'
- *		    | NCName ':' '*'
- *		    | QName
- * [38] NodeType ::= 'comment'
- *		   | 'text'
- *		   | 'processing-instruction'
- *		   | 'node'
- * ```
+/*
+ * Functions which only need the first node in document order of
+ * node-set arguments, or any node for boolean() and not().
  *
- * @param ctxt  the XPath Parser context
- * @param test  pointer to a xmlXPathTestVal
- * @param type  pointer to a xmlXPathTypeVal
- * @param prefix  placeholder for a possible name prefix
- * @param name  current name token (optional)
- * @returns the name found and updates `test`, `type` and `prefix` appropriately
+ * Returns the lazy evaluation mode for the arguments or -1.
  */
-static xmlChar *
-xmlXPathCompNodeTest(xmlXPathParserContextPtr ctxt, xmlXPathTestVal *test,
-	             xmlXPathTypeVal *type, xmlChar **prefix,
-		     xmlChar *name) {
-    int blanks;
-
-    if ((test == NULL) || (type == NULL) || (prefix == NULL)) {
-	return(NULL);
-    }
-    *type = (xmlXPathTypeVal) 0;
-    *test = (xmlXPathTestVal) 0;
-    *prefix = NULL;
-    SKIP_BLANKS;
-
-    if ((name == NULL) && (CUR == '*')) {
-	/*
-	 * All elements
-	 */
-	NEXT;
-	*test = NODE_TEST_ALL;
-	return(NULL);
-    }
-
-    if (name == NULL)
-	name = xmlXPathParseNCName(ctxt);
-    if (name == NULL) {
-	XP_ERRORNULL(XPATH_EXPR_ERROR);
-    }
-
-    blanks = IS_BLANK_CH(CUR);
-    SKIP_BLANKS;
-    if (CUR == '(') {
-	NEXT;
-	/*
-	 * NodeType or PI search
-	 */
-	if (xmlStrEqual(name, BAD_CAST "comment"))
-	    *type = NODE_TYPE_COMMENT;
-	else if (xmlStrEqual(name, BAD_CAST "node"))
-	    *type = NODE_TYPE_NODE;
-	else if (xmlStrEqual(name, BAD_CAST "processing-instruction"))
-	    *type = NODE_TYPE_PI;
-	else if (xmlStrEqual(name, BAD_CAST "text"))
-	    *type = NODE_TYPE_TEXT;
-	else {
-	    if (name != NULL)
-		xmlFree(name);
-	    XP_ERRORNULL(XPATH_EXPR_ERROR);
-	}
-
-	*test = NODE_TEST_TYPE;
+static int
+xmlXPathLazyArgMode(xmlXPathFunction func, int nargs) {
+    if (nargs <= 0)
+        return(-1);
+    if (func == xmlXPathCountFunction)
+        return((nargs == 1) ? XPATH_LAZY_COUNT : -1);
+    if ((func == xmlXPathBooleanFunction) || (func == xmlXPathNotFunction))
+        return(XPATH_LAZY_ANY);
+    if ((func == xmlXPathStringFunction) ||
+        (func == xmlXPathNumberFunction) ||
+        (func == xmlXPathStringLengthFunction) ||
+        (func == xmlXPathNormalizeFunction) ||
+        (func == xmlXPathNameFunction) ||
+        (func == xmlXPathLocalNameFunction) ||
+        (func == xmlXPathNamespaceURIFunction) ||
+        (func == xmlXPathConcatFunction) ||
+        (func == xmlXPathContainsFunction) ||
+        (func == xmlXPathStartsWithFunction) ||
+        (func == xmlXPathSubstringFunction) ||
+        (func == xmlXPathSubstringBeforeFunction) ||
+        (func == xmlXPathSubstringAfterFunction) ||
+        (func == xmlXPathTranslateFunction) ||
+        (func == xmlXPathFloorFunction) ||
+        (func == xmlXPathCeilingFunction) ||
+        (func == xmlXPathRoundFunction))
+        return(XPATH_LAZY_FIRST);
+    return(-1);
+}
 
-	SKIP_BLANKS;
-	if (*type == NODE_TYPE_PI) {
-	    /*
-	     * Specific case: search a PI by name.
-	     */
-	    if (name != NULL)
-		xmlFree(name);
-	    name = NULL;
-	    if (CUR != ')') {
-		name = xmlXPathParseLiteral(ctxt);
-		*test = NODE_TEST_PI;
-		SKIP_BLANKS;
-	    }
-	}
-	if (CUR != ')') {
-	    if (name != NULL)
-		xmlFree(name);
-	    XP_ERRORNULL(XPATH_UNCLOSED_ERROR);
-	}
-	NEXT;
-	return(name);
-    }
-    *test = NODE_TEST_NAME;
-    if ((!blanks) && (CUR == ':')) {
-	NEXT;
+/*
+ * Evaluate the arguments of a function call, replacing node-set
+ * arguments with a single node if possible.
+ */
+static int
+xmlXPathCompOpEvalLazyArgs(xmlXPathParserContextPtr ctxt,
+                           xmlXPathStepOpPtr op, int mode) {
+    xmlXPathCompExprPtr comp = ctxt->comp;
+    xmlXPathLazyPath path;
+    int total = 0, res;
 
-	/*
-	 * Since currently the parser context don't have a
-	 * namespace list associated:
-	 * The namespace name for this prefix can be computed
-	 * only at evaluation time. The compilation is done
-	 * outside of any context.
-	 */
-	*prefix = name;
+    if (op->op != XPATH_OP_ARG)
+        return(xmlXPathCompOpEval(ctxt, op));
 
-	if (CUR == '*') {
-	    /*
-	     * All elements
-	     */
-	    NEXT;
-	    *test = NODE_TEST_ALL;
-	    return(NULL);
-	}
+    if (ctxt->context->depth >= XPATH_MAX_RECURSION_DEPTH)
+        XP_ERROR0(XPATH_RECURSION_LIMIT_EXCEEDED);
+    ctxt->context->depth += 1;
 
-	name = xmlXPathParseNCName(ctxt);
-	if (name == NULL) {
-	    XP_ERRORNULL(XPATH_EXPR_ERROR);
-	}
+    if (op->ch1 != -1)
+        total += xmlXPathCompOpEvalLazyArgs(ctxt, &comp->steps[op->ch1],
+                                            mode);
+    if ((op->ch2 != -1) && (ctxt->error == XPATH_EXPRESSION_OK)) {
+        res = xmlXPathLazyEval(ctxt, &comp->steps[op->ch2], mode, &path);
+        if (res > 0)
+            xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt,
+                                                            path.result));
+        else if (res == 0)
+            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
     }
-    return(name);
+
+    ctxt->context->depth -= 1;
+    return(total);
 }
 
-/**
- * [6] AxisName ::=   'ancestor'
- *                  | 'ancestor-or-self'
- *                  | 'attribute'
- *                  | 'child'
- *                  | 'descendant'
- *                  | 'descendant-or-self'
- *                  | 'following'
- *                  | 'following-sibling'
- *                  | 'namespace'
- *                  | 'parent'
- *                  | 'preceding'
- *                  | 'preceding-sibling'
- *                  | 'self'
+/*
+ * Evaluate count() of a location path without building the node set.
  *
- * @param name  a preparsed name token
- * @returns the axis or 0
+ * Returns 1 if the result or an error was pushed, 0 otherwise.
  */
-static xmlXPathAxisVal
-xmlXPathIsAxisName(const xmlChar *name) {
-    xmlXPathAxisVal ret = (xmlXPathAxisVal) 0;
-    switch (name[0]) {
-	case 'a':
-	    if (xmlStrEqual(name, BAD_CAST "ancestor"))
-		ret = AXIS_ANCESTOR;
-	    if (xmlStrEqual(name, BAD_CAST "ancestor-or-self"))
-		ret = AXIS_ANCESTOR_OR_SELF;
-	    if (xmlStrEqual(name, BAD_CAST "attribute"))
-		ret = AXIS_ATTRIBUTE;
-	    break;
-	case 'c':
-	    if (xmlStrEqual(name, BAD_CAST "child"))
-		ret = AXIS_CHILD;
-	    break;
-	case 'd':
-	    if (xmlStrEqual(name, BAD_CAST "descendant"))
-		ret = AXIS_DESCENDANT;
-	    if (xmlStrEqual(name, BAD_CAST "descendant-or-self"))
-		ret = AXIS_DESCENDANT_OR_SELF;
-	    break;
-	case 'f':
-	    if (xmlStrEqual(name, BAD_CAST "following"))
-		ret = AXIS_FOLLOWING;
-	    if (xmlStrEqual(name, BAD_CAST "following-sibling"))
-		ret = AXIS_FOLLOWING_SIBLING;
-	    break;
-	case 'n':
-	    if (xmlStrEqual(name, BAD_CAST "namespace"))
-		ret = AXIS_NAMESPACE;
-	    break;
-	case 'p':
-	    if (xmlStrEqual(name, BAD_CAST "parent"))
-		ret = AXIS_PARENT;
-	    if (xmlStrEqual(name, BAD_CAST "preceding"))
-		ret = AXIS_PRECEDING;
-	    if (xmlStrEqual(name, BAD_CAST "preceding-sibling"))
-		ret = AXIS_PRECEDING_SIBLING;
-	    break;
-	case 's':
-	    if (xmlStrEqual(name, BAD_CAST "self"))
-		ret = AXIS_SELF;
-	    break;
-    }
-    return(ret);
+static int
+xmlXPathCountLazy(xmlXPathParserContextPtr ctxt, xmlXPathStepOpPtr op) {
+    xmlXPathCompExprPtr comp = ctxt->comp;
+    xmlXPathStepOpPtr arg;
+    xmlXPathLazyPath path;
+    int res;
+
+    if (op->ch1 == -1)
+        return(0);
+    arg = &comp->steps[op->ch1];
+    if ((arg->op != XPATH_OP_ARG) || (arg->ch1 != -1) || (arg->ch2 == -1))
+        return(0);
+
+    res = xmlXPathLazyEval(ctxt, &comp->steps[arg->ch2], XPATH_LAZY_COUNT,
+                           &path);
+    if (res > 0)
+        xmlXPathValuePush(ctxt, xmlXPathCacheNewFloat(ctxt, path.count));
+
+    return(res != 0);
 }
 
+static int
+xmlXPathCompOpEvalFilterFirst(xmlXPathParserContextPtr ctxt,
+			      xmlXPathStepOpPtr op, xmlNodePtr * first);
+
 /**
- * [4] Step ::=   AxisSpecifier NodeTest Predicate*
- *                  | AbbreviatedStep
- *
- * [12] AbbreviatedStep ::=   '.' | '..'
- *
- * [5] AxisSpecifier ::= AxisName '::'
- *                  | AbbreviatedAxisSpecifier
- *
- * [13] AbbreviatedAxisSpecifier ::= '@'?
- *
- * Modified for XPtr range support as:
- *
- *  [4xptr] Step ::= AxisSpecifier NodeTest Predicate*
- *                     | AbbreviatedStep
- *                     | 'range-to' '(' Expr ')' Predicate*
- *
- * Compile one step in a Location Path
+ * Evaluate the Precompiled XPath operation searching only the first
+ * element in document order
  *
- * @param ctxt  the XPath Parser context
+ * @param ctxt  the XPath parser context with the compiled expression
+ * @param op  an XPath compiled operation
+ * @param first  the first elem found so far
+ * @returns the number of examined objects.
  */
-static void
-xmlXPathCompStep(xmlXPathParserContextPtr ctxt) {
-    SKIP_BLANKS;
-    if ((CUR == '.') && (NXT(1) == '.')) {
-	SKIP(2);
-	SKIP_BLANKS;
-	PUSH_LONG_EXPR(XPATH_OP_COLLECT, AXIS_PARENT,
-		    NODE_TEST_TYPE, NODE_TYPE_NODE, NULL, NULL);
-    } else if (CUR == '.') {
-	NEXT;
-	SKIP_BLANKS;
-    } else {
-	xmlChar *name = NULL;
-	xmlChar *prefix = NULL;
-	xmlXPathTestVal test = (xmlXPathTestVal) 0;
-	xmlXPathAxisVal axis = (xmlXPathAxisVal) 0;
-	xmlXPathTypeVal type = (xmlXPathTypeVal) 0;
-	int op1;
+static int
+xmlXPathCompOpEvalFirst(xmlXPathParserContextPtr ctxt,
+                        xmlXPathStepOpPtr op, xmlNodePtr * first)
+{
+    int total = 0, cur;
+    xmlXPathCompExprPtr comp;
+    xmlXPathObjectPtr arg1, arg2;
 
-	if (CUR == '*') {
-	    axis = AXIS_CHILD;
-	} else {
-	    if (name == NULL)
-		name = xmlXPathParseNCName(ctxt);
-	    if (name != NULL) {
-		axis = xmlXPathIsAxisName(name);
-		if (axis != 0) {
-		    SKIP_BLANKS;
-		    if ((CUR == ':') && (NXT(1) == ':')) {
-			SKIP(2);
-			xmlFree(name);
-			name = NULL;
-		    } else {
-			/* an element name can conflict with an axis one :-\ */
-			axis = AXIS_CHILD;
-		    }
-		} else {
-		    axis = AXIS_CHILD;
-		}
-	    } else if (CUR == '@') {
-		NEXT;
-		axis = AXIS_ATTRIBUTE;
-	    } else {
-		axis = AXIS_CHILD;
-	    }
-	}
+    CHECK_ERROR0;
+    if (OP_LIMIT_EXCEEDED(ctxt, 1))
+        return(0);
+    if (ctxt->context->depth >= XPATH_MAX_RECURSION_DEPTH)
+        XP_ERROR0(XPATH_RECURSION_LIMIT_EXCEEDED);
+    ctxt->context->depth += 1;
+    comp = ctxt->comp;
 
-        if (ctxt->error != XPATH_EXPRESSION_OK) {
-            xmlFree(name);
-            return;
+    if ((op->op == XPATH_OP_SORT) || (op->op == XPATH_OP_COLLECT)) {
+        xmlXPathLazyPath path;
+        int res;
+
+        res = xmlXPathLazyEval(ctxt, op, XPATH_LAZY_FIRST, &path);
+        if (res != 0) {
+            if (res > 0)
+                xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt,
+                                                            path.result));
+            ctxt->context->depth -= 1;
+            return(total);
         }
+    }
 
-	name = xmlXPathCompNodeTest(ctxt, &test, &type, &prefix, name);
-	if (test == 0)
-	    return;
+    switch (op->op) {
+        case XPATH_OP_END:
+            break;
+        case XPATH_OP_UNION:
+            total =
+                xmlXPathCompOpEvalFirst(ctxt, &comp->steps[op->ch1],
+                                        first);
+	    CHECK_ERROR0;
+            if ((ctxt->value != NULL)
+                && (ctxt->value->type == XPATH_NODESET)
+                && (ctxt->value->nodesetval != NULL)
+                && (ctxt->value->nodesetval->nodeNr >= 1)) {
+                /*
+                 * limit tree traversing to first node in the result
+                 */
+		/*
+		* OPTIMIZE TODO: This implicitly sorts
+		*  the result, even if not needed. E.g. if the argument
+		*  of the count() function, no sorting is needed.
+		* OPTIMIZE TODO: How do we know if the node-list wasn't
+		*  already sorted?
+		*/
+		if (ctxt->value->nodesetval->nodeNr > 1)
+		    xmlXPathNodeSetSortCtxt(ctxt->context,
+                                            ctxt->value->nodesetval);
+                *first = ctxt->value->nodesetval->nodeTab[0];
+            }
+            cur =
+                xmlXPathCompOpEvalFirst(ctxt, &comp->steps[op->ch2],
+                                        first);
+	    CHECK_ERROR0;
 
-        if ((prefix != NULL) && (ctxt->context != NULL) &&
-	    (ctxt->context->flags & XML_XPATH_CHECKNS)) {
-	    if (xmlXPathNsLookup(ctxt->context, prefix) == NULL) {
-		xmlXPathErrFmt(ctxt, XPATH_UNDEF_PREFIX_ERROR,
-                               "Undefined namespace prefix: %s\n", prefix);
-	    }
-	}
+            arg2 = xmlXPathValuePop(ctxt);
+            arg1 = xmlXPathValuePop(ctxt);
+            if ((arg1 == NULL) || (arg1->type != XPATH_NODESET) ||
+                (arg2 == NULL) || (arg2->type != XPATH_NODESET)) {
+	        xmlXPathReleaseObject(ctxt->context, arg1);
+	        xmlXPathReleaseObject(ctxt->context, arg2);
+                XP_ERROR0(XPATH_INVALID_TYPE);
+            }
+            if ((ctxt->context->opLimit != 0) &&
+                (((arg1->nodesetval != NULL) &&
+                  (xmlXPathCheckOpLimit(ctxt,
+                                        arg1->nodesetval->nodeNr) < 0)) ||
+                 ((arg2->nodesetval != NULL) &&
+                  (xmlXPathCheckOpLimit(ctxt,
+                                        arg2->nodesetval->nodeNr) < 0)))) {
+	        xmlXPathReleaseObject(ctxt->context, arg1);
+	        xmlXPathReleaseObject(ctxt->context, arg2);
+                break;
+            }
 
-	op1 = ctxt->comp->last;
-	ctxt->comp->last = -1;
+            if ((arg2->nodesetval != NULL) &&
+                (arg2->nodesetval->nodeNr != 0)) {
+                arg1->nodesetval = xmlXPathNodeSetMerge(arg1->nodesetval,
+                                                        arg2->nodesetval);
+                if (arg1->nodesetval == NULL)
+                    xmlXPathPErrMemory(ctxt);
+            }
+            xmlXPathValuePush(ctxt, arg1);
+	    xmlXPathReleaseObject(ctxt->context, arg2);
+            total += cur;
+            break;
+        case XPATH_OP_ROOT:
+            xmlXPathRoot(ctxt);
+            break;
+        case XPATH_OP_NODE:
+            if (op->ch1 != -1)
+                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+	    CHECK_ERROR0;
+            if (op->ch2 != -1)
+                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
+	    CHECK_ERROR0;
+	    xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt,
+		ctxt->context->node));
+            break;
+        case XPATH_OP_COLLECT:{
+                if (op->ch1 == -1)
+                    break;
 
-	SKIP_BLANKS;
-	while (CUR == '[') {
-	    xmlXPathCompPredicate(ctxt, 0);
-	}
+                total = xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+		CHECK_ERROR0;
 
-        if (PUSH_FULL_EXPR(XPATH_OP_COLLECT, op1, ctxt->comp->last, axis,
-                           test, type, (void *)prefix, (void *)name) == -1) {
-            xmlFree(prefix);
-            xmlFree(name);
-        }
+                total += xmlXPathNodeCollectAndTest(ctxt, op, first, NULL, 0);
+                break;
+            }
+        case XPATH_OP_VALUE:
+            xmlXPathValuePush(ctxt, xmlXPathCacheObjectCopy(ctxt, op->value4));
+            break;
+        case XPATH_OP_SORT:
+            if (op->ch1 != -1)
+                total +=
+                    xmlXPathCompOpEvalFirst(ctxt, &comp->steps[op->ch1],
+                                            first);
+	    CHECK_ERROR0;
+            if ((ctxt->value != NULL)
+                && (ctxt->value->type == XPATH_NODESET)
+                && (ctxt->value->nodesetval != NULL)
+		&& (ctxt->value->nodesetval->nodeNr > 1))
+                xmlXPathNodeSetSortCtxt(ctxt->context,
+                                        ctxt->value->nodesetval);
+            break;
+#ifdef XP_OPTIMIZED_FILTER_FIRST
+	case XPATH_OP_FILTER:
+                total += xmlXPathCompOpEvalFilterFirst(ctxt, op, first);
+            break;
+#endif
+        default:
+            total += xmlXPathCompOpEval(ctxt, op);
+            break;
     }
+
+    ctxt->context->depth -= 1;
+    return(total);
 }
 
 /**
- *  [3]   RelativeLocationPath ::=   Step
- *                     | RelativeLocationPath '/' Step
- *                     | AbbreviatedRelativeLocationPath
- *  [11]  AbbreviatedRelativeLocationPath ::=   RelativeLocationPath '//' Step
- *
- * Compile a relative location path.
+ * Evaluate the Precompiled XPath operation searching only the last
+ * element in document order
  *
- * @param ctxt  the XPath Parser context
+ * @param ctxt  the XPath parser context with the compiled expression
+ * @param op  an XPath compiled operation
+ * @param last  the last elem found so far
+ * @returns the number of nodes traversed
  */
-static void
-xmlXPathCompRelativeLocationPath
-(xmlXPathParserContextPtr ctxt) {
-    SKIP_BLANKS;
-    if ((CUR == '/') && (NXT(1) == '/')) {
-	SKIP(2);
-	SKIP_BLANKS;
-	PUSH_LONG_EXPR(XPATH_OP_COLLECT, AXIS_DESCENDANT_OR_SELF,
-		         NODE_TEST_TYPE, NODE_TYPE_NODE, NULL, NULL);
-    } else if (CUR == '/') {
-	    NEXT;
-	SKIP_BLANKS;
-    }
-    xmlXPathCompStep(ctxt);
-    CHECK_ERROR;
-    SKIP_BLANKS;
-    while (CUR == '/') {
-	if ((CUR == '/') && (NXT(1) == '/')) {
-	    SKIP(2);
-	    SKIP_BLANKS;
-	    PUSH_LONG_EXPR(XPATH_OP_COLLECT, AXIS_DESCENDANT_OR_SELF,
-			     NODE_TEST_TYPE, NODE_TYPE_NODE, NULL, NULL);
-	    xmlXPathCompStep(ctxt);
-	} else if (CUR == '/') {
-	    NEXT;
-	    SKIP_BLANKS;
-	    xmlXPathCompStep(ctxt);
-	}
-	SKIP_BLANKS;
+static int
+xmlXPathCompOpEvalLast(xmlXPathParserContextPtr ctxt, xmlXPathStepOpPtr op,
+                       xmlNodePtr * last)
+{
+    int total = 0, cur;
+    xmlXPathCompExprPtr comp;
+    xmlXPathObjectPtr arg1, arg2;
+
+    CHECK_ERROR0;
+    if (OP_LIMIT_EXCEEDED(ctxt, 1))
+        return(0);
+    if (ctxt->context->depth >= XPATH_MAX_RECURSION_DEPTH)
+        XP_ERROR0(XPATH_RECURSION_LIMIT_EXCEEDED);
+    ctxt->context->depth += 1;
+    comp = ctxt->comp;
+    switch (op->op) {
+        case XPATH_OP_END:
+            break;
+        case XPATH_OP_UNION:
+            total =
+                xmlXPathCompOpEvalLast(ctxt, &comp->steps[op->ch1], last);
+	    CHECK_ERROR0;
+            if ((ctxt->value != NULL)
+                && (ctxt->value->type == XPATH_NODESET)
+                && (ctxt->value->nodesetval != NULL)
+                && (ctxt->value->nodesetval->nodeNr >= 1)) {
+                /*
+                 * limit tree traversing to first node in the result
+                 */
+		if (ctxt->value->nodesetval->nodeNr > 1)
+		    xmlXPathNodeSetSortCtxt(ctxt->context,
+                                            ctxt->value->nodesetval);
+                *last =
+                    ctxt->value->nodesetval->nodeTab[ctxt->value->
+                                                     nodesetval->nodeNr -
+                                                     1];
+            }
+            cur =
+                xmlXPathCompOpEvalLast(ctxt, &comp->steps[op->ch2], last);
+	    CHECK_ERROR0;
+            if ((ctxt->value != NULL)
+                && (ctxt->value->type == XPATH_NODESET)
+                && (ctxt->value->nodesetval != NULL)
+                && (ctxt->value->nodesetval->nodeNr >= 1)) { /* TODO: NOP ? */
+            }
+
+            arg2 = xmlXPathValuePop(ctxt);
+            arg1 = xmlXPathValuePop(ctxt);
+            if ((arg1 == NULL) || (arg1->type != XPATH_NODESET) ||
+                (arg2 == NULL) || (arg2->type != XPATH_NODESET)) {
+	        xmlXPathReleaseObject(ctxt->context, arg1);
+	        xmlXPathReleaseObject(ctxt->context, arg2);
+                XP_ERROR0(XPATH_INVALID_TYPE);
+            }
+            if ((ctxt->context->opLimit != 0) &&
+                (((arg1->nodesetval != NULL) &&
+                  (xmlXPathCheckOpLimit(ctxt,
+                                        arg1->nodesetval->nodeNr) < 0)) ||
+                 ((arg2->nodesetval != NULL) &&
+                  (xmlXPathCheckOpLimit(ctxt,
+                                        arg2->nodesetval->nodeNr) < 0)))) {
+	        xmlXPathReleaseObject(ctxt->context, arg1);
+	        xmlXPathReleaseObject(ctxt->context, arg2);
+                break;
+            }
+
+            if ((arg2->nodesetval != NULL) &&
+                (arg2->nodesetval->nodeNr != 0)) {
+                arg1->nodesetval = xmlXPathNodeSetMerge(arg1->nodesetval,
+                                                        arg2->nodesetval);
+                if (arg1->nodesetval == NULL)
+                    xmlXPathPErrMemory(ctxt);
+            }
+            xmlXPathValuePush(ctxt, arg1);
+	    xmlXPathReleaseObject(ctxt->context, arg2);
+            total += cur;
+            break;
+        case XPATH_OP_ROOT:
+            xmlXPathRoot(ctxt);
+            break;
+        case XPATH_OP_NODE:
+            if (op->ch1 != -1)
+                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+	    CHECK_ERROR0;
+            if (op->ch2 != -1)
+                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
+	    CHECK_ERROR0;
+	    xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt,
+		ctxt->context->node));
+            break;
+        case XPATH_OP_COLLECT:{
+                if (op->ch1 == -1)
+                    break;
+
+                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+		CHECK_ERROR0;
+
+                total += xmlXPathNodeCollectAndTest(ctxt, op, NULL, last, 0);
+                break;
+            }
+        case XPATH_OP_VALUE:
+            xmlXPathValuePush(ctxt, xmlXPathCacheObjectCopy(ctxt, op->value4));
+            break;
+        case XPATH_OP_SORT:
+            if (op->ch1 != -1)
+                total +=
+                    xmlXPathCompOpEvalLast(ctxt, &comp->steps[op->ch1],
+                                           last);
+	    CHECK_ERROR0;
+            if ((ctxt->value != NULL)
+                && (ctxt->value->type == XPATH_NODESET)
+                && (ctxt->value->nodesetval != NULL)
+		&& (ctxt->value->nodesetval->nodeNr > 1))
+                xmlXPathNodeSetSortCtxt(ctxt->context,
+                                        ctxt->value->nodesetval);
+            break;
+        default:
+            total += xmlXPathCompOpEval(ctxt, op);
+            break;
     }
+
+    ctxt->context->depth -= 1;
+    return (total);
 }
 
-/**
- *  [1]   LocationPath ::=   RelativeLocationPath
- *                     | AbsoluteLocationPath
- *  [2]   AbsoluteLocationPath ::=   '/' RelativeLocationPath?
- *                     | AbbreviatedAbsoluteLocationPath
- *  [10]   AbbreviatedAbsoluteLocationPath ::=
- *                           '//' RelativeLocationPath
- *
- * Compile a location path
- *
- * @param ctxt  the XPath Parser context
- */
-static void
-xmlXPathCompLocationPath(xmlXPathParserContextPtr ctxt) {
-    SKIP_BLANKS;
-    if (CUR != '/') {
-        xmlXPathCompRelativeLocationPath(ctxt);
-    } else {
-	while (CUR == '/') {
-	    if ((CUR == '/') && (NXT(1) == '/')) {
-		SKIP(2);
-		SKIP_BLANKS;
-		PUSH_LONG_EXPR(XPATH_OP_COLLECT, AXIS_DESCENDANT_OR_SELF,
-			     NODE_TEST_TYPE, NODE_TYPE_NODE, NULL, NULL);
-		xmlXPathCompRelativeLocationPath(ctxt);
-	    } else if (CUR == '/') {
-		NEXT;
-		SKIP_BLANKS;
-		if ((CUR != 0) &&
-		    ((IS_ASCII_LETTER(CUR)) || (CUR >= 0x80) ||
-                     (CUR == '_') || (CUR == '.') ||
-		     (CUR == '@') || (CUR == '*')))
-		    xmlXPathCompRelativeLocationPath(ctxt);
+#ifdef XP_OPTIMIZED_FILTER_FIRST
+static int
+xmlXPathCompOpEvalFilterFirst(xmlXPathParserContextPtr ctxt,
+			      xmlXPathStepOpPtr op, xmlNodePtr * first)
+{
+    int total = 0;
+    xmlXPathCompExprPtr comp;
+    xmlXPathObjectPtr obj;
+    xmlNodeSetPtr set;
+
+    CHECK_ERROR0;
+    comp = ctxt->comp;
+    /*
+    * Optimization for ()[last()] selection i.e. the last elem
+    */
+    if ((op->ch1 != -1) && (op->ch2 != -1) &&
+	(comp->steps[op->ch1].op == XPATH_OP_SORT) &&
+	(comp->steps[op->ch2].op == XPATH_OP_SORT)) {
+	int f = comp->steps[op->ch2].ch1;
+
+	if ((f != -1) &&
+	    (comp->steps[f].op == XPATH_OP_FUNCTION) &&
+	    (comp->steps[f].value5 == NULL) &&
+	    (comp->steps[f].value == 0) &&
+	    (comp->steps[f].value4 != NULL) &&
+	    (xmlStrEqual
+	    (comp->steps[f].value4, BAD_CAST "last"))) {
+	    xmlNodePtr last = NULL;
+
+	    total +=
+		xmlXPathCompOpEvalLast(ctxt,
+		    &comp->steps[op->ch1],
+		    &last);
+	    CHECK_ERROR0;
+	    /*
+	    * The nodeset should be in document order,
+	    * Keep only the last value
+	    */
+	    if ((ctxt->value != NULL) &&
+		(ctxt->value->type == XPATH_NODESET) &&
+		(ctxt->value->nodesetval != NULL) &&
+		(ctxt->value->nodesetval->nodeTab != NULL) &&
+		(ctxt->value->nodesetval->nodeNr > 1)) {
+                xmlXPathNodeSetKeepLast(ctxt->value->nodesetval);
+		*first = *(ctxt->value->nodesetval->nodeTab);
 	    }
-	    CHECK_ERROR;
+	    return (total);
 	}
     }
-}
 
-/************************************************************************
- *									*
- *		XPath precompiled expression evaluation			*
- *									*
- ************************************************************************/
+    if (op->ch1 != -1)
+	total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+    CHECK_ERROR0;
+    if (op->ch2 == -1)
+	return (total);
+    if (ctxt->value == NULL)
+	return (total);
 
-static int
-xmlXPathCompOpEval(xmlXPathParserContextPtr ctxt, xmlXPathStepOpPtr op);
+    /*
+     * In case of errors, xmlXPathNodeSetFilter can pop additional nodes from
+     * the stack. We have to temporarily remove the nodeset object from the
+     * stack to avoid freeing it prematurely.
+     */
+    CHECK_TYPE0(XPATH_NODESET);
+    obj = xmlXPathValuePop(ctxt);
+    set = obj->nodesetval;
+    if (set != NULL) {
+        xmlXPathNodeSetFilter(ctxt, set, op->ch2, 1, 1, 1);
+        if (set->nodeNr > 0)
+            *first = set->nodeTab[0];
+    }
+    xmlXPathValuePush(ctxt, obj);
+
+    return (total);
+}
+#endif /* XP_OPTIMIZED_FILTER_FIRST */
 
 /**
- * Filter a node set, keeping only nodes for which the predicate expression
- * matches. Afterwards, keep only nodes between minPos and maxPos in the
- * filtered result.
+ * Evaluate the Precompiled XPath operation
  *
- * @param ctxt  the XPath Parser context
- * @param set  the node set to filter
- * @param filterOpIndex  the index of the predicate/filter op
- * @param minPos  minimum position in the filtered set (1-based)
- * @param maxPos  maximum position in the filtered set (1-based)
- * @param hasNsNodes  true if the node set may contain namespace nodes
+ * @param ctxt  the XPath parser context with the compiled expression
+ * @param op  an XPath compiled operation
+ * @returns the number of nodes traversed
  */
-static void
-xmlXPathNodeSetFilter(xmlXPathParserContextPtr ctxt,
-		      xmlNodeSetPtr set,
-		      int filterOpIndex,
-                      int minPos, int maxPos,
-		      int hasNsNodes)
+static int
+xmlXPathCompOpEval(xmlXPathParserContextPtr ctxt, xmlXPathStepOpPtr op)
 {
-    xmlXPathContextPtr xpctxt;
-    xmlNodePtr oldnode;
-    xmlDocPtr olddoc;
-    xmlXPathStepOpPtr filterOp;
-    int oldcs, oldpp;
-    int i, j, pos;
+    int total = 0;
+    int equal, ret;
+    xmlXPathCompExprPtr comp;
+    xmlXPathObjectPtr arg1, arg2;
+
+    CHECK_ERROR0;
+    if (OP_LIMIT_EXCEEDED(ctxt, 1))
+        return(0);
+    if (ctxt->context->depth >= XPATH_MAX_RECURSION_DEPTH)
+        XP_ERROR0(XPATH_RECURSION_LIMIT_EXCEEDED);
+    ctxt->context->depth += 1;
+    comp = ctxt->comp;
+    switch (op->op) {
+        case XPATH_OP_END:
+            break;
+        case XPATH_OP_AND:
+            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+	    CHECK_ERROR0;
+            xmlXPathBooleanFunction(ctxt, 1);
+            if ((ctxt->value == NULL) || (ctxt->value->boolval == 0))
+                break;
+            arg2 = xmlXPathValuePop(ctxt);
+            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
+	    if (ctxt->error) {
+		xmlXPathFreeObject(arg2);
+		break;
+	    }
+            xmlXPathBooleanFunction(ctxt, 1);
+            if (ctxt->value != NULL)
+                ctxt->value->boolval &= arg2->boolval;
+	    xmlXPathReleaseObject(ctxt->context, arg2);
+            break;
+        case XPATH_OP_OR:
+            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+	    CHECK_ERROR0;
+            xmlXPathBooleanFunction(ctxt, 1);
+            if ((ctxt->value == NULL) || (ctxt->value->boolval == 1))
+                break;
+            arg2 = xmlXPathValuePop(ctxt);
+            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
+	    if (ctxt->error) {
+		xmlXPathFreeObject(arg2);
+		break;
+	    }
+            xmlXPathBooleanFunction(ctxt, 1);
+            if (ctxt->value != NULL)
+                ctxt->value->boolval |= arg2->boolval;
+	    xmlXPathReleaseObject(ctxt->context, arg2);
+            break;
+        case XPATH_OP_EQUAL:
+            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+	    CHECK_ERROR0;
+            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
+	    CHECK_ERROR0;
+	    if (op->value)
+		equal = xmlXPathEqualValues(ctxt);
+	    else
+		equal = xmlXPathNotEqualValues(ctxt);
+	    xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, equal));
+            break;
+        case XPATH_OP_CMP:
+            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+	    CHECK_ERROR0;
+            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
+	    CHECK_ERROR0;
+            ret = xmlXPathCompareValues(ctxt, op->value, op->value2);
+	    xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, ret));
+            break;
+        case XPATH_OP_PLUS:
+            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+	    CHECK_ERROR0;
+            if (op->ch2 != -1) {
+                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
+	    }
+	    CHECK_ERROR0;
+            if (op->value == 0)
+                xmlXPathSubValues(ctxt);
+            else if (op->value == 1)
+                xmlXPathAddValues(ctxt);
+            else if (op->value == 2)
+                xmlXPathValueFlipSign(ctxt);
+            else if (op->value == 3) {
+                CAST_TO_NUMBER;
+                CHECK_TYPE0(XPATH_NUMBER);
+            }
+            break;
+        case XPATH_OP_MULT:
+            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+	    CHECK_ERROR0;
+            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
+	    CHECK_ERROR0;
+            if (op->value == 0)
+                xmlXPathMultValues(ctxt);
+            else if (op->value == 1)
+                xmlXPathDivValues(ctxt);
+            else if (op->value == 2)
+                xmlXPathModValues(ctxt);
+            break;
+        case XPATH_OP_UNION:
+            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+	    CHECK_ERROR0;
+            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
+	    CHECK_ERROR0;
+
+            arg2 = xmlXPathValuePop(ctxt);
+            arg1 = xmlXPathValuePop(ctxt);
+            if ((arg1 == NULL) || (arg1->type != XPATH_NODESET) ||
+                (arg2 == NULL) || (arg2->type != XPATH_NODESET)) {
+	        xmlXPathReleaseObject(ctxt->context, arg1);
+	        xmlXPathReleaseObject(ctxt->context, arg2);
+                XP_ERROR0(XPATH_INVALID_TYPE);
+            }
+            if ((ctxt->context->opLimit != 0) &&
+                (((arg1->nodesetval != NULL) &&
+                  (xmlXPathCheckOpLimit(ctxt,
+                                        arg1->nodesetval->nodeNr) < 0)) ||
+                 ((arg2->nodesetval != NULL) &&
+                  (xmlXPathCheckOpLimit(ctxt,
+                                        arg2->nodesetval->nodeNr) < 0)))) {
+	        xmlXPathReleaseObject(ctxt->context, arg1);
+	        xmlXPathReleaseObject(ctxt->context, arg2);
+                break;
+            }
+
+	    if (((arg2->nodesetval != NULL) &&
+		 (arg2->nodesetval->nodeNr != 0)))
+	    {
+                xmlNodeSetPtr set1 = arg1->nodesetval;
+                xmlNodeSetPtr set2 = arg2->nodesetval;
+
+                /*
+                 * Checking each node for duplicates is quadratic. Merge
+                 * large sets in document order instead.
+                 */
+                if ((set1 != NULL) &&
+                    (set1->nodeNr >= XP_UNION_MERGE_MIN) &&
+                    (set2->nodeNr >= XP_UNION_MERGE_MIN) &&
+                    (!xmlXPathNodeSetHasNs(set1)) &&
+                    (!xmlXPathNodeSetHasNs(set2)))
+                    arg1->nodesetval = xmlXPathNodeSetMergeSorted(
+                            ctxt->context, set1, set2);
+                else
+                    arg1->nodesetval = xmlXPathNodeSetMerge(set1, set2);
+                if (arg1->nodesetval == NULL)
+                    xmlXPathPErrMemory(ctxt);
+	    }
+
+            xmlXPathValuePush(ctxt, arg1);
+	    xmlXPathReleaseObject(ctxt->context, arg2);
+            break;
+        case XPATH_OP_ROOT:
+            xmlXPathRoot(ctxt);
+            break;
+        case XPATH_OP_NODE:
+            if (op->ch1 != -1)
+                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+	    CHECK_ERROR0;
+            if (op->ch2 != -1)
+                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
+	    CHECK_ERROR0;
+	    xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt,
+                                                    ctxt->context->node));
+            break;
+        case XPATH_OP_COLLECT:{
+                if (op->ch1 == -1)
+                    break;
 
-    if ((set == NULL) || (set->nodeNr == 0))
-        return;
+                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+		CHECK_ERROR0;
 
-    /*
-    * Check if the node set contains a sufficient number of nodes for
-    * the requested range.
-    */
-    if (set->nodeNr < minPos) {
-        xmlXPathNodeSetClear(set, hasNsNodes);
-        return;
-    }
+                total += xmlXPathNodeCollectAndTest(ctxt, op, NULL, NULL, 0);
+                break;
+            }
+        case XPATH_OP_VALUE:
+            xmlXPathValuePush(ctxt, xmlXPathCacheObjectCopy(ctxt, op->value4));
+            break;
+        case XPATH_OP_VARIABLE:{
+		xmlXPathObjectPtr val;
 
-    xpctxt = ctxt->context;
-    oldnode = xpctxt->node;
-    olddoc = xpctxt->doc;
-    oldcs = xpctxt->contextSize;
-    oldpp = xpctxt->proximityPosition;
-    filterOp = &ctxt->comp->steps[filterOpIndex];
+                if (op->ch1 != -1)
+                    total +=
+                        xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+                if (op->value5 == NULL) {
+		    val = xmlXPathVariableLookup(ctxt->context, op->value4);
+		    if (val == NULL) {
+                        xmlXPathErrFmt(ctxt, XPATH_UNDEF_VARIABLE_ERROR,
+                                       "Undefined variable: %s\n", op->value4);
+                        return 0;
+                    }
+                    xmlXPathValuePush(ctxt, val);
+		} else {
+                    const xmlChar *URI;
 
-    xpctxt->contextSize = set->nodeNr;
+                    URI = xmlXPathNsLookup(ctxt->context, op->value5);
+                    if (URI == NULL) {
+                        xmlXPathErrFmt(ctxt, XPATH_UNDEF_PREFIX_ERROR,
+                                       "Undefined namespace prefix: %s\n",
+                                       op->value5);
+                        return 0;
+                    }
+		    val = xmlXPathVariableLookupNS(ctxt->context,
+                                                       op->value4, URI);
+		    if (val == NULL) {
+                        xmlXPathErrFmt(ctxt, XPATH_UNDEF_VARIABLE_ERROR,
+                                       "Undefined variable: %s:%s\n",
+                                       op->value5, op->value4);
+                        return 0;
+                    }
+                    xmlXPathValuePush(ctxt, val);
+                }
+                break;
+            }
+        case XPATH_OP_FUNCTION:{
+                xmlXPathFunction func;
+                const xmlChar *oldFunc, *oldFuncURI;
+		int i, mode;
+                int frame;
 
-    for (i = 0, j = 0, pos = 1; i < set->nodeNr; i++) {
-        xmlNodePtr node = set->nodeTab[i];
-        int res;
+                if (op->cache != NULL)
+                    func = op->cache;
+                else {
+                    const xmlChar *URI = NULL;
 
-        xpctxt->node = node;
-        xpctxt->proximityPosition = i + 1;
+                    if (op->value5 == NULL) {
+                        func = xmlXPathFunctionLookup(ctxt->context,
+                                                      op->value4);
+                        if (func == NULL) {
+                            xmlXPathErrFmt(ctxt, XPATH_UNKNOWN_FUNC_ERROR,
+                                           "Unregistered function: %s\n",
+                                           op->value4);
+                            return 0;
+                        }
+                    } else {
+                        URI = xmlXPathNsLookup(ctxt->context, op->value5);
+                        if (URI == NULL) {
+                            xmlXPathErrFmt(ctxt, XPATH_UNDEF_PREFIX_ERROR,
+                                           "Undefined namespace prefix: %s\n",
+                                           op->value5);
+                            return 0;
+                        }
+                        func = xmlXPathFunctionLookupNS(ctxt->context,
+                                                        op->value4, URI);
+                        if (func == NULL) {
+                            xmlXPathErrFmt(ctxt, XPATH_UNKNOWN_FUNC_ERROR,
+                                           "Unregistered function: %s:%s\n",
+                                           op->value5, op->value4);
+                            return 0;
+                        }
+                    }
+                    op->cache = func;
+                    op->cacheURI = (void *) URI;
+                }
 
-        /*
-        * Also set the xpath document in case things like
-        * key() are evaluated in the predicate.
-        *
-        * TODO: Get real doc for namespace nodes.
-        */
-        if ((node->type != XML_NAMESPACE_DECL) &&
-            (node->doc != NULL))
-            xpctxt->doc = node->doc;
+                frame = ctxt->valueNr;
+                mode = xmlXPathLazyArgMode(func, op->value);
+                if (mode == XPATH_LAZY_COUNT) {
+                    if (xmlXPathCountLazy(ctxt, op) != 0)
+                        break;
+                    mode = -1;
+                }
+                if (op->ch1 != -1) {
+                    if (mode >= 0)
+                        total += xmlXPathCompOpEvalLazyArgs(ctxt,
+                                &comp->steps[op->ch1], mode);
+                    else
+                        total +=
+                            xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+                    if (ctxt->error != XPATH_EXPRESSION_OK)
+                        break;
+                }
+		if (ctxt->valueNr < frame + op->value)
+		    XP_ERROR0(XPATH_INVALID_OPERAND);
+		for (i = 0; i < op->value; i++) {
+		    if (ctxt->valueTab[(ctxt->valueNr - 1) - i] == NULL)
+			XP_ERROR0(XPATH_INVALID_OPERAND);
+                }
+                oldFunc = ctxt->context->function;
+                oldFuncURI = ctxt->context->functionURI;
+                ctxt->context->function = op->value4;
+                ctxt->context->functionURI = op->cacheURI;
+                func(ctxt, op->value);
+                ctxt->context->function = oldFunc;
+                ctxt->context->functionURI = oldFuncURI;
+                if ((ctxt->error == XPATH_EXPRESSION_OK) &&
+                    (ctxt->valueNr != frame + 1))
+                    XP_ERROR0(XPATH_STACK_ERROR);
+                break;
+            }
+        case XPATH_OP_ARG:
+            if (op->ch1 != -1) {
+                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+	        CHECK_ERROR0;
+            }
+            if (op->ch2 != -1) {
+                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
+	        CHECK_ERROR0;
+	    }
+            break;
+        case XPATH_OP_PREDICATE:
+        case XPATH_OP_FILTER:{
+                xmlXPathObjectPtr obj;
+                xmlNodeSetPtr set;
 
-        res = xmlXPathCompOpEvalToBoolean(ctxt, filterOp, 1);
+                /*
+                 * Optimization for ()[1] selection i.e. the first elem
+                 */
+                if ((op->ch1 != -1) && (op->ch2 != -1) &&
+#ifdef XP_OPTIMIZED_FILTER_FIRST
+		    /*
+		    * FILTER TODO: Can we assume that the inner processing
+		    *  will result in an ordered list if we have an
+		    *  XPATH_OP_FILTER?
+		    *  What about an additional field or flag on
+		    *  xmlXPathObject like @sorted ? This way we wouldn't need
+		    *  to assume anything, so it would be more robust and
+		    *  easier to optimize.
+		    */
+                    ((comp->steps[op->ch1].op == XPATH_OP_SORT) || /* 18 */
+		     (comp->steps[op->ch1].op == XPATH_OP_FILTER)) && /* 17 */
+#else
+		    (comp->steps[op->ch1].op == XPATH_OP_SORT) &&
+#endif
+                    (comp->steps[op->ch2].op == XPATH_OP_VALUE)) { /* 12 */
+                    xmlXPathObjectPtr val;
 
-        if (ctxt->error != XPATH_EXPRESSION_OK)
-            break;
-        if (res < 0) {
-            /* Shouldn't happen */
-            xmlXPathErr(ctxt, XPATH_EXPR_ERROR);
-            break;
-        }
+                    val = comp->steps[op->ch2].value4;
+                    if ((val != NULL) && (val->type == XPATH_NUMBER) &&
+                        (val->floatval == 1.0)) {
+                        xmlNodePtr first = NULL;
 
-        if ((res != 0) && ((pos >= minPos) && (pos <= maxPos))) {
-            if (i != j) {
-                set->nodeTab[j] = node;
-                set->nodeTab[i] = NULL;
-            }
+                        total +=
+                            xmlXPathCompOpEvalFirst(ctxt,
+                                                    &comp->steps[op->ch1],
+                                                    &first);
+			CHECK_ERROR0;
+                        /*
+                         * The nodeset should be in document order,
+                         * Keep only the first value
+                         */
+                        if ((ctxt->value != NULL) &&
+                            (ctxt->value->type == XPATH_NODESET) &&
+                            (ctxt->value->nodesetval != NULL) &&
+                            (ctxt->value->nodesetval->nodeNr > 1))
+                            xmlXPathNodeSetClearFromPos(ctxt->value->nodesetval,
+                                                        1, 1);
+                        break;
+                    }
+                }
+                /*
+                 * Optimization for ()[last()] selection i.e. the last elem
+                 */
+                if ((op->ch1 != -1) && (op->ch2 != -1) &&
+                    (comp->steps[op->ch1].op == XPATH_OP_SORT) &&
+                    (comp->steps[op->ch2].op == XPATH_OP_SORT)) {
+                    int f = comp->steps[op->ch2].ch1;
 
-            j += 1;
-        } else {
-            /* Remove the entry from the initial node set. */
-            set->nodeTab[i] = NULL;
-            if (node->type == XML_NAMESPACE_DECL)
-                xmlXPathNodeSetFreeNs((xmlNsPtr) node);
-        }
+                    if ((f != -1) &&
+                        (comp->steps[f].op == XPATH_OP_FUNCTION) &&
+                        (comp->steps[f].value5 == NULL) &&
+                        (comp->steps[f].value == 0) &&
+                        (comp->steps[f].value4 != NULL) &&
+                        (xmlStrEqual
+                         (comp->steps[f].value4, BAD_CAST "last"))) {
+                        xmlNodePtr last = NULL;
+
+                        total +=
+                            xmlXPathCompOpEvalLast(ctxt,
+                                                   &comp->steps[op->ch1],
+                                                   &last);
+			CHECK_ERROR0;
+                        /*
+                         * The nodeset should be in document order,
+                         * Keep only the last value
+                         */
+                        if ((ctxt->value != NULL) &&
+                            (ctxt->value->type == XPATH_NODESET) &&
+                            (ctxt->value->nodesetval != NULL) &&
+                            (ctxt->value->nodesetval->nodeTab != NULL) &&
+                            (ctxt->value->nodesetval->nodeNr > 1))
+                            xmlXPathNodeSetKeepLast(ctxt->value->nodesetval);
+                        break;
+                    }
+                }
+		/*
+		* Process inner predicates first.
+		* Example "index[parent::book][1]":
+		* ...
+		*   PREDICATE   <-- we are here "[1]"
+		*     PREDICATE <-- process "[parent::book]" first
+		*       SORT
+		*         COLLECT  'parent' 'name' 'node' book
+		*           NODE
+		*     ELEM Object is a number : 1
+		*/
+                if (op->ch1 != -1)
+                    total +=
+                        xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+		CHECK_ERROR0;
+                if (op->ch2 == -1)
+                    break;
+                if (ctxt->value == NULL)
+                    break;
 
-        if (res != 0) {
-            if (pos == maxPos) {
-                i += 1;
+                /*
+                 * In case of errors, xmlXPathNodeSetFilter can pop additional
+                 * nodes from the stack. We have to temporarily remove the
+                 * nodeset object from the stack to avoid freeing it
+                 * prematurely.
+                 */
+                CHECK_TYPE0(XPATH_NODESET);
+                obj = xmlXPathValuePop(ctxt);
+                set = obj->nodesetval;
+                if (set != NULL)
+                    xmlXPathNodeSetFilter(ctxt, set, op->ch2,
+                                          1, set->nodeNr, 1);
+                xmlXPathValuePush(ctxt, obj);
                 break;
             }
-
-            pos += 1;
-        }
-    }
-
-    /* Free remaining nodes. */
-    if (hasNsNodes) {
-        for (; i < set->nodeNr; i++) {
-            xmlNodePtr node = set->nodeTab[i];
-            if ((node != NULL) && (node->type == XML_NAMESPACE_DECL))
-                xmlXPathNodeSetFreeNs((xmlNsPtr) node);
-        }
-    }
-
-    set->nodeNr = j;
-
-    /* If too many elements were removed, shrink table to preserve memory. */
-    if ((set->nodeMax > XML_NODESET_DEFAULT) &&
-        (set->nodeNr < set->nodeMax / 2)) {
-        xmlNodePtr *tmp;
-        int nodeMax = set->nodeNr;
-
-        if (nodeMax < XML_NODESET_DEFAULT)
-            nodeMax = XML_NODESET_DEFAULT;
-        tmp = (xmlNodePtr *) xmlRealloc(set->nodeTab,
-                nodeMax * sizeof(xmlNodePtr));
-        if (tmp == NULL) {
-            xmlXPathPErrMemory(ctxt);
-        } else {
-            set->nodeTab = tmp;
-            set->nodeMax = nodeMax;
-        }
+        case XPATH_OP_SORT:
+            if (op->ch1 != -1)
+                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
+	    CHECK_ERROR0;
+            if ((ctxt->value != NULL) &&
+                (ctxt->value->type == XPATH_NODESET) &&
+                (ctxt->value->nodesetval != NULL) &&
+		(ctxt->value->nodesetval->nodeNr > 1))
+	    {
+                xmlXPathNodeSetSortCtxt(ctxt->context,
+                                        ctxt->value->nodesetval);
+	    }
+            break;
+        default:
+            XP_ERROR0(XPATH_INVALID_OPERAND);
+            break;
     }
 
-    xpctxt->node = oldnode;
-    xpctxt->doc = olddoc;
-    xpctxt->contextSize = oldcs;
-    xpctxt->proximityPosition = oldpp;
+    ctxt->context->depth -= 1;
+    return (total);
 }
 
 /**
- * Filter a node set, keeping only nodes for which the sequence of predicate
- * expressions matches. Afterwards, keep only nodes between minPos and maxPos
- * in the filtered result.
+ * Evaluates if the expression evaluates to true.
  *
- * @param ctxt  the XPath Parser context
- * @param op  the predicate op
- * @param set  the node set to filter
- * @param minPos  minimum position in the filtered set (1-based)
- * @param maxPos  maximum position in the filtered set (1-based)
- * @param hasNsNodes  true if the node set may contain namespace nodes
+ * @param ctxt  the XPath parser context
+ * @param op  the step operation
+ * @param isPredicate  whether a predicate is evaluated
+ * @returns 1 if true, 0 if false and -1 on API or internal errors.
  */
-static void
-xmlXPathCompOpEvalPredicate(xmlXPathParserContextPtr ctxt,
-			    xmlXPathStepOpPtr op,
-			    xmlNodeSetPtr set,
-                            int minPos, int maxPos,
-			    int hasNsNodes)
-{
-    if (op->ch1 != -1) {
-	xmlXPathCompExprPtr comp = ctxt->comp;
-	/*
-	* Process inner predicates first.
-	*/
-	if (comp->steps[op->ch1].op != XPATH_OP_PREDICATE) {
-            XP_ERROR(XPATH_INVALID_OPERAND);
-	}
-        if (ctxt->context->depth >= XPATH_MAX_RECURSION_DEPTH)
-            XP_ERROR(XPATH_RECURSION_LIMIT_EXCEEDED);
-        ctxt->context->depth += 1;
-	xmlXPathCompOpEvalPredicate(ctxt, &comp->steps[op->ch1], set,
-                                    1, set->nodeNr, hasNsNodes);
-        ctxt->context->depth -= 1;
-	CHECK_ERROR;
-    }
-
-    if (op->ch2 != -1)
-        xmlXPathNodeSetFilter(ctxt, set, op->ch2, minPos, maxPos, hasNsNodes);
-}
-
 static int
-xmlXPathIsPositionalPredicate(xmlXPathParserContextPtr ctxt,
+xmlXPathCompOpEvalToBoolean(xmlXPathParserContextPtr ctxt,
 			    xmlXPathStepOpPtr op,
-			    int *maxPos)
+			    int isPredicate)
 {
+    xmlXPathObjectPtr resObj = NULL;
 
-    xmlXPathStepOpPtr exprOp;
-
-    /*
-    * BIG NOTE: This is not intended for XPATH_OP_FILTER yet!
-    */
+start:
+    if (OP_LIMIT_EXCEEDED(ctxt, 1))
+        return(0);
+    /* comp = ctxt->comp; */
+    switch (op->op) {
+        case XPATH_OP_END:
+            return (0);
+	case XPATH_OP_VALUE:
+	    resObj = (xmlXPathObjectPtr) op->value4;
+	    if (isPredicate)
+		return(xmlXPathEvaluatePredicateResult(ctxt, resObj));
+	    return(xmlXPathCastToBoolean(resObj));
+	case XPATH_OP_SORT:
+	    /*
+	    * We don't need sorting for boolean results. Skip this one.
+	    */
+            if (op->ch1 != -1) {
+		op = &ctxt->comp->steps[op->ch1];
+		goto start;
+	    }
+	    return(0);
+	case XPATH_OP_COLLECT: {
+            xmlXPathLazyPath path;
+            int res;
 
-    /*
-    * If not -1, then ch1 will point to:
-    * 1) For predicates (XPATH_OP_PREDICATE):
-    *    - an inner predicate operator
-    * 2) For filters (XPATH_OP_FILTER):
-    *    - an inner filter operator OR
-    *    - an expression selecting the node set.
-    *      E.g. "key('a', 'b')" or "(//foo | //bar)".
-    */
-    if ((op->op != XPATH_OP_PREDICATE) && (op->op != XPATH_OP_FILTER))
-	return(0);
+	    if (op->ch1 == -1)
+		return(0);
 
-    if (op->ch2 != -1) {
-	exprOp = &ctxt->comp->steps[op->ch2];
-    } else
-	return(0);
+            res = xmlXPathLazyEval(ctxt, op, XPATH_LAZY_ANY, &path);
+            if (res < 0)
+                return(-1);
+            if (res > 0)
+                return(path.result != NULL);
 
-    if ((exprOp != NULL) &&
-	(exprOp->op == XPATH_OP_VALUE) &&
-	(exprOp->value4 != NULL) &&
-	(((xmlXPathObjectPtr) exprOp->value4)->type == XPATH_NUMBER))
-    {
-        double floatval = ((xmlXPathObjectPtr) exprOp->value4)->floatval;
+            xmlXPathCompOpEval(ctxt, &ctxt->comp->steps[op->ch1]);
+	    if (ctxt->error != XPATH_EXPRESSION_OK)
+		return(-1);
 
-	/*
-	* We have a "[n]" predicate here.
-	* TODO: Unfortunately this simplistic test here is not
-	* able to detect a position() predicate in compound
-	* expressions like "[@attr = 'a" and position() = 1],
-	* and even not the usage of position() in
-	* "[position() = 1]"; thus - obviously - a position-range,
-	* like it "[position() < 5]", is also not detected.
-	* Maybe we could rewrite the AST to ease the optimization.
-	*/
+            xmlXPathNodeCollectAndTest(ctxt, op, NULL, NULL, 1);
+	    if (ctxt->error != XPATH_EXPRESSION_OK)
+		return(-1);
 
-        if ((floatval > INT_MIN) && (floatval < INT_MAX)) {
-	    *maxPos = (int) floatval;
-            if (floatval == (double) *maxPos)
-                return(1);
+	    resObj = xmlXPathValuePop(ctxt);
+	    if (resObj == NULL)
+		return(-1);
+	    break;
         }
-    }
-    return(0);
-}
+	default:
+	    /*
+	    * Fallback to call xmlXPathCompOpEval().
+	    */
+	    xmlXPathCompOpEval(ctxt, op);
+	    if (ctxt->error != XPATH_EXPRESSION_OK)
+		return(-1);
 
-static int
-xmlXPathNodeCollectAndTest(xmlXPathParserContextPtr ctxt,
-                           xmlXPathStepOpPtr op,
-			   xmlNodePtr * first, xmlNodePtr * last,
-			   int toBool)
-{
+	    resObj = xmlXPathValuePop(ctxt);
+	    if (resObj == NULL)
+		return(-1);
+	    break;
+    }
 
-#define XP_TEST_HIT \
-    if (hasAxisRange != 0) { \
-	if (++pos == maxPos) { \
-	    if (addNode(seq, cur) < 0) \
-	        xmlXPathPErrMemory(ctxt); \
-	    goto axis_range_end; } \
-    } else { \
-	if (addNode(seq, cur) < 0) \
-	    xmlXPathPErrMemory(ctxt); \
-	if (breakOnFirstHit) goto first_hit; }
+    if (resObj) {
+	int res;
 
-#define XP_TEST_HIT_NS \
-    if (hasAxisRange != 0) { \
-	if (++pos == maxPos) { \
-	    hasNsNodes = 1; \
-	    if (xmlXPathNodeSetAddNs(seq, xpctxt->node, (xmlNsPtr) cur) < 0) \
-	        xmlXPathPErrMemory(ctxt); \
-	goto axis_range_end; } \
-    } else { \
-	hasNsNodes = 1; \
-	if (xmlXPathNodeSetAddNs(seq, xpctxt->node, (xmlNsPtr) cur) < 0) \
-	    xmlXPathPErrMemory(ctxt); \
-	if (breakOnFirstHit) goto first_hit; }
+	if (resObj->type == XPATH_BOOLEAN) {
+	    res = resObj->boolval;
+	} else if (isPredicate) {
+	    /*
+	    * For predicates a result of type "number" is handled
+	    * differently:
+	    * SPEC XPath 1.0:
+	    * "If the result is a number, the result will be converted
+	    *  to true if the number is equal to the context position
+	    *  and will be converted to false otherwise;"
+	    */
+	    res = xmlXPathEvaluatePredicateResult(ctxt, resObj);
+	} else {
+	    res = xmlXPathCastToBoolean(resObj);
+	}
+	xmlXPathReleaseObject(ctxt->context, resObj);
+	return(res);
+    }
 
-    xmlXPathAxisVal axis = (xmlXPathAxisVal) op->value;
-    xmlXPathTestVal test = (xmlXPathTestVal) op->value2;
-    xmlXPathTypeVal type = (xmlXPathTypeVal) op->value3;
-    const xmlChar *prefix = op->value4;
-    const xmlChar *name = op->value5;
-    const xmlChar *URI = NULL;
+    return(0);
+}
 
-    int total = 0, hasNsNodes = 0;
-    /* The popped object holding the context nodes */
-    xmlXPathObjectPtr obj;
-    /* The set of context nodes for the node tests */
-    xmlNodeSetPtr contextSeq;
-    int contextIdx;
-    xmlNodePtr contextNode;
-    /* The final resulting node set wrt to all context nodes */
-    xmlNodeSetPtr outSeq;
-    /*
-    * The temporary resulting node set wrt 1 context node.
-    * Used to feed predicate evaluation.
-    */
-    xmlNodeSetPtr seq;
-    xmlNodePtr cur;
-    /* First predicate operator */
-    xmlXPathStepOpPtr predOp;
-    int maxPos; /* The requested position() (when a "[n]" predicate) */
-    int hasPredicateRange, hasAxisRange, pos;
-    int breakOnFirstHit;
+#ifdef XPATH_STREAMING
+/**
+ * Evaluate the Precompiled Streamable XPath expression in the given context.
+ *
+ * @param pctxt  the XPath parser context with the compiled expression
+ */
+static int
+xmlXPathRunStreamEval(xmlXPathParserContextPtr pctxt, xmlPatternPtr comp,
+		      xmlXPathObjectPtr *resultSeq, int toBool)
+{
+    int max_depth, min_depth;
+    int from_root;
+    int ret, depth;
+    int eval_all_nodes;
+    xmlNodePtr cur = NULL, limit = NULL;
+    xmlStreamCtxtPtr patstream = NULL;
+    xmlXPathContextPtr ctxt = pctxt->context;
 
-    xmlXPathTraversalFunction next = NULL;
-    int (*addNode) (xmlNodeSetPtr, xmlNodePtr);
-    xmlXPathNodeSetMergeFunction mergeAndClear;
-    xmlNodePtr oldContextNode;
-    xmlXPathContextPtr xpctxt = ctxt->context;
+    if ((ctxt == NULL) || (comp == NULL))
+        return(-1);
+    max_depth = xmlPatternMaxDepth(comp);
+    if (max_depth == -1)
+        return(-1);
+    if (max_depth == -2)
+        max_depth = 10000;
+    min_depth = xmlPatternMinDepth(comp);
+    if (min_depth == -1)
+        return(-1);
+    from_root = xmlPatternFromRoot(comp);
+    if (from_root < 0)
+        return(-1);
 
+    if (! toBool) {
+	if (resultSeq == NULL)
+	    return(-1);
+	*resultSeq = xmlXPathCacheNewNodeSet(pctxt, NULL);
+	if (*resultSeq == NULL)
+	    return(-1);
+    }
 
-    CHECK_TYPE0(XPATH_NODESET);
-    obj = xmlXPathValuePop(ctxt);
     /*
-    * Setup namespaces.
-    */
-    if (prefix != NULL) {
-        URI = xmlXPathNsLookup(xpctxt, prefix);
-        if (URI == NULL) {
-	    xmlXPathReleaseObject(xpctxt, obj);
-            xmlXPathErrFmt(ctxt, XPATH_UNDEF_PREFIX_ERROR,
-                           "Undefined namespace prefix: %s\n", prefix);
-            return 0;
+     * handle the special cases of "/" amd "." being matched
+     */
+    if (min_depth == 0) {
+        int res;
+
+	if (from_root) {
+	    /* Select "/" */
+	    if (toBool)
+		return(1);
+            res = xmlXPathNodeSetAddUnique((*resultSeq)->nodesetval,
+                                           (xmlNodePtr) ctxt->doc);
+	} else {
+	    /* Select "self::node()" */
+	    if (toBool)
+		return(1);
+            res = xmlXPathNodeSetAddUnique((*resultSeq)->nodesetval,
+                                           ctxt->node);
 	}
-    }
-    /*
-    * Setup axis.
-    *
-    * MAYBE FUTURE TODO: merging optimizations:
-    * - If the nodes to be traversed wrt to the initial nodes and
-    *   the current axis cannot overlap, then we could avoid searching
-    *   for duplicates during the merge.
-    *   But the question is how/when to evaluate if they cannot overlap.
-    *   Example: if we know that for two initial nodes, the one is
-    *   not in the ancestor-or-self axis of the other, then we could safely
-    *   avoid a duplicate-aware merge, if the axis to be traversed is e.g.
-    *   the descendant-or-self axis.
-    */
-    mergeAndClear = xmlXPathNodeSetMergeAndClear;
-    switch (axis) {
-        case AXIS_ANCESTOR:
-            first = NULL;
-            next = xmlXPathNextAncestor;
-            break;
-        case AXIS_ANCESTOR_OR_SELF:
-            first = NULL;
-            next = xmlXPathNextAncestorOrSelf;
-            break;
-        case AXIS_ATTRIBUTE:
-            first = NULL;
-	    last = NULL;
-            next = xmlXPathNextAttribute;
-	    mergeAndClear = xmlXPathNodeSetMergeAndClearNoDupls;
-            break;
-        case AXIS_CHILD:
-	    last = NULL;
-	    if (((test == NODE_TEST_NAME) || (test == NODE_TEST_ALL)) &&
-		(type == NODE_TYPE_NODE))
-	    {
-		/*
-		* Optimization if an element node type is 'element'.
-		*/
-		next = xmlXPathNextChildElement;
-	    } else
-		next = xmlXPathNextChild;
-	    mergeAndClear = xmlXPathNodeSetMergeAndClearNoDupls;
-            break;
-        case AXIS_DESCENDANT:
-	    last = NULL;
-            next = xmlXPathNextDescendant;
-            break;
-        case AXIS_DESCENDANT_OR_SELF:
-	    last = NULL;
-            next = xmlXPathNextDescendantOrSelf;
-            break;
-        case AXIS_FOLLOWING:
-	    last = NULL;
-            next = xmlXPathNextFollowing;
-            break;
-        case AXIS_FOLLOWING_SIBLING:
-	    last = NULL;
-            next = xmlXPathNextFollowingSibling;
-            break;
-        case AXIS_NAMESPACE:
-            first = NULL;
-	    last = NULL;
-            next = (xmlXPathTraversalFunction) xmlXPathNextNamespace;
-	    mergeAndClear = xmlXPathNodeSetMergeAndClearNoDupls;
-            break;
-        case AXIS_PARENT:
-            first = NULL;
-            next = xmlXPathNextParent;
-            break;
-        case AXIS_PRECEDING:
-            first = NULL;
-            next = xmlXPathNextPrecedingInternal;
-            break;
-        case AXIS_PRECEDING_SIBLING:
-            first = NULL;
-            next = xmlXPathNextPrecedingSibling;
-            break;
-        case AXIS_SELF:
-            first = NULL;
-	    last = NULL;
-            next = xmlXPathNextSelf;
-	    mergeAndClear = xmlXPathNodeSetMergeAndClearNoDupls;
-            break;
-    }
 
-    if (next == NULL) {
-	xmlXPathReleaseObject(xpctxt, obj);
-        return(0);
+        if (res < 0)
+            xmlXPathPErrMemory(pctxt);
     }
-    contextSeq = obj->nodesetval;
-    if ((contextSeq == NULL) || (contextSeq->nodeNr <= 0)) {
-        xmlXPathValuePush(ctxt, obj);
-        return(0);
+    if (max_depth == 0) {
+	return(0);
     }
-    /*
-    * Predicate optimization ---------------------------------------------
-    * If this step has a last predicate, which contains a position(),
-    * then we'll optimize (although not exactly "position()", but only
-    * the  short-hand form, i.e., "[n]".
-    *
-    * Example - expression "/foo[parent::bar][1]":
-    *
-    * COLLECT 'child' 'name' 'node' foo    -- op (we are here)
-    *   ROOT                               -- op->ch1
-    *   PREDICATE                          -- op->ch2 (predOp)
-    *     PREDICATE                          -- predOp->ch1 = [parent::bar]
-    *       SORT
-    *         COLLECT  'parent' 'name' 'node' bar
-    *           NODE
-    *     ELEM Object is a number : 1        -- predOp->ch2 = [1]
-    *
-    */
-    maxPos = 0;
-    predOp = NULL;
-    hasPredicateRange = 0;
-    hasAxisRange = 0;
-    if (op->ch2 != -1) {
-	/*
-	* There's at least one predicate. 16 == XPATH_OP_PREDICATE
-	*/
-	predOp = &ctxt->comp->steps[op->ch2];
-	if (xmlXPathIsPositionalPredicate(ctxt, predOp, &maxPos)) {
-	    if (predOp->ch1 != -1) {
-		/*
-		* Use the next inner predicate operator.
-		*/
-		predOp = &ctxt->comp->steps[predOp->ch1];
-		hasPredicateRange = 1;
-	    } else {
-		/*
-		* There's no other predicate than the [n] predicate.
-		*/
-		predOp = NULL;
-		hasAxisRange = 1;
-	    }
+
+    if (from_root) {
+        cur = (xmlNodePtr)ctxt->doc;
+    } else if (ctxt->node != NULL) {
+        switch (ctxt->node->type) {
+            case XML_ELEMENT_NODE:
+            case XML_DOCUMENT_NODE:
+            case XML_DOCUMENT_FRAG_NODE:
+            case XML_HTML_DOCUMENT_NODE:
+	        cur = ctxt->node;
+		break;
+            case XML_ATTRIBUTE_NODE:
+            case XML_TEXT_NODE:
+            case XML_CDATA_SECTION_NODE:
+            case XML_ENTITY_REF_NODE:
+            case XML_ENTITY_NODE:
+            case XML_PI_NODE:
+            case XML_COMMENT_NODE:
+            case XML_NOTATION_NODE:
+            case XML_DTD_NODE:
+            case XML_DOCUMENT_TYPE_NODE:
+            case XML_ELEMENT_DECL:
+            case XML_ATTRIBUTE_DECL:
+            case XML_ENTITY_DECL:
+            case XML_NAMESPACE_DECL:
+            case XML_XINCLUDE_START:
+            case XML_XINCLUDE_END:
+		break;
 	}
+	limit = cur;
+    }
+    if (cur == NULL) {
+        return(0);
     }
-    breakOnFirstHit = ((toBool) && (predOp == NULL)) ? 1 : 0;
-    /*
-    * Axis traversal -----------------------------------------------------
-    */
-    /*
-     * 2.3 Node Tests
-     *  - For the attribute axis, the principal node type is attribute.
-     *  - For the namespace axis, the principal node type is namespace.
-     *  - For other axes, the principal node type is element.
-     *
-     * A node test * is true for any node of the
-     * principal node type. For example, child::* will
-     * select all element children of the context node
-     */
-    oldContextNode = xpctxt->node;
-    addNode = xmlXPathNodeSetAddUnique;
-    outSeq = NULL;
-    seq = NULL;
-    contextNode = NULL;
-    contextIdx = 0;
 
+    patstream = xmlPatternGetStreamCtxt(comp);
+    if (patstream == NULL) {
+        xmlXPathPErrMemory(pctxt);
+	return(-1);
+    }
 
-    while (((contextIdx < contextSeq->nodeNr) || (contextNode != NULL)) &&
-           (ctxt->error == XPATH_EXPRESSION_OK)) {
-	xpctxt->node = contextSeq->nodeTab[contextIdx++];
+    eval_all_nodes = xmlStreamWantsAnyNode(patstream);
+    if ((eval_all_nodes) && (XML_LAZY_DOC(cur->doc)))
+        xmlLazyMaterialize(cur, XML_LAZY_CONTENT | XML_LAZY_RECURSIVE);
 
-	if (seq == NULL) {
-	    seq = xmlXPathNodeSetCreate(NULL);
-	    if (seq == NULL) {
-                xmlXPathPErrMemory(ctxt);
-		total = 0;
-		goto error;
-	    }
+    if (from_root) {
+	ret = xmlStreamPush(patstream, NULL, NULL);
+	if (ret < 0) {
+	} else if (ret == 1) {
+	    if (toBool)
+		goto return_1;
+	    if (xmlXPathNodeSetAddUnique((*resultSeq)->nodesetval, cur) < 0)
+                xmlXPathPErrMemory(pctxt);
 	}
-	/*
-	* Traverse the axis and test the nodes.
-	*/
-	pos = 0;
-	cur = NULL;
-	hasNsNodes = 0;
-        do {
-            if (OP_LIMIT_EXCEEDED(ctxt, 1))
-                goto error;
-
-            cur = next(ctxt, cur);
-            if (cur == NULL)
-                break;
+    }
+    depth = 0;
+    goto scan_children;
+next_node:
+    do {
+        if (ctxt->opLimit != 0) {
+            if (ctxt->opCount >= ctxt->opLimit) {
+                xmlXPathErr(ctxt, XPATH_RECURSION_LIMIT_EXCEEDED);
+                xmlFreeStreamCtxt(patstream);
+                return(-1);
+            }
+            ctxt->opCount++;
+        }
 
-	    /*
-	    * QUESTION TODO: What does the "first" and "last" stuff do?
-	    */
-            if ((first != NULL) && (*first != NULL)) {
-		if (*first == cur)
-		    break;
-		if (((total % 256) == 0) &&
-#ifdef XP_OPTIMIZED_NON_ELEM_COMPARISON
-		    (xmlXPathCmpNodesExt(*first, cur) >= 0))
-#else
-		    (xmlXPathCmpNodes(*first, cur) >= 0))
-#endif
-		{
+	switch (cur->type) {
+	    case XML_ELEMENT_NODE:
+	    case XML_TEXT_NODE:
+	    case XML_CDATA_SECTION_NODE:
+	    case XML_COMMENT_NODE:
+	    case XML_PI_NODE:
+		if (cur->type == XML_ELEMENT_NODE) {
+		    ret = xmlStreamPush(patstream, cur->name,
+				(cur->ns ? cur->ns->href : NULL));
+		} else if (eval_all_nodes)
+		    ret = xmlStreamPushNode(patstream, NULL, NULL, cur->type);
+		else
 		    break;
+
+		if (ret < 0) {
+		    xmlXPathPErrMemory(pctxt);
+		} else if (ret == 1) {
+		    if (toBool)
+			goto return_1;
+		    if (xmlXPathNodeSetAddUnique((*resultSeq)->nodesetval,
+                                                 cur) < 0)
+                        xmlXPathPErrMemory(pctxt);
 		}
-	    }
-	    if ((last != NULL) && (*last != NULL)) {
-		if (*last == cur)
-		    break;
-		if (((total % 256) == 0) &&
-#ifdef XP_OPTIMIZED_NON_ELEM_COMPARISON
-		    (xmlXPathCmpNodesExt(cur, *last) >= 0))
-#else
-		    (xmlXPathCmpNodes(cur, *last) >= 0))
-#endif
-		{
-		    break;
+		if ((cur->children == NULL) || (depth >= max_depth)) {
+		    ret = xmlStreamPop(patstream);
+		    while (cur->next != NULL) {
+			cur = cur->next;
+			if ((cur->type != XML_ENTITY_DECL) &&
+			    (cur->type != XML_DTD_NODE))
+			    goto next_node;
+		    }
 		}
+	    default:
+		break;
+	}
+
+scan_children:
+	if (cur->type == XML_NAMESPACE_DECL) break;
+	if ((cur->children != NULL) && (depth < max_depth)) {
+	    /*
+	     * Do not descend on entities declarations
+	     */
+	    if (cur->children->type != XML_ENTITY_DECL) {
+		cur = cur->children;
+		depth++;
+		/*
+		 * Skip DTDs
+		 */
+		if (cur->type != XML_DTD_NODE)
+		    continue;
 	    }
+	}
 
-            total++;
+	if (cur == limit)
+	    break;
 
-	    switch (test) {
-                case NODE_TEST_NONE:
-		    total = 0;
-		    goto error;
-                case NODE_TEST_TYPE:
-		    if (type == NODE_TYPE_NODE) {
-			switch (cur->type) {
-			    case XML_DOCUMENT_NODE:
-			    case XML_HTML_DOCUMENT_NODE:
-			    case XML_ELEMENT_NODE:
-			    case XML_ATTRIBUTE_NODE:
-			    case XML_PI_NODE:
-			    case XML_COMMENT_NODE:
-			    case XML_CDATA_SECTION_NODE:
-			    case XML_TEXT_NODE:
-				XP_TEST_HIT
-				break;
-			    case XML_NAMESPACE_DECL: {
-				if (axis == AXIS_NAMESPACE) {
-				    XP_TEST_HIT_NS
-				} else {
-	                            hasNsNodes = 1;
-				    XP_TEST_HIT
-				}
-				break;
-                            }
-			    default:
-				break;
-			}
-		    } else if (cur->type == (xmlElementType) type) {
-			if (cur->type == XML_NAMESPACE_DECL)
-			    XP_TEST_HIT_NS
-			else
-			    XP_TEST_HIT
-		    } else if ((type == NODE_TYPE_TEXT) &&
-			 (cur->type == XML_CDATA_SECTION_NODE))
-		    {
-			XP_TEST_HIT
-		    }
-		    break;
-                case NODE_TEST_PI:
-                    if ((cur->type == XML_PI_NODE) &&
-                        ((name == NULL) || xmlStrEqual(name, cur->name)))
-		    {
-			XP_TEST_HIT
-                    }
-                    break;
-                case NODE_TEST_ALL:
-                    if (axis == AXIS_ATTRIBUTE) {
-                        if (cur->type == XML_ATTRIBUTE_NODE)
-			{
-                            if (prefix == NULL)
-			    {
-				XP_TEST_HIT
-                            } else if ((cur->ns != NULL) &&
-				(xmlStrEqual(URI, cur->ns->href)))
-			    {
-				XP_TEST_HIT
-                            }
-                        }
-                    } else if (axis == AXIS_NAMESPACE) {
-                        if (cur->type == XML_NAMESPACE_DECL)
-			{
-			    XP_TEST_HIT_NS
-                        }
-                    } else {
-                        if (cur->type == XML_ELEMENT_NODE) {
-                            if (prefix == NULL)
-			    {
-				XP_TEST_HIT
+	while (cur->next != NULL) {
+	    cur = cur->next;
+	    if ((cur->type != XML_ENTITY_DECL) &&
+		(cur->type != XML_DTD_NODE))
+		goto next_node;
+	}
+
+	do {
+	    cur = cur->parent;
+	    depth--;
+	    if ((cur == NULL) || (cur == limit) ||
+                (cur->type == XML_DOCUMENT_NODE))
+	        goto done;
+	    if (cur->type == XML_ELEMENT_NODE) {
+		ret = xmlStreamPop(patstream);
+	    } else if ((eval_all_nodes) &&
+		((cur->type == XML_TEXT_NODE) ||
+		 (cur->type == XML_CDATA_SECTION_NODE) ||
+		 (cur->type == XML_COMMENT_NODE) ||
+		 (cur->type == XML_PI_NODE)))
+	    {
+		ret = xmlStreamPop(patstream);
+	    }
+	    if (cur->next != NULL) {
+		cur = cur->next;
+		break;
+	    }
+	} while (cur != NULL);
+
+    } while ((cur != NULL) && (depth >= 0));
 
-                            } else if ((cur->ns != NULL) &&
-				(xmlStrEqual(URI, cur->ns->href)))
-			    {
-				XP_TEST_HIT
-                            }
-                        }
-                    }
-                    break;
-                case NODE_TEST_NS:{
-                        /* TODO */
-                        break;
-                    }
-                case NODE_TEST_NAME:
-                    if (axis == AXIS_ATTRIBUTE) {
-                        if (cur->type != XML_ATTRIBUTE_NODE)
-			    break;
-		    } else if (axis == AXIS_NAMESPACE) {
-                        if (cur->type != XML_NAMESPACE_DECL)
-			    break;
-		    } else {
-		        if (cur->type != XML_ELEMENT_NODE)
-			    break;
-		    }
-                    switch (cur->type) {
-                        case XML_ELEMENT_NODE:
-                            if (xmlStrEqual(name, cur->name)) {
-                                if (prefix == NULL) {
-                                    if (cur->ns == NULL)
-				    {
-					XP_TEST_HIT
-                                    }
-                                } else {
-                                    if ((cur->ns != NULL) &&
-                                        (xmlStrEqual(URI, cur->ns->href)))
-				    {
-					XP_TEST_HIT
-                                    }
-                                }
-                            }
-                            break;
-                        case XML_ATTRIBUTE_NODE:{
-                                xmlAttrPtr attr = (xmlAttrPtr) cur;
+done:
 
-                                if (xmlStrEqual(name, attr->name)) {
-                                    if (prefix == NULL) {
-                                        if ((attr->ns == NULL) ||
-                                            (attr->ns->prefix == NULL))
-					{
-					    XP_TEST_HIT
-                                        }
-                                    } else {
-                                        if ((attr->ns != NULL) &&
-                                            (xmlStrEqual(URI,
-					      attr->ns->href)))
-					{
-					    XP_TEST_HIT
-                                        }
-                                    }
-                                }
-                                break;
-                            }
-                        case XML_NAMESPACE_DECL:
-                            if (cur->type == XML_NAMESPACE_DECL) {
-                                xmlNsPtr ns = (xmlNsPtr) cur;
+    if (patstream)
+	xmlFreeStreamCtxt(patstream);
+    return(0);
 
-                                if ((ns->prefix != NULL) && (name != NULL)
-                                    && (xmlStrEqual(ns->prefix, name)))
-				{
-				    XP_TEST_HIT_NS
-                                }
-                            }
-                            break;
-                        default:
-                            break;
-                    }
-                    break;
-	    } /* switch(test) */
-        } while ((cur != NULL) && (ctxt->error == XPATH_EXPRESSION_OK));
+return_1:
+    if (patstream)
+	xmlFreeStreamCtxt(patstream);
+    return(1);
+}
+#endif /* XPATH_STREAMING */
 
-	goto apply_predicates;
+/************************************************************************
+ *									*
+ *			Specialized evaluation				*
+ *									*
+ ************************************************************************/
 
-axis_range_end: /* ----------------------------------------------------- */
-	/*
-	* We have a "/foo[n]", and position() = n was reached.
-	* Note that we can have as well "/foo/::parent::foo[1]", so
-	* a duplicate-aware merge is still needed.
-	* Merge with the result.
-	*/
-	if (outSeq == NULL) {
-	    outSeq = seq;
-	    seq = NULL;
-	} else {
-	    outSeq = mergeAndClear(outSeq, seq);
-            if (outSeq == NULL)
-                xmlXPathPErrMemory(ctxt);
-        }
-	/*
-	* Break if only a true/false result was requested.
-	*/
-	if (toBool)
-	    break;
-	continue;
+/*
+ * xmlXPathCompiledSpecialize turns the ops of a compiled expression
+ * into a tree of conditions and paths, each evaluated by a function
+ * chosen for its shape when the tree is built. Intermediate values
+ * are plain strings, numbers and node pointers instead of XPath
+ * objects on the value stack. String values of attributes and text
+ * nodes are read in place, and comparisons with literals are done
+ * directly on them.
+ *
+ * Supported are location paths without filter expressions whose
+ * predicates are constant positions or conditions made of existence
+ * tests, comparisons of a path with a literal, and, or, not(),
+ * boolean(), true(), false(), contains() and starts-with(). At the
+ * top, such a path, a condition, count() or string() of a path can
+ * be specialized.
+ */
 
-first_hit: /* ---------------------------------------------------------- */
-	/*
-	* Break if only a true/false result was requested and
-	* no predicates existed and a node test succeeded.
-	*/
-	if (outSeq == NULL) {
-	    outSeq = seq;
-	    seq = NULL;
-	} else {
-	    outSeq = mergeAndClear(outSeq, seq);
-            if (outSeq == NULL)
-                xmlXPathPErrMemory(ctxt);
-        }
-	break;
+#define XPATH_SPEC_MAX_STEPS 16
+#define XPATH_SPEC_MAX_PREDS 4
+#define XPATH_SPEC_MAX_URIS 16
+#define XPATH_SPEC_MAX_DEPTH 20
 
-apply_predicates: /* --------------------------------------------------- */
-        if (ctxt->error != XPATH_EXPRESSION_OK)
-	    goto error;
+typedef enum {
+    XPATH_SPEC_NODESET = 0,
+    XPATH_SPEC_BOOLEAN,
+    XPATH_SPEC_COUNT,
+    XPATH_SPEC_STRING
+} xmlXPathSpecType;
 
-        /*
-	* Apply predicates.
-	*/
-        if ((predOp != NULL) && (seq->nodeNr > 0)) {
-	    /*
-	    * E.g. when we have a "/foo[some expression][n]".
-	    */
-	    /*
-	    * QUESTION TODO: The old predicate evaluation took into
-	    *  account location-sets.
-	    *  (E.g. ctxt->value->type == XPATH_LOCATIONSET)
-	    *  Do we expect such a set here?
-	    *  All what I learned now from the evaluation semantics
-	    *  does not indicate that a location-set will be processed
-	    *  here, so this looks OK.
-	    */
-	    /*
-	    * Iterate over all predicates, starting with the outermost
-	    * predicate.
-	    * TODO: Problem: we cannot execute the inner predicates first
-	    *  since we cannot go back *up* the operator tree!
-	    *  Options we have:
-	    *  1) Use of recursive functions (like is it currently done
-	    *     via xmlXPathCompOpEval())
-	    *  2) Add a predicate evaluation information stack to the
-	    *     context struct
-	    *  3) Change the way the operators are linked; we need a
-	    *     "parent" field on xmlXPathStepOp
-	    *
-	    * For the moment, I'll try to solve this with a recursive
-	    * function: xmlXPathCompOpEvalPredicate().
-	    */
-	    if (hasPredicateRange != 0)
-		xmlXPathCompOpEvalPredicate(ctxt, predOp, seq, maxPos, maxPos,
-					    hasNsNodes);
-	    else
-		xmlXPathCompOpEvalPredicate(ctxt, predOp, seq, 1, seq->nodeNr,
-					    hasNsNodes);
+typedef enum {
+    XPATH_SPEC_EQ = 0,
+    XPATH_SPEC_NE,
+    XPATH_SPEC_LT,
+    XPATH_SPEC_LE,
+    XPATH_SPEC_GT,
+    XPATH_SPEC_GE
+} xmlXPathSpecCmp;
+
+typedef struct _xmlXPathSpecCtxt xmlXPathSpecCtxt;
+typedef struct _xmlXPathSpecStep xmlXPathSpecStep;
+typedef struct _xmlXPathSpecPath xmlXPathSpecPath;
+typedef struct _xmlXPathSpecCond xmlXPathSpecCond;
 
-	    if (ctxt->error != XPATH_EXPRESSION_OK) {
-		total = 0;
-		goto error;
-	    }
-        }
+/*
+ * Receives a node selected by a step. Returns 1 to stop, 0 to
+ * continue and -1 in case of error.
+ */
+typedef int (*xmlXPathSpecNodeFunc)(xmlXPathSpecCtxt *sctxt, void *data,
+                                    xmlNodePtr node);
 
-        if (seq->nodeNr > 0) {
-	    /*
-	    * Add to result set.
-	    */
-	    if (outSeq == NULL) {
-		outSeq = seq;
-		seq = NULL;
-	    } else {
-		outSeq = mergeAndClear(outSeq, seq);
-                if (outSeq == NULL)
-                    xmlXPathPErrMemory(ctxt);
-	    }
+/*
+ * Feeds the nodes selected by a step from a context node into `func`.
+ * Returns 1 if `func` stopped, 0 otherwise and -1 in case of error.
+ */
+typedef int (*xmlXPathSpecStepFunc)(xmlXPathSpecCtxt *sctxt,
+                                    xmlXPathSpecStep *step, xmlNodePtr node,
+                                    xmlXPathSpecNodeFunc func, void *data);
 
-            if (toBool)
-                break;
-	}
+/*
+ * Tests a condition for a context node. Returns 1 if it holds, 0 if
+ * it doesn't and -1 in case of error.
+ */
+typedef int (*xmlXPathSpecCondFunc)(xmlXPathSpecCtxt *sctxt,
+                                    xmlXPathSpecCond *cond, xmlNodePtr node);
+
+struct _xmlXPathSpecStep {
+    xmlXPathSpecStepFunc func;
+    xmlXPathStepOpPtr op;
+    xmlXPathTraversalFunction next;
+    /* index into the namespace URIs or -1 */
+    int uri;
+    int nbPreds;
+    /* innermost predicate first, NULL for [n] */
+    xmlXPathSpecCond *preds[XPATH_SPEC_MAX_PREDS];
+    int pos[XPATH_SPEC_MAX_PREDS];
+    /* the nodes selected by this step must be sorted */
+    int sort;
+};
+
+struct _xmlXPathSpecPath {
+    int absolute;
+    /* nested loops find the nodes in document order */
+    int ordered;
+    /* no step needs sorting */
+    int distinct;
+    int nbSteps;
+    xmlXPathSpecStep steps[XPATH_SPEC_MAX_STEPS];
+};
+
+struct _xmlXPathSpecCond {
+    xmlXPathSpecCondFunc func;
+    xmlXPathSpecCond *left;
+    xmlXPathSpecCond *right;
+    xmlXPathSpecPath *path;
+    xmlXPathSpecCmp cmp;
+    /* string literal, compared as string if cmp is EQ or NE */
+    const xmlChar *str;
+    double num;
+};
+
+struct _xmlXPathSpec {
+    xmlXPathSpecType type;
+    xmlXPathSpecPath *path;
+    xmlXPathSpecCond *cond;
+    int nbURIs;
+    const xmlChar *prefixes[XPATH_SPEC_MAX_URIS];
+    /* only used while building */
+    int memError;
+};
+
+struct _xmlXPathSpecCtxt {
+    xmlXPathParserContextPtr pctxt;
+    const xmlChar *URIs[XPATH_SPEC_MAX_URIS];
+};
+
+static void
+xmlXPathSpecFreeCond(xmlXPathSpecCond *cond);
+
+static void
+xmlXPathSpecFreePath(xmlXPathSpecPath *path) {
+    int i, j;
+
+    if (path == NULL)
+        return;
+    for (i = 0; i < path->nbSteps; i++) {
+        for (j = 0; j < path->steps[i].nbPreds; j++)
+            xmlXPathSpecFreeCond(path->steps[i].preds[j]);
     }
+    xmlFree(path);
+}
 
-error:
-    if ((obj->boolval) && (obj->user != NULL)) {
-	/*
-	* QUESTION TODO: What does this do and why?
-	* TODO: Do we have to do this also for the "error"
-	* cleanup further down?
-	*/
-	ctxt->value->boolval = 1;
-	ctxt->value->user = obj->user;
-	obj->user = NULL;
-	obj->boolval = 0;
+static void
+xmlXPathSpecFreeCond(xmlXPathSpecCond *cond) {
+    if (cond == NULL)
+        return;
+    xmlXPathSpecFreeCond(cond->left);
+    xmlXPathSpecFreeCond(cond->right);
+    xmlXPathSpecFreePath(cond->path);
+    xmlFree(cond);
+}
+
+static void
+xmlXPathSpecFree(xmlXPathSpec *spec) {
+    if (spec == NULL)
+        return;
+    xmlXPathSpecFreePath(spec->path);
+    xmlXPathSpecFreeCond(spec->cond);
+    xmlFree(spec);
+}
+
+/*
+ * Return the string value of a node. Attributes, text nodes and
+ * elements with a single text child are read in place, otherwise
+ * a copy is returned in `copy` which the caller has to free.
+ */
+static const xmlChar *
+xmlXPathSpecNodeString(xmlNodePtr node, xmlChar **copy) {
+    xmlNodePtr child;
+
+    *copy = NULL;
+
+    switch (node->type) {
+        case XML_TEXT_NODE:
+        case XML_CDATA_SECTION_NODE:
+        case XML_COMMENT_NODE:
+        case XML_PI_NODE:
+            if (node->content == NULL)
+                return(BAD_CAST "");
+            return(node->content);
+        case XML_ATTRIBUTE_NODE:
+        case XML_ELEMENT_NODE:
+            if ((node->type == XML_ELEMENT_NODE) &&
+                (XML_LAZY_DOC(node->doc)))
+                break;
+            child = node->children;
+            if (child == NULL)
+                return(BAD_CAST "");
+            if ((child->next == NULL) &&
+                ((child->type == XML_TEXT_NODE) ||
+                 (child->type == XML_CDATA_SECTION_NODE)))
+                return((child->content != NULL) ? child->content :
+                                                  BAD_CAST "");
+            break;
+        default:
+            break;
     }
-    xmlXPathReleaseObject(xpctxt, obj);
 
-    /*
-    * Ensure we return at least an empty set.
-    */
-    if (outSeq == NULL) {
-	if ((seq != NULL) && (seq->nodeNr == 0)) {
-	    outSeq = seq;
+    *copy = xmlXPathCastNodeToString(node);
+    return(*copy);
+}
+
+/*
+ * Apply the predicates of a step to a node passing the node test.
+ * `pos` holds the positions counted so far for each predicate.
+ * `done` is set if no later node can pass a [n] predicate.
+ *
+ * Returns 1 if the node passes, 0 if not and -1 in case of error.
+ */
+static int
+xmlXPathSpecFilter(xmlXPathSpecCtxt *sctxt, xmlXPathSpecStep *step,
+                   xmlNodePtr cur, int *pos, int *done) {
+    int i, res;
+
+    for (i = 0; i < step->nbPreds; i++) {
+        xmlXPathSpecCond *pred = step->preds[i];
+
+        if (pred == NULL) {
+            pos[i] += 1;
+            if (pos[i] >= step->pos[i])
+                *done = 1;
+            if (pos[i] != step->pos[i])
+                return(0);
         } else {
-	    outSeq = xmlXPathNodeSetCreate(NULL);
-            if (outSeq == NULL)
-                xmlXPathPErrMemory(ctxt);
+            res = pred->func(sctxt, pred, cur);
+            if (res <= 0)
+                return(res);
         }
     }
-    if ((seq != NULL) && (seq != outSeq)) {
-	 xmlXPathFreeNodeSet(seq);
+
+    return(1);
+}
+
+/*
+ * Generic step using the axis traversal function.
+ */
+static int
+xmlXPathSpecStepAxis(xmlXPathSpecCtxt *sctxt, xmlXPathSpecStep *step,
+                     xmlNodePtr node, xmlXPathSpecNodeFunc func,
+                     void *data) {
+    xmlXPathParserContextPtr ctxt = sctxt->pctxt;
+    xmlXPathContextPtr xpctxt = ctxt->context;
+    const xmlChar *URI = (step->uri >= 0) ? sctxt->URIs[step->uri] : NULL;
+    int pos[XPATH_SPEC_MAX_PREDS] = { 0 };
+    xmlNodePtr cur = NULL;
+    int res, done = 0;
+
+    while (!done) {
+        xpctxt->node = node;
+        cur = step->next(ctxt, cur);
+        if (cur == NULL)
+            break;
+        if (OP_LIMIT_EXCEEDED(ctxt, 1))
+            return(-1);
+
+        if (!xmlXPathLazyTest(step->op, URI, cur))
+            continue;
+        res = xmlXPathSpecFilter(sctxt, step, cur, pos, &done);
+        if (res > 0)
+            res = func(sctxt, data, cur);
+        if (res != 0)
+            return(res);
     }
-    /*
-    * Hand over the result. Better to push the set also in
-    * case of errors.
-    */
-    xmlXPathValuePush(ctxt, xmlXPathCacheWrapNodeSet(ctxt, outSeq));
-    /*
-    * Reset the context node.
-    */
-    xpctxt->node = oldContextNode;
-    /*
-    * When traversing the namespace axis in "toBool" mode, it's
-    * possible that tmpNsList wasn't freed.
-    */
-    if (xpctxt->tmpNsList != NULL) {
-        xmlFree(xpctxt->tmpNsList);
-        xpctxt->tmpNsList = NULL;
+
+    return(0);
+}
+
+/*
+ * Fused "child::name" step without namespace prefix, scanning the
+ * children directly.
+ */
+static int
+xmlXPathSpecStepChildName(xmlXPathSpecCtxt *sctxt, xmlXPathSpecStep *step,
+                          xmlNodePtr node, xmlXPathSpecNodeFunc func,
+                          void *data) {
+    xmlXPathParserContextPtr ctxt = sctxt->pctxt;
+    const xmlChar *name = step->op->value5;
+    int pos[XPATH_SPEC_MAX_PREDS] = { 0 };
+    xmlNodePtr cur;
+    int res, done = 0;
+
+    if ((node->type != XML_ELEMENT_NODE) &&
+        (node->type != XML_DOCUMENT_NODE) &&
+        (node->type != XML_HTML_DOCUMENT_NODE))
+        return(0);
+    if (XML_LAZY_DOC(node->doc))
+        return(xmlXPathSpecStepAxis(sctxt, step, node, func, data));
+
+    for (cur = node->children; (cur != NULL) && (!done); cur = cur->next) {
+        if (OP_LIMIT_EXCEEDED(ctxt, 1))
+            return(-1);
+        if ((cur->type != XML_ELEMENT_NODE) || (cur->ns != NULL) ||
+            ((cur->name != name) && (!xmlStrEqual(cur->name, name))))
+            continue;
+
+        res = xmlXPathSpecFilter(sctxt, step, cur, pos, &done);
+        if (res > 0)
+            res = func(sctxt, data, cur);
+        if (res != 0)
+            return(res);
     }
 
-    return(total);
+    return(0);
 }
 
+typedef struct {
+    xmlXPathSpecPath *path;
+    int idx;
+    xmlXPathSpecNodeFunc func;
+    void *data;
+} xmlXPathSpecVisitData;
+
 static int
-xmlXPathCompOpEvalFilterFirst(xmlXPathParserContextPtr ctxt,
-			      xmlXPathStepOpPtr op, xmlNodePtr * first);
+xmlXPathSpecVisitNode(xmlXPathSpecCtxt *sctxt, void *data,
+                      xmlNodePtr node) {
+    xmlXPathSpecVisitData *visit = data;
+    xmlXPathSpecVisitData next;
+    xmlXPathSpecStep *step;
+
+    if (visit->idx >= visit->path->nbSteps)
+        return(visit->func(sctxt, visit->data, node));
+
+    step = &visit->path->steps[visit->idx];
+    next = *visit;
+    next.idx += 1;
+    return(step->func(sctxt, step, node, xmlXPathSpecVisitNode, &next));
+}
 
-/**
- * Evaluate the Precompiled XPath operation searching only the first
- * element in document order
+/*
+ * Feed the nodes selected by a path into `func` with nested loops.
+ * Nodes can be visited more than once and are only visited in
+ * document order if `path->ordered` is set.
  *
- * @param ctxt  the XPath parser context with the compiled expression
- * @param op  an XPath compiled operation
- * @param first  the first elem found so far
- * @returns the number of examined objects.
+ * Returns 1 if `func` stopped, 0 otherwise and -1 in case of error.
  */
 static int
-xmlXPathCompOpEvalFirst(xmlXPathParserContextPtr ctxt,
-                        xmlXPathStepOpPtr op, xmlNodePtr * first)
-{
-    int total = 0, cur;
-    xmlXPathCompExprPtr comp;
-    xmlXPathObjectPtr arg1, arg2;
+xmlXPathSpecVisit(xmlXPathSpecCtxt *sctxt, xmlXPathSpecPath *path,
+                  xmlNodePtr node, xmlXPathSpecNodeFunc func, void *data) {
+    xmlXPathSpecVisitData visit;
+
+    if (path->absolute)
+        node = (xmlNodePtr) sctxt->pctxt->context->doc;
+
+    visit.path = path;
+    visit.idx = 0;
+    visit.func = func;
+    visit.data = data;
+    return(xmlXPathSpecVisitNode(sctxt, &visit, node));
+}
 
-    CHECK_ERROR0;
-    if (OP_LIMIT_EXCEEDED(ctxt, 1))
-        return(0);
-    if (ctxt->context->depth >= XPATH_MAX_RECURSION_DEPTH)
-        XP_ERROR0(XPATH_RECURSION_LIMIT_EXCEEDED);
-    ctxt->context->depth += 1;
-    comp = ctxt->comp;
-    switch (op->op) {
-        case XPATH_OP_END:
-            break;
-        case XPATH_OP_UNION:
-            total =
-                xmlXPathCompOpEvalFirst(ctxt, &comp->steps[op->ch1],
-                                        first);
-	    CHECK_ERROR0;
-            if ((ctxt->value != NULL)
-                && (ctxt->value->type == XPATH_NODESET)
-                && (ctxt->value->nodesetval != NULL)
-                && (ctxt->value->nodesetval->nodeNr >= 1)) {
-                /*
-                 * limit tree traversing to first node in the result
-                 */
-		/*
-		* OPTIMIZE TODO: This implicitly sorts
-		*  the result, even if not needed. E.g. if the argument
-		*  of the count() function, no sorting is needed.
-		* OPTIMIZE TODO: How do we know if the node-list wasn't
-		*  already sorted?
-		*/
-		if (ctxt->value->nodesetval->nodeNr > 1)
-		    xmlXPathNodeSetSort(ctxt->value->nodesetval);
-                *first = ctxt->value->nodesetval->nodeTab[0];
-            }
-            cur =
-                xmlXPathCompOpEvalFirst(ctxt, &comp->steps[op->ch2],
-                                        first);
-	    CHECK_ERROR0;
+static int
+xmlXPathSpecStop(xmlXPathSpecCtxt *sctxt ATTRIBUTE_UNUSED,
+                 void *data ATTRIBUTE_UNUSED,
+                 xmlNodePtr node ATTRIBUTE_UNUSED) {
+    return(1);
+}
 
-            arg2 = xmlXPathValuePop(ctxt);
-            arg1 = xmlXPathValuePop(ctxt);
-            if ((arg1 == NULL) || (arg1->type != XPATH_NODESET) ||
-                (arg2 == NULL) || (arg2->type != XPATH_NODESET)) {
-	        xmlXPathReleaseObject(ctxt->context, arg1);
-	        xmlXPathReleaseObject(ctxt->context, arg2);
-                XP_ERROR0(XPATH_INVALID_TYPE);
+static int
+xmlXPathSpecCount(xmlXPathSpecCtxt *sctxt ATTRIBUTE_UNUSED, void *data,
+                  xmlNodePtr node ATTRIBUTE_UNUSED) {
+    *((double *) data) += 1;
+    return(0);
+}
+
+static int
+xmlXPathSpecSetFirst(xmlXPathSpecCtxt *sctxt ATTRIBUTE_UNUSED, void *data,
+                     xmlNodePtr node) {
+    *((xmlNodePtr *) data) = node;
+    return(1);
+}
+
+static int
+xmlXPathSpecAddNode(xmlXPathSpecCtxt *sctxt, void *data, xmlNodePtr node) {
+    if (xmlXPathNodeSetAddUnique(data, node) < 0) {
+        xmlXPathPErrMemory(sctxt->pctxt);
+        return(-1);
+    }
+    return(0);
+}
+
+/*
+ * Build the node set selected by a path one step at a time, sorting
+ * only after steps which can break document order.
+ *
+ * Returns the node set or NULL in case of error.
+ */
+static xmlNodeSetPtr
+xmlXPathSpecSelect(xmlXPathSpecCtxt *sctxt, xmlXPathSpecPath *path,
+                   xmlNodePtr node) {
+    xmlXPathParserContextPtr ctxt = sctxt->pctxt;
+    xmlNodeSetPtr set, next;
+    int i, j, k, end;
+
+    if (path->absolute)
+        node = (xmlNodePtr) ctxt->context->doc;
+
+    set = xmlXPathNodeSetCreate(node);
+    if (set == NULL) {
+        xmlXPathPErrMemory(ctxt);
+        return(NULL);
+    }
+
+    for (i = 0; i < path->nbSteps; i++) {
+        xmlXPathSpecStep *step = &path->steps[i];
+
+        next = xmlXPathNodeSetCreate(NULL);
+        if (next == NULL) {
+            xmlXPathPErrMemory(ctxt);
+            xmlXPathFreeNodeSet(set);
+            return(NULL);
+        }
+        /*
+         * Without predicates, a single context node selects the
+         * following axes of all nodes, see xmlXPathAxisContextIndex.
+         */
+        j = 0;
+        end = set->nodeNr;
+        if ((step->next == xmlXPathNextFollowing) && (step->nbPreds == 0) &&
+            (set->nodeNr > 1)) {
+            k = xmlXPathAxisContextIndex(set, 1);
+            if (k >= 0) {
+                j = k;
+                end = k + 1;
             }
-            if ((ctxt->context->opLimit != 0) &&
-                (((arg1->nodesetval != NULL) &&
-                  (xmlXPathCheckOpLimit(ctxt,
-                                        arg1->nodesetval->nodeNr) < 0)) ||
-                 ((arg2->nodesetval != NULL) &&
-                  (xmlXPathCheckOpLimit(ctxt,
-                                        arg2->nodesetval->nodeNr) < 0)))) {
-	        xmlXPathReleaseObject(ctxt->context, arg1);
-	        xmlXPathReleaseObject(ctxt->context, arg2);
-                break;
+        }
+        for (; j < end; j++) {
+            if (step->func(sctxt, step, set->nodeTab[j],
+                           xmlXPathSpecAddNode, next) < 0) {
+                xmlXPathFreeNodeSet(next);
+                xmlXPathFreeNodeSet(set);
+                return(NULL);
             }
-
-            if ((arg2->nodesetval != NULL) &&
-                (arg2->nodesetval->nodeNr != 0)) {
-                arg1->nodesetval = xmlXPathNodeSetMerge(arg1->nodesetval,
-                                                        arg2->nodesetval);
-                if (arg1->nodesetval == NULL)
-                    xmlXPathPErrMemory(ctxt);
+        }
+        xmlXPathFreeNodeSet(set);
+        set = next;
+
+        if ((step->sort) && (set->nodeNr > 1)) {
+            xmlXPathNodeSetSortCtxt(ctxt->context, set);
+            for (j = 1, k = 1; j < set->nodeNr; j++) {
+                if (set->nodeTab[j] != set->nodeTab[k-1])
+                    set->nodeTab[k++] = set->nodeTab[j];
             }
-            xmlXPathValuePush(ctxt, arg1);
-	    xmlXPathReleaseObject(ctxt->context, arg2);
-            total += cur;
-            break;
-        case XPATH_OP_ROOT:
-            xmlXPathRoot(ctxt);
-            break;
-        case XPATH_OP_NODE:
-            if (op->ch1 != -1)
-                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-	    CHECK_ERROR0;
-            if (op->ch2 != -1)
-                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
-	    CHECK_ERROR0;
-	    xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt,
-		ctxt->context->node));
-            break;
-        case XPATH_OP_COLLECT:{
-                if (op->ch1 == -1)
-                    break;
+            set->nodeNr = k;
+        }
+    }
 
-                total = xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-		CHECK_ERROR0;
+    return(set);
+}
 
-                total += xmlXPathNodeCollectAndTest(ctxt, op, first, NULL, 0);
-                break;
-            }
-        case XPATH_OP_VALUE:
-            xmlXPathValuePush(ctxt, xmlXPathCacheObjectCopy(ctxt, op->value4));
-            break;
-        case XPATH_OP_SORT:
-            if (op->ch1 != -1)
-                total +=
-                    xmlXPathCompOpEvalFirst(ctxt, &comp->steps[op->ch1],
-                                            first);
-	    CHECK_ERROR0;
-            if ((ctxt->value != NULL)
-                && (ctxt->value->type == XPATH_NODESET)
-                && (ctxt->value->nodesetval != NULL)
-		&& (ctxt->value->nodesetval->nodeNr > 1))
-                xmlXPathNodeSetSort(ctxt->value->nodesetval);
-            break;
-#ifdef XP_OPTIMIZED_FILTER_FIRST
-	case XPATH_OP_FILTER:
-                total += xmlXPathCompOpEvalFilterFirst(ctxt, op, first);
-            break;
-#endif
-        default:
-            total += xmlXPathCompOpEval(ctxt, op);
-            break;
+/*
+ * Return the string value of the first node of a path in document
+ * order or the empty string, see xmlXPathSpecNodeString.
+ */
+static const xmlChar *
+xmlXPathSpecPathString(xmlXPathSpecCtxt *sctxt, xmlXPathSpecPath *path,
+                       xmlNodePtr node, xmlChar **copy) {
+    xmlNodePtr first = NULL;
+    const xmlChar *ret;
+
+    *copy = NULL;
+
+    if (path->ordered) {
+        if (xmlXPathSpecVisit(sctxt, path, node, xmlXPathSpecSetFirst,
+                              &first) < 0)
+            return(NULL);
+    } else {
+        xmlNodeSetPtr set = xmlXPathSpecSelect(sctxt, path, node);
+
+        if (set == NULL)
+            return(NULL);
+        if (set->nodeNr > 0)
+            first = set->nodeTab[0];
+        xmlXPathFreeNodeSet(set);
+    }
+
+    if (first == NULL)
+        return(BAD_CAST "");
+    ret = xmlXPathSpecNodeString(first, copy);
+    if (ret == NULL)
+        xmlXPathPErrMemory(sctxt->pctxt);
+    return(ret);
+}
+
+static int
+xmlXPathSpecCompareNode(xmlXPathSpecCtxt *sctxt, void *data,
+                        xmlNodePtr node) {
+    xmlXPathSpecCond *cond = data;
+    const xmlChar *str;
+    xmlChar *copy;
+    double val;
+    int res = 0;
+
+    str = xmlXPathSpecNodeString(node, &copy);
+    if (str == NULL) {
+        xmlXPathPErrMemory(sctxt->pctxt);
+        return(-1);
+    }
+
+    if (cond->str != NULL) {
+        res = xmlStrEqual(str, cond->str);
+        if (cond->cmp == XPATH_SPEC_NE)
+            res = !res;
+    } else {
+        /* IEEE comparisons handle NaN and infinity like XPath */
+        val = xmlXPathStringEvalNumber(str);
+        switch (cond->cmp) {
+            case XPATH_SPEC_EQ: res = (val == cond->num); break;
+            case XPATH_SPEC_NE: res = (val != cond->num); break;
+            case XPATH_SPEC_LT: res = (val < cond->num); break;
+            case XPATH_SPEC_LE: res = (val <= cond->num); break;
+            case XPATH_SPEC_GT: res = (val > cond->num); break;
+            case XPATH_SPEC_GE: res = (val >= cond->num); break;
+        }
     }
 
-    ctxt->context->depth -= 1;
-    return(total);
+    xmlFree(copy);
+    return(res);
+}
+
+static int
+xmlXPathSpecAnd(xmlXPathSpecCtxt *sctxt, xmlXPathSpecCond *cond,
+                xmlNodePtr node) {
+    int res = cond->left->func(sctxt, cond->left, node);
+
+    if (res <= 0)
+        return(res);
+    return(cond->right->func(sctxt, cond->right, node));
+}
+
+static int
+xmlXPathSpecOr(xmlXPathSpecCtxt *sctxt, xmlXPathSpecCond *cond,
+               xmlNodePtr node) {
+    int res = cond->left->func(sctxt, cond->left, node);
+
+    if (res != 0)
+        return(res);
+    return(cond->right->func(sctxt, cond->right, node));
+}
+
+static int
+xmlXPathSpecNot(xmlXPathSpecCtxt *sctxt, xmlXPathSpecCond *cond,
+                xmlNodePtr node) {
+    int res = cond->left->func(sctxt, cond->left, node);
+
+    return((res < 0) ? res : !res);
 }
 
-/**
- * Evaluate the Precompiled XPath operation searching only the last
- * element in document order
- *
- * @param ctxt  the XPath parser context with the compiled expression
- * @param op  an XPath compiled operation
- * @param last  the last elem found so far
- * @returns the number of nodes traversed
- */
 static int
-xmlXPathCompOpEvalLast(xmlXPathParserContextPtr ctxt, xmlXPathStepOpPtr op,
-                       xmlNodePtr * last)
-{
-    int total = 0, cur;
-    xmlXPathCompExprPtr comp;
-    xmlXPathObjectPtr arg1, arg2;
+xmlXPathSpecTrue(xmlXPathSpecCtxt *sctxt ATTRIBUTE_UNUSED,
+                 xmlXPathSpecCond *cond ATTRIBUTE_UNUSED,
+                 xmlNodePtr node ATTRIBUTE_UNUSED) {
+    return(1);
+}
 
-    CHECK_ERROR0;
-    if (OP_LIMIT_EXCEEDED(ctxt, 1))
-        return(0);
-    if (ctxt->context->depth >= XPATH_MAX_RECURSION_DEPTH)
-        XP_ERROR0(XPATH_RECURSION_LIMIT_EXCEEDED);
-    ctxt->context->depth += 1;
-    comp = ctxt->comp;
-    switch (op->op) {
-        case XPATH_OP_END:
-            break;
-        case XPATH_OP_UNION:
-            total =
-                xmlXPathCompOpEvalLast(ctxt, &comp->steps[op->ch1], last);
-	    CHECK_ERROR0;
-            if ((ctxt->value != NULL)
-                && (ctxt->value->type == XPATH_NODESET)
-                && (ctxt->value->nodesetval != NULL)
-                && (ctxt->value->nodesetval->nodeNr >= 1)) {
-                /*
-                 * limit tree traversing to first node in the result
-                 */
-		if (ctxt->value->nodesetval->nodeNr > 1)
-		    xmlXPathNodeSetSort(ctxt->value->nodesetval);
-                *last =
-                    ctxt->value->nodesetval->nodeTab[ctxt->value->
-                                                     nodesetval->nodeNr -
-                                                     1];
-            }
-            cur =
-                xmlXPathCompOpEvalLast(ctxt, &comp->steps[op->ch2], last);
-	    CHECK_ERROR0;
-            if ((ctxt->value != NULL)
-                && (ctxt->value->type == XPATH_NODESET)
-                && (ctxt->value->nodesetval != NULL)
-                && (ctxt->value->nodesetval->nodeNr >= 1)) { /* TODO: NOP ? */
-            }
+static int
+xmlXPathSpecFalse(xmlXPathSpecCtxt *sctxt ATTRIBUTE_UNUSED,
+                  xmlXPathSpecCond *cond ATTRIBUTE_UNUSED,
+                  xmlNodePtr node ATTRIBUTE_UNUSED) {
+    return(0);
+}
 
-            arg2 = xmlXPathValuePop(ctxt);
-            arg1 = xmlXPathValuePop(ctxt);
-            if ((arg1 == NULL) || (arg1->type != XPATH_NODESET) ||
-                (arg2 == NULL) || (arg2->type != XPATH_NODESET)) {
-	        xmlXPathReleaseObject(ctxt->context, arg1);
-	        xmlXPathReleaseObject(ctxt->context, arg2);
-                XP_ERROR0(XPATH_INVALID_TYPE);
-            }
-            if ((ctxt->context->opLimit != 0) &&
-                (((arg1->nodesetval != NULL) &&
-                  (xmlXPathCheckOpLimit(ctxt,
-                                        arg1->nodesetval->nodeNr) < 0)) ||
-                 ((arg2->nodesetval != NULL) &&
-                  (xmlXPathCheckOpLimit(ctxt,
-                                        arg2->nodesetval->nodeNr) < 0)))) {
-	        xmlXPathReleaseObject(ctxt->context, arg1);
-	        xmlXPathReleaseObject(ctxt->context, arg2);
-                break;
-            }
+/* A path selects at least one node */
+static int
+xmlXPathSpecExists(xmlXPathSpecCtxt *sctxt, xmlXPathSpecCond *cond,
+                   xmlNodePtr node) {
+    return(xmlXPathSpecVisit(sctxt, cond->path, node, xmlXPathSpecStop,
+                             NULL));
+}
 
-            if ((arg2->nodesetval != NULL) &&
-                (arg2->nodesetval->nodeNr != 0)) {
-                arg1->nodesetval = xmlXPathNodeSetMerge(arg1->nodesetval,
-                                                        arg2->nodesetval);
-                if (arg1->nodesetval == NULL)
-                    xmlXPathPErrMemory(ctxt);
-            }
-            xmlXPathValuePush(ctxt, arg1);
-	    xmlXPathReleaseObject(ctxt->context, arg2);
-            total += cur;
-            break;
-        case XPATH_OP_ROOT:
-            xmlXPathRoot(ctxt);
-            break;
-        case XPATH_OP_NODE:
-            if (op->ch1 != -1)
-                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-	    CHECK_ERROR0;
-            if (op->ch2 != -1)
-                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
-	    CHECK_ERROR0;
-	    xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt,
-		ctxt->context->node));
-            break;
-        case XPATH_OP_COLLECT:{
-                if (op->ch1 == -1)
-                    break;
+/* Some node selected by a path compares true with a literal */
+static int
+xmlXPathSpecCompare(xmlXPathSpecCtxt *sctxt, xmlXPathSpecCond *cond,
+                    xmlNodePtr node) {
+    return(xmlXPathSpecVisit(sctxt, cond->path, node,
+                             xmlXPathSpecCompareNode, cond));
+}
 
-                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-		CHECK_ERROR0;
+/*
+ * Fused comparison of an attribute of the context node with a literal
+ * like "@name = 'value'" or "@name > 10".
+ */
+static int
+xmlXPathSpecCompareAttr(xmlXPathSpecCtxt *sctxt, xmlXPathSpecCond *cond,
+                        xmlNodePtr node) {
+    xmlXPathSpecStep *step = &cond->path->steps[0];
+    const xmlChar *URI = (step->uri >= 0) ? sctxt->URIs[step->uri] : NULL;
+    xmlAttrPtr attr;
+    int res;
 
-                total += xmlXPathNodeCollectAndTest(ctxt, op, NULL, last, 0);
-                break;
-            }
-        case XPATH_OP_VALUE:
-            xmlXPathValuePush(ctxt, xmlXPathCacheObjectCopy(ctxt, op->value4));
-            break;
-        case XPATH_OP_SORT:
-            if (op->ch1 != -1)
-                total +=
-                    xmlXPathCompOpEvalLast(ctxt, &comp->steps[op->ch1],
-                                           last);
-	    CHECK_ERROR0;
-            if ((ctxt->value != NULL)
-                && (ctxt->value->type == XPATH_NODESET)
-                && (ctxt->value->nodesetval != NULL)
-		&& (ctxt->value->nodesetval->nodeNr > 1))
-                xmlXPathNodeSetSort(ctxt->value->nodesetval);
-            break;
-        default:
-            total += xmlXPathCompOpEval(ctxt, op);
-            break;
+    if (node->type != XML_ELEMENT_NODE)
+        return(0);
+    if (XML_LAZY_DOC(node->doc))
+        xmlLazyMaterialize(node, XML_LAZY_ATTRS);
+
+    for (attr = node->properties; attr != NULL; attr = attr->next) {
+        if (!xmlXPathLazyTest(step->op, URI, (xmlNodePtr) attr))
+            continue;
+        res = xmlXPathSpecCompareNode(sctxt, cond, (xmlNodePtr) attr);
+        if (res != 0)
+            return(res);
     }
 
-    ctxt->context->depth -= 1;
-    return (total);
+    return(0);
 }
 
-#ifdef XP_OPTIMIZED_FILTER_FIRST
 static int
-xmlXPathCompOpEvalFilterFirst(xmlXPathParserContextPtr ctxt,
-			      xmlXPathStepOpPtr op, xmlNodePtr * first)
-{
-    int total = 0;
-    xmlXPathCompExprPtr comp;
-    xmlXPathObjectPtr obj;
-    xmlNodeSetPtr set;
+xmlXPathSpecContains(xmlXPathSpecCtxt *sctxt, xmlXPathSpecCond *cond,
+                     xmlNodePtr node) {
+    const xmlChar *str;
+    xmlChar *copy;
+    int res;
 
-    CHECK_ERROR0;
-    comp = ctxt->comp;
-    /*
-    * Optimization for ()[last()] selection i.e. the last elem
-    */
-    if ((op->ch1 != -1) && (op->ch2 != -1) &&
-	(comp->steps[op->ch1].op == XPATH_OP_SORT) &&
-	(comp->steps[op->ch2].op == XPATH_OP_SORT)) {
-	int f = comp->steps[op->ch2].ch1;
+    str = xmlXPathSpecPathString(sctxt, cond->path, node, &copy);
+    if (str == NULL)
+        return(-1);
+    res = (xmlStrstr(str, cond->str) != NULL);
+    xmlFree(copy);
+    return(res);
+}
 
-	if ((f != -1) &&
-	    (comp->steps[f].op == XPATH_OP_FUNCTION) &&
-	    (comp->steps[f].value5 == NULL) &&
-	    (comp->steps[f].value == 0) &&
-	    (comp->steps[f].value4 != NULL) &&
-	    (xmlStrEqual
-	    (comp->steps[f].value4, BAD_CAST "last"))) {
-	    xmlNodePtr last = NULL;
+static int
+xmlXPathSpecStartsWith(xmlXPathSpecCtxt *sctxt, xmlXPathSpecCond *cond,
+                       xmlNodePtr node) {
+    const xmlChar *str;
+    xmlChar *copy;
+    int res;
 
-	    total +=
-		xmlXPathCompOpEvalLast(ctxt,
-		    &comp->steps[op->ch1],
-		    &last);
-	    CHECK_ERROR0;
-	    /*
-	    * The nodeset should be in document order,
-	    * Keep only the last value
-	    */
-	    if ((ctxt->value != NULL) &&
-		(ctxt->value->type == XPATH_NODESET) &&
-		(ctxt->value->nodesetval != NULL) &&
-		(ctxt->value->nodesetval->nodeTab != NULL) &&
-		(ctxt->value->nodesetval->nodeNr > 1)) {
-                xmlXPathNodeSetKeepLast(ctxt->value->nodesetval);
-		*first = *(ctxt->value->nodesetval->nodeTab);
-	    }
-	    return (total);
-	}
+    str = xmlXPathSpecPathString(sctxt, cond->path, node, &copy);
+    if (str == NULL)
+        return(-1);
+    res = (xmlStrncmp(str, cond->str, xmlStrlen(cond->str)) == 0);
+    xmlFree(copy);
+    return(res);
+}
+
+static xmlXPathSpecCond *
+xmlXPathSpecBuildCond(xmlXPathSpec *spec, xmlXPathCompExprPtr comp,
+                      xmlXPathStepOpPtr op, int depth);
+
+/*
+ * Build a location path. Returns NULL if the path isn't supported or
+ * a memory allocation failed.
+ */
+static xmlXPathSpecPath *
+xmlXPathSpecBuildPath(xmlXPathSpec *spec, xmlXPathCompExprPtr comp,
+                      xmlXPathStepOpPtr op, int depth) {
+    xmlXPathStepOpPtr ops[XPATH_SPEC_MAX_STEPS];
+    xmlXPathSpecPath *path;
+    int i, j, n = 0, flat = 1;
+
+    if (depth > XPATH_SPEC_MAX_DEPTH)
+        return(NULL);
+
+    while ((op->op == XPATH_OP_SORT) && (op->ch1 != -1))
+        op = &comp->steps[op->ch1];
+    while (op->op == XPATH_OP_COLLECT) {
+        if ((n >= XPATH_SPEC_MAX_STEPS) || (op->ch1 == -1))
+            return(NULL);
+        ops[n++] = op;
+        op = &comp->steps[op->ch1];
+    }
+    if ((op->ch1 != -1) || (op->ch2 != -1) ||
+        ((op->op != XPATH_OP_ROOT) && (op->op != XPATH_OP_NODE)))
+        return(NULL);
+
+    path = xmlMalloc(sizeof(*path));
+    if (path == NULL) {
+        spec->memError = 1;
+        return(NULL);
     }
+    memset(path, 0, sizeof(*path));
+    path->absolute = (op->op == XPATH_OP_ROOT);
+    path->ordered = 1;
+    path->distinct = 1;
+
+    for (i = 0; i < n; i++) {
+        xmlXPathSpecStep *step = &path->steps[i];
+        xmlXPathAxisVal axis;
+        xmlXPathTestVal test;
+        xmlXPathStepOpPtr pred;
+        int elemOnly;
+
+        /* The chain is stored from the last step */
+        op = ops[n - 1 - i];
+        path->nbSteps = i + 1;
+        step->op = op;
+        step->func = xmlXPathSpecStepAxis;
+        axis = (xmlXPathAxisVal) op->value;
+        test = (xmlXPathTestVal) op->value2;
+        elemOnly = (((test == NODE_TEST_NAME) || (test == NODE_TEST_ALL)) &&
+                    (op->value3 == NODE_TYPE_NODE));
+
+        if ((test != NODE_TEST_TYPE) && (test != NODE_TEST_PI) &&
+            (test != NODE_TEST_ALL) && (test != NODE_TEST_NAME))
+            goto error;
+
+        switch (axis) {
+            case AXIS_ANCESTOR:
+                step->next = xmlXPathNextAncestor;
+                break;
+            case AXIS_ANCESTOR_OR_SELF:
+                step->next = xmlXPathNextAncestorOrSelf;
+                break;
+            case AXIS_ATTRIBUTE:
+                step->next = xmlXPathNextAttribute;
+                break;
+            case AXIS_CHILD:
+                step->next = elemOnly ? xmlXPathNextChildElement :
+                                        xmlXPathNextChild;
+                if ((test == NODE_TEST_NAME) && (op->value4 == NULL))
+                    step->func = xmlXPathSpecStepChildName;
+                break;
+            case AXIS_DESCENDANT:
+                step->next = elemOnly ? xmlXPathNextDescendantElement :
+                                        xmlXPathNextDescendant;
+                break;
+            case AXIS_DESCENDANT_OR_SELF:
+                step->next = elemOnly ?
+                             xmlXPathNextDescendantOrSelfElement :
+                             xmlXPathNextDescendantOrSelf;
+                break;
+            case AXIS_FOLLOWING:
+                step->next = xmlXPathNextFollowing;
+                break;
+            case AXIS_FOLLOWING_SIBLING:
+                step->next = xmlXPathNextFollowingSibling;
+                break;
+            case AXIS_PARENT:
+                step->next = xmlXPathNextParent;
+                break;
+            case AXIS_PRECEDING_SIBLING:
+                step->next = xmlXPathNextPrecedingSibling;
+                break;
+            case AXIS_SELF:
+                step->next = xmlXPathNextSelf;
+                break;
+            default:
+                goto error;
+        }
+
+        /*
+         * Steps from a set of nodes which don't contain each other
+         * keep document order, except for reverse axes and axes
+         * leaving the subtree. Attributes always do.
+         */
+        switch (axis) {
+            case AXIS_ATTRIBUTE:
+                flat = 1;
+                break;
+            case AXIS_SELF:
+                break;
+            case AXIS_CHILD:
+                step->sort = !flat;
+                break;
+            case AXIS_DESCENDANT:
+            case AXIS_DESCENDANT_OR_SELF:
+                step->sort = !flat;
+                flat = 0;
+                break;
+            case AXIS_FOLLOWING:
+            case AXIS_FOLLOWING_SIBLING:
+                step->sort = (i > 0);
+                flat = 0;
+                break;
+            default:
+                step->sort = 1;
+                flat = 0;
+                break;
+        }
+        if (step->sort)
+            path->distinct = 0;
+
+        /* Same conditions as for lazy paths */
+        switch (axis) {
+            case AXIS_CHILD:
+            case AXIS_ATTRIBUTE:
+            case AXIS_SELF:
+                break;
+            case AXIS_DESCENDANT:
+            case AXIS_DESCENDANT_OR_SELF:
+                if (i < n - 1)
+                    path->ordered = 0;
+                break;
+            case AXIS_FOLLOWING:
+            case AXIS_FOLLOWING_SIBLING:
+                if (n > 1)
+                    path->ordered = 0;
+                break;
+            default:
+                path->ordered = 0;
+                break;
+        }
+
+        step->uri = -1;
+        if (op->value4 != NULL) {
+            for (j = 0; j < spec->nbURIs; j++) {
+                if (xmlStrEqual(spec->prefixes[j], op->value4))
+                    break;
+            }
+            if (j >= spec->nbURIs) {
+                if (j >= XPATH_SPEC_MAX_URIS)
+                    goto error;
+                spec->prefixes[j] = op->value4;
+                spec->nbURIs += 1;
+            }
+            step->uri = j;
+        }
+
+        pred = (op->ch2 != -1) ? &comp->steps[op->ch2] : NULL;
+        while (pred != NULL) {
+            xmlXPathStepOpPtr exprOp;
+            xmlXPathSpecCond *cond = NULL;
+            int pos = 0;
+
+            if ((step->nbPreds >= XPATH_SPEC_MAX_PREDS) ||
+                (pred->op != XPATH_OP_PREDICATE) || (pred->ch2 == -1))
+                goto error;
+            exprOp = &comp->steps[pred->ch2];
+
+            if ((exprOp->op == XPATH_OP_VALUE) &&
+                (((xmlXPathObjectPtr) exprOp->value4)->type ==
+                 XPATH_NUMBER)) {
+                double floatval =
+                    ((xmlXPathObjectPtr) exprOp->value4)->floatval;
+
+                if ((floatval <= INT_MIN) || (floatval >= INT_MAX))
+                    goto error;
+                pos = (int) floatval;
+                if (floatval != (double) pos)
+                    goto error;
+            } else {
+                cond = xmlXPathSpecBuildCond(spec, comp, exprOp, depth + 1);
+                if (cond == NULL)
+                    goto error;
+            }
 
-    if (op->ch1 != -1)
-	total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-    CHECK_ERROR0;
-    if (op->ch2 == -1)
-	return (total);
-    if (ctxt->value == NULL)
-	return (total);
+            /* Insert at the front */
+            for (j = step->nbPreds; j > 0; j--) {
+                step->preds[j] = step->preds[j-1];
+                step->pos[j] = step->pos[j-1];
+            }
+            step->preds[0] = cond;
+            step->pos[0] = pos;
+            step->nbPreds += 1;
 
-    /*
-     * In case of errors, xmlXPathNodeSetFilter can pop additional nodes from
-     * the stack. We have to temporarily remove the nodeset object from the
-     * stack to avoid freeing it prematurely.
-     */
-    CHECK_TYPE0(XPATH_NODESET);
-    obj = xmlXPathValuePop(ctxt);
-    set = obj->nodesetval;
-    if (set != NULL) {
-        xmlXPathNodeSetFilter(ctxt, set, op->ch2, 1, 1, 1);
-        if (set->nodeNr > 0)
-            *first = set->nodeTab[0];
+            pred = (pred->ch1 != -1) ? &comp->steps[pred->ch1] : NULL;
+        }
     }
-    xmlXPathValuePush(ctxt, obj);
 
-    return (total);
+    return(path);
+
+error:
+    xmlXPathSpecFreePath(path);
+    return(NULL);
 }
-#endif /* XP_OPTIMIZED_FILTER_FIRST */
 
-/**
- * Evaluate the Precompiled XPath operation
- *
- * @param ctxt  the XPath parser context with the compiled expression
- * @param op  an XPath compiled operation
- * @returns the number of nodes traversed
+/*
+ * Build the comparison of a path with a string or number literal.
  */
 static int
-xmlXPathCompOpEval(xmlXPathParserContextPtr ctxt, xmlXPathStepOpPtr op)
-{
-    int total = 0;
-    int equal, ret;
-    xmlXPathCompExprPtr comp;
-    xmlXPathObjectPtr arg1, arg2;
+xmlXPathSpecBuildCompare(xmlXPathSpec *spec, xmlXPathCompExprPtr comp,
+                         xmlXPathStepOpPtr op, xmlXPathSpecCond *cond,
+                         int depth) {
+    xmlXPathStepOpPtr pathOp, valueOp;
+    xmlXPathObjectPtr val;
+    xmlXPathSpecStep *step;
+    int swap = 0;
 
-    CHECK_ERROR0;
-    if (OP_LIMIT_EXCEEDED(ctxt, 1))
-        return(0);
-    if (ctxt->context->depth >= XPATH_MAX_RECURSION_DEPTH)
-        XP_ERROR0(XPATH_RECURSION_LIMIT_EXCEEDED);
-    ctxt->context->depth += 1;
-    comp = ctxt->comp;
-    switch (op->op) {
-        case XPATH_OP_END:
+    if ((op->ch1 == -1) || (op->ch2 == -1))
+        return(-1);
+    pathOp = &comp->steps[op->ch1];
+    valueOp = &comp->steps[op->ch2];
+    if (pathOp->op == XPATH_OP_VALUE) {
+        xmlXPathStepOpPtr tmp = pathOp;
+
+        pathOp = valueOp;
+        valueOp = tmp;
+        swap = 1;
+    }
+    if (valueOp->op != XPATH_OP_VALUE)
+        return(-1);
+    val = valueOp->value4;
+    if ((val->type != XPATH_STRING) && (val->type != XPATH_NUMBER))
+        return(-1);
+
+    if (op->op == XPATH_OP_EQUAL) {
+        cond->cmp = op->value ? XPATH_SPEC_EQ : XPATH_SPEC_NE;
+    } else {
+        int inf = op->value;
+
+        /* 'lit' < path is path > 'lit' */
+        if (swap)
+            inf = !inf;
+        if (inf)
+            cond->cmp = op->value2 ? XPATH_SPEC_LT : XPATH_SPEC_LE;
+        else
+            cond->cmp = op->value2 ? XPATH_SPEC_GT : XPATH_SPEC_GE;
+    }
+
+    /* Relational operators compare strings as numbers */
+    if ((val->type == XPATH_STRING) &&
+        ((cond->cmp == XPATH_SPEC_EQ) || (cond->cmp == XPATH_SPEC_NE)))
+        cond->str = val->stringval;
+    else if (val->type == XPATH_STRING)
+        cond->num = xmlXPathStringEvalNumber(val->stringval);
+    else
+        cond->num = val->floatval;
+
+    cond->path = xmlXPathSpecBuildPath(spec, comp, pathOp, depth + 1);
+    if (cond->path == NULL)
+        return(-1);
+
+    step = &cond->path->steps[0];
+    if ((!cond->path->absolute) && (cond->path->nbSteps == 1) &&
+        (step->op->value == AXIS_ATTRIBUTE) && (step->nbPreds == 0))
+        cond->func = xmlXPathSpecCompareAttr;
+    else
+        cond->func = xmlXPathSpecCompare;
+
+    return(0);
+}
+
+/*
+ * Return the op of the only argument of a function call with
+ * `nargs` arguments, or of the first argument if `nargs` is 2.
+ */
+static xmlXPathStepOpPtr
+xmlXPathSpecFunctionArg(xmlXPathCompExprPtr comp, xmlXPathStepOpPtr op,
+                        int nargs, xmlXPathStepOpPtr *second) {
+    xmlXPathStepOpPtr arg;
+
+    if ((op->value != nargs) || (op->ch1 == -1))
+        return(NULL);
+    arg = &comp->steps[op->ch1];
+    if ((arg->op != XPATH_OP_ARG) || (arg->ch2 == -1))
+        return(NULL);
+    if (nargs == 2) {
+        *second = &comp->steps[arg->ch2];
+        if (arg->ch1 == -1)
+            return(NULL);
+        arg = &comp->steps[arg->ch1];
+        if ((arg->op != XPATH_OP_ARG) || (arg->ch2 == -1))
+            return(NULL);
+    }
+    if (arg->ch1 != -1)
+        return(NULL);
+    return(&comp->steps[arg->ch2]);
+}
+
+/*
+ * Build a condition. Returns NULL if the expression isn't supported
+ * or a memory allocation failed.
+ */
+static xmlXPathSpecCond *
+xmlXPathSpecBuildCond(xmlXPathSpec *spec, xmlXPathCompExprPtr comp,
+                      xmlXPathStepOpPtr op, int depth) {
+    xmlXPathSpecCond *cond;
+    xmlXPathStepOpPtr arg, second;
+    const xmlChar *name;
+
+    if (depth > XPATH_SPEC_MAX_DEPTH)
+        return(NULL);
+
+    /* boolean() doesn't change conditions */
+    while (1) {
+        if ((op->op == XPATH_OP_SORT) && (op->ch1 != -1)) {
+            op = &comp->steps[op->ch1];
+        } else if ((op->op == XPATH_OP_FUNCTION) && (op->value5 == NULL) &&
+                   (xmlStrEqual(op->value4, BAD_CAST "boolean"))) {
+            op = xmlXPathSpecFunctionArg(comp, op, 1, NULL);
+            if (op == NULL)
+                return(NULL);
+        } else {
             break;
+        }
+    }
+
+    cond = xmlMalloc(sizeof(*cond));
+    if (cond == NULL) {
+        spec->memError = 1;
+        return(NULL);
+    }
+    memset(cond, 0, sizeof(*cond));
+
+    switch (op->op) {
         case XPATH_OP_AND:
-            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-	    CHECK_ERROR0;
-            xmlXPathBooleanFunction(ctxt, 1);
-            if ((ctxt->value == NULL) || (ctxt->value->boolval == 0))
-                break;
-            arg2 = xmlXPathValuePop(ctxt);
-            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
-	    if (ctxt->error) {
-		xmlXPathFreeObject(arg2);
-		break;
-	    }
-            xmlXPathBooleanFunction(ctxt, 1);
-            if (ctxt->value != NULL)
-                ctxt->value->boolval &= arg2->boolval;
-	    xmlXPathReleaseObject(ctxt->context, arg2);
-            break;
         case XPATH_OP_OR:
-            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-	    CHECK_ERROR0;
-            xmlXPathBooleanFunction(ctxt, 1);
-            if ((ctxt->value == NULL) || (ctxt->value->boolval == 1))
-                break;
-            arg2 = xmlXPathValuePop(ctxt);
-            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
-	    if (ctxt->error) {
-		xmlXPathFreeObject(arg2);
-		break;
-	    }
-            xmlXPathBooleanFunction(ctxt, 1);
-            if (ctxt->value != NULL)
-                ctxt->value->boolval |= arg2->boolval;
-	    xmlXPathReleaseObject(ctxt->context, arg2);
+            cond->func = (op->op == XPATH_OP_AND) ? xmlXPathSpecAnd :
+                                                    xmlXPathSpecOr;
+            cond->left = xmlXPathSpecBuildCond(spec, comp,
+                                               &comp->steps[op->ch1],
+                                               depth + 1);
+            if (cond->left == NULL)
+                goto error;
+            cond->right = xmlXPathSpecBuildCond(spec, comp,
+                                                &comp->steps[op->ch2],
+                                                depth + 1);
+            if (cond->right == NULL)
+                goto error;
             break;
+
         case XPATH_OP_EQUAL:
-            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-	    CHECK_ERROR0;
-            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
-	    CHECK_ERROR0;
-	    if (op->value)
-		equal = xmlXPathEqualValues(ctxt);
-	    else
-		equal = xmlXPathNotEqualValues(ctxt);
-	    xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, equal));
-            break;
         case XPATH_OP_CMP:
-            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-	    CHECK_ERROR0;
-            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
-	    CHECK_ERROR0;
-            ret = xmlXPathCompareValues(ctxt, op->value, op->value2);
-	    xmlXPathValuePush(ctxt, xmlXPathCacheNewBoolean(ctxt, ret));
+            if (xmlXPathSpecBuildCompare(spec, comp, op, cond, depth) < 0)
+                goto error;
             break;
-        case XPATH_OP_PLUS:
-            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-	    CHECK_ERROR0;
-            if (op->ch2 != -1) {
-                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
-	    }
-	    CHECK_ERROR0;
-            if (op->value == 0)
-                xmlXPathSubValues(ctxt);
-            else if (op->value == 1)
-                xmlXPathAddValues(ctxt);
-            else if (op->value == 2)
-                xmlXPathValueFlipSign(ctxt);
-            else if (op->value == 3) {
-                CAST_TO_NUMBER;
-                CHECK_TYPE0(XPATH_NUMBER);
-            }
+
+        case XPATH_OP_VALUE:
+            /* Folded true() or false(). Numbers are positions. */
+            if (((xmlXPathObjectPtr) op->value4)->type != XPATH_BOOLEAN)
+                goto error;
+            cond->func = ((xmlXPathObjectPtr) op->value4)->boolval ?
+                         xmlXPathSpecTrue : xmlXPathSpecFalse;
             break;
-        case XPATH_OP_MULT:
-            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-	    CHECK_ERROR0;
-            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
-	    CHECK_ERROR0;
-            if (op->value == 0)
-                xmlXPathMultValues(ctxt);
-            else if (op->value == 1)
-                xmlXPathDivValues(ctxt);
-            else if (op->value == 2)
-                xmlXPathModValues(ctxt);
+
+        case XPATH_OP_COLLECT:
+        case XPATH_OP_ROOT:
+        case XPATH_OP_NODE:
+            cond->func = xmlXPathSpecExists;
+            cond->path = xmlXPathSpecBuildPath(spec, comp, op, depth + 1);
+            if (cond->path == NULL)
+                goto error;
             break;
-        case XPATH_OP_UNION:
-            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-	    CHECK_ERROR0;
-            total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
-	    CHECK_ERROR0;
 
-            arg2 = xmlXPathValuePop(ctxt);
-            arg1 = xmlXPathValuePop(ctxt);
-            if ((arg1 == NULL) || (arg1->type != XPATH_NODESET) ||
-                (arg2 == NULL) || (arg2->type != XPATH_NODESET)) {
-	        xmlXPathReleaseObject(ctxt->context, arg1);
-	        xmlXPathReleaseObject(ctxt->context, arg2);
-                XP_ERROR0(XPATH_INVALID_TYPE);
-            }
-            if ((ctxt->context->opLimit != 0) &&
-                (((arg1->nodesetval != NULL) &&
-                  (xmlXPathCheckOpLimit(ctxt,
-                                        arg1->nodesetval->nodeNr) < 0)) ||
-                 ((arg2->nodesetval != NULL) &&
-                  (xmlXPathCheckOpLimit(ctxt,
-                                        arg2->nodesetval->nodeNr) < 0)))) {
-	        xmlXPathReleaseObject(ctxt->context, arg1);
-	        xmlXPathReleaseObject(ctxt->context, arg2);
-                break;
+        case XPATH_OP_FUNCTION:
+            if (op->value5 != NULL)
+                goto error;
+            name = op->value4;
+
+            if (xmlStrEqual(name, BAD_CAST "not")) {
+                arg = xmlXPathSpecFunctionArg(comp, op, 1, NULL);
+                if (arg == NULL)
+                    goto error;
+                cond->func = xmlXPathSpecNot;
+                cond->left = xmlXPathSpecBuildCond(spec, comp, arg,
+                                                   depth + 1);
+                if (cond->left == NULL)
+                    goto error;
+            } else if ((xmlStrEqual(name, BAD_CAST "true")) ||
+                       (xmlStrEqual(name, BAD_CAST "false"))) {
+                if ((op->value != 0) || (op->ch1 != -1))
+                    goto error;
+                cond->func = (name[0] == 't') ? xmlXPathSpecTrue :
+                                                xmlXPathSpecFalse;
+            } else if ((xmlStrEqual(name, BAD_CAST "contains")) ||
+                       (xmlStrEqual(name, BAD_CAST "starts-with"))) {
+                arg = xmlXPathSpecFunctionArg(comp, op, 2, &second);
+                if ((arg == NULL) || (second->op != XPATH_OP_VALUE) ||
+                    (((xmlXPathObjectPtr) second->value4)->type !=
+                     XPATH_STRING))
+                    goto error;
+                cond->func = (name[0] == 'c') ? xmlXPathSpecContains :
+                                                xmlXPathSpecStartsWith;
+                cond->str = ((xmlXPathObjectPtr) second->value4)->stringval;
+                cond->path = xmlXPathSpecBuildPath(spec, comp, arg,
+                                                   depth + 1);
+                if (cond->path == NULL)
+                    goto error;
+            } else {
+                goto error;
             }
+            break;
 
-	    if (((arg2->nodesetval != NULL) &&
-		 (arg2->nodesetval->nodeNr != 0)))
-	    {
-		arg1->nodesetval = xmlXPathNodeSetMerge(arg1->nodesetval,
-							arg2->nodesetval);
-                if (arg1->nodesetval == NULL)
-                    xmlXPathPErrMemory(ctxt);
-	    }
+        default:
+            goto error;
+    }
 
-            xmlXPathValuePush(ctxt, arg1);
-	    xmlXPathReleaseObject(ctxt->context, arg2);
-            break;
-        case XPATH_OP_ROOT:
-            xmlXPathRoot(ctxt);
-            break;
-        case XPATH_OP_NODE:
-            if (op->ch1 != -1)
-                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-	    CHECK_ERROR0;
-            if (op->ch2 != -1)
-                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
-	    CHECK_ERROR0;
-	    xmlXPathValuePush(ctxt, xmlXPathCacheNewNodeSet(ctxt,
-                                                    ctxt->context->node));
-            break;
-        case XPATH_OP_COLLECT:{
-                if (op->ch1 == -1)
-                    break;
+    return(cond);
 
-                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-		CHECK_ERROR0;
+error:
+    xmlXPathSpecFreeCond(cond);
+    return(NULL);
+}
 
-                total += xmlXPathNodeCollectAndTest(ctxt, op, NULL, NULL, 0);
-                break;
+/*
+ * Evaluate a specialized expression.
+ *
+ * Returns 0 if the expression must be evaluated by the interpreter,
+ * 1 otherwise. `result` is set like the return value of
+ * xmlXPathRunEval.
+ */
+static int
+xmlXPathSpecRun(xmlXPathParserContextPtr ctxt, int toBool, int *result) {
+    xmlXPathSpec *spec = ctxt->comp->spec;
+    xmlXPathContextPtr xpctxt = ctxt->context;
+    xmlXPathObjectPtr obj = NULL;
+    xmlXPathSpecCtxt sctxt;
+    xmlNodeSetPtr set;
+    xmlNodePtr node = xpctxt->node;
+    const xmlChar *str;
+    xmlChar *copy;
+    double count = 0;
+    int i, res = 0;
+
+    /*
+     * The indexes are faster than any scan, and the interpreter
+     * reports unknown prefixes.
+     */
+    if ((xpctxt->flags & (XML_XPATH_NAME_INDEX | XML_XPATH_ATTR_INDEX)) ||
+        (node == NULL) || (node->type == XML_NAMESPACE_DECL) ||
+        (xpctxt->doc == NULL) ||
+        (xpctxt->depth >= XPATH_MAX_RECURSION_DEPTH))
+        return(0);
+
+    sctxt.pctxt = ctxt;
+    for (i = 0; i < spec->nbURIs; i++) {
+        sctxt.URIs[i] = xmlXPathNsLookup(xpctxt, spec->prefixes[i]);
+        if (sctxt.URIs[i] == NULL)
+            return(0);
+    }
+
+    xpctxt->depth += 1;
+
+    switch (spec->type) {
+        case XPATH_SPEC_NODESET:
+            if (toBool) {
+                res = xmlXPathSpecVisit(&sctxt, spec->path, node,
+                                        xmlXPathSpecStop, NULL);
+            } else {
+                set = xmlXPathSpecSelect(&sctxt, spec->path, node);
+                if (set == NULL)
+                    res = -1;
+                else
+                    obj = xmlXPathCacheWrapNodeSet(ctxt, set);
             }
-        case XPATH_OP_VALUE:
-            xmlXPathValuePush(ctxt, xmlXPathCacheObjectCopy(ctxt, op->value4));
             break;
-        case XPATH_OP_VARIABLE:{
-		xmlXPathObjectPtr val;
 
-                if (op->ch1 != -1)
-                    total +=
-                        xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-                if (op->value5 == NULL) {
-		    val = xmlXPathVariableLookup(ctxt->context, op->value4);
-		    if (val == NULL) {
-                        xmlXPathErrFmt(ctxt, XPATH_UNDEF_VARIABLE_ERROR,
-                                       "Undefined variable: %s\n", op->value4);
-                        return 0;
-                    }
-                    xmlXPathValuePush(ctxt, val);
-		} else {
-                    const xmlChar *URI;
+        case XPATH_SPEC_BOOLEAN:
+            res = spec->cond->func(&sctxt, spec->cond, node);
+            if ((res >= 0) && (!toBool))
+                obj = xmlXPathCacheNewBoolean(ctxt, res);
+            break;
 
-                    URI = xmlXPathNsLookup(ctxt->context, op->value5);
-                    if (URI == NULL) {
-                        xmlXPathErrFmt(ctxt, XPATH_UNDEF_PREFIX_ERROR,
-                                       "Undefined namespace prefix: %s\n",
-                                       op->value5);
-                        return 0;
-                    }
-		    val = xmlXPathVariableLookupNS(ctxt->context,
-                                                       op->value4, URI);
-		    if (val == NULL) {
-                        xmlXPathErrFmt(ctxt, XPATH_UNDEF_VARIABLE_ERROR,
-                                       "Undefined variable: %s:%s\n",
-                                       op->value5, op->value4);
-                        return 0;
-                    }
-                    xmlXPathValuePush(ctxt, val);
+        case XPATH_SPEC_COUNT:
+            if (spec->path->distinct) {
+                res = xmlXPathSpecVisit(&sctxt, spec->path, node,
+                                        xmlXPathSpecCount, &count);
+            } else {
+                set = xmlXPathSpecSelect(&sctxt, spec->path, node);
+                if (set == NULL) {
+                    res = -1;
+                } else {
+                    count = set->nodeNr;
+                    xmlXPathFreeNodeSet(set);
                 }
-                break;
             }
-        case XPATH_OP_FUNCTION:{
-                xmlXPathFunction func;
-                const xmlChar *oldFunc, *oldFuncURI;
-		int i;
-                int frame;
+            if (res >= 0) {
+                res = (count != 0);
+                if (!toBool)
+                    obj = xmlXPathCacheNewFloat(ctxt, count);
+            }
+            break;
 
-                frame = ctxt->valueNr;
-                if (op->ch1 != -1) {
-                    total +=
-                        xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-                    if (ctxt->error != XPATH_EXPRESSION_OK)
-                        break;
-                }
-		if (ctxt->valueNr < frame + op->value)
-		    XP_ERROR0(XPATH_INVALID_OPERAND);
-		for (i = 0; i < op->value; i++) {
-		    if (ctxt->valueTab[(ctxt->valueNr - 1) - i] == NULL)
-			XP_ERROR0(XPATH_INVALID_OPERAND);
+        case XPATH_SPEC_STRING:
+            str = xmlXPathSpecPathString(&sctxt, spec->path, node, &copy);
+            if (str == NULL) {
+                res = -1;
+            } else {
+                res = (str[0] != 0);
+                if (!toBool) {
+                    if (copy != NULL)
+                        obj = xmlXPathCacheWrapString(ctxt, copy);
+                    else
+                        obj = xmlXPathCacheNewString(ctxt, str);
+                    copy = NULL;
                 }
-                if (op->cache != NULL)
-                    func = op->cache;
-                else {
-                    const xmlChar *URI = NULL;
+                xmlFree(copy);
+            }
+            break;
+    }
 
-                    if (op->value5 == NULL) {
-                        func = xmlXPathFunctionLookup(ctxt->context,
-                                                      op->value4);
-                        if (func == NULL) {
-                            xmlXPathErrFmt(ctxt, XPATH_UNKNOWN_FUNC_ERROR,
-                                           "Unregistered function: %s\n",
-                                           op->value4);
-                            return 0;
-                        }
-                    } else {
-                        URI = xmlXPathNsLookup(ctxt->context, op->value5);
-                        if (URI == NULL) {
-                            xmlXPathErrFmt(ctxt, XPATH_UNDEF_PREFIX_ERROR,
-                                           "Undefined namespace prefix: %s\n",
-                                           op->value5);
-                            return 0;
-                        }
-                        func = xmlXPathFunctionLookupNS(ctxt->context,
-                                                        op->value4, URI);
-                        if (func == NULL) {
-                            xmlXPathErrFmt(ctxt, XPATH_UNKNOWN_FUNC_ERROR,
-                                           "Unregistered function: %s:%s\n",
-                                           op->value5, op->value4);
-                            return 0;
-                        }
-                    }
-                    op->cache = func;
-                    op->cacheURI = (void *) URI;
-                }
-                oldFunc = ctxt->context->function;
-                oldFuncURI = ctxt->context->functionURI;
-                ctxt->context->function = op->value4;
-                ctxt->context->functionURI = op->cacheURI;
-                func(ctxt, op->value);
-                ctxt->context->function = oldFunc;
-                ctxt->context->functionURI = oldFuncURI;
-                if ((ctxt->error == XPATH_EXPRESSION_OK) &&
-                    (ctxt->valueNr != frame + 1))
-                    XP_ERROR0(XPATH_STACK_ERROR);
+    xpctxt->depth -= 1;
+    xpctxt->node = node;
+
+    if ((res < 0) || (ctxt->error != XPATH_EXPRESSION_OK)) {
+        xmlXPathReleaseObject(xpctxt, obj);
+        *result = -1;
+    } else if (toBool) {
+        *result = (res != 0);
+    } else {
+        xmlXPathValuePush(ctxt, obj);
+        *result = 0;
+    }
+
+    return(1);
+}
+
+/**
+ * Compile a compiled XPath expression further into a tree of
+ * specialized evaluation functions. Later evaluations of `comp`
+ * use these functions instead of the generic interpreter.
+ *
+ * Supported are location paths, count() and string() of location
+ * paths, and boolean expressions built from paths, comparisons of a
+ * path with a literal, and, or, not(), contains() and starts-with().
+ * Predicates are limited to such boolean expressions and constant
+ * positions like "[1]". Variables, filter expressions and other
+ * function calls aren't supported.
+ *
+ * The interpreter is still used if the context has one of the
+ * XML_XPATH_NAME_INDEX or XML_XPATH_ATTR_INDEX flags set.
+ *
+ * This function must not be called while `comp` is being evaluated
+ * in another thread.
+ *
+ * @since 2.16.0
+ *
+ * @param comp  the compiled XPath expression
+ * @returns 1 if the expression was specialized, 0 if it isn't
+ * supported and -1 if a memory allocation failed.
+ */
+int
+xmlXPathCompiledSpecialize(xmlXPathCompExpr *comp) {
+    xmlXPathSpec *spec;
+    xmlXPathStepOpPtr op, arg;
+
+    if ((comp == NULL) || (comp->last < 0))
+        return(0);
+    if (comp->spec != NULL)
+        return(1);
+
+    spec = xmlMalloc(sizeof(*spec));
+    if (spec == NULL)
+        return(-1);
+    memset(spec, 0, sizeof(*spec));
+
+    op = &comp->steps[comp->last];
+    while ((op->op == XPATH_OP_SORT) && (op->ch1 != -1))
+        op = &comp->steps[op->ch1];
+
+    if ((op->op == XPATH_OP_FUNCTION) && (op->value5 == NULL) &&
+        ((xmlStrEqual(op->value4, BAD_CAST "count")) ||
+         (xmlStrEqual(op->value4, BAD_CAST "string")))) {
+        spec->type = (((xmlChar *) op->value4)[0] == 'c') ?
+                     XPATH_SPEC_COUNT : XPATH_SPEC_STRING;
+        arg = xmlXPathSpecFunctionArg(comp, op, 1, NULL);
+        if (arg != NULL)
+            spec->path = xmlXPathSpecBuildPath(spec, comp, arg, 0);
+    } else if ((op->op == XPATH_OP_COLLECT) || (op->op == XPATH_OP_ROOT) ||
+               (op->op == XPATH_OP_NODE)) {
+        spec->type = XPATH_SPEC_NODESET;
+        spec->path = xmlXPathSpecBuildPath(spec, comp, op, 0);
+    } else {
+        spec->type = XPATH_SPEC_BOOLEAN;
+        switch (op->op) {
+            case XPATH_OP_AND:
+            case XPATH_OP_OR:
+            case XPATH_OP_EQUAL:
+            case XPATH_OP_CMP:
+            case XPATH_OP_FUNCTION:
+                spec->cond = xmlXPathSpecBuildCond(spec, comp, op, 0);
                 break;
-            }
-        case XPATH_OP_ARG:
-            if (op->ch1 != -1) {
-                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-	        CHECK_ERROR0;
-            }
-            if (op->ch2 != -1) {
-                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch2]);
-	        CHECK_ERROR0;
+            default:
+                break;
+        }
+    }
+
+    if ((spec->path == NULL) && (spec->cond == NULL)) {
+        int ret = spec->memError ? -1 : 0;
+
+        xmlXPathSpecFree(spec);
+        return(ret);
+    }
+
+    comp->spec = spec;
+    return(1);
+}
+
+/**
+ * Evaluate the Precompiled XPath expression in the given context.
+ *
+ * @param ctxt  the XPath parser context with the compiled expression
+ * @param toBool  evaluate to a boolean result
+ */
+static int
+xmlXPathRunEval(xmlXPathParserContextPtr ctxt, int toBool)
+{
+    xmlXPathCompExprPtr comp;
+    int oldDepth;
+
+    if ((ctxt == NULL) || (ctxt->comp == NULL))
+	return(-1);
+
+    if (ctxt->valueTab == NULL) {
+#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
+        int valueMax = 1;
+#else
+        int valueMax = 10;
+#endif
+
+	/* Allocate the value stack */
+	ctxt->valueTab = xmlMalloc(valueMax * sizeof(xmlXPathObjectPtr));
+	if (ctxt->valueTab == NULL) {
+	    xmlXPathPErrMemory(ctxt);
+	    return(-1);
+	}
+	ctxt->valueNr = 0;
+	ctxt->valueMax = valueMax;
+	ctxt->value = NULL;
+    }
+#ifdef XPATH_STREAMING
+    if (ctxt->comp->stream) {
+	int res;
+
+	if (toBool) {
+	    /*
+	    * Evaluation to boolean result.
+	    */
+	    res = xmlXPathRunStreamEval(ctxt, ctxt->comp->stream, NULL, 1);
+	    if (res != -1)
+		return(res);
+	} else {
+	    xmlXPathObjectPtr resObj = NULL;
+
+	    /*
+	    * Evaluation to a sequence.
+	    */
+	    res = xmlXPathRunStreamEval(ctxt, ctxt->comp->stream, &resObj, 0);
+
+	    if ((res != -1) && (resObj != NULL)) {
+		xmlXPathValuePush(ctxt, resObj);
+		return(0);
 	    }
-            break;
-        case XPATH_OP_PREDICATE:
-        case XPATH_OP_FILTER:{
-                xmlXPathObjectPtr obj;
-                xmlNodeSetPtr set;
+	    if (resObj != NULL)
+		xmlXPathReleaseObject(ctxt->context, resObj);
+	}
+	/*
+	* QUESTION TODO: This falls back to normal XPath evaluation
+	* if res == -1. Is this intended?
+	*/
+    }
+#endif
+    comp = ctxt->comp;
+    if (comp->last < 0) {
+        xmlXPathErr(ctxt, XPATH_STACK_ERROR);
+	return(-1);
+    }
+    if (comp->spec != NULL) {
+        int res;
+
+        if (xmlXPathSpecRun(ctxt, toBool, &res))
+            return(res);
+    }
+    oldDepth = ctxt->context->depth;
+    if (toBool)
+	return(xmlXPathCompOpEvalToBoolean(ctxt,
+	    &comp->steps[comp->last], 0));
+    else
+	xmlXPathCompOpEval(ctxt, &comp->steps[comp->last]);
+    ctxt->context->depth = oldDepth;
+
+    return(0);
+}
+
+/************************************************************************
+ *									*
+ *			Public interfaces				*
+ *									*
+ ************************************************************************/
+
+/**
+ * Evaluate a predicate result for the current node.
+ * A PredicateExpr is evaluated by evaluating the Expr and converting
+ * the result to a boolean. If the result is a number, the result will
+ * be converted to true if the number is equal to the position of the
+ * context node in the context node list (as returned by the position
+ * function) and will be converted to false otherwise; if the result
+ * is not a number, then the result will be converted as if by a call
+ * to the boolean function.
+ *
+ * @param ctxt  the XPath context
+ * @param res  the Predicate Expression evaluation result
+ * @returns 1 if predicate is true, 0 otherwise
+ */
+int
+xmlXPathEvalPredicate(xmlXPathContext *ctxt, xmlXPathObject *res) {
+    if ((ctxt == NULL) || (res == NULL)) return(0);
+    switch (res->type) {
+        case XPATH_BOOLEAN:
+	    return(res->boolval);
+        case XPATH_NUMBER:
+	    return(res->floatval == ctxt->proximityPosition);
+        case XPATH_NODESET:
+        case XPATH_XSLT_TREE:
+	    if (res->nodesetval == NULL)
+		return(0);
+	    return(res->nodesetval->nodeNr != 0);
+        case XPATH_STRING:
+	    return((res->stringval != NULL) &&
+	           (xmlStrlen(res->stringval) != 0));
+        default:
+	    break;
+    }
+    return(0);
+}
 
-                /*
-                 * Optimization for ()[1] selection i.e. the first elem
-                 */
-                if ((op->ch1 != -1) && (op->ch2 != -1) &&
-#ifdef XP_OPTIMIZED_FILTER_FIRST
-		    /*
-		    * FILTER TODO: Can we assume that the inner processing
-		    *  will result in an ordered list if we have an
-		    *  XPATH_OP_FILTER?
-		    *  What about an additional field or flag on
-		    *  xmlXPathObject like @sorted ? This way we wouldn't need
-		    *  to assume anything, so it would be more robust and
-		    *  easier to optimize.
-		    */
-                    ((comp->steps[op->ch1].op == XPATH_OP_SORT) || /* 18 */
-		     (comp->steps[op->ch1].op == XPATH_OP_FILTER)) && /* 17 */
+/**
+ * Evaluate a predicate result for the current node.
+ * A PredicateExpr is evaluated by evaluating the Expr and converting
+ * the result to a boolean. If the result is a number, the result will
+ * be converted to true if the number is equal to the position of the
+ * context node in the context node list (as returned by the position
+ * function) and will be converted to false otherwise; if the result
+ * is not a number, then the result will be converted as if by a call
+ * to the boolean function.
+ *
+ * @param ctxt  the XPath Parser context
+ * @param res  the Predicate Expression evaluation result
+ * @returns 1 if predicate is true, 0 otherwise
+ */
+int
+xmlXPathEvaluatePredicateResult(xmlXPathParserContext *ctxt,
+                                xmlXPathObject *res) {
+    if ((ctxt == NULL) || (res == NULL)) return(0);
+    switch (res->type) {
+        case XPATH_BOOLEAN:
+	    return(res->boolval);
+        case XPATH_NUMBER:
+#if defined(__BORLANDC__) || (defined(_MSC_VER) && (_MSC_VER == 1200))
+	    return((res->floatval == ctxt->context->proximityPosition) &&
+	           (!xmlXPathIsNaN(res->floatval))); /* MSC pbm Mark Vakoc !*/
 #else
-		    (comp->steps[op->ch1].op == XPATH_OP_SORT) &&
+	    return(res->floatval == ctxt->context->proximityPosition);
 #endif
-                    (comp->steps[op->ch2].op == XPATH_OP_VALUE)) { /* 12 */
-                    xmlXPathObjectPtr val;
+        case XPATH_NODESET:
+        case XPATH_XSLT_TREE:
+	    if (res->nodesetval == NULL)
+		return(0);
+	    return(res->nodesetval->nodeNr != 0);
+        case XPATH_STRING:
+	    return((res->stringval != NULL) && (res->stringval[0] != 0));
+        default:
+	    break;
+    }
+    return(0);
+}
 
-                    val = comp->steps[op->ch2].value4;
-                    if ((val != NULL) && (val->type == XPATH_NUMBER) &&
-                        (val->floatval == 1.0)) {
-                        xmlNodePtr first = NULL;
+#ifdef XPATH_STREAMING
+/**
+ * Try to compile the XPath expression as a streamable subset.
+ *
+ * @param ctxt  an XPath context
+ * @param str  the XPath expression
+ * @returns the compiled expression or NULL if failed to compile.
+ */
+static xmlXPathCompExprPtr
+xmlXPathTryStreamCompile(xmlXPathContextPtr ctxt, const xmlChar *str) {
+    /*
+     * Optimization: use streaming patterns when the XPath expression can
+     * be compiled to a stream lookup
+     */
+    xmlPatternPtr stream;
+    xmlXPathCompExprPtr comp;
+    xmlDictPtr dict = NULL;
+    const xmlChar **namespaces = NULL;
+    xmlNsPtr ns;
+    int i, j;
 
-                        total +=
-                            xmlXPathCompOpEvalFirst(ctxt,
-                                                    &comp->steps[op->ch1],
-                                                    &first);
-			CHECK_ERROR0;
-                        /*
-                         * The nodeset should be in document order,
-                         * Keep only the first value
-                         */
-                        if ((ctxt->value != NULL) &&
-                            (ctxt->value->type == XPATH_NODESET) &&
-                            (ctxt->value->nodesetval != NULL) &&
-                            (ctxt->value->nodesetval->nodeNr > 1))
-                            xmlXPathNodeSetClearFromPos(ctxt->value->nodesetval,
-                                                        1, 1);
-                        break;
-                    }
-                }
-                /*
-                 * Optimization for ()[last()] selection i.e. the last elem
-                 */
-                if ((op->ch1 != -1) && (op->ch2 != -1) &&
-                    (comp->steps[op->ch1].op == XPATH_OP_SORT) &&
-                    (comp->steps[op->ch2].op == XPATH_OP_SORT)) {
-                    int f = comp->steps[op->ch2].ch1;
+    if ((!xmlStrchr(str, '[')) && (!xmlStrchr(str, '(')) &&
+        (!xmlStrchr(str, '@'))) {
+	const xmlChar *tmp;
+        int res;
 
-                    if ((f != -1) &&
-                        (comp->steps[f].op == XPATH_OP_FUNCTION) &&
-                        (comp->steps[f].value5 == NULL) &&
-                        (comp->steps[f].value == 0) &&
-                        (comp->steps[f].value4 != NULL) &&
-                        (xmlStrEqual
-                         (comp->steps[f].value4, BAD_CAST "last"))) {
-                        xmlNodePtr last = NULL;
+	/*
+	 * We don't try to handle expressions using the verbose axis
+	 * specifiers ("::"), just the simplified form at this point.
+	 * Additionally, if there is no list of namespaces available and
+	 *  there's a ":" in the expression, indicating a prefixed QName,
+	 *  then we won't try to compile either. xmlPatterncompile() needs
+	 *  to have a list of namespaces at compilation time in order to
+	 *  compile prefixed name tests.
+	 */
+	tmp = xmlStrchr(str, ':');
+	if ((tmp != NULL) &&
+	    ((ctxt == NULL) || (ctxt->nsNr == 0) || (tmp[1] == ':')))
+	    return(NULL);
 
-                        total +=
-                            xmlXPathCompOpEvalLast(ctxt,
-                                                   &comp->steps[op->ch1],
-                                                   &last);
-			CHECK_ERROR0;
-                        /*
-                         * The nodeset should be in document order,
-                         * Keep only the last value
-                         */
-                        if ((ctxt->value != NULL) &&
-                            (ctxt->value->type == XPATH_NODESET) &&
-                            (ctxt->value->nodesetval != NULL) &&
-                            (ctxt->value->nodesetval->nodeTab != NULL) &&
-                            (ctxt->value->nodesetval->nodeNr > 1))
-                            xmlXPathNodeSetKeepLast(ctxt->value->nodesetval);
-                        break;
-                    }
-                }
-		/*
-		* Process inner predicates first.
-		* Example "index[parent::book][1]":
-		* ...
-		*   PREDICATE   <-- we are here "[1]"
-		*     PREDICATE <-- process "[parent::book]" first
-		*       SORT
-		*         COLLECT  'parent' 'name' 'node' book
-		*           NODE
-		*     ELEM Object is a number : 1
-		*/
-                if (op->ch1 != -1)
-                    total +=
-                        xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-		CHECK_ERROR0;
-                if (op->ch2 == -1)
-                    break;
-                if (ctxt->value == NULL)
-                    break;
+	if (ctxt != NULL) {
+	    dict = ctxt->dict;
+	    if (ctxt->nsNr > 0) {
+		namespaces = xmlMalloc(2 * (ctxt->nsNr + 1) * sizeof(xmlChar*));
+		if (namespaces == NULL) {
+		    xmlXPathErrMemory(ctxt);
+		    return(NULL);
+		}
+		for (i = 0, j = 0; (j < ctxt->nsNr); j++) {
+		    ns = ctxt->namespaces[j];
+		    namespaces[i++] = ns->href;
+		    namespaces[i++] = ns->prefix;
+		}
+		namespaces[i++] = NULL;
+		namespaces[i] = NULL;
+	    }
+	}
 
-                /*
-                 * In case of errors, xmlXPathNodeSetFilter can pop additional
-                 * nodes from the stack. We have to temporarily remove the
-                 * nodeset object from the stack to avoid freeing it
-                 * prematurely.
-                 */
-                CHECK_TYPE0(XPATH_NODESET);
-                obj = xmlXPathValuePop(ctxt);
-                set = obj->nodesetval;
-                if (set != NULL)
-                    xmlXPathNodeSetFilter(ctxt, set, op->ch2,
-                                          1, set->nodeNr, 1);
-                xmlXPathValuePush(ctxt, obj);
-                break;
-            }
-        case XPATH_OP_SORT:
-            if (op->ch1 != -1)
-                total += xmlXPathCompOpEval(ctxt, &comp->steps[op->ch1]);
-	    CHECK_ERROR0;
-            if ((ctxt->value != NULL) &&
-                (ctxt->value->type == XPATH_NODESET) &&
-                (ctxt->value->nodesetval != NULL) &&
-		(ctxt->value->nodesetval->nodeNr > 1))
-	    {
-                xmlXPathNodeSetSort(ctxt->value->nodesetval);
+	res = xmlPatternCompileSafe(str, dict, XML_PATTERN_XPATH, namespaces,
+                                    &stream);
+	if (namespaces != NULL) {
+	    xmlFree((xmlChar **)namespaces);
+	}
+        if (res < 0) {
+            xmlXPathErrMemory(ctxt);
+            return(NULL);
+        }
+	if ((stream != NULL) && (xmlPatternStreamable(stream) == 1)) {
+	    comp = xmlXPathNewCompExpr();
+	    if (comp == NULL) {
+		xmlXPathErrMemory(ctxt);
+	        xmlFreePattern(stream);
+		return(NULL);
 	    }
+	    comp->stream = stream;
+	    comp->dict = dict;
+	    if (comp->dict)
+		xmlDictReference(comp->dict);
+	    return(comp);
+	}
+	xmlFreePattern(stream);
+    }
+    return(NULL);
+}
+#endif /* XPATH_STREAMING */
+
+/**
+ * Check whether an expression doesn't call last(), position() or
+ * functions which aren't core functions.
+ *
+ * @param comp  the compiled expression
+ * @param op  the expression op
+ * @param depth  recursion depth
+ * @returns 1 if the expression doesn't depend on the context position
+ * or size, 0 otherwise.
+ */
+static int
+xmlXPathIgnoresPosition(xmlXPathCompExprPtr comp, xmlXPathStepOpPtr op,
+                        int depth) {
+    if (depth > 50)
+        return(0);
+
+    if (op->op == XPATH_OP_FUNCTION) {
+        size_t i;
+
+        if ((op->value5 != NULL) ||
+            (xmlStrEqual(op->value4, BAD_CAST "last")) ||
+            (xmlStrEqual(op->value4, BAD_CAST "position")))
+            return(0);
+        for (i = 0; i < NUM_STANDARD_FUNCTIONS; i++) {
+            if (xmlStrEqual(op->value4,
+                            BAD_CAST xmlXPathStandardFunctions[i].name))
+                break;
+        }
+        if (i >= NUM_STANDARD_FUNCTIONS)
+            return(0);
+    }
+
+    /* ch1 of values and variables isn't an operand */
+    if ((op->op == XPATH_OP_VALUE) || (op->op == XPATH_OP_VARIABLE))
+        return(1);
+
+    if ((op->ch1 != -1) &&
+        (!xmlXPathIgnoresPosition(comp, &comp->steps[op->ch1], depth + 1)))
+        return(0);
+    if ((op->ch2 != -1) &&
+        (!xmlXPathIgnoresPosition(comp, &comp->steps[op->ch2], depth + 1)))
+        return(0);
+
+    return(1);
+}
+
+/*
+ * Check whether a single predicate expression returns a boolean or a
+ * node-set and doesn't depend on the context position or size.
+ */
+static int
+xmlXPathPredicateIgnoresPosition(xmlXPathCompExprPtr comp,
+                                 xmlXPathStepOpPtr exprOp) {
+    switch (exprOp->op) {
+        case XPATH_OP_AND:
+        case XPATH_OP_OR:
+        case XPATH_OP_EQUAL:
+        case XPATH_OP_CMP:
+        case XPATH_OP_COLLECT:
             break;
+        case XPATH_OP_VALUE:
+            /* Only numbers are compared with the position */
+            return(((xmlXPathObjectPtr) exprOp->value4)->type !=
+                   XPATH_NUMBER);
+        case XPATH_OP_FUNCTION:
+            if ((exprOp->value5 == NULL) &&
+                ((xmlStrEqual(exprOp->value4, BAD_CAST "not")) ||
+                 (xmlStrEqual(exprOp->value4, BAD_CAST "boolean")) ||
+                 (xmlStrEqual(exprOp->value4, BAD_CAST "contains")) ||
+                 (xmlStrEqual(exprOp->value4, BAD_CAST "starts-with"))))
+                break;
+            return(0);
         default:
-            XP_ERROR0(XPATH_INVALID_OPERAND);
-            break;
+            return(0);
     }
 
-    ctxt->context->depth -= 1;
-    return (total);
+    return(xmlXPathIgnoresPosition(comp, exprOp, 0));
 }
 
 /**
- * Evaluates if the expression evaluates to true.
- *
- * @param ctxt  the XPath parser context
- * @param op  the step operation
- * @param isPredicate  whether a predicate is evaluated
- * @returns 1 if true, 0 if false and -1 on API or internal errors.
+ * Check whether the predicates of a step select the same nodes no
+ * matter how the nodes they filter are grouped. This is the case if
+ * every predicate returns a boolean or a node-set and doesn't depend
+ * on the context position or size.
+ *
+ * @param comp  the compiled expression
+ * @param op  the outermost predicate op
+ * @returns 1 if the predicates ignore the position, 0 otherwise.
  */
 static int
-xmlXPathCompOpEvalToBoolean(xmlXPathParserContextPtr ctxt,
-			    xmlXPathStepOpPtr op,
-			    int isPredicate)
-{
-    xmlXPathObjectPtr resObj = NULL;
+xmlXPathPredicatesIgnorePosition(xmlXPathCompExprPtr comp,
+                                 xmlXPathStepOpPtr op) {
+    while (1) {
+        if ((op->op != XPATH_OP_PREDICATE) || (op->ch2 == -1))
+            return(0);
+        if (!xmlXPathPredicateIgnoresPosition(comp, &comp->steps[op->ch2]))
+            return(0);
+
+        if (op->ch1 == -1)
+            break;
+        op = &comp->steps[op->ch1];
+    }
 
-start:
-    if (OP_LIMIT_EXCEEDED(ctxt, 1))
-        return(0);
-    /* comp = ctxt->comp; */
-    switch (op->op) {
-        case XPATH_OP_END:
-            return (0);
-	case XPATH_OP_VALUE:
-	    resObj = (xmlXPathObjectPtr) op->value4;
-	    if (isPredicate)
-		return(xmlXPathEvaluatePredicateResult(ctxt, resObj));
-	    return(xmlXPathCastToBoolean(resObj));
-	case XPATH_OP_SORT:
-	    /*
-	    * We don't need sorting for boolean results. Skip this one.
-	    */
-            if (op->ch1 != -1) {
-		op = &ctxt->comp->steps[op->ch1];
-		goto start;
-	    }
-	    return(0);
-	case XPATH_OP_COLLECT:
-	    if (op->ch1 == -1)
-		return(0);
+    return(1);
+}
 
-            xmlXPathCompOpEval(ctxt, &ctxt->comp->steps[op->ch1]);
-	    if (ctxt->error != XPATH_EXPRESSION_OK)
-		return(-1);
+/************************************************************************
+ *									*
+ *			Expression rewriting				*
+ *									*
+ ************************************************************************/
 
-            xmlXPathNodeCollectAndTest(ctxt, op, NULL, NULL, 1);
-	    if (ctxt->error != XPATH_EXPRESSION_OK)
-		return(-1);
+/*
+ * Standard functions whose result only depends on their arguments,
+ * with the number of arguments for which this holds. A maximum of
+ * -1 means any number.
+ */
+static const struct {
+    const char *name;
+    int minArgs;
+    int maxArgs;
+} xmlXPathFoldableFunctions[] = {
+    { "boolean", 1, 1 },
+    { "ceiling", 1, 1 },
+    { "concat", 2, -1 },
+    { "contains", 2, 2 },
+    { "false", 0, 0 },
+    { "floor", 1, 1 },
+    { "normalize-space", 1, 1 },
+    { "not", 1, 1 },
+    { "number", 1, 1 },
+    { "round", 1, 1 },
+    { "starts-with", 2, 2 },
+    { "string", 1, 1 },
+    { "string-length", 1, 1 },
+    { "substring", 2, 3 },
+    { "substring-after", 2, 2 },
+    { "substring-before", 2, 2 },
+    { "translate", 3, 3 },
+    { "true", 0, 0 }
+};
 
-	    resObj = xmlXPathValuePop(ctxt);
-	    if (resObj == NULL)
-		return(-1);
-	    break;
-	default:
-	    /*
-	    * Fallback to call xmlXPathCompOpEval().
-	    */
-	    xmlXPathCompOpEval(ctxt, op);
-	    if (ctxt->error != XPATH_EXPRESSION_OK)
-		return(-1);
+#define NUM_FOLDABLE_FUNCTIONS \
+    (sizeof(xmlXPathFoldableFunctions) / \
+     sizeof(xmlXPathFoldableFunctions[0]))
 
-	    resObj = xmlXPathValuePop(ctxt);
-	    if (resObj == NULL)
-		return(-1);
-	    break;
-    }
+/*
+ * Check whether a function call with constant arguments can be
+ * evaluated at compile time.
+ */
+static int
+xmlXPathIsFoldableCall(xmlXPathCompExprPtr comp, xmlXPathStepOpPtr op) {
+    xmlXPathStepOpPtr arg;
+    size_t i;
 
-    if (resObj) {
-	int res;
+    if (op->value5 != NULL)
+        return(0);
+    for (i = 0; i < NUM_FOLDABLE_FUNCTIONS; i++) {
+        if (xmlStrEqual(op->value4,
+                        BAD_CAST xmlXPathFoldableFunctions[i].name))
+            break;
+    }
+    if ((i >= NUM_FOLDABLE_FUNCTIONS) ||
+        (op->value < xmlXPathFoldableFunctions[i].minArgs) ||
+        ((xmlXPathFoldableFunctions[i].maxArgs >= 0) &&
+         (op->value > xmlXPathFoldableFunctions[i].maxArgs)))
+        return(0);
 
-	if (resObj->type == XPATH_BOOLEAN) {
-	    res = resObj->boolval;
-	} else if (isPredicate) {
-	    /*
-	    * For predicates a result of type "number" is handled
-	    * differently:
-	    * SPEC XPath 1.0:
-	    * "If the result is a number, the result will be converted
-	    *  to true if the number is equal to the context position
-	    *  and will be converted to false otherwise;"
-	    */
-	    res = xmlXPathEvaluatePredicateResult(ctxt, resObj);
-	} else {
-	    res = xmlXPathCastToBoolean(resObj);
-	}
-	xmlXPathReleaseObject(ctxt->context, resObj);
-	return(res);
+    for (arg = (op->ch1 >= 0) ? &comp->steps[op->ch1] : NULL;
+         arg != NULL;
+         arg = (arg->ch1 >= 0) ? &comp->steps[arg->ch1] : NULL) {
+        if ((arg->op != XPATH_OP_ARG) || (arg->ch2 < 0) ||
+            (comp->steps[arg->ch2].op != XPATH_OP_VALUE))
+            return(0);
     }
 
-    return(0);
+    return(1);
 }
 
-#ifdef XPATH_STREAMING
-/**
- * Evaluate the Precompiled Streamable XPath expression in the given context.
- *
- * @param pctxt  the XPath parser context with the compiled expression
+/*
+ * Turn an op into a VALUE op holding `value`.
  */
-static int
-xmlXPathRunStreamEval(xmlXPathParserContextPtr pctxt, xmlPatternPtr comp,
-		      xmlXPathObjectPtr *resultSeq, int toBool)
-{
-    int max_depth, min_depth;
-    int from_root;
-    int ret, depth;
-    int eval_all_nodes;
-    xmlNodePtr cur = NULL, limit = NULL;
-    xmlStreamCtxtPtr patstream = NULL;
-    xmlXPathContextPtr ctxt = pctxt->context;
+static void
+xmlXPathSetValueOp(xmlXPathCompExprPtr comp, xmlXPathStepOpPtr op,
+                   xmlXPathObjectPtr value) {
+    if ((comp->dict == NULL) && (op->op != XPATH_OP_VALUE)) {
+        xmlFree(op->value4);
+        xmlFree(op->value5);
+    }
+    op->op = XPATH_OP_VALUE;
+    op->ch1 = -1;
+    op->ch2 = -1;
+    op->value = value->type;
+    op->value2 = 0;
+    op->value3 = 0;
+    op->value4 = value;
+    op->value5 = NULL;
+    op->cache = NULL;
+}
 
-    if ((ctxt == NULL) || (comp == NULL))
-        return(-1);
-    max_depth = xmlPatternMaxDepth(comp);
-    if (max_depth == -1)
-        return(-1);
-    if (max_depth == -2)
-        max_depth = 10000;
-    min_depth = xmlPatternMinDepth(comp);
-    if (min_depth == -1)
-        return(-1);
-    from_root = xmlPatternFromRoot(comp);
-    if (from_root < 0)
-        return(-1);
+/*
+ * Evaluate an op whose operands are constant and turn it into a
+ * VALUE op. The op is left alone if the evaluation fails.
+ */
+static void
+xmlXPathFoldOp(xmlXPathParserContextPtr pctxt, xmlXPathStepOpPtr op) {
+    xmlXPathParserContextPtr tmp;
+    xmlXPathObjectPtr res = NULL;
 
-    if (! toBool) {
-	if (resultSeq == NULL)
-	    return(-1);
-	*resultSeq = xmlXPathCacheNewNodeSet(pctxt, NULL);
-	if (*resultSeq == NULL)
-	    return(-1);
+    tmp = xmlXPathCompParserContext(pctxt->comp, pctxt->context);
+    if (tmp == NULL)
+        return;
+    xmlXPathCompOpEval(tmp, op);
+    if ((tmp->error == XPATH_EXPRESSION_OK) && (tmp->valueNr == 1))
+        res = xmlXPathValuePop(tmp);
+    tmp->comp = NULL;
+    xmlXPathFreeParserContext(tmp);
+
+    if (res == NULL)
+        return;
+    if ((res->type != XPATH_BOOLEAN) && (res->type != XPATH_NUMBER) &&
+        (res->type != XPATH_STRING)) {
+        xmlXPathFreeObject(res);
+        return;
     }
+    xmlXPathSetValueOp(pctxt->comp, op, res);
+}
 
-    /*
-     * handle the special cases of "/" amd "." being matched
-     */
-    if (min_depth == 0) {
-        int res;
+/*
+ * Fold constant subexpressions, working bottom-up. Operators and
+ * function calls with constant operands are evaluated. "false() and
+ * x" and "true() or x" are replaced with their result.
+ */
+static void
+xmlXPathFoldConstants(xmlXPathParserContextPtr pctxt, xmlXPathStepOpPtr op,
+                      int depth) {
+    xmlXPathCompExprPtr comp = pctxt->comp;
+    xmlXPathStepOpPtr op1, op2;
 
-	if (from_root) {
-	    /* Select "/" */
-	    if (toBool)
-		return(1);
-            res = xmlXPathNodeSetAddUnique((*resultSeq)->nodesetval,
-                                           (xmlNodePtr) ctxt->doc);
-	} else {
-	    /* Select "self::node()" */
-	    if (toBool)
-		return(1);
-            res = xmlXPathNodeSetAddUnique((*resultSeq)->nodesetval,
-                                           ctxt->node);
-	}
+    /* OP_VALUE has invalid ch1. */
+    if ((op->op == XPATH_OP_VALUE) || (depth > XPATH_MAX_RECURSION_DEPTH))
+        return;
+
+    if (op->ch1 >= 0)
+        xmlXPathFoldConstants(pctxt, &comp->steps[op->ch1], depth + 1);
+    if (op->ch2 >= 0)
+        xmlXPathFoldConstants(pctxt, &comp->steps[op->ch2], depth + 1);
+
+    op1 = (op->ch1 >= 0) ? &comp->steps[op->ch1] : NULL;
+    op2 = (op->ch2 >= 0) ? &comp->steps[op->ch2] : NULL;
+
+    switch (op->op) {
+        case XPATH_OP_AND:
+        case XPATH_OP_OR:
+            if ((op1 == NULL) || (op1->op != XPATH_OP_VALUE))
+                break;
+            /* The second operand isn't evaluated in this case. */
+            if ((op2 != NULL) && (op2->op != XPATH_OP_VALUE) &&
+                (xmlXPathCastToBoolean(op1->value4) ==
+                 (op->op == XPATH_OP_AND)))
+                break;
+            xmlXPathFoldOp(pctxt, op);
+            break;
+        case XPATH_OP_EQUAL:
+        case XPATH_OP_CMP:
+        case XPATH_OP_PLUS:
+        case XPATH_OP_MULT:
+            if ((op1 != NULL) && (op1->op == XPATH_OP_VALUE) &&
+                ((op2 == NULL) || (op2->op == XPATH_OP_VALUE)))
+                xmlXPathFoldOp(pctxt, op);
+            break;
+        case XPATH_OP_FUNCTION:
+            if (xmlXPathIsFoldableCall(comp, op))
+                xmlXPathFoldOp(pctxt, op);
+            break;
+        case XPATH_OP_SORT:
+            /* Move the value into the SORT op. */
+            if ((op1 != NULL) && (op1->op == XPATH_OP_VALUE)) {
+                *op = *op1;
+                op1->value4 = NULL;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Standard functions which can't raise an error when called with a
+ * number of arguments in the given range. A maximum of -1 means any
+ * number. If `nodeSetArgs` is set, the arguments must be node-sets.
+ */
+static const struct {
+    const char *name;
+    int minArgs;
+    int maxArgs;
+    int nodeSetArgs;
+} xmlXPathSafeFunctions[] = {
+    { "boolean", 1, 1, 0 },
+    { "ceiling", 1, 1, 0 },
+    { "concat", 2, -1, 0 },
+    { "contains", 2, 2, 0 },
+    { "count", 1, 1, 1 },
+    { "false", 0, 0, 0 },
+    { "floor", 1, 1, 0 },
+    { "id", 1, 1, 0 },
+    { "lang", 1, 1, 0 },
+    { "last", 0, 0, 0 },
+    { "local-name", 0, 1, 1 },
+    { "name", 0, 1, 1 },
+    { "namespace-uri", 0, 1, 1 },
+    { "normalize-space", 0, 1, 0 },
+    { "not", 1, 1, 0 },
+    { "number", 0, 1, 0 },
+    { "position", 0, 0, 0 },
+    { "round", 1, 1, 0 },
+    { "starts-with", 2, 2, 0 },
+    { "string", 0, 1, 0 },
+    { "string-length", 0, 1, 0 },
+    { "substring", 2, 3, 0 },
+    { "substring-after", 2, 2, 0 },
+    { "substring-before", 2, 2, 0 },
+    { "sum", 1, 1, 1 },
+    { "translate", 3, 3, 0 },
+    { "true", 0, 0, 0 }
+};
+
+#define NUM_SAFE_FUNCTIONS \
+    (sizeof(xmlXPathSafeFunctions) / sizeof(xmlXPathSafeFunctions[0]))
+
+/*
+ * Check whether evaluating an expression can't raise an error. This
+ * excludes variables, extension functions and standard functions
+ * called with the wrong number or type of arguments, like count(1).
+ * If `nodeSet` is set, the expression must also return a node-set.
+ * Such expressions can be skipped or evaluated in any order without
+ * changing the result or the errors raised.
+ */
+static int
+xmlXPathCannotFail(xmlXPathCompExprPtr comp, xmlXPathStepOpPtr op,
+                   int nodeSet, int depth) {
+    xmlXPathStepOpPtr arg;
+    size_t i;
+
+    if (depth > 50)
+        return(0);
+
+    switch (op->op) {
+        case XPATH_OP_VALUE:
+            /* ch1 of values isn't an operand */
+            return(!nodeSet);
+        case XPATH_OP_NODE:
+        case XPATH_OP_ROOT:
+            return(1);
+        case XPATH_OP_AND:
+        case XPATH_OP_OR:
+        case XPATH_OP_EQUAL:
+        case XPATH_OP_CMP:
+        case XPATH_OP_PLUS:
+        case XPATH_OP_MULT:
+            if (nodeSet)
+                return(0);
+            break;
+        case XPATH_OP_SORT:
+            if ((op->ch1 >= 0) &&
+                (!xmlXPathCannotFail(comp, &comp->steps[op->ch1], nodeSet,
+                                     depth + 1)))
+                return(0);
+            return(1);
+        case XPATH_OP_UNION:
+            nodeSet = 1;
+            break;
+        case XPATH_OP_COLLECT:
+        case XPATH_OP_PREDICATE:
+        case XPATH_OP_FILTER:
+            /* The input must be a node-set, predicates can be anything */
+            if ((op->ch1 >= 0) &&
+                (!xmlXPathCannotFail(comp, &comp->steps[op->ch1], 1,
+                                     depth + 1)))
+                return(0);
+            if ((op->ch2 >= 0) &&
+                (!xmlXPathCannotFail(comp, &comp->steps[op->ch2], 0,
+                                     depth + 1)))
+                return(0);
+            return(1);
+        case XPATH_OP_FUNCTION:
+            if ((nodeSet) || (op->value5 != NULL))
+                return(0);
+            for (i = 0; i < NUM_SAFE_FUNCTIONS; i++) {
+                if (xmlStrEqual(op->value4,
+                                BAD_CAST xmlXPathSafeFunctions[i].name))
+                    break;
+            }
+            if ((i >= NUM_SAFE_FUNCTIONS) ||
+                (op->value < xmlXPathSafeFunctions[i].minArgs) ||
+                ((xmlXPathSafeFunctions[i].maxArgs >= 0) &&
+                 (op->value > xmlXPathSafeFunctions[i].maxArgs)))
+                return(0);
 
-        if (res < 0)
-            xmlXPathPErrMemory(pctxt);
-    }
-    if (max_depth == 0) {
-	return(0);
+            for (arg = (op->ch1 >= 0) ? &comp->steps[op->ch1] : NULL;
+                 arg != NULL;
+                 arg = (arg->ch1 >= 0) ? &comp->steps[arg->ch1] : NULL) {
+                if ((arg->op != XPATH_OP_ARG) || (arg->ch2 < 0) ||
+                    (!xmlXPathCannotFail(comp, &comp->steps[arg->ch2],
+                                         xmlXPathSafeFunctions[i].nodeSetArgs,
+                                         depth + 1)))
+                    return(0);
+            }
+            return(1);
+        default:
+            return(0);
     }
 
-    if (from_root) {
-        cur = (xmlNodePtr)ctxt->doc;
-    } else if (ctxt->node != NULL) {
-        switch (ctxt->node->type) {
-            case XML_ELEMENT_NODE:
-            case XML_DOCUMENT_NODE:
-            case XML_DOCUMENT_FRAG_NODE:
-            case XML_HTML_DOCUMENT_NODE:
-	        cur = ctxt->node;
-		break;
-            case XML_ATTRIBUTE_NODE:
-            case XML_TEXT_NODE:
-            case XML_CDATA_SECTION_NODE:
-            case XML_ENTITY_REF_NODE:
-            case XML_ENTITY_NODE:
-            case XML_PI_NODE:
-            case XML_COMMENT_NODE:
-            case XML_NOTATION_NODE:
-            case XML_DTD_NODE:
-            case XML_DOCUMENT_TYPE_NODE:
-            case XML_ELEMENT_DECL:
-            case XML_ATTRIBUTE_DECL:
-            case XML_ENTITY_DECL:
-            case XML_NAMESPACE_DECL:
-            case XML_XINCLUDE_START:
-            case XML_XINCLUDE_END:
-		break;
-	}
-	limit = cur;
-    }
-    if (cur == NULL) {
+    if ((op->ch1 >= 0) &&
+        (!xmlXPathCannotFail(comp, &comp->steps[op->ch1], nodeSet,
+                             depth + 1)))
+        return(0);
+    if ((op->ch2 >= 0) &&
+        (!xmlXPathCannotFail(comp, &comp->steps[op->ch2], nodeSet,
+                             depth + 1)))
         return(0);
-    }
 
-    patstream = xmlPatternGetStreamCtxt(comp);
-    if (patstream == NULL) {
-        xmlXPathPErrMemory(pctxt);
-	return(-1);
-    }
+    return(1);
+}
 
-    eval_all_nodes = xmlStreamWantsAnyNode(patstream);
+#define XPATH_MAX_COST 1000000
 
-    if (from_root) {
-	ret = xmlStreamPush(patstream, NULL, NULL);
-	if (ret < 0) {
-	} else if (ret == 1) {
-	    if (toBool)
-		goto return_1;
-	    if (xmlXPathNodeSetAddUnique((*resultSeq)->nodesetval, cur) < 0)
-                xmlXPathPErrMemory(pctxt);
-	}
-    }
-    depth = 0;
-    goto scan_children;
-next_node:
-    do {
-        if (ctxt->opLimit != 0) {
-            if (ctxt->opCount >= ctxt->opLimit) {
-                xmlXPathErr(ctxt, XPATH_RECURSION_LIMIT_EXCEEDED);
-                xmlFreeStreamCtxt(patstream);
-                return(-1);
+/*
+ * Estimate the cost of evaluating an expression once. Steps on axes
+ * that visit many nodes multiply the cost of their predicates.
+ */
+static int
+xmlXPathEstimateCost(xmlXPathCompExprPtr comp, xmlXPathStepOpPtr op,
+                     int depth) {
+    int cost = 1, weight;
+
+    if (depth > XPATH_MAX_RECURSION_DEPTH)
+        return(XPATH_MAX_COST);
+
+    switch (op->op) {
+        case XPATH_OP_VALUE:
+            return(1);
+        case XPATH_OP_COLLECT:
+            switch ((xmlXPathAxisVal) op->value) {
+                case AXIS_SELF:
+                    weight = 1;
+                    break;
+                case AXIS_ATTRIBUTE:
+                case AXIS_PARENT:
+                    weight = 2;
+                    break;
+                case AXIS_NAMESPACE:
+                    weight = 4;
+                    break;
+                case AXIS_CHILD:
+                case AXIS_ANCESTOR:
+                case AXIS_ANCESTOR_OR_SELF:
+                    weight = 8;
+                    break;
+                case AXIS_FOLLOWING_SIBLING:
+                case AXIS_PRECEDING_SIBLING:
+                    weight = 16;
+                    break;
+                default:
+                    weight = 64;
+                    break;
             }
-            ctxt->opCount++;
-        }
+            if (op->ch1 >= 0)
+                cost = xmlXPathEstimateCost(comp, &comp->steps[op->ch1],
+                                            depth + 1);
+            if (op->ch2 >= 0)
+                weight += weight *
+                          xmlXPathEstimateCost(comp, &comp->steps[op->ch2],
+                                               depth + 1);
+            cost += weight;
+            return((cost > XPATH_MAX_COST) ? XPATH_MAX_COST : cost);
+        case XPATH_OP_FUNCTION:
+            /* id() and string functions do more work per call */
+            cost = 4;
+            break;
+        default:
+            break;
+    }
 
-	switch (cur->type) {
-	    case XML_ELEMENT_NODE:
-	    case XML_TEXT_NODE:
-	    case XML_CDATA_SECTION_NODE:
-	    case XML_COMMENT_NODE:
-	    case XML_PI_NODE:
-		if (cur->type == XML_ELEMENT_NODE) {
-		    ret = xmlStreamPush(patstream, cur->name,
-				(cur->ns ? cur->ns->href : NULL));
-		} else if (eval_all_nodes)
-		    ret = xmlStreamPushNode(patstream, NULL, NULL, cur->type);
-		else
-		    break;
+    if (op->ch1 >= 0)
+        cost += xmlXPathEstimateCost(comp, &comp->steps[op->ch1], depth + 1);
+    if (op->ch2 >= 0)
+        cost += xmlXPathEstimateCost(comp, &comp->steps[op->ch2], depth + 1);
 
-		if (ret < 0) {
-		    xmlXPathPErrMemory(pctxt);
-		} else if (ret == 1) {
-		    if (toBool)
-			goto return_1;
-		    if (xmlXPathNodeSetAddUnique((*resultSeq)->nodesetval,
-                                                 cur) < 0)
-                        xmlXPathPErrMemory(pctxt);
-		}
-		if ((cur->children == NULL) || (depth >= max_depth)) {
-		    ret = xmlStreamPop(patstream);
-		    while (cur->next != NULL) {
-			cur = cur->next;
-			if ((cur->type != XML_ENTITY_DECL) &&
-			    (cur->type != XML_DTD_NODE))
-			    goto next_node;
-		    }
-		}
-	    default:
-		break;
-	}
+    return((cost > XPATH_MAX_COST) ? XPATH_MAX_COST : cost);
+}
 
-scan_children:
-	if (cur->type == XML_NAMESPACE_DECL) break;
-	if ((cur->children != NULL) && (depth < max_depth)) {
-	    /*
-	     * Do not descend on entities declarations
-	     */
-	    if (cur->children->type != XML_ENTITY_DECL) {
-		cur = cur->children;
-		depth++;
-		/*
-		 * Skip DTDs
-		 */
-		if (cur->type != XML_DTD_NODE)
-		    continue;
-	    }
-	}
+#define XPATH_MAX_REORDER 16
 
-	if (cur == limit)
-	    break;
+/*
+ * Sort the operands of a chain of "and" operators by estimated cost,
+ * so that cheap tests run first and the expensive ones are skipped
+ * when a cheap test fails.
+ */
+static void
+xmlXPathReorderAnd(xmlXPathCompExprPtr comp, xmlXPathStepOpPtr op) {
+    xmlXPathStepOpPtr chain[XPATH_MAX_REORDER];
+    int operands[XPATH_MAX_REORDER + 1];
+    int costs[XPATH_MAX_REORDER + 1];
+    int nbChain = 0, nbOperands, i, j;
+
+    /* "a and b and c" is parsed as "(a and b) and c" */
+    while (op->op == XPATH_OP_AND) {
+        if ((nbChain >= XPATH_MAX_REORDER) || (op->ch1 < 0) || (op->ch2 < 0))
+            return;
+        chain[nbChain++] = op;
+        op = &comp->steps[op->ch1];
+    }
 
-	while (cur->next != NULL) {
-	    cur = cur->next;
-	    if ((cur->type != XML_ENTITY_DECL) &&
-		(cur->type != XML_DTD_NODE))
-		goto next_node;
-	}
+    nbOperands = 0;
+    operands[nbOperands++] = chain[nbChain - 1]->ch1;
+    for (i = nbChain - 1; i >= 0; i--)
+        operands[nbOperands++] = chain[i]->ch2;
 
-	do {
-	    cur = cur->parent;
-	    depth--;
-	    if ((cur == NULL) || (cur == limit) ||
-                (cur->type == XML_DOCUMENT_NODE))
-	        goto done;
-	    if (cur->type == XML_ELEMENT_NODE) {
-		ret = xmlStreamPop(patstream);
-	    } else if ((eval_all_nodes) &&
-		((cur->type == XML_TEXT_NODE) ||
-		 (cur->type == XML_CDATA_SECTION_NODE) ||
-		 (cur->type == XML_COMMENT_NODE) ||
-		 (cur->type == XML_PI_NODE)))
-	    {
-		ret = xmlStreamPop(patstream);
-	    }
-	    if (cur->next != NULL) {
-		cur = cur->next;
-		break;
-	    }
-	} while (cur != NULL);
+    for (i = 0; i < nbOperands; i++) {
+        xmlXPathStepOpPtr operand = &comp->steps[operands[i]];
 
-    } while ((cur != NULL) && (depth >= 0));
+        if (!xmlXPathCannotFail(comp, operand, 0, 0))
+            return;
+        costs[i] = xmlXPathEstimateCost(comp, operand, 0);
+    }
 
-done:
+    /* Stable insertion sort */
+    for (i = 1; i < nbOperands; i++) {
+        int operand = operands[i], cost = costs[i];
 
-    if (patstream)
-	xmlFreeStreamCtxt(patstream);
-    return(0);
+        for (j = i; (j > 0) && (costs[j - 1] > cost); j--) {
+            operands[j] = operands[j - 1];
+            costs[j] = costs[j - 1];
+        }
+        operands[j] = operand;
+        costs[j] = cost;
+    }
 
-return_1:
-    if (patstream)
-	xmlFreeStreamCtxt(patstream);
-    return(1);
+    chain[nbChain - 1]->ch1 = operands[0];
+    for (i = nbChain - 1, j = 1; i >= 0; i--, j++)
+        chain[i]->ch2 = operands[j];
 }
-#endif /* XPATH_STREAMING */
 
-/**
- * Evaluate the Precompiled XPath expression in the given context.
- *
- * @param ctxt  the XPath parser context with the compiled expression
- * @param toBool  evaluate to a boolean result
+/*
+ * Sort adjacent predicates of a step by estimated cost if they don't
+ * depend on the position. The innermost predicate is applied first.
  */
-static int
-xmlXPathRunEval(xmlXPathParserContextPtr ctxt, int toBool)
-{
-    xmlXPathCompExprPtr comp;
-    int oldDepth;
-
-    if ((ctxt == NULL) || (ctxt->comp == NULL))
-	return(-1);
+static void
+xmlXPathReorderPredicates(xmlXPathCompExprPtr comp, xmlXPathStepOpPtr op) {
+    xmlXPathStepOpPtr preds[XPATH_MAX_REORDER];
+    int costs[XPATH_MAX_REORDER];
+    int movable[XPATH_MAX_REORDER];
+    int nbPreds = 0, i, swapped;
+
+    /* The outermost predicate comes first */
+    op = &comp->steps[op->ch2];
+    while (1) {
+        if ((op->op != XPATH_OP_PREDICATE) || (op->ch2 < 0) ||
+            (nbPreds >= XPATH_MAX_REORDER))
+            return;
+        preds[nbPreds++] = op;
+        if (op->ch1 < 0)
+            break;
+        op = &comp->steps[op->ch1];
+    }
+    if (nbPreds < 2)
+        return;
 
-    if (ctxt->valueTab == NULL) {
-#ifdef FUZZING_BUILD_MODE_UNSAFE_FOR_PRODUCTION
-        int valueMax = 1;
-#else
-        int valueMax = 10;
-#endif
+    for (i = 0; i < nbPreds; i++) {
+        xmlXPathStepOpPtr exprOp = &comp->steps[preds[i]->ch2];
 
-	/* Allocate the value stack */
-	ctxt->valueTab = xmlMalloc(valueMax * sizeof(xmlXPathObjectPtr));
-	if (ctxt->valueTab == NULL) {
-	    xmlXPathPErrMemory(ctxt);
-	    return(-1);
-	}
-	ctxt->valueNr = 0;
-	ctxt->valueMax = valueMax;
-	ctxt->value = NULL;
+        movable[i] = (xmlXPathPredicateIgnoresPosition(comp, exprOp)) &&
+                     (xmlXPathCannotFail(comp, exprOp, 0, 0));
+        costs[i] = xmlXPathEstimateCost(comp, exprOp, 0);
     }
-#ifdef XPATH_STREAMING
-    if (ctxt->comp->stream) {
-	int res;
 
-	if (toBool) {
-	    /*
-	    * Evaluation to boolean result.
-	    */
-	    res = xmlXPathRunStreamEval(ctxt, ctxt->comp->stream, NULL, 1);
-	    if (res != -1)
-		return(res);
-	} else {
-	    xmlXPathObjectPtr resObj = NULL;
+    do {
+        swapped = 0;
+        /* preds[i + 1] is applied before preds[i] */
+        for (i = 0; i < nbPreds - 1; i++) {
+            if ((movable[i]) && (movable[i + 1]) &&
+                (costs[i] < costs[i + 1])) {
+                int tmp = preds[i]->ch2;
+
+                preds[i]->ch2 = preds[i + 1]->ch2;
+                preds[i + 1]->ch2 = tmp;
+                tmp = costs[i];
+                costs[i] = costs[i + 1];
+                costs[i + 1] = tmp;
+                swapped = 1;
+            }
+        }
+    } while (swapped);
+}
+
+/*
+ * Merge the node test of "self::T" into the node test of a step.
+ * Returns 1 if the step must use the test of
+ * `self`, 2 if the test of the step already implies `self`, 0 if the
+ * tests can't be merged.
+ */
+static int
+xmlXPathMergeNodeTest(xmlXPathStepOpPtr op, xmlXPathStepOpPtr self) {
+    xmlXPathTestVal test = op->value2, selfTest = self->value2;
+
+    if ((selfTest == NODE_TEST_TYPE) && (self->value3 == NODE_TYPE_NODE))
+        return(2);
+    if (((xmlXPathAxisVal) op->value == AXIS_ATTRIBUTE) ||
+        ((xmlXPathAxisVal) op->value == AXIS_NAMESPACE))
+        return(0);
+    if ((test == NODE_TEST_TYPE) && (op->value3 == NODE_TYPE_NODE))
+        return(1);
+
+    /* "*" and "p:*" select elements of the principal node type */
+    if ((test == NODE_TEST_ALL) &&
+        ((selfTest == NODE_TEST_NAME) || (selfTest == NODE_TEST_ALL)) &&
+        ((op->value4 == NULL) || (xmlStrEqual(op->value4, self->value4))))
+        return(1);
+    if ((selfTest == NODE_TEST_ALL) && (test == NODE_TEST_NAME) &&
+        ((self->value4 == NULL) || (xmlStrEqual(op->value4, self->value4))))
+        return(2);
 
-	    /*
-	    * Evaluation to a sequence.
-	    */
-	    res = xmlXPathRunStreamEval(ctxt, ctxt->comp->stream, &resObj, 0);
+    if ((test == selfTest) && (op->value3 == self->value3) &&
+        (xmlStrEqual(op->value4, self->value4)) &&
+        (xmlStrEqual(op->value5, self->value5)))
+        return(2);
 
-	    if ((res != -1) && (resObj != NULL)) {
-		xmlXPathValuePush(ctxt, resObj);
-		return(0);
-	    }
-	    if (resObj != NULL)
-		xmlXPathReleaseObject(ctxt->context, resObj);
-	}
-	/*
-	* QUESTION TODO: This falls back to normal XPath evaluation
-	* if res == -1. Is this intended?
-	*/
-    }
-#endif
-    comp = ctxt->comp;
-    if (comp->last < 0) {
-        xmlXPathErr(ctxt, XPATH_STACK_ERROR);
-	return(-1);
+    return(0);
+}
+
+/*
+ * Copy the node test of `from` to `op`.
+ */
+static int
+xmlXPathCopyNodeTest(xmlXPathCompExprPtr comp, xmlXPathStepOpPtr op,
+                     xmlXPathStepOpPtr from) {
+    xmlChar *prefix = from->value4, *name = from->value5;
+
+    if (comp->dict == NULL) {
+        if (prefix != NULL) {
+            prefix = xmlStrdup(prefix);
+            if (prefix == NULL)
+                return(-1);
+        }
+        if (name != NULL) {
+            name = xmlStrdup(name);
+            if (name == NULL) {
+                xmlFree(prefix);
+                return(-1);
+            }
+        }
+        xmlFree(op->value4);
+        xmlFree(op->value5);
     }
-    oldDepth = ctxt->context->depth;
-    if (toBool)
-	return(xmlXPathCompOpEvalToBoolean(ctxt,
-	    &comp->steps[comp->last], 0));
-    else
-	xmlXPathCompOpEval(ctxt, &comp->steps[comp->last]);
-    ctxt->context->depth = oldDepth;
 
+    op->value2 = from->value2;
+    op->value3 = from->value3;
+    op->value4 = prefix;
+    op->value5 = name;
     return(0);
 }
 
-/************************************************************************
- *									*
- *			Public interfaces				*
- *									*
- ************************************************************************/
+/*
+ * Check whether an op is a "self::T" step without predicates on the
+ * context node.
+ */
+static int
+xmlXPathIsSelfTest(xmlXPathCompExprPtr comp, xmlXPathStepOpPtr op) {
+    xmlXPathStepOpPtr ctxtOp;
 
-/**
- * Evaluate a predicate result for the current node.
- * A PredicateExpr is evaluated by evaluating the Expr and converting
- * the result to a boolean. If the result is a number, the result will
- * be converted to true if the number is equal to the position of the
- * context node in the context node list (as returned by the position
- * function) and will be converted to false otherwise; if the result
- * is not a number, then the result will be converted as if by a call
- * to the boolean function.
- *
- * @param ctxt  the XPath context
- * @param res  the Predicate Expression evaluation result
- * @returns 1 if predicate is true, 0 otherwise
+    if ((op->op != XPATH_OP_COLLECT) ||
+        ((xmlXPathAxisVal) op->value != AXIS_SELF) ||
+        (op->ch1 < 0) || (op->ch2 >= 0))
+        return(0);
+    ctxtOp = &comp->steps[op->ch1];
+    return((ctxtOp->op == XPATH_OP_NODE) &&
+           (ctxtOp->ch1 < 0) && (ctxtOp->ch2 < 0));
+}
+
+/*
+ * Move a leading "[self::T]" predicate into the node test of a step.
+ * "node()[self::a]" becomes "a" and "*[self::node()][1]" becomes
+ * "*[1]". Other predicates still see the same node list.
  */
-int
-xmlXPathEvalPredicate(xmlXPathContext *ctxt, xmlXPathObject *res) {
-    if ((ctxt == NULL) || (res == NULL)) return(0);
-    switch (res->type) {
-        case XPATH_BOOLEAN:
-	    return(res->boolval);
-        case XPATH_NUMBER:
-	    return(res->floatval == ctxt->proximityPosition);
-        case XPATH_NODESET:
-        case XPATH_XSLT_TREE:
-	    if (res->nodesetval == NULL)
-		return(0);
-	    return(res->nodesetval->nodeNr != 0);
-        case XPATH_STRING:
-	    return((res->stringval != NULL) &&
-	           (xmlStrlen(res->stringval) != 0));
-        default:
-	    break;
+static void
+xmlXPathHoistSelfPredicates(xmlXPathCompExprPtr comp, xmlXPathStepOpPtr op) {
+    while (op->ch2 >= 0) {
+        xmlXPathStepOpPtr pred, outer = NULL, self;
+        int res;
+
+        /* Find the innermost predicate */
+        pred = &comp->steps[op->ch2];
+        while ((pred->op == XPATH_OP_PREDICATE) && (pred->ch1 >= 0)) {
+            outer = pred;
+            pred = &comp->steps[pred->ch1];
+        }
+        if ((pred->op != XPATH_OP_PREDICATE) || (pred->ch2 < 0))
+            return;
+
+        self = &comp->steps[pred->ch2];
+        if (!xmlXPathIsSelfTest(comp, self))
+            return;
+        res = xmlXPathMergeNodeTest(op, self);
+        if (res == 0)
+            return;
+        if ((res == 1) && (xmlXPathCopyNodeTest(comp, op, self) < 0))
+            return;
+
+        if (outer == NULL)
+            op->ch2 = -1;
+        else
+            outer->ch1 = -1;
     }
-    return(0);
 }
 
-/**
- * Evaluate a predicate result for the current node.
- * A PredicateExpr is evaluated by evaluating the Expr and converting
- * the result to a boolean. If the result is a number, the result will
- * be converted to true if the number is equal to the position of the
- * context node in the context node list (as returned by the position
- * function) and will be converted to false otherwise; if the result
- * is not a number, then the result will be converted as if by a call
- * to the boolean function.
- *
- * @param ctxt  the XPath Parser context
- * @param res  the Predicate Expression evaluation result
- * @returns 1 if predicate is true, 0 otherwise
+/*
+ * Fuse a "self::T" step without predicates into the preceding step.
+ * "x/self::node()" becomes "x" and "*[@a]/self::b" becomes "b[@a]".
+ * The preceding step's predicates must ignore the position unless
+ * the self step doesn't filter. Returns 1 if the steps were fused.
  */
-int
-xmlXPathEvaluatePredicateResult(xmlXPathParserContext *ctxt,
-                                xmlXPathObject *res) {
-    if ((ctxt == NULL) || (res == NULL)) return(0);
-    switch (res->type) {
-        case XPATH_BOOLEAN:
-	    return(res->boolval);
-        case XPATH_NUMBER:
-#if defined(__BORLANDC__) || (defined(_MSC_VER) && (_MSC_VER == 1200))
-	    return((res->floatval == ctxt->context->proximityPosition) &&
-	           (!xmlXPathIsNaN(res->floatval))); /* MSC pbm Mark Vakoc !*/
-#else
-	    return(res->floatval == ctxt->context->proximityPosition);
-#endif
-        case XPATH_NODESET:
-        case XPATH_XSLT_TREE:
-	    if (res->nodesetval == NULL)
-		return(0);
-	    return(res->nodesetval->nodeNr != 0);
-        case XPATH_STRING:
-	    return((res->stringval != NULL) && (res->stringval[0] != 0));
-        default:
-	    break;
-    }
-    return(0);
+static int
+xmlXPathFuseSelfStep(xmlXPathCompExprPtr comp, xmlXPathStepOpPtr op) {
+    xmlXPathStepOpPtr prev;
+    int res;
+
+    if ((op->op != XPATH_OP_COLLECT) ||
+        ((xmlXPathAxisVal) op->value != AXIS_SELF) ||
+        (op->ch1 < 0) || (op->ch2 >= 0))
+        return(0);
+    prev = &comp->steps[op->ch1];
+    if (prev->op != XPATH_OP_COLLECT)
+        return(0);
+
+    if ((op->value2 == NODE_TEST_TYPE) && (op->value3 == NODE_TYPE_NODE)) {
+        res = 2;
+    } else {
+        if ((prev->ch2 >= 0) &&
+            (!xmlXPathPredicatesIgnorePosition(comp,
+                                               &comp->steps[prev->ch2])))
+            return(0);
+        res = xmlXPathMergeNodeTest(prev, op);
+        if (res == 0)
+            return(0);
+    }
+    if ((res == 2) && (xmlXPathCopyNodeTest(comp, op, prev) < 0))
+        return(0);
+
+    op->value = prev->value;
+    op->ch1 = prev->ch1;
+    op->ch2 = prev->ch2;
+    return(1);
 }
 
-#ifdef XPATH_STREAMING
-/**
- * Try to compile the XPath expression as a streamable subset.
- *
- * @param ctxt  an XPath context
- * @param str  the XPath expression
- * @returns the compiled expression or NULL if failed to compile.
+/*
+ * Properties of the node-set selected by a location path
  */
-static xmlXPathCompExprPtr
-xmlXPathTryStreamCompile(xmlXPathContextPtr ctxt, const xmlChar *str) {
-    /*
-     * Optimization: use streaming patterns when the XPath expression can
-     * be compiled to a stream lookup
-     */
-    xmlPatternPtr stream;
-    xmlXPathCompExprPtr comp;
-    xmlDictPtr dict = NULL;
-    const xmlChar **namespaces = NULL;
-    xmlNsPtr ns;
-    int i, j;
+/* The nodes are distinct and in document order */
+#define XP_PLAN_ORDERED     (1 << 0)
+/* No node is an ancestor of another node */
+#define XP_PLAN_FLAT        (1 << 1)
 
-    if ((!xmlStrchr(str, '[')) && (!xmlStrchr(str, '(')) &&
-        (!xmlStrchr(str, '@'))) {
-	const xmlChar *tmp;
-        int res;
+/*
+ * Find steps whose results for different context nodes can't
+ * overlap. Returns the XP_PLAN_* properties of the result of `op`.
+ *
+ * The child axis of a flat set in document order yields a flat set
+ * in document order. The descendant axes of such a set don't
+ * overlap. For a set that isn't flat, a descendant step only has to
+ * visit the outermost context nodes, unless its predicates use the
+ * position.
+ */
+static int
+xmlXPathPlanExpression(xmlXPathCompExprPtr comp, xmlXPathStepOpPtr op,
+                       int depth) {
+    int in = 0;
 
-	/*
-	 * We don't try to handle expressions using the verbose axis
-	 * specifiers ("::"), just the simplified form at this point.
-	 * Additionally, if there is no list of namespaces available and
-	 *  there's a ":" in the expression, indicating a prefixed QName,
-	 *  then we won't try to compile either. xmlPatterncompile() needs
-	 *  to have a list of namespaces at compilation time in order to
-	 *  compile prefixed name tests.
-	 */
-	tmp = xmlStrchr(str, ':');
-	if ((tmp != NULL) &&
-	    ((ctxt == NULL) || (ctxt->nsNr == 0) || (tmp[1] == ':')))
-	    return(NULL);
+    /* OP_VALUE has invalid ch1. */
+    if ((op->op == XPATH_OP_VALUE) || (depth > XPATH_MAX_RECURSION_DEPTH))
+        return(0);
 
-	if (ctxt != NULL) {
-	    dict = ctxt->dict;
-	    if (ctxt->nsNr > 0) {
-		namespaces = xmlMalloc(2 * (ctxt->nsNr + 1) * sizeof(xmlChar*));
-		if (namespaces == NULL) {
-		    xmlXPathErrMemory(ctxt);
-		    return(NULL);
-		}
-		for (i = 0, j = 0; (j < ctxt->nsNr); j++) {
-		    ns = ctxt->namespaces[j];
-		    namespaces[i++] = ns->href;
-		    namespaces[i++] = ns->prefix;
-		}
-		namespaces[i++] = NULL;
-		namespaces[i] = NULL;
-	    }
-	}
+    if (op->ch1 >= 0)
+        in = xmlXPathPlanExpression(comp, &comp->steps[op->ch1], depth + 1);
+    if (op->ch2 >= 0)
+        xmlXPathPlanExpression(comp, &comp->steps[op->ch2], depth + 1);
 
-	res = xmlPatternCompileSafe(str, dict, XML_PATTERN_XPATH, namespaces,
-                                    &stream);
-	if (namespaces != NULL) {
-	    xmlFree((xmlChar **)namespaces);
-	}
-        if (res < 0) {
-            xmlXPathErrMemory(ctxt);
-            return(NULL);
-        }
-	if ((stream != NULL) && (xmlPatternStreamable(stream) == 1)) {
-	    comp = xmlXPathNewCompExpr();
-	    if (comp == NULL) {
-		xmlXPathErrMemory(ctxt);
-	        xmlFreePattern(stream);
-		return(NULL);
-	    }
-	    comp->stream = stream;
-	    comp->dict = dict;
-	    if (comp->dict)
-		xmlDictReference(comp->dict);
-	    return(comp);
-	}
-	xmlFreePattern(stream);
+    switch (op->op) {
+        case XPATH_OP_ROOT:
+        case XPATH_OP_NODE:
+            return(XP_PLAN_ORDERED | XP_PLAN_FLAT);
+        case XPATH_OP_SORT:
+            return(in);
+        case XPATH_OP_COLLECT:
+            break;
+        default:
+            return(0);
     }
-    return(NULL);
+
+    if (op->ch1 < 0)
+        return(0);
+
+    switch ((xmlXPathAxisVal) op->value) {
+        case AXIS_SELF:
+            return(in);
+        case AXIS_ATTRIBUTE:
+            if (in & XP_PLAN_ORDERED)
+                return(XP_PLAN_ORDERED | XP_PLAN_FLAT);
+            break;
+        case AXIS_CHILD:
+            if (in == (XP_PLAN_ORDERED | XP_PLAN_FLAT))
+                return(in);
+            break;
+        case AXIS_DESCENDANT:
+        case AXIS_DESCENDANT_OR_SELF:
+            if (in == (XP_PLAN_ORDERED | XP_PLAN_FLAT)) {
+                op->flags |= XP_STEP_NO_DUPS;
+                return(XP_PLAN_ORDERED);
+            }
+            if ((in & XP_PLAN_ORDERED) &&
+                ((op->ch2 < 0) ||
+                 (xmlXPathPredicatesIgnorePosition(comp,
+                                                   &comp->steps[op->ch2])))) {
+                op->flags |= XP_STEP_NO_DUPS | XP_STEP_PRUNE;
+                return(XP_PLAN_ORDERED);
+            }
+            break;
+        default:
+            break;
+    }
+
+    return(0);
 }
-#endif /* XPATH_STREAMING */
 
 static void
 xmlXPathOptimizeExpression(xmlXPathParserContextPtr pctxt,
@@ -11709,14 +16481,26 @@ xmlXPathOptimizeExpression(xmlXPathParserContextPtr pctxt,
     xmlXPathCompExprPtr comp = pctxt->comp;
     xmlXPathContextPtr ctxt;
 
+    if (op->op == XPATH_OP_COLLECT) {
+        xmlXPathHoistSelfPredicates(comp, op);
+        while (xmlXPathFuseSelfStep(comp, op))
+            ;
+        if (op->ch2 >= 0)
+            xmlXPathReorderPredicates(comp, op);
+    } else if (op->op == XPATH_OP_AND) {
+        xmlXPathReorderAnd(comp, op);
+    }
+
     /*
     * Try to rewrite "descendant-or-self::node()/foo" to an optimized
-    * internal representation.
+    * internal representation. This also works if foo has predicates
+    * which don't depend on the position.
     */
 
     if ((op->op == XPATH_OP_COLLECT /* 11 */) &&
         (op->ch1 != -1) &&
-        (op->ch2 == -1 /* no predicate */))
+        ((op->ch2 == -1 /* no predicate */) ||
+         (xmlXPathPredicatesIgnorePosition(comp, &comp->steps[op->ch2]))))
     {
         xmlXPathStepOpPtr prevop = &comp->steps[op->ch1];
 
@@ -11778,6 +16562,29 @@ xmlXPathOptimizeExpression(xmlXPathParserContextPtr pctxt,
         ctxt->depth -= 1;
 }
 
+/*
+ * Rewrite a compiled expression: fold constants, simplify and reorder
+ * steps and predicates, then plan the evaluation of location paths.
+ */
+static void
+xmlXPathRewriteCompExpr(xmlXPathParserContextPtr pctxt) {
+    xmlXPathCompExprPtr comp = pctxt->comp;
+    xmlXPathContextPtr ctxt = pctxt->context;
+    int oldDepth = 0;
+
+    if ((comp->nbStep <= 1) || (comp->last < 0))
+        return;
+
+    if (ctxt != NULL)
+        oldDepth = ctxt->depth;
+    if (ctxt != NULL)
+        xmlXPathFoldConstants(pctxt, &comp->steps[comp->last], 0);
+    xmlXPathOptimizeExpression(pctxt, &comp->steps[comp->last]);
+    xmlXPathPlanExpression(comp, &comp->steps[comp->last], 0);
+    if (ctxt != NULL)
+        ctxt->depth = oldDepth;
+}
+
 /**
  * Compile an XPath expression
  *
@@ -11844,13 +16651,7 @@ xmlXPathCtxtCompile(xmlXPathContext *ctxt, const xmlChar *str) {
 	comp = NULL;
     } else {
 	comp = pctxt->comp;
-	if ((comp->nbStep > 1) && (comp->last >= 0)) {
-            if (ctxt != NULL)
-                oldDepth = ctxt->depth;
-	    xmlXPathOptimizeExpression(pctxt, &comp->steps[comp->last]);
-            if (ctxt != NULL)
-                ctxt->depth = oldDepth;
-	}
+        xmlXPathRewriteCompExpr(pctxt);
 	pctxt->comp = NULL;
     }
     xmlXPathFreeParserContext(pctxt);
@@ -11859,6 +16660,7 @@ xmlXPathCtxtCompile(xmlXPathContext *ctxt, const xmlChar *str) {
 
     if (comp != NULL) {
 	comp->expr = xmlStrdup(str);
+        xmlXPathCompSetCacheInfo(comp);
     }
     return(comp);
 }
@@ -11894,6 +16696,8 @@ xmlXPathCompiledEvalInternal(xmlXPathCompExprPtr comp,
 {
     xmlXPathParserContextPtr pctxt;
     xmlXPathObjectPtr resObj = NULL;
+    xmlXPathResultCacheEntry key;
+    int cacheable = 0;
     int res;
 
     if (comp == NULL)
@@ -11902,6 +16706,27 @@ xmlXPathCompiledEvalInternal(xmlXPathCompExprPtr comp,
 
     xmlResetError(&ctxt->lastError);
 
+    if (ctxt->resultCache != NULL) {
+        cacheable = xmlXPathResultCacheKey(comp, ctxt, &key);
+        if (cacheable) {
+            xmlXPathObjectPtr cached;
+
+            cached = xmlXPathResultCacheLookup(ctxt->resultCache, &key);
+            if (cached != NULL) {
+                if (toBool)
+                    return(xmlXPathCastToBoolean(cached));
+                resObj = xmlXPathObjectCopy(cached);
+                if (resObj != NULL) {
+                    if (resObjPtr)
+                        *resObjPtr = resObj;
+                    else
+                        xmlXPathFreeObject(resObj);
+                    return(0);
+                }
+            }
+        }
+    }
+
     pctxt = xmlXPathCompParserContext(comp, ctxt);
     if (pctxt == NULL)
         return(-1);
@@ -11914,6 +16739,9 @@ xmlXPathCompiledEvalInternal(xmlXPathCompExprPtr comp,
             resObj = xmlXPathValuePop(pctxt);
     }
 
+    if ((cacheable) && (resObj != NULL))
+        xmlXPathResultCacheStore(ctxt->resultCache, &key, resObj);
+
     if (resObjPtr)
         *resObjPtr = resObj;
     else
@@ -11958,6 +16786,654 @@ xmlXPathCompiledEvalToBoolean(xmlXPathCompExpr *comp,
     return(xmlXPathCompiledEvalInternal(comp, ctxt, NULL, 1));
 }
 
+/************************************************************************
+ *									*
+ *		Evaluation of multiple expressions			*
+ *									*
+ ************************************************************************/
+
+#define XPATH_MULTI_MAX_STEPS 16
+
+/*
+ * A location path without predicates using only the child, descendant,
+ * descendant-or-self, self and attribute axes. Such paths can be
+ * tested against single nodes by matching the steps backwards along
+ * the ancestors.
+ */
+typedef struct _xmlXPathMultiPath xmlXPathMultiPath;
+struct _xmlXPathMultiPath {
+    /* next path with the same dispatch key */
+    xmlXPathMultiPath *next;
+    /* index of the expression */
+    int expr;
+    int nbSteps;
+    xmlNodePtr start;
+    xmlXPathStepOpPtr steps[XPATH_MULTI_MAX_STEPS];
+    const xmlChar *URIs[XPATH_MULTI_MAX_STEPS];
+};
+
+typedef struct {
+    xmlXPathContextPtr ctxt;
+    xmlXPathMultiPath *paths;
+    int nbPaths;
+    int maxPaths;
+    /* paths selecting elements by name */
+    xmlHashTablePtr elemNames;
+    /* paths selecting attributes by name */
+    xmlHashTablePtr attrNames;
+    /* paths selecting any element or attribute */
+    xmlXPathMultiPath *anyElem;
+    xmlXPathMultiPath *anyAttr;
+    /* paths selecting text, comments or processing instructions */
+    xmlXPathMultiPath *anyOther;
+    /* paths selecting nodes of any type except attributes */
+    xmlXPathMultiPath *anyNode;
+    /* results by expression */
+    xmlNodeSetPtr *sets;
+    /* the current node and its ancestors, starting with the document */
+    xmlNodePtr *ancestors;
+    int maxDepth;
+    /* failed matches of (ancestor, step) pairs, see xmlXPathMultiMatch */
+    unsigned *failed;
+    unsigned stamp;
+} xmlXPathMulti;
+
+/**
+ * Add the location paths of an expression to the set of paths
+ * evaluated together.
+ *
+ * @param multi  the evaluation state
+ * @param comp  the compiled expression
+ * @param op  the current op
+ * @param expr  index of the expression
+ * @param depth  recursion depth
+ * @returns 1 if the paths were added, 0 if the expression isn't
+ * supported, -1 if a memory allocation failed.
+ */
+static int
+xmlXPathMultiAddPaths(xmlXPathMulti *multi, xmlXPathCompExprPtr comp,
+                      xmlXPathStepOpPtr op, int expr, int depth) {
+    xmlXPathContextPtr ctxt = multi->ctxt;
+    xmlXPathMultiPath *path;
+    xmlXPathStepOpPtr ops[XPATH_MULTI_MAX_STEPS];
+    int i, n = 0, res;
+
+    if (depth > 50)
+        return(0);
+
+    while ((op->op == XPATH_OP_SORT) && (op->ch1 != -1))
+        op = &comp->steps[op->ch1];
+
+    if (op->op == XPATH_OP_UNION) {
+        if ((op->ch1 == -1) || (op->ch2 == -1))
+            return(0);
+        res = xmlXPathMultiAddPaths(multi, comp, &comp->steps[op->ch1],
+                                    expr, depth + 1);
+        if (res <= 0)
+            return(res);
+        return(xmlXPathMultiAddPaths(multi, comp, &comp->steps[op->ch2],
+                                     expr, depth + 1));
+    }
+
+    while (op->op == XPATH_OP_COLLECT) {
+        if ((n >= XPATH_MULTI_MAX_STEPS) || (op->ch1 == -1) ||
+            (op->ch2 != -1))
+            return(0);
+        ops[n++] = op;
+        op = &comp->steps[op->ch1];
+    }
+    if ((n == 0) || (op->ch1 != -1) || (op->ch2 != -1))
+        return(0);
+
+    if (multi->nbPaths >= multi->maxPaths) {
+        xmlXPathMultiPath *tmp;
+        int newSize;
+
+        newSize = xmlGrowCapacity(multi->maxPaths, sizeof(tmp[0]),
+                                  16, XPATH_MAX_STEPS);
+        if (newSize < 0)
+            return(-1);
+        tmp = xmlRealloc(multi->paths, newSize * sizeof(tmp[0]));
+        if (tmp == NULL)
+            return(-1);
+        multi->paths = tmp;
+        multi->maxPaths = newSize;
+    }
+    path = &multi->paths[multi->nbPaths];
+    path->next = NULL;
+    path->expr = expr;
+    path->nbSteps = n;
+
+    if (op->op == XPATH_OP_ROOT)
+        path->start = (xmlNodePtr) ctxt->doc;
+    else if (op->op == XPATH_OP_NODE)
+        path->start = ctxt->node;
+    else
+        return(0);
+
+    for (i = 0; i < n; i++) {
+        /* The chain is stored from the last step */
+        op = ops[n - 1 - i];
+
+        switch ((xmlXPathAxisVal) op->value) {
+            case AXIS_CHILD:
+            case AXIS_DESCENDANT:
+            case AXIS_DESCENDANT_OR_SELF:
+            case AXIS_SELF:
+                break;
+            case AXIS_ATTRIBUTE:
+                if (i == n - 1)
+                    break;
+                return(0);
+            default:
+                return(0);
+        }
+        switch ((xmlXPathTestVal) op->value2) {
+            case NODE_TEST_TYPE:
+            case NODE_TEST_PI:
+            case NODE_TEST_ALL:
+            case NODE_TEST_NAME:
+                break;
+            default:
+                return(0);
+        }
+
+        path->steps[i] = op;
+        path->URIs[i] = NULL;
+        if (op->value4 != NULL) {
+            path->URIs[i] = xmlXPathNsLookup(ctxt, op->value4);
+            if (path->URIs[i] == NULL)
+                return(0);
+        }
+    }
+
+    multi->nbPaths += 1;
+    return(1);
+}
+
+/**
+ * Make room for `depth + 1` entries in the ancestor stack.
+ *
+ * @param multi  the evaluation state
+ * @param depth  the depth
+ * @returns 0 on success or -1 if a memory allocation failed.
+ */
+static int
+xmlXPathMultiGrowDepth(xmlXPathMulti *multi, int depth) {
+    xmlNodePtr *ancestors;
+    unsigned *failed;
+    int newSize;
+
+    if (depth < multi->maxDepth)
+        return(0);
+
+    newSize = xmlGrowCapacity(multi->maxDepth,
+                              sizeof(failed[0]) * XPATH_MULTI_MAX_STEPS,
+                              32, XML_MAX_ITEMS);
+    if (newSize < 0)
+        return(-1);
+    ancestors = xmlRealloc(multi->ancestors,
+                           newSize * sizeof(ancestors[0]));
+    if (ancestors == NULL)
+        return(-1);
+    multi->ancestors = ancestors;
+    failed = xmlRealloc(multi->failed,
+                        newSize * XPATH_MULTI_MAX_STEPS * sizeof(failed[0]));
+    if (failed == NULL)
+        return(-1);
+    memset(failed + multi->maxDepth * XPATH_MULTI_MAX_STEPS, 0,
+           (newSize - multi->maxDepth) * XPATH_MULTI_MAX_STEPS *
+           sizeof(failed[0]));
+    multi->failed = failed;
+    multi->maxDepth = newSize;
+
+    return(0);
+}
+
+/**
+ * Check whether an ancestor of the current node is selected by the
+ * first `k + 1` steps of a path.
+ *
+ * Failed matches are recorded for the current stamp, so every
+ * (ancestor, step) pair is only tested once. Otherwise, paths with
+ * several descendant steps would backtrack exponentially.
+ *
+ * @param multi  the evaluation state
+ * @param path  the path
+ * @param k  index of the last step
+ * @param i  index of the ancestor
+ * @returns 1 if the node is selected, 0 otherwise.
+ */
+static int
+xmlXPathMultiMatch(xmlXPathMulti *multi, xmlXPathMultiPath *path, int k,
+                   int i) {
+    xmlNodePtr node = multi->ancestors[i];
+    unsigned *failed;
+    xmlXPathStepOpPtr op;
+    int j, ret = 0;
+
+    if (k < 0)
+        return(node == path->start);
+
+    failed = &multi->failed[i * XPATH_MULTI_MAX_STEPS + k];
+    if (*failed == multi->stamp)
+        return(0);
+
+    op = path->steps[k];
+    if ((node->type == XML_ATTRIBUTE_NODE) !=
+        ((xmlXPathAxisVal) op->value == AXIS_ATTRIBUTE))
+        goto done;
+    if (!xmlXPathLazyTest(op, path->URIs[k], node))
+        goto done;
+
+    switch ((xmlXPathAxisVal) op->value) {
+        case AXIS_CHILD:
+        case AXIS_ATTRIBUTE:
+            ret = ((i > 0) && (xmlXPathMultiMatch(multi, path, k - 1, i - 1)));
+            break;
+        case AXIS_SELF:
+            ret = xmlXPathMultiMatch(multi, path, k - 1, i);
+            break;
+        case AXIS_DESCENDANT_OR_SELF:
+        case AXIS_DESCENDANT:
+            j = ((xmlXPathAxisVal) op->value == AXIS_DESCENDANT) ? i - 1 : i;
+            for (; j >= 0; j--) {
+                if (xmlXPathMultiMatch(multi, path, k - 1, j)) {
+                    ret = 1;
+                    break;
+                }
+            }
+            break;
+        default:
+            break;
+    }
+
+done:
+    if (!ret)
+        *failed = multi->stamp;
+    return(ret);
+}
+
+/**
+ * Add a node to the results of the paths in a list which select it.
+ *
+ * @param multi  the evaluation state
+ * @param path  the list of paths
+ * @param depth  index of the node in the ancestor stack
+ * @returns 0 on success or -1 if a memory allocation failed.
+ */
+static int
+xmlXPathMultiVisit(xmlXPathMulti *multi, xmlXPathMultiPath *path,
+                   int depth) {
+    xmlNodePtr node = multi->ancestors[depth];
+
+    for (; path != NULL; path = path->next) {
+        xmlNodeSetPtr set;
+
+        /* Start a new set of failed matches */
+        multi->stamp += 1;
+        if (multi->stamp == 0) {
+            memset(multi->failed, 0, multi->maxDepth *
+                   XPATH_MULTI_MAX_STEPS * sizeof(multi->failed[0]));
+            multi->stamp = 1;
+        }
+
+        if (!xmlXPathMultiMatch(multi, path, path->nbSteps - 1, depth))
+            continue;
+
+        /* Several paths of a union can select the same node */
+        set = multi->sets[path->expr];
+        if ((set->nodeNr > 0) && (set->nodeTab[set->nodeNr - 1] == node))
+            continue;
+        if (xmlXPathNodeSetAddUnique(set, node) < 0)
+            return(-1);
+    }
+
+    return(0);
+}
+
+/**
+ * Add a path to a hash table of lists.
+ *
+ * @param hash  the hash table
+ * @param name  the name
+ * @param URI  the namespace URI or NULL
+ * @param path  the path
+ * @returns 0 on success or -1 if a memory allocation failed.
+ */
+static int
+xmlXPathMultiAddToHash(xmlHashTablePtr hash, const xmlChar *name,
+                       const xmlChar *URI, xmlXPathMultiPath *path) {
+    path->next = xmlHashLookup2(hash, name, URI);
+    if (xmlHashUpdateEntry2(hash, name, URI, path, NULL) < 0)
+        return(-1);
+    return(0);
+}
+
+/**
+ * Build the tables which map nodes to the paths which can select them
+ * by looking at the last step.
+ *
+ * @param multi  the evaluation state
+ * @returns 0 on success or -1 if a memory allocation failed.
+ */
+static int
+xmlXPathMultiDispatch(xmlXPathMulti *multi) {
+    int i;
+
+    multi->elemNames = xmlHashCreate(0);
+    multi->attrNames = xmlHashCreate(0);
+    if ((multi->elemNames == NULL) || (multi->attrNames == NULL))
+        return(-1);
+
+    for (i = 0; i < multi->nbPaths; i++) {
+        xmlXPathMultiPath *path = &multi->paths[i];
+        xmlXPathStepOpPtr op = path->steps[path->nbSteps - 1];
+        const xmlChar *URI = path->URIs[path->nbSteps - 1];
+        int attr = ((xmlXPathAxisVal) op->value == AXIS_ATTRIBUTE);
+        xmlXPathMultiPath **list;
+
+        switch ((xmlXPathTestVal) op->value2) {
+            case NODE_TEST_NAME:
+                if (xmlXPathMultiAddToHash(attr ? multi->attrNames :
+                                                  multi->elemNames,
+                                           op->value5, URI, path) < 0)
+                    return(-1);
+                continue;
+            case NODE_TEST_ALL:
+                list = attr ? &multi->anyAttr : &multi->anyElem;
+                break;
+            case NODE_TEST_TYPE:
+                if ((xmlXPathTypeVal) op->value3 == NODE_TYPE_NODE)
+                    list = attr ? &multi->anyAttr : &multi->anyNode;
+                else
+                    list = &multi->anyOther;
+                break;
+            default:
+                list = &multi->anyOther;
+                break;
+        }
+        path->next = *list;
+        *list = path;
+    }
+
+    return(0);
+}
+
+/**
+ * Walk the document once and add every node to the results of the
+ * paths selecting it. Since nodes are visited in document order, the
+ * results are sorted.
+ *
+ * @param multi  the evaluation state
+ * @returns 0 on success or -1 if a memory allocation failed.
+ */
+static int
+xmlXPathMultiWalk(xmlXPathMulti *multi) {
+    xmlDocPtr doc = multi->ctxt->doc;
+    xmlNodePtr cur;
+    int depth = 0;
+    int wantAttrs, wantOther, lazyFlags = 0;
+
+    wantAttrs = ((multi->anyAttr != NULL) ||
+                 (xmlHashSize(multi->attrNames) > 0));
+    wantOther = ((multi->anyOther != NULL) || (multi->anyNode != NULL));
+    if (XML_LAZY_DOC(doc)) {
+        if (wantAttrs)
+            lazyFlags |= XML_LAZY_ATTRS;
+        if (wantOther)
+            lazyFlags |= XML_LAZY_CONTENT;
+    }
+
+    if (xmlXPathMultiGrowDepth(multi, depth) < 0)
+        return(-1);
+    multi->ancestors[depth] = (xmlNodePtr) doc;
+    if (xmlXPathMultiVisit(multi, multi->anyNode, depth) < 0)
+        return(-1);
+
+    cur = doc->children;
+    depth = 1;
+    while (cur != NULL) {
+        /* Leave room for an attribute */
+        if (xmlXPathMultiGrowDepth(multi, depth + 1) < 0)
+            return(-1);
+        multi->ancestors[depth] = cur;
+
+        switch (cur->type) {
+            case XML_ELEMENT_NODE: {
+                const xmlChar *URI = (cur->ns != NULL) ? cur->ns->href : NULL;
+                xmlAttrPtr attr;
+
+                if ((lazyFlags != 0) &&
+                    (xmlLazyMaterialize(cur, lazyFlags) < 0))
+                    return(-1);
+
+                if ((xmlXPathMultiVisit(multi,
+                        xmlHashLookup2(multi->elemNames, cur->name, URI),
+                        depth) < 0) ||
+                    (xmlXPathMultiVisit(multi, multi->anyElem, depth) < 0) ||
+                    (xmlXPathMultiVisit(multi, multi->anyNode, depth) < 0))
+                    return(-1);
+
+                if (wantAttrs) {
+                    for (attr = cur->properties; attr != NULL;
+                         attr = attr->next) {
+                        xmlNsPtr ns = attr->ns;
+
+                        multi->ancestors[depth + 1] = (xmlNodePtr) attr;
+
+                        /* See xmlXPathAttrNameMatch */
+                        if (((ns == NULL) || (ns->prefix == NULL)) &&
+                            (xmlXPathMultiVisit(multi,
+                                 xmlHashLookup2(multi->attrNames,
+                                                attr->name, NULL),
+                                 depth + 1) < 0))
+                            return(-1);
+                        if ((ns != NULL) &&
+                            (xmlXPathMultiVisit(multi,
+                                 xmlHashLookup2(multi->attrNames,
+                                                attr->name, ns->href),
+                                 depth + 1) < 0))
+                            return(-1);
+                        if (xmlXPathMultiVisit(multi, multi->anyAttr,
+                                               depth + 1) < 0)
+                            return(-1);
+                    }
+                }
+
+                if (cur->children != NULL) {
+                    cur = cur->children;
+                    depth += 1;
+                    continue;
+                }
+                break;
+            }
+
+            case XML_TEXT_NODE:
+            case XML_CDATA_SECTION_NODE:
+            case XML_COMMENT_NODE:
+            case XML_PI_NODE:
+                if ((wantOther) &&
+                    ((xmlXPathMultiVisit(multi, multi->anyOther,
+                                         depth) < 0) ||
+                     (xmlXPathMultiVisit(multi, multi->anyNode,
+                                         depth) < 0)))
+                    return(-1);
+                break;
+
+            default:
+                break;
+        }
+
+        while ((cur->next == NULL) && (cur->parent != NULL) &&
+               (cur->parent != (xmlNodePtr) doc)) {
+            cur = cur->parent;
+            depth -= 1;
+        }
+        cur = cur->next;
+    }
+
+    return(0);
+}
+
+/**
+ * Evaluate the supported expressions in a single pass.
+ *
+ * @param comps  the compiled expressions
+ * @param nbComps  the number of expressions
+ * @param ctxt  the XPath context
+ * @param results  array receiving the results
+ * @returns the number of expressions evaluated or -1 if a memory
+ * allocation failed.
+ */
+static int
+xmlXPathMultiEval(xmlXPathCompExprPtr *comps, int nbComps,
+                  xmlXPathContextPtr ctxt, xmlXPathObjectPtr *results) {
+    xmlXPathMulti multi;
+    xmlNodePtr cur;
+    int i, res, ret = -1, nbExprs = 0;
+    int nodeInDoc = 0;
+
+    if (ctxt->doc == NULL)
+        return(0);
+    /*
+     * Relative paths are only supported if the walk covers them.
+     * Attributes aren't always visited, so self and descendant-or-self
+     * steps couldn't select an attribute context node.
+     */
+    if ((ctxt->node != NULL) && (ctxt->node->type != XML_NAMESPACE_DECL) &&
+        (ctxt->node->type != XML_ATTRIBUTE_NODE)) {
+        for (cur = ctxt->node; cur->parent != NULL; cur = cur->parent)
+            ;
+        nodeInDoc = (cur == (xmlNodePtr) ctxt->doc);
+    }
+
+    memset(&multi, 0, sizeof(multi));
+    multi.ctxt = ctxt;
+    multi.sets = xmlMalloc(nbComps * sizeof(multi.sets[0]));
+    if (multi.sets == NULL)
+        goto error;
+    memset(multi.sets, 0, nbComps * sizeof(multi.sets[0]));
+
+    for (i = 0; i < nbComps; i++) {
+        xmlXPathCompExprPtr comp = comps[i];
+        int oldNbPaths = multi.nbPaths;
+        int j;
+
+        if ((comp == NULL) || (comp->last < 0))
+            continue;
+        res = xmlXPathMultiAddPaths(&multi, comp, &comp->steps[comp->last],
+                                    i, 0);
+        if (res < 0)
+            goto error;
+        for (j = oldNbPaths; (res > 0) && (j < multi.nbPaths); j++) {
+            if ((multi.paths[j].start == NULL) ||
+                ((multi.paths[j].start != (xmlNodePtr) ctxt->doc) &&
+                 (!nodeInDoc)))
+                res = 0;
+        }
+        if (res == 0) {
+            multi.nbPaths = oldNbPaths;
+            continue;
+        }
+
+        multi.sets[i] = xmlXPathNodeSetCreate(NULL);
+        if (multi.sets[i] == NULL)
+            goto error;
+        nbExprs += 1;
+    }
+
+    if (nbExprs > 0) {
+        if ((xmlXPathMultiDispatch(&multi) < 0) ||
+            (xmlXPathMultiWalk(&multi) < 0))
+            goto error;
+
+        for (i = 0; i < nbComps; i++) {
+            if (multi.sets[i] == NULL)
+                continue;
+            results[i] = xmlXPathWrapNodeSet(multi.sets[i]);
+            multi.sets[i] = NULL;
+            if (results[i] == NULL)
+                goto error;
+        }
+    }
+
+    ret = nbExprs;
+
+error:
+    if (ret < 0) {
+        for (i = 0; i < nbComps; i++) {
+            xmlXPathFreeObject(results[i]);
+            results[i] = NULL;
+        }
+    }
+    if (multi.sets != NULL) {
+        for (i = 0; i < nbComps; i++)
+            xmlXPathFreeNodeSet(multi.sets[i]);
+        xmlFree(multi.sets);
+    }
+    xmlHashFree(multi.elemNames, NULL);
+    xmlHashFree(multi.attrNames, NULL);
+    xmlFree(multi.paths);
+    xmlFree(multi.ancestors);
+    xmlFree(multi.failed);
+    return(ret);
+}
+
+/**
+ * Evaluate multiple compiled XPath expressions in the same context.
+ *
+ * Location paths without predicates which only use the child,
+ * descendant, descendant-or-self, self and attribute axes, as well
+ * as unions of such paths, are evaluated together in a single walk
+ * of the document. The other expressions are evaluated one after the
+ * other like with #xmlXPathCompiledEval. Relative paths are only
+ * evaluated in the shared walk if the context node is part of the
+ * context document and isn't an attribute.
+ *
+ * If the context has an operation limit, all expressions are
+ * evaluated separately.
+ *
+ * The caller has to free the results.
+ *
+ * @since 2.16.0
+ *
+ * @param comps  array of compiled XPath expressions
+ * @param nbComps  number of expressions
+ * @param ctxt  the XPath context
+ * @param results  array of `nbComps` entries receiving the results,
+ * an entry is set to NULL if the expression failed to evaluate
+ * @returns the number of expressions evaluated in the shared walk or
+ * -1 if the arguments are invalid.
+ */
+int
+xmlXPathCompiledEvalMany(xmlXPathCompExpr **comps, int nbComps,
+                         xmlXPathContext *ctxt, xmlXPathObject **results) {
+    int i, ret = 0;
+
+    if ((comps == NULL) || (nbComps < 0) || (ctxt == NULL) ||
+        (results == NULL))
+        return(-1);
+
+    xmlInitParser();
+
+    for (i = 0; i < nbComps; i++)
+        results[i] = NULL;
+
+    if ((ctxt->opLimit == 0) && (nbComps > 0)) {
+        ret = xmlXPathMultiEval(comps, nbComps, ctxt, results);
+        if (ret < 0)
+            ret = 0;
+    }
+
+    for (i = 0; i < nbComps; i++) {
+        if (results[i] == NULL)
+            results[i] = xmlXPathCompiledEval(comps[i], ctxt);
+    }
+
+    return(ret);
+}
+
 /**
  * Parse and evaluate an XPath expression in the given context,
  * then push the result on the context stack
@@ -12003,14 +17479,7 @@ xmlXPathEvalExpr(xmlXPathParserContext *ctxt) {
         if (*ctxt->cur != 0)
             XP_ERROR(XPATH_EXPR_ERROR);
 
-	if ((ctxt->comp->nbStep > 1) && (ctxt->comp->last >= 0)) {
-            if (ctxt->context != NULL)
-                oldDepth = ctxt->context->depth;
-	    xmlXPathOptimizeExpression(ctxt,
-		&ctxt->comp->steps[ctxt->comp->last]);
-            if (ctxt->context != NULL)
-                ctxt->context->depth = oldDepth;
-        }
+        xmlXPathRewriteCompExpr(ctxt);
     }
 
     xmlXPathRunEval(ctxt, 0);